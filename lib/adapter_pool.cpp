@@ -0,0 +1,240 @@
+#ifdef _WIN32
+#include "src/wireguard.h"
+#include "wireguard_tool.cpp"
+#else
+#include "selftest_compat.h"
+#endif
+#include "room_pipeline.cpp"
+#include "mutex"
+#include "condition_variable"
+#include "thread"
+#include "deque"
+#include "chrono"
+#include "string"
+
+#pragma once
+
+// 预创建适配器数量上限
+static constexpr size_t ADAPTER_POOL_LIMIT = 4;
+
+// 房间创建各阶段耗时(us)，调用方按 24 字节步长解析
+#pragma pack(push, 4)
+struct room_timing
+{
+    uint32_t adapter_us;   // 创建适配器或从池中取出
+    uint32_t config_us;    // 写入密钥与监听端口
+    uint32_t bind_us;      // 设置 IP 与路由
+    uint32_t trans_us;     // 注册广播转发
+    uint32_t total_us;
+    uint32_t pooled;       // 1 表示适配器来自预创建池
+};
+#pragma pack(pop)
+static_assert(sizeof(room_timing) == 24, "room_timing layout changed");
+
+/**
+ * 预创建适配器池
+ * 后台线程提前创建适配器，创建房间时直接取出，只需写入密钥、IP 和路由，
+ * 适配器创建（数百毫秒到数秒）不在加入房间的关键路径上。取出后后台自动补足。
+ * 池中适配器使用占位名称，系统网络列表中显示的是占位名而不是房间名
+ */
+class adapter_pool
+{
+public:
+    static adapter_pool pool_instance;
+
+    static adapter_pool &getInstance()
+    {
+        return pool_instance;
+    }
+
+    adapter_pool(const adapter_pool &) = delete;
+    adapter_pool &operator=(const adapter_pool &) = delete;
+
+    // 设置池大小并启动后台创建，0 表示关闭并释放池中适配器
+    void resize(size_t size)
+    {
+        if (size > ADAPTER_POOL_LIMIT)
+            size = ADAPTER_POOL_LIMIT;
+        if (size == 0)
+        {
+            stop();
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        target = size;
+        if (!filler.joinable())
+        {
+            stopping = false;
+            filler = std::thread([this]
+                                 { fill_loop(); });
+        }
+        cv.notify_one();
+    }
+
+    // 取出一个预创建的适配器，name 返回其占位名，池为空时返回 nullptr，由调用方同步创建
+    adapter_ptr acquire(std::wstring &name)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (ready.empty())
+            return nullptr;
+        auto adapter = std::move(ready.front().adapter);
+        name = std::move(ready.front().name);
+        ready.pop_front();
+        cv.notify_one();
+        return adapter;
+    }
+
+    // 停止后台创建并关闭池中适配器，卸载 wireguard.dll 前调用
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            target = 0;
+        }
+        cv.notify_all();
+        if (filler.joinable())
+        {
+            filler.join();
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        ready.clear();
+    }
+
+private:
+    adapter_pool() = default;
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::thread filler;
+    bool stopping = false;
+    size_t target = 0;
+    struct pooled
+    {
+        adapter_ptr adapter;
+        std::wstring name;
+    };
+    std::deque<pooled> ready;
+    uint32_t sequence = 0;
+
+    void fill_loop()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true)
+        {
+            cv.wait(guard, [this]
+                    { return stopping || ready.size() < target; });
+            if (stopping)
+                break;
+            const std::wstring name = L"mole-pool-" + std::to_wstring(GetCurrentProcessId()) + L"-" + std::to_wstring(sequence++);
+            guard.unlock();
+            stage_clock clock;
+            const auto handle = WireGuardCreateAdapter(name.c_str(), L"WireGuard Tunnel", nullptr);
+            const auto us = clock.lap();
+            guard.lock();
+            if (handle == nullptr)
+            {
+                log(WIREGUARD_LOG_ERR, "pool adapter create failed", GetLastError());
+                // 创建失败不重试，避免驱动异常时空转，下次 resize 重新启动
+                target = ready.size();
+                continue;
+            }
+            ready.push_back({make_adapter_ptr(handle), name});
+            log(WIREGUARD_LOG_INFO, "pool adapter created in " + std::to_string(us / 1000) + "ms, ready:" + std::to_string(ready.size()));
+        }
+    }
+};
+
+adapter_pool adapter_pool::pool_instance;
+
+#ifdef ADAPTER_POOL_SELFTEST
+// 本地自测：bash lib/selftest.sh adapter_pool
+// 模拟驱动创建与关闭适配器：补足到目标数量、取出后补足、上限、创建失败不重试，以及停止时关闭池中适配器
+#include "selftest_compat.h"
+#include "atomic"
+
+namespace adapter_pool_test
+{
+    std::atomic<int> created{0}, closed{0}, attempts{0};
+    std::atomic<bool> failing{false};
+    std::mutex names_lock;
+    std::vector<std::wstring> names;
+
+    WIREGUARD_ADAPTER_HANDLE fake_create(LPCWSTR name, LPCWSTR, const GUID *)
+    {
+        attempts++;
+        if (failing)
+        {
+            SetLastError(5);
+            return nullptr;
+        }
+        {
+            std::lock_guard<std::mutex> guard(names_lock);
+            names.push_back(name);
+        }
+        return reinterpret_cast<WIREGUARD_ADAPTER_HANDLE>(static_cast<uintptr_t>(++created));
+    }
+
+    void fake_close(WIREGUARD_ADAPTER_HANDLE)
+    {
+        closed++;
+    }
+
+    // 等待计数达到 n，再稍等确认不会继续增长
+    bool settles_at(const std::atomic<int> &count, int n)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+        while (count < n && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        return count == n;
+    }
+
+    inline int run()
+    {
+        WireGuardCreateAdapter = &fake_create;
+        WireGuardCloseAdapter = &fake_close;
+        auto &pool = adapter_pool::getInstance();
+        std::wstring name;
+        expect(pool.acquire(name) == nullptr, "empty pool hands out nothing");
+
+        pool.resize(2);
+        expect(settles_at(created, 2), "pool fills to its target and stops");
+        auto adapter = pool.acquire(name);
+        const std::wstring prefix = L"mole-pool-" + std::to_wstring(GetCurrentProcessId()) + L"-";
+        expect(adapter != nullptr && name.compare(0, prefix.size(), prefix) == 0, "acquired adapter carries its placeholder name");
+        expect(settles_at(created, 3), "acquire triggers a refill");
+        {
+            std::lock_guard<std::mutex> guard(names_lock);
+            expect(names.size() == 3 && names[0] != names[1] && names[1] != names[2], "placeholder names are unique");
+        }
+        adapter.reset();
+        expect(closed == 1, "releasing the last owner closes the adapter");
+
+        pool.resize(ADAPTER_POOL_LIMIT + 3);
+        expect(settles_at(created, 1 + ADAPTER_POOL_LIMIT), "pool size capped at ADAPTER_POOL_LIMIT");
+
+        // 停止时关闭池中全部适配器，之后取不到
+        pool.stop();
+        expect(closed == 1 + ADAPTER_POOL_LIMIT && pool.acquire(name) == nullptr, "stop closes pooled adapters");
+
+        // 创建失败：只尝试一次，不在驱动异常时空转，下次 resize 重新尝试
+        failing = true;
+        const int before = attempts;
+        pool.resize(2);
+        expect(settles_at(attempts, before + 1) && pool.acquire(name) == nullptr, "failed create not retried");
+        failing = false;
+        pool.resize(2);
+        expect(settles_at(created, 3 + ADAPTER_POOL_LIMIT) && attempts == before + 3, "next resize retries after a failure");
+
+        pool.resize(0);
+        expect(closed == 3 + ADAPTER_POOL_LIMIT, "resize to zero closes the pool");
+        return selftest_result();
+    }
+}
+
+int main()
+{
+    return adapter_pool_test::run();
+}
+#endif
@@ -0,0 +1,589 @@
+#include "hole_punch.cpp"
+#include "algorithm"
+#include "atomic"
+#include "chrono"
+#include "functional"
+#include "mutex"
+#include "thread"
+#include "vector"
+
+#pragma once
+
+/**
+ * 广播复制：大房间中发送端只上传一份广播给复制点，由复制点扇出给其余成员，节省发送端上行
+ * 复制点为房间内选出的连接较好的成员，报文在隧道内以 UDP 发往各成员虚拟 IP 的 REPLICA_PORT，外层由 WireGuard 加密。
+ * 报文携带房间标记与频道（原广播的 UDP 目标端口），接收端剥掉复制头后把原广播包注入本机协议栈，源地址仍为发送端虚拟 IP
+ * 是否经复制点发送按成员数与配置的上行带宽（wgUplinkKbps）判断，上行带宽不做测量，未配置时只按成员数
+ */
+
+// 复制报文端口，所有成员在各自虚拟 IP 上监听
+static constexpr uint16_t REPLICA_PORT = 51830;
+// 复制头标识 "MRPL" 与版本
+static constexpr uint32_t REPLICA_MAGIC = 0x4D52504C;
+static constexpr uint8_t REPLICA_VERSION = 1;
+static constexpr size_t REPLICA_HEADER_SIZE = 16;
+// 可复制的原始包长上限：复制头 + 包需放进隧道 MTU(1420) 的一个 UDP 报文
+static constexpr size_t REPLICA_PACKET_LIMIT = 1420 - 28 - REPLICA_HEADER_SIZE;
+// 成员数（不含本端）达到该值才考虑复制，低于 REPLICA_OFF_PEERS 时恢复逐个发送
+static constexpr size_t REPLICA_MIN_PEERS = 4;
+static constexpr size_t REPLICA_OFF_PEERS = 3;
+// 上行带宽未知时按成员数决定：达到该值开启，低于 REPLICA_BLIND_OFF_PEERS 关闭
+static constexpr size_t REPLICA_BLIND_PEERS = 8;
+static constexpr size_t REPLICA_BLIND_OFF_PEERS = 6;
+// 上行已知时按逐个发送的广播占用比例决定：超过 REPLICA_UPLINK_ON 开启，低于 REPLICA_UPLINK_OFF 关闭
+static constexpr double REPLICA_UPLINK_ON = 0.05;
+static constexpr double REPLICA_UPLINK_OFF = 0.025;
+// 广播速率的统计周期(ms)，按 1/4 平滑
+static constexpr uint32_t REPLICA_METER_MS = 1000;
+// 接收线程的最长等待(ms)，决定停止的响应时间
+static constexpr int REPLICA_IDLE_WAIT_MS = 100;
+
+enum replica_flag : uint8_t
+{
+    REPLICA_FANNED = 1, // 复制点扇出的报文，接收端只投递不再扇出
+};
+
+// 导出给调用方的复制状态，调用方按 48 字节解析
+#pragma pack(push, 8)
+struct replica_stats
+{
+    uint32_t active;        // 1 表示当前经复制点发送
+    uint32_t peers;         // 需要转发广播的成员数
+    uint64_t broadcast_bps; // 单份广播的平滑速率(bit/s)
+    uint64_t uplink_bps;    // 配置的上行带宽(bit/s)，0 表示未知
+    uint64_t uploaded;      // 上传给复制点的广播数，每个只上传一份
+    uint64_t fanned;        // 作为复制点扇出的报文数
+    uint64_t delivered;     // 收到并投递到本机的广播数
+};
+#pragma pack(pop)
+static_assert(sizeof(replica_stats) == 48, "replica_stats layout changed");
+
+// 房间标记：房间名各 UTF-16 码元的 FNV-1a 哈希，与 wchar_t 宽度无关
+inline uint32_t replica_room_tag(const wchar_t *name)
+{
+    uint32_t h = 2166136261u;
+    for (; *name != L'\0'; ++name)
+    {
+        const auto unit = static_cast<uint16_t>(*name);
+        h = (h ^ (unit & 0xFF)) * 16777619u;
+        h = (h ^ (unit >> 8)) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * 复制头，大端序定长编码，后接原始 IPv4 广播包
+ * 0 magic u32 | 4 version u8 | 5 flags u8 | 6 channel u16 | 8 room u32 | 12 origin u32（发送端虚拟 IP，网络序原样）
+ */
+struct replica_header
+{
+    uint8_t flags;
+    uint16_t channel;
+    uint32_t room;
+    uint32_t origin;
+
+    void encode(uint8_t *out) const
+    {
+        out[0] = static_cast<uint8_t>(REPLICA_MAGIC >> 24);
+        out[1] = static_cast<uint8_t>(REPLICA_MAGIC >> 16);
+        out[2] = static_cast<uint8_t>(REPLICA_MAGIC >> 8);
+        out[3] = static_cast<uint8_t>(REPLICA_MAGIC);
+        out[4] = REPLICA_VERSION;
+        out[5] = flags;
+        out[6] = static_cast<uint8_t>(channel >> 8);
+        out[7] = static_cast<uint8_t>(channel);
+        for (int i = 0; i < 4; i++)
+            out[8 + i] = static_cast<uint8_t>(room >> (24 - 8 * i));
+        memcpy(out + 12, &origin, 4);
+    }
+
+    bool decode(const uint8_t *in, size_t len)
+    {
+        if (len <= REPLICA_HEADER_SIZE || in[4] != REPLICA_VERSION ||
+            (static_cast<uint32_t>(in[0]) << 24 | static_cast<uint32_t>(in[1]) << 16 | static_cast<uint32_t>(in[2]) << 8 | in[3]) != REPLICA_MAGIC)
+            return false;
+        flags = in[5];
+        channel = static_cast<uint16_t>(in[6] << 8 | in[7]);
+        room = static_cast<uint32_t>(in[8]) << 24 | static_cast<uint32_t>(in[9]) << 16 | static_cast<uint32_t>(in[10]) << 8 | in[11];
+        memcpy(&origin, in + 12, 4);
+        return true;
+    }
+};
+
+// 隧道组播封装标记头：附加在 UDP payload 最前面，固定 8 字节
+#pragma pack(push, 1)
+struct multicast_marker
+{
+    uint32_t magic;          // 魔数 0x4D434D54 "MCMT"，接收端据此识别
+    uint32_t orig_dst_addr;  // 原始组播/广播目标地址（网络字节序）
+};
+#pragma pack(pop)
+
+// 识别魔数
+static constexpr uint32_t MULTICAST_MARKER_MAGIC = 0x4D434D54;
+
+/**
+ * 去掉 IPv4/UDP 包中的组播标记头并恢复原目标地址，返回新包长，不带标记头的包原样返回
+ * 复制报文已携带原广播地址，不需要标记头；只改长度与地址，校验和由调用方重算
+ */
+inline size_t strip_multicast_marker(uint8_t *packet, size_t len)
+{
+    const size_t ihl = len >= 20 ? static_cast<size_t>(packet[0] & 0x0F) * 4 : 0;
+    if (ihl < 20 || (packet[0] >> 4) != 4 || packet[9] != IPPROTO_UDP || len < ihl + 8 + sizeof(multicast_marker))
+        return len;
+    uint8_t *udp = packet + ihl;
+    multicast_marker m{};
+    memcpy(&m, udp + 8, sizeof(m));
+    const size_t udp_len = static_cast<size_t>(udp[4]) << 8 | udp[5];
+    if (m.magic != htonl(MULTICAST_MARKER_MAGIC) || udp_len < 8 + sizeof(m) || ihl + udp_len > len)
+        return len;
+    memmove(udp + 8, udp + 8 + sizeof(m), len - ihl - 8 - sizeof(m));
+    const auto shrink = [](uint8_t *field)
+    {
+        const auto v = static_cast<uint16_t>((field[0] << 8 | field[1]) - sizeof(multicast_marker));
+        field[0] = static_cast<uint8_t>(v >> 8);
+        field[1] = static_cast<uint8_t>(v);
+    };
+    shrink(udp + 4);
+    shrink(packet + 2);
+    memcpy(packet + 16, &m.orig_dst_addr, 4);
+    return len - sizeof(m);
+}
+
+// 单份广播的发送速率，按 REPLICA_METER_MS 周期统计并平滑，只由捕获线程调用
+class replica_meter
+{
+    uint64_t bytes = 0;
+    uint64_t smoothed = 0;
+    std::chrono::steady_clock::time_point since{};
+
+public:
+    // 记录一个广播包，完成一个统计周期时返回 true
+    bool add(size_t len, std::chrono::steady_clock::time_point now)
+    {
+        if (since == std::chrono::steady_clock::time_point{})
+            since = now;
+        bytes += len;
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - since).count();
+        if (elapsed < REPLICA_METER_MS)
+            return false;
+        const uint64_t bps = bytes * 8 * 1000 / static_cast<uint64_t>(elapsed);
+        smoothed = smoothed == 0 ? bps : (smoothed * 3 + bps) / 4;
+        bytes = 0;
+        since = now;
+        return true;
+    }
+
+    uint64_t bps() const { return smoothed; }
+};
+
+/**
+ * 按成员数与配置的上行带宽决定是否经复制点发送，开与关使用不同阈值，避免在边界上来回切换
+ * 逐个发送时广播占用的上行为 单份速率 × 成员数，复制后只占一份
+ */
+class replica_policy
+{
+    bool active = false;
+
+public:
+    bool update(size_t peers, uint64_t uplink_bps, uint64_t broadcast_bps)
+    {
+        if (peers < REPLICA_OFF_PEERS)
+            active = false;
+        else if (uplink_bps == 0)
+            active = peers >= REPLICA_BLIND_PEERS || (active && peers >= REPLICA_BLIND_OFF_PEERS);
+        else
+        {
+            const double share = static_cast<double>(broadcast_bps) * static_cast<double>(peers) / static_cast<double>(uplink_bps);
+            active = (peers >= REPLICA_MIN_PEERS && share > REPLICA_UPLINK_ON) || (active && share >= REPLICA_UPLINK_OFF);
+        }
+        return active;
+    }
+
+    bool enabled() const { return active; }
+};
+
+/**
+ * 复制收发端，每个房间一个，绑定本端虚拟 IP 的 REPLICA_PORT
+ * 普通成员：upload 把广播发给复制点；收到复制点扇出的报文后交给投递回调。
+ * 复制点：收到成员上传的报文后发给除发送端外的全部成员并投递到本机，只接受来自成员虚拟 IP 且源地址与 origin 一致的上传，不能被用作放大
+ */
+class replica_engine
+{
+public:
+    using deliver_fn = std::function<void(const uint8_t *packet, size_t len, uint16_t channel)>;
+
+    replica_engine() = default;
+    replica_engine(const replica_engine &) = delete;
+    replica_engine &operator=(const replica_engine &) = delete;
+
+    ~replica_engine()
+    {
+        stop();
+    }
+
+    // ip 为网络序的本端虚拟 IP
+    bool start(uint32_t ip, uint16_t port, uint32_t room_tag, deliver_fn deliver)
+    {
+        if (running())
+            return true;
+        const punch_socket s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (s == PUNCH_INVALID_SOCKET)
+            return false;
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = ip;
+        addr.sin_port = htons(port);
+        if (bind(s, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0)
+        {
+            punch_close(s);
+            return false;
+        }
+        sock = s;
+        local = ip;
+        this->port = port;
+        room = room_tag;
+        on_deliver = std::move(deliver);
+        stopping.store(false);
+        worker = std::thread(&replica_engine::run, this);
+        return true;
+    }
+
+    void stop()
+    {
+        stopping.store(true);
+        if (worker.joinable())
+            worker.join();
+        if (sock != PUNCH_INVALID_SOCKET)
+        {
+            punch_close(sock);
+            sock = PUNCH_INVALID_SOCKET;
+        }
+    }
+
+    bool running() const { return sock != PUNCH_INVALID_SOCKET; }
+
+    // 设置复制点虚拟 IP，0 表示没有复制点；等于本端 IP 时本端为复制点
+    void set_replicator(uint32_t ip) { replicator.store(ip); }
+
+    uint32_t replicator_ip() const { return replicator.load(); }
+
+    void add_member(uint32_t ip)
+    {
+        std::lock_guard<std::mutex> guard(members_lock);
+        if (std::find(members.begin(), members.end(), ip) == members.end())
+            members.push_back(ip);
+    }
+
+    void del_member(uint32_t ip)
+    {
+        std::lock_guard<std::mutex> guard(members_lock);
+        members.erase(std::remove(members.begin(), members.end(), ip), members.end());
+    }
+
+    /**
+     * 发出一个广播包：本端为复制点时直接扇出，否则只上传一份给复制点
+     * @return 是否已发出，false 时调用方应逐个发送
+     */
+    bool upload(const uint8_t *packet, size_t len, uint16_t channel)
+    {
+        const uint32_t target = replicator.load();
+        if (!running() || target == 0 || len > REPLICA_PACKET_LIMIT)
+            return false;
+        uint8_t frame[REPLICA_HEADER_SIZE + REPLICA_PACKET_LIMIT];
+        replica_header h{0, channel, room, local};
+        h.encode(frame);
+        memcpy(frame + REPLICA_HEADER_SIZE, packet, len);
+        if (target == local)
+            return fan_out(frame, REPLICA_HEADER_SIZE + len, local) >= 0;
+        if (!send_to(target, frame, REPLICA_HEADER_SIZE + len))
+            return false;
+        uploaded.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    uint64_t uploaded_count() const { return uploaded.load(std::memory_order_relaxed); }
+    uint64_t fanned_count() const { return fanned.load(std::memory_order_relaxed); }
+    uint64_t delivered_count() const { return delivered.load(std::memory_order_relaxed); }
+    uint64_t rejected_count() const { return rejected.load(std::memory_order_relaxed); }
+
+private:
+    punch_socket sock = PUNCH_INVALID_SOCKET;
+    uint32_t local = 0;
+    uint16_t port = REPLICA_PORT;
+    uint32_t room = 0;
+    deliver_fn on_deliver;
+    std::atomic<uint32_t> replicator{0};
+    std::vector<uint32_t> members;
+    std::mutex members_lock;
+    std::thread worker;
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> uploaded{0};
+    std::atomic<uint64_t> fanned{0};
+    std::atomic<uint64_t> delivered{0};
+    std::atomic<uint64_t> rejected{0};
+
+    bool send_to(uint32_t ip, const uint8_t *frame, size_t len)
+    {
+        sockaddr_in to{};
+        to.sin_family = AF_INET;
+        to.sin_addr.s_addr = ip;
+        to.sin_port = htons(port);
+        return sendto(sock, reinterpret_cast<const char *>(frame), static_cast<int>(len), 0, reinterpret_cast<const sockaddr *>(&to), sizeof(to)) ==
+               static_cast<int>(len);
+    }
+
+    // 把帧标记为扇出后发给除 origin 与本端外的全部成员，返回发出的份数，origin 不是成员时返回 -1
+    int fan_out(uint8_t *frame, size_t len, uint32_t origin)
+    {
+        std::vector<uint32_t> targets;
+        {
+            std::lock_guard<std::mutex> guard(members_lock);
+            if (origin != local && std::find(members.begin(), members.end(), origin) == members.end())
+                return -1;
+            targets = members;
+        }
+        frame[5] |= REPLICA_FANNED;
+        int sent = 0;
+        for (const uint32_t ip : targets)
+        {
+            if (ip != origin && ip != local && send_to(ip, frame, len))
+                sent++;
+        }
+        fanned.fetch_add(static_cast<uint64_t>(sent), std::memory_order_relaxed);
+        return sent;
+    }
+
+    void run()
+    {
+        uint8_t buf[2048];
+        pollfd fd{};
+        fd.fd = sock;
+        fd.events = POLLIN;
+        while (!stopping.load())
+        {
+            if (punch_poll(&fd, 1, REPLICA_IDLE_WAIT_MS) <= 0)
+                continue;
+            sockaddr_in from{};
+            socklen_t from_len = sizeof(from);
+            const int n = recvfrom(sock, reinterpret_cast<char *>(buf), sizeof(buf), 0, reinterpret_cast<sockaddr *>(&from), &from_len);
+            replica_header h{};
+            if (n <= 0 || !h.decode(buf, static_cast<size_t>(n)) || h.room != room)
+            {
+                if (n > 0)
+                    rejected.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            if ((h.flags & REPLICA_FANNED) == 0)
+            {
+                // 成员上传：只有复制点处理，且上传必须来自 origin 本身
+                if (replicator.load() != local || from.sin_addr.s_addr != h.origin || fan_out(buf, static_cast<size_t>(n), h.origin) < 0)
+                {
+                    rejected.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+            }
+            else if (from.sin_addr.s_addr != replicator.load() || h.origin == local)
+            {
+                // 扇出报文只接受当前复制点发来的，不投递自己发出的广播
+                rejected.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            delivered.fetch_add(1, std::memory_order_relaxed);
+            if (on_deliver)
+                on_deliver(buf + REPLICA_HEADER_SIZE, static_cast<size_t>(n) - REPLICA_HEADER_SIZE, h.channel);
+        }
+    }
+};
+
+#ifdef BROADCAST_REPLICA_SELFTEST
+// 本地自测：bash lib/selftest.sh broadcast_replica
+// 使用 127.0.0.0/8 上的不同地址模拟各成员虚拟 IP，复制点为本地替身
+#include "selftest_compat.h"
+#include "iostream"
+#include "map"
+#include "memory"
+
+int main()
+{
+    const auto ip = [](int host)
+    { return htonl(0x7F000000u | static_cast<uint32_t>(host)); };
+
+    // 复制头编解码
+    {
+        uint8_t buf[REPLICA_HEADER_SIZE + 4] = {};
+        replica_header h{REPLICA_FANNED, 27015, replica_room_tag(L"room-a"), ip(9)};
+        h.encode(buf);
+        replica_header d{};
+        expect(d.decode(buf, sizeof(buf)) && d.flags == REPLICA_FANNED && d.channel == 27015 && d.room == h.room && d.origin == ip(9),
+               "header round trip");
+        expect(!d.decode(buf, REPLICA_HEADER_SIZE), "header without packet rejected");
+        expect(replica_room_tag(L"room-a") != replica_room_tag(L"room-b"), "room tags differ");
+    }
+
+    // 策略：成员数与上行占用，带滞回
+    {
+        replica_policy p;
+        expect(!p.update(3, 0, 100000), "3 peers, unknown uplink: per-peer");
+        expect(!p.update(7, 0, 100000), "7 peers, unknown uplink: per-peer");
+        expect(p.update(8, 0, 100000), "8 peers, unknown uplink: replicate");
+        expect(p.update(6, 0, 100000), "6 peers after 8: keep replicating");
+        expect(!p.update(5, 0, 100000), "5 peers: back to per-peer");
+        replica_policy q;
+        // 10 Mbit/s 上行，单份 40 kbit/s：4 个成员占 1.6%，20 个成员占 8%
+        expect(!q.update(4, 10000000, 40000), "4 peers at 1.6% of uplink: per-peer");
+        expect(q.update(20, 10000000, 40000), "20 peers at 8% of uplink: replicate");
+        expect(q.update(10, 10000000, 40000), "10 peers at 4% of uplink: keep replicating");
+        expect(!q.update(5, 10000000, 40000), "5 peers at 2% of uplink: back to per-peer");
+        // 上行很小时少量成员也复制
+        replica_policy r;
+        expect(r.update(4, 1000000, 40000), "4 peers at 16% of a 1 Mbit/s uplink: replicate");
+        expect(!r.update(2, 1000000, 40000), "2 peers: never replicate");
+    }
+
+    // 组播标记头：上传与投递前剥掉，包与未封装时一致
+    {
+        uint8_t plain[20 + 8 + 12] = {0x45, 0, 0, 40, 0, 0, 0, 0, 64, IPPROTO_UDP};
+        const uint32_t group = htonl(0xEFFFFFFAu), peer = ip(7);
+        memcpy(plain + 12, &peer, 4);
+        memcpy(plain + 16, &group, 4);
+        plain[20 + 2] = 0x07;
+        plain[20 + 5] = 20;
+        for (int i = 0; i < 12; i++)
+            plain[28 + i] = static_cast<uint8_t>(0xA0 + i);
+        // 按 capture_loop 的封装方式插入标记头，目标地址改为对端
+        uint8_t marked[sizeof(plain) + sizeof(multicast_marker)];
+        memcpy(marked, plain, 28);
+        const multicast_marker m{htonl(MULTICAST_MARKER_MAGIC), group};
+        memcpy(marked + 28, &m, sizeof(m));
+        memcpy(marked + 28 + sizeof(m), plain + 28, 12);
+        marked[3] = 48;
+        marked[20 + 5] = 28;
+        const uint32_t unicast = ip(8);
+        memcpy(marked + 16, &unicast, 4);
+        const size_t len = strip_multicast_marker(marked, sizeof(marked));
+        expect(len == sizeof(plain) && memcmp(marked, plain, sizeof(plain)) == 0, "marker stripped and group address restored");
+        uint8_t copy[sizeof(plain)];
+        memcpy(copy, plain, sizeof(plain));
+        expect(strip_multicast_marker(copy, sizeof(copy)) == sizeof(plain) && memcmp(copy, plain, sizeof(plain)) == 0,
+               "unmarked packet unchanged");
+        expect(strip_multicast_marker(copy, 27) == 27, "truncated packet unchanged");
+    }
+
+    // 速率统计
+    {
+        replica_meter m;
+        const auto t0 = std::chrono::steady_clock::now();
+        bool folded = false;
+        for (int i = 0; i <= 100; i++)
+            folded = m.add(125, t0 + std::chrono::milliseconds(i * 10)) || folded;
+        expect(folded && m.bps() >= 99000 && m.bps() <= 101000, "meter: 100 x 125 bytes in 1s = " + std::to_string(m.bps()) + " bit/s");
+    }
+
+    // 本地替身复制点 127.0.0.1，成员 127.0.0.2 ~ 127.0.0.6
+    const uint32_t tag = replica_room_tag(L"replica-test");
+    const uint16_t port = 40000 + static_cast<uint16_t>(std::random_device{}() % 20000);
+    struct inbox
+    {
+        std::mutex lock;
+        std::vector<std::vector<uint8_t>> packets;
+        std::vector<uint16_t> channels;
+    };
+    std::map<int, std::unique_ptr<inbox>> boxes;
+    std::map<int, std::unique_ptr<replica_engine>> engines;
+    bool started = true;
+    for (int host = 1; host <= 6; host++)
+    {
+        boxes[host] = std::make_unique<inbox>();
+        engines[host] = std::make_unique<replica_engine>();
+        auto *box = boxes[host].get();
+        started = started && engines[host]->start(ip(host), port, tag, [box](const uint8_t *p, size_t len, uint16_t channel)
+                                                  {
+            std::lock_guard<std::mutex> guard(box->lock);
+            box->packets.emplace_back(p, p + len);
+            box->channels.push_back(channel); });
+        for (int other = 1; other <= 6; other++)
+        {
+            if (other != host)
+                engines[host]->add_member(ip(other));
+        }
+        engines[host]->set_replicator(ip(1));
+    }
+    expect(started, "stand-in replicator and 5 members listening on port " + std::to_string(port));
+    const auto wait_quiet = []
+    { std::this_thread::sleep_for(std::chrono::milliseconds(300)); };
+    const auto count = [&](int host)
+    {
+        std::lock_guard<std::mutex> guard(boxes[host]->lock);
+        return boxes[host]->packets.size();
+    };
+
+    // 成员 2 上传一份，其余成员与复制点各收到一份，原样还原
+    std::vector<uint8_t> packet(300);
+    for (size_t i = 0; i < packet.size(); i++)
+        packet[i] = static_cast<uint8_t>(i * 7);
+    expect(engines[2]->upload(packet.data(), packet.size(), 27015), "member uploads a broadcast");
+    wait_quiet();
+    bool exact = true;
+    for (int host = 3; host <= 6; host++)
+    {
+        std::lock_guard<std::mutex> guard(boxes[host]->lock);
+        exact = exact && boxes[host]->packets.size() == 1 && boxes[host]->packets[0] == packet && boxes[host]->channels[0] == 27015;
+    }
+    expect(exact, "each other member receives the original packet once");
+    expect(count(1) == 1, "replicator delivers it locally");
+    expect(count(2) == 0, "sender does not receive its own broadcast");
+    expect(engines[2]->uploaded_count() == 1 && engines[1]->fanned_count() == 4,
+           "sender uploaded 1 copy instead of 5, replicator fanned out 4");
+
+    // 复制点自己的广播直接扇出
+    expect(engines[1]->upload(packet.data(), 100, 7777), "replicator broadcasts directly");
+    wait_quiet();
+    expect(count(2) == 1 && count(6) == 2 && count(1) == 1, "replicator's own broadcast reaches every member");
+
+    // 非成员上传、伪造 origin、错误房间、非复制点收到上传均被拒绝
+    {
+        replica_engine outsider;
+        outsider.start(ip(9), port, tag, nullptr);
+        outsider.set_replicator(ip(1));
+        outsider.upload(packet.data(), 50, 1);
+        replica_engine other_room;
+        other_room.start(ip(10), port, replica_room_tag(L"other"), nullptr);
+        other_room.set_replicator(ip(1));
+        other_room.upload(packet.data(), 50, 1);
+        // 伪造：从 127.0.0.2 发送 origin 为 127.0.0.3 的上传
+        uint8_t frame[REPLICA_HEADER_SIZE + 50] = {};
+        replica_header{0, 1, tag, ip(3)}.encode(frame);
+        const punch_socket s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        sockaddr_in from{}, to{};
+        from.sin_family = AF_INET;
+        from.sin_addr.s_addr = ip(2);
+        bind(s, reinterpret_cast<const sockaddr *>(&from), sizeof(from));
+        to.sin_family = AF_INET;
+        to.sin_addr.s_addr = ip(1);
+        to.sin_port = htons(port);
+        sendto(s, frame, sizeof(frame), 0, reinterpret_cast<const sockaddr *>(&to), sizeof(to));
+        // 上传给非复制点
+        to.sin_addr.s_addr = ip(4);
+        replica_header{0, 1, tag, ip(2)}.encode(frame);
+        sendto(s, frame, sizeof(frame), 0, reinterpret_cast<const sockaddr *>(&to), sizeof(to));
+        punch_close(s);
+        wait_quiet();
+        expect(engines[1]->rejected_count() == 3 && engines[4]->rejected_count() == 1, "outsider, foreign room and spoofed uploads rejected");
+        expect(count(3) == 2 && count(5) == 2, "nothing rejected is delivered");
+    }
+
+    // 成员离开后不再收到扇出；没有复制点或包过大时调用方逐个发送
+    engines[1]->del_member(ip(6));
+    engines[3]->upload(packet.data(), packet.size(), 27015);
+    wait_quiet();
+    expect(count(6) == 2 && count(5) == 3, "departed member no longer receives");
+    engines[2]->set_replicator(0);
+    std::vector<uint8_t> big(REPLICA_PACKET_LIMIT + 1);
+    expect(!engines[2]->upload(packet.data(), packet.size(), 1) && !engines[3]->upload(big.data(), big.size(), 1),
+           "no replicator or oversized packet falls back to per-peer");
+
+    engines.clear();
+    return selftest_result();
+}
+#endif
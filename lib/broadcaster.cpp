@@ -1,43 +1,37 @@
 #include "src/wireguard.h"
 #include "wireguard_tool.cpp"
 #include "src/windivert.h"
+#include "broadcast_replica.cpp"
 #include "shared_mutex"
 #include "thread"
 #include "unordered_set"
 #include "atomic"
+#include "memory"
+#include "vector"
+#include "algorithm"
 
 #pragma comment(lib, "lib/src/WinDivert.lib")
 
-// 隧道组播封装标记头：附加在 UDP payload 最前面，固定 8 字节
-#pragma pack(push, 1)
-struct multicast_marker
-{
-    uint32_t magic;          // 魔数 0x4D434D54 "MCMT"，接收端据此识别
-    uint32_t orig_dst_addr;  // 原始组播/广播目标地址（网络字节序）
-};
-#pragma pack(pop)
-
-// 识别魔数
-static constexpr uint32_t MULTICAST_MARKER_MAGIC = 0x4D434D54;
 // 封装长度阈值：小于该长度才封装/还原，防止封装后超过 wireguard MTU(1420)
 static constexpr uint16_t MULTICAST_ENCAP_LIMIT = 1400;
 // 组播隧道传输总开关：0 = 只转发广播(255.255.255.255)，不启用组播封装/解析；1 = 启用组播
 #define MULTICAST_TRANSPORT_ENABLED 0
 
-// 用于转发三层网络中的广播数据包到wireguard隧道
+// 用于转发三层网络中的广播数据包到wireguard隧道，每个房间一个实例，绑定房间适配器和虚拟 IP
 class transporter
 {
 public:
-    // 组播数据包过滤器，匹配所有的组播数据包
-    static const char *multicast_filter;
-    static transporter bt_instance;
+    transporter(DWORD wg_idx, const char *wg_ip_str)
+        : wg_idx(wg_idx), wg_ip((wg_ip_str != nullptr) ? inet_addr(wg_ip_str) : INADDR_NONE) {}
 
     transporter(const transporter &b) = delete;
     transporter &operator=(const transporter &) = delete;
 
-    static transporter &getInstance()
+    ~transporter()
     {
-        return bt_instance;
+        replica.stop();
+        if (inject != NULL)
+            WinDivertClose(inject);
     }
 
     void add_ips(const char **ips, size_t count)
@@ -48,6 +42,7 @@ public:
             if (inet_addr(ips[i]) == INADDR_NONE)
                 continue;
             peers.insert(inet_addr(ips[i]));
+            replica.add_member(inet_addr(ips[i]));
             log(WIREGUARD_LOG_INFO, std::string("add broadcast peer ip:") + ips[i]);
         }
     }
@@ -58,11 +53,251 @@ public:
         for (size_t i = 0; i < count; i++)
         {
             peers.erase(inet_addr(ips[i]));
+            replica.del_member(inet_addr(ips[i]));
             log(WIREGUARD_LOG_INFO, std::string("del broadcast peer ip:") + ips[i]);
         }
     }
 
+    DWORD index() const
+    {
+        return wg_idx;
+    }
+
+    // 累计转发成功的包数
+    uint64_t forwarded_count() const
+    {
+        return forwarded.load(std::memory_order_relaxed);
+    }
+
+    // 累计转发失败的包数
+    uint64_t failed_count() const
+    {
+        return failed.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * 设置广播复制点，replicator_ip 为空时关闭复制，全部广播恢复逐个发送
+     * 复制点为本端虚拟 IP 时本端负责扇出；是否经复制点发送由成员数、uplink_bps 与测得的广播速率决定，
+     * 上行带宽不做测量，只取配置项 wgUplinkKbps
+     * @param room_tag: 房间标记，成员之间一致 @param uplink_bps: 配置的上行带宽(bit/s)，0 表示未配置
+     */
+    bool set_replica(uint32_t room_tag, const char *replicator_ip, uint64_t uplink_bps)
+    {
+        std::unique_lock<std::shared_mutex> lock(peer_rw_lock);
+        uplink.store(uplink_bps, std::memory_order_relaxed);
+        if (replicator_ip == nullptr || replicator_ip[0] == '\0')
+        {
+            replica.set_replicator(0);
+            replica.stop();
+            log(WIREGUARD_LOG_INFO, "broadcast replica disabled");
+            return true;
+        }
+        const uint32_t replicator = inet_addr(replicator_ip);
+        if (replicator == INADDR_NONE || wg_ip == INADDR_NONE)
+            return false;
+        // 注入句柄只发送，把复制点转来的广播作为 wg 网卡的入站包交给本机协议栈
+        if (inject == NULL)
+        {
+            HANDLE h = WinDivertOpen("false", WINDIVERT_LAYER_NETWORK, 0, WINDIVERT_FLAG_SEND_ONLY);
+            if (h == INVALID_HANDLE_VALUE || h == NULL)
+            {
+                log(WIREGUARD_LOG_ERR, "replica inject open failed", GetLastError());
+                return false;
+            }
+            inject = h;
+        }
+        if (!replica.start(wg_ip, REPLICA_PORT, room_tag, [this](const uint8_t *packet, size_t len, uint16_t)
+                           { deliver(packet, len); }))
+        {
+            log(WIREGUARD_LOG_ERR, "replica listen failed", WSAGetLastError());
+            return false;
+        }
+        for (const auto &p : peers)
+            replica.add_member(p);
+        replica.set_replicator(replicator);
+        log(WIREGUARD_LOG_INFO, std::string("broadcast replica:") + replicator_ip + (replicator == wg_ip ? " (self)" : ""));
+        return true;
+    }
+
+    replica_stats replica_state()
+    {
+        std::shared_lock<std::shared_mutex> lock(peer_rw_lock);
+        replica_stats out{};
+        out.active = replicating.load(std::memory_order_relaxed) && replica.running();
+        out.peers = static_cast<uint32_t>(peers.size());
+        out.broadcast_bps = broadcast_bps.load(std::memory_order_relaxed);
+        out.uplink_bps = uplink.load(std::memory_order_relaxed);
+        out.uploaded = replica.uploaded_count();
+        out.fanned = replica.fanned_count();
+        out.delivered = replica.delivered_count();
+        return out;
+    }
+
+    /**
+     * 将捕获到的广播包复制到本房间每个 peer，会改写 packet 的 IP 头地址和 addr 的网卡索引
+     * 启用复制且成员数、配置上行的占用达到阈值时只上传一份给复制点，channel 为原广播的 UDP 目标端口
+     * 复制报文携带原广播地址，上传的是去掉组播标记头的副本，packet 本身保持不变供逐个发送与其他房间使用
+     */
+    void forward(HANDLE h, char *packet, uint32_t packet_l, PWINDIVERT_IPHDR ip_header, WINDIVERT_ADDRESS &addr, uint16_t channel)
+    {
+        std::shared_lock<std::shared_mutex> lock(peer_rw_lock);
+        // 只由捕获线程调用，速率与策略状态不需要额外加锁
+        if (meter.add(packet_l, std::chrono::steady_clock::now()))
+        {
+            broadcast_bps.store(meter.bps(), std::memory_order_relaxed);
+            const bool next = policy.update(peers.size(), uplink.load(std::memory_order_relaxed), meter.bps());
+            if (next != replicating.load(std::memory_order_relaxed))
+                log(WIREGUARD_LOG_INFO, std::string("broadcast ") + (next ? "via replica" : "per peer") + ", peers " +
+                                            std::to_string(peers.size()) + ", rate " + std::to_string(meter.bps()) + "bps");
+            replicating.store(next, std::memory_order_relaxed);
+        }
+        if (replicating.load(std::memory_order_relaxed) && replica.running())
+        {
+            // 保留原广播目标地址，接收端原样注入
+            char copy[REPLICA_PACKET_LIMIT];
+            UINT copy_l = 0;
+            ip_header->SrcAddr = wg_ip;
+            if (packet_l <= sizeof(copy))
+            {
+                memcpy(copy, packet, packet_l);
+                copy_l = static_cast<UINT>(strip_multicast_marker(reinterpret_cast<uint8_t *>(copy), packet_l));
+            }
+            if (copy_l > 0 && WinDivertHelperCalcChecksums(copy, copy_l, &addr, 0) &&
+                replica.upload(reinterpret_cast<const uint8_t *>(copy), copy_l, channel))
+            {
+                forwarded.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+        for (const auto &p : peers)
+        {
+            // 源地址改为 wg 网卡虚拟 IP：对端 wg 网卡按 peer AllowedIPs 过滤，
+            // 若保留物理网卡源地址，包会被对端丢弃，转发无效
+            ip_header->SrcAddr = wg_ip;
+            ip_header->DstAddr = p;
+            if (!WinDivertHelperCalcChecksums(packet, packet_l, &addr, 0))
+            {
+                failed.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            // IfIdx/SubIfIdx 必须同时置 0 才会按目标地址自动路由到 wg 网卡；
+            // 只置 IfIdx 而 SubIfIdx 残留物理网卡值，包仍会被注入物理网卡造成断网
+            addr.Network.IfIdx = 0;
+            addr.Network.SubIfIdx = 0;
+            if (!WinDivertSend(h, packet, packet_l, nullptr, &addr))
+            {
+                failed.fetch_add(1, std::memory_order_relaxed);
+                log(WIREGUARD_LOG_ERR, "windivert send failed", GetLastError());
+                continue;
+            }
+            forwarded.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    // 复制点转来的广播：作为 wg 网卡的入站包注入，源地址保持为发送端虚拟 IP；仍带组播标记头的包先还原
+    void deliver(const uint8_t *packet, size_t len)
+    {
+        char buf[REPLICA_PACKET_LIMIT];
+        if (len > sizeof(buf) || len < sizeof(WINDIVERT_IPHDR))
+            return;
+        memcpy(buf, packet, len);
+        len = strip_multicast_marker(reinterpret_cast<uint8_t *>(buf), len);
+        WINDIVERT_ADDRESS addr{};
+        addr.Outbound = 0;
+        addr.Network.IfIdx = wg_idx;
+        addr.Network.SubIfIdx = 0;
+        if (!WinDivertHelperCalcChecksums(buf, static_cast<UINT>(len), &addr, 0) ||
+            !WinDivertSend(inject, buf, static_cast<UINT>(len), nullptr, &addr))
+        {
+            failed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // 需要转发的ip地址
+    std::unordered_set<uint32_t> peers;
+    std::shared_mutex peer_rw_lock;
+    DWORD wg_idx;
+    uint32_t wg_ip{INADDR_NONE};             // wg 网卡虚拟 IP，泛洪注入时的源地址
+    std::atomic<uint64_t> forwarded{0};      // 遥测计数，只累加不清零
+    std::atomic<uint64_t> failed{0};
+    // 广播复制，引擎在设置复制点后启动；meter 与 policy 只由捕获线程访问
+    replica_engine replica;
+    replica_meter meter;
+    replica_policy policy;
+    HANDLE inject{NULL};
+    std::atomic<bool> replicating{false};
+    std::atomic<uint64_t> uplink{0};
+    std::atomic<uint64_t> broadcast_bps{0};
+};
+
+/**
+ * 广播捕获中心单例
+ * 所有房间共享同一个嗅探句柄：过滤器排除全部房间的 wg 网卡，广播只捕获一次再分发给各房间的 transporter，
+ * CPU 开销不随房间数线性增长。房间变化时按新过滤器重新打开句柄
+ */
+class capture_hub
+{
+public:
+    // 组播数据包过滤器，匹配所有的组播数据包
+    static const char *multicast_filter;
+    static capture_hub hub_instance;
+
+    capture_hub(const capture_hub &) = delete;
+    capture_hub &operator=(const capture_hub &) = delete;
+
+    static capture_hub &getInstance()
+    {
+        return hub_instance;
+    }
+
+    // 注册房间转发器，并按新的网卡集合重启捕获
+    void attach(const std::shared_ptr<transporter> &t)
+    {
+        std::lock_guard<std::mutex> control(control_lock);
+        {
+            std::unique_lock<std::shared_mutex> lock(rooms_lock);
+            rooms.push_back(t);
+        }
+        restart();
+    }
+
+    // 注销房间转发器，没有房间时停止捕获
+    void detach(const std::shared_ptr<transporter> &t)
+    {
+        std::lock_guard<std::mutex> control(control_lock);
+        {
+            std::unique_lock<std::shared_mutex> lock(rooms_lock);
+            rooms.erase(std::remove(rooms.begin(), rooms.end(), t), rooms.end());
+        }
+        restart();
+    }
+
     void stop_trans()
+    {
+        std::lock_guard<std::mutex> control(control_lock);
+        {
+            std::unique_lock<std::shared_mutex> lock(rooms_lock);
+            rooms.clear();
+        }
+        shutdown();
+    }
+
+private:
+    std::vector<std::shared_ptr<transporter>> rooms;
+    std::shared_mutex rooms_lock;
+    // 串行化 attach/detach 引起的重启
+    std::mutex control_lock;
+    std::thread braoder_thread;
+    std::thread parser_thread;
+    std::atomic<bool> stop{false};
+    std::atomic<HANDLE> windivert_handle{NULL}; // 发送端嗅探句柄
+    std::atomic<HANDLE> rx_handle{NULL};        // 接收端嗅探句柄
+    std::atomic<HANDLE> inject_handle{NULL};    // 接收端注入句柄
+    capture_hub() = default;
+
+    // 停止捕获线程并等待退出
+    void shutdown()
     {
         stop = true;
         // 关闭发送端接收通道，让阻塞中的 WinDivertRecv 立即返回 ERROR_OPERATION_ABORTED，
@@ -78,269 +313,255 @@ public:
         {
             WinDivertShutdown(rx, WINDIVERT_SHUTDOWN_RECV);
         }
+        if (braoder_thread.joinable())
+            braoder_thread.join();
+        if (parser_thread.joinable())
+            parser_thread.join();
     }
 
-    void run(DWORD wg_idx, const char *wg_ip_str)
-    {   
-        // 允许重复启动：stop_trans() 会把 stop 置为 true，若不重置，
-        // 再次启动时两个线程的 while(!stop) 直接不成立，立即退出
-        stop = false;
-        // 记录 wg 网卡虚拟 IP：泛洪注入时作为源地址，否则对端按 peer AllowedIPs 过滤会丢弃包
-        wg_ip = (wg_ip_str != nullptr) ? inet_addr(wg_ip_str) : INADDR_NONE;
-        // 广播转发线程，复制所有广播到每个peer，组播数据包进行再封装
-        braoder_thread = std::thread([this, wg_idx]{
-            auto filter = multicast_filter + std::to_string(wg_idx);
-            log(WIREGUARD_LOG_INFO, "broadcast run with filter: " + filter);
-            // 获取windivert句柄，设置为嗅探模式，接收出站广播/组播
-            HANDLE h = WinDivertOpen(filter.c_str(), WINDIVERT_LAYER_NETWORK, 0, WINDIVERT_FLAG_SNIFF);
-            windivert_handle.store(h, std::memory_order_release);
-            if (h == INVALID_HANDLE_VALUE || h == NULL)
+    // 按当前房间集合重建过滤器并重启捕获线程，调用方需持有 control_lock
+    void restart()
+    {
+        shutdown();
+        std::string exclude;
+        std::string include;
+        {
+            std::shared_lock<std::shared_mutex> lock(rooms_lock);
+            if (rooms.empty())
             {
-                log(WIREGUARD_LOG_ERR, "load windivert failed", GetLastError());
                 return;
             }
-
-            WINDIVERT_ADDRESS addr;
-            char packet[0xffff];
-            uint32_t packet_l;
-            log(WIREGUARD_LOG_INFO, "start layer 3 broadcast transport");
-            while (!stop)
+            for (const auto &t : rooms)
             {
-                if (!WinDivertRecv(h, packet, sizeof(packet), &packet_l, &addr))
-                {
-                    auto error = GetLastError();
-                    if (error == ERROR_TIMEOUT || error == ERROR_HOST_UNREACHABLE)
-                    {
-                        if (stop) break;
-                        continue;
-                    }
-
-                    if (error == ERROR_INVALID_HANDLE || error == ERROR_OPERATION_ABORTED)
-                    {
-                        break;
-                    }
-                    log(WIREGUARD_LOG_ERR, "windivert read failed", error);
-                    break;
-                }
-                PWINDIVERT_IPHDR ip_header = NULL;
-                PWINDIVERT_IPV6HDR ipv6_header = NULL;
-                PWINDIVERT_UDPHDR udp_header = NULL;
-
-                // 解析数据包
-                WinDivertHelperParsePacket(
-                    packet, packet_l,
-                    &ip_header, &ipv6_header,
-                    NULL, NULL, NULL, NULL,
-                    &udp_header, NULL, NULL, NULL, NULL
-                );
-                if (ip_header == NULL)
-                {
-                    log(WIREGUARD_LOG_ERR, "parse broadcast data failed");
-                    continue;
-                }
-                // 只转发 UDP 且总长度小于阈值的包：
-                // 1) 非 UDP 组播/广播没有封装标记，接收端无法还原，直接放弃
-                // 2) 大包转发会超过 wg MTU(1420) 且泛洪无意义，直接放弃
-                //    注意 udp_header->Length 是网络字节序，不能直接拿来比较大小
-                if (udp_header == NULL || packet_l >= MULTICAST_ENCAP_LIMIT)
-                {
-                    continue;
-                }
-
-                // 组播判断（DstAddr 为网络字节序）：224.0.0.0/4 为组播，255.255.255.255 为受限广播。
-                // WireGuard 不支持组播路由，所以两者统一走"广播/组播转单播泛洪"：
-                // 复制包并把 DstAddr 改写为每个 peer 的 IP 后发送。
-                bool is_multicast = (ip_header->DstAddr & htonl(0xF0000000)) == htonl(0xE0000000);
+                const auto idx = std::to_string(t->index());
+                exclude += " and ifIdx != " + idx;
+                include += (include.empty() ? "ifIdx == " : " or ifIdx == ") + idx;
+            }
+        }
+        // 允许重复启动：shutdown() 会把 stop 置为 true，若不重置，
+        // 再次启动时两个线程的 while(!stop) 直接不成立，立即退出
+        stop = false;
+        // 句柄在当前线程打开后再交给捕获线程，保证 shutdown 时一定能拿到句柄
+        const std::string filter = multicast_filter + exclude;
+        log(WIREGUARD_LOG_INFO, "broadcast run with filter: " + filter);
+        // 获取windivert句柄，设置为嗅探模式，接收出站广播/组播
+        HANDLE h = WinDivertOpen(filter.c_str(), WINDIVERT_LAYER_NETWORK, 0, WINDIVERT_FLAG_SNIFF);
+        if (h == INVALID_HANDLE_VALUE || h == NULL)
+        {
+            log(WIREGUARD_LOG_ERR, "load windivert failed", GetLastError());
+            return;
+        }
+        windivert_handle.store(h, std::memory_order_release);
+        braoder_thread = std::thread([this, h, filter]
+                                     { capture_loop(h, filter); });
+#if MULTICAST_TRANSPORT_ENABLED
+        // 接收端：嗅探从所有房间 wireguard 网卡进入的 UDP 包
+        const std::string rx_filter = "inbound and udp and (" + include + ")";
+        log(WIREGUARD_LOG_INFO, "parser run with filter: " + rx_filter);
+        HANDLE rx = WinDivertOpen(rx_filter.c_str(), WINDIVERT_LAYER_NETWORK, 0, WINDIVERT_FLAG_SNIFF);
+        if (rx == INVALID_HANDLE_VALUE || rx == NULL)
+        {
+            log(WIREGUARD_LOG_ERR, "parser windivert open failed", GetLastError());
+            return;
+        }
+        // 注入句柄（非嗅探模式），用于把还原后的组播包送回本机协议栈
+        HANDLE inject = WinDivertOpen("true", WINDIVERT_LAYER_NETWORK, 0, 0);
+        if (inject == INVALID_HANDLE_VALUE || inject == NULL)
+        {
+            log(WIREGUARD_LOG_ERR, "parser inject open failed", GetLastError());
+            WinDivertClose(rx);
+            return;
+        }
+        rx_handle.store(rx, std::memory_order_release);
+        inject_handle.store(inject, std::memory_order_release);
+        parser_thread = std::thread([this, rx, inject, rx_filter]
+                                    { parser_loop(rx, inject, rx_filter); });
+#endif
+    }
 
-                // 链路本地组播 224.0.0.0/24（mDNS 224.0.0.251、LLMNR 224.0.0.252、IGMP 查询等）
-                // 属于单跳协议，跨隧道泛洪无意义且可能干扰对端网络，直接跳过
-                if (is_multicast && (ntohl(ip_header->DstAddr) & 0xFFFFFF00) == 0xE0000000)
+    // 广播转发线程，复制所有广播到每个房间的每个peer，组播数据包进行再封装
+    void capture_loop(HANDLE h, const std::string &filter)
+    {
+        WINDIVERT_ADDRESS addr;
+        char packet[0xffff];
+        uint32_t packet_l;
+        log(WIREGUARD_LOG_INFO, "start layer 3 broadcast transport");
+        while (!stop)
+        {
+            if (!WinDivertRecv(h, packet, sizeof(packet), &packet_l, &addr))
+            {
+                auto error = GetLastError();
+                if (error == ERROR_TIMEOUT || error == ERROR_HOST_UNREACHABLE)
                 {
+                    if (stop) break;
                     continue;
                 }
-#if MULTICAST_TRANSPORT_ENABLED
-                // 封装：在 UDP payload 前插入 8 字节标记头，携带原始组播/广播地址供接收端还原
-                {
-                    uint32_t orig_dst = ip_header->DstAddr; // 原始组播/广播地址
-                    BYTE *payload = (BYTE *)udp_header + sizeof(WINDIVERT_UDPHDR);
-                    uint16_t udp_len = ntohs(udp_header->Length);
-                    uint16_t payload_len = udp_len - (uint16_t)sizeof(WINDIVERT_UDPHDR);
-
-                    // payload 后移 8 字节并写入标记头
-                    memmove(payload + sizeof(multicast_marker), payload, payload_len);
-                    auto *m = (multicast_marker *)payload;
-                    m->magic = htonl(MULTICAST_MARKER_MAGIC);
-                    m->orig_dst_addr = orig_dst;
-
-                    // 同步更新 UDP/IP 长度与总包长
-                    udp_header->Length = htons(udp_len + (uint16_t)sizeof(multicast_marker));
-                    ip_header->Length = htons(ntohs(ip_header->Length) + (uint16_t)sizeof(multicast_marker));
-                    packet_l += (uint32_t)sizeof(multicast_marker);
-                }
-#endif
 
-                std::shared_lock<std::shared_mutex> lock(peer_rw_lock);
-                if (peers.empty()) continue;
-                for (const auto &p : peers)
+                if (error == ERROR_INVALID_HANDLE || error == ERROR_OPERATION_ABORTED || error == ERROR_NO_DATA)
                 {
-                    // 源地址改为 wg 网卡虚拟 IP：对端 wg 网卡按 peer AllowedIPs 过滤，
-                    // 若保留物理网卡源地址，包会被对端丢弃，转发无效
-                    ip_header->SrcAddr = wg_ip;
-                    ip_header->DstAddr = p;
-                    if (!WinDivertHelperCalcChecksums(packet, packet_l, &addr, 0)) continue;
-                    // IfIdx/SubIfIdx 必须同时置 0 才会按目标地址自动路由到 wg 网卡；
-                    // 只置 IfIdx 而 SubIfIdx 残留物理网卡值，包仍会被注入物理网卡造成断网
-                    addr.Network.IfIdx = 0;
-                    addr.Network.SubIfIdx = 0;
-                    if (!WinDivertSend(h, packet, packet_l, nullptr, &addr))
-                    {
-                        log(WIREGUARD_LOG_ERR, "windivert send failed", GetLastError());
-                    }
+                    break;
                 }
-                lock.unlock();
+                log(WIREGUARD_LOG_ERR, "windivert read failed", error);
+                break;
             }
-            // 接收线程自行关闭句柄，避免与 stop_trans 跨线程关闭产生竞争
-            WinDivertClose(h);
-            windivert_handle.store(NULL, std::memory_order_release);
-            log(WIREGUARD_LOG_INFO, "stop layer 3 broadcast transport with filter:" + filter);
-        });
-#if MULTICAST_TRANSPORT_ENABLED
-        parser_thread = std::thread([this, wg_idx]{
-            // 接收端：嗅探从 wireguard 网卡进入的 UDP 包，识别隧道组播并还原
-            auto rx_filter = "inbound and ifIdx == " + std::to_string(wg_idx) + " and udp";
-            log(WIREGUARD_LOG_INFO, "parser run with filter: " + rx_filter);
-            HANDLE rx = WinDivertOpen(rx_filter.c_str(), WINDIVERT_LAYER_NETWORK, 0, WINDIVERT_FLAG_SNIFF);
-            rx_handle.store(rx, std::memory_order_release);
-            if (rx == INVALID_HANDLE_VALUE || rx == NULL)
+            PWINDIVERT_IPHDR ip_header = NULL;
+            PWINDIVERT_IPV6HDR ipv6_header = NULL;
+            PWINDIVERT_UDPHDR udp_header = NULL;
+
+            // 解析数据包
+            WinDivertHelperParsePacket(
+                packet, packet_l,
+                &ip_header, &ipv6_header,
+                NULL, NULL, NULL, NULL,
+                &udp_header, NULL, NULL, NULL, NULL
+            );
+            if (ip_header == NULL)
             {
-                log(WIREGUARD_LOG_ERR, "parser windivert open failed", GetLastError());
-                return;
+                log(WIREGUARD_LOG_ERR, "parse broadcast data failed");
+                continue;
             }
-            // 注入句柄（非嗅探模式），用于把还原后的组播包送回本机协议栈
-            HANDLE inject = WinDivertOpen("true", WINDIVERT_LAYER_NETWORK, 0, 0);
-            inject_handle.store(inject, std::memory_order_release);
-            if (inject == INVALID_HANDLE_VALUE || inject == NULL)
+            // 只转发 UDP 且总长度小于阈值的包：
+            // 1) 非 UDP 组播/广播没有封装标记，接收端无法还原，直接放弃
+            // 2) 大包转发会超过 wg MTU(1420) 且泛洪无意义，直接放弃
+            //    注意 udp_header->Length 是网络字节序，不能直接拿来比较大小
+            if (udp_header == NULL || packet_l >= MULTICAST_ENCAP_LIMIT)
             {
-                log(WIREGUARD_LOG_ERR, "parser inject open failed", GetLastError());
-                WinDivertClose(rx);
-                rx_handle.store(NULL, std::memory_order_release);
-                return;
+                continue;
             }
 
-            WINDIVERT_ADDRESS addr;
-            char packet[0xffff];
-            uint32_t packet_l;
-            while (!stop)
+            // 组播判断（DstAddr 为网络字节序）：224.0.0.0/4 为组播，255.255.255.255 为受限广播。
+            // WireGuard 不支持组播路由，所以两者统一走"广播/组播转单播泛洪"：
+            // 复制包并把 DstAddr 改写为每个 peer 的 IP 后发送。
+            bool is_multicast = (ip_header->DstAddr & htonl(0xF0000000)) == htonl(0xE0000000);
+
+            // 链路本地组播 224.0.0.0/24（mDNS 224.0.0.251、LLMNR 224.0.0.252、IGMP 查询等）
+            // 属于单跳协议，跨隧道泛洪无意义且可能干扰对端网络，直接跳过
+            if (is_multicast && (ntohl(ip_header->DstAddr) & 0xFFFFFF00) == 0xE0000000)
             {
-                if (!WinDivertRecv(rx, packet, sizeof(packet), &packet_l, &addr))
-                {
-                    auto error = GetLastError();
-                    if (error == ERROR_TIMEOUT || error == ERROR_HOST_UNREACHABLE)
-                    {
-                        if (stop) break;
-                        continue;
-                    }
-                    if (error == ERROR_INVALID_HANDLE || error == ERROR_OPERATION_ABORTED)
-                    {
-                        break;
-                    }
-                    log(WIREGUARD_LOG_ERR, "parser windivert read failed", error);
-                    break;
-                }
-                PWINDIVERT_IPHDR ip_header = NULL;
-                PWINDIVERT_IPV6HDR ipv6_header = NULL;
-                PWINDIVERT_UDPHDR udp_header = NULL;
-
-                WinDivertHelperParsePacket(
-                    packet, packet_l,
-                    &ip_header, &ipv6_header,
-                    NULL, NULL, NULL, NULL,
-                    &udp_header, NULL, NULL, NULL, NULL
-                );
-                if (ip_header == NULL || udp_header == NULL)
-                {
-                    continue; // 非 IPv4/UDP，放行
-                }
-                uint16_t udp_len = ntohs(udp_header->Length);
-                if ((udp_len < (uint16_t)(sizeof(WINDIVERT_UDPHDR) + sizeof(multicast_marker))))
-                {
-                    continue; // 太短不可能是封装包
-                }
+                continue;
+            }
+#if MULTICAST_TRANSPORT_ENABLED
+            // 封装：在 UDP payload 前插入 8 字节标记头，携带原始组播/广播地址供接收端还原
+            {
+                uint32_t orig_dst = ip_header->DstAddr; // 原始组播/广播地址
                 BYTE *payload = (BYTE *)udp_header + sizeof(WINDIVERT_UDPHDR);
+                uint16_t udp_len = ntohs(udp_header->Length);
+                uint16_t payload_len = udp_len - (uint16_t)sizeof(WINDIVERT_UDPHDR);
+
+                // payload 后移 8 字节并写入标记头
+                memmove(payload + sizeof(multicast_marker), payload, payload_len);
                 auto *m = (multicast_marker *)payload;
-                if (m->magic != htonl(MULTICAST_MARKER_MAGIC))
-                {
-                    continue; // 普通 UDP，嗅探模式不干预，放行
-                }
+                m->magic = htonl(MULTICAST_MARKER_MAGIC);
+                m->orig_dst_addr = orig_dst;
 
-                // 识别为隧道组播，执行还原
-                uint32_t orig_dst = m->orig_dst_addr;
-                uint16_t payload_len = udp_len - (uint16_t)(sizeof(WINDIVERT_UDPHDR) + sizeof(multicast_marker));
-                // 剥掉 8 字节标记头
-                memmove(payload, payload + sizeof(multicast_marker), payload_len);
-                udp_header->Length = htons((uint16_t)sizeof(WINDIVERT_UDPHDR) + payload_len);
-                ip_header->Length = htons(ntohs(ip_header->Length) - (uint16_t)sizeof(multicast_marker));
-                packet_l -= (uint32_t)sizeof(multicast_marker);
-                // 恢复原始组播/广播目标地址
+                // 同步更新 UDP/IP 长度与总包长
+                udp_header->Length = htons(udp_len + (uint16_t)sizeof(multicast_marker));
+                ip_header->Length = htons(ntohs(ip_header->Length) + (uint16_t)sizeof(multicast_marker));
+                packet_l += (uint32_t)sizeof(multicast_marker);
+            }
+#endif
+            // 封装只做一次，各房间只改写地址后发送；复制上传需要原广播地址，每个房间前恢复
+            const uint32_t orig_dst = ip_header->DstAddr;
+            const uint16_t channel = ntohs(udp_header->DstPort);
+            std::shared_lock<std::shared_mutex> lock(rooms_lock);
+            for (const auto &t : rooms)
+            {
                 ip_header->DstAddr = orig_dst;
-                // 方向为入站；接口置 0 由系统自动选网卡，避免再次命中本 filter 造成环路
-                addr.Outbound = 0;
-                addr.Network.IfIdx = 0;
-                addr.Network.SubIfIdx = 0;
-                if (!WinDivertHelperCalcChecksums(packet, packet_l, &addr, 0))
+                t->forward(h, packet, packet_l, ip_header, addr, channel);
+            }
+        }
+        // 接收线程自行关闭句柄，避免与 shutdown 跨线程关闭产生竞争
+        WinDivertClose(h);
+        windivert_handle.store(NULL, std::memory_order_release);
+        log(WIREGUARD_LOG_INFO, "stop layer 3 broadcast transport with filter:" + filter);
+    }
+
+#if MULTICAST_TRANSPORT_ENABLED
+    // 接收端：识别从房间 wireguard 网卡进入的隧道组播并还原
+    void parser_loop(HANDLE rx, HANDLE inject, const std::string &rx_filter)
+    {
+        WINDIVERT_ADDRESS addr;
+        char packet[0xffff];
+        uint32_t packet_l;
+        while (!stop)
+        {
+            if (!WinDivertRecv(rx, packet, sizeof(packet), &packet_l, &addr))
+            {
+                auto error = GetLastError();
+                if (error == ERROR_TIMEOUT || error == ERROR_HOST_UNREACHABLE)
                 {
+                    if (stop) break;
                     continue;
                 }
-                if (!WinDivertSend(inject, packet, packet_l, nullptr, &addr))
+                if (error == ERROR_INVALID_HANDLE || error == ERROR_OPERATION_ABORTED || error == ERROR_NO_DATA)
                 {
-                    log(WIREGUARD_LOG_ERR, "parser inject failed", GetLastError());
+                    break;
                 }
+                log(WIREGUARD_LOG_ERR, "parser windivert read failed", error);
+                break;
             }
-            // 线程自行关闭句柄，避免与 stop_trans 竞争
-            WinDivertClose(inject);
-            inject_handle.store(NULL, std::memory_order_release);
-            WinDivertClose(rx);
-            rx_handle.store(NULL, std::memory_order_release);
-            log(WIREGUARD_LOG_INFO, "stop parser with filter: " + rx_filter);
-        });
-        parser_thread.detach();
-#endif
-        braoder_thread.detach();
-    }
+            PWINDIVERT_IPHDR ip_header = NULL;
+            PWINDIVERT_IPV6HDR ipv6_header = NULL;
+            PWINDIVERT_UDPHDR udp_header = NULL;
 
-private:
-    // 需要转发的ip地址
-    std::unordered_set<uint32_t> peers;
-    std::shared_mutex peer_rw_lock;
-    std::thread braoder_thread;
-    std::thread parser_thread;
-    std::atomic<bool> stop{false};
-    uint32_t wg_ip{INADDR_NONE};             // wg 网卡虚拟 IP，泛洪注入时的源地址
-    static std::atomic<HANDLE> windivert_handle; // 发送端嗅探句柄
-    static std::atomic<HANDLE> rx_handle;        // 接收端嗅探句柄
-    static std::atomic<HANDLE> inject_handle;    // 接收端注入句柄
-    transporter() = default;
+            WinDivertHelperParsePacket(
+                packet, packet_l,
+                &ip_header, &ipv6_header,
+                NULL, NULL, NULL, NULL,
+                &udp_header, NULL, NULL, NULL, NULL
+            );
+            if (ip_header == NULL || udp_header == NULL)
+            {
+                continue; // 非 IPv4/UDP，放行
+            }
+            uint16_t udp_len = ntohs(udp_header->Length);
+            if ((udp_len < (uint16_t)(sizeof(WINDIVERT_UDPHDR) + sizeof(multicast_marker))))
+            {
+                continue; // 太短不可能是封装包
+            }
+            BYTE *payload = (BYTE *)udp_header + sizeof(WINDIVERT_UDPHDR);
+            auto *m = (multicast_marker *)payload;
+            if (m->magic != htonl(MULTICAST_MARKER_MAGIC))
+            {
+                continue; // 普通 UDP，嗅探模式不干预，放行
+            }
+
+            // 识别为隧道组播，执行还原
+            uint32_t orig_dst = m->orig_dst_addr;
+            uint16_t payload_len = udp_len - (uint16_t)(sizeof(WINDIVERT_UDPHDR) + sizeof(multicast_marker));
+            // 剥掉 8 字节标记头
+            memmove(payload, payload + sizeof(multicast_marker), payload_len);
+            udp_header->Length = htons((uint16_t)sizeof(WINDIVERT_UDPHDR) + payload_len);
+            ip_header->Length = htons(ntohs(ip_header->Length) - (uint16_t)sizeof(multicast_marker));
+            packet_l -= (uint32_t)sizeof(multicast_marker);
+            // 恢复原始组播/广播目标地址
+            ip_header->DstAddr = orig_dst;
+            // 方向为入站；接口置 0 由系统自动选网卡，避免再次命中本 filter 造成环路
+            addr.Outbound = 0;
+            addr.Network.IfIdx = 0;
+            addr.Network.SubIfIdx = 0;
+            if (!WinDivertHelperCalcChecksums(packet, packet_l, &addr, 0))
+            {
+                continue;
+            }
+            if (!WinDivertSend(inject, packet, packet_l, nullptr, &addr))
+            {
+                log(WIREGUARD_LOG_ERR, "parser inject failed", GetLastError());
+            }
+        }
+        // 线程自行关闭句柄，避免与 shutdown 竞争
+        WinDivertClose(inject);
+        inject_handle.store(NULL, std::memory_order_release);
+        WinDivertClose(rx);
+        rx_handle.store(NULL, std::memory_order_release);
+        log(WIREGUARD_LOG_INFO, "stop parser with filter: " + rx_filter);
+    }
+#endif
 };
 
 #if MULTICAST_TRANSPORT_ENABLED
-const char *transporter::multicast_filter = "outbound and (ip.DstAddr == 255.255.255.255 or (ip.DstAddr >= 224.0.0.0 and ip.DstAddr <= 239.255.255.255)) and ifIdx !=";
+const char *capture_hub::multicast_filter = "outbound and (ip.DstAddr == 255.255.255.255 or (ip.DstAddr >= 224.0.0.0 and ip.DstAddr <= 239.255.255.255))";
 #else
-const char *transporter::multicast_filter = "outbound and (ip.DstAddr == 255.255.255.255) and ifIdx !=";
+const char *capture_hub::multicast_filter = "outbound and (ip.DstAddr == 255.255.255.255)";
 #endif
-transporter transporter::bt_instance;
-std::atomic<HANDLE> transporter::windivert_handle{NULL};
-std::atomic<HANDLE> transporter::rx_handle{NULL};
-std::atomic<HANDLE> transporter::inject_handle{NULL};
-
-extern "C"
-{
-    EXPORT void add_trans_ips(const char **ips, size_t count)
-    {
-        transporter::getInstance().add_ips(ips, count);
-    }
-
-    EXPORT void del_trans_ips(const char **ips, size_t count)
-    {
-        transporter::getInstance().del_ips(ips, count);
-    }
-}
+capture_hub capture_hub::hub_instance;
@@ -0,0 +1,332 @@
+#include "src/wireguard.h"
+#include "wireguard_tool.cpp"
+#include "hole_punch.cpp"
+#include "src/windivert.h"
+#include "thread"
+#include "atomic"
+#include "mutex"
+#include "condition_variable"
+#include "vector"
+#include "chrono"
+
+#pragma once
+
+#pragma comment(lib, "lib/src/WinDivert.lib")
+
+// 探测报文捕获句柄的优先级，高于广播嗅探句柄
+static constexpr INT16 DIVERT_PROBE_PRIORITY = 100;
+// 注入报文的 TTL/HopLimit
+static constexpr UINT8 DIVERT_PROBE_TTL = 64;
+// 源地址查询结果的缓存时长(ms)，网络切换后最迟在此时间后改用新地址
+static constexpr uint32_t DIVERT_ROUTE_TTL_MS = 10000;
+static constexpr size_t DIVERT_ROUTE_LIMIT = 64;
+
+/**
+ * WireGuard 监听端口上的打洞引擎：punch_core 通过 WinDivert 收发探测报文
+ * 出站探测以 wg 监听端口为源端口注入，NAT 为探测建立的映射就是隧道使用的映射；
+ * 入站探测按报文标识在到达 wg 套接字之前被捕获并消费，隧道不会收到非 WireGuard 报文。
+ * 接口与 punch_engine 相同，状态机在 Linux 上通过 punch_engine 测试
+ */
+class divert_prober
+{
+    struct route_entry
+    {
+        sockaddr_storage dst;
+        sockaddr_storage src;
+        std::chrono::steady_clock::time_point at;
+    };
+
+    HANDLE rx = INVALID_HANDLE_VALUE; // 捕获句柄，消费匹配的探测报文
+    HANDLE tx = INVALID_HANDLE_VALUE; // 只发送的注入句柄
+    uint16_t bound_port = 0;
+    punch_core core{[this](const sockaddr_storage &to, const uint8_t *data, size_t len)
+                    { inject(to, data, len); },
+                    [](int family)
+                    { return family == AF_INET || family == AF_INET6; }};
+    std::function<void(const punch_result &)> callback;
+    std::thread receiver;
+    std::thread pacer;
+    std::atomic<bool> stopping{false};
+    // 新连接或触发检查需要提前唤醒重发线程
+    std::mutex wake_lock;
+    std::condition_variable wake_cv;
+    bool woken = false;
+    // 目标地址到本机源地址的缓存，叶子锁
+    std::mutex route_lock;
+    std::vector<route_entry> routes;
+
+    // 按路由表查询发往 to 时使用的本机地址：连接一个不发送数据的 UDP 套接字后读取本端地址
+    bool source_for(const sockaddr_storage &to, sockaddr_storage &src)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> guard(route_lock);
+            for (const auto &r : routes)
+            {
+                if (punch_same_host(r.dst, to) && now - r.at < std::chrono::milliseconds(DIVERT_ROUTE_TTL_MS))
+                {
+                    src = r.src;
+                    return true;
+                }
+            }
+        }
+        const punch_socket s = socket(to.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+        if (s == PUNCH_INVALID_SOCKET)
+            return false;
+        socklen_t len = sizeof(src);
+        const bool ok = ::connect(s, reinterpret_cast<const sockaddr *>(&to), punch_addr_len(to)) == 0 &&
+                        getsockname(s, reinterpret_cast<sockaddr *>(&src), &len) == 0;
+        punch_close(s);
+        if (!ok)
+            return false;
+        std::lock_guard<std::mutex> guard(route_lock);
+        routes.erase(std::remove_if(routes.begin(), routes.end(), [&to](const route_entry &r)
+                                    { return punch_same_host(r.dst, to); }),
+                     routes.end());
+        if (routes.size() >= DIVERT_ROUTE_LIMIT)
+            routes.erase(routes.begin());
+        routes.push_back({to, src, now});
+        return true;
+    }
+
+    // 构造以 wg 监听端口为源端口的 IP/UDP 报文并按目标地址路由注入
+    void inject(const sockaddr_storage &to, const uint8_t *data, size_t len)
+    {
+        sockaddr_storage src{};
+        if (tx == INVALID_HANDLE_VALUE || !source_for(to, src))
+            return;
+        char packet[sizeof(WINDIVERT_IPV6HDR) + sizeof(WINDIVERT_UDPHDR) + PUNCH_RESPONSE_SIZE] = {};
+        size_t ip_len;
+        WINDIVERT_ADDRESS addr{};
+        if (to.ss_family == AF_INET)
+        {
+            auto *ip = reinterpret_cast<PWINDIVERT_IPHDR>(packet);
+            ip->Version = 4;
+            ip->HdrLength = sizeof(WINDIVERT_IPHDR) / 4;
+            ip->Length = htons(static_cast<UINT16>(sizeof(WINDIVERT_IPHDR) + sizeof(WINDIVERT_UDPHDR) + len));
+            ip->TTL = DIVERT_PROBE_TTL;
+            ip->Protocol = IPPROTO_UDP;
+            ip->SrcAddr = reinterpret_cast<const sockaddr_in &>(src).sin_addr.s_addr;
+            ip->DstAddr = reinterpret_cast<const sockaddr_in &>(to).sin_addr.s_addr;
+            ip_len = sizeof(WINDIVERT_IPHDR);
+        }
+        else
+        {
+            auto *ip6 = reinterpret_cast<PWINDIVERT_IPV6HDR>(packet);
+            ip6->Version = 6;
+            ip6->Length = htons(static_cast<UINT16>(sizeof(WINDIVERT_UDPHDR) + len));
+            ip6->NextHdr = IPPROTO_UDP;
+            ip6->HopLimit = DIVERT_PROBE_TTL;
+            memcpy(ip6->SrcAddr, &reinterpret_cast<const sockaddr_in6 &>(src).sin6_addr, 16);
+            memcpy(ip6->DstAddr, &reinterpret_cast<const sockaddr_in6 &>(to).sin6_addr, 16);
+            ip_len = sizeof(WINDIVERT_IPV6HDR);
+            addr.IPv6 = 1;
+        }
+        auto *udp = reinterpret_cast<PWINDIVERT_UDPHDR>(packet + ip_len);
+        udp->SrcPort = htons(bound_port);
+        udp->DstPort = htons(punch_port(to));
+        udp->Length = htons(static_cast<UINT16>(sizeof(WINDIVERT_UDPHDR) + len));
+        memcpy(packet + ip_len + sizeof(WINDIVERT_UDPHDR), data, len);
+        const auto packet_l = static_cast<UINT>(ip_len + sizeof(WINDIVERT_UDPHDR) + len);
+        // IfIdx/SubIfIdx 同时置 0，按目标地址自动路由到物理网卡
+        addr.Outbound = 1;
+        addr.Network.IfIdx = 0;
+        addr.Network.SubIfIdx = 0;
+        if (!WinDivertHelperCalcChecksums(packet, packet_l, &addr, 0) || !WinDivertSend(tx, packet, packet_l, nullptr, &addr))
+            log(WIREGUARD_LOG_WARN, "probe inject failed to " + format_candidate(to), GetLastError());
+    }
+
+    void wake()
+    {
+        {
+            std::lock_guard<std::mutex> guard(wake_lock);
+            woken = true;
+        }
+        wake_cv.notify_all();
+    }
+
+    void report(const std::vector<punch_result> &done)
+    {
+        for (const auto &r : done)
+        {
+            if (callback)
+                callback(r);
+        }
+    }
+
+    // 捕获线程：解析探测报文交给状态机，报文不再重新注入
+    void receive_loop()
+    {
+        WINDIVERT_ADDRESS addr;
+        char packet[0xffff];
+        UINT packet_l;
+        std::vector<punch_result> done;
+        while (!stopping)
+        {
+            if (!WinDivertRecv(rx, packet, sizeof(packet), &packet_l, &addr))
+            {
+                auto error = GetLastError();
+                if (error == ERROR_TIMEOUT || error == ERROR_HOST_UNREACHABLE)
+                    continue;
+                if (error != ERROR_INVALID_HANDLE && error != ERROR_OPERATION_ABORTED && error != ERROR_NO_DATA)
+                    log(WIREGUARD_LOG_ERR, "probe windivert read failed", error);
+                break;
+            }
+            PWINDIVERT_IPHDR ip_header = NULL;
+            PWINDIVERT_IPV6HDR ipv6_header = NULL;
+            PWINDIVERT_UDPHDR udp_header = NULL;
+            PVOID payload = NULL;
+            UINT payload_l = 0;
+            WinDivertHelperParsePacket(packet, packet_l, &ip_header, &ipv6_header, NULL, NULL, NULL, NULL,
+                                       &udp_header, &payload, &payload_l, NULL, NULL);
+            if (udp_header == NULL || payload == NULL)
+                continue;
+            sockaddr_storage from{};
+            if (ip_header != NULL)
+            {
+                auto &in = reinterpret_cast<sockaddr_in &>(from);
+                in.sin_family = AF_INET;
+                in.sin_addr.s_addr = ip_header->SrcAddr;
+                in.sin_port = udp_header->SrcPort;
+            }
+            else if (ipv6_header != NULL)
+            {
+                auto &in6 = reinterpret_cast<sockaddr_in6 &>(from);
+                in6.sin6_family = AF_INET6;
+                memcpy(&in6.sin6_addr, ipv6_header->SrcAddr, 16);
+                in6.sin6_port = udp_header->SrcPort;
+            }
+            else
+            {
+                continue;
+            }
+            core.on_message(static_cast<const uint8_t *>(payload), payload_l, from, std::chrono::steady_clock::now(), done);
+            // 触发检查由重发线程立即发出
+            wake();
+            report(done);
+            done.clear();
+        }
+    }
+
+    // 重发线程：按状态机给出的时间发送到期的检查并处理超时
+    void pace_loop()
+    {
+        std::vector<punch_result> done;
+        while (!stopping)
+        {
+            const auto now = std::chrono::steady_clock::now();
+            const auto wake_at = core.poll(now, done);
+            report(done);
+            done.clear();
+            const auto limit = now + std::chrono::milliseconds(PUNCH_IDLE_WAIT_MS);
+            std::unique_lock<std::mutex> guard(wake_lock);
+            wake_cv.wait_until(guard, wake_at < limit ? wake_at : limit, [this]
+                               { return woken || stopping; });
+            woken = false;
+        }
+    }
+
+public:
+    divert_prober() = default;
+    divert_prober(const divert_prober &) = delete;
+    divert_prober &operator=(const divert_prober &) = delete;
+
+    ~divert_prober()
+    {
+        stop();
+    }
+
+    /**
+     * 在 wg 监听端口上启动，已启动时按新端口重启，进行中的连接不再回调
+     * 端口由 wireguard 网卡占用，这里不绑定套接字，只按端口与报文标识捕获
+     */
+    bool start(uint16_t port, std::function<void(const punch_result &)> cb)
+    {
+        stop();
+        if (port == 0)
+            return false;
+        const std::string filter = "inbound and !loopback and udp.DstPort == " + std::to_string(port) +
+                                   " and udp.PayloadLength >= " + std::to_string(PUNCH_REQUEST_SIZE) +
+                                   " and udp.Payload32[0] == " + std::to_string(PUNCH_MAGIC);
+        rx = WinDivertOpen(filter.c_str(), WINDIVERT_LAYER_NETWORK, DIVERT_PROBE_PRIORITY, 0);
+        if (rx == INVALID_HANDLE_VALUE || rx == NULL)
+        {
+            rx = INVALID_HANDLE_VALUE;
+            return false;
+        }
+        tx = WinDivertOpen("false", WINDIVERT_LAYER_NETWORK, DIVERT_PROBE_PRIORITY, WINDIVERT_FLAG_SEND_ONLY);
+        if (tx == INVALID_HANDLE_VALUE || tx == NULL)
+        {
+            tx = INVALID_HANDLE_VALUE;
+            WinDivertClose(rx);
+            rx = INVALID_HANDLE_VALUE;
+            return false;
+        }
+        log(WIREGUARD_LOG_INFO, "probe run with filter: " + filter);
+        bound_port = port;
+        callback = std::move(cb);
+        stopping = false;
+        receiver = std::thread([this]
+                               { receive_loop(); });
+        pacer = std::thread([this]
+                            { pace_loop(); });
+        return true;
+    }
+
+    void stop()
+    {
+        stopping = true;
+        // 让阻塞中的 WinDivertRecv 立即返回，捕获线程随后退出
+        if (rx != INVALID_HANDLE_VALUE)
+            WinDivertShutdown(rx, WINDIVERT_SHUTDOWN_BOTH);
+        wake();
+        if (receiver.joinable())
+            receiver.join();
+        if (pacer.joinable())
+            pacer.join();
+        if (rx != INVALID_HANDLE_VALUE)
+            WinDivertClose(rx);
+        if (tx != INVALID_HANDLE_VALUE)
+            WinDivertClose(tx);
+        rx = INVALID_HANDLE_VALUE;
+        tx = INVALID_HANDLE_VALUE;
+        bound_port = 0;
+        core.clear();
+    }
+
+    bool running() const
+    {
+        return receiver.joinable();
+    }
+
+    uint16_t port() const
+    {
+        return bound_port;
+    }
+
+    // 本端候选：各网卡地址上的 wg 监听端口加上已学到的 wg 端口映射地址
+    std::vector<punch_candidate> local_candidates()
+    {
+        auto out = punch_host_candidates(bound_port, true, true);
+        for (const auto &c : core.reflexive_candidates())
+            out.push_back(c);
+        return out;
+    }
+
+    // 向候选地址并发发起检查，返回连接 id，结果通过回调返回，未启动或没有可用候选返回 0
+    uint64_t connect(uint64_t session, std::vector<punch_candidate> remote, uint32_t timeout_ms, int32_t port_delta = 0)
+    {
+        if (!running())
+            return 0;
+        const auto id = core.connect(session, std::move(remote), timeout_ms, port_delta);
+        if (id != 0)
+            wake();
+        return id;
+    }
+
+    // 取消进行中的连接，不再回调
+    void cancel(uint64_t id)
+    {
+        core.cancel(id);
+    }
+};
@@ -0,0 +1,480 @@
+#include "hole_punch.cpp"
+#include "algorithm"
+#include "chrono"
+#include "condition_variable"
+#include "deque"
+#include "functional"
+#include "future"
+#include "mutex"
+#include "random"
+#include "string"
+#include "thread"
+#include "vector"
+
+#ifdef _WIN32
+#include "windns.h"
+#pragma comment(lib, "dnsapi.lib")
+#else
+#include <netdb.h>
+#endif
+
+#pragma once
+
+// 记录 TTL 的下限与上限(s)，无法取得 TTL 时（getaddrinfo）使用默认值
+static constexpr uint32_t DNS_MIN_TTL_S = 30;
+static constexpr uint32_t DNS_MAX_TTL_S = 3600;
+static constexpr uint32_t DNS_DEFAULT_TTL_S = 60;
+// 解析失败的缓存时长(s)，期间同一域名直接返回失败
+static constexpr uint32_t DNS_NEGATIVE_TTL_S = 5;
+// 过期后仍可使用的时长(s)：期间立即返回旧结果并在后台刷新，重复加入房间不等待解析
+static constexpr uint32_t DNS_STALE_S = 24 * 3600;
+// 缓存域名数上限
+static constexpr size_t DNS_CACHE_LIMIT = 256;
+// happy eyeballs：先向 IPv6 发检查，DNS_HE_DELAY_MS 后向 IPv4 发，DNS_HE_RESEND_MS 重发一次，最长等待 DNS_HE_WAIT_MS
+static constexpr uint32_t DNS_HE_DELAY_MS = 50;
+static constexpr uint32_t DNS_HE_RESEND_MS = 150;
+static constexpr uint32_t DNS_HE_WAIT_MS = 300;
+
+// 单个地址族的解析结果
+struct dns_answer
+{
+    bool ok;
+    uint32_t ttl_s;
+    std::vector<sockaddr_storage> addrs;
+};
+
+// 查询单个地址族，Windows 使用 DnsQuery 取得记录 TTL，其他平台使用 getaddrinfo 与默认 TTL
+inline dns_answer dns_query(const std::string &host, int family)
+{
+    dns_answer out{false, DNS_DEFAULT_TTL_S, {}};
+#ifdef _WIN32
+    PDNS_RECORD records = nullptr;
+    const WORD type = family == AF_INET6 ? DNS_TYPE_AAAA : DNS_TYPE_A;
+    if (DnsQuery_A(host.c_str(), type, DNS_QUERY_STANDARD, nullptr, &records, nullptr) != 0)
+        return out;
+    uint32_t ttl = DNS_MAX_TTL_S;
+    for (auto *r = records; r != nullptr; r = r->pNext)
+    {
+        // 应答中可能含 CNAME 链，只取目标类型
+        if (r->wType != type || r->Flags.S.Section != DnsSectionAnswer)
+            continue;
+        sockaddr_storage addr{};
+        if (type == DNS_TYPE_A)
+        {
+            auto &in = reinterpret_cast<sockaddr_in &>(addr);
+            in.sin_family = AF_INET;
+            in.sin_addr.s_addr = r->Data.A.IpAddress;
+        }
+        else
+        {
+            auto &in6 = reinterpret_cast<sockaddr_in6 &>(addr);
+            in6.sin6_family = AF_INET6;
+            memcpy(&in6.sin6_addr, r->Data.AAAA.Ip6Address.IP6Byte, sizeof(in6.sin6_addr));
+        }
+        out.addrs.push_back(addr);
+        ttl = std::min<uint32_t>(ttl, r->dwTtl);
+    }
+    DnsRecordListFree(records, DnsFreeRecordList);
+    out.ttl_s = ttl;
+#else
+    addrinfo hints{};
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo *res = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &res) != 0)
+        return out;
+    for (auto *p = res; p != nullptr; p = p->ai_next)
+    {
+        if (p->ai_family != family)
+            continue;
+        sockaddr_storage addr{};
+        memcpy(&addr, p->ai_addr, p->ai_addrlen);
+        punch_set_port(addr, 0);
+        if (std::none_of(out.addrs.begin(), out.addrs.end(), [&addr](const sockaddr_storage &a)
+                         { return punch_same_addr(a, addr); }))
+            out.addrs.push_back(addr);
+    }
+    freeaddrinfo(res);
+#endif
+    out.ok = !out.addrs.empty();
+    return out;
+}
+
+/**
+ * happy eyeballs（RFC 8305 的 UDP 版本）：向两个地址族的首选地址发送打洞检查，IPv6 先发，先应答的地址族胜出
+ * 对方 wg 端口未运行探测引擎时都不会应答，此时返回 AF_INET，与只解析 A 记录的旧行为一致
+ */
+inline int happy_eyeballs(const sockaddr_storage &v6, const sockaddr_storage &v4)
+{
+    const sockaddr_storage *targets[] = {&v6, &v4};
+    punch_socket sockets[] = {punch_open(AF_INET6, 0), punch_open(AF_INET, 0)};
+    uint64_t nonces[2] = {};
+    std::mt19937_64 rng{std::random_device{}()};
+    const auto start = std::chrono::steady_clock::now();
+    const auto deadline = start + std::chrono::milliseconds(DNS_HE_WAIT_MS);
+    // 每个地址族的两次发送时间
+    const std::chrono::milliseconds sends[2][2] = {
+        {std::chrono::milliseconds(0), std::chrono::milliseconds(DNS_HE_RESEND_MS)},
+        {std::chrono::milliseconds(DNS_HE_DELAY_MS), std::chrono::milliseconds(DNS_HE_DELAY_MS + DNS_HE_RESEND_MS)},
+    };
+    size_t sent[2] = {};
+    int winner = AF_INET;
+    uint8_t buf[512];
+    bool done = false;
+    while (!done)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline)
+            break;
+        auto wake = deadline;
+        for (int k = 0; k < 2; k++)
+        {
+            if (sockets[k] == PUNCH_INVALID_SOCKET)
+                continue;
+            if (sent[k] < 2 && now >= start + sends[k][sent[k]])
+            {
+                if (sent[k] == 0)
+                    nonces[k] = rng();
+                punch_message req{PUNCH_REQUEST, 0, PUNCH_PROBE_SESSION, nonces[k], {}};
+                const size_t len = req.encode(buf);
+                sendto(sockets[k], reinterpret_cast<const char *>(buf), static_cast<int>(len), 0,
+                       reinterpret_cast<const sockaddr *>(targets[k]), punch_addr_len(*targets[k]));
+                sent[k]++;
+            }
+            if (sent[k] < 2 && start + sends[k][sent[k]] < wake)
+                wake = start + sends[k][sent[k]];
+        }
+        pollfd fds[2];
+        int owner[2];
+        size_t n = 0;
+        for (int k = 0; k < 2; k++)
+        {
+            if (sockets[k] != PUNCH_INVALID_SOCKET && sent[k] > 0)
+            {
+                fds[n] = {sockets[k], POLLIN, 0};
+                owner[n++] = k;
+            }
+        }
+        if (n == 0 || punch_poll(fds, n, punch_wait_ms(wake, now, static_cast<int>(DNS_HE_WAIT_MS))) <= 0)
+            continue;
+        for (size_t i = 0; i < n && !done; i++)
+        {
+            if ((fds[i].revents & POLLIN) == 0)
+                continue;
+            const int k = owner[i];
+            sockaddr_storage from{};
+            socklen_t from_len = sizeof(from);
+            const auto len = recvfrom(fds[i].fd, reinterpret_cast<char *>(buf), sizeof(buf), 0,
+                                      reinterpret_cast<sockaddr *>(&from), &from_len);
+            punch_message reply{};
+            if (len > 0 && reply.decode(buf, static_cast<size_t>(len)) && reply.type == PUNCH_RESPONSE &&
+                reply.nonce == nonces[k] && punch_same_addr(from, *targets[k]))
+            {
+                winner = k == 0 ? AF_INET6 : AF_INET;
+                done = true;
+            }
+        }
+    }
+    for (const auto s : sockets)
+    {
+        if (s != PUNCH_INVALID_SOCKET)
+            punch_close(s);
+    }
+    return winner;
+}
+
+/**
+ * 成员 endpoint 的域名解析缓存单例
+ * A 与 AAAA 并发查询，按记录 TTL 缓存；两个地址族都有地址时以 happy eyeballs 选择地址族并随条目缓存。
+ * 过期不超过 DNS_STALE_S 的条目立即返回并交给后台线程刷新，只有首次遇到的域名需要等待解析
+ */
+class dns_cache
+{
+    struct entry
+    {
+        std::string host;
+        std::vector<sockaddr_storage> v4;
+        std::vector<sockaddr_storage> v6;
+        int family; // 选中的地址族，解析失败为 0
+        std::chrono::steady_clock::time_point expires;
+        bool refreshing;
+    };
+
+    std::mutex lock;
+    std::vector<entry> entries;
+    // 后台刷新队列与线程
+    std::condition_variable cv;
+    std::deque<std::pair<std::string, uint16_t>> refreshes;
+    std::thread worker;
+    bool stopped = false;
+
+    dns_cache() = default;
+
+    entry *find(const std::string &host)
+    {
+        for (auto &e : entries)
+        {
+            if (e.host == host)
+                return &e;
+        }
+        return nullptr;
+    }
+
+    // 解析并选择地址族，不持有锁
+    entry query(const std::string &host, uint16_t port, std::chrono::steady_clock::time_point now)
+    {
+        auto v6 = std::async(std::launch::async, resolver, host, AF_INET6);
+        const auto v4 = resolver(host, AF_INET);
+        const auto a6 = v6.get();
+        entry e{host, v4.addrs, a6.addrs, 0, {}, false};
+        if (!v4.ok && !a6.ok)
+        {
+            e.expires = now + std::chrono::seconds(DNS_NEGATIVE_TTL_S);
+            return e;
+        }
+        uint32_t ttl = DNS_MAX_TTL_S;
+        for (const auto *a : {&v4, &a6})
+        {
+            if (a->ok)
+                ttl = std::min(ttl, a->ttl_s);
+        }
+        e.expires = now + std::chrono::seconds(std::max(ttl, DNS_MIN_TTL_S));
+        e.family = a6.ok ? AF_INET6 : AF_INET;
+        if (v4.ok && a6.ok)
+        {
+            auto t6 = e.v6.front();
+            auto t4 = e.v4.front();
+            punch_set_port(t6, port);
+            punch_set_port(t4, port);
+            e.family = happy_eyeballs(t6, t4);
+        }
+        return e;
+    }
+
+    void store(entry e)
+    {
+        if (auto *old = find(e.host))
+        {
+            // 刷新失败时保留旧地址，直到超过可用期限
+            if (e.family == 0 && old->family != 0)
+            {
+                old->refreshing = false;
+                return;
+            }
+            *old = std::move(e);
+            return;
+        }
+        if (entries.size() >= DNS_CACHE_LIMIT)
+        {
+            entries.erase(std::min_element(entries.begin(), entries.end(), [](const entry &a, const entry &b)
+                                           { return a.expires < b.expires; }));
+        }
+        entries.push_back(std::move(e));
+    }
+
+    void work()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true)
+        {
+            cv.wait(guard, [this]
+                    { return stopped || !refreshes.empty(); });
+            if (stopped)
+                break;
+            const auto [host, port] = refreshes.front();
+            refreshes.pop_front();
+            guard.unlock();
+            auto e = query(host, port, std::chrono::steady_clock::now());
+            guard.lock();
+            store(std::move(e));
+        }
+    }
+
+    static bool pick(const entry &e, uint16_t port, sockaddr_storage &out)
+    {
+        const auto &addrs = e.family == AF_INET6 ? e.v6 : e.v4;
+        if (addrs.empty())
+            return false;
+        out = addrs.front();
+        punch_set_port(out, port);
+        return true;
+    }
+
+public:
+    static dns_cache dns_instance;
+
+    // 单个地址族的查询函数，自测时替换为模拟实现
+    std::function<dns_answer(const std::string &, int)> resolver = dns_query;
+
+    dns_cache(const dns_cache &) = delete;
+    dns_cache &operator=(const dns_cache &) = delete;
+
+    static dns_cache &getInstance()
+    {
+        return dns_instance;
+    }
+
+    /**
+     * 解析 endpoint，host 为 IP 文本时直接转换
+     * 未过期的条目直接返回；过期不超过 DNS_STALE_S 的条目返回旧地址并提交后台刷新；未缓存时同步解析
+     */
+    bool resolve(const std::string &host, uint16_t port, sockaddr_storage &out,
+                 std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now())
+    {
+        punch_candidate numeric{};
+        if (parse_candidate(host.find(':') != std::string::npos ? "[" + host + "]:" + std::to_string(port) : host + ":" + std::to_string(port), numeric))
+        {
+            out = numeric.addr;
+            return true;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (auto *e = find(host))
+            {
+                if (now < e->expires)
+                    return pick(*e, port, out);
+                if (e->family != 0 && now < e->expires + std::chrono::seconds(DNS_STALE_S))
+                {
+                    if (!e->refreshing && !stopped)
+                    {
+                        e->refreshing = true;
+                        refreshes.emplace_back(host, port);
+                        if (!worker.joinable())
+                            worker = std::thread([this]
+                                                 { work(); });
+                        cv.notify_one();
+                    }
+                    return pick(*e, port, out);
+                }
+            }
+        }
+        auto e = query(host, port, now);
+        const bool ok = pick(e, port, out);
+        std::lock_guard<std::mutex> guard(lock);
+        store(std::move(e));
+        return ok;
+    }
+
+    // 域名是否可以不等待解析直接使用（未过期，或过期后仍在可用期限内）
+    bool cached(const std::string &host, std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now())
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        const auto *e = find(host);
+        return e != nullptr && e->family != 0 && now < e->expires + std::chrono::seconds(DNS_STALE_S);
+    }
+
+    // 停止后台刷新并清空缓存
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopped = true;
+        }
+        cv.notify_all();
+        if (worker.joinable())
+            worker.join();
+        std::lock_guard<std::mutex> guard(lock);
+        entries.clear();
+        refreshes.clear();
+        stopped = false;
+    }
+};
+
+dns_cache dns_cache::dns_instance;
+
+#ifdef DNS_CACHE_SELFTEST
+// 本地自测：bash lib/selftest.sh dns_cache
+#include "selftest_compat.h"
+#include "atomic"
+#include "iostream"
+
+int main()
+{
+    const auto elapsed_ms = [](std::chrono::steady_clock::time_point since)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - since).count();
+    };
+    auto &cache = dns_cache::getInstance();
+
+    // 模拟 DNS：每次查询耗时 100ms，记录查询次数
+    std::atomic<int> queries{0};
+    std::atomic<bool> broken{false};
+    cache.resolver = [&queries, &broken](const std::string &host, int family)
+    {
+        queries++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        dns_answer a{false, 120, {}};
+        if (broken || host == "nx.example" || family == AF_INET6)
+            return a;
+        punch_candidate c{};
+        parse_candidate(host == "moved.example" ? "198.51.100.9:0" : "198.51.100.7:0", c);
+        a.addrs.push_back(c.addr);
+        a.ok = true;
+        return a;
+    };
+
+    sockaddr_storage out{};
+    auto start = std::chrono::steady_clock::now();
+    expect(cache.resolve("203.0.113.5", 51820, out) && queries == 0 && format_candidate(out) == "203.0.113.5:51820", "numeric ipv4 skips dns");
+    expect(cache.resolve("2001:db8::1", 51820, out) && queries == 0 && format_candidate(out) == "[2001:db8::1]:51820", "numeric ipv6 skips dns");
+
+    start = std::chrono::steady_clock::now();
+    const bool first = cache.resolve("peer.example", 51820, out);
+    const auto first_ms = elapsed_ms(start);
+    expect(first && queries == 2 && first_ms < 190 && format_candidate(out) == "198.51.100.7:51820",
+           "a and aaaa queried concurrently in " + std::to_string(first_ms) + "ms");
+
+    start = std::chrono::steady_clock::now();
+    expect(cache.resolve("peer.example", 40000, out) && queries == 2 && elapsed_ms(start) < 10 && punch_port(out) == 40000, "cached lookup does not query");
+
+    // 超过 TTL：立即返回旧地址，后台刷新
+    const auto later = std::chrono::steady_clock::now() + std::chrono::seconds(121);
+    start = std::chrono::steady_clock::now();
+    const bool stale = cache.resolve("peer.example", 51820, out, later);
+    const auto stale_ms = elapsed_ms(start);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    expect(stale && stale_ms < 10 && queries == 4, "stale entry served in " + std::to_string(stale_ms) + "ms, refreshed in background");
+
+    // 刷新失败保留旧地址
+    broken = true;
+    cache.resolve("peer.example", 51820, out, later + std::chrono::seconds(3600));
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    broken = false;
+    expect(cache.resolve("peer.example", 51820, out, later + std::chrono::seconds(3601)) && format_candidate(out) == "198.51.100.7:51820",
+           "failed refresh keeps last address");
+
+    // 解析失败短时缓存，先等待上一步提交的后台刷新完成
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    const int before = queries;
+    expect(!cache.resolve("nx.example", 1, out) && !cache.resolve("nx.example", 1, out) && queries == before + 2, "negative answer cached");
+    expect(!cache.cached("nx.example") && cache.cached("peer.example"), "cached reports usable entries only");
+    cache.close();
+
+    // 真实解析：localhost
+    cache.resolver = dns_query;
+    const bool local = cache.resolve("localhost", 51820, out);
+    expect(local && punch_port(out) == 51820, "localhost resolves to " + format_candidate(out));
+
+    // happy eyeballs：只有应答的地址族胜出，都不应答时回退 IPv4
+    punch_engine responder;
+    responder.start(0, nullptr);
+    punch_candidate live4{}, live6{}, dead4{}, dead6{};
+    parse_candidate("127.0.0.1:" + std::to_string(responder.port()), live4);
+    parse_candidate("[::1]:" + std::to_string(responder.port()), live6);
+    parse_candidate("127.0.0.1:1", dead4);
+    parse_candidate("[::1]:1", dead6);
+    start = std::chrono::steady_clock::now();
+    const int v4_only = happy_eyeballs(dead6.addr, live4.addr);
+    expect(v4_only == AF_INET, "ipv4 wins when ipv6 silent, " + std::to_string(elapsed_ms(start)) + "ms");
+    const int v6 = happy_eyeballs(live6.addr, dead4.addr);
+    if (v6 == AF_INET6)
+        expect(true, "ipv6 wins when ipv4 silent");
+    else
+        std::cout << "skip ipv6 loopback unavailable" << std::endl;
+    start = std::chrono::steady_clock::now();
+    expect(happy_eyeballs(dead6.addr, dead4.addr) == AF_INET && elapsed_ms(start) <= DNS_HE_WAIT_MS + 50, "silent peer falls back to ipv4");
+    responder.stop();
+    cache.close();
+    return selftest_result();
+}
+#endif
@@ -0,0 +1,476 @@
+#ifdef _WIN32
+#include "src/wireguard.h"
+#include "wireguard_tool.cpp"
+#else
+#include "selftest_compat.h"
+#include <cstdio>
+#endif
+#include "mutex"
+#include "vector"
+#include "string"
+#include "chrono"
+#include "algorithm"
+
+#pragma once
+
+// 缓存条目总数上限与单个 peer 的条目上限
+static constexpr size_t ENDPOINT_CACHE_LIMIT = 1024;
+static constexpr size_t ENDPOINT_PER_PEER = 4;
+// 条目有效期(ms)，超过后不再使用并在写盘时丢弃
+static constexpr uint64_t ENDPOINT_CACHE_TTL_MS = 7ull * 24 * 3600 * 1000;
+// 网络指纹缓存时间(ms)，避免每次添加 peer 都枚举网卡
+static constexpr uint64_t NETWORK_FINGERPRINT_TTL_MS = 10000;
+// 缓存 endpoint 等待握手的时间(ms)，超时切回服务器下发的 endpoint
+static constexpr uint32_t ENDPOINT_RACE_MS = 1000;
+// 存在竞速时检查握手的间隔(ms)
+static constexpr uint32_t ENDPOINT_RACE_TICK_MS = 100;
+// 记录握手 endpoint 的间隔(ms)与写盘间隔(ms)
+static constexpr uint32_t ENDPOINT_RECORD_MS = 2000;
+static constexpr uint32_t ENDPOINT_FLUSH_MS = 30000;
+// 最近握手在该时间(ms)内的 endpoint 视为可用，与 wireguard 的 REJECT_AFTER_TIME 一致
+static constexpr uint64_t ENDPOINT_FRESH_MS = 180000;
+// 缓存文件标识与版本
+static constexpr uint32_t ENDPOINT_CACHE_MAGIC = 0x4345454D; // "MEEC"
+static constexpr uint32_t ENDPOINT_CACHE_VERSION = 1;
+
+// 缓存条目，文件中按 72 字节定长存放
+#pragma pack(push, 8)
+struct endpoint_entry
+{
+    uint8_t public_key[WIREGUARD_KEY_LENGTH];
+    uint64_t fingerprint; // 观察到握手时的本地网络指纹
+    uint64_t observed_ms; // 最近一次观察到握手的 unix 毫秒
+    uint8_t addr[16];
+    uint16_t family;
+    uint16_t port; // 网络字节序
+    uint32_t hits;
+};
+#pragma pack(pop)
+static_assert(sizeof(endpoint_entry) == 72, "endpoint_entry layout changed");
+
+// 单个 peer 的 endpoint 竞速状态，由房间持有并受房间锁保护
+struct endpoint_race
+{
+    uint8_t public_key[WIREGUARD_KEY_LENGTH];
+    // 缓存 endpoint 超时未握手时切回的服务器下发 endpoint
+    SOCKADDR_INET fallback;
+    std::chrono::steady_clock::time_point deadline;
+    // 缓存 endpoint 写入适配器时的 unix 毫秒，晚于该时间的握手才算成功
+    uint64_t started_ms;
+};
+
+/**
+ * 用缓存中最新的 endpoint 替换服务器下发的 endpoint，cached 按观察时间从新到旧
+ * 只尝试最新的一个：peer 发起首次握手后，wireguard 对同一 peer 的握手发起限速为 REKEY_TIMEOUT(5s)，
+ * 逐个切换更旧的候选每个都要多等一个限速周期，不如在 ENDPOINT_RACE_MS 后直接回到服务器下发的 endpoint。
+ * @return 需要登记竞速时返回 true，fallback 为服务器下发的 endpoint；没有服务器下发的 endpoint 时只使用缓存，不登记竞速
+ */
+inline bool prefer_cached_endpoint(WIREGUARD_PEER &peer, const std::vector<SOCKADDR_INET> &cached, SOCKADDR_INET &fallback)
+{
+    if (cached.empty())
+        return false;
+    const bool has_server = (peer.Flags & WIREGUARD_PEER_HAS_ENDPOINT) != 0;
+    // 最新的缓存就是服务器下发的 endpoint，无需竞速
+    if (has_server && same_endpoint(cached.front(), peer.Endpoint))
+        return false;
+    fallback = peer.Endpoint;
+    peer.Endpoint = cached.front();
+    peer.Flags |= WIREGUARD_PEER_HAS_ENDPOINT;
+    return has_server;
+}
+
+/**
+ * 本地网络指纹：各个已连接物理网卡的网关地址、DNS 后缀与首个 IPv4 网段的 FNV-1a 哈希
+ * 同一网络下指纹不变，切换 Wi-Fi 或网线后缓存的 endpoint 不再优先使用。跳过 wireguard 等隧道网卡
+ */
+#ifdef _WIN32
+inline uint64_t network_fingerprint()
+{
+    ULONG size = 16 * 1024;
+    std::vector<uint64_t> buffer;
+    IP_ADAPTER_ADDRESSES *list = nullptr;
+    ULONG result = ERROR_BUFFER_OVERFLOW;
+    for (int attempt = 0; attempt < 3 && result == ERROR_BUFFER_OVERFLOW; attempt++)
+    {
+        buffer.resize(size / sizeof(uint64_t) + 1);
+        list = reinterpret_cast<IP_ADAPTER_ADDRESSES *>(buffer.data());
+        result = GetAdaptersAddresses(AF_UNSPEC, GAA_FLAG_INCLUDE_GATEWAYS | GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST,
+                                      nullptr, list, &size);
+    }
+    if (result != NO_ERROR)
+        return 0;
+    std::vector<std::string> parts;
+    for (auto *a = list; a != nullptr; a = a->Next)
+    {
+        if (a->OperStatus != IfOperStatusUp || a->FirstGatewayAddress == nullptr ||
+            a->IfType == IF_TYPE_PROP_VIRTUAL || a->IfType == IF_TYPE_TUNNEL || a->IfType == IF_TYPE_SOFTWARE_LOOPBACK)
+            continue;
+        std::string part;
+        char buf[INET6_ADDRSTRLEN];
+        for (auto *g = a->FirstGatewayAddress; g != nullptr; g = g->Next)
+        {
+            const auto *sa = g->Address.lpSockaddr;
+            if (sa->sa_family == AF_INET)
+                inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in *>(sa)->sin_addr, buf, sizeof(buf));
+            else
+                inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6 *>(sa)->sin6_addr, buf, sizeof(buf));
+            part += buf;
+            part += ',';
+        }
+        for (auto *u = a->FirstUnicastAddress; u != nullptr; u = u->Next)
+        {
+            const auto *sa = u->Address.lpSockaddr;
+            if (sa->sa_family != AF_INET)
+                continue;
+            auto net = ntohl(reinterpret_cast<const sockaddr_in *>(sa)->sin_addr.s_addr);
+            net &= u->OnLinkPrefixLength == 0 ? 0 : ~0u << (32 - u->OnLinkPrefixLength);
+            part += std::to_string(net) + "/" + std::to_string(u->OnLinkPrefixLength);
+            break;
+        }
+        if (a->DnsSuffix != nullptr)
+        {
+            for (const wchar_t *c = a->DnsSuffix; *c != L'\0'; ++c)
+                part += static_cast<char>(*c & 0x7F);
+        }
+        parts.push_back(part);
+    }
+    // 网卡枚举顺序可能变化，排序后再哈希
+    std::sort(parts.begin(), parts.end());
+    uint64_t h = 1469598103934665603ull;
+    for (const auto &part : parts)
+    {
+        for (const char c : part)
+        {
+            h ^= static_cast<uint8_t>(c);
+            h *= 1099511628211ull;
+        }
+        h ^= '|';
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+#else
+// 自测不区分本地网络
+inline uint64_t network_fingerprint()
+{
+    return 1;
+}
+#endif
+
+/**
+ * 持久化 endpoint 缓存，以 peer 公钥为键
+ * 记录产生过握手的 endpoint、观察时间与当时的本地网络指纹，添加 peer 时优先尝试同一网络下最近可用的 endpoint。
+ * 条目总数与单 peer 条目数有上限，超出时淘汰最久未观察到的条目，过期条目不再返回。
+ * 内存中维护，定期写盘（临时文件替换），写盘失败不影响使用
+ */
+class endpoint_cache
+{
+public:
+    static endpoint_cache cache_instance;
+
+    static endpoint_cache &getInstance()
+    {
+        return cache_instance;
+    }
+
+    endpoint_cache(const endpoint_cache &) = delete;
+    endpoint_cache &operator=(const endpoint_cache &) = delete;
+
+    // 加载缓存文件，文件不存在或格式不符时从空缓存开始
+    void open(const std::string &file)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        path = file;
+        entries.clear();
+        dirty = false;
+        FILE *f = nullptr;
+        if (fopen_s(&f, path.c_str(), "rb") != 0 || f == nullptr)
+            return;
+        uint32_t header[3] = {};
+        if (fread(header, sizeof(header), 1, f) == 1 && header[0] == ENDPOINT_CACHE_MAGIC &&
+            header[1] == ENDPOINT_CACHE_VERSION && header[2] <= ENDPOINT_CACHE_LIMIT)
+        {
+            entries.resize(header[2]);
+            if (header[2] != 0 && fread(entries.data(), sizeof(endpoint_entry), header[2], f) != header[2])
+                entries.clear();
+        }
+        fclose(f);
+        log(WIREGUARD_LOG_INFO, "endpoint cache loaded:" + std::to_string(entries.size()));
+    }
+
+    bool enabled() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return !path.empty();
+    }
+
+    // 写盘并关闭
+    void close()
+    {
+        flush();
+        std::lock_guard<std::mutex> guard(lock);
+        path.clear();
+        entries.clear();
+    }
+
+    // 当前网络指纹，NETWORK_FINGERPRINT_TTL_MS 内复用上次结果
+    uint64_t fingerprint(uint64_t now_ms)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (fingerprint_ms != 0 && now_ms - fingerprint_ms < NETWORK_FINGERPRINT_TTL_MS)
+                return current_fingerprint;
+        }
+        const auto fp = network_fingerprint();
+        std::lock_guard<std::mutex> guard(lock);
+        current_fingerprint = fp;
+        fingerprint_ms = now_ms;
+        return fp;
+    }
+
+    // 查找 peer 在当前网络下未过期的 endpoint，按观察时间从新到旧
+    std::vector<SOCKADDR_INET> lookup(const uint8_t *key, uint64_t fp, uint64_t now_ms)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<const endpoint_entry *> found;
+        for (const auto &e : entries)
+        {
+            if (e.fingerprint == fp && now_ms - e.observed_ms < ENDPOINT_CACHE_TTL_MS &&
+                memcmp(e.public_key, key, WIREGUARD_KEY_LENGTH) == 0)
+                found.push_back(&e);
+        }
+        std::sort(found.begin(), found.end(), [](const endpoint_entry *a, const endpoint_entry *b)
+                  { return a->observed_ms > b->observed_ms; });
+        std::vector<SOCKADDR_INET> out;
+        for (const auto *e : found)
+            out.push_back(to_sockaddr(*e));
+        return out;
+    }
+
+    // 记录产生握手的 endpoint
+    void record(const uint8_t *key, const SOCKADDR_INET &endpoint, uint64_t fp, uint64_t now_ms)
+    {
+        if (endpoint.si_family != AF_INET && endpoint.si_family != AF_INET6)
+            return;
+        std::lock_guard<std::mutex> guard(lock);
+        if (path.empty())
+            return;
+        size_t owned = 0;
+        size_t oldest_owned = entries.size();
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            auto &e = entries[i];
+            if (memcmp(e.public_key, key, WIREGUARD_KEY_LENGTH) != 0)
+                continue;
+            if (e.fingerprint == fp && same_endpoint(to_sockaddr(e), endpoint))
+            {
+                // 同一 endpoint 只刷新时间，间隔过短时不标记写盘
+                if (now_ms - e.observed_ms > 60000)
+                    dirty = true;
+                e.observed_ms = now_ms;
+                e.hits++;
+                return;
+            }
+            owned++;
+            if (oldest_owned == entries.size() || e.observed_ms < entries[oldest_owned].observed_ms)
+                oldest_owned = i;
+        }
+        endpoint_entry entry{};
+        memcpy(entry.public_key, key, WIREGUARD_KEY_LENGTH);
+        entry.fingerprint = fp;
+        entry.observed_ms = now_ms;
+        entry.family = endpoint.si_family;
+        entry.hits = 1;
+        if (endpoint.si_family == AF_INET)
+        {
+            memcpy(entry.addr, &endpoint.Ipv4.sin_addr, 4);
+            entry.port = endpoint.Ipv4.sin_port;
+        }
+        else
+        {
+            memcpy(entry.addr, &endpoint.Ipv6.sin6_addr, 16);
+            entry.port = endpoint.Ipv6.sin6_port;
+        }
+        dirty = true;
+        if (owned >= ENDPOINT_PER_PEER)
+        {
+            entries[oldest_owned] = entry;
+            return;
+        }
+        if (entries.size() >= ENDPOINT_CACHE_LIMIT)
+        {
+            const auto oldest = std::min_element(entries.begin(), entries.end(), [](const endpoint_entry &a, const endpoint_entry &b)
+                                                 { return a.observed_ms < b.observed_ms; });
+            *oldest = entry;
+            return;
+        }
+        entries.push_back(entry);
+    }
+
+    // 有变更时写盘，丢弃过期条目
+    void flush()
+    {
+        std::string file;
+        std::vector<endpoint_entry> copy;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!dirty || path.empty())
+                return;
+            const auto now_ms = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                          std::chrono::system_clock::now().time_since_epoch())
+                                                          .count());
+            entries.erase(std::remove_if(entries.begin(), entries.end(), [now_ms](const endpoint_entry &e)
+                                         { return now_ms - e.observed_ms >= ENDPOINT_CACHE_TTL_MS; }),
+                          entries.end());
+            copy = entries;
+            file = path;
+            dirty = false;
+        }
+        const std::string tmp = file + ".tmp";
+        FILE *f = nullptr;
+        if (fopen_s(&f, tmp.c_str(), "wb") != 0 || f == nullptr)
+        {
+            log(WIREGUARD_LOG_ERR, "open endpoint cache failed:" + tmp);
+            return;
+        }
+        const uint32_t header[3] = {ENDPOINT_CACHE_MAGIC, ENDPOINT_CACHE_VERSION, static_cast<uint32_t>(copy.size())};
+        bool ok = fwrite(header, sizeof(header), 1, f) == 1;
+        if (ok && !copy.empty())
+            ok = fwrite(copy.data(), sizeof(endpoint_entry), copy.size(), f) == copy.size();
+        fclose(f);
+        if (!ok || !MoveFileExA(tmp.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING))
+            log(WIREGUARD_LOG_ERR, "write endpoint cache failed:" + file, GetLastError());
+    }
+
+private:
+    endpoint_cache() = default;
+
+    mutable std::mutex lock;
+    std::string path;
+    std::vector<endpoint_entry> entries;
+    bool dirty = false;
+    uint64_t current_fingerprint = 0;
+    uint64_t fingerprint_ms = 0;
+
+    static SOCKADDR_INET to_sockaddr(const endpoint_entry &e)
+    {
+        SOCKADDR_INET addr{};
+        addr.si_family = e.family;
+        if (e.family == AF_INET)
+        {
+            memcpy(&addr.Ipv4.sin_addr, e.addr, 4);
+            addr.Ipv4.sin_port = e.port;
+        }
+        else
+        {
+            memcpy(&addr.Ipv6.sin6_addr, e.addr, 16);
+            addr.Ipv6.sin6_port = e.port;
+        }
+        return addr;
+    }
+};
+
+endpoint_cache endpoint_cache::cache_instance;
+
+#ifdef ENDPOINT_CACHE_SELFTEST
+// 本地自测：bash lib/selftest.sh endpoint_cache
+#include "selftest_compat.h"
+#include "iostream"
+
+namespace endpoint_cache_test
+{
+    inline SOCKADDR_INET addr(const char *ip, int port)
+    {
+        SOCKADDR_INET a{};
+        parse_ip(ip, port, a);
+        return a;
+    }
+
+    inline int run()
+    {
+        const std::string file = "/tmp/endpoint_cache_selftest.bin";
+        remove(file.c_str());
+        auto &cache = endpoint_cache::getInstance();
+        cache.open(file);
+        // 写盘时按真实时间丢弃过期条目，测试时间整体放在一分钟前
+        const auto now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                   std::chrono::system_clock::now().time_since_epoch())
+                                                   .count()) -
+                         60000;
+        uint8_t a[WIREGUARD_KEY_LENGTH] = {1};
+        uint8_t b[WIREGUARD_KEY_LENGTH] = {2};
+        const auto e1 = addr("10.0.0.1", 1000);
+        const auto e2 = addr("10.0.0.2", 1000);
+        const auto e3 = addr("fd00::3", 1000);
+
+        cache.record(a, e1, 7, now - 3000);
+        cache.record(a, e2, 7, now - 1000);
+        cache.record(a, e3, 8, now);
+        auto found = cache.lookup(a, 7, now);
+        expect(found.size() == 2 && same_endpoint(found[0], e2) && same_endpoint(found[1], e1),
+               "lookup returns newest first");
+        found = cache.lookup(a, 8, now);
+        expect(found.size() == 1 && same_endpoint(found[0], e3), "lookup filters by network fingerprint");
+        expect(cache.lookup(b, 7, now).empty(), "lookup filters by public key");
+        expect(cache.lookup(a, 7, now - 3000 + ENDPOINT_CACHE_TTL_MS).size() == 1, "expired entries are skipped");
+
+        // 重复记录只刷新时间
+        cache.record(a, e1, 7, now);
+        found = cache.lookup(a, 7, now);
+        expect(found.size() == 2 && same_endpoint(found[0], e1), "re-recording refreshes an entry");
+
+        // 单 peer 超出上限时替换该 peer 最旧的条目
+        for (int i = 0; i < 6; i++)
+            cache.record(b, addr("10.1.0.1", 2000 + i), 7, now + i);
+        found = cache.lookup(b, 7, now + 10);
+        expect(found.size() == ENDPOINT_PER_PEER && found.back().Ipv4.sin_port == htons(2002),
+               "per-peer cap evicts the oldest entry of that peer");
+
+        // 总数超出上限时淘汰全局最旧的条目
+        for (size_t i = 0; i < ENDPOINT_CACHE_LIMIT; i++)
+        {
+            uint8_t key[WIREGUARD_KEY_LENGTH] = {3};
+            memcpy(key + 1, &i, sizeof(i));
+            cache.record(key, e1, 7, now + 100 + i);
+        }
+        found = cache.lookup(a, 7, now + 2000);
+        expect(found.empty(), "cache limit evicts the oldest entries");
+
+        // 写盘后重新加载
+        uint8_t last[WIREGUARD_KEY_LENGTH] = {3};
+        const size_t last_index = ENDPOINT_CACHE_LIMIT - 1;
+        memcpy(last + 1, &last_index, sizeof(last_index));
+        cache.flush();
+        cache.open(file);
+        found = cache.lookup(last, 7, now + 2000);
+        expect(found.size() == 1 && same_endpoint(found[0], e1), "entries survive flush and reload");
+        cache.close();
+        remove(file.c_str());
+
+        // 新成员优先使用最新的缓存 endpoint
+        const auto server = addr("203.0.113.1", 3000);
+        WIREGUARD_PEER peer{};
+        peer.Flags = WIREGUARD_PEER_HAS_PUBLIC_KEY | WIREGUARD_PEER_HAS_ENDPOINT;
+        peer.Endpoint = server;
+        SOCKADDR_INET fallback{};
+        expect(!prefer_cached_endpoint(peer, {}, fallback) && same_endpoint(peer.Endpoint, server),
+               "no cache keeps the server endpoint");
+        expect(!prefer_cached_endpoint(peer, {server, e1}, fallback) && same_endpoint(peer.Endpoint, server),
+               "cache matching the server endpoint needs no race");
+        expect(prefer_cached_endpoint(peer, {e2, e1}, fallback) && same_endpoint(peer.Endpoint, e2) &&
+                   same_endpoint(fallback, server),
+               "newest cached endpoint raced against the server endpoint");
+        WIREGUARD_PEER bare{};
+        bare.Flags = WIREGUARD_PEER_HAS_PUBLIC_KEY;
+        expect(!prefer_cached_endpoint(bare, {e2}, fallback) && (bare.Flags & WIREGUARD_PEER_HAS_ENDPOINT) &&
+                   same_endpoint(bare.Endpoint, e2),
+               "peer without server endpoint uses the cache without a race");
+        return selftest_result();
+    }
+}
+
+int main()
+{
+    return endpoint_cache_test::run();
+}
+#endif
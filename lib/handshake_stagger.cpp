@@ -0,0 +1,437 @@
+#ifdef _WIN32
+#include "src/wireguard.h"
+#include "wireguard_tool.cpp"
+#else
+#include "selftest_compat.h"
+#endif
+#include "peer_stats.cpp"
+#include "mutex"
+#include "vector"
+#include "string"
+#include "chrono"
+#include "random"
+#include "algorithm"
+
+#pragma once
+
+// 握手超时(ms)，与 wireguard 的 REKEY_TIMEOUT 一致，超时未完成的握手不再占用并发名额，由 wireguard 自行重试
+static constexpr uint32_t STAGGER_HANDSHAKE_TIMEOUT_MS = 5000;
+// 存在进行中的握手时检查完成情况的间隔(ms)
+static constexpr uint32_t STAGGER_TICK_MS = 20;
+// 同时进行的握手数上限
+static constexpr uint32_t STAGGER_INFLIGHT_LIMIT = 256;
+
+/**
+ * 握手错峰队列
+ * 新加入的 peer 先以休眠记录写入适配器（无 endpoint 与保活，本端不握手但对端发起的握手可完成），按随机抖动后的到期时间排队，
+ * 进行中的握手数低于上限时才恢复 endpoint 发起握手。有流量等待的 peer（闸门拦截到发往其虚拟 IP 的报文）标记为紧急，
+ * 优先于其他 peer 且不等待抖动。进行中的握手在完成或超过 STAGGER_HANDSHAKE_TIMEOUT_MS 后释放名额。
+ * 队列只保存房间名与成员名，出队时由调用方按名称查找，已删除的成员直接忽略。
+ * 锁为叶子锁，可在持有房间锁时调用
+ */
+class stagger_queue
+{
+    struct entry
+    {
+        std::wstring room;
+        std::wstring peer;
+        std::chrono::steady_clock::time_point due;
+        bool urgent;
+        uint64_t seq;
+    };
+
+    struct flight
+    {
+        std::wstring room;
+        uint8_t public_key[WIREGUARD_KEY_LENGTH];
+        std::chrono::steady_clock::time_point started;
+        uint64_t started_ms; // 写入适配器时的 unix 毫秒，晚于该时间的握手才算完成
+    };
+
+    mutable std::mutex lock;
+    std::vector<entry> waiting;
+    std::vector<flight> inflight;
+    uint32_t max_inflight = 0;
+    uint32_t jitter_ms = 0;
+    uint64_t sequence = 0;
+    std::mt19937 rng{std::random_device{}()};
+
+public:
+    /**
+     * 设置并发上限与抖动，max_inflight 为 0 时关闭，已排队的 peer 由调用方全部激活
+     * @return 关闭前排队的成员，调用方据此激活
+     */
+    std::vector<std::pair<std::wstring, std::wstring>> configure(uint32_t inflight_limit, uint32_t jitter)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        max_inflight = inflight_limit > STAGGER_INFLIGHT_LIMIT ? STAGGER_INFLIGHT_LIMIT : inflight_limit;
+        jitter_ms = jitter;
+        std::vector<std::pair<std::wstring, std::wstring>> released;
+        if (max_inflight != 0)
+            return released;
+        for (auto &e : waiting)
+            released.emplace_back(std::move(e.room), std::move(e.peer));
+        waiting.clear();
+        inflight.clear();
+        return released;
+    }
+
+    bool enabled() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return max_inflight != 0;
+    }
+
+    // 排队等待激活，已在队列中的成员只更新紧急标记
+    void push(const std::wstring &room, const std::wstring &peer, bool urgent, std::chrono::steady_clock::time_point now)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto &e : waiting)
+        {
+            if (e.peer == peer && e.room == room)
+            {
+                if (urgent && !e.urgent)
+                {
+                    e.urgent = true;
+                    e.due = now;
+                }
+                return;
+            }
+        }
+        auto due = now;
+        if (!urgent && jitter_ms != 0)
+            due += std::chrono::milliseconds(std::uniform_int_distribution<uint32_t>(0, jitter_ms)(rng));
+        waiting.push_back({room, peer, due, urgent, sequence++});
+    }
+
+    // 按剩余并发名额取出到期的成员：紧急优先，其次按到期时间
+    std::vector<std::pair<std::wstring, std::wstring>> take(std::chrono::steady_clock::time_point now)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<std::pair<std::wstring, std::wstring>> out;
+        if (inflight.size() >= max_inflight)
+            return out;
+        size_t slots = max_inflight - inflight.size();
+        std::sort(waiting.begin(), waiting.end(), [](const entry &a, const entry &b)
+                  {
+            if (a.urgent != b.urgent)
+                return a.urgent;
+            if (a.due != b.due)
+                return a.due < b.due;
+            return a.seq < b.seq; });
+        size_t n = 0;
+        while (n < waiting.size() && n < slots && waiting[n].due <= now)
+            n++;
+        for (size_t i = 0; i < n; i++)
+            out.emplace_back(std::move(waiting[i].room), std::move(waiting[i].peer));
+        waiting.erase(waiting.begin(), waiting.begin() + static_cast<ptrdiff_t>(n));
+        return out;
+    }
+
+    // 已恢复 endpoint 发起握手，开始占用并发名额
+    void launched(const std::wstring &room, const uint8_t *public_key, std::chrono::steady_clock::time_point now, uint64_t now_ms)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        flight f{room, {}, now, now_ms};
+        memcpy(f.public_key, public_key, WIREGUARD_KEY_LENGTH);
+        inflight.push_back(f);
+    }
+
+    // 握手完成，释放并发名额
+    void finish(const std::wstring &room, const uint8_t *public_key)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t i = 0; i < inflight.size(); i++)
+        {
+            if (inflight[i].room == room && memcmp(inflight[i].public_key, public_key, WIREGUARD_KEY_LENGTH) == 0)
+            {
+                inflight.erase(inflight.begin() + static_cast<ptrdiff_t>(i));
+                return;
+            }
+        }
+    }
+
+    // 按房间配置快照释放已完成的握手，config 为空表示房间已删除
+    void settle(const std::wstring &room, const WIREGUARD_INTERFACE *config)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t i = inflight.size(); i-- > 0;)
+        {
+            auto &f = inflight[i];
+            if (f.room != room)
+                continue;
+            bool done = config == nullptr;
+            const BYTE *cursor = config == nullptr ? nullptr : reinterpret_cast<const BYTE *>(config) + interface_size;
+            for (DWORD p = 0; !done && p < config->PeersCount; p++)
+            {
+                const auto *peer = reinterpret_cast<const WIREGUARD_PEER *>(cursor);
+                cursor += peer_size + peer->AllowedIPsCount * allowed_ip_size;
+                if (memcmp(peer->PublicKey, f.public_key, WIREGUARD_KEY_LENGTH) == 0)
+                {
+                    done = handshake_to_unix_ms(peer->LastHandshake) >= f.started_ms;
+                    break;
+                }
+            }
+            if (done)
+                inflight.erase(inflight.begin() + static_cast<ptrdiff_t>(i));
+        }
+    }
+
+    // 释放超时的握手
+    void expire(std::chrono::steady_clock::time_point now)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        const auto timeout = std::chrono::milliseconds(STAGGER_HANDSHAKE_TIMEOUT_MS);
+        inflight.erase(std::remove_if(inflight.begin(), inflight.end(), [&](const flight &f)
+                                      { return now - f.started >= timeout; }),
+                       inflight.end());
+    }
+
+    // 有进行中握手的房间
+    std::vector<std::wstring> inflight_rooms() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<std::wstring> rooms;
+        for (const auto &f : inflight)
+        {
+            if (std::find(rooms.begin(), rooms.end(), f.room) == rooms.end())
+                rooms.push_back(f.room);
+        }
+        return rooms;
+    }
+
+    size_t inflight_count() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return inflight.size();
+    }
+
+    size_t waiting_count() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return waiting.size();
+    }
+
+    /**
+     * 下一次需要处理的时间：有进行中的握手时按 STAGGER_TICK_MS 检查完成情况，
+     * 否则为最早到期的排队成员，队列为空返回 time_point::max
+     */
+    std::chrono::steady_clock::time_point next_wake(std::chrono::steady_clock::time_point now) const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto wake = std::chrono::steady_clock::time_point::max();
+        if (!inflight.empty())
+            wake = now + std::chrono::milliseconds(STAGGER_TICK_MS);
+        if (inflight.size() < max_inflight)
+        {
+            for (const auto &e : waiting)
+            {
+                if (e.due < wake)
+                    wake = e.due;
+            }
+        }
+        return wake;
+    }
+};
+
+#ifdef HANDSHAKE_STAGGER_SELFTEST
+// 本地自测：bash lib/selftest.sh handshake_stagger
+#include "selftest_compat.h"
+#include "iostream"
+
+namespace handshake_stagger_test
+{
+    // 错峰期间 peer 在本端适配器中的状态
+    enum hold_mode
+    {
+        HOLD_NONE,    // 不错峰，收到 add_peer 立即握手
+        HOLD_REMOVED, // 错峰期间不写入适配器，对端握手被丢弃
+        HOLD_DORMANT, // 错峰期间以休眠记录写入适配器，对端握手可完成
+    };
+
+    struct result
+    {
+        int all_ms = 0;
+        int median_ms = 0;
+        size_t peak = 0;
+        int wasted = 0;   // 本端发起但对端尚未登记本端公钥而被丢弃的握手
+        int rejected = 0; // 对端发起、本端已收到其 add_peer 却因未写入适配器而丢弃的握手
+    };
+
+    /**
+     * 集中加入模型，虚拟时钟(ms)：本机在 200ms 内陆续收到 members-1 次 add_peer，
+     * 每个对端在 400ms 内各自收到成员列表并立即登记本端公钥、发起握手（对端不错峰）。
+     * 握手报文单程 20ms，响应方未登记发起方公钥时丢弃，发起方在 REKEY_TIMEOUT 后重试；
+     * 本端每处理一次握手消耗 1.5ms 单核 CPU。任一方向的握手被接受即建立会话
+     */
+    inline result simulate(int members, hold_mode mode, uint32_t max_inflight, uint32_t jitter_ms)
+    {
+        constexpr int cpu_us = 1500;
+        constexpr int one_way_ms = 20;
+        constexpr int limit_ms = 60000;
+        const int peers = members - 1;
+        std::mt19937 rng(static_cast<uint32_t>(members));
+        std::vector<int> join(peers), remote_install(peers);
+        for (int i = 0; i < peers; i++)
+        {
+            join[i] = std::uniform_int_distribution<int>(0, 200)(rng);
+            remote_install[i] = std::uniform_int_distribution<int>(0, 400)(rng);
+        }
+        const auto retry = [&rng]
+        { return static_cast<int>(STAGGER_HANDSHAKE_TIMEOUT_MS) + std::uniform_int_distribution<int>(0, 333)(rng); };
+
+        // installed: 本端写入适配器的时间；ours: 本端下次发起握手；theirs: 对端握手下次到达本端
+        std::vector<int> installed(peers, -1), ours(peers, -1), theirs(peers), established(peers, -1), done(peers, -1);
+        std::vector<bool> flying(peers, false);
+        for (int i = 0; i < peers; i++)
+            theirs[i] = remote_install[i] + one_way_ms;
+        const auto key_of = [](int i, uint8_t *key)
+        {
+            memset(key, 0, WIREGUARD_KEY_LENGTH);
+            memcpy(key, &i, sizeof(i));
+        };
+
+        result r;
+        long long cpu_free_us = 0;
+        const auto cpu = [&cpu_free_us](int t)
+        {
+            cpu_free_us = (cpu_free_us > t * 1000LL ? cpu_free_us : t * 1000LL) + cpu_us;
+            return static_cast<int>(cpu_free_us / 1000);
+        };
+        stagger_queue queue;
+        queue.configure(mode == HOLD_NONE ? 0 : max_inflight, jitter_ms);
+        const auto base = std::chrono::steady_clock::now();
+        int finished = 0;
+        for (int t = 0; finished < peers && t < limit_ms; t++)
+        {
+            const auto now = base + std::chrono::milliseconds(t);
+            uint8_t key[WIREGUARD_KEY_LENGTH];
+            for (int i = 0; i < peers; i++)
+            {
+                if (join[i] != t)
+                    continue;
+                if (mode == HOLD_NONE)
+                {
+                    installed[i] = t;
+                    ours[i] = t;
+                    continue;
+                }
+                if (mode == HOLD_DORMANT)
+                    installed[i] = t;
+                queue.push(L"bench", std::to_wstring(i), false, now);
+            }
+            for (int i = 0; i < peers; i++)
+            {
+                if (established[i] == t)
+                {
+                    done[i] = t;
+                    finished++;
+                    if (flying[i])
+                    {
+                        key_of(i, key);
+                        queue.finish(L"bench", key);
+                        flying[i] = false;
+                    }
+                }
+            }
+            queue.expire(now);
+            for (const auto &[room, name] : queue.take(now))
+            {
+                const int i = std::stoi(name);
+                installed[i] = installed[i] < 0 ? t : installed[i];
+                // 对端握手已建立会话，恢复 endpoint 后无需再握手
+                if (established[i] >= 0)
+                    continue;
+                key_of(i, key);
+                queue.launched(room, key, now, static_cast<uint64_t>(t));
+                flying[i] = true;
+                ours[i] = t;
+            }
+            for (int i = 0; i < peers; i++)
+            {
+                if (established[i] >= 0)
+                    continue;
+                if (ours[i] == t)
+                {
+                    const int sent = cpu(t);
+                    if (remote_install[i] <= sent + one_way_ms)
+                    {
+                        established[i] = sent + 2 * one_way_ms;
+                    }
+                    else
+                    {
+                        r.wasted++;
+                        ours[i] = t + retry();
+                    }
+                }
+                if (theirs[i] == t && established[i] < 0)
+                {
+                    if (installed[i] >= 0)
+                    {
+                        established[i] = cpu(t) + one_way_ms;
+                    }
+                    else
+                    {
+                        if (t >= join[i])
+                            r.rejected++;
+                        theirs[i] = t + retry();
+                    }
+                }
+            }
+            if (queue.inflight_count() > r.peak)
+                r.peak = queue.inflight_count();
+        }
+        std::sort(done.begin(), done.end());
+        r.all_ms = done.front() < 0 ? limit_ms : done.back();
+        r.median_ms = done[done.size() / 2];
+        return r;
+    }
+
+    inline void print(const char *name, const result &r)
+    {
+        std::cout << "  " << name << " all=" << r.all_ms << "ms median=" << r.median_ms << "ms peak=" << r.peak
+                  << " wasted=" << r.wasted << " rejected=" << r.rejected << std::endl;
+    }
+
+    inline int run()
+    {
+        constexpr int members = 64;
+        constexpr uint32_t inflight = 4;
+        constexpr uint32_t jitter = 500;
+        const auto burst = simulate(members, HOLD_NONE, inflight, jitter);
+        const auto removed = simulate(members, HOLD_REMOVED, inflight, jitter);
+        const auto dormant = simulate(members, HOLD_DORMANT, inflight, jitter);
+        std::cout << "stagger bench: members=" << members << " inflight=" << inflight << " jitter=" << jitter << "ms" << std::endl;
+        print("burst:  ", burst);
+        print("removed:", removed);
+        print("dormant:", dormant);
+
+        expect(dormant.rejected == 0, "dormant hold answers remote handshakes");
+        expect(removed.rejected > 0 && removed.median_ms > dormant.median_ms,
+               "removed hold drops remote handshakes and delays the median");
+        expect(dormant.wasted < burst.wasted, "staggering wastes fewer initiations on uninstalled responders");
+        expect(dormant.all_ms <= burst.all_ms + static_cast<int>(jitter), "dormant hold finishes within the jitter of a burst");
+        expect(dormant.peak <= inflight, "inflight handshakes stay under the limit");
+
+        // 紧急成员优先且不等待抖动
+        stagger_queue queue;
+        queue.configure(1, 10000);
+        const auto now = std::chrono::steady_clock::now();
+        queue.push(L"r", L"a", false, now);
+        queue.push(L"r", L"b", true, now);
+        const auto first = queue.take(now);
+        expect(first.size() == 1 && first[0].second == L"b", "urgent peer released first");
+        uint8_t key[WIREGUARD_KEY_LENGTH] = {1};
+        queue.launched(L"r", key, now, 0);
+        expect(queue.take(now + std::chrono::seconds(20)).empty(), "release waits for a free slot");
+        queue.expire(now + std::chrono::milliseconds(STAGGER_HANDSHAKE_TIMEOUT_MS));
+        expect(queue.take(now + std::chrono::seconds(20)).size() == 1, "timed out handshake frees its slot");
+        return selftest_result();
+    }
+}
+
+int main()
+{
+    return handshake_stagger_test::run();
+}
+#endif
@@ -0,0 +1,1142 @@
+#ifdef _WIN32
+#include "winsock2.h"
+#include "ws2tcpip.h"
+#include "iphlpapi.h"
+#include "mstcpip.h"
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+#include "cstdint"
+#include "cstring"
+#include "string"
+#include "vector"
+#include "mutex"
+#include "thread"
+#include "chrono"
+#include "functional"
+#include "tuple"
+#include "random"
+#include "atomic"
+#include "algorithm"
+
+#pragma once
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+using punch_socket = SOCKET;
+static constexpr punch_socket PUNCH_INVALID_SOCKET = INVALID_SOCKET;
+inline void punch_close(punch_socket s) { closesocket(s); }
+inline int punch_poll(pollfd *fds, size_t n, int timeout_ms) { return WSAPoll(fds, static_cast<ULONG>(n), timeout_ms); }
+#else
+using punch_socket = int;
+static constexpr punch_socket PUNCH_INVALID_SOCKET = -1;
+inline void punch_close(punch_socket s) { close(s); }
+inline int punch_poll(pollfd *fds, size_t n, int timeout_ms) { return poll(fds, static_cast<nfds_t>(n), timeout_ms); }
+#endif
+
+// 报文标识 "MPCH" 与版本
+static constexpr uint32_t PUNCH_MAGIC = 0x4D504348;
+static constexpr uint8_t PUNCH_VERSION = 1;
+// 请求报文长度，应答在请求之后附带对方看到的源地址
+static constexpr size_t PUNCH_REQUEST_SIZE = 24;
+static constexpr size_t PUNCH_RESPONSE_SIZE = 44;
+// 每个候选对的首次重发间隔(ms)，之后按 2 倍放大到 PUNCH_MAX_PACE_MS
+static constexpr uint32_t PUNCH_FIRST_PACE_MS = 20;
+static constexpr uint32_t PUNCH_MAX_PACE_MS = 500;
+// 同一轮中相邻候选对的发送间隔(ms)，避免首轮在 NAT 上形成突发
+static constexpr uint32_t PUNCH_PAIR_SPACING_MS = 2;
+// 端口预测：对方为顺序分配的对称型 NAT 时，在每个映射候选之后按步长追加的预测端口数
+static constexpr int PUNCH_PREDICT_COUNT = 8;
+// 单次连接的候选对上限，超出的低优先级候选丢弃
+static constexpr size_t PUNCH_MAX_PAIRS = 32;
+// 无进行中连接时线程的最长等待(ms)，决定停止的响应时间
+static constexpr int PUNCH_IDLE_WAIT_MS = 100;
+// 对方的检查先于本端 connect 到达时保留其源地址的时长(ms)与条数，connect 时作为触发检查
+static constexpr uint32_t PUNCH_EARLY_KEEP_MS = 5000;
+static constexpr size_t PUNCH_EARLY_LIMIT = 16;
+// 连接结束后继续应答该会话检查的时长(ms)，对方的连接可能晚于本端开始与结束
+static constexpr uint32_t PUNCH_SESSION_KEEP_MS = 10000;
+// 路径探测使用的会话：对方只应答不保留，应答中的映射地址可能经过中继，也不作为本端候选
+static constexpr uint64_t PUNCH_PROBE_SESSION = 0;
+// 向反射器学习本端映射地址使用的会话：与路径探测一样无需登记即应答，应答中的映射地址作为本端候选
+static constexpr uint64_t PUNCH_REFLEXIVE_SESSION = 1;
+
+enum punch_message_type : uint8_t
+{
+    PUNCH_REQUEST = 1,
+    PUNCH_RESPONSE = 2,
+    // 请求反射器向附带的地址发送一个应答，用于 NAT 过滤行为检测，目标必须与请求方同一 IP
+    PUNCH_REFLECT = 3,
+};
+
+// 候选类型，数值越小优先级越高
+enum punch_kind : uint8_t
+{
+    PUNCH_HOST = 0,      // 本地网卡地址（局域网直连）
+    PUNCH_REFLEXIVE = 1, // 对方或中继看到的 NAT 映射地址
+    PUNCH_PEER = 2,      // 收到对方检查时学到的源地址
+    PUNCH_PREDICTED = 3, // 按对方端口分配步长预测的映射地址
+};
+
+struct punch_candidate
+{
+    sockaddr_storage addr;
+    punch_kind kind;
+};
+
+struct punch_result
+{
+    uint64_t id;
+    bool success;
+    sockaddr_storage remote; // 成功的候选对中对方的地址
+    uint32_t elapsed_ms;
+    uint32_t sent; // 本次连接发出的检查报文数
+};
+
+inline socklen_t punch_addr_len(const sockaddr_storage &addr)
+{
+    return addr.ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+}
+
+inline bool punch_same_host(const sockaddr_storage &a, const sockaddr_storage &b)
+{
+    if (a.ss_family != b.ss_family)
+        return false;
+    if (a.ss_family == AF_INET)
+        return reinterpret_cast<const sockaddr_in &>(a).sin_addr.s_addr == reinterpret_cast<const sockaddr_in &>(b).sin_addr.s_addr;
+    return memcmp(&reinterpret_cast<const sockaddr_in6 &>(a).sin6_addr, &reinterpret_cast<const sockaddr_in6 &>(b).sin6_addr, 16) == 0;
+}
+
+inline uint16_t punch_port(const sockaddr_storage &addr)
+{
+    return ntohs(addr.ss_family == AF_INET6 ? reinterpret_cast<const sockaddr_in6 &>(addr).sin6_port
+                                            : reinterpret_cast<const sockaddr_in &>(addr).sin_port);
+}
+
+inline void punch_set_port(sockaddr_storage &addr, uint16_t port)
+{
+    if (addr.ss_family == AF_INET6)
+        reinterpret_cast<sockaddr_in6 &>(addr).sin6_port = htons(port);
+    else
+        reinterpret_cast<sockaddr_in &>(addr).sin_port = htons(port);
+}
+
+inline bool punch_same_addr(const sockaddr_storage &a, const sockaddr_storage &b)
+{
+    if (a.ss_family != b.ss_family)
+        return false;
+    if (a.ss_family == AF_INET)
+    {
+        const auto &x = reinterpret_cast<const sockaddr_in &>(a);
+        const auto &y = reinterpret_cast<const sockaddr_in &>(b);
+        return x.sin_port == y.sin_port && x.sin_addr.s_addr == y.sin_addr.s_addr;
+    }
+    const auto &x = reinterpret_cast<const sockaddr_in6 &>(a);
+    const auto &y = reinterpret_cast<const sockaddr_in6 &>(b);
+    return x.sin6_port == y.sin6_port && memcmp(&x.sin6_addr, &y.sin6_addr, sizeof(x.sin6_addr)) == 0;
+}
+
+// 打开绑定到 port 的 UDP 套接字，port 为 0 时由系统分配，失败返回 PUNCH_INVALID_SOCKET
+inline punch_socket punch_open(int family, uint16_t port)
+{
+    const punch_socket s = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+    if (s == PUNCH_INVALID_SOCKET)
+        return s;
+    int result;
+    if (family == AF_INET6)
+    {
+        int only = 1;
+        setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char *>(&only), sizeof(only));
+        sockaddr_in6 addr{};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(port);
+        result = bind(s, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr));
+    }
+    else
+    {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        result = bind(s, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr));
+    }
+    if (result != 0)
+    {
+        punch_close(s);
+        return PUNCH_INVALID_SOCKET;
+    }
+#ifdef _WIN32
+    // 关闭 ICMP 端口不可达导致的 WSAECONNRESET，不可达的候选不应中断其余候选的接收
+    BOOL reset = FALSE;
+    DWORD bytes = 0;
+    WSAIoctl(s, SIO_UDP_CONNRESET, &reset, sizeof(reset), nullptr, 0, &bytes, nullptr, nullptr);
+#endif
+    return s;
+}
+
+// 解析 "ip:port" 或 "[ipv6]:port"，只接受数字地址
+inline bool parse_candidate(const std::string &text, punch_candidate &out)
+{
+    std::string host;
+    std::string port;
+    if (!text.empty() && text[0] == '[')
+    {
+        const auto end = text.find("]:");
+        if (end == std::string::npos)
+            return false;
+        host = text.substr(1, end - 1);
+        port = text.substr(end + 2);
+    }
+    else
+    {
+        const auto colon = text.rfind(':');
+        if (colon == std::string::npos)
+            return false;
+        host = text.substr(0, colon);
+        port = text.substr(colon + 1);
+    }
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    addrinfo *info = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0 || info == nullptr)
+        return false;
+    memset(&out, 0, sizeof(out));
+    memcpy(&out.addr, info->ai_addr, info->ai_addrlen);
+    out.kind = PUNCH_REFLEXIVE;
+    freeaddrinfo(info);
+    return true;
+}
+
+inline std::string format_candidate(const sockaddr_storage &addr)
+{
+    char buf[INET6_ADDRSTRLEN] = {};
+    if (addr.ss_family == AF_INET)
+    {
+        const auto &in = reinterpret_cast<const sockaddr_in &>(addr);
+        inet_ntop(AF_INET, &in.sin_addr, buf, sizeof(buf));
+        return std::string(buf) + ":" + std::to_string(ntohs(in.sin_port));
+    }
+    const auto &in6 = reinterpret_cast<const sockaddr_in6 &>(addr);
+    inet_ntop(AF_INET6, &in6.sin6_addr, buf, sizeof(buf));
+    return "[" + std::string(buf) + "]:" + std::to_string(ntohs(in6.sin6_port));
+}
+
+// 会话标识：双方使用同一个连接 id 的 FNV-1a 哈希，连接 id 由双方从信令得到（见 roomController 的 punchSession）
+inline uint64_t punch_session(const char *uid)
+{
+    uint64_t h = 1469598103934665603ull;
+    for (; *uid != '\0'; ++uid)
+    {
+        h ^= static_cast<uint8_t>(*uid);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/**
+ * 打洞报文，大端序定长编码
+ * 0 magic u32 | 4 version u8 | 5 type u8 | 6 pair u16 | 8 session u64 | 16 nonce u64
+ * 应答与反射请求附带：24 family u8 (4/6) | 25 保留 | 26 port u16 | 28 addr[16]
+ */
+struct punch_message
+{
+    uint8_t type;
+    uint16_t pair;
+    uint64_t session;
+    uint64_t nonce;
+    sockaddr_storage mapped; // 应答：请求方的源地址；反射请求：应答的目标地址
+
+    size_t encode(uint8_t *out) const
+    {
+        put(out, PUNCH_MAGIC, 4);
+        out[4] = PUNCH_VERSION;
+        out[5] = type;
+        put(out + 6, pair, 2);
+        put(out + 8, session, 8);
+        put(out + 16, nonce, 8);
+        if (type == PUNCH_REQUEST)
+            return PUNCH_REQUEST_SIZE;
+        memset(out + 24, 0, PUNCH_RESPONSE_SIZE - 24);
+        if (mapped.ss_family == AF_INET)
+        {
+            const auto &in = reinterpret_cast<const sockaddr_in &>(mapped);
+            out[24] = 4;
+            memcpy(out + 26, &in.sin_port, 2);
+            memcpy(out + 28, &in.sin_addr, 4);
+        }
+        else
+        {
+            const auto &in6 = reinterpret_cast<const sockaddr_in6 &>(mapped);
+            out[24] = 6;
+            memcpy(out + 26, &in6.sin6_port, 2);
+            memcpy(out + 28, &in6.sin6_addr, 16);
+        }
+        return PUNCH_RESPONSE_SIZE;
+    }
+
+    bool decode(const uint8_t *in, size_t len)
+    {
+        if (len < PUNCH_REQUEST_SIZE || get(in, 4) != PUNCH_MAGIC || in[4] != PUNCH_VERSION)
+            return false;
+        type = in[5];
+        pair = static_cast<uint16_t>(get(in + 6, 2));
+        session = get(in + 8, 8);
+        nonce = get(in + 16, 8);
+        memset(&mapped, 0, sizeof(mapped));
+        if (type == PUNCH_REQUEST)
+            return true;
+        if ((type != PUNCH_RESPONSE && type != PUNCH_REFLECT) || len < PUNCH_RESPONSE_SIZE)
+            return false;
+        if (in[24] == 4)
+        {
+            auto &addr = reinterpret_cast<sockaddr_in &>(mapped);
+            addr.sin_family = AF_INET;
+            memcpy(&addr.sin_port, in + 26, 2);
+            memcpy(&addr.sin_addr, in + 28, 4);
+        }
+        else if (in[24] == 6)
+        {
+            auto &addr = reinterpret_cast<sockaddr_in6 &>(mapped);
+            addr.sin6_family = AF_INET6;
+            memcpy(&addr.sin6_port, in + 26, 2);
+            memcpy(&addr.sin6_addr, in + 28, 16);
+        }
+        return true;
+    }
+
+private:
+    static void put(uint8_t *out, uint64_t value, int bytes)
+    {
+        for (int i = bytes - 1; i >= 0; i--)
+        {
+            out[i] = static_cast<uint8_t>(value);
+            value >>= 8;
+        }
+    }
+
+    static uint64_t get(const uint8_t *in, int bytes)
+    {
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++)
+            value = (value << 8) | in[i];
+        return value;
+    }
+};
+
+/**
+ * 打洞状态机，ICE 式候选对检查，与收发方式无关
+ * 对每个候选对并发发送检查请求，重发间隔从 PUNCH_FIRST_PACE_MS 按 2 倍放大，第一个收到应答的候选对即为结果。
+ * 收到对方的检查时立即应答，并向其源地址追加一个触发检查（对方 NAT 映射地址），双方同时打洞时一个 RTT 内即可打通。
+ * 只应答本端登记过的会话（connect 后到结束后 PUNCH_SESSION_KEEP_MS 内）与路径探测、映射学习两个公共会话，不为任意会话充当反射；
+ * 本端尚未 connect 的会话只记下源地址，connect 时作为触发检查。
+ * 应答携带请求方的源地址，用于学习本端的 NAT 映射地址。
+ * 报文通过构造时传入的发送函数发出，收到的报文由调用方交给 on_message，调用方按 poll 返回的时间驱动重发与超时
+ */
+class punch_core
+{
+public:
+    // 发送一个打洞报文
+    using sender = std::function<void(const sockaddr_storage &to, const uint8_t *data, size_t len)>;
+    // 是否能向该地址族发送
+    using family_filter = std::function<bool(int family)>;
+
+private:
+    struct check
+    {
+        sockaddr_storage remote;
+        punch_kind kind;
+        uint64_t nonce;
+        std::chrono::steady_clock::time_point due;
+        uint32_t pace;
+    };
+
+    struct attempt
+    {
+        uint64_t id;
+        uint64_t session;
+        std::vector<check> checks;
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::time_point deadline;
+        uint32_t sent;
+    };
+
+    sender send;
+    family_filter usable;
+    std::mutex lock;
+    std::vector<attempt> attempts;
+    std::vector<punch_candidate> reflexive;
+    // 尚无对应连接时收到的检查：会话、源地址与到达时间
+    std::vector<std::tuple<uint64_t, sockaddr_storage, std::chrono::steady_clock::time_point>> early;
+    // 本端登记的会话与停止应答的时间
+    std::vector<std::pair<uint64_t, std::chrono::steady_clock::time_point>> sessions;
+    uint64_t next_id = 1;
+    std::mt19937_64 rng{std::random_device{}()};
+
+    void send_message(const sockaddr_storage &to, const punch_message &msg)
+    {
+        uint8_t buf[PUNCH_RESPONSE_SIZE];
+        const size_t len = msg.encode(buf);
+        send(to, buf, len);
+    }
+
+    // 发送到期的检查并放大重发间隔，调用方需持有锁，返回最早的下次发送时间
+    std::chrono::steady_clock::time_point send_due(std::chrono::steady_clock::time_point now)
+    {
+        auto wake = std::chrono::steady_clock::time_point::max();
+        for (auto &a : attempts)
+        {
+            for (size_t i = 0; i < a.checks.size(); i++)
+            {
+                auto &c = a.checks[i];
+                if (c.due <= now)
+                {
+                    punch_message msg{PUNCH_REQUEST, static_cast<uint16_t>(i), a.session, c.nonce, {}};
+                    send_message(c.remote, msg);
+                    a.sent++;
+                    c.due = now + std::chrono::milliseconds(c.pace);
+                    c.pace = c.pace * 2 > PUNCH_MAX_PACE_MS ? PUNCH_MAX_PACE_MS : c.pace * 2;
+                }
+                if (c.due < wake)
+                    wake = c.due;
+            }
+            if (a.deadline < wake)
+                wake = a.deadline;
+        }
+        return wake;
+    }
+
+    // 以对方检查的源地址追加触发检查，调用方需持有锁
+    void add_triggered(attempt &a, const sockaddr_storage &from, std::chrono::steady_clock::time_point now)
+    {
+        if (a.checks.size() >= PUNCH_MAX_PAIRS)
+            return;
+        const bool known = std::any_of(a.checks.begin(), a.checks.end(), [&from](const check &c)
+                                       { return punch_same_addr(c.remote, from); });
+        if (!known)
+            a.checks.push_back({from, PUNCH_PEER, rng(), now, PUNCH_FIRST_PACE_MS});
+    }
+
+    // 会话是否由本端登记且未过期，调用方需持有锁
+    bool registered(uint64_t session, std::chrono::steady_clock::time_point now) const
+    {
+        return std::any_of(sessions.begin(), sessions.end(), [session, now](const auto &s)
+                           { return s.first == session && now < s.second; });
+    }
+
+    // 登记会话，已登记时延长应答时间，调用方需持有锁
+    void register_session(uint64_t session, std::chrono::steady_clock::time_point until)
+    {
+        for (auto &s : sessions)
+        {
+            if (s.first == session)
+            {
+                s.second = std::max(s.second, until);
+                return;
+            }
+        }
+        sessions.emplace_back(session, until);
+    }
+
+    // 记录应答中的本端映射地址，调用方需持有锁
+    void learn_reflexive(const sockaddr_storage &mapped)
+    {
+        if (mapped.ss_family != AF_INET && mapped.ss_family != AF_INET6)
+            return;
+        for (const auto &c : reflexive)
+        {
+            if (punch_same_addr(c.addr, mapped))
+                return;
+        }
+        if (reflexive.size() >= 4)
+            reflexive.erase(reflexive.begin());
+        reflexive.push_back({mapped, PUNCH_REFLEXIVE});
+    }
+
+public:
+    punch_core(sender send, family_filter usable) : send(std::move(send)), usable(std::move(usable)) {}
+    punch_core(const punch_core &) = delete;
+    punch_core &operator=(const punch_core &) = delete;
+
+    // 处理一个收到的报文，不是打洞报文返回 false；成功的连接写入 done
+    bool on_message(const uint8_t *data, size_t len, const sockaddr_storage &from,
+                    std::chrono::steady_clock::time_point now, std::vector<punch_result> &done)
+    {
+        punch_message msg{};
+        if (!msg.decode(data, len))
+            return false;
+        if (msg.type == PUNCH_REFLECT)
+        {
+            // 只反射到请求方自己的公网 IP，避免被用作反射放大
+            if (punch_same_host(msg.mapped, from))
+            {
+                punch_message reply{PUNCH_RESPONSE, msg.pair, msg.session, msg.nonce, msg.mapped};
+                send_message(msg.mapped, reply);
+            }
+            return true;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        if (msg.type == PUNCH_REQUEST)
+        {
+            // 未登记的会话不应答：本端还未发起连接时保留源地址一段时间，供随后的 connect 使用
+            if (msg.session != PUNCH_PROBE_SESSION && msg.session != PUNCH_REFLEXIVE_SESSION && !registered(msg.session, now))
+            {
+                if (early.size() >= PUNCH_EARLY_LIMIT)
+                    early.erase(early.begin());
+                early.emplace_back(msg.session, from, now);
+                return true;
+            }
+            punch_message reply{PUNCH_RESPONSE, msg.pair, msg.session, msg.nonce, from};
+            send_message(from, reply);
+            // 同一会话正在连接：对方的源地址就是其 NAT 映射，追加触发检查，下一次 poll 立即发送
+            for (auto &a : attempts)
+            {
+                if (a.session == msg.session)
+                    add_triggered(a, from, now);
+            }
+            return true;
+        }
+        if (msg.session != PUNCH_PROBE_SESSION)
+            learn_reflexive(msg.mapped);
+        for (size_t i = 0; i < attempts.size(); i++)
+        {
+            auto &a = attempts[i];
+            if (a.session != msg.session || msg.pair >= a.checks.size())
+                continue;
+            const auto &c = a.checks[msg.pair];
+            if (c.nonce != msg.nonce || !punch_same_addr(c.remote, from))
+                continue;
+            punch_result r{};
+            r.id = a.id;
+            r.success = true;
+            r.remote = c.remote;
+            r.elapsed_ms = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now - a.started).count());
+            r.sent = a.sent;
+            done.push_back(r);
+            attempts.erase(attempts.begin() + static_cast<ptrdiff_t>(i));
+            break;
+        }
+        return true;
+    }
+
+    /**
+     * 发送到期的检查，超时的连接写入 done
+     * @return 下一次需要调用的时间，没有进行中的连接时为 time_point::max
+     */
+    std::chrono::steady_clock::time_point poll(std::chrono::steady_clock::time_point now, std::vector<punch_result> &done)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t i = attempts.size(); i-- > 0;)
+        {
+            const auto &a = attempts[i];
+            if (now < a.deadline)
+                continue;
+            punch_result r{};
+            r.id = a.id;
+            r.elapsed_ms = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now - a.started).count());
+            r.sent = a.sent;
+            done.push_back(r);
+            attempts.erase(attempts.begin() + static_cast<ptrdiff_t>(i));
+        }
+        sessions.erase(std::remove_if(sessions.begin(), sessions.end(), [now](const auto &s)
+                                      { return now >= s.second; }),
+                       sessions.end());
+        return send_due(now);
+    }
+
+    /**
+     * 向候选地址并发发起检查，返回连接 id，没有可用候选返回 0
+     * 候选按类型优先级排序，同一轮中按 PUNCH_PAIR_SPACING_MS 依次发出，首个检查立即发出。
+     * port_delta 非 0 时对方为顺序分配端口的对称型 NAT，在每个映射候选之后追加按步长预测的端口
+     */
+    uint64_t connect(uint64_t session, std::vector<punch_candidate> remote, uint32_t timeout_ms, int32_t port_delta = 0)
+    {
+        if (port_delta != 0)
+        {
+            const size_t count = remote.size();
+            for (size_t i = 0; i < count; i++)
+            {
+                if (remote[i].kind != PUNCH_REFLEXIVE)
+                    continue;
+                for (int k = 1; k <= PUNCH_PREDICT_COUNT; k++)
+                {
+                    const int32_t port = punch_port(remote[i].addr) + port_delta * k;
+                    if (port <= 0 || port > 65535)
+                        break;
+                    punch_candidate c = remote[i];
+                    c.kind = PUNCH_PREDICTED;
+                    punch_set_port(c.addr, static_cast<uint16_t>(port));
+                    remote.push_back(c);
+                }
+            }
+        }
+        std::stable_sort(remote.begin(), remote.end(), [](const punch_candidate &a, const punch_candidate &b)
+                         { return a.kind < b.kind; });
+        std::lock_guard<std::mutex> guard(lock);
+        const auto now = std::chrono::steady_clock::now();
+        attempt a{next_id++, session, {}, now, now + std::chrono::milliseconds(timeout_ms), 0};
+        for (const auto &c : remote)
+        {
+            if (a.checks.size() >= PUNCH_MAX_PAIRS || !usable(c.addr.ss_family))
+                continue;
+            const bool known = std::any_of(a.checks.begin(), a.checks.end(), [&c](const check &k)
+                                           { return punch_same_addr(k.remote, c.addr); });
+            if (known)
+                continue;
+            const auto due = now + std::chrono::milliseconds(PUNCH_PAIR_SPACING_MS * a.checks.size());
+            a.checks.push_back({c.addr, c.kind, rng(), due, PUNCH_FIRST_PACE_MS});
+        }
+        for (size_t i = early.size(); i-- > 0;)
+        {
+            const auto &[from_session, from, at] = early[i];
+            if (now - at > std::chrono::milliseconds(PUNCH_EARLY_KEEP_MS))
+            {
+                early.erase(early.begin() + static_cast<ptrdiff_t>(i));
+                continue;
+            }
+            if (from_session != session || !usable(from.ss_family))
+                continue;
+            add_triggered(a, from, now);
+            early.erase(early.begin() + static_cast<ptrdiff_t>(i));
+        }
+        if (a.checks.empty())
+            return 0;
+        const auto id = a.id;
+        register_session(session, a.deadline + std::chrono::milliseconds(PUNCH_SESSION_KEEP_MS));
+        attempts.push_back(std::move(a));
+        send_due(now);
+        return id;
+    }
+
+    // 取消进行中的连接，不再回调
+    void cancel(uint64_t id)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        attempts.erase(std::remove_if(attempts.begin(), attempts.end(), [id](const attempt &a)
+                                      { return a.id == id; }),
+                       attempts.end());
+    }
+
+    // 放弃全部进行中的连接
+    void clear()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        attempts.clear();
+        early.clear();
+        sessions.clear();
+    }
+
+    // 已学到的本端 NAT 映射地址
+    std::vector<punch_candidate> reflexive_candidates()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return reflexive;
+    }
+};
+
+/**
+ * 各网卡的单播地址（局域网与 IPv6）作为本端局域网候选，端口为 port
+ * 回环与链路本地地址不作为候选
+ */
+inline std::vector<punch_candidate> punch_host_candidates(uint16_t port, bool v4, bool v6)
+{
+    std::vector<punch_candidate> out;
+    const auto add = [&out, port, v4, v6](const sockaddr *sa)
+    {
+        punch_candidate c{};
+        c.kind = PUNCH_HOST;
+        if (sa->sa_family == AF_INET && v4)
+        {
+            auto in = *reinterpret_cast<const sockaddr_in *>(sa);
+            if ((ntohl(in.sin_addr.s_addr) >> 24) == 127 || (ntohl(in.sin_addr.s_addr) >> 16) == 0xA9FE)
+                return;
+            in.sin_port = htons(port);
+            memcpy(&c.addr, &in, sizeof(in));
+        }
+        else if (sa->sa_family == AF_INET6 && v6)
+        {
+            auto in6 = *reinterpret_cast<const sockaddr_in6 *>(sa);
+            if (IN6_IS_ADDR_LOOPBACK(&in6.sin6_addr) || IN6_IS_ADDR_LINKLOCAL(&in6.sin6_addr))
+                return;
+            in6.sin6_port = htons(port);
+            in6.sin6_scope_id = 0;
+            memcpy(&c.addr, &in6, sizeof(in6));
+        }
+        else
+        {
+            return;
+        }
+        out.push_back(c);
+    };
+#ifdef _WIN32
+    ULONG size = 16 * 1024;
+    std::vector<uint64_t> buffer(size / sizeof(uint64_t) + 1);
+    auto *list = reinterpret_cast<IP_ADAPTER_ADDRESSES *>(buffer.data());
+    if (GetAdaptersAddresses(AF_UNSPEC, GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST | GAA_FLAG_SKIP_DNS_SERVER,
+                             nullptr, list, &size) == NO_ERROR)
+    {
+        for (auto *a = list; a != nullptr; a = a->Next)
+        {
+            // 跳过 wireguard 等隧道网卡，隧道地址只在打通后可达
+            if (a->OperStatus != IfOperStatusUp || a->IfType == IF_TYPE_PROP_VIRTUAL || a->IfType == IF_TYPE_TUNNEL)
+                continue;
+            for (auto *u = a->FirstUnicastAddress; u != nullptr; u = u->Next)
+                add(u->Address.lpSockaddr);
+        }
+    }
+#else
+    ifaddrs *list = nullptr;
+    if (getifaddrs(&list) == 0)
+    {
+        for (auto *a = list; a != nullptr; a = a->ifa_next)
+        {
+            if (a->ifa_addr != nullptr && (a->ifa_flags & IFF_UP) != 0 && (a->ifa_flags & IFF_POINTOPOINT) == 0)
+                add(a->ifa_addr);
+        }
+        freeifaddrs(list);
+    }
+#endif
+    return out;
+}
+
+// poll 返回的唤醒时间换算为等待毫秒数，不超过 max_ms
+inline int punch_wait_ms(std::chrono::steady_clock::time_point wake, std::chrono::steady_clock::time_point now, int max_ms)
+{
+    if (wake == std::chrono::steady_clock::time_point::max())
+        return max_ms;
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count() + 1;
+    return ms < max_ms ? static_cast<int>(ms) : max_ms;
+}
+
+/**
+ * 套接字打洞引擎：punch_core 加上绑定同一端口的 IPv4/IPv6 UDP 套接字
+ * 只依赖标准套接字接口，可在 Linux 上用本地 UDP 端口测试
+ */
+class punch_engine
+{
+    punch_socket sock4 = PUNCH_INVALID_SOCKET;
+    punch_socket sock6 = PUNCH_INVALID_SOCKET;
+    uint16_t bound_port = 0;
+    punch_core core{[this](const sockaddr_storage &to, const uint8_t *data, size_t len)
+                    {
+                        const auto s = socket_for(to);
+                        if (s != PUNCH_INVALID_SOCKET)
+                            sendto(s, reinterpret_cast<const char *>(data), static_cast<int>(len), 0,
+                                   reinterpret_cast<const sockaddr *>(&to), punch_addr_len(to));
+                    },
+                    [this](int family)
+                    { return (family == AF_INET6 ? sock6 : sock4) != PUNCH_INVALID_SOCKET; }};
+    std::function<void(const punch_result &)> callback;
+    std::thread worker;
+    std::atomic<bool> stopping{false};
+
+    punch_socket socket_for(const sockaddr_storage &addr) const
+    {
+        return addr.ss_family == AF_INET6 ? sock6 : sock4;
+    }
+
+    void punch_loop()
+    {
+        std::vector<uint8_t> buf(2048);
+        std::vector<punch_result> done;
+        pollfd fds[2];
+        size_t n = 0;
+        if (sock4 != PUNCH_INVALID_SOCKET)
+            fds[n++] = {sock4, POLLIN, 0};
+        if (sock6 != PUNCH_INVALID_SOCKET)
+            fds[n++] = {sock6, POLLIN, 0};
+        while (!stopping)
+        {
+            auto now = std::chrono::steady_clock::now();
+            const int wait_ms = punch_wait_ms(core.poll(now, done), now, PUNCH_IDLE_WAIT_MS);
+            if (done.empty() && punch_poll(fds, n, wait_ms) > 0)
+            {
+                now = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < n; i++)
+                {
+                    if ((fds[i].revents & POLLIN) == 0)
+                        continue;
+                    sockaddr_storage from{};
+                    socklen_t from_len = sizeof(from);
+                    const auto len = recvfrom(fds[i].fd, reinterpret_cast<char *>(buf.data()), static_cast<int>(buf.size()), 0,
+                                              reinterpret_cast<sockaddr *>(&from), &from_len);
+                    if (len > 0)
+                        core.on_message(buf.data(), static_cast<size_t>(len), from, now, done);
+                }
+            }
+            // 回调不持有锁，回调中可以发起新的连接
+            for (const auto &r : done)
+            {
+                if (callback)
+                    callback(r);
+            }
+            done.clear();
+        }
+    }
+
+public:
+    punch_engine() = default;
+    punch_engine(const punch_engine &) = delete;
+    punch_engine &operator=(const punch_engine &) = delete;
+
+    ~punch_engine()
+    {
+        stop();
+    }
+
+    /**
+     * 绑定端口并启动引擎，port 为 0 时由系统分配，IPv6 不可用时只使用 IPv4
+     * @param cb 连接结果回调，在引擎线程中调用
+     */
+    bool start(uint16_t port, std::function<void(const punch_result &)> cb)
+    {
+        stop();
+        sock4 = punch_open(AF_INET, port);
+        if (sock4 == PUNCH_INVALID_SOCKET)
+            return false;
+        sockaddr_in local{};
+        socklen_t len = sizeof(local);
+        getsockname(sock4, reinterpret_cast<sockaddr *>(&local), &len);
+        bound_port = ntohs(local.sin_port);
+        sock6 = punch_open(AF_INET6, bound_port);
+        callback = std::move(cb);
+        stopping = false;
+        worker = std::thread([this]
+                             { punch_loop(); });
+        return true;
+    }
+
+    void stop()
+    {
+        stopping = true;
+        if (worker.joinable())
+            worker.join();
+        if (sock4 != PUNCH_INVALID_SOCKET)
+            punch_close(sock4);
+        if (sock6 != PUNCH_INVALID_SOCKET)
+            punch_close(sock6);
+        sock4 = PUNCH_INVALID_SOCKET;
+        sock6 = PUNCH_INVALID_SOCKET;
+        core.clear();
+    }
+
+    bool running() const
+    {
+        return worker.joinable();
+    }
+
+    uint16_t port() const
+    {
+        return bound_port;
+    }
+
+    // 本端候选：各网卡的单播地址加上已学到的 NAT 映射地址，按优先级排序
+    std::vector<punch_candidate> local_candidates()
+    {
+        auto out = punch_host_candidates(bound_port, sock4 != PUNCH_INVALID_SOCKET, sock6 != PUNCH_INVALID_SOCKET);
+        for (const auto &c : core.reflexive_candidates())
+            out.push_back(c);
+        return out;
+    }
+
+    // 向候选地址并发发起检查，返回连接 id，结果通过回调返回，引擎未启动或没有可用候选返回 0
+    uint64_t connect(uint64_t session, std::vector<punch_candidate> remote, uint32_t timeout_ms, int32_t port_delta = 0)
+    {
+        if (!running())
+            return 0;
+        return core.connect(session, std::move(remote), timeout_ms, port_delta);
+    }
+
+    // 取消进行中的连接，不再回调
+    void cancel(uint64_t id)
+    {
+        core.cancel(id);
+    }
+};
+
+#ifdef HOLE_PUNCH_SELFTEST
+// 本地自测：bash lib/selftest.sh hole_punch
+#include "selftest_compat.h"
+#include "iostream"
+#include "condition_variable"
+#include "deque"
+#include "memory"
+
+namespace punch_test
+{
+    // 本地 UDP 替身：转发到目标端口，丢弃前 drop 个报文，模拟尚未建立映射的 NAT
+    class lossy_forwarder
+    {
+        punch_socket front = PUNCH_INVALID_SOCKET;
+        punch_socket back = PUNCH_INVALID_SOCKET;
+        sockaddr_in target{};
+        sockaddr_in client{};
+        int drop;
+        std::atomic<bool> stopping{false};
+        std::thread worker;
+
+    public:
+        uint16_t port = 0;
+
+        lossy_forwarder(uint16_t target_port, int drop) : drop(drop)
+        {
+            front = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            back = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            bind(front, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+            bind(back, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+            socklen_t len = sizeof(addr);
+            getsockname(front, reinterpret_cast<sockaddr *>(&addr), &len);
+            port = ntohs(addr.sin_port);
+            target.sin_family = AF_INET;
+            target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            target.sin_port = htons(target_port);
+            worker = std::thread([this]
+                                 { run(); });
+        }
+
+        ~lossy_forwarder()
+        {
+            stopping = true;
+            worker.join();
+            punch_close(front);
+            punch_close(back);
+        }
+
+        void run()
+        {
+            uint8_t buf[2048];
+            pollfd fds[2] = {{front, POLLIN, 0}, {back, POLLIN, 0}};
+            while (!stopping)
+            {
+                if (punch_poll(fds, 2, 20) <= 0)
+                    continue;
+                sockaddr_in from{};
+                socklen_t len = sizeof(from);
+                if (fds[0].revents & POLLIN)
+                {
+                    const auto n = recvfrom(front, reinterpret_cast<char *>(buf), sizeof(buf), 0, reinterpret_cast<sockaddr *>(&from), &len);
+                    client = from;
+                    if (n > 0 && drop-- <= 0)
+                        sendto(back, reinterpret_cast<char *>(buf), n, 0, reinterpret_cast<sockaddr *>(&target), sizeof(target));
+                }
+                if (fds[1].revents & POLLIN)
+                {
+                    const auto n = recvfrom(back, reinterpret_cast<char *>(buf), sizeof(buf), 0, reinterpret_cast<sockaddr *>(&from), &len);
+                    if (n > 0)
+                        sendto(front, reinterpret_cast<char *>(buf), n, 0, reinterpret_cast<sockaddr *>(&client), sizeof(client));
+                }
+            }
+        }
+    };
+
+    struct waiter
+    {
+        std::mutex lock;
+        std::condition_variable cv;
+        std::vector<punch_result> results;
+
+        void push(const punch_result &r)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            results.push_back(r);
+            cv.notify_all();
+        }
+
+        punch_result wait(uint64_t id)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            punch_result out{};
+            cv.wait_for(guard, std::chrono::seconds(15), [&]
+                        {
+                for (const auto &r : results)
+                    if (r.id == id) { out = r; return true; }
+                return false; });
+            return out;
+        }
+    };
+
+    inline punch_candidate candidate(const char *text)
+    {
+        punch_candidate c{};
+        parse_candidate(text, c);
+        return c;
+    }
+
+    /**
+     * 不经过套接字的内存链路：两个 punch_core 各在一个端口受限型 NAT 之后
+     * 出站报文的源地址改写为映射地址，入站报文只有在本端曾向该地址发送过时才放行
+     */
+    struct nat_link
+    {
+        struct side
+        {
+            sockaddr_storage mapped;
+            std::vector<sockaddr_storage> opened;
+            std::unique_ptr<punch_core> core;
+        };
+        struct packet
+        {
+            int to;
+            sockaddr_storage from;
+            std::vector<uint8_t> data;
+        };
+        side sides[2];
+        std::deque<packet> wire;
+        size_t dropped = 0;
+
+        nat_link(const char *mapped_a, const char *mapped_b)
+        {
+            sides[0].mapped = candidate(mapped_a).addr;
+            sides[1].mapped = candidate(mapped_b).addr;
+            for (int i = 0; i < 2; i++)
+            {
+                sides[i].core = std::make_unique<punch_core>(
+                    [this, i](const sockaddr_storage &to, const uint8_t *data, size_t len)
+                    {
+                        sides[i].opened.push_back(to);
+                        const int peer = punch_same_addr(to, sides[1 - i].mapped) ? 1 - i : -1;
+                        if (peer >= 0)
+                            wire.push_back({peer, sides[i].mapped, std::vector<uint8_t>(data, data + len)});
+                    },
+                    [](int family)
+                    { return family == AF_INET; });
+            }
+        }
+
+        // 投递链路上的报文并驱动重发，直到 done 中出现 want 个结果或超过 limit_ms
+        void run(std::vector<punch_result> &done, size_t want, int limit_ms)
+        {
+            const auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(limit_ms);
+            while (done.size() < want && std::chrono::steady_clock::now() < end)
+            {
+                const auto now = std::chrono::steady_clock::now();
+                sides[0].core->poll(now, done);
+                sides[1].core->poll(now, done);
+                while (!wire.empty())
+                {
+                    const auto p = wire.front();
+                    wire.pop_front();
+                    auto &dst = sides[p.to];
+                    const bool open = std::any_of(dst.opened.begin(), dst.opened.end(), [&p](const sockaddr_storage &a)
+                                                  { return punch_same_addr(a, p.from); });
+                    if (!open)
+                    {
+                        dropped++;
+                        continue;
+                    }
+                    dst.core->on_message(p.data.data(), p.data.size(), p.from, now, done);
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    };
+
+    inline int run()
+    {
+        // 编解码
+        punch_message msg{PUNCH_RESPONSE, 7, 0x0102030405060708ull, 42, candidate("[2001:db8::1]:51820").addr};
+        uint8_t buf[PUNCH_RESPONSE_SIZE];
+        punch_message back{};
+        expect(msg.encode(buf) == PUNCH_RESPONSE_SIZE && back.decode(buf, sizeof(buf)) && back.pair == 7 &&
+                   back.session == msg.session && back.nonce == 42 && punch_same_addr(back.mapped, msg.mapped),
+               "message round trip");
+        expect(!back.decode(buf, PUNCH_REQUEST_SIZE - 1), "short message rejected");
+
+        // 状态机：双方在端口受限型 NAT 之后同时连接，先到的检查被对方 NAT 丢弃，之后由重发打通
+        {
+            nat_link link("198.51.100.1:40000", "203.0.113.2:51820");
+            const uint64_t session = punch_session("core");
+            std::vector<punch_result> done;
+            link.sides[0].core->connect(session, {candidate("203.0.113.2:51820"), candidate("192.0.2.1:9")}, 2000);
+            link.run(done, 1, 5);
+            link.sides[1].core->connect(session, {candidate("198.51.100.1:40000")}, 2000);
+            link.run(done, 2, 3000);
+            const bool both = done.size() == 2 && done[0].success && done[1].success;
+            const auto learned = link.sides[0].core->reflexive_candidates();
+            expect(both && link.dropped > 0, "core mutual connect behind nat, " + std::to_string(link.dropped) + " dropped");
+            expect(learned.size() == 1 && punch_same_addr(learned[0].addr, link.sides[0].mapped), "core learns mapped address");
+        }
+
+        waiter wa, wb;
+        punch_engine a, b;
+        expect(a.start(0, [&wa](const punch_result &r)
+                       { wa.push(r); }),
+               "engine a start");
+        expect(b.start(0, [&wb](const punch_result &r)
+                       { wb.push(r); }),
+               "engine b start");
+        std::cout << "local candidates:";
+        for (const auto &c : a.local_candidates())
+            std::cout << " " << format_candidate(c.addr);
+        std::cout << std::endl;
+
+        // 不可达候选与可达候选并发检查：黑洞地址、无人监听的端口、丢弃前 3 个报文的 NAT 替身
+        lossy_forwarder nat(b.port(), 3);
+        const uint64_t session = punch_session("selftest");
+        std::vector<punch_candidate> remote = {
+            candidate("192.0.2.1:9"),
+            candidate("127.0.0.1:1"),
+            candidate(("127.0.0.1:" + std::to_string(nat.port)).c_str()),
+        };
+        // b 只应答登记过的会话：以同一会话连接一个不可达地址完成登记
+        const auto registered = b.connect(session, {candidate("192.0.2.1:9")}, 5000);
+        auto id = a.connect(session, remote, 5000);
+        auto r = wa.wait(id);
+        b.cancel(registered);
+        expect(r.success && ntohs(reinterpret_cast<sockaddr_in &>(r.remote).sin_port) == nat.port,
+               "lossy path selected in " + std::to_string(r.elapsed_ms) + "ms, " + std::to_string(r.sent) + " checks");
+
+        // 双方同时连接：b 通过 a 的检查学到 a 的源地址，追加触发检查
+        const uint64_t mutual = punch_session("mutual");
+        const auto ida = a.connect(mutual, {candidate(("127.0.0.1:" + std::to_string(b.port())).c_str())}, 3000);
+        const auto idb = b.connect(mutual, {candidate("192.0.2.1:9")}, 3000);
+        const auto ra = wa.wait(ida);
+        const auto rb = wb.wait(idb);
+        expect(ra.success && rb.success, "mutual connect a:" + std::to_string(ra.elapsed_ms) + "ms b:" + std::to_string(rb.elapsed_ms) + "ms");
+
+        // IPv6 回环
+        punch_candidate v6 = candidate(("[::1]:" + std::to_string(b.port())).c_str());
+        v6.kind = PUNCH_HOST;
+        const auto v6_registered = b.connect(punch_session("v6"), {candidate("192.0.2.1:9")}, 2000);
+        id = a.connect(punch_session("v6"), {v6}, 2000);
+        if (id != 0)
+        {
+            r = wa.wait(id);
+            expect(r.success, "ipv6 loopback in " + std::to_string(r.elapsed_ms) + "ms");
+        }
+        b.cancel(v6_registered);
+
+        // 未登记的会话不应答，路径探测会话照常应答
+        const auto b_addr = candidate(("127.0.0.1:" + std::to_string(b.port())).c_str());
+        id = a.connect(punch_session("stranger"), {b_addr}, 600);
+        r = wa.wait(id);
+        expect(!r.success, "unregistered session not answered, " + std::to_string(r.sent) + " checks");
+        id = a.connect(PUNCH_PROBE_SESSION, {b_addr}, 2000);
+        r = wa.wait(id);
+        expect(r.success, "path probe answered without registration");
+
+        // 全部不可达：超时失败
+        id = a.connect(punch_session("dead"), {candidate("192.0.2.1:9"), candidate("127.0.0.1:1")}, 600);
+        r = wa.wait(id);
+        expect(!r.success && r.elapsed_ms >= 600, "unreachable candidates time out, " + std::to_string(r.sent) + " checks");
+        return selftest_result();
+    }
+}
+
+int main()
+{
+    return punch_test::run();
+}
+#endif
@@ -0,0 +1,410 @@
+#ifdef _WIN32
+#include "src/wireguard.h"
+#include "wireguard_tool.cpp"
+#else
+#include "selftest_compat.h"
+#endif
+#include "vector"
+#include "chrono"
+
+#pragma once
+
+// 保守的保活间隔(s)，探测失败或路径变化时回退到该值
+static constexpr uint16_t KEEPALIVE_CONSERVATIVE = 15;
+// 保活间隔上下限(s)
+static constexpr uint16_t KEEPALIVE_MIN = 10;
+static constexpr uint16_t KEEPALIVE_MAX = 120;
+// 每次检查中收发字节都少于该值视为静默（只有保活包）
+static constexpr uint64_t KEEPALIVE_IDLE_BYTES = 256;
+// 连续静默多久后进入探测
+static constexpr auto KEEPALIVE_IDLE_AFTER = std::chrono::seconds(60);
+// 共享采样线程比对收发计数的间隔(ms)
+static constexpr uint32_t KEEPALIVE_TICK_MS = 5000;
+// 二分探测的精度(s)，上下界差小于该值时停止探测
+static constexpr uint16_t KEEPALIVE_PRECISION = 5;
+
+// 导出给调用方的单个 peer 保活状态，调用方按 48 字节步长解析
+#pragma pack(push, 8)
+struct keepalive_stat
+{
+    uint8_t public_key[WIREGUARD_KEY_LENGTH];
+    uint16_t interval; // 当前写入适配器的保活间隔(s)
+    uint16_t lifetime; // 探测到的失效间隔(s)，0 表示尚未测得
+    uint16_t verified; // 静默期内已验证可用的最大间隔(s)，0 表示尚未验证
+    uint16_t idle;     // 1 表示处于静默期，探测只在此期间进行
+    uint64_t saved;    // 相比固定 KEEPALIVE_CONSERVATIVE 少发的保活包数
+};
+#pragma pack(pop)
+static_assert(sizeof(keepalive_stat) == 48, "keepalive_stat layout changed");
+
+/**
+ * 自适应保活控制器，每个房间一个，调用方需持有房间锁
+ * 有数据流动时 wireguard 不发保活，NAT 映射由数据刷新，此时间隔无从验证也无需调整；
+ * 只在静默期（双方只有保活包）探测：先在已验证或保守间隔下记录对端保活包的最大到达间隔，
+ * 之后放大本端间隔，对端保活包晚于该间隔加两个检查周期仍未到达视为入站被丢弃、映射已在本端间隔内失效，
+ * 记录为上界并回退到已验证的间隔，之后在上下界之间二分。
+ * 判定依据只有收发字节计数，并不直接测量 NAT：依赖对端在静默期周期性发包，
+ * 对端静默时不放大也不判定，保持当前间隔；入站也会刷新映射的 NAT 上测得的值偏大，真实丢包会使其偏小
+ */
+class keepalive_controller
+{
+    struct path_state
+    {
+        uint8_t public_key[WIREGUARD_KEY_LENGTH];
+        SOCKADDR_INET endpoint;
+        uint16_t interval;
+        uint16_t good;
+        uint16_t bad;
+        bool quiet;
+        // 本次静默期内是否收到过对端报文
+        bool heard;
+        bool seen;
+        uint64_t rx_bytes;
+        uint64_t tx_bytes;
+        // 最近一次收到数据时的发送计数，之后只发不收用于判定映射失效
+        uint64_t tx_at_rx;
+        // 安全间隔下观测到的对端静默期最大发包间隔，0 表示尚未测得
+        std::chrono::steady_clock::duration remote_gap;
+        std::chrono::steady_clock::time_point rx_at;
+        std::chrono::steady_clock::time_point step_at;
+        std::chrono::steady_clock::time_point active_at;
+        double saved;
+    };
+
+    std::vector<path_state> paths;
+
+    path_state *find(const uint8_t *key)
+    {
+        for (auto &p : paths)
+        {
+            if (memcmp(p.public_key, key, WIREGUARD_KEY_LENGTH) == 0)
+                return &p;
+        }
+        return nullptr;
+    }
+
+    const path_state *find(const uint8_t *key) const
+    {
+        return const_cast<keepalive_controller *>(this)->find(key);
+    }
+
+    // 新路径或路径变化：从保守间隔重新探测
+    static void reset(path_state &p, const SOCKADDR_INET &endpoint, std::chrono::steady_clock::time_point now)
+    {
+        p.endpoint = endpoint;
+        p.interval = KEEPALIVE_CONSERVATIVE;
+        p.good = 0;
+        p.bad = 0;
+        p.quiet = false;
+        p.heard = false;
+        p.remote_gap = {};
+        p.rx_at = now;
+        p.step_at = now;
+        p.active_at = now;
+        p.tx_at_rx = p.tx_bytes;
+    }
+
+    // 已验证的间隔，尚未验证时为保守值；在该间隔下观测到的对端发包间隔可作为基准
+    static uint16_t safe(const path_state &p)
+    {
+        return p.good != 0 ? p.good : KEEPALIVE_CONSERVATIVE;
+    }
+
+    // 下一个探测间隔：未测得上界时按 1.5 倍放大，测得后在上下界之间二分
+    static uint16_t next_probe(const path_state &p)
+    {
+        if (p.bad == 0)
+        {
+            const uint16_t next = static_cast<uint16_t>(p.interval + p.interval / 2);
+            return next > KEEPALIVE_MAX ? KEEPALIVE_MAX : next;
+        }
+        if (p.bad - p.good <= KEEPALIVE_PRECISION)
+            return p.good;
+        return static_cast<uint16_t>((p.good + p.bad) / 2);
+    }
+
+    // 映射失效的判定窗口：对端最大发包间隔加两个检查周期的计数误差
+    static std::chrono::steady_clock::duration dead_window(const path_state &p)
+    {
+        return p.remote_gap + std::chrono::milliseconds(2 * KEEPALIVE_TICK_MS);
+    }
+
+public:
+    // peer 当前应使用的保活间隔，未跟踪的 peer 使用保守值
+    uint16_t interval_for(const uint8_t *key) const
+    {
+        const auto *p = find(key);
+        return p == nullptr ? KEEPALIVE_CONSERVATIVE : p->interval;
+    }
+
+    /**
+     * 按一次配置查询更新各路径状态
+     * @return 需要修改保活间隔的 peer 是否存在，调用方随后通过 interval_for 写入配置并应用
+     */
+    bool update(const WIREGUARD_INTERFACE *config, std::chrono::steady_clock::time_point now, double elapsed_s)
+    {
+        bool changed = false;
+        for (auto &p : paths)
+            p.seen = false;
+        const BYTE *cursor = reinterpret_cast<const BYTE *>(config) + interface_size;
+        for (DWORD i = 0; i < config->PeersCount; i++)
+        {
+            const auto *peer = reinterpret_cast<const WIREGUARD_PEER *>(cursor);
+            cursor += peer_size + peer->AllowedIPsCount * allowed_ip_size;
+            auto *p = find(peer->PublicKey);
+            if (p == nullptr)
+            {
+                paths.push_back({});
+                p = &paths.back();
+                memcpy(p->public_key, peer->PublicKey, WIREGUARD_KEY_LENGTH);
+                p->tx_bytes = peer->TxBytes;
+                p->rx_bytes = peer->RxBytes;
+                reset(*p, peer->Endpoint, now);
+                changed |= peer->PersistentKeepalive != p->interval;
+            }
+            p->seen = true;
+            const uint16_t before = p->interval;
+            // 统计节省的保活包：固定间隔应发的数量减去实际间隔应发的数量
+            p->saved += elapsed_s / KEEPALIVE_CONSERVATIVE - elapsed_s / before;
+
+            if (!same_endpoint(p->endpoint, peer->Endpoint))
+            {
+                reset(*p, peer->Endpoint, now);
+            }
+            const uint64_t rx_delta = peer->RxBytes - p->rx_bytes;
+            const uint64_t tx_delta = peer->TxBytes - p->tx_bytes;
+            p->rx_bytes = peer->RxBytes;
+            p->tx_bytes = peer->TxBytes;
+            if (rx_delta > KEEPALIVE_IDLE_BYTES || tx_delta > KEEPALIVE_IDLE_BYTES)
+            {
+                // 有数据流动：映射由数据刷新，不探测也不计入验证
+                p->active_at = now;
+                p->quiet = false;
+            }
+            else if (!p->quiet && now - p->active_at >= KEEPALIVE_IDLE_AFTER)
+            {
+                p->quiet = true;
+                p->heard = false;
+                p->step_at = now;
+            }
+            if (rx_delta > 0)
+            {
+                // 只在安全间隔下记录对端发包间隔，放大后的丢包不能抬高基准
+                if (p->quiet && p->heard && p->interval <= safe(*p) && now - p->rx_at > p->remote_gap)
+                    p->remote_gap = now - p->rx_at;
+                p->heard = p->quiet;
+                p->rx_at = now;
+                p->tx_at_rx = peer->TxBytes;
+            }
+
+            if (p->quiet && p->heard && p->remote_gap.count() != 0)
+            {
+                if (peer->TxBytes > p->tx_at_rx && now - p->rx_at >= dead_window(*p))
+                {
+                    // 发出保活后对端报文迟迟未到：当前间隔下映射已失效，入站被丢弃
+                    p->bad = p->interval;
+                    if (p->good >= p->bad)
+                        p->good = 0;
+                    p->interval = p->good != 0 ? p->good : (p->bad > KEEPALIVE_CONSERVATIVE ? KEEPALIVE_CONSERVATIVE : KEEPALIVE_MIN);
+                    // 恢复前的到达间隔包含丢包，需重新收到对端报文后再判定
+                    p->heard = false;
+                    p->rx_at = now;
+                    p->tx_at_rx = peer->TxBytes;
+                    p->step_at = now;
+                    log(WIREGUARD_LOG_INFO, "keepalive path expired at " + std::to_string(p->bad) + "s, fallback to " + std::to_string(p->interval) + "s");
+                }
+                else if (now - p->step_at >= std::chrono::seconds(3 * p->interval + 30))
+                {
+                    // 静默期内当前间隔持续可用，记为已验证并继续探测
+                    if (p->interval > p->good)
+                        p->good = p->interval;
+                    p->interval = next_probe(*p);
+                    p->step_at = now;
+                }
+            }
+            changed |= p->interval != before;
+        }
+        // 已删除的 peer 不再跟踪
+        for (size_t i = paths.size(); i-- > 0;)
+        {
+            if (!paths[i].seen)
+                paths.erase(paths.begin() + static_cast<ptrdiff_t>(i));
+        }
+        return changed;
+    }
+
+    // 关闭自适应保活时清空状态，之后所有 peer 使用保守值
+    void clear()
+    {
+        paths.clear();
+    }
+
+    // 输出各路径状态，返回路径总数
+    size_t stats(keepalive_stat *out, size_t max) const
+    {
+        for (size_t i = 0; i < paths.size() && i < max; i++)
+        {
+            const auto &p = paths[i];
+            auto &s = out[i];
+            memset(&s, 0, sizeof(s));
+            memcpy(s.public_key, p.public_key, WIREGUARD_KEY_LENGTH);
+            s.interval = p.interval;
+            s.lifetime = p.bad;
+            s.verified = p.good;
+            s.idle = p.quiet;
+            s.saved = p.saved > 0 ? static_cast<uint64_t>(p.saved) : 0;
+        }
+        return paths.size();
+    }
+};
+
+#ifdef KEEPALIVE_SELFTEST
+// 本地自测：bash lib/selftest.sh keepalive
+#include "selftest_compat.h"
+#include "iostream"
+
+namespace keepalive_test
+{
+    // 模拟一条经过 NAT 的路径：映射只由本端出站报文刷新，超过寿命后对端报文被丢弃，下次出站重建映射
+    struct nat_path
+    {
+        int lifetime;    // 映射寿命(s)
+        int remote;      // 对端保活间隔(s)，0 表示对端静默
+        int last_out = 0;
+        int last_keepalive = 0;
+        int last_remote = 0;
+        uint64_t tx = 0;
+        uint64_t rx = 0;
+        uint64_t dropped = 0;
+
+        // 推进一秒，busy 表示双向都有数据，此时双方都不发保活
+        void step(int t, uint16_t interval, bool busy)
+        {
+            if (busy)
+            {
+                tx += 1400;
+                rx += 1400;
+                last_out = last_keepalive = last_remote = t;
+                return;
+            }
+            if (remote != 0 && t - last_remote >= remote)
+            {
+                last_remote = t;
+                if (t - last_out < lifetime)
+                    rx += 32;
+                else
+                    dropped++;
+            }
+            if (t - last_keepalive >= interval)
+            {
+                tx += 32;
+                last_out = last_keepalive = t;
+            }
+        }
+    };
+
+    // 按保活线程的节奏每 5s 把模拟计数交给控制器
+    struct harness
+    {
+        keepalive_controller controller;
+        std::vector<BYTE> buffer = std::vector<BYTE>(interface_size + peer_size);
+        WIREGUARD_INTERFACE *config = reinterpret_cast<WIREGUARD_INTERFACE *>(buffer.data());
+        WIREGUARD_PEER *peer = reinterpret_cast<WIREGUARD_PEER *>(buffer.data() + interface_size);
+        std::chrono::steady_clock::time_point base = std::chrono::steady_clock::now();
+        int t = 0;
+
+        harness()
+        {
+            config->PeersCount = 1;
+            memset(peer->PublicKey, 3, WIREGUARD_KEY_LENGTH);
+            parse_ip("203.0.113.7", 51820, peer->Endpoint);
+        }
+
+        uint16_t interval() const
+        {
+            return controller.interval_for(peer->PublicKey);
+        }
+
+        keepalive_stat stat() const
+        {
+            keepalive_stat s{};
+            controller.stats(&s, 1);
+            return s;
+        }
+
+        void run(nat_path &path, int seconds, bool busy)
+        {
+            for (const int end = t + seconds; t < end; t++)
+            {
+                path.step(t, interval(), busy);
+                if ((t + 1) % (KEEPALIVE_TICK_MS / 1000) != 0)
+                    continue;
+                peer->TxBytes = path.tx;
+                peer->RxBytes = path.rx;
+                peer->PersistentKeepalive = interval();
+                controller.update(config, base + std::chrono::seconds(t + 1), KEEPALIVE_TICK_MS / 1000.0);
+            }
+        }
+    };
+
+    inline int run()
+    {
+        {
+            // 持续有数据时保活不会发出，不能据此放大
+            harness h;
+            nat_path path{30, 25};
+            h.run(path, 2 * 3600, true);
+            expect(h.interval() == KEEPALIVE_CONSERVATIVE && h.stat().verified == 0, "busy path keeps conservative interval");
+        }
+        {
+            // 30s 映射寿命：静默期放大到超过寿命时对端保活被丢弃，应判定失效并收敛到寿命以下
+            harness h;
+            nat_path path{30, 25};
+            h.run(path, 600, true);
+            h.run(path, 4 * 3600, false);
+            const auto s = h.stat();
+            expect(s.idle == 1, "quiet path is probing");
+            expect(s.lifetime != 0 && s.lifetime <= 49, "expiry detected while quiet, lifetime " + std::to_string(s.lifetime));
+            expect(h.interval() >= 20 && h.interval() < 30, "converged below binding lifetime at " + std::to_string(h.interval()) + "s");
+            const uint64_t dropped = path.dropped;
+            h.run(path, 3600, false);
+            expect(path.dropped == dropped, "no inbound loss after convergence");
+            // 一段数据流不改变已收敛的间隔
+            const uint16_t settled = h.interval();
+            h.run(path, 600, true);
+            expect(h.interval() == settled && h.stat().idle == 0, "traffic leaves converged interval alone");
+        }
+        {
+            // 宽松 NAT：静默期逐步验证到上限，且全程无入站丢包
+            harness h;
+            nat_path path{300, 25};
+            h.run(path, 4 * 3600, false);
+            expect(h.interval() == KEEPALIVE_MAX && h.stat().lifetime == 0, "loose nat grows to " + std::to_string(h.interval()) + "s");
+            expect(path.dropped == 0, "loose nat never drops inbound");
+        }
+        {
+            // 对端静默时无从判定，保持保守间隔
+            harness h;
+            nat_path path{30, 0};
+            h.run(path, 4 * 3600, false);
+            expect(h.interval() == KEEPALIVE_CONSERVATIVE && h.stat().verified == 0, "silent remote keeps conservative interval");
+        }
+        {
+            // 路径变化后重新探测
+            harness h;
+            nat_path path{300, 25};
+            h.run(path, 3600, false);
+            const bool grown = h.interval() > KEEPALIVE_CONSERVATIVE;
+            parse_ip("198.51.100.20", 40000, h.peer->Endpoint);
+            h.run(path, 5, false);
+            expect(grown && h.interval() == KEEPALIVE_CONSERVATIVE && h.stat().verified == 0, "endpoint change resets probing");
+        }
+        return selftest_result();
+    }
+}
+
+int main()
+{
+    return keepalive_test::run();
+}
+#endif
@@ -0,0 +1,660 @@
+#include "hole_punch.cpp"
+#include "cstdint"
+#include "cstring"
+#include "vector"
+#include "array"
+#include "mutex"
+#include "chrono"
+#include "cmath"
+
+#pragma once
+
+// 报文标识 "MLAT" 与版本
+static constexpr uint32_t LATENCY_MAGIC = 0x4D4C4154;
+static constexpr uint8_t LATENCY_VERSION = 1;
+// 报文长度：0 magic u32 | 4 version u8 | 5 type u8 | 6 保留 u16 | 8 seq u32
+static constexpr size_t LATENCY_MESSAGE_SIZE = 12;
+// 一个探测报文经 wireguard 封装后的字节数估算（16 头 + 按 16 字节对齐的内层 IP/UDP 报文 + 16 认证标签），
+// 判断空闲时从 peer 收发计数中扣除探测自身产生的流量
+static constexpr uint64_t LATENCY_WIRE_BYTES = 80;
+// 自适应探测间隔(ms)：从下限开始，连续 LATENCY_STABLE_REPLIES 个平稳应答后加倍，丢包或时延突增时回到下限
+static constexpr uint32_t LATENCY_MIN_INTERVAL_MS = 500;
+static constexpr uint32_t LATENCY_MAX_INTERVAL_MS = 5000;
+static constexpr uint32_t LATENCY_STABLE_REPLIES = 8;
+// 每个房间每秒最多发出的探测数，peer 较多时按比例放大每个 peer 的间隔
+static constexpr uint32_t LATENCY_ROOM_BUDGET_PPS = 20;
+// 超过该时间(ms)未收到应答计为丢包
+static constexpr uint32_t LATENCY_TIMEOUT_MS = 3000;
+// 每个 peer 同时等待应答的探测数上限，超出时最旧的计为丢包
+static constexpr size_t LATENCY_OUTSTANDING = 16;
+// 除探测外收发字节少于该值视为无业务流量，持续 LATENCY_IDLE_AFTER 后暂停探测
+static constexpr uint64_t LATENCY_ACTIVE_BYTES = 256;
+static constexpr auto LATENCY_IDLE_AFTER = std::chrono::seconds(60);
+// 直方图统计窗口：当前窗口与上一窗口合并计算分位数，窗口按该时长轮换
+static constexpr auto LATENCY_WINDOW = std::chrono::seconds(60);
+// 线程同步 peer 列表与空闲状态的间隔(ms)，以及无探测到期时的最长等待(ms)
+static constexpr uint32_t LATENCY_SYNC_MS = 1000;
+static constexpr int LATENCY_IDLE_WAIT_MS = 100;
+// 公钥长度，与 WIREGUARD_KEY_LENGTH 一致
+static constexpr size_t LATENCY_KEY_LENGTH = 32;
+
+enum latency_message_type : uint8_t
+{
+    LATENCY_REQUEST = 1,
+    LATENCY_REPLY = 2,
+};
+
+/**
+ * HDR 风格的对数线性直方图，记录微秒时延
+ * 小于 64us 的值精确记录，之后每个 2 的幂区间分 32 个线性子桶，相对误差不超过 1/32；
+ * 桶数固定，记录与查询不分配内存
+ */
+class latency_histogram
+{
+public:
+    static constexpr uint32_t LINEAR = 64;
+    static constexpr uint32_t SUB = 32;
+    // 可记录的最大值约 67s，超出的按最大值记录
+    static constexpr uint32_t MAX_VALUE = (1u << 26) - 1;
+    static constexpr uint32_t BUCKETS = LINEAR + 20 * SUB;
+
+private:
+    std::array<uint32_t, BUCKETS> counts{};
+    uint64_t total = 0;
+    uint32_t max_value = 0;
+
+    static uint32_t msb(uint32_t v)
+    {
+        uint32_t n = 0;
+        while (v >>= 1)
+            n++;
+        return n;
+    }
+
+public:
+    static uint32_t index_of(uint32_t v)
+    {
+        if (v < LINEAR)
+            return v;
+        const uint32_t shift = msb(v) - 5;
+        return LINEAR + (shift - 1) * SUB + ((v >> shift) - SUB);
+    }
+
+    // 桶内可能的最大值，分位数按此保守报告
+    static uint32_t upper_of(uint32_t idx)
+    {
+        if (idx < LINEAR)
+            return idx;
+        const uint32_t shift = (idx - LINEAR) / SUB + 1;
+        const uint32_t sub = (idx - LINEAR) % SUB + SUB;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    void record(uint32_t us)
+    {
+        if (us > MAX_VALUE)
+            us = MAX_VALUE;
+        counts[index_of(us)]++;
+        total++;
+        if (us > max_value)
+            max_value = us;
+    }
+
+    void reset()
+    {
+        counts.fill(0);
+        total = 0;
+        max_value = 0;
+    }
+
+    uint64_t count() const
+    {
+        return total;
+    }
+
+    uint32_t max() const
+    {
+        return max_value;
+    }
+
+    // 两个窗口合并后的分位数(q 取 0~1)，没有样本返回 0
+    static uint32_t percentile(const latency_histogram &a, const latency_histogram &b, double q)
+    {
+        const uint64_t n = a.total + b.total;
+        if (n == 0)
+            return 0;
+        auto rank = static_cast<uint64_t>(std::ceil(q * static_cast<double>(n)));
+        if (rank == 0)
+            rank = 1;
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < BUCKETS; i++)
+        {
+            seen += a.counts[i] + b.counts[i];
+            if (seen >= rank)
+            {
+                // 最大值所在桶按实际最大值报告
+                const uint32_t top = a.max_value > b.max_value ? a.max_value : b.max_value;
+                const uint32_t upper = upper_of(i);
+                return upper > top ? top : upper;
+            }
+        }
+        return a.max_value > b.max_value ? a.max_value : b.max_value;
+    }
+};
+
+// 导出给调用方的单个 peer 时延统计，调用方按 72 字节步长解析
+#pragma pack(push, 8)
+struct latency_stat
+{
+    uint8_t public_key[LATENCY_KEY_LENGTH];
+    uint32_t p50_us;      // 最近一到两个统计窗口的往返时延中位数
+    uint32_t p99_us;
+    uint32_t max_us;
+    uint32_t jitter_us;   // 相邻往返时延差的平滑值（RFC 3550 算法）
+    uint32_t last_us;     // 最近一次往返时延，0 表示尚无应答
+    uint16_t interval_ms; // 当前探测间隔，已计入房间预算
+    uint16_t paused;      // 1 表示 peer 空闲，探测已暂停
+    uint64_t sent;        // 累计发出的探测数
+    uint64_t lost;        // 累计超时未应答的探测数
+};
+#pragma pack(pop)
+static_assert(sizeof(latency_stat) == 72, "latency_stat layout changed");
+
+// 同步给探测器的 peer：公钥、虚拟 IP 与 wireguard 收发字节合计
+struct latency_target
+{
+    uint8_t public_key[LATENCY_KEY_LENGTH];
+    sockaddr_storage vip;
+    uint64_t bytes;
+};
+
+/**
+ * 房间内的隧道时延探测器，每个房间一个
+ * 套接字绑定在本房间虚拟 IP 的固定端口上，向各 peer 虚拟 IP 的同一端口发送小探测报文，
+ * 对方探测器原样回送。收到对方的探测时同样回送，双方各自测量。
+ * 探测间隔按路径平稳程度自适应，房间总速率不超过 LATENCY_ROOM_BUDGET_PPS；
+ * 扣除探测自身流量后没有业务流量的 peer 暂停探测，恢复流量后从最短间隔重新开始。
+ * 内部锁保护全部状态，收发由调用方的单个线程驱动，统计查询可在任意线程调用
+ */
+class latency_prober
+{
+    struct pending
+    {
+        uint32_t seq;
+        std::chrono::steady_clock::time_point sent;
+    };
+
+    struct peer_state
+    {
+        uint8_t public_key[LATENCY_KEY_LENGTH];
+        sockaddr_storage vip;
+        bool seen;
+        uint32_t seq;
+        std::array<pending, LATENCY_OUTSTANDING> outstanding;
+        uint64_t sent;
+        uint64_t lost;
+        latency_histogram current;
+        latency_histogram previous;
+        uint32_t last_us;
+        double srtt_us;
+        double jitter_us;
+        uint32_t interval_ms;
+        uint32_t stable;
+        std::chrono::steady_clock::time_point due;
+        // 空闲判断：上次同步时的收发字节与期间探测报文数
+        uint64_t bytes;
+        uint64_t probe_packets;
+        std::chrono::steady_clock::time_point active_at;
+        bool paused;
+    };
+
+    std::mutex lock;
+    punch_socket sock = PUNCH_INVALID_SOCKET;
+    std::vector<peer_state> peers;
+    std::chrono::steady_clock::time_point window_at = std::chrono::steady_clock::now();
+
+    peer_state *find(const uint8_t *key)
+    {
+        for (auto &p : peers)
+        {
+            if (memcmp(p.public_key, key, LATENCY_KEY_LENGTH) == 0)
+                return &p;
+        }
+        return nullptr;
+    }
+
+    peer_state *find_host(const sockaddr_storage &from)
+    {
+        for (auto &p : peers)
+        {
+            if (punch_same_host(p.vip, from))
+                return &p;
+        }
+        return nullptr;
+    }
+
+    static void encode(uint8_t *out, uint8_t type, uint32_t seq)
+    {
+        out[0] = static_cast<uint8_t>(LATENCY_MAGIC >> 24);
+        out[1] = static_cast<uint8_t>(LATENCY_MAGIC >> 16);
+        out[2] = static_cast<uint8_t>(LATENCY_MAGIC >> 8);
+        out[3] = static_cast<uint8_t>(LATENCY_MAGIC);
+        out[4] = LATENCY_VERSION;
+        out[5] = type;
+        out[6] = 0;
+        out[7] = 0;
+        out[8] = static_cast<uint8_t>(seq >> 24);
+        out[9] = static_cast<uint8_t>(seq >> 16);
+        out[10] = static_cast<uint8_t>(seq >> 8);
+        out[11] = static_cast<uint8_t>(seq);
+    }
+
+    void send_to(const sockaddr_storage &to, uint8_t type, uint32_t seq)
+    {
+        uint8_t buf[LATENCY_MESSAGE_SIZE];
+        encode(buf, type, seq);
+        sendto(sock, reinterpret_cast<const char *>(buf), static_cast<int>(sizeof(buf)), 0,
+               reinterpret_cast<const sockaddr *>(&to), punch_addr_len(to));
+    }
+
+    // 丢包或时延突增：回到最短间隔加密采样
+    static void tighten(peer_state &p)
+    {
+        p.interval_ms = LATENCY_MIN_INTERVAL_MS;
+        p.stable = 0;
+    }
+
+    void on_reply(peer_state &p, uint32_t seq, std::chrono::steady_clock::time_point now)
+    {
+        auto &slot = p.outstanding[seq % LATENCY_OUTSTANDING];
+        // 已计为丢包或被覆盖的迟到应答不再计入
+        if (slot.seq != seq || seq == 0)
+            return;
+        slot.seq = 0;
+        const auto us = std::chrono::duration_cast<std::chrono::microseconds>(now - slot.sent).count();
+        const auto rtt = static_cast<uint32_t>(us < 0 ? 0 : (us > latency_histogram::MAX_VALUE ? latency_histogram::MAX_VALUE : us));
+        p.current.record(rtt);
+        if (p.last_us != 0)
+        {
+            const double d = std::fabs(static_cast<double>(rtt) - p.last_us);
+            p.jitter_us += (d - p.jitter_us) / 16;
+        }
+        const bool spike = p.srtt_us > 0 && rtt > 2 * p.srtt_us + 10000;
+        p.srtt_us = p.srtt_us == 0 ? rtt : p.srtt_us + (rtt - p.srtt_us) / 8;
+        p.last_us = rtt;
+        if (spike)
+        {
+            tighten(p);
+        }
+        else if (++p.stable >= LATENCY_STABLE_REPLIES)
+        {
+            p.stable = 0;
+            p.interval_ms = p.interval_ms * 2 > LATENCY_MAX_INTERVAL_MS ? LATENCY_MAX_INTERVAL_MS : p.interval_ms * 2;
+        }
+    }
+
+    // 房间预算下每个 peer 的最短间隔(ms)
+    uint32_t budget_floor_ms() const
+    {
+        uint32_t active = 0;
+        for (const auto &p : peers)
+            active += !p.paused;
+        return active * 1000 / LATENCY_ROOM_BUDGET_PPS;
+    }
+
+public:
+    latency_prober() = default;
+    latency_prober(const latency_prober &) = delete;
+    latency_prober &operator=(const latency_prober &) = delete;
+
+    ~latency_prober()
+    {
+        close();
+    }
+
+    // 绑定到本房间虚拟 IP 的探测端口，虚拟 IP 尚未生效时失败，调用方稍后重试
+    bool open(const sockaddr_storage &local)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (sock != PUNCH_INVALID_SOCKET)
+            return true;
+        const punch_socket s = socket(local.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+        if (s == PUNCH_INVALID_SOCKET)
+            return false;
+        if (bind(s, reinterpret_cast<const sockaddr *>(&local), punch_addr_len(local)) != 0)
+        {
+            punch_close(s);
+            return false;
+        }
+#ifdef _WIN32
+        // 不可达 peer 的 ICMP 端口不可达不应中断其余 peer 的接收
+        BOOL reset = FALSE;
+        DWORD bytes = 0;
+        WSAIoctl(s, SIO_UDP_CONNRESET, &reset, sizeof(reset), nullptr, 0, &bytes, nullptr, nullptr);
+#endif
+        sock = s;
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (sock != PUNCH_INVALID_SOCKET)
+            punch_close(sock);
+        sock = PUNCH_INVALID_SOCKET;
+        peers.clear();
+    }
+
+    bool opened()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return sock != PUNCH_INVALID_SOCKET;
+    }
+
+    punch_socket handle()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return sock;
+    }
+
+    /**
+     * 按当前配置同步 peer 列表，并根据收发字节判断空闲
+     * 新 peer 从最短间隔立即开始探测，不在列表中的 peer 丢弃统计
+     */
+    void sync(const std::vector<latency_target> &targets, std::chrono::steady_clock::time_point now)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        const bool rotate = now - window_at >= LATENCY_WINDOW;
+        if (rotate)
+            window_at = now;
+        for (auto &p : peers)
+            p.seen = false;
+        for (const auto &t : targets)
+        {
+            auto *p = find(t.public_key);
+            if (p == nullptr)
+            {
+                peers.push_back({});
+                p = &peers.back();
+                memcpy(p->public_key, t.public_key, LATENCY_KEY_LENGTH);
+                p->interval_ms = LATENCY_MIN_INTERVAL_MS;
+                p->due = now;
+                p->bytes = t.bytes;
+                p->active_at = now;
+            }
+            p->seen = true;
+            if (!punch_same_host(p->vip, t.vip))
+            {
+                p->vip = t.vip;
+                tighten(*p);
+            }
+            // 扣除探测自身的流量后仍有收发即为业务流量
+            const uint64_t delta = t.bytes >= p->bytes ? t.bytes - p->bytes : 0;
+            if (delta > p->probe_packets * LATENCY_WIRE_BYTES + LATENCY_ACTIVE_BYTES)
+            {
+                p->active_at = now;
+                if (p->paused)
+                {
+                    // 下一次 send_due 立即发出
+                    p->paused = false;
+                    p->due = {};
+                    tighten(*p);
+                }
+            }
+            else if (!p->paused && now - p->active_at >= LATENCY_IDLE_AFTER)
+            {
+                p->paused = true;
+            }
+            p->bytes = t.bytes;
+            p->probe_packets = 0;
+            if (rotate)
+            {
+                p->previous = p->current;
+                p->current.reset();
+            }
+        }
+        for (size_t i = peers.size(); i-- > 0;)
+        {
+            if (!peers[i].seen)
+                peers.erase(peers.begin() + static_cast<ptrdiff_t>(i));
+        }
+    }
+
+    /**
+     * 发送到期的探测并把超时的探测计为丢包
+     * @return 下一次需要调用的时间，没有需要探测的 peer 时为 time_point::max
+     */
+    std::chrono::steady_clock::time_point send_due(std::chrono::steady_clock::time_point now)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto wake = std::chrono::steady_clock::time_point::max();
+        if (sock == PUNCH_INVALID_SOCKET)
+            return wake;
+        const uint32_t floor_ms = budget_floor_ms();
+        for (auto &p : peers)
+        {
+            for (auto &slot : p.outstanding)
+            {
+                if (slot.seq != 0 && now - slot.sent >= std::chrono::milliseconds(LATENCY_TIMEOUT_MS))
+                {
+                    slot.seq = 0;
+                    p.lost++;
+                    tighten(p);
+                }
+            }
+            if (p.paused || p.vip.ss_family == 0)
+                continue;
+            if (p.due <= now)
+            {
+                if (++p.seq == 0)
+                    p.seq = 1;
+                auto &slot = p.outstanding[p.seq % LATENCY_OUTSTANDING];
+                if (slot.seq != 0)
+                {
+                    p.lost++;
+                    tighten(p);
+                }
+                slot = {p.seq, now};
+                send_to(p.vip, LATENCY_REQUEST, p.seq);
+                p.sent++;
+                p.probe_packets++;
+                const uint32_t interval = p.interval_ms > floor_ms ? p.interval_ms : floor_ms;
+                p.due = now + std::chrono::milliseconds(interval);
+            }
+            if (p.due < wake)
+                wake = p.due;
+        }
+        return wake;
+    }
+
+    // 读取一个报文：对方的探测原样回送，本端探测的应答计入统计
+    void receive(std::chrono::steady_clock::time_point now)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (sock == PUNCH_INVALID_SOCKET)
+            return;
+        uint8_t buf[64];
+        sockaddr_storage from{};
+        socklen_t from_len = sizeof(from);
+        const auto n = recvfrom(sock, reinterpret_cast<char *>(buf), sizeof(buf), 0, reinterpret_cast<sockaddr *>(&from), &from_len);
+        if (n < static_cast<long>(LATENCY_MESSAGE_SIZE) || buf[4] != LATENCY_VERSION ||
+            ((uint32_t(buf[0]) << 24) | (uint32_t(buf[1]) << 16) | (uint32_t(buf[2]) << 8) | buf[3]) != LATENCY_MAGIC)
+            return;
+        const uint32_t seq = (uint32_t(buf[8]) << 24) | (uint32_t(buf[9]) << 16) | (uint32_t(buf[10]) << 8) | buf[11];
+        auto *p = find_host(from);
+        if (buf[5] == LATENCY_REQUEST)
+        {
+            // 只回送本房间成员的探测，应答流量同样计入探测流量
+            if (p == nullptr)
+                return;
+            send_to(from, LATENCY_REPLY, seq);
+            p->probe_packets += 2;
+        }
+        else if (buf[5] == LATENCY_REPLY && p != nullptr)
+        {
+            p->probe_packets++;
+            on_reply(*p, seq, now);
+        }
+    }
+
+    // 输出各 peer 统计，返回 peer 总数
+    size_t stats(latency_stat *out, size_t max)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        const uint32_t floor_ms = budget_floor_ms();
+        for (size_t i = 0; i < peers.size() && i < max; i++)
+        {
+            const auto &p = peers[i];
+            auto &s = out[i];
+            memset(&s, 0, sizeof(s));
+            memcpy(s.public_key, p.public_key, LATENCY_KEY_LENGTH);
+            s.p50_us = latency_histogram::percentile(p.current, p.previous, 0.5);
+            s.p99_us = latency_histogram::percentile(p.current, p.previous, 0.99);
+            s.max_us = p.current.max() > p.previous.max() ? p.current.max() : p.previous.max();
+            s.jitter_us = static_cast<uint32_t>(p.jitter_us);
+            s.last_us = p.last_us;
+            const uint32_t interval = p.interval_ms > floor_ms ? p.interval_ms : floor_ms;
+            s.interval_ms = static_cast<uint16_t>(interval > 0xFFFF ? 0xFFFF : interval);
+            s.paused = p.paused;
+            s.sent = p.sent;
+            s.lost = p.lost;
+        }
+        return peers.size();
+    }
+};
+
+#ifdef LATENCY_PROBE_SELFTEST
+// 本地自测：bash lib/selftest.sh latency_probe
+#include "selftest_compat.h"
+#include "iostream"
+#include "random"
+#include "algorithm"
+
+namespace latency_test
+{
+    inline sockaddr_storage address(const char *text)
+    {
+        punch_candidate c{};
+        parse_candidate(text, c);
+        return c.addr;
+    }
+
+    inline latency_target target(uint8_t id, const char *vip, uint64_t bytes)
+    {
+        latency_target t{};
+        memset(t.public_key, id, LATENCY_KEY_LENGTH);
+        t.vip = address(vip);
+        return t.bytes = bytes, t;
+    }
+
+    // 驱动一个或多个探测器收发，直到 until
+    inline void pump(std::vector<latency_prober *> probers, std::chrono::steady_clock::time_point until)
+    {
+        while (std::chrono::steady_clock::now() < until)
+        {
+            const auto now = std::chrono::steady_clock::now();
+            std::vector<pollfd> fds;
+            for (auto *p : probers)
+            {
+                p->send_due(now);
+                fds.push_back({p->handle(), POLLIN, 0});
+            }
+            if (punch_poll(fds.data(), fds.size(), 5) <= 0)
+                continue;
+            for (size_t i = 0; i < fds.size(); i++)
+            {
+                if (fds[i].revents & POLLIN)
+                    probers[i]->receive(std::chrono::steady_clock::now());
+            }
+        }
+    }
+
+    inline int run()
+    {
+        // 直方图精度：均匀分布与长尾分布的分位数相对误差不超过 1/32
+        latency_histogram h, empty;
+        std::mt19937 rng(7);
+        std::vector<uint32_t> values;
+        for (int i = 0; i < 100000; i++)
+        {
+            const uint32_t v = i % 100 == 0 ? 150000 + rng() % 50000 : 20000 + rng() % 5000;
+            values.push_back(v);
+            h.record(v);
+        }
+        std::sort(values.begin(), values.end());
+        bool precise = true;
+        for (double q : {0.5, 0.9, 0.99, 0.999})
+        {
+            const uint32_t exact = values[static_cast<size_t>(std::ceil(q * values.size())) - 1];
+            const uint32_t got = latency_histogram::percentile(h, empty, q);
+            precise &= got >= exact && got - exact <= exact / 32 + 1;
+        }
+        expect(precise && h.max() == values.back(), "histogram percentiles within 1/32");
+        bool exact_small = true;
+        for (uint32_t v = 0; v < 5000; v++)
+            exact_small &= latency_histogram::upper_of(latency_histogram::index_of(v)) >= v &&
+                           latency_histogram::index_of(latency_histogram::upper_of(latency_histogram::index_of(v))) == latency_histogram::index_of(v);
+        expect(exact_small && latency_histogram::index_of(latency_histogram::MAX_VALUE) == latency_histogram::BUCKETS - 1, "bucket bounds consistent");
+
+        // 两个房间成员互相探测，另一个成员不可达
+        const uint16_t port = 47000 + static_cast<uint16_t>(rng() % 1000);
+        const std::string ip_a = "127.0.0.1:" + std::to_string(port);
+        const std::string ip_b = "127.0.0.2:" + std::to_string(port);
+        latency_prober a, b;
+        if (!a.open(address(ip_a.c_str())) || !b.open(address(ip_b.c_str())))
+        {
+            expect(false, "bind loopback probers");
+            return selftest_result();
+        }
+        auto now = std::chrono::steady_clock::now();
+        a.sync({target(2, ip_b.c_str(), 0), target(3, ("127.0.0.3:" + std::to_string(port)).c_str(), 0)}, now);
+        b.sync({target(1, ip_a.c_str(), 0)}, now);
+        pump({&a, &b}, now + std::chrono::milliseconds(3600));
+        latency_stat stats[4];
+        expect(a.stats(stats, 4) == 2, "two peers tracked");
+        expect(stats[0].sent >= 4 && stats[0].lost == 0 && stats[0].last_us > 0 && stats[0].p99_us >= stats[0].p50_us,
+               "echo p50:" + std::to_string(stats[0].p50_us) + "us p99:" + std::to_string(stats[0].p99_us) + "us sent:" + std::to_string(stats[0].sent));
+        expect(stats[1].lost >= 1 && stats[1].interval_ms == LATENCY_MIN_INTERVAL_MS && stats[1].last_us == 0,
+               "unreachable peer lost:" + std::to_string(stats[1].lost));
+        latency_stat back[1];
+        expect(b.stats(back, 1) == 1 && back[0].sent > 0 && back[0].lost == 0, "both sides measure");
+
+        // 只有探测流量：超过空闲时长后暂停，业务流量恢复后立即继续
+        now = std::chrono::steady_clock::now();
+        a.sync({target(2, ip_b.c_str(), 0)}, now + LATENCY_IDLE_AFTER);
+        a.stats(stats, 4);
+        const uint64_t paused_sent = stats[0].sent;
+        pump({&a, &b}, std::chrono::steady_clock::now() + std::chrono::milliseconds(1200));
+        a.stats(stats, 4);
+        expect(stats[0].paused == 1 && stats[0].sent == paused_sent, "idle peer paused");
+        a.sync({target(2, ip_b.c_str(), 100000)}, now + LATENCY_IDLE_AFTER + std::chrono::seconds(1));
+        pump({&a, &b}, std::chrono::steady_clock::now() + std::chrono::milliseconds(100));
+        a.stats(stats, 4);
+        expect(stats[0].paused == 0 && stats[0].sent > paused_sent, "traffic resumes probing");
+
+        // 房间预算：peer 数超过每秒预算时按比例放大间隔
+        latency_prober crowded;
+        crowded.open(address(("127.0.0.4:" + std::to_string(port)).c_str()));
+        std::vector<latency_target> many;
+        for (uint8_t i = 0; i < 100; i++)
+            many.push_back(target(static_cast<uint8_t>(i + 10), ("127.0.1." + std::to_string(i + 1) + ":" + std::to_string(port)).c_str(), 0));
+        crowded.sync(many, std::chrono::steady_clock::now());
+        const auto start = std::chrono::steady_clock::now();
+        pump({&crowded}, start + std::chrono::milliseconds(2000));
+        std::vector<latency_stat> crowd(100);
+        crowded.stats(crowd.data(), crowd.size());
+        uint64_t total = 0;
+        for (const auto &s : crowd)
+            total += s.sent;
+        // 首轮每个 peer 各一次，之后不超过预算速率
+        expect(total <= 100 + 2 * LATENCY_ROOM_BUDGET_PPS + 1 && crowd[0].interval_ms == 100 * 1000 / LATENCY_ROOM_BUDGET_PPS,
+               "room budget holds, " + std::to_string(total) + " probes in 2s for 100 peers");
+        return selftest_result();
+    }
+}
+
+int main()
+{
+    return latency_test::run();
+}
+#endif
@@ -0,0 +1,337 @@
+#ifdef _WIN32
+#include "src/wireguard.h"
+#include "wireguard_tool.cpp"
+#include "src/windivert.h"
+#else
+#include "selftest_compat.h"
+#endif
+#include "mutex"
+#include "condition_variable"
+#include "thread"
+#include "functional"
+#include "vector"
+#include "string"
+#include "algorithm"
+#include "chrono"
+
+#pragma once
+
+// 每个房间按需激活的 peer 数上限，过滤器中每个 IP 占一条比较，超出的 peer 始终保持激活
+static constexpr size_t LAZY_PEER_LIMIT = 128;
+// 激活期间报文在 windivert 队列中的最长保留时间，超时由驱动丢弃
+static constexpr UINT64 LAZY_HOLD_MS = 500;
+// 按需激活句柄的优先级，高于广播嗅探句柄
+static constexpr int16_t LAZY_GATE_PRIORITY = 100;
+// 接收出错后的退避(ms)，连续出错时加倍，超过上限后关闭句柄并在退避后重开
+static constexpr uint32_t LAZY_RECV_BACKOFF_MS = 10;
+static constexpr uint32_t LAZY_RECV_BACKOFF_MAX_MS = 1000;
+// 休眠 peer 写入适配器的标志：保留公钥与 allowed ip，不写 endpoint，保活为 0
+static constexpr WIREGUARD_PEER_FLAG LAZY_DORMANT_FLAGS = WIREGUARD_PEER_HAS_PUBLIC_KEY | WIREGUARD_PEER_HAS_PERSISTENT_KEEPALIVE;
+
+// peer 激活时的标志与保活间隔，休眠期间保存在索引项中
+struct lazy_saved
+{
+    WIREGUARD_PEER_FLAG flags;
+    uint16_t keepalive;
+};
+
+/**
+ * 把 peer 记录改为休眠：peer 仍留在适配器中，对端发起的握手照常完成，wireguard 随之漫游到对端地址；
+ * 本端不再发保活，也不主动握手。已休眠的记录不重复保存
+ */
+inline void lazy_sleep(WIREGUARD_PEER &peer, lazy_saved &saved, bool awake)
+{
+    if (awake)
+        saved = {peer.Flags, peer.PersistentKeepalive};
+    peer.Flags = LAZY_DORMANT_FLAGS;
+    peer.PersistentKeepalive = 0;
+}
+
+// 恢复激活时的标志与保活间隔，需要随后 set_config 生效
+inline void lazy_wake(WIREGUARD_PEER &peer, const lazy_saved &saved)
+{
+    peer.Flags = saved.flags;
+    peer.PersistentKeepalive = saved.keepalive;
+}
+
+// 闸门过滤器：本房间网卡上发往休眠 peer 虚拟 IP 的出站报文
+inline std::string lazy_gate_filter(DWORD wg_idx, const std::vector<uint32_t> &ips)
+{
+    std::string filter = "outbound and ifIdx == " + std::to_string(wg_idx) + " and (";
+    char buf[INET_ADDRSTRLEN];
+    for (size_t i = 0; i < ips.size(); i++)
+    {
+        inet_ntop(AF_INET, &ips[i], buf, sizeof(buf));
+        filter += (i == 0 ? "ip.DstAddr == " : " or ip.DstAddr == ");
+        filter += buf;
+    }
+    return filter + ")";
+}
+
+#ifdef _WIN32
+/**
+ * 按需激活闸门，每个房间一个
+ * 拦截发往休眠 peer 虚拟 IP 的出站报文：报文留在 windivert 队列中（最长 LAZY_HOLD_MS），
+ * 激活回调恢复 peer 的 endpoint 与保活后原样注入，过滤器随后去掉已激活的 IP。
+ * 休眠 peer 始终留在适配器中，对端先发起时不经过闸门；过滤器只包含休眠 peer 的 IP，已激活 peer 的流量不经过用户态
+ */
+class lazy_gate
+{
+public:
+    // inactive 返回当前未激活 peer 的虚拟 IP（网络字节序），activate 激活目标 IP 对应的 peer
+    lazy_gate(DWORD wg_idx, std::function<std::vector<uint32_t>()> inactive, std::function<void(uint32_t)> activate)
+        : wg_idx(wg_idx), inactive(std::move(inactive)), activate(std::move(activate)) {}
+
+    lazy_gate(const lazy_gate &) = delete;
+    lazy_gate &operator=(const lazy_gate &) = delete;
+
+    ~lazy_gate()
+    {
+        stop();
+    }
+
+    void start()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (worker.joinable())
+            return;
+        stopping = false;
+        changed = true;
+        worker = std::thread([this]
+                             { gate_loop(); });
+    }
+
+    // 未激活集合变化后调用，关闭当前句柄的接收通道，线程处理完队列中的报文后按新集合重开
+    void refresh()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        changed = true;
+        if (handle != INVALID_HANDLE_VALUE)
+            WinDivertShutdown(handle, WINDIVERT_SHUTDOWN_RECV);
+        cv.notify_one();
+    }
+
+    // 停止闸门，调用方不能持有房间锁：线程中的激活回调需要房间锁
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            if (handle != INVALID_HANDLE_VALUE)
+                WinDivertShutdown(handle, WINDIVERT_SHUTDOWN_RECV);
+        }
+        cv.notify_one();
+        if (worker.joinable())
+            worker.join();
+    }
+
+private:
+    DWORD wg_idx;
+    std::function<std::vector<uint32_t>()> inactive;
+    std::function<void(uint32_t)> activate;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::thread worker;
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    bool stopping = false;
+    bool changed = false;
+
+    void gate_loop()
+    {
+        std::vector<char> packet(WINDIVERT_MTU_MAX);
+        std::unique_lock<std::mutex> guard(lock);
+        while (!stopping)
+        {
+            cv.wait(guard, [this]
+                    { return stopping || changed; });
+            if (stopping)
+                break;
+            changed = false;
+            guard.unlock();
+            const auto ips = inactive();
+            if (ips.empty())
+            {
+                guard.lock();
+                continue;
+            }
+            const std::string filter = lazy_gate_filter(wg_idx, ips);
+            HANDLE h = WinDivertOpen(filter.c_str(), WINDIVERT_LAYER_NETWORK, LAZY_GATE_PRIORITY, 0);
+            if (h == INVALID_HANDLE_VALUE)
+            {
+                log(WIREGUARD_LOG_ERR, "lazy gate open failed", GetLastError());
+                guard.lock();
+                continue;
+            }
+            WinDivertSetParam(h, WINDIVERT_PARAM_QUEUE_TIME, LAZY_HOLD_MS);
+            guard.lock();
+            if (stopping || changed)
+            {
+                // 打开期间集合已变化，直接按新集合重开
+                guard.unlock();
+                WinDivertClose(h);
+                guard.lock();
+                continue;
+            }
+            handle = h;
+            guard.unlock();
+
+            WINDIVERT_ADDRESS addr;
+            UINT len = 0;
+            uint32_t backoff = 0;
+            while (true)
+            {
+                if (!WinDivertRecv(h, packet.data(), static_cast<UINT>(packet.size()), &len, &addr))
+                {
+                    const DWORD err = GetLastError();
+                    // 关闭接收通道后队列取空返回 ERROR_NO_DATA，句柄失效时不再重试
+                    if (err == ERROR_NO_DATA || err == ERROR_INVALID_HANDLE || err == ERROR_OPERATION_ABORTED)
+                        break;
+                    backoff = backoff == 0 ? LAZY_RECV_BACKOFF_MS : backoff * 2;
+                    if (backoff > LAZY_RECV_BACKOFF_MAX_MS)
+                        break;
+                    log(WIREGUARD_LOG_ERR, "lazy gate recv failed", err);
+                    Sleep(backoff);
+                    continue;
+                }
+                backoff = 0;
+                PWINDIVERT_IPHDR ip_header = nullptr;
+                WinDivertHelperParsePacket(packet.data(), len, &ip_header, nullptr, nullptr, nullptr, nullptr,
+                                           nullptr, nullptr, nullptr, nullptr, nullptr, nullptr);
+                // 激活失败时同样放行，未激活的 peer 流量经中继 peer 转发
+                if (ip_header != nullptr)
+                    activate(ip_header->DstAddr);
+                if (!WinDivertSend(h, packet.data(), len, nullptr, &addr))
+                    log(WIREGUARD_LOG_ERR, "lazy gate inject failed", GetLastError());
+            }
+
+            guard.lock();
+            handle = INVALID_HANDLE_VALUE;
+            guard.unlock();
+            WinDivertClose(h);
+            guard.lock();
+            // 连续出错退出时等待后按当前集合重开
+            if (backoff > LAZY_RECV_BACKOFF_MAX_MS)
+            {
+                cv.wait_for(guard, std::chrono::milliseconds(LAZY_RECV_BACKOFF_MAX_MS), [this]
+                            { return stopping; });
+                changed = true;
+            }
+        }
+    }
+};
+#endif
+
+#ifdef LAZY_GATE_SELFTEST
+// 本地自测：bash lib/selftest.sh lazy_gate
+#include "selftest_compat.h"
+#include "iostream"
+#include "map"
+
+namespace lazy_gate_test
+{
+    // 模拟适配器：按 wireguard 的配置语义维护已安装的 peer，只关心 endpoint 与保活
+    struct fake_adapter
+    {
+        struct installed
+        {
+            SOCKADDR_INET endpoint{};
+            uint16_t keepalive = 0;
+        };
+        std::map<std::string, installed> peers;
+
+        static std::string key_of(const BYTE *key)
+        {
+            return std::string(reinterpret_cast<const char *>(key), WIREGUARD_KEY_LENGTH);
+        }
+
+        void apply(const WIREGUARD_PEER &peer)
+        {
+            const auto key = key_of(peer.PublicKey);
+            if ((peer.Flags & WIREGUARD_PEER_REMOVE) != 0)
+            {
+                peers.erase(key);
+                return;
+            }
+            if ((peer.Flags & WIREGUARD_PEER_UPDATE_ONLY) != 0 && peers.count(key) == 0)
+                return;
+            auto &p = peers[key];
+            if ((peer.Flags & WIREGUARD_PEER_HAS_ENDPOINT) != 0)
+                p.endpoint = peer.Endpoint;
+            if ((peer.Flags & WIREGUARD_PEER_HAS_PERSISTENT_KEEPALIVE) != 0)
+                p.keepalive = peer.PersistentKeepalive;
+        }
+
+        // 对端发起握手：公钥未安装时握手被丢弃，安装时完成并漫游到来源地址
+        bool initiation(const BYTE *key, const SOCKADDR_INET &from)
+        {
+            const auto it = peers.find(key_of(key));
+            if (it == peers.end())
+                return false;
+            it->second.endpoint = from;
+            return true;
+        }
+    };
+
+    inline int run()
+    {
+        WIREGUARD_PEER peer{};
+        memset(peer.PublicKey, 7, WIREGUARD_KEY_LENGTH);
+        peer.Flags = WIREGUARD_PEER_HAS_PUBLIC_KEY | WIREGUARD_PEER_HAS_PERSISTENT_KEEPALIVE | WIREGUARD_PEER_HAS_ENDPOINT;
+        peer.PersistentKeepalive = 25;
+        SOCKADDR_INET signalled{}, roamed{}, nat{};
+        parse_ip("198.51.100.7", 51820, signalled);
+        parse_ip("203.0.113.9", 40001, roamed);
+        parse_ip("203.0.113.9", 40777, nat);
+        peer.Endpoint = signalled;
+        fake_adapter adapter;
+        const auto key = fake_adapter::key_of(peer.PublicKey);
+
+        // 新成员按需登记：写入适配器但不带 endpoint 与保活
+        lazy_saved saved{};
+        lazy_sleep(peer, saved, true);
+        adapter.apply(peer);
+        expect(adapter.peers.count(key) == 1 && adapter.peers[key].endpoint.si_family == 0 && adapter.peers[key].keepalive == 0,
+               "dormant peer installed without endpoint and keepalive");
+        expect(saved.keepalive == 25 && (saved.flags & WIREGUARD_PEER_HAS_ENDPOINT) != 0, "awake settings saved");
+        lazy_sleep(peer, saved, false);
+        expect(saved.keepalive == 25 && (saved.flags & WIREGUARD_PEER_HAS_ENDPOINT) != 0, "sleeping twice keeps saved settings");
+
+        // 对端先发起：休眠 peer 完成握手并漫游到对端地址
+        expect(adapter.initiation(peer.PublicKey, roamed) && same_endpoint(adapter.peers[key].endpoint, roamed),
+               "remote initiation to a dormant peer completes and roams");
+
+        // 出站流量经闸门激活：恢复 endpoint 与保活
+        lazy_wake(peer, saved);
+        adapter.apply(peer);
+        expect(adapter.peers[key].keepalive == 25 && same_endpoint(adapter.peers[key].endpoint, signalled), "wake restores endpoint and keepalive");
+
+        // 空闲降级：仍留在适配器中，保留当前 endpoint，只停保活
+        adapter.initiation(peer.PublicKey, roamed);
+        lazy_sleep(peer, saved, true);
+        adapter.apply(peer);
+        expect(adapter.peers.count(key) == 1 && adapter.peers[key].keepalive == 0 && same_endpoint(adapter.peers[key].endpoint, roamed),
+               "demoted peer stays installed with its endpoint");
+        expect(adapter.initiation(peer.PublicKey, nat) && same_endpoint(adapter.peers[key].endpoint, nat),
+               "remote initiation after demotion completes");
+
+        // 对照：以删除标志降级时对端的握手被丢弃
+        WIREGUARD_PEER removed = peer;
+        removed.Flags = WIREGUARD_PEER_REMOVE | WIREGUARD_PEER_HAS_PUBLIC_KEY;
+        adapter.apply(removed);
+        expect(!adapter.initiation(peer.PublicKey, nat), "removed peer would drop the remote initiation");
+
+        // 过滤器只列出休眠 IP
+        uint32_t a = 0, b = 0;
+        inet_pton(AF_INET, "10.8.0.2", &a);
+        inet_pton(AF_INET, "10.8.0.3", &b);
+        expect(lazy_gate_filter(12, {a, b}) == "outbound and ifIdx == 12 and (ip.DstAddr == 10.8.0.2 or ip.DstAddr == 10.8.0.3)",
+               "gate filter lists dormant ips");
+        return selftest_result();
+    }
+}
+
+int main()
+{
+    return lazy_gate_test::run();
+}
+#endif
@@ -0,0 +1,439 @@
+#include "hole_punch.cpp"
+
+#pragma once
+
+// 单次探测的等待时间(ms)，期间按 100ms 起倍增重发
+static constexpr uint32_t NAT_PROBE_WAIT_MS = 800;
+static constexpr uint32_t NAT_PROBE_RETRY_MS = 100;
+// 相邻映射端口差不超过该值视为顺序分配，可预测
+static constexpr int32_t NAT_SEQUENTIAL_DELTA = 16;
+
+// 映射与过滤行为，RFC 4787 分类
+enum nat_behavior : uint8_t
+{
+    NAT_UNKNOWN = 0,
+    NAT_ENDPOINT_INDEPENDENT = 1,
+    NAT_ADDRESS_DEPENDENT = 2,
+    NAT_PORT_DEPENDENT = 3, // 地址与端口相关，映射为该值即对称型 NAT
+};
+
+// 端口分配方式
+enum nat_allocation : uint8_t
+{
+    NAT_ALLOC_UNKNOWN = 0,
+    NAT_ALLOC_PRESERVING = 1, // 映射端口与本地端口相同
+    NAT_ALLOC_SEQUENTIAL = 2, // 新映射端口按固定步长递增
+    NAT_ALLOC_RANDOM = 3,
+};
+
+// 穿透策略
+enum nat_strategy : int
+{
+    NAT_TRY_DIRECT = 0,
+    NAT_PREDICT_PORTS = 1, // 直连需要按对方端口分配步长预测
+    NAT_RELAY_ONLY = 2,    // 直连不可能成功，直接走中继
+};
+
+// 导出给调用方的 NAT 分类结果，调用方按 24 字节解析
+#pragma pack(push, 8)
+struct nat_profile
+{
+    uint64_t fingerprint; // 测得时的本地网络指纹
+    uint64_t measured_ms; // 测得时的 unix 毫秒
+    uint8_t mapping;
+    uint8_t filtering;
+    uint8_t allocation;
+    uint8_t reserved;
+    int32_t port_delta; // 顺序分配时相邻映射端口差
+};
+#pragma pack(pop)
+static_assert(sizeof(nat_profile) == 24, "nat_profile layout changed");
+
+// 反射器地址：主地址，同 IP 不同端口，不同 IP，后两者可缺省（ss_family 为 0）
+struct nat_reflectors
+{
+    sockaddr_storage primary;
+    sockaddr_storage alt_port;
+    sockaddr_storage alt_ip;
+};
+
+/**
+ * NAT 类型探测，反射器为任意运行 punch_engine 的节点
+ * 使用两个本地端口：S1 只与主反射器通信得到映射 M1，随后由 S2 请求其他反射器向 M1 发送应答，
+ * 根据 S1 能否收到判断过滤行为；之后 S1 再访问其他反射器，比较映射地址判断映射行为与端口分配规律。
+ * 同步执行，耗时最长约 6 个 NAT_PROBE_WAIT_MS，调用方应在工作线程中调用
+ */
+class nat_classifier
+{
+    punch_socket s1 = PUNCH_INVALID_SOCKET;
+    punch_socket s2 = PUNCH_INVALID_SOCKET;
+    std::mt19937_64 rng{std::random_device{}()};
+
+    static void send_to(punch_socket s, const sockaddr_storage &to, const punch_message &msg)
+    {
+        uint8_t buf[PUNCH_RESPONSE_SIZE];
+        const size_t len = msg.encode(buf);
+        sendto(s, reinterpret_cast<const char *>(buf), static_cast<int>(len), 0,
+               reinterpret_cast<const sockaddr *>(&to), punch_addr_len(to));
+    }
+
+    /**
+     * 从 from 发送请求，在 listen 上等待同一 nonce 的应答，按间隔倍增重发
+     * @return 是否收到应答，mapped 为应答中的映射地址
+     */
+    bool exchange(punch_socket from, punch_socket listen, const sockaddr_storage &to, uint8_t type,
+                  const sockaddr_storage *target, sockaddr_storage *mapped)
+    {
+        punch_message req{type, 0, 0, rng(), {}};
+        if (target != nullptr)
+            req.mapped = *target;
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(NAT_PROBE_WAIT_MS);
+        auto resend = std::chrono::steady_clock::now();
+        uint32_t pace = NAT_PROBE_RETRY_MS;
+        uint8_t buf[512];
+        while (true)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= deadline)
+                return false;
+            if (now >= resend)
+            {
+                send_to(from, to, req);
+                resend = now + std::chrono::milliseconds(pace);
+                pace *= 2;
+            }
+            const auto until = resend < deadline ? resend : deadline;
+            pollfd fd{listen, POLLIN, 0};
+            const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(until - now).count() + 1;
+            if (punch_poll(&fd, 1, static_cast<int>(wait)) <= 0)
+                continue;
+            sockaddr_storage src{};
+            socklen_t len = sizeof(src);
+            const auto n = recvfrom(listen, reinterpret_cast<char *>(buf), sizeof(buf), 0, reinterpret_cast<sockaddr *>(&src), &len);
+            punch_message reply{};
+            if (n <= 0 || !reply.decode(buf, static_cast<size_t>(n)) || reply.type != PUNCH_RESPONSE || reply.nonce != req.nonce)
+                continue;
+            if (mapped != nullptr)
+                *mapped = reply.mapped;
+            return true;
+        }
+    }
+
+    static uint16_t local_port(punch_socket s)
+    {
+        sockaddr_storage addr{};
+        socklen_t len = sizeof(addr);
+        getsockname(s, reinterpret_cast<sockaddr *>(&addr), &len);
+        return punch_port(addr);
+    }
+
+public:
+    ~nat_classifier()
+    {
+        if (s1 != PUNCH_INVALID_SOCKET)
+            punch_close(s1);
+        if (s2 != PUNCH_INVALID_SOCKET)
+            punch_close(s2);
+    }
+
+    // 探测 NAT 行为，主反射器不可达时返回全部 NAT_UNKNOWN
+    nat_profile classify(const nat_reflectors &r)
+    {
+        nat_profile profile{};
+        const int family = r.primary.ss_family;
+        s1 = punch_open(family, 0);
+        s2 = punch_open(family, 0);
+        if (s1 == PUNCH_INVALID_SOCKET || s2 == PUNCH_INVALID_SOCKET)
+            return profile;
+        const bool has_port = r.alt_port.ss_family == family;
+        const bool has_ip = r.alt_ip.ss_family == family;
+
+        sockaddr_storage m1{};
+        if (!exchange(s1, s1, r.primary, PUNCH_REQUEST, nullptr, &m1))
+            return profile;
+
+        // 过滤：S1 只访问过主反射器，其他反射器发往 M1 的报文能否到达
+        // 结论只取测量能区分的最严格一档：没有不同 IP 的反射器时，同 IP 不同端口能到达只说明与端口无关，
+        // 无法区分地址相关与无关，按地址相关上报；未到达（含丢包）按端口相关上报
+        if (has_ip && exchange(s2, s1, r.alt_ip, PUNCH_REFLECT, &m1, nullptr))
+            profile.filtering = NAT_ENDPOINT_INDEPENDENT;
+        else if (has_port && exchange(s2, s1, r.alt_port, PUNCH_REFLECT, &m1, nullptr))
+            profile.filtering = NAT_ADDRESS_DEPENDENT;
+        else if (has_port || has_ip)
+            profile.filtering = NAT_PORT_DEPENDENT;
+
+        // 映射：S1 访问不同端口与不同 IP 的反射器，比较映射地址
+        sockaddr_storage m2{};
+        sockaddr_storage m3{};
+        const bool got_port = has_port && exchange(s1, s1, r.alt_port, PUNCH_REQUEST, nullptr, &m2);
+        const bool got_ip = has_ip && exchange(s1, s1, r.alt_ip, PUNCH_REQUEST, nullptr, &m3);
+        if (got_port && !punch_same_addr(m1, m2))
+            profile.mapping = NAT_PORT_DEPENDENT;
+        else if (got_ip && !punch_same_addr(m1, m3))
+            profile.mapping = NAT_ADDRESS_DEPENDENT;
+        else if (got_port || got_ip)
+            profile.mapping = NAT_ENDPOINT_INDEPENDENT;
+
+        // 端口分配：先看是否保持本地端口，否则看同一套接字新映射的端口步长
+        sockaddr_storage m4{};
+        const bool got_s2 = exchange(s2, s2, r.primary, PUNCH_REQUEST, nullptr, &m4);
+        if (punch_port(m1) == local_port(s1) && (!got_s2 || punch_port(m4) == local_port(s2)))
+        {
+            profile.allocation = NAT_ALLOC_PRESERVING;
+        }
+        else if (profile.mapping == NAT_PORT_DEPENDENT || profile.mapping == NAT_ADDRESS_DEPENDENT)
+        {
+            std::vector<int32_t> ports = {punch_port(m1)};
+            if (got_port && !punch_same_addr(m1, m2))
+                ports.push_back(punch_port(m2));
+            if (got_ip && !punch_same_addr(m1, m3))
+                ports.push_back(punch_port(m3));
+            const int32_t delta = ports.size() > 1 ? ports[1] - ports[0] : 0;
+            bool steady = delta != 0 && delta >= -NAT_SEQUENTIAL_DELTA && delta <= NAT_SEQUENTIAL_DELTA;
+            for (size_t i = 2; i < ports.size(); i++)
+                steady = steady && ports[i] - ports[i - 1] == delta;
+            profile.allocation = steady ? NAT_ALLOC_SEQUENTIAL : NAT_ALLOC_RANDOM;
+            profile.port_delta = steady ? delta : 0;
+        }
+        else if (got_s2)
+        {
+            profile.allocation = NAT_ALLOC_RANDOM;
+        }
+        return profile;
+    }
+};
+
+/**
+ * 按双方的 NAT 行为选择穿透策略，任一方未知时照常尝试直连
+ * 一方映射与目的无关时，另一方发往其映射的报文总能到达（过滤为端口相关时除外）；
+ * 双方映射都与目的相关或对方过滤为端口相关时，只有可预测的顺序分配才有机会
+ */
+inline nat_strategy traversal_strategy(const nat_profile &local, const nat_profile &remote)
+{
+    if (local.mapping == NAT_UNKNOWN || remote.mapping == NAT_UNKNOWN)
+        return NAT_TRY_DIRECT;
+    const bool local_eim = local.mapping == NAT_ENDPOINT_INDEPENDENT;
+    const bool remote_eim = remote.mapping == NAT_ENDPOINT_INDEPENDENT;
+    if (local_eim && remote_eim)
+        return NAT_TRY_DIRECT;
+    // 只有一方映射与目的相关：另一方过滤宽松即可直连
+    if (local_eim && local.filtering != NAT_PORT_DEPENDENT)
+        return NAT_TRY_DIRECT;
+    if (remote_eim && remote.filtering != NAT_PORT_DEPENDENT)
+        return NAT_TRY_DIRECT;
+    // 需要命中对方的新映射端口：对方按固定步长分配时预测，否则放弃直连
+    if (!remote_eim && remote.allocation != NAT_ALLOC_SEQUENTIAL)
+        return NAT_RELAY_ONLY;
+    if (!local_eim && local.allocation != NAT_ALLOC_SEQUENTIAL)
+        return NAT_RELAY_ONLY;
+    return NAT_PREDICT_PORTS;
+}
+
+#ifdef NAT_PROBE_SELFTEST
+// 本地自测：bash lib/selftest.sh nat_probe
+#include "selftest_compat.h"
+#include "iostream"
+#include "atomic"
+
+/**
+ * 回环上的用户态 NAT：classify 的两个套接字把报文发到 NAT 的网关端口（每个反射器一个），
+ * NAT 用外部套接字转发给对应反射器，外部套接字的地址即映射地址。
+ * 映射与目的无关时每个内部地址一个外部套接字，否则每个（内部地址, 反射器）一个；
+ * 外部套接字收到的报文按过滤行为与已访问的反射器比对，通过的转回内部地址。
+ * 回环上源 IP 都是 127.0.0.1，反射器的“主机”按下标区分：alt_ip 为另一台主机
+ */
+struct sim_nat
+{
+    struct mapping
+    {
+        sockaddr_storage inside;
+        int target; // 映射与目的无关时为 -1
+        punch_socket s;
+        std::vector<int> contacted;
+    };
+
+    nat_behavior map_mode;
+    nat_behavior filter_mode;
+    std::vector<sockaddr_storage> targets;
+    std::vector<int> hosts;
+    std::vector<punch_socket> gateways;
+    std::vector<mapping> maps;
+    std::atomic<bool> stop{false};
+    std::thread worker;
+
+    sim_nat(nat_behavior map_mode, nat_behavior filter_mode, std::vector<sockaddr_storage> targets, std::vector<int> hosts)
+        : map_mode(map_mode), filter_mode(filter_mode), targets(std::move(targets)), hosts(std::move(hosts))
+    {
+        for (size_t i = 0; i < this->targets.size(); i++)
+            gateways.push_back(punch_open(AF_INET, 0));
+        worker = std::thread([this]
+                             { loop(); });
+    }
+
+    ~sim_nat()
+    {
+        stop.store(true);
+        worker.join();
+        for (const auto g : gateways)
+            punch_close(g);
+        for (const auto &m : maps)
+            punch_close(m.s);
+    }
+
+    // classify 使用的反射器地址：第 i 个反射器经第 i 个网关
+    sockaddr_storage gateway(size_t i) const
+    {
+        sockaddr_storage addr{};
+        socklen_t len = sizeof(addr);
+        getsockname(gateways[i], reinterpret_cast<sockaddr *>(&addr), &len);
+        reinterpret_cast<sockaddr_in &>(addr).sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return addr;
+    }
+
+    int source_of(const sockaddr_storage &from) const
+    {
+        for (size_t i = 0; i < targets.size(); i++)
+        {
+            if (punch_port(targets[i]) == punch_port(from))
+                return static_cast<int>(i);
+        }
+        return -1;
+    }
+
+    bool allowed(const mapping &m, int source) const
+    {
+        if (source < 0)
+            return false;
+        if (filter_mode == NAT_ENDPOINT_INDEPENDENT)
+            return true;
+        return std::any_of(m.contacted.begin(), m.contacted.end(), [&](int t)
+                           { return filter_mode == NAT_ADDRESS_DEPENDENT ? hosts[t] == hosts[source] : t == source; });
+    }
+
+    void loop()
+    {
+        uint8_t buf[512];
+        while (!stop.load())
+        {
+            std::vector<pollfd> fds;
+            for (const auto g : gateways)
+                fds.push_back({g, POLLIN, 0});
+            for (const auto &m : maps)
+                fds.push_back({m.s, POLLIN, 0});
+            if (punch_poll(fds.data(), fds.size(), 20) <= 0)
+                continue;
+            for (size_t i = 0; i < fds.size(); i++)
+            {
+                if ((fds[i].revents & POLLIN) == 0)
+                    continue;
+                sockaddr_storage from{};
+                socklen_t len = sizeof(from);
+                const auto n = recvfrom(fds[i].fd, reinterpret_cast<char *>(buf), sizeof(buf), 0, reinterpret_cast<sockaddr *>(&from), &len);
+                if (n <= 0)
+                    continue;
+                if (i < gateways.size())
+                {
+                    // 内部发往反射器 i：按映射行为找到或新建外部套接字
+                    const int target = map_mode == NAT_ENDPOINT_INDEPENDENT ? -1 : static_cast<int>(i);
+                    auto it = std::find_if(maps.begin(), maps.end(), [&](const mapping &m)
+                                           { return punch_same_addr(m.inside, from) && m.target == target; });
+                    if (it == maps.end())
+                    {
+                        maps.push_back({from, target, punch_open(AF_INET, 0), {}});
+                        it = maps.end() - 1;
+                    }
+                    if (std::find(it->contacted.begin(), it->contacted.end(), static_cast<int>(i)) == it->contacted.end())
+                        it->contacted.push_back(static_cast<int>(i));
+                    sendto(it->s, reinterpret_cast<const char *>(buf), static_cast<int>(n), 0,
+                           reinterpret_cast<const sockaddr *>(&targets[i]), punch_addr_len(targets[i]));
+                    continue;
+                }
+                const auto &m = maps[i - gateways.size()];
+                if (!allowed(m, source_of(from)))
+                    continue;
+                sendto(gateways[0], reinterpret_cast<const char *>(buf), static_cast<int>(n), 0,
+                       reinterpret_cast<const sockaddr *>(&m.inside), punch_addr_len(m.inside));
+            }
+        }
+    }
+};
+
+int main()
+{
+    // 回环上的三个反射器，127.0.0.2 作为不同 IP；本机无 NAT，应得到最宽松的分类
+    punch_engine primary, alt_port, alt_ip;
+    primary.start(0, nullptr);
+    alt_port.start(0, nullptr);
+    alt_ip.start(0, nullptr);
+    nat_reflectors r{};
+    punch_candidate c{};
+    parse_candidate("127.0.0.1:" + std::to_string(primary.port()), c);
+    r.primary = c.addr;
+    parse_candidate("127.0.0.1:" + std::to_string(alt_port.port()), c);
+    r.alt_port = c.addr;
+    parse_candidate("127.0.0.2:" + std::to_string(alt_ip.port()), c);
+    r.alt_ip = c.addr;
+    const auto start = std::chrono::steady_clock::now();
+    const auto open = nat_classifier().classify(r);
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    expect(open.mapping == NAT_ENDPOINT_INDEPENDENT && open.filtering == NAT_ENDPOINT_INDEPENDENT &&
+               open.allocation == NAT_ALLOC_PRESERVING,
+           "no nat classified open in " + std::to_string(ms) + "ms");
+
+    // 经模拟 NAT 分类，reflectors 缺省 alt_ip 时只经过前两个反射器
+    const auto behind = [&r](nat_behavior map_mode, nat_behavior filter_mode, bool with_alt_ip)
+    {
+        sim_nat nat(map_mode, filter_mode, {r.primary, r.alt_port, r.alt_ip}, {0, 0, 1});
+        nat_reflectors via{};
+        via.primary = nat.gateway(0);
+        via.alt_port = nat.gateway(1);
+        if (with_alt_ip)
+            via.alt_ip = nat.gateway(2);
+        return nat_classifier().classify(via);
+    };
+    const auto full = behind(NAT_ENDPOINT_INDEPENDENT, NAT_ENDPOINT_INDEPENDENT, true);
+    expect(full.mapping == NAT_ENDPOINT_INDEPENDENT && full.filtering == NAT_ENDPOINT_INDEPENDENT, "simulated full cone");
+    const auto restricted = behind(NAT_ENDPOINT_INDEPENDENT, NAT_ADDRESS_DEPENDENT, true);
+    expect(restricted.mapping == NAT_ENDPOINT_INDEPENDENT && restricted.filtering == NAT_ADDRESS_DEPENDENT,
+           "simulated address restricted cone");
+    const auto measured_prc = behind(NAT_ENDPOINT_INDEPENDENT, NAT_PORT_DEPENDENT, true);
+    expect(measured_prc.mapping == NAT_ENDPOINT_INDEPENDENT && measured_prc.filtering == NAT_PORT_DEPENDENT &&
+               measured_prc.allocation == NAT_ALLOC_RANDOM,
+           "simulated port restricted cone");
+    const auto measured_sym = behind(NAT_PORT_DEPENDENT, NAT_PORT_DEPENDENT, true);
+    expect(measured_sym.mapping == NAT_PORT_DEPENDENT && measured_sym.filtering == NAT_PORT_DEPENDENT &&
+               measured_sym.allocation == NAT_ALLOC_RANDOM,
+           "simulated symmetric");
+    // 只有同 IP 不同端口的反射器：无法区分地址相关与无关，不得报告为与地址无关
+    const auto no_alt_ip = behind(NAT_ENDPOINT_INDEPENDENT, NAT_ENDPOINT_INDEPENDENT, false);
+    expect(no_alt_ip.mapping == NAT_ENDPOINT_INDEPENDENT && no_alt_ip.filtering == NAT_ADDRESS_DEPENDENT,
+           "alt port only reports address dependent filtering");
+    const auto no_alt_ip_strict = behind(NAT_ENDPOINT_INDEPENDENT, NAT_PORT_DEPENDENT, false);
+    expect(no_alt_ip_strict.filtering == NAT_PORT_DEPENDENT, "alt port only still detects port dependent filtering");
+    expect(traversal_strategy(measured_prc, measured_sym) == NAT_RELAY_ONLY, "measured port restricted to symmetric relay");
+
+    parse_candidate("192.0.2.1:9", c);
+    r.primary = c.addr;
+    expect(nat_classifier().classify(r).mapping == NAT_UNKNOWN, "unreachable reflector gives unknown");
+
+    const auto profile = [](uint8_t mapping, uint8_t filtering, uint8_t allocation)
+    {
+        nat_profile p{};
+        p.mapping = mapping;
+        p.filtering = filtering;
+        p.allocation = allocation;
+        return p;
+    };
+    const auto full_cone = profile(NAT_ENDPOINT_INDEPENDENT, NAT_ENDPOINT_INDEPENDENT, NAT_ALLOC_PRESERVING);
+    const auto port_restricted = profile(NAT_ENDPOINT_INDEPENDENT, NAT_PORT_DEPENDENT, NAT_ALLOC_RANDOM);
+    const auto symmetric_seq = profile(NAT_PORT_DEPENDENT, NAT_PORT_DEPENDENT, NAT_ALLOC_SEQUENTIAL);
+    const auto symmetric_rand = profile(NAT_PORT_DEPENDENT, NAT_PORT_DEPENDENT, NAT_ALLOC_RANDOM);
+    expect(traversal_strategy(port_restricted, port_restricted) == NAT_TRY_DIRECT, "cone to cone direct");
+    expect(traversal_strategy(full_cone, symmetric_rand) == NAT_TRY_DIRECT, "full cone to symmetric direct");
+    expect(traversal_strategy(port_restricted, symmetric_rand) == NAT_RELAY_ONLY, "port restricted to random symmetric relay");
+    expect(traversal_strategy(port_restricted, symmetric_seq) == NAT_PREDICT_PORTS, "port restricted to sequential symmetric predict");
+    expect(traversal_strategy(symmetric_seq, symmetric_rand) == NAT_RELAY_ONLY, "symmetric pair relay");
+    expect(traversal_strategy(nat_profile{}, symmetric_rand) == NAT_TRY_DIRECT, "unknown falls back to direct");
+    return selftest_result();
+}
+#endif
@@ -0,0 +1,498 @@
+#include "hole_punch.cpp"
+#include "cstdint"
+#include "cstring"
+#include "string"
+#include "vector"
+#include "algorithm"
+#include "chrono"
+
+#pragma once
+
+// 每条路径的探测间隔与单次探测超时(ms)
+static constexpr uint32_t PATH_PROBE_MS = 2000;
+static constexpr uint32_t PATH_PROBE_TIMEOUT_MS = 1000;
+// 共享采样线程判定路径的间隔(ms)
+static constexpr uint32_t PATH_TICK_MS = 500;
+// 时延与丢包的指数平滑系数（1/8）
+static constexpr double PATH_EWMA = 0.125;
+// 有效时延 = 平滑时延 + 丢包率 × 该值(ms)，丢包路径即使时延低也不会被选中
+static constexpr double PATH_LOSS_COST_MS = 250;
+// 路径至少收到多少个应答后才参与比较，从未应答的路径视为不可测
+static constexpr uint32_t PATH_MIN_SAMPLES = 3;
+// 迟滞：另一条路径的有效时延低于当前路径的该比例且差值超过 PATH_SWITCH_MARGIN_MS，并持续 PATH_SWITCH_HOLD 才切换
+static constexpr double PATH_SWITCH_RATIO = 0.8;
+static constexpr double PATH_SWITCH_MARGIN_MS = 10;
+static constexpr auto PATH_SWITCH_HOLD = std::chrono::seconds(10);
+// 两次切换的最短间隔，防止来回切换
+static constexpr auto PATH_MIN_DWELL = std::chrono::seconds(30);
+// 当前路径丢包率超过该值视为失效，另一条路径可用时不等待迟滞立即切换
+static constexpr double PATH_FAIL_LOSS = 0.5;
+// 公钥长度，与 WIREGUARD_KEY_LENGTH 一致
+static constexpr size_t PATH_KEY_LENGTH = 32;
+
+enum path_kind : uint8_t
+{
+    PATH_DIRECT = 0,
+    PATH_RELAY = 1,
+};
+
+struct path_metrics
+{
+    double srtt_ms;
+    double loss;
+    uint32_t samples; // 收到的应答数
+    uint32_t probes;  // 发出的探测数
+};
+
+// 需要发起的一次路径探测
+struct path_probe
+{
+    uint8_t public_key[PATH_KEY_LENGTH];
+    path_kind kind;
+    sockaddr_storage endpoint;
+};
+
+// 一次切换决策及其依据
+struct path_switch
+{
+    uint8_t public_key[PATH_KEY_LENGTH];
+    path_kind to;
+    sockaddr_storage endpoint;
+    path_metrics from_metrics;
+    path_metrics to_metrics;
+    const char *reason;
+};
+
+// 导出给调用方的单个 peer 路径状态，调用方按 56 字节步长解析
+#pragma pack(push, 8)
+struct path_stat
+{
+    uint8_t public_key[PATH_KEY_LENGTH];
+    uint32_t direct_rtt_us; // 平滑往返时延，路径不可测时为 0
+    uint32_t relay_rtt_us;
+    uint16_t direct_loss;   // 平滑丢包率（千分比）
+    uint16_t relay_loss;
+    uint8_t active;         // 当前使用的路径，0 直连 1 中继
+    uint8_t measurable;     // bit0 直连可测，bit1 中继可测
+    uint16_t reserved;
+    uint32_t switches;      // 累计切换次数
+    uint32_t reserved2;
+};
+#pragma pack(pop)
+static_assert(sizeof(path_stat) == 56, "path_stat layout changed");
+
+/**
+ * 直连/中继路径选择器，每个房间一个，调用方需持有房间锁
+ * 每个 peer 保存直连与中继两个 endpoint，两条路径都按 PATH_PROBE_MS 持续探测，
+ * 以“平滑时延 + 丢包代价”作为有效时延比较：另一条路径明显更好并持续一段时间才切换，
+ * 当前路径失效时立即切换；两次切换之间至少间隔 PATH_MIN_DWELL。
+ * 只做决策不做收发，探测由调用方发出后通过 sample 回填结果
+ */
+class path_manager
+{
+    struct entry
+    {
+        uint8_t public_key[PATH_KEY_LENGTH];
+        sockaddr_storage endpoints[2];
+        path_metrics metrics[2];
+        path_kind active;
+        bool better;
+        uint32_t switches;
+        std::chrono::steady_clock::time_point better_since;
+        std::chrono::steady_clock::time_point switched_at;
+        std::chrono::steady_clock::time_point probe_due;
+    };
+
+    std::vector<entry> entries;
+
+    entry *find(const uint8_t *key)
+    {
+        for (auto &e : entries)
+        {
+            if (memcmp(e.public_key, key, PATH_KEY_LENGTH) == 0)
+                return &e;
+        }
+        return nullptr;
+    }
+
+    static bool measurable(const path_metrics &m)
+    {
+        return m.samples >= PATH_MIN_SAMPLES;
+    }
+
+    static double effective(const path_metrics &m)
+    {
+        return m.srtt_ms + m.loss * PATH_LOSS_COST_MS;
+    }
+
+public:
+    /**
+     * 设置 peer 的直连与中继 endpoint，两者之一可为空（ss_family 为 0）
+     * active 为当前写入适配器的路径；endpoint 变化的路径重新开始测量
+     */
+    void set(const uint8_t *key, const sockaddr_storage &direct, const sockaddr_storage &relay, path_kind active,
+             std::chrono::steady_clock::time_point now)
+    {
+        auto *e = find(key);
+        if (e == nullptr)
+        {
+            entries.push_back({});
+            e = &entries.back();
+            memcpy(e->public_key, key, PATH_KEY_LENGTH);
+            e->switched_at = now;
+            e->probe_due = now;
+        }
+        const sockaddr_storage *paths[] = {&direct, &relay};
+        for (int k = 0; k < 2; k++)
+        {
+            if (!punch_same_addr(e->endpoints[k], *paths[k]))
+            {
+                e->endpoints[k] = *paths[k];
+                e->metrics[k] = {};
+            }
+        }
+        e->active = active;
+        e->better = false;
+    }
+
+    void remove(const uint8_t *key)
+    {
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (memcmp(entries[i].public_key, key, PATH_KEY_LENGTH) == 0)
+            {
+                entries.erase(entries.begin() + static_cast<ptrdiff_t>(i));
+                return;
+            }
+        }
+    }
+
+    // 只保留 keep(public_key) 为 true 的 peer，用于清理已删除的成员
+    template <typename F>
+    void retain(F keep)
+    {
+        entries.erase(std::remove_if(entries.begin(), entries.end(), [&keep](const entry &e)
+                                     { return !keep(e.public_key); }),
+                      entries.end());
+    }
+
+    // 切换写入适配器失败时回退当前路径，测量状态保留
+    void set_active(const uint8_t *key, path_kind active)
+    {
+        if (auto *e = find(key))
+        {
+            e->active = active;
+            e->better = false;
+        }
+    }
+
+    /**
+     * 以 WireGuard 实际使用的 endpoint 校正当前路径：收到对端从另一地址发来的已认证报文时 WireGuard 会漫游到该地址，
+     * 选择器记录的路径随之失真。与中继 endpoint 相同视为在中继上，其它地址视为直连，
+     * 直连地址变化（对端 NAT 映射变化）时更新并重新测量。漫游不计入切换次数，但与切换一样需要停留 PATH_MIN_DWELL，
+     * 避免立即切回与对端的选择来回拉扯
+     * @return 当前路径或直连地址是否被校正
+     */
+    bool observe(const uint8_t *key, const sockaddr_storage &actual, std::chrono::steady_clock::time_point now)
+    {
+        auto *e = find(key);
+        if (e == nullptr || actual.ss_family == 0)
+            return false;
+        bool changed = false;
+        auto kind = PATH_DIRECT;
+        if (e->endpoints[PATH_RELAY].ss_family != 0 && punch_same_addr(e->endpoints[PATH_RELAY], actual))
+        {
+            kind = PATH_RELAY;
+        }
+        else if (!punch_same_addr(e->endpoints[PATH_DIRECT], actual))
+        {
+            e->endpoints[PATH_DIRECT] = actual;
+            e->metrics[PATH_DIRECT] = {};
+            changed = true;
+        }
+        if (e->active != kind)
+        {
+            e->active = kind;
+            e->better = false;
+            e->switched_at = now;
+            changed = true;
+        }
+        return changed;
+    }
+
+    bool empty() const
+    {
+        return entries.empty();
+    }
+
+    // 收集到期的探测，只有两条路径都存在的 peer 需要探测
+    void due(std::chrono::steady_clock::time_point now, std::vector<path_probe> &out)
+    {
+        for (auto &e : entries)
+        {
+            if (e.probe_due > now || e.endpoints[PATH_DIRECT].ss_family == 0 || e.endpoints[PATH_RELAY].ss_family == 0)
+                continue;
+            e.probe_due = now + std::chrono::milliseconds(PATH_PROBE_MS);
+            for (int k = 0; k < 2; k++)
+            {
+                path_probe p{};
+                memcpy(p.public_key, e.public_key, PATH_KEY_LENGTH);
+                p.kind = static_cast<path_kind>(k);
+                p.endpoint = e.endpoints[k];
+                out.push_back(p);
+                e.metrics[k].probes++;
+            }
+        }
+    }
+
+    /**
+     * 回填一次探测结果
+     * @param sent 本次探测发出的报文数，大于 1 表示有重发，按重发比例计入丢包
+     */
+    void sample(const uint8_t *key, path_kind kind, bool ok, uint32_t rtt_ms, uint32_t sent)
+    {
+        auto *e = find(key);
+        if (e == nullptr)
+            return;
+        auto &m = e->metrics[kind];
+        double lost = 1;
+        if (ok)
+        {
+            lost = sent > 1 ? static_cast<double>(sent - 1) / sent : 0;
+            m.srtt_ms = m.samples == 0 ? rtt_ms : m.srtt_ms + (rtt_ms - m.srtt_ms) * PATH_EWMA;
+            m.samples++;
+        }
+        m.loss += (lost - m.loss) * PATH_EWMA;
+    }
+
+    /**
+     * 按测量结果做切换决策，决策立即生效（active 已更新），调用方随后写入适配器
+     */
+    void evaluate(std::chrono::steady_clock::time_point now, std::vector<path_switch> &out)
+    {
+        for (auto &e : entries)
+        {
+            const auto other = static_cast<path_kind>(1 - e.active);
+            const auto &cur = e.metrics[e.active];
+            const auto &alt = e.metrics[other];
+            if (e.endpoints[other].ss_family == 0 || !measurable(alt) || alt.loss >= PATH_FAIL_LOSS)
+            {
+                e.better = false;
+                continue;
+            }
+            const char *reason = nullptr;
+            // 当前路径从未应答或丢包严重：失效，立即切换
+            if ((!measurable(cur) && cur.probes >= 2 * PATH_MIN_SAMPLES) || (measurable(cur) && cur.loss >= PATH_FAIL_LOSS))
+            {
+                reason = "active path failed";
+            }
+            else if (measurable(cur))
+            {
+                const double a = effective(cur);
+                const double b = effective(alt);
+                const bool better = b < a * PATH_SWITCH_RATIO && a - b > PATH_SWITCH_MARGIN_MS;
+                if (!better)
+                {
+                    e.better = false;
+                    continue;
+                }
+                if (!e.better)
+                {
+                    e.better = true;
+                    e.better_since = now;
+                }
+                if (now - e.better_since >= PATH_SWITCH_HOLD && now - e.switched_at >= PATH_MIN_DWELL)
+                    reason = "other path clearly better";
+            }
+            if (reason == nullptr)
+                continue;
+            path_switch s{};
+            memcpy(s.public_key, e.public_key, PATH_KEY_LENGTH);
+            s.to = other;
+            s.endpoint = e.endpoints[other];
+            s.from_metrics = cur;
+            s.to_metrics = alt;
+            s.reason = reason;
+            out.push_back(s);
+            e.active = other;
+            e.better = false;
+            e.switched_at = now;
+            e.switches++;
+        }
+    }
+
+    // 输出各 peer 路径状态，返回 peer 总数
+    size_t stats(path_stat *out, size_t max) const
+    {
+        for (size_t i = 0; i < entries.size() && i < max; i++)
+        {
+            const auto &e = entries[i];
+            auto &s = out[i];
+            memset(&s, 0, sizeof(s));
+            memcpy(s.public_key, e.public_key, PATH_KEY_LENGTH);
+            const auto &d = e.metrics[PATH_DIRECT];
+            const auto &r = e.metrics[PATH_RELAY];
+            s.direct_rtt_us = measurable(d) ? static_cast<uint32_t>(d.srtt_ms * 1000) : 0;
+            s.relay_rtt_us = measurable(r) ? static_cast<uint32_t>(r.srtt_ms * 1000) : 0;
+            s.direct_loss = static_cast<uint16_t>(d.loss * 1000);
+            s.relay_loss = static_cast<uint16_t>(r.loss * 1000);
+            s.active = e.active;
+            s.measurable = static_cast<uint8_t>((measurable(d) ? 1 : 0) | (measurable(r) ? 2 : 0));
+            s.switches = e.switches;
+        }
+        return entries.size();
+    }
+};
+
+// 切换日志：路径、原因与两条路径的测量值
+inline std::string describe_switch(const path_switch &s)
+{
+    const auto metrics = [](const path_metrics &m)
+    {
+        return std::to_string(static_cast<int>(m.srtt_ms)) + "ms/" + std::to_string(static_cast<int>(m.loss * 100)) + "% loss/" +
+               std::to_string(m.samples) + " of " + std::to_string(m.probes);
+    };
+    return std::string("path switch to ") + (s.to == PATH_DIRECT ? "direct " : "relay ") + format_candidate(s.endpoint) + ", " +
+           s.reason + ", from " + metrics(s.from_metrics) + " to " + metrics(s.to_metrics);
+}
+
+#ifdef PATH_MANAGER_SELFTEST
+// 本地自测：bash lib/selftest.sh path_manager
+#include "selftest_compat.h"
+#include "iostream"
+
+namespace path_test
+{
+    inline sockaddr_storage address(const char *text)
+    {
+        punch_candidate c{};
+        parse_candidate(text, c);
+        return c.addr;
+    }
+
+    /**
+     * 按虚拟时钟推进 seconds 秒，每个探测周期按给定时延与丢包回填结果
+     * lose_every 为 n 时每 n 次探测丢一次，0 不丢
+     */
+    struct simulator
+    {
+        path_manager manager;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        uint8_t key[PATH_KEY_LENGTH] = {1};
+        uint32_t round = 0;
+        std::vector<path_switch> switches;
+
+        simulator()
+        {
+            manager.set(key, address("198.51.100.7:51820"), address("203.0.113.1:3478"), PATH_DIRECT, now);
+        }
+
+        void run(int seconds, uint32_t direct_ms, uint32_t relay_ms, uint32_t direct_lose_every = 0, uint32_t relay_lose_every = 0)
+        {
+            const auto end = now + std::chrono::seconds(seconds);
+            while (now < end)
+            {
+                std::vector<path_probe> probes;
+                manager.due(now, probes);
+                for (const auto &p : probes)
+                {
+                    round++;
+                    const uint32_t rtt = p.kind == PATH_DIRECT ? direct_ms : relay_ms;
+                    const uint32_t every = p.kind == PATH_DIRECT ? direct_lose_every : relay_lose_every;
+                    const bool lost = every != 0 && (every == 1 || round % every == 0);
+                    manager.sample(p.public_key, p.kind, !lost, rtt, 1);
+                }
+                manager.evaluate(now, switches);
+                now += std::chrono::milliseconds(PATH_TICK_MS);
+            }
+        }
+
+        path_kind active()
+        {
+            path_stat s{};
+            manager.stats(&s, 1);
+            return static_cast<path_kind>(s.active);
+        }
+
+        // WireGuard 漫游到 endpoint
+        bool roam(const char *endpoint)
+        {
+            return manager.observe(key, address(endpoint), now);
+        }
+    };
+
+    inline int run()
+    {
+        {
+            simulator sim;
+            sim.run(60, 20, 60);
+            expect(sim.switches.empty() && sim.active() == PATH_DIRECT, "good direct path stays");
+            // 直连恶化到 200ms：持续 PATH_SWITCH_HOLD 后切到中继
+            sim.run(60, 200, 60);
+            expect(sim.switches.size() == 1 && sim.active() == PATH_RELAY, "degraded direct switches to relay");
+            if (!sim.switches.empty())
+                std::cout << "     " << describe_switch(sim.switches[0]) << std::endl;
+            // 直连恢复：超过最短间隔后切回
+            sim.run(90, 20, 60);
+            expect(sim.switches.size() == 2 && sim.active() == PATH_DIRECT, "recovered direct switches back");
+        }
+        {
+            // 两条路径相近并交替波动：迟滞内不切换
+            simulator sim;
+            for (int i = 0; i < 20; i++)
+                sim.run(6, i % 2 ? 50 : 40, i % 2 ? 40 : 50);
+            expect(sim.switches.empty(), "similar paths do not flap");
+        }
+        {
+            // 直连完全中断：不等待迟滞立即切换
+            simulator sim;
+            sim.run(40, 20, 60);
+            sim.run(20, 20, 60, 1);
+            const bool fast = sim.switches.size() == 1 && sim.switches[0].reason == std::string("active path failed");
+            expect(fast && sim.active() == PATH_RELAY, "dead direct path fails over");
+        }
+        {
+            // WireGuard 漫游到中继：校正当前路径，不计入切换，停留期内不切回
+            simulator sim;
+            sim.run(40, 20, 60);
+            expect(sim.roam("203.0.113.1:3478") && sim.active() == PATH_RELAY && sim.switches.empty(),
+                   "roaming to the relay reconciles the active path");
+            expect(!sim.roam("203.0.113.1:3478"), "unchanged endpoint needs no reconcile");
+            sim.run(20, 20, 60);
+            expect(sim.switches.empty(), "no switch back within the dwell after roaming");
+            sim.run(30, 20, 60);
+            expect(sim.switches.size() == 1 && sim.active() == PATH_DIRECT, "better direct path retaken after the dwell");
+        }
+        {
+            // 对端 NAT 映射变化后 WireGuard 漫游到新的直连地址：直连地址更新并重新测量
+            simulator sim;
+            sim.run(40, 20, 60);
+            expect(sim.roam("198.51.100.7:40000") && sim.active() == PATH_DIRECT, "roaming to a new direct address");
+            std::vector<path_probe> probes;
+            sim.manager.due(sim.now + std::chrono::milliseconds(PATH_PROBE_MS), probes);
+            path_stat st{};
+            sim.manager.stats(&st, 1);
+            const bool probed = !probes.empty() && punch_same_addr(probes[0].endpoint, address("198.51.100.7:40000"));
+            expect(probed && (st.measurable & 1) == 0, "new direct address probed and measured afresh");
+        }
+        {
+            // 中继从未应答：不可测的路径不会被选中
+            simulator sim;
+            sim.run(60, 300, 20, 0, 1);
+            expect(sim.switches.empty(), "unmeasurable relay never selected");
+        }
+        {
+            // 低时延但高丢包的中继不优于稳定直连
+            simulator sim;
+            sim.run(120, 60, 30, 0, 3);
+            expect(sim.switches.empty(), "lossy relay loses to clean direct");
+        }
+        return selftest_result();
+    }
+}
+
+int main()
+{
+    return path_test::run();
+}
+#endif
@@ -0,0 +1,570 @@
+#ifdef _WIN32
+#include "src/wireguard.h"
+#include "wireguard_tool.cpp"
+#include "broadcaster.cpp"
+#else
+#include "selftest_compat.h"
+#endif
+#include "peer_stats.cpp"
+#include "atomic"
+#include "array"
+#include "vector"
+#include "thread"
+#include "string"
+#include "algorithm"
+#include "cstdio"
+
+#pragma once
+
+// 事件类型，与 JS 侧约定
+enum wg_event_type
+{
+    WG_EVENT_HANDSHAKE = 1,         // peer 首次握手或断开后重新握手
+    WG_EVENT_HANDSHAKE_LOST = 2,    // 超过 HANDSHAKE_LOST_MS 未握手
+    WG_EVENT_ENDPOINT_ROAMED = 3,   // peer 对端地址变化
+    WG_EVENT_ADAPTER_STATE = 4,     // 适配器启停，value 为 WIREGUARD_ADAPTER_STATE
+    WG_EVENT_TRANSPORTER_ERROR = 5, // 广播转发失败，value 为新增失败包数
+};
+
+// 事件队列容量，必须为 2 的幂
+static constexpr size_t EVENT_QUEUE_SIZE = 1024;
+// 单次派发最多合并的事件数
+static constexpr size_t EVENT_BATCH_SIZE = 256;
+// wireguard 会话超过 180s 未重新握手即失效（REJECT_AFTER_TIME）
+static constexpr uint64_t HANDSHAKE_LOST_MS = 180000;
+// 事件中房间名长度上限（含结尾 0）
+static constexpr size_t EVENT_ROOM_LENGTH = 64;
+
+struct wg_event
+{
+    uint32_t type;
+    uint32_t value;
+    bool has_peer;
+    uint8_t public_key[WIREGUARD_KEY_LENGTH];
+    SOCKADDR_INET endpoint;
+    wchar_t room[EVENT_ROOM_LENGTH];
+};
+
+/**
+ * 有界无锁多生产者多消费者队列（按序号的环形槽位）
+ * 队列满时 push 失败，不阻塞生产者
+ */
+template <typename T, size_t N>
+class event_queue
+{
+    static_assert((N & (N - 1)) == 0, "event queue size must be a power of 2");
+
+    struct cell
+    {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    std::array<cell, N> cells;
+    alignas(64) std::atomic<size_t> enqueue_pos{0};
+    alignas(64) std::atomic<size_t> dequeue_pos{0};
+
+public:
+    event_queue()
+    {
+        for (size_t i = 0; i < N; i++)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(const T &item)
+    {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            cell &c = cells[pos & (N - 1)];
+            const size_t seq = c.seq.load(std::memory_order_acquire);
+            const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    c.data = item;
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool pop(T &item)
+    {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            cell &c = cells[pos & (N - 1)];
+            const size_t seq = c.seq.load(std::memory_order_acquire);
+            const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    item = c.data;
+                    c.seq.store(pos + N, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+};
+
+// 事件回调：类型、房间名、peer 公钥(base64，房间级事件为空)、详情(endpoint、适配器状态或失败包数)
+typedef void (*event_callback)(int type, const wchar_t *room, const char *peer, const char *detail);
+
+/**
+ * 事件派发通道
+ * 生产者只写无锁队列并唤醒派发线程；派发线程批量取出，同一 peer 同类事件只保留最后一个，
+ * 负载高时回调次数不随事件数增长。回调在派发线程执行，不持有任何锁
+ */
+class event_channel
+{
+    event_queue<wg_event, EVENT_QUEUE_SIZE> queue;
+    HANDLE signal = nullptr;
+    std::thread dispatcher;
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> dropped{0};
+    event_callback callback = nullptr;
+
+    // 握手与断开互相覆盖，只保留最终状态
+    static uint32_t category(uint32_t type)
+    {
+        return type == WG_EVENT_HANDSHAKE_LOST ? WG_EVENT_HANDSHAKE : type;
+    }
+
+    static bool same_target(const wg_event &a, const wg_event &b)
+    {
+        return category(a.type) == category(b.type) && a.has_peer == b.has_peer &&
+               (!a.has_peer || memcmp(a.public_key, b.public_key, WIREGUARD_KEY_LENGTH) == 0) &&
+               wcsncmp(a.room, b.room, EVENT_ROOM_LENGTH) == 0;
+    }
+
+    static void format_endpoint(const SOCKADDR_INET &endpoint, char *out, size_t size)
+    {
+        char ip[INET6_ADDRSTRLEN] = {};
+        if (endpoint.si_family == AF_INET)
+        {
+            inet_ntop(AF_INET, &endpoint.Ipv4.sin_addr, ip, sizeof(ip));
+            snprintf(out, size, "%s:%u", ip, ntohs(endpoint.Ipv4.sin_port));
+        }
+        else if (endpoint.si_family == AF_INET6)
+        {
+            inet_ntop(AF_INET6, &endpoint.Ipv6.sin6_addr, ip, sizeof(ip));
+            snprintf(out, size, "[%s]:%u", ip, ntohs(endpoint.Ipv6.sin6_port));
+        }
+    }
+
+    void deliver(const wg_event &e) const
+    {
+        char detail[64] = {};
+        switch (e.type)
+        {
+        case WG_EVENT_ADAPTER_STATE:
+            snprintf(detail, sizeof(detail), "%s", e.value == WIREGUARD_ADAPTER_STATE_UP ? "up" : "down");
+            break;
+        case WG_EVENT_TRANSPORTER_ERROR:
+            snprintf(detail, sizeof(detail), "%u", e.value);
+            break;
+        default:
+            format_endpoint(e.endpoint, detail, sizeof(detail));
+            break;
+        }
+        const std::string peer = e.has_peer ? formmater::base64_encode(e.public_key, WIREGUARD_KEY_LENGTH) : "";
+        callback(static_cast<int>(e.type), e.room, peer.c_str(), detail);
+    }
+
+    void dispatch_loop()
+    {
+        std::vector<wg_event> batch;
+        batch.reserve(EVENT_BATCH_SIZE);
+        while (true)
+        {
+            WaitForSingleObject(signal, INFINITE);
+            if (stopping.load())
+                break;
+            wg_event e;
+            while (true)
+            {
+                batch.clear();
+                while (batch.size() < EVENT_BATCH_SIZE && queue.pop(e))
+                {
+                    auto it = std::find_if(batch.begin(), batch.end(), [&e](const wg_event &b)
+                                           { return same_target(b, e); });
+                    if (it == batch.end())
+                        batch.push_back(e);
+                    else if (e.type == WG_EVENT_TRANSPORTER_ERROR)
+                        it->value += e.value;
+                    else
+                        *it = e;
+                }
+                if (batch.empty())
+                    break;
+                if (const auto lost = dropped.exchange(0); lost > 0)
+                    log(WIREGUARD_LOG_WARN, "event queue full, dropped:" + std::to_string(lost));
+                for (const auto &item : batch)
+                    deliver(item);
+            }
+        }
+    }
+
+public:
+    event_channel() = default;
+    event_channel(const event_channel &) = delete;
+    event_channel &operator=(const event_channel &) = delete;
+
+    ~event_channel()
+    {
+        stop();
+        if (signal != nullptr)
+            CloseHandle(signal);
+    }
+
+    // 启动派发线程，已启动时先停止再替换回调
+    bool start(event_callback cb)
+    {
+        stop();
+        if (signal == nullptr)
+        {
+            signal = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+            if (signal == nullptr)
+            {
+                log(WIREGUARD_LOG_ERR, "create event signal failed", GetLastError());
+                return false;
+            }
+        }
+        callback = cb;
+        stopping = false;
+        dispatcher = std::thread([this]
+                                 { dispatch_loop(); });
+        return true;
+    }
+
+    // 停止派发线程，队列中未派发的事件丢弃
+    void stop()
+    {
+        if (!dispatcher.joinable())
+            return;
+        stopping = true;
+        SetEvent(signal);
+        dispatcher.join();
+        wg_event e;
+        while (queue.pop(e))
+        {
+        }
+    }
+
+    bool running() const
+    {
+        return dispatcher.joinable();
+    }
+
+    void emit(const wg_event &e)
+    {
+        if (!queue.push(e))
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        SetEvent(signal);
+    }
+};
+
+/**
+ * 单个房间的事件比对状态，只由共享采样线程访问，无需加锁
+ * 保存上次配置中每个 peer 的握手与 endpoint，与本次查询比对产生事件
+ */
+class room_watch
+{
+    struct peer_link
+    {
+        uint8_t public_key[WIREGUARD_KEY_LENGTH];
+        SOCKADDR_INET endpoint;
+        bool connected;
+    };
+
+    std::vector<peer_link> links;
+    std::vector<peer_link> next;
+    bool has_state = false;
+    WIREGUARD_ADAPTER_STATE state = WIREGUARD_ADAPTER_STATE_DOWN;
+    uint64_t failed = 0;
+
+    const peer_link *find_link(const BYTE *key, size_t hint) const
+    {
+        if (hint < links.size() && memcmp(links[hint].public_key, key, WIREGUARD_KEY_LENGTH) == 0)
+            return &links[hint];
+        for (const auto &l : links)
+        {
+            if (memcmp(l.public_key, key, WIREGUARD_KEY_LENGTH) == 0)
+                return &l;
+        }
+        return nullptr;
+    }
+
+public:
+    // 以共享采样线程查询到的配置比对一次，产生的事件写入 channel，config 为空时只比对适配器状态与转发错误
+    void diff(const std::wstring &room, WIREGUARD_ADAPTER_HANDLE handle, const WIREGUARD_INTERFACE *config,
+              const transporter *trans, uint64_t now_ms, event_channel &channel)
+    {
+        wg_event e = {};
+        wcsncpy_s(e.room, room.c_str(), _TRUNCATE);
+
+        WIREGUARD_ADAPTER_STATE current_state;
+        if (WireGuardGetAdapterState(handle, &current_state) && (!has_state || current_state != state))
+        {
+            has_state = true;
+            state = current_state;
+            e.type = WG_EVENT_ADAPTER_STATE;
+            e.value = current_state;
+            channel.emit(e);
+        }
+        if (trans != nullptr)
+        {
+            const uint64_t current_failed = trans->failed_count();
+            if (current_failed > failed)
+            {
+                e.type = WG_EVENT_TRANSPORTER_ERROR;
+                e.value = static_cast<uint32_t>(current_failed - failed);
+                channel.emit(e);
+            }
+            failed = current_failed;
+        }
+
+        if (config == nullptr)
+            return;
+        next.clear();
+        e.has_peer = true;
+        const BYTE *cursor = reinterpret_cast<const BYTE *>(config) + interface_size;
+        for (DWORD i = 0; i < config->PeersCount; i++)
+        {
+            const auto *peer = reinterpret_cast<const WIREGUARD_PEER *>(cursor);
+            cursor += peer_size + peer->AllowedIPsCount * allowed_ip_size;
+            const uint64_t handshake = handshake_to_unix_ms(peer->LastHandshake);
+            peer_link link = {};
+            memcpy(link.public_key, peer->PublicKey, WIREGUARD_KEY_LENGTH);
+            link.endpoint = peer->Endpoint;
+            link.connected = handshake != 0 && now_ms < handshake + HANDSHAKE_LOST_MS;
+            next.push_back(link);
+
+            memcpy(e.public_key, peer->PublicKey, WIREGUARD_KEY_LENGTH);
+            e.endpoint = peer->Endpoint;
+            const auto *prev = find_link(peer->PublicKey, i);
+            const bool was_connected = prev != nullptr && prev->connected;
+            if (link.connected != was_connected)
+            {
+                e.type = link.connected ? WG_EVENT_HANDSHAKE : WG_EVENT_HANDSHAKE_LOST;
+                channel.emit(e);
+            }
+            else if (link.connected && !same_endpoint(prev->endpoint, link.endpoint))
+            {
+                e.type = WG_EVENT_ENDPOINT_ROAMED;
+                channel.emit(e);
+            }
+        }
+        links.swap(next);
+    }
+};
+
+#ifdef PEER_EVENTS_SELFTEST
+// 本地自测：bash lib/selftest.sh peer_events
+// 派发通道的合并与丢弃计数，以及配置比对产生的握手、断开、漫游、适配器状态与转发错误事件
+#include "selftest_compat.h"
+#include "mutex"
+#include "chrono"
+
+namespace peer_events_test
+{
+    struct seen_event
+    {
+        int type;
+        std::wstring room;
+        std::string peer;
+        std::string detail;
+    };
+
+    std::mutex seen_lock;
+    std::vector<seen_event> seen;
+    std::string warned;
+    WIREGUARD_ADAPTER_STATE adapter_state = WIREGUARD_ADAPTER_STATE_UP;
+
+    void collect(int type, const wchar_t *room, const char *peer, const char *detail)
+    {
+        std::lock_guard<std::mutex> guard(seen_lock);
+        seen.push_back({type, room, peer, detail});
+    }
+
+    BOOL fake_state(WIREGUARD_ADAPTER_HANDLE, WIREGUARD_ADAPTER_STATE *state)
+    {
+        *state = adapter_state;
+        return TRUE;
+    }
+
+    // 取出派发线程已送达的事件：等到至少 n 个或超时，再稍等片刻收下多出的事件
+    std::vector<seen_event> take(size_t n)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+        while (std::chrono::steady_clock::now() < deadline)
+        {
+            {
+                std::lock_guard<std::mutex> guard(seen_lock);
+                if (seen.size() >= n)
+                    break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        std::lock_guard<std::mutex> guard(seen_lock);
+        std::vector<seen_event> out;
+        out.swap(seen);
+        return out;
+    }
+
+    wg_event peer_event(uint32_t type, uint8_t key)
+    {
+        wg_event e = {};
+        e.type = type;
+        e.has_peer = true;
+        memset(e.public_key, key, WIREGUARD_KEY_LENGTH);
+        wcsncpy_s(e.room, L"r", _TRUNCATE);
+        return e;
+    }
+
+    std::string key_of(uint8_t key)
+    {
+        uint8_t bytes[WIREGUARD_KEY_LENGTH];
+        memset(bytes, key, sizeof(bytes));
+        return formmater::base64_encode(bytes, WIREGUARD_KEY_LENGTH);
+    }
+
+    uint64_t handshake_at(uint64_t unix_ms)
+    {
+        return FILETIME_UNIX_EPOCH + unix_ms * 10000;
+    }
+
+    inline int run()
+    {
+        WireGuardGetAdapterState = &fake_state;
+        log_func = [](WIREGUARD_LOGGER_LEVEL, const char *msg, int)
+        { warned = msg; };
+
+        // 派发线程启动前入队的事件在第一次唤醒时一批取出：同一 peer 的握手与断开只留最后一个，转发错误累加
+        {
+            event_channel channel;
+            channel.emit(peer_event(WG_EVENT_HANDSHAKE, 1));
+            auto error = peer_event(WG_EVENT_TRANSPORTER_ERROR, 0);
+            error.has_peer = false;
+            error.value = 3;
+            channel.emit(error);
+            channel.emit(peer_event(WG_EVENT_HANDSHAKE_LOST, 1));
+            error.value = 4;
+            channel.emit(error);
+            auto roamed = peer_event(WG_EVENT_ENDPOINT_ROAMED, 1);
+            parse_ip("192.0.2.9", 4500, roamed.endpoint);
+            channel.emit(roamed);
+            channel.start(&collect);
+            auto state = error;
+            state.type = WG_EVENT_ADAPTER_STATE;
+            state.value = WIREGUARD_ADAPTER_STATE_UP;
+            channel.emit(state);
+            const auto got = take(4);
+            expect(got.size() == 4 && got[0].type == WG_EVENT_HANDSHAKE_LOST && got[0].peer == key_of(1) &&
+                       got[1].type == WG_EVENT_TRANSPORTER_ERROR && got[1].detail == "7" && got[1].peer.empty() &&
+                       got[2].type == WG_EVENT_ENDPOINT_ROAMED && got[2].detail == "192.0.2.9:4500" &&
+                       got[3].type == WG_EVENT_ADAPTER_STATE && got[3].detail == "up" && got[3].room == L"r",
+                   "batch coalesces per peer and category, sums transporter errors, keeps first-seen order");
+        }
+
+        // 队列满时丢弃并计数，下一批派发时告警
+        {
+            event_channel channel;
+            for (size_t i = 0; i < EVENT_QUEUE_SIZE + 5; i++)
+            {
+                auto e = peer_event(WG_EVENT_HANDSHAKE, 0);
+                memcpy(e.public_key, &i, sizeof(i));
+                channel.emit(e);
+            }
+            channel.start(&collect);
+            channel.emit(peer_event(WG_EVENT_HANDSHAKE, 0xEE));
+            const auto got = take(EVENT_QUEUE_SIZE);
+            expect(got.size() == EVENT_QUEUE_SIZE && warned == "event queue full, dropped:6", "full queue drops and reports the count");
+        }
+
+        // 配置比对
+        event_channel channel;
+        channel.start(&collect);
+        room_watch watch;
+        transporter trans;
+        const uint64_t ms0 = 1700000000000ull;
+        selftest_config conf;
+        auto &first = conf.add_peer(1, 0, 0, 1);
+        first.LastHandshake = handshake_at(ms0 - 1000);
+        parse_ip("192.0.2.1", 51820, first.Endpoint);
+        conf.add_peer(2);
+        watch.diff(L"r1", nullptr, conf.get(), &trans, ms0, channel);
+        auto got = take(2);
+        expect(got.size() == 2 && got[0].type == WG_EVENT_ADAPTER_STATE && got[0].detail == "up" && got[0].room == L"r1" &&
+                   got[1].type == WG_EVENT_HANDSHAKE && got[1].peer == key_of(1) && got[1].detail == "192.0.2.1:51820",
+               "first diff reports adapter state and handshaken peers only");
+
+        watch.diff(L"r1", nullptr, conf.get(), &trans, ms0 + 1000, channel);
+        expect(take(0).empty(), "unchanged configuration emits nothing");
+
+        parse_ip("198.51.100.2", 4500, conf.peer(0).Endpoint);
+        trans.failed = 5;
+        watch.diff(L"r1", nullptr, conf.get(), &trans, ms0 + 2000, channel);
+        got = take(2);
+        expect(got.size() == 2 && got[0].type == WG_EVENT_TRANSPORTER_ERROR && got[0].detail == "5" &&
+                   got[1].type == WG_EVENT_ENDPOINT_ROAMED && got[1].detail == "198.51.100.2:4500",
+               "endpoint change of a connected peer and new forward failures");
+
+        watch.diff(L"r1", nullptr, conf.get(), &trans, ms0 - 1000 + HANDSHAKE_LOST_MS, channel);
+        got = take(1);
+        expect(got.size() == 1 && got[0].type == WG_EVENT_HANDSHAKE_LOST && got[0].peer == key_of(1),
+               "handshake older than the session lifetime reported lost");
+
+        // 查询失败的一轮只比对适配器状态，peer 状态保留到下一次成功查询
+        adapter_state = WIREGUARD_ADAPTER_STATE_DOWN;
+        conf.peer(1).LastHandshake = handshake_at(ms0 + 200000);
+        watch.diff(L"r1", nullptr, nullptr, &trans, ms0 + 200500, channel);
+        got = take(1);
+        expect(got.size() == 1 && got[0].type == WG_EVENT_ADAPTER_STATE && got[0].detail == "down", "null config still diffs adapter state");
+        watch.diff(L"r1", nullptr, conf.get(), &trans, ms0 + 201000, channel);
+        got = take(1);
+        expect(got.size() == 1 && got[0].type == WG_EVENT_HANDSHAKE && got[0].peer == key_of(2) && got[0].detail.empty(),
+               "peer state kept across a failed query");
+
+        // peer 重排后按公钥对应；删除后重新加入的已连接 peer 重新报告握手
+        selftest_config reordered;
+        reordered.add_peer(2).LastHandshake = handshake_at(ms0 + 200000);
+        watch.diff(L"r1", nullptr, reordered.get(), &trans, ms0 + 202000, channel);
+        expect(take(0).empty(), "reordering and removal without handshake change emit nothing");
+        reordered.add_peer(1).LastHandshake = handshake_at(ms0 + 201500);
+        watch.diff(L"r1", nullptr, reordered.get(), &trans, ms0 + 202500, channel);
+        got = take(1);
+        expect(got.size() == 1 && got[0].type == WG_EVENT_HANDSHAKE && got[0].peer == key_of(1), "re-added peer reports its handshake");
+
+        // 房间名超长时截断
+        room_watch named;
+        named.diff(std::wstring(100, L'x'), nullptr, nullptr, nullptr, ms0, channel);
+        got = take(1);
+        expect(got.size() == 1 && got[0].room == std::wstring(EVENT_ROOM_LENGTH - 1, L'x'), "long room name truncated");
+        channel.stop();
+        log_func = nullptr;
+        return selftest_result();
+    }
+}
+
+int main()
+{
+    return peer_events_test::run();
+}
+#endif
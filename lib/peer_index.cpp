@@ -0,0 +1,239 @@
+#include "vector"
+#include "cstdint"
+#include "cstddef"
+
+#pragma once
+
+/**
+ * 哈希到 peer 下标的开放寻址表：线性探测，删除时把后续项回移，不留墓碑
+ * 容量为 2 的幂且不低于元素数的两倍，随 peer 表按倍数扩容，稳态下增删改都不分配内存；
+ * 哈希冲突的多个项各自占一个位置，查找时由调用方按名称或公钥区分
+ */
+class peer_index
+{
+public:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+    // 保证可容纳 count 个元素，扩容时按当前内容重新散列
+    void reserve(size_t count)
+    {
+        size_t capacity = table.empty() ? MIN_CAPACITY : table.size();
+        while (capacity < count * 2)
+            capacity *= 2;
+        if (capacity == table.size())
+            return;
+        std::vector<entry> old(capacity, entry{0, npos});
+        old.swap(table);
+        for (const auto &e : old)
+        {
+            if (e.slot != npos)
+                place(e);
+        }
+    }
+
+    // 清空全部项，保留容量
+    void clear()
+    {
+        for (auto &e : table)
+            e.slot = npos;
+        count = 0;
+    }
+
+    // 登记 hash -> slot，容量不足时先扩容
+    void insert(uint64_t hash, uint32_t slot)
+    {
+        reserve(count + 1);
+        place({hash, slot});
+        count++;
+    }
+
+    // 删除 hash 对应、值为 slot 的项，后续同簇的项回移填补空位
+    void erase(uint64_t hash, uint32_t slot)
+    {
+        auto i = locate(hash, slot);
+        if (i == npos_pos)
+            return;
+        const size_t mask = table.size() - 1;
+        for (size_t j = (i + 1) & mask; table[j].slot != npos; j = (j + 1) & mask)
+        {
+            // 起始位置不在 (i, j] 之间的项可以回移到 i
+            const size_t home = home_of(table[j].hash);
+            if (((j - home) & mask) >= ((j - i) & mask))
+            {
+                table[i] = table[j];
+                i = j;
+            }
+        }
+        table[i].slot = npos;
+        count--;
+    }
+
+    // 把 hash 对应、值为 from 的项改为 to，peer 表交换删除后调用
+    void move(uint64_t hash, uint32_t from, uint32_t to)
+    {
+        const auto i = locate(hash, from);
+        if (i != npos_pos)
+            table[i].slot = to;
+    }
+
+    // 按哈希查找，match(slot) 返回 true 的第一个下标，不存在返回 npos
+    template <typename Match>
+    uint32_t find(uint64_t hash, Match &&match) const
+    {
+        if (table.empty())
+            return npos;
+        const size_t mask = table.size() - 1;
+        for (size_t i = home_of(hash); table[i].slot != npos; i = (i + 1) & mask)
+        {
+            if (table[i].hash == hash && match(table[i].slot))
+                return table[i].slot;
+        }
+        return npos;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    size_t capacity() const
+    {
+        return table.size();
+    }
+
+private:
+    struct entry
+    {
+        uint64_t hash;
+        uint32_t slot;
+    };
+
+    static constexpr size_t MIN_CAPACITY = 32;
+    static constexpr size_t npos_pos = static_cast<size_t>(-1);
+
+    // 起始位置，混合高位后取低位，FNV 哈希的低位分布较差
+    size_t home_of(uint64_t hash) const
+    {
+        return static_cast<size_t>((hash ^ (hash >> 32)) * 0x9E3779B97F4A7C15ull >> 7) & (table.size() - 1);
+    }
+
+    // 写入第一个空位，调用方保证容量充足
+    void place(const entry &e)
+    {
+        const size_t mask = table.size() - 1;
+        size_t i = home_of(e.hash);
+        while (table[i].slot != npos)
+            i = (i + 1) & mask;
+        table[i] = e;
+    }
+
+    size_t locate(uint64_t hash, uint32_t slot) const
+    {
+        if (table.empty())
+            return npos_pos;
+        const size_t mask = table.size() - 1;
+        for (size_t i = home_of(hash); table[i].slot != npos; i = (i + 1) & mask)
+        {
+            if (table[i].hash == hash && table[i].slot == slot)
+                return i;
+        }
+        return npos_pos;
+    }
+
+    std::vector<entry> table;
+    size_t count = 0;
+};
+
+#ifdef PEER_INDEX_SELFTEST
+// 本地自测：bash lib/selftest.sh peer_index
+// 与按值线性扫描的参照实现对拍：随机插入、交换删除与整表清空，哈希刻意压到少量取值以制造冲突簇
+#include "selftest_compat.h"
+#include "iostream"
+#include "random"
+#include "algorithm"
+#include "string"
+
+int main()
+{
+    peer_index index;
+    std::vector<uint64_t> slots;
+    std::mt19937_64 rng(7);
+    bool consistent = true;
+    size_t max_size = 0;
+    const auto check_all = [&]
+    {
+        if (index.size() != slots.size())
+            return false;
+        for (uint32_t s = 0; s < slots.size(); s++)
+        {
+            if (index.find(slots[s], [s](uint32_t v)
+                           { return v == s; }) != s)
+                return false;
+        }
+        return true;
+    };
+    for (int round = 0; round < 20000; round++)
+    {
+        const auto op = rng() % 10;
+        if (op < 6 || slots.empty())
+        {
+            const uint64_t hash = rng() % 64;
+            index.insert(hash, static_cast<uint32_t>(slots.size()));
+            slots.push_back(hash);
+        }
+        else if (op < 9)
+        {
+            // 与 room_config::remove_peer 相同：删除后把最后一项移入空位
+            const auto idx = static_cast<uint32_t>(rng() % slots.size());
+            const auto last = static_cast<uint32_t>(slots.size() - 1);
+            index.erase(slots[idx], idx);
+            if (idx != last)
+            {
+                slots[idx] = slots[last];
+                index.move(slots[idx], last, idx);
+            }
+            slots.pop_back();
+        }
+        else if (rng() % 50 == 0)
+        {
+            index.clear();
+            slots.clear();
+        }
+        max_size = std::max(max_size, slots.size());
+        if (round % 97 == 0)
+            consistent = consistent && check_all();
+    }
+    consistent = consistent && check_all();
+    expect(max_size > 100, "random workload grew past the initial capacity");
+    expect(consistent, "index matches swap-removed slots under heavy collisions");
+    expect(index.find(999, [](uint32_t)
+                      { return true; }) == peer_index::npos,
+           "missing hash not found");
+
+    // 同一哈希的多个项由 match 区分
+    peer_index same;
+    same.insert(5, 0);
+    same.insert(5, 1);
+    same.insert(5, 2);
+    same.erase(5, 1);
+    expect(same.find(5, [](uint32_t v)
+                     { return v == 2; }) == 2 &&
+               same.find(5, [](uint32_t v)
+                         { return v == 1; }) == peer_index::npos,
+           "colliding entries told apart by match");
+
+    // 稳态增删不改变容量
+    peer_index steady;
+    steady.reserve(16);
+    const auto capacity = steady.capacity();
+    for (uint32_t i = 0; i < 16; i++)
+        steady.insert(i * 31, i);
+    for (int r = 0; r < 1000; r++)
+    {
+        steady.erase((r % 16) * 31, r % 16);
+        steady.insert((r % 16) * 31, r % 16);
+    }
+    expect(steady.capacity() == capacity && steady.size() == 16, "steady-state churn does not reallocate");
+    return selftest_result();
+}
+#endif
@@ -0,0 +1,300 @@
+#ifdef _WIN32
+#include "src/wireguard.h"
+#include "wireguard_tool.cpp"
+#else
+#include "selftest_compat.h"
+#endif
+#include "mutex"
+#include "vector"
+#include "chrono"
+
+#pragma once
+
+// FILETIME(1601-01-01 起的 100ns) 与 unix 毫秒时间戳的差值
+static constexpr uint64_t FILETIME_UNIX_EPOCH = 116444736000000000ull;
+
+// 导出给调用方的单个 peer 统计，固定内存布局，调用方按 96 字节步长解析
+#pragma pack(push, 8)
+struct peer_stat
+{
+    uint8_t public_key[WIREGUARD_KEY_LENGTH]; // peer 公钥，作为 peer 标识
+    uint64_t tx_bytes;                        // 累计发送字节
+    uint64_t rx_bytes;                        // 累计接收字节
+    uint64_t tx_rate;                         // 相对上次查询的发送速率，字节/秒
+    uint64_t rx_rate;                         // 相对上次查询的接收速率，字节/秒
+    uint64_t last_handshake_ms;               // 最后握手 unix 毫秒时间戳，0 表示从未握手
+    uint8_t endpoint_addr[16];                // 对端地址，IPv4 占前 4 字节，网络字节序
+    uint16_t endpoint_family;                 // AF_INET / AF_INET6，0 表示无 endpoint
+    uint16_t endpoint_port;                   // 对端端口，主机字节序
+    uint32_t reserved;
+};
+#pragma pack(pop)
+static_assert(sizeof(peer_stat) == 96, "peer_stat layout changed");
+
+// 将 wireguard 的 FILETIME 握手时间转换为 unix 毫秒
+inline uint64_t handshake_to_unix_ms(DWORD64 last_handshake)
+{
+    if (last_handshake <= FILETIME_UNIX_EPOCH)
+        return 0;
+    return (last_handshake - FILETIME_UNIX_EPOCH) / 10000;
+}
+
+// 查询适配器配置到复用缓冲区，空间不足时扩容后重试，buffer 以 uint64_t 为单位分配保证 8 字节对齐
+inline WIREGUARD_INTERFACE *query_configuration(WIREGUARD_ADAPTER_HANDLE handle, std::vector<uint64_t> &buffer)
+{
+    for (int attempt = 0; attempt < 3; attempt++)
+    {
+        DWORD size = static_cast<DWORD>(buffer.size() * sizeof(uint64_t));
+        if (WireGuardGetConfiguration(handle, reinterpret_cast<WIREGUARD_INTERFACE *>(buffer.data()), &size))
+        {
+            return reinterpret_cast<WIREGUARD_INTERFACE *>(buffer.data());
+        }
+        if (GetLastError() != ERROR_MORE_DATA)
+        {
+            log(WIREGUARD_LOG_ERR, "get configuration failed", GetLastError());
+            return nullptr;
+        }
+        buffer.resize((size + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    }
+    return nullptr;
+}
+
+/**
+ * 单个房间的统计查询状态
+ * 复用 WireGuardGetConfiguration 的查询缓冲区，保存上次查询的计数用于计算速率，
+ * 使用独立的锁，不会阻塞在房间配置修改上
+ */
+class room_stats
+{
+    struct counter
+    {
+        uint8_t public_key[WIREGUARD_KEY_LENGTH];
+        uint64_t tx_bytes;
+        uint64_t rx_bytes;
+    };
+
+    std::mutex lock;
+    // 查询缓冲区
+    std::vector<uint64_t> buffer;
+    std::vector<counter> previous;
+    std::vector<counter> current;
+    std::chrono::steady_clock::time_point previous_at;
+
+    // 查找 peer 上次的计数，peer 顺序通常不变，优先比较同一下标
+    const counter *find_previous(const BYTE *key, size_t hint) const
+    {
+        if (hint < previous.size() && memcmp(previous[hint].public_key, key, WIREGUARD_KEY_LENGTH) == 0)
+            return &previous[hint];
+        for (const auto &c : previous)
+        {
+            if (memcmp(c.public_key, key, WIREGUARD_KEY_LENGTH) == 0)
+                return &c;
+        }
+        return nullptr;
+    }
+
+    static uint64_t rate(uint64_t now, uint64_t before, double seconds)
+    {
+        if (seconds <= 0 || now < before)
+            return 0;
+        return static_cast<uint64_t>((now - before) / seconds);
+    }
+
+    // 按查询结果计算统计并写入 out，保存本次计数，调用方需持有 lock
+    void compute(const WIREGUARD_INTERFACE *config, std::chrono::steady_clock::time_point now,
+                 peer_stat *out, size_t max, size_t &total)
+    {
+        const double seconds = previous.empty() ? 0 : std::chrono::duration<double>(now - previous_at).count();
+        current.clear();
+        const BYTE *cursor = reinterpret_cast<const BYTE *>(config) + interface_size;
+        for (DWORD i = 0; i < config->PeersCount; i++)
+        {
+            const auto *peer = reinterpret_cast<const WIREGUARD_PEER *>(cursor);
+            cursor += peer_size + peer->AllowedIPsCount * allowed_ip_size;
+            counter c{};
+            memcpy(c.public_key, peer->PublicKey, WIREGUARD_KEY_LENGTH);
+            c.tx_bytes = peer->TxBytes;
+            c.rx_bytes = peer->RxBytes;
+            current.push_back(c);
+            if (i >= max)
+                continue;
+
+            auto &stat = out[i];
+            memset(&stat, 0, sizeof(stat));
+            memcpy(stat.public_key, peer->PublicKey, WIREGUARD_KEY_LENGTH);
+            stat.tx_bytes = peer->TxBytes;
+            stat.rx_bytes = peer->RxBytes;
+            if (const auto *prev = find_previous(peer->PublicKey, i); prev != nullptr)
+            {
+                stat.tx_rate = rate(peer->TxBytes, prev->tx_bytes, seconds);
+                stat.rx_rate = rate(peer->RxBytes, prev->rx_bytes, seconds);
+            }
+            stat.last_handshake_ms = handshake_to_unix_ms(peer->LastHandshake);
+            if (peer->Endpoint.si_family == AF_INET)
+            {
+                memcpy(stat.endpoint_addr, &peer->Endpoint.Ipv4.sin_addr, 4);
+                stat.endpoint_port = ntohs(peer->Endpoint.Ipv4.sin_port);
+                stat.endpoint_family = AF_INET;
+            }
+            else if (peer->Endpoint.si_family == AF_INET6)
+            {
+                memcpy(stat.endpoint_addr, &peer->Endpoint.Ipv6.sin6_addr, 16);
+                stat.endpoint_port = ntohs(peer->Endpoint.Ipv6.sin6_port);
+                stat.endpoint_family = AF_INET6;
+            }
+        }
+        total = config->PeersCount;
+        previous.swap(current);
+        previous_at = now;
+    }
+
+public:
+    /**
+     * 查询 peer 统计并写入调用方数组
+     * @param out: 输出数组 @param max: 数组长度 @param total: 输出 peer 总数，大于 max 时只写入前 max 个
+     * @return 查询是否成功
+     */
+    bool snapshot(WIREGUARD_ADAPTER_HANDLE handle, peer_stat *out, size_t max, size_t &total)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        total = 0;
+        const auto config = query_configuration(handle, buffer);
+        if (config == nullptr)
+        {
+            return false;
+        }
+        compute(config, std::chrono::steady_clock::now(), out, max, total);
+        return true;
+    }
+
+    // 按调用方已查询的配置计算统计，共享采样线程把同一份查询结果分发给多个消费者，config 为空时返回 false
+    bool snapshot(const WIREGUARD_INTERFACE *config, std::chrono::steady_clock::time_point now,
+                  peer_stat *out, size_t max, size_t &total)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        total = 0;
+        if (config == nullptr)
+        {
+            return false;
+        }
+        compute(config, now, out, max, total);
+        return true;
+    }
+};
+
+#ifdef PEER_STATS_SELFTEST
+// 本地自测：bash lib/selftest.sh peer_stats
+// 按内存布局拼装查询结果驱动 room_stats：速率、计数回绕、peer 重排与截断，以及查询缓冲区扩容
+#include "selftest_compat.h"
+
+namespace peer_stats_test
+{
+    // 模拟适配器返回的配置，调用方缓冲区不足时按驱动约定返回 ERROR_MORE_DATA 与所需大小
+    selftest_config *adapter_config = nullptr;
+    int adapter_queries = 0;
+
+    BOOL fake_get(WIREGUARD_ADAPTER_HANDLE, WIREGUARD_INTERFACE *config, DWORD *bytes)
+    {
+        adapter_queries++;
+        if (adapter_config == nullptr)
+        {
+            SetLastError(ERROR_MORE_DATA + 1);
+            return 0;
+        }
+        if (*bytes < adapter_config->size())
+        {
+            *bytes = adapter_config->size();
+            SetLastError(ERROR_MORE_DATA);
+            return 0;
+        }
+        memcpy(config, adapter_config->get(), adapter_config->size());
+        *bytes = adapter_config->size();
+        return 1;
+    }
+
+    inline int run()
+    {
+        using namespace std::chrono;
+        const auto t0 = steady_clock::now();
+        room_stats stats;
+        peer_stat out[4];
+        size_t total = 0;
+
+        selftest_config conf;
+        conf.add_peer(1, 1000, 100, 2);
+        conf.add_peer(2, 5000, 500);
+        expect(stats.snapshot(conf.get(), t0, out, 4, total) && total == 2 && out[0].public_key[0] == 1 &&
+                   out[0].tx_bytes == 1000 && out[1].rx_bytes == 500,
+               "first snapshot copies counters across allowed IP records");
+        expect(out[0].tx_rate == 0 && out[0].rx_rate == 0 && out[1].tx_rate == 0, "first snapshot has no rate");
+
+        conf.peer(0).TxBytes += 2000;
+        conf.peer(0).RxBytes += 500;
+        conf.peer(1).TxBytes += 100;
+        stats.snapshot(conf.get(), t0 + seconds(2), out, 4, total);
+        expect(out[0].tx_rate == 1000 && out[0].rx_rate == 250 && out[1].tx_rate == 50 && out[1].rx_rate == 0,
+               "rates are byte deltas over elapsed seconds");
+
+        // 计数回绕或驱动重建 peer 后计数变小：本次速率为 0，下次从新计数起算
+        conf.peer(0).TxBytes = 10;
+        stats.snapshot(conf.get(), t0 + seconds(3), out, 4, total);
+        expect(out[0].tx_rate == 0 && out[0].tx_bytes == 10, "counter going backwards yields zero, not a wrapped rate");
+        conf.peer(0).TxBytes = 4010;
+        stats.snapshot(conf.get(), t0 + seconds(5), out, 4, total);
+        expect(out[0].tx_rate == 2000, "rate resumes from the reset counter");
+
+        // 同一时刻再次查询：间隔为 0 不产生除零
+        stats.snapshot(conf.get(), t0 + seconds(5), out, 4, total);
+        expect(out[0].tx_rate == 0 && out[1].tx_rate == 0, "zero interval yields zero rate");
+
+        // peer 顺序变化与新增 peer：按公钥对应上次计数，新 peer 没有速率
+        selftest_config moved;
+        moved.add_peer(3, 7000, 0);
+        moved.add_peer(2, conf.peer(1).TxBytes + 300, 500);
+        moved.add_peer(1, 4010 + 600, conf.peer(0).RxBytes);
+        stats.snapshot(moved.get(), t0 + seconds(8), out, 4, total);
+        expect(total == 3 && out[0].public_key[0] == 3 && out[0].tx_rate == 0 && out[1].tx_rate == 100 && out[2].tx_rate == 200,
+               "reordered peers matched by public key, new peer starts at zero");
+
+        // 输出数组不足：total 为全部 peer 数，只写入前 max 个，其余 peer 的计数仍作为下次基准
+        out[1].tx_bytes = 12345;
+        moved.peer(2).TxBytes += 900;
+        stats.snapshot(moved.get(), t0 + seconds(9), out, 1, total);
+        expect(total == 3 && out[0].public_key[0] == 3 && out[1].tx_bytes == 12345, "output truncated to max, total counts all peers");
+        stats.snapshot(moved.get(), t0 + seconds(10), out, 4, total);
+        expect(out[2].tx_rate == 0 && out[2].tx_bytes == 4010 + 600 + 900, "truncated peers keep their baseline");
+
+        // 握手时间与 endpoint
+        selftest_config shaped;
+        auto &peer = shaped.add_peer(9);
+        peer.LastHandshake = FILETIME_UNIX_EPOCH + 1234ull * 10000;
+        parse_ip("192.0.2.7", 51820, peer.Endpoint);
+        shaped.add_peer(10).LastHandshake = FILETIME_UNIX_EPOCH;
+        stats.snapshot(shaped.get(), t0 + seconds(11), out, 4, total);
+        const uint8_t addr[4] = {192, 0, 2, 7};
+        expect(out[0].last_handshake_ms == 1234 && out[1].last_handshake_ms == 0, "handshake FILETIME converted to unix ms, epoch means never");
+        expect(out[0].endpoint_family == AF_INET && out[0].endpoint_port == 51820 && memcmp(out[0].endpoint_addr, addr, 4) == 0 &&
+                   out[1].endpoint_family == 0,
+               "endpoint address in network order, port in host order");
+
+        // 按句柄查询：首次缓冲区为空，按驱动返回的大小扩容后重试
+        WireGuardGetConfiguration = &fake_get;
+        adapter_config = &conf;
+        room_stats queried;
+        const bool ok = queried.snapshot(nullptr, out, 4, total);
+        expect(ok && total == 2 && adapter_queries == 2 && out[1].public_key[0] == 2, "query grows the buffer once on ERROR_MORE_DATA");
+        adapter_queries = 0;
+        queried.snapshot(nullptr, out, 4, total);
+        expect(adapter_queries == 1, "grown buffer reused by the next query");
+        adapter_config = nullptr;
+        expect(!queried.snapshot(nullptr, out, 4, total) && total == 0, "query failure reported without stats");
+        expect(!stats.snapshot(nullptr, t0 + seconds(12), out, 4, total) && total == 0, "missing shared sample reported without stats");
+        return selftest_result();
+    }
+}
+
+int main()
+{
+    return peer_stats_test::run();
+}
+#endif
@@ -0,0 +1,1460 @@
+#include "hole_punch.cpp"
+#include "algorithm"
+#include "atomic"
+#include "chrono"
+#include "memory"
+#include "mutex"
+#include "string"
+#include "thread"
+#include "unordered_map"
+#include "vector"
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#pragma once
+
+// 中继与信令服务器共享的绑定密钥长度，令牌与 cookie 的截断长度
+static constexpr size_t RELAY_SECRET_SIZE = 32;
+static constexpr size_t RELAY_TOKEN_SIZE = 16;
+static constexpr size_t RELAY_COOKIE_SIZE = 8;
+
+// SHA-256，只用于绑定令牌与 cookie，转发路径不经过
+class relay_sha256
+{
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    uint8_t block[64] = {};
+    size_t used = 0;
+    uint64_t total = 0;
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const uint8_t *p)
+    {
+        static constexpr uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = static_cast<uint32_t>(p[4 * i]) << 24 | static_cast<uint32_t>(p[4 * i + 1]) << 16 |
+                   static_cast<uint32_t>(p[4 * i + 2]) << 8 | p[4 * i + 3];
+        for (int i = 16; i < 64; i++)
+        {
+            const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t v[8];
+        memcpy(v, h, sizeof(v));
+        for (int i = 0; i < 64; i++)
+        {
+            const uint32_t s1 = rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25);
+            const uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+            const uint32_t t1 = v[7] + s1 + ch + k[i] + w[i];
+            const uint32_t s0 = rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22);
+            const uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+            memmove(v + 1, v, 7 * sizeof(uint32_t));
+            v[4] += t1;
+            v[0] = t1 + s0 + maj;
+        }
+        for (int i = 0; i < 8; i++)
+            h[i] += v[i];
+    }
+
+public:
+    void update(const uint8_t *data, size_t len)
+    {
+        total += len;
+        while (len > 0)
+        {
+            const size_t n = std::min(sizeof(block) - used, len);
+            memcpy(block + used, data, n);
+            used += n;
+            data += n;
+            len -= n;
+            if (used == sizeof(block))
+            {
+                compress(block);
+                used = 0;
+            }
+        }
+    }
+
+    void final(uint8_t out[32])
+    {
+        const uint64_t bits = total * 8;
+        const uint8_t pad = 0x80, zero = 0;
+        update(&pad, 1);
+        while (used != 56)
+            update(&zero, 1);
+        uint8_t length[8];
+        for (int i = 0; i < 8; i++)
+            length[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+        update(length, sizeof(length));
+        for (int i = 0; i < 8; i++)
+        {
+            out[4 * i] = static_cast<uint8_t>(h[i] >> 24);
+            out[4 * i + 1] = static_cast<uint8_t>(h[i] >> 16);
+            out[4 * i + 2] = static_cast<uint8_t>(h[i] >> 8);
+            out[4 * i + 3] = static_cast<uint8_t>(h[i]);
+        }
+    }
+};
+
+// HMAC-SHA256，key 不超过 64 字节
+inline void relay_hmac(const uint8_t *key, size_t key_len, const uint8_t *data, size_t len, uint8_t out[32])
+{
+    uint8_t pad[64] = {};
+    memcpy(pad, key, std::min(key_len, sizeof(pad)));
+    for (auto &b : pad)
+        b ^= 0x36;
+    relay_sha256 inner;
+    inner.update(pad, sizeof(pad));
+    inner.update(data, len);
+    uint8_t digest[32];
+    inner.final(digest);
+    for (auto &b : pad)
+        b ^= 0x36 ^ 0x5c;
+    relay_sha256 outer;
+    outer.update(pad, sizeof(pad));
+    outer.update(digest, sizeof(digest));
+    outer.final(out);
+}
+
+// 定长比较，耗时与内容无关
+inline bool relay_equal(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint8_t diff = 0;
+    for (size_t i = 0; i < len; i++)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+/**
+ * 绑定令牌：信令服务器为会话的每一端签发，中继用同一密钥校验
+ * HMAC-SHA256(secret, session u64 | end u8 | expiry u32) 取前 RELAY_TOKEN_SIZE 字节，均为大端序
+ * @param end 会话中的一端（0 或 1），令牌只能绑定这一端 @param expiry 过期的 unix 秒
+ */
+inline void relay_token(const uint8_t *secret, uint64_t session, uint8_t end, uint32_t expiry, uint8_t *out)
+{
+    uint8_t msg[13];
+    for (int i = 0; i < 8; i++)
+        msg[i] = static_cast<uint8_t>(session >> (56 - 8 * i));
+    msg[8] = end;
+    for (int i = 0; i < 4; i++)
+        msg[9 + i] = static_cast<uint8_t>(expiry >> (24 - 8 * i));
+    uint8_t mac[32];
+    relay_hmac(secret, RELAY_SECRET_SIZE, msg, sizeof(msg), mac);
+    memcpy(out, mac, RELAY_TOKEN_SIZE);
+}
+
+#ifdef __linux__
+/**
+ * 中继转发守护进程（Linux），直连失败时的中继路径
+ * 不解密 WireGuard 报文：双方从 wg 端口向中继发送绑定报文，同一会话两端都绑定后，任一方发来的报文原样转发给另一方。
+ * 成员把中继地址作为对方的 wg endpoint 即可（见 path_manager）。
+ * 绑定需要两步：报文携带信令服务器签发的令牌（见 relay_token），令牌指定会话与其中一端，过期即失效，
+ * 会话 id 可预测也无法冒用；令牌有效时中继先向源地址回一个 cookie，源地址带着 cookie 重发后才绑定，
+ * 伪造源地址的一方收不到 cookie，无法把他人的地址绑定为转发目标。
+ * 未绑定的源地址发来的打洞检查由中继自己应答，供 relay_select 测量到中继的往返时延；已绑定的检查照常转发，路径探测测的是经中继到对方的时延。
+ */
+
+/**
+ * 绑定报文类型，前 24 字节与打洞请求相同（pair 为绑定的一端），之后为
+ * 24 expiry u32 | 28 token[16] | 44 cookie[8]，首次发送时 cookie 全零
+ * 应答为 PUNCH_RESPONSE，pair 字段为会话已绑定的地址数（1 或 2）；cookie 不符时应答 RELAY_COOKIE
+ */
+static constexpr uint8_t RELAY_BIND = 4;
+static constexpr size_t RELAY_BIND_SIZE = 52;
+// cookie 报文：前 24 字节回显绑定报文（type 改为 RELAY_COOKIE），24 cookie[8]，比绑定报文短，不能用于放大
+static constexpr uint8_t RELAY_COOKIE = 5;
+static constexpr size_t RELAY_COOKIE_REPLY_SIZE = 32;
+// cookie 密钥的轮换周期(s)，接受当前与上一周期的 cookie
+static constexpr uint32_t RELAY_COOKIE_S = 30;
+// 每次 recvmmsg/sendmmsg 的报文数
+static constexpr unsigned RELAY_BATCH = 64;
+// 单个报文的接收缓冲，超过的报文被截断后丢弃
+static constexpr size_t RELAY_MTU = 2048;
+// 会话无转发的过期时间(s)，WireGuard keepalive 为 25s
+static constexpr uint32_t RELAY_IDLE_S = 180;
+// 过期清理间隔(s)，被替换的旧会话表也在一个清理周期后释放
+static constexpr uint32_t RELAY_SWEEP_S = 10;
+// 会话表初始槽数与上限，占用（含删除标记）超过 3/4 时重建
+static constexpr size_t RELAY_TABLE_INITIAL = 1024;
+static constexpr size_t RELAY_TABLE_LIMIT = 1 << 20;
+// 工作线程等待报文的超时(ms)，决定停止的响应时间
+static constexpr int RELAY_POLL_MS = 100;
+// 套接字收发缓冲(byte)
+static constexpr int RELAY_SOCKET_BUFFER = 4 << 20;
+
+// 守护进程计数，各工作线程之和
+struct relay_stats
+{
+    uint64_t received;  // 收到的报文
+    uint64_t forwarded; // 转发的报文
+    uint64_t bytes;     // 转发的字节
+    uint64_t answered;  // 中继自己应答的检查与绑定
+    uint64_t dropped;   // 无绑定或发送失败丢弃的报文
+    uint64_t rejected;  // 令牌无效或过期的绑定
+    uint32_t sessions;  // 当前会话数
+    uint32_t endpoints; // 当前已绑定的源地址数
+};
+
+// 地址按 3 个 64 位字编码，作为会话表的键与值：family | port << 16 | scope << 32，地址 16 字节
+struct relay_addr
+{
+    uint64_t w[3];
+
+    static relay_addr from(const sockaddr_storage &addr)
+    {
+        relay_addr out{};
+        if (addr.ss_family == AF_INET)
+        {
+            const auto &in = reinterpret_cast<const sockaddr_in &>(addr);
+            out.w[0] = AF_INET | static_cast<uint64_t>(in.sin_port) << 16;
+            memcpy(&out.w[1], &in.sin_addr, 4);
+        }
+        else if (addr.ss_family == AF_INET6)
+        {
+            const auto &in6 = reinterpret_cast<const sockaddr_in6 &>(addr);
+            out.w[0] = AF_INET6 | static_cast<uint64_t>(in6.sin6_port) << 16 | static_cast<uint64_t>(in6.sin6_scope_id) << 32;
+            memcpy(&out.w[1], &in6.sin6_addr, 16);
+        }
+        return out;
+    }
+
+    socklen_t to(sockaddr_storage &addr) const
+    {
+        memset(&addr, 0, sizeof(addr));
+        const uint16_t family = static_cast<uint16_t>(w[0]);
+        const uint16_t port = static_cast<uint16_t>(w[0] >> 16);
+        if (family == AF_INET)
+        {
+            auto &in = reinterpret_cast<sockaddr_in &>(addr);
+            in.sin_family = AF_INET;
+            in.sin_port = port;
+            memcpy(&in.sin_addr, &w[1], 4);
+            return sizeof(sockaddr_in);
+        }
+        auto &in6 = reinterpret_cast<sockaddr_in6 &>(addr);
+        in6.sin6_family = AF_INET6;
+        in6.sin6_port = port;
+        in6.sin6_scope_id = static_cast<uint32_t>(w[0] >> 32);
+        memcpy(&in6.sin6_addr, &w[1], 16);
+        return sizeof(sockaddr_in6);
+    }
+
+    bool valid() const { return w[0] != 0; }
+
+    bool operator==(const relay_addr &o) const { return w[0] == o.w[0] && w[1] == o.w[1] && w[2] == o.w[2]; }
+
+    uint64_t hash() const
+    {
+        uint64_t h = w[0] * 0x9E3779B97F4A7C15ull ^ w[1];
+        h = (h ^ (h >> 31)) * 0xBF58476D1CE4E5B9ull ^ w[2];
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+        return h ^ (h >> 31);
+    }
+};
+
+struct relay_addr_hash
+{
+    size_t operator()(const relay_addr &a) const { return static_cast<size_t>(a.hash()); }
+};
+
+/**
+ * 源地址 -> 对端地址的开放寻址表，读无锁，写由调用方串行
+ * 每个槽带序号（seqlock）：写前置为奇数、写完置为偶数，读端读到奇数或前后序号不同则重读，不会读到写了一半的槽。
+ * 删除只留标记，标记与占用超过 3/4 时由写端建新表整体替换，读端持有的旧表延后释放
+ */
+class relay_table
+{
+    enum : uint32_t
+    {
+        EMPTY = 0,
+        USED = 1,
+        DEAD = 2,
+    };
+
+    struct alignas(64) slot
+    {
+        std::atomic<uint32_t> seq{0};
+        std::atomic<uint32_t> state{EMPTY};
+        std::atomic<uint64_t> key[3];
+        std::atomic<uint64_t> peer[3];
+        std::atomic<uint32_t> seen{0}; // 最近一次转发(s)，读端更新，不参与序号校验
+    };
+
+    std::unique_ptr<slot[]> slots;
+    size_t mask;
+
+    void write(slot &s, uint32_t state, const relay_addr &key, const relay_addr &peer)
+    {
+        const uint32_t v = s.seq.load(std::memory_order_relaxed);
+        s.seq.store(v + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        s.state.store(state, std::memory_order_relaxed);
+        for (int i = 0; i < 3; i++)
+        {
+            s.key[i].store(key.w[i], std::memory_order_relaxed);
+            s.peer[i].store(peer.w[i], std::memory_order_relaxed);
+        }
+        s.seq.store(v + 2, std::memory_order_release);
+    }
+
+    // 写端查找：只有写端修改槽，不需要序号校验
+    slot *find(const relay_addr &key) const
+    {
+        for (size_t i = 0, at = key.hash() & mask; i <= mask; i++, at = (at + 1) & mask)
+        {
+            slot &s = slots[at];
+            const auto state = s.state.load(std::memory_order_relaxed);
+            if (state == EMPTY)
+                return nullptr;
+            if (state == USED && s.key[0].load(std::memory_order_relaxed) == key.w[0] &&
+                s.key[1].load(std::memory_order_relaxed) == key.w[1] && s.key[2].load(std::memory_order_relaxed) == key.w[2])
+                return &s;
+        }
+        return nullptr;
+    }
+
+public:
+    size_t used = 0;
+    size_t dead = 0;
+
+    explicit relay_table(size_t capacity) : slots(new slot[capacity]), mask(capacity - 1) {}
+
+    size_t capacity() const { return mask + 1; }
+
+    // 读端查找 key 的对端地址，找到时刷新转发时间；对端未绑定时返回的 peer 无效
+    bool lookup(const relay_addr &key, relay_addr &peer, uint32_t now_s)
+    {
+        for (size_t i = 0, at = key.hash() & mask; i <= mask; i++, at = (at + 1) & mask)
+        {
+            slot &s = slots[at];
+            uint32_t v, state;
+            relay_addr k, p;
+            do
+            {
+                v = s.seq.load(std::memory_order_acquire);
+                state = s.state.load(std::memory_order_relaxed);
+                for (int j = 0; j < 3; j++)
+                {
+                    k.w[j] = s.key[j].load(std::memory_order_relaxed);
+                    p.w[j] = s.peer[j].load(std::memory_order_relaxed);
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+            } while ((v & 1) != 0 || s.seq.load(std::memory_order_relaxed) != v);
+            if (state == EMPTY)
+                return false;
+            if (state != USED || !(k == key))
+                continue;
+            // 同一秒内不重复写，避免各工作线程反复使同一缓存行失效
+            if (s.seen.load(std::memory_order_relaxed) != now_s)
+                s.seen.store(now_s, std::memory_order_relaxed);
+            peer = p;
+            return true;
+        }
+        return false;
+    }
+
+    // 以下为写端操作，调用方串行
+    bool put(const relay_addr &key, const relay_addr &peer, uint32_t now_s)
+    {
+        if (slot *s = find(key))
+        {
+            write(*s, USED, key, peer);
+            return true;
+        }
+        for (size_t i = 0, at = key.hash() & mask; i <= mask; i++, at = (at + 1) & mask)
+        {
+            slot &s = slots[at];
+            const auto state = s.state.load(std::memory_order_relaxed);
+            if (state == USED)
+                continue;
+            dead -= state == DEAD;
+            used++;
+            s.seen.store(now_s, std::memory_order_relaxed);
+            write(s, USED, key, peer);
+            return true;
+        }
+        return false;
+    }
+
+    void erase(const relay_addr &key)
+    {
+        if (slot *s = find(key))
+        {
+            write(*s, DEAD, relay_addr{}, relay_addr{});
+            used--;
+            dead++;
+        }
+    }
+
+    // 最近一次转发时间，不存在返回 0
+    uint32_t seen(const relay_addr &key) const
+    {
+        const slot *s = find(key);
+        return s == nullptr ? 0 : s->seen.load(std::memory_order_relaxed);
+    }
+
+    // 复制全部有效槽到 to，包括转发时间
+    void copy_to(relay_table &to) const
+    {
+        for (size_t i = 0; i <= mask; i++)
+        {
+            const slot &s = slots[i];
+            if (s.state.load(std::memory_order_relaxed) != USED)
+                continue;
+            relay_addr key, peer;
+            for (int j = 0; j < 3; j++)
+            {
+                key.w[j] = s.key[j].load(std::memory_order_relaxed);
+                peer.w[j] = s.peer[j].load(std::memory_order_relaxed);
+            }
+            to.put(key, peer, s.seen.load(std::memory_order_relaxed));
+        }
+    }
+};
+
+/**
+ * 中继转发引擎，每个工作线程一个 SO_REUSEPORT 套接字绑定同一端口，由内核按四元组分流，线程之间不共享套接字
+ * 工作线程用 recvmmsg 批量收包，查会话表后原样用 sendmmsg 批量发往对端，报文不复制。
+ * 会话表读无锁，绑定、过期清理与重建由 bind_lock 串行，只在控制报文与清理时进入
+ */
+class relay_daemon
+{
+    struct session
+    {
+        relay_addr ends[2];
+    };
+
+    struct alignas(64) counters
+    {
+        std::atomic<uint64_t> received{0};
+        std::atomic<uint64_t> forwarded{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> answered{0};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<uint64_t> rejected{0};
+    };
+
+    std::atomic<relay_table *> table{nullptr};
+    std::mutex bind_lock;
+    std::unique_ptr<relay_table> owned;
+    // 被替换的旧表，读端可能仍在使用，过一个清理周期后释放
+    std::vector<std::pair<std::unique_ptr<relay_table>, uint32_t>> retired;
+    std::unordered_map<uint64_t, session> sessions;
+    std::unordered_map<relay_addr, uint64_t, relay_addr_hash> owners; // 源地址所属的会话
+    std::vector<int> sockets;
+    std::vector<std::thread> workers;
+    std::unique_ptr<counters[]> stats_;
+    std::thread sweeper;
+    std::atomic<bool> stopping{false};
+    std::chrono::steady_clock::time_point epoch;
+    std::atomic<uint32_t> skew_s{0}; // 自测模拟经过的时间
+    uint8_t secret[RELAY_SECRET_SIZE] = {};
+    uint8_t cookie_key[RELAY_SECRET_SIZE] = {}; // 每次启动随机生成
+    uint16_t bound_port = 0;
+    int family = AF_INET6;
+
+    uint32_t now_s() const
+    {
+        return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - epoch).count()) + 1 + skew_s.load(std::memory_order_relaxed);
+    }
+
+    int open_socket(uint16_t port)
+    {
+        int s = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+        if (s < 0)
+            return -1;
+        int on = 1, off = 0, size = RELAY_SOCKET_BUFFER;
+        setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        setsockopt(s, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        int result;
+        if (family == AF_INET6)
+        {
+            // 双栈：IPv4 成员以映射地址出现，转发时原样使用
+            setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+            sockaddr_in6 addr{};
+            addr.sin6_family = AF_INET6;
+            addr.sin6_addr = in6addr_any;
+            addr.sin6_port = htons(port);
+            result = bind(s, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr));
+        }
+        else
+        {
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            addr.sin_port = htons(port);
+            result = bind(s, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr));
+        }
+        if (result != 0)
+        {
+            close(s);
+            return -1;
+        }
+        return s;
+    }
+
+    // 报文中的映射地址使用普通 IPv4 形式，与直连打洞的应答一致
+    static sockaddr_storage unmapped(const sockaddr_storage &from)
+    {
+        if (from.ss_family != AF_INET6)
+            return from;
+        const auto &in6 = reinterpret_cast<const sockaddr_in6 &>(from);
+        if (!IN6_IS_ADDR_V4MAPPED(&in6.sin6_addr))
+            return from;
+        sockaddr_storage out{};
+        auto &in = reinterpret_cast<sockaddr_in &>(out);
+        in.sin_family = AF_INET;
+        in.sin_port = in6.sin6_port;
+        memcpy(&in.sin_addr, reinterpret_cast<const uint8_t *>(&in6.sin6_addr) + 12, 4);
+        return out;
+    }
+
+    // 写端：按会话重写两端的槽，占用过高时先重建
+    void publish(const session &s, uint32_t now)
+    {
+        relay_table *t = table.load(std::memory_order_relaxed);
+        if ((t->used + t->dead + 2) * 4 > t->capacity() * 3)
+        {
+            size_t capacity = t->capacity();
+            while ((t->used + 2) * 2 > capacity && capacity < RELAY_TABLE_LIMIT)
+                capacity *= 2;
+            auto fresh = std::make_unique<relay_table>(capacity);
+            t->copy_to(*fresh);
+            retired.emplace_back(std::move(owned), now);
+            owned = std::move(fresh);
+            t = owned.get();
+            table.store(t, std::memory_order_release);
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            if (s.ends[i].valid())
+                t->put(s.ends[i], s.ends[1 - i], now);
+        }
+    }
+
+    void unbind(uint64_t id, const relay_addr &addr)
+    {
+        auto it = sessions.find(id);
+        if (it == sessions.end())
+            return;
+        relay_table *t = table.load(std::memory_order_relaxed);
+        t->erase(addr);
+        owners.erase(addr);
+        for (auto &end : it->second.ends)
+        {
+            if (end == addr)
+                end = relay_addr{};
+        }
+        if (!it->second.ends[0].valid() && !it->second.ends[1].valid())
+            sessions.erase(it);
+        else
+            publish(it->second, now_s());
+    }
+
+    // 绑定 from 到会话的 end 一端，该端原有的地址被替换（成员 NAT 映射变化），返回会话已绑定的地址数，表满返回 0
+    uint16_t bind_session(uint64_t id, uint8_t end, const sockaddr_storage &from)
+    {
+        std::lock_guard<std::mutex> guard(bind_lock);
+        const auto addr = relay_addr::from(from);
+        const uint32_t now = now_s();
+        // 同一源地址换了会话（成员重新加入房间），先解除旧绑定
+        const auto owner = owners.find(addr);
+        if (owner != owners.end() && owner->second != id)
+            unbind(owner->second, addr);
+        relay_table *t = table.load(std::memory_order_relaxed);
+        if (owner == owners.end() && t->used + 2 > RELAY_TABLE_LIMIT / 2)
+            return 0;
+        auto &s = sessions[id];
+        if (!(s.ends[end] == addr))
+        {
+            // 同一地址改绑到另一端
+            if (s.ends[1 - end] == addr)
+            {
+                t->erase(addr);
+                s.ends[1 - end] = relay_addr{};
+            }
+            if (s.ends[end].valid())
+            {
+                t->erase(s.ends[end]);
+                owners.erase(s.ends[end]);
+            }
+            s.ends[end] = addr;
+            owners[addr] = id;
+        }
+        publish(s, now);
+        return static_cast<uint16_t>(s.ends[0].valid() + s.ends[1].valid());
+    }
+
+    // 源地址的 cookie：HMAC(cookie_key, 周期 | 源地址 | 会话 | 端)
+    void cookie_of(const relay_addr &addr, uint64_t session, uint8_t end, uint32_t period, uint8_t *out) const
+    {
+        uint8_t msg[4 + sizeof(addr.w) + 8 + 1];
+        memcpy(msg, &period, 4);
+        memcpy(msg + 4, addr.w, sizeof(addr.w));
+        memcpy(msg + 4 + sizeof(addr.w), &session, 8);
+        msg[sizeof(msg) - 1] = end;
+        uint8_t mac[32];
+        relay_hmac(cookie_key, sizeof(cookie_key), msg, sizeof(msg), mac);
+        memcpy(out, mac, RELAY_COOKIE_SIZE);
+    }
+
+    /**
+     * 处理绑定报文：令牌无效或过期时不应答；cookie 不符时回 cookie；两者都通过才绑定
+     * @return 应答长度，0 表示不应答
+     */
+    size_t bind_message(const uint8_t *data, size_t len, const sockaddr_storage &from, uint8_t *reply, uint64_t &rejected)
+    {
+        uint8_t copy[PUNCH_REQUEST_SIZE];
+        memcpy(copy, data, sizeof(copy));
+        copy[5] = PUNCH_REQUEST;
+        punch_message msg{};
+        // 与检查同头，借用请求的解码
+        if (len < RELAY_BIND_SIZE || !msg.decode(copy, sizeof(copy)) || msg.session == PUNCH_PROBE_SESSION || msg.pair > 1)
+        {
+            rejected++;
+            return 0;
+        }
+        const uint8_t end = static_cast<uint8_t>(msg.pair);
+        uint32_t expiry = 0;
+        for (int i = 0; i < 4; i++)
+            expiry = expiry << 8 | data[PUNCH_REQUEST_SIZE + i];
+        const auto unix_s = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(
+                                                      std::chrono::system_clock::now().time_since_epoch())
+                                                      .count());
+        uint8_t token[RELAY_TOKEN_SIZE];
+        relay_token(secret, msg.session, end, expiry, token);
+        if (expiry < unix_s || !relay_equal(token, data + 28, RELAY_TOKEN_SIZE))
+        {
+            rejected++;
+            return 0;
+        }
+        const auto addr = relay_addr::from(from);
+        const uint32_t period = now_s() / RELAY_COOKIE_S;
+        uint8_t cookie[RELAY_COOKIE_SIZE], previous[RELAY_COOKIE_SIZE];
+        cookie_of(addr, msg.session, end, period, cookie);
+        cookie_of(addr, msg.session, end, period - 1, previous);
+        if (!relay_equal(cookie, data + 44, RELAY_COOKIE_SIZE) && !relay_equal(previous, data + 44, RELAY_COOKIE_SIZE))
+        {
+            memcpy(reply, data, PUNCH_REQUEST_SIZE);
+            reply[5] = RELAY_COOKIE;
+            memcpy(reply + PUNCH_REQUEST_SIZE, cookie, RELAY_COOKIE_SIZE);
+            return RELAY_COOKIE_REPLY_SIZE;
+        }
+        const uint16_t count = bind_session(msg.session, end, from);
+        if (count == 0)
+            return 0;
+        punch_message ack{PUNCH_RESPONSE, count, msg.session, msg.nonce, unmapped(from)};
+        return ack.encode(reply);
+    }
+
+    void sweep()
+    {
+        std::lock_guard<std::mutex> guard(bind_lock);
+        const uint32_t now = now_s();
+        relay_table *t = table.load(std::memory_order_relaxed);
+        std::vector<std::pair<uint64_t, relay_addr>> idle;
+        for (const auto &[id, s] : sessions)
+        {
+            for (const auto &end : s.ends)
+            {
+                if (end.valid() && now - t->seen(end) > RELAY_IDLE_S)
+                    idle.emplace_back(id, end);
+            }
+        }
+        for (const auto &[id, end] : idle)
+            unbind(id, end);
+        retired.erase(std::remove_if(retired.begin(), retired.end(),
+                                     [now](const auto &r)
+                                     { return now - r.second >= RELAY_SWEEP_S; }),
+                      retired.end());
+    }
+
+    void sweep_loop()
+    {
+        auto next = std::chrono::steady_clock::now() + std::chrono::seconds(RELAY_SWEEP_S);
+        while (!stopping.load())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(RELAY_POLL_MS));
+            if (std::chrono::steady_clock::now() < next)
+                continue;
+            sweep();
+            next += std::chrono::seconds(RELAY_SWEEP_S);
+        }
+    }
+
+    // 控制报文：绑定与未绑定源地址的检查由中继应答，其余返回 false 按数据报文处理
+    bool control(const uint8_t *data, size_t len, const sockaddr_storage &from, bool bound, uint8_t *reply, size_t &reply_len,
+                 uint64_t &rejected)
+    {
+        if (len < PUNCH_REQUEST_SIZE || data[0] != static_cast<uint8_t>(PUNCH_MAGIC >> 24))
+            return false;
+        if (data[5] == RELAY_BIND)
+        {
+            reply_len = bind_message(data, len, from, reply, rejected);
+            return true;
+        }
+        punch_message msg{};
+        if (bound || !msg.decode(data, len) || msg.type != PUNCH_REQUEST)
+            return false;
+        punch_message ack{PUNCH_RESPONSE, msg.pair, msg.session, msg.nonce, unmapped(from)};
+        reply_len = ack.encode(reply);
+        return true;
+    }
+
+    void worker_loop(size_t index)
+    {
+        const int s = sockets[index];
+        counters &c = stats_[index];
+        std::vector<uint8_t> buffers(RELAY_BATCH * RELAY_MTU);
+        std::vector<uint8_t> replies(RELAY_BATCH * PUNCH_RESPONSE_SIZE);
+        mmsghdr in[RELAY_BATCH]{};
+        mmsghdr out[RELAY_BATCH]{};
+        iovec in_iov[RELAY_BATCH], out_iov[RELAY_BATCH];
+        sockaddr_storage from[RELAY_BATCH], to[RELAY_BATCH];
+        for (unsigned i = 0; i < RELAY_BATCH; i++)
+        {
+            in_iov[i] = {buffers.data() + i * RELAY_MTU, RELAY_MTU};
+            in[i].msg_hdr.msg_iov = &in_iov[i];
+            in[i].msg_hdr.msg_iovlen = 1;
+            in[i].msg_hdr.msg_name = &from[i];
+            out[i].msg_hdr.msg_iov = &out_iov[i];
+            out[i].msg_hdr.msg_iovlen = 1;
+            out[i].msg_hdr.msg_name = &to[i];
+        }
+        pollfd fd{s, POLLIN, 0};
+        while (!stopping.load(std::memory_order_relaxed))
+        {
+            for (unsigned i = 0; i < RELAY_BATCH; i++)
+                in[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+            int n = recvmmsg(s, in, RELAY_BATCH, MSG_DONTWAIT, nullptr);
+            if (n <= 0)
+            {
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    break;
+                poll(&fd, 1, RELAY_POLL_MS);
+                continue;
+            }
+            const uint32_t now = now_s();
+            relay_table *t = table.load(std::memory_order_acquire);
+            unsigned count = 0;
+            uint64_t bytes = 0, answered = 0, dropped = 0, rejected = 0;
+            for (int i = 0; i < n; i++)
+            {
+                const auto *data = static_cast<const uint8_t *>(in_iov[i].iov_base);
+                const size_t len = in[i].msg_len;
+                if ((in[i].msg_hdr.msg_flags & MSG_TRUNC) != 0)
+                {
+                    dropped++;
+                    continue;
+                }
+                relay_addr peer{};
+                const bool bound = t->lookup(relay_addr::from(from[i]), peer, now) && peer.valid();
+                size_t reply_len = 0;
+                uint8_t *reply = replies.data() + count * PUNCH_RESPONSE_SIZE;
+                if (control(data, len, from[i], bound, reply, reply_len, rejected))
+                {
+                    if (reply_len == 0)
+                        continue;
+                    to[count] = from[i];
+                    out[count].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+                    out_iov[count] = {reply, reply_len};
+                    count++;
+                    answered++;
+                    // 绑定可能替换了会话表，后续报文使用新表
+                    t = table.load(std::memory_order_acquire);
+                    continue;
+                }
+                if (!bound)
+                {
+                    dropped++;
+                    continue;
+                }
+                out[count].msg_hdr.msg_namelen = peer.to(to[count]);
+                out_iov[count] = {const_cast<uint8_t *>(data), len};
+                bytes += len;
+                count++;
+            }
+            unsigned sent = 0;
+            while (sent < count)
+            {
+                const int r = sendmmsg(s, out + sent, count - sent, 0);
+                if (r <= 0)
+                {
+                    // 发送缓冲满或对端不可达：丢弃当前报文，继续发送其余报文
+                    if (r < 0 && errno == EINTR)
+                        continue;
+                    dropped++;
+                    sent++;
+                    continue;
+                }
+                sent += static_cast<unsigned>(r);
+            }
+            c.received.fetch_add(static_cast<uint64_t>(n), std::memory_order_relaxed);
+            c.forwarded.fetch_add(count - answered, std::memory_order_relaxed);
+            c.bytes.fetch_add(bytes, std::memory_order_relaxed);
+            c.answered.fetch_add(answered, std::memory_order_relaxed);
+            c.dropped.fetch_add(dropped, std::memory_order_relaxed);
+            c.rejected.fetch_add(rejected, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    ~relay_daemon()
+    {
+        stop();
+    }
+
+    /**
+     * 在 port 上启动 workers 个工作线程，port 为 0 时由系统分配
+     * @param bind_secret 与信令服务器共享的 RELAY_SECRET_SIZE 字节密钥，用于校验绑定令牌
+     * @param pin 是否把第 i 个工作线程固定到第 i 个 CPU
+     * @return 是否成功
+     */
+    bool start(uint16_t port, size_t workers_count, const uint8_t *bind_secret, bool pin = false)
+    {
+        if (!sockets.empty() || workers_count == 0 || bind_secret == nullptr)
+            return false;
+        stopping.store(false);
+        memcpy(secret, bind_secret, sizeof(secret));
+        std::random_device rd;
+        for (auto &b : cookie_key)
+            b = static_cast<uint8_t>(rd());
+        epoch = std::chrono::steady_clock::now();
+        owned = std::make_unique<relay_table>(RELAY_TABLE_INITIAL);
+        table.store(owned.get());
+        family = AF_INET6;
+        int first = open_socket(port);
+        if (first < 0)
+        {
+            family = AF_INET;
+            first = open_socket(port);
+        }
+        if (first < 0)
+            return false;
+        sockaddr_storage local{};
+        socklen_t len = sizeof(local);
+        getsockname(first, reinterpret_cast<sockaddr *>(&local), &len);
+        bound_port = punch_port(local);
+        sockets.push_back(first);
+        while (sockets.size() < workers_count)
+        {
+            const int s = open_socket(bound_port);
+            if (s < 0)
+            {
+                stop();
+                return false;
+            }
+            sockets.push_back(s);
+        }
+        stats_.reset(new counters[workers_count]);
+        const unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < workers_count; i++)
+        {
+            workers.emplace_back(&relay_daemon::worker_loop, this, i);
+            if (pin)
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(i % cpus, &set);
+                pthread_setaffinity_np(workers.back().native_handle(), sizeof(set), &set);
+            }
+        }
+        sweeper = std::thread(&relay_daemon::sweep_loop, this);
+        return true;
+    }
+
+    void stop()
+    {
+        stopping.store(true);
+        for (auto &w : workers)
+            w.join();
+        workers.clear();
+        if (sweeper.joinable())
+            sweeper.join();
+        for (const int s : sockets)
+            close(s);
+        sockets.clear();
+        std::lock_guard<std::mutex> guard(bind_lock);
+        sessions.clear();
+        owners.clear();
+        retired.clear();
+    }
+
+    uint16_t port() const { return bound_port; }
+
+    relay_stats stats()
+    {
+        relay_stats out{};
+        for (size_t i = 0; i < sockets.size(); i++)
+        {
+            out.received += stats_[i].received.load(std::memory_order_relaxed);
+            out.forwarded += stats_[i].forwarded.load(std::memory_order_relaxed);
+            out.bytes += stats_[i].bytes.load(std::memory_order_relaxed);
+            out.answered += stats_[i].answered.load(std::memory_order_relaxed);
+            out.dropped += stats_[i].dropped.load(std::memory_order_relaxed);
+            out.rejected += stats_[i].rejected.load(std::memory_order_relaxed);
+        }
+        std::lock_guard<std::mutex> guard(bind_lock);
+        out.sessions = static_cast<uint32_t>(sessions.size());
+        if (const relay_table *t = table.load())
+            out.endpoints = static_cast<uint32_t>(t->used);
+        return out;
+    }
+
+    // 立即执行一次过期清理，now_offset_s 为模拟经过的时间，供自测使用
+    void sweep_now(uint32_t now_offset_s = 0)
+    {
+        skew_s.fetch_add(now_offset_s);
+        sweep();
+    }
+};
+
+/**
+ * 绑定报文：成员从 wg 端口发往中继，令牌由信令服务器下发。首次 cookie 传 nullptr，收到 RELAY_COOKIE 后带上 cookie 重发，
+ * 重发直到收到 PUNCH_RESPONSE，之后每个 keepalive 周期内有转发即可保持
+ */
+inline size_t relay_bind_message(uint64_t session, uint8_t end, uint32_t expiry, const uint8_t *token, const uint8_t *cookie,
+                                 uint64_t nonce, uint8_t *out)
+{
+    punch_message msg{PUNCH_REQUEST, end, session, nonce, {}};
+    msg.encode(out);
+    out[5] = RELAY_BIND;
+    for (int i = 0; i < 4; i++)
+        out[PUNCH_REQUEST_SIZE + i] = static_cast<uint8_t>(expiry >> (24 - 8 * i));
+    memcpy(out + 28, token, RELAY_TOKEN_SIZE);
+    if (cookie != nullptr)
+        memcpy(out + 44, cookie, RELAY_COOKIE_SIZE);
+    else
+        memset(out + 44, 0, RELAY_COOKIE_SIZE);
+    return RELAY_BIND_SIZE;
+}
+
+// 解析中继回的 cookie 报文，session 与 nonce 需与所发绑定一致
+inline bool relay_cookie_reply(const uint8_t *in, size_t len, uint64_t session, uint64_t nonce, uint8_t *cookie)
+{
+    if (len < RELAY_COOKIE_REPLY_SIZE || in[5] != RELAY_COOKIE)
+        return false;
+    uint8_t copy[PUNCH_REQUEST_SIZE];
+    memcpy(copy, in, sizeof(copy));
+    copy[5] = PUNCH_REQUEST;
+    punch_message msg{};
+    if (!msg.decode(copy, sizeof(copy)) || msg.session != session || msg.nonce != nonce)
+        return false;
+    memcpy(cookie, in + PUNCH_REQUEST_SIZE, RELAY_COOKIE_SIZE);
+    return true;
+}
+#endif
+
+#ifdef RELAY_DAEMON_MAIN
+// 守护进程：g++ -std=c++17 -O2 -DRELAY_DAEMON_MAIN -x c++ lib/relay_daemon.cpp -lpthread -o mole-relay && MOLE_RELAY_SECRET=<64 位十六进制> ./mole-relay 51821
+#include "csignal"
+#include "cstdio"
+#include "cstdlib"
+
+static std::atomic<bool> relay_exit{false};
+
+// 读取与信令服务器共享的绑定密钥，格式为 64 位十六进制
+static bool relay_secret(uint8_t *out)
+{
+    const char *hex = getenv("MOLE_RELAY_SECRET");
+    if (hex == nullptr || strlen(hex) != RELAY_SECRET_SIZE * 2)
+        return false;
+    for (size_t i = 0; i < RELAY_SECRET_SIZE; i++)
+    {
+        unsigned value = 0;
+        if (sscanf(hex + 2 * i, "%2x", &value) != 1)
+            return false;
+        out[i] = static_cast<uint8_t>(value);
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const uint16_t port = static_cast<uint16_t>(argc > 1 ? atoi(argv[1]) : 51821);
+    const size_t workers = argc > 2 ? static_cast<size_t>(atoi(argv[2])) : std::max(1u, std::thread::hardware_concurrency());
+    uint8_t secret[RELAY_SECRET_SIZE];
+    if (!relay_secret(secret))
+    {
+        fprintf(stderr, "relay: MOLE_RELAY_SECRET must be %zu hex chars\n", RELAY_SECRET_SIZE * 2);
+        return 1;
+    }
+    signal(SIGINT, [](int) { relay_exit.store(true); });
+    signal(SIGTERM, [](int) { relay_exit.store(true); });
+    relay_daemon daemon;
+    if (!daemon.start(port, workers, secret, true))
+    {
+        fprintf(stderr, "relay: listen on %u failed\n", port);
+        return 1;
+    }
+    fprintf(stderr, "relay: listening on %u with %zu workers\n", daemon.port(), workers);
+    auto last = daemon.stats();
+    while (!relay_exit.load())
+    {
+        for (int i = 0; i < 100 && !relay_exit.load(); i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        const auto now = daemon.stats();
+        fprintf(stderr, "relay: sessions %u endpoints %u forwarded %llu pps %llu dropped %llu rejected %llu\n", now.sessions,
+                now.endpoints, static_cast<unsigned long long>(now.forwarded),
+                static_cast<unsigned long long>((now.forwarded - last.forwarded) / 10), static_cast<unsigned long long>(now.dropped),
+                static_cast<unsigned long long>(now.rejected));
+        last = now;
+    }
+    daemon.stop();
+    return 0;
+}
+#endif
+
+#ifdef RELAY_DAEMON_SELFTEST
+// 本地自测与回环压测：bash lib/selftest.sh relay_daemon [秒数]
+#include "selftest_compat.h"
+#include "iostream"
+#include "cstdlib"
+#include "random"
+
+namespace relay_test
+{
+    struct client
+    {
+        int s = -1;
+        sockaddr_in relay{};
+
+        client(uint16_t port)
+        {
+            s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            sockaddr_in local{};
+            local.sin_family = AF_INET;
+            local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            bind(s, reinterpret_cast<const sockaddr *>(&local), sizeof(local));
+            int size = RELAY_SOCKET_BUFFER;
+            setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+            relay.sin_family = AF_INET;
+            relay.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            relay.sin_port = htons(port);
+        }
+
+        ~client() { close(s); }
+
+        uint16_t local_port() const
+        {
+            sockaddr_in addr{};
+            socklen_t len = sizeof(addr);
+            getsockname(s, reinterpret_cast<sockaddr *>(&addr), &len);
+            return ntohs(addr.sin_port);
+        }
+
+        void send(const void *data, size_t len) const
+        {
+            sendto(s, data, len, 0, reinterpret_cast<const sockaddr *>(&relay), sizeof(relay));
+        }
+
+        // 等待一个报文，超时返回 -1
+        int recv(uint8_t *buf, size_t cap, int timeout_ms) const
+        {
+            pollfd fd{s, POLLIN, 0};
+            if (poll(&fd, 1, timeout_ms) <= 0)
+                return -1;
+            return static_cast<int>(::recv(s, buf, cap, 0));
+        }
+
+        // 发送一个绑定报文并等待应答，返回应答长度，超时返回 -1
+        int bind_once(uint64_t session, uint8_t end, uint32_t expiry, const uint8_t *token, const uint8_t *cookie, uint64_t nonce,
+                      uint8_t *buf, size_t cap) const
+        {
+            uint8_t msg[RELAY_BIND_SIZE];
+            send(msg, relay_bind_message(session, end, expiry, token, cookie, nonce, msg));
+            return recv(buf, cap, 200);
+        }
+
+        // 以 secret 签发的令牌完成两步绑定，返回会话已绑定的地址数
+        int bind_to(uint64_t session, uint8_t end, const uint8_t *secret) const
+        {
+            const uint32_t expiry = unix_s() + 60;
+            uint8_t token[RELAY_TOKEN_SIZE], cookie[RELAY_COOKIE_SIZE], buf[RELAY_MTU];
+            relay_token(secret, session, end, expiry, token);
+            const uint8_t *with = nullptr;
+            for (int attempt = 0; attempt < 5; attempt++)
+            {
+                const uint64_t nonce = 7 + attempt;
+                const int n = bind_once(session, end, expiry, token, with, nonce, buf, sizeof(buf));
+                if (n > 0 && relay_cookie_reply(buf, static_cast<size_t>(n), session, nonce, cookie))
+                {
+                    with = cookie;
+                    continue;
+                }
+                punch_message ack{};
+                if (n > 0 && ack.decode(buf, static_cast<size_t>(n)) && ack.type == PUNCH_RESPONSE && ack.session == session)
+                    return ack.pair;
+            }
+            return 0;
+        }
+
+        static uint32_t unix_s()
+        {
+            return static_cast<uint32_t>(
+                std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+        }
+    };
+
+    // 自测使用的共享密钥
+    static const uint8_t test_secret[RELAY_SECRET_SIZE] = {'m', 'o', 'l', 'e', '-', 'r', 'e', 'l', 'a', 'y'};
+
+    inline int64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    struct load_result
+    {
+        double pps;
+        double p50_us;
+        double p99_us;
+        double loss;
+    };
+
+    /**
+     * 回环压测：pairs 对成员经中继单向发送 size 字节的报文，每对最多 RELAY_TEST_WINDOW 个在途报文（闭环，避免排队时延失真）
+     * 报文携带发送时间，接收端统计单向转发时延（含两次回环收发）
+     */
+    static constexpr unsigned RELAY_TEST_WINDOW = 16;
+
+    inline load_result load(size_t workers, size_t pairs, size_t generators, double seconds, size_t size)
+    {
+        relay_daemon daemon;
+        load_result out{};
+        if (!daemon.start(0, workers, test_secret))
+            return out;
+        std::vector<std::unique_ptr<client>> senders, receivers;
+        for (size_t i = 0; i < pairs; i++)
+        {
+            senders.push_back(std::make_unique<client>(daemon.port()));
+            receivers.push_back(std::make_unique<client>(daemon.port()));
+            senders.back()->bind_to(1000 + i, 0, test_secret);
+            receivers.back()->bind_to(1000 + i, 1, test_secret);
+        }
+        std::atomic<uint64_t> delivered{0}, sent_total{0};
+        std::vector<std::vector<uint32_t>> latencies(generators);
+        const int64_t warmup_end = now_ns() + 200'000'000;
+        const int64_t end = warmup_end + static_cast<int64_t>(seconds * 1e9);
+        std::vector<std::thread> threads;
+        for (size_t g = 0; g < generators; g++)
+        {
+            threads.emplace_back([&, g]
+                                 {
+                std::vector<size_t> mine;
+                for (size_t i = g; i < pairs; i += generators)
+                    mine.push_back(i);
+                std::vector<uint32_t> outstanding(mine.size(), 0);
+                std::vector<int64_t> progress(mine.size(), now_ns());
+                std::vector<uint8_t> tx(RELAY_TEST_WINDOW * size), rx(RELAY_BATCH * RELAY_MTU);
+                mmsghdr out_msgs[RELAY_TEST_WINDOW]{}, in_msgs[RELAY_BATCH]{};
+                iovec out_iov[RELAY_TEST_WINDOW], in_iov[RELAY_BATCH];
+                for (unsigned i = 0; i < RELAY_TEST_WINDOW; i++)
+                {
+                    out_iov[i] = {tx.data() + i * size, size};
+                    out_msgs[i].msg_hdr.msg_iov = &out_iov[i];
+                    out_msgs[i].msg_hdr.msg_iovlen = 1;
+                }
+                for (unsigned i = 0; i < RELAY_BATCH; i++)
+                {
+                    in_iov[i] = {rx.data() + i * RELAY_MTU, RELAY_MTU};
+                    in_msgs[i].msg_hdr.msg_iov = &in_iov[i];
+                    in_msgs[i].msg_hdr.msg_iovlen = 1;
+                }
+                // WireGuard 数据报文的首字节为 4，中继不应当作控制报文
+                for (unsigned i = 0; i < RELAY_TEST_WINDOW; i++)
+                    tx[i * size] = 4;
+                auto &samples = latencies[g];
+                uint64_t received = 0, sent = 0;
+                std::vector<pollfd> fds;
+                for (const size_t i : mine)
+                    fds.push_back({receivers[i]->s, POLLIN, 0});
+                for (;;)
+                {
+                    const int64_t now = now_ns();
+                    if (now >= end)
+                        break;
+                    for (size_t k = 0; k < mine.size(); k++)
+                    {
+                        // 丢包后窗口不再前进：一段时间无进展视为在途报文全部丢失
+                        if (outstanding[k] > 0 && now - progress[k] > 20'000'000)
+                        {
+                            outstanding[k] = 0;
+                            progress[k] = now;
+                        }
+                        const unsigned room = RELAY_TEST_WINDOW - outstanding[k];
+                        if (room == 0)
+                            continue;
+                        const auto &c = *senders[mine[k]];
+                        for (unsigned i = 0; i < room; i++)
+                        {
+                            memcpy(&tx[i * size + 8], &now, sizeof(now));
+                            out_msgs[i].msg_hdr.msg_name = const_cast<sockaddr_in *>(&c.relay);
+                            out_msgs[i].msg_hdr.msg_namelen = sizeof(c.relay);
+                        }
+                        const int n = sendmmsg(c.s, out_msgs, room, MSG_DONTWAIT);
+                        if (n > 0)
+                        {
+                            outstanding[k] += static_cast<unsigned>(n);
+                            sent += static_cast<uint64_t>(n);
+                        }
+                    }
+                    if (poll(fds.data(), fds.size(), 1) <= 0)
+                        continue;
+                    for (size_t k = 0; k < mine.size(); k++)
+                    {
+                        if ((fds[k].revents & POLLIN) == 0)
+                            continue;
+                        const int n = recvmmsg(fds[k].fd, in_msgs, RELAY_BATCH, MSG_DONTWAIT, nullptr);
+                        if (n <= 0)
+                            continue;
+                        const int64_t at = now_ns();
+                        for (int i = 0; i < n; i++)
+                        {
+                            int64_t stamp;
+                            memcpy(&stamp, rx.data() + i * RELAY_MTU + 8, sizeof(stamp));
+                            if (stamp >= warmup_end)
+                            {
+                                samples.push_back(static_cast<uint32_t>((at - stamp) / 1000));
+                                received++;
+                            }
+                        }
+                        outstanding[k] -= std::min(outstanding[k], static_cast<unsigned>(n));
+                        progress[k] = at;
+                    }
+                }
+                delivered.fetch_add(received);
+                sent_total.fetch_add(sent); });
+        }
+        for (auto &t : threads)
+            t.join();
+        std::vector<uint32_t> all;
+        for (const auto &l : latencies)
+            all.insert(all.end(), l.begin(), l.end());
+        std::sort(all.begin(), all.end());
+        const auto stats = daemon.stats();
+        daemon.stop();
+        out.pps = static_cast<double>(delivered.load()) / seconds;
+        if (!all.empty())
+        {
+            out.p50_us = all[all.size() / 2];
+            out.p99_us = all[std::min(all.size() - 1, all.size() * 99 / 100)];
+        }
+        out.loss = stats.received == 0 ? 0 : static_cast<double>(stats.dropped) / static_cast<double>(stats.received);
+        return out;
+    }
+
+    inline int run(double seconds)
+    {
+        uint8_t buf[RELAY_MTU];
+
+        // HMAC-SHA256 与 RFC 4231 测试向量 2 一致
+        {
+            const char *data = "what do ya want for nothing?";
+            uint8_t mac[32];
+            relay_hmac(reinterpret_cast<const uint8_t *>("Jefe"), 4, reinterpret_cast<const uint8_t *>(data), strlen(data), mac);
+            const uint8_t want[8] = {0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e};
+            const uint8_t tail[4] = {0x64, 0xec, 0x38, 0x43};
+            expect(memcmp(mac, want, sizeof(want)) == 0 && memcmp(mac + 28, tail, sizeof(tail)) == 0, "hmac-sha256 matches rfc 4231");
+        }
+
+        relay_daemon daemon;
+        const bool started = daemon.start(0, 2, test_secret);
+        expect(started, "start 2 workers on port " + std::to_string(daemon.port()));
+        client a(daemon.port()), b(daemon.port()), c(daemon.port()), d(daemon.port());
+
+        // 未绑定：检查由中继应答，数据报文丢弃
+        punch_message req{PUNCH_REQUEST, 3, PUNCH_PROBE_SESSION, 42, {}};
+        size_t len = req.encode(buf);
+        a.send(buf, len);
+        int n = a.recv(buf, sizeof(buf), 500);
+        punch_message reply{};
+        expect(n > 0 && reply.decode(buf, static_cast<size_t>(n)) && reply.type == PUNCH_RESPONSE && reply.nonce == 42 &&
+                   reply.mapped.ss_family == AF_INET && punch_port(reply.mapped) == a.local_port(),
+               "unbound check answered by the relay with the mapped address");
+        const uint8_t data[] = {4, 0, 0, 0, 'w', 'g'};
+        a.send(data, sizeof(data));
+        expect(b.recv(buf, sizeof(buf), 200) < 0, "unbound data dropped");
+
+        // 令牌：伪造、过期或换一端使用的令牌不应答
+        const uint64_t session = punch_session("relay-test");
+        const uint32_t expiry = client::unix_s() + 60;
+        uint8_t token[RELAY_TOKEN_SIZE], forged[RELAY_TOKEN_SIZE], expired[RELAY_TOKEN_SIZE];
+        relay_token(test_secret, session, 0, expiry, token);
+        const uint8_t wrong_secret[RELAY_SECRET_SIZE] = {'x'};
+        relay_token(wrong_secret, session, 0, expiry, forged);
+        relay_token(test_secret, session, 0, expiry - 120, expired);
+        expect(d.bind_once(session, 0, expiry, forged, nullptr, 1, buf, sizeof(buf)) < 0, "bind with a forged token ignored");
+        expect(d.bind_once(session, 0, expiry - 120, expired, nullptr, 1, buf, sizeof(buf)) < 0, "bind with an expired token ignored");
+        expect(d.bind_once(session, 1, expiry, token, nullptr, 1, buf, sizeof(buf)) < 0, "token only binds the end it was issued for");
+        expect(daemon.stats().rejected == 3, "rejected binds counted");
+
+        // cookie：有效令牌先换来 cookie，不绑定；另一源地址拿不到这个 cookie 的绑定
+        uint8_t cookie[RELAY_COOKIE_SIZE] = {};
+        n = d.bind_once(session, 0, expiry, token, nullptr, 9, buf, sizeof(buf));
+        expect(n > 0 && relay_cookie_reply(buf, static_cast<size_t>(n), session, 9, cookie) &&
+                   static_cast<size_t>(n) < RELAY_BIND_SIZE,
+               "valid token answered with a shorter cookie");
+        expect(daemon.stats().sessions == 0, "cookie round trip binds nothing");
+        uint8_t other[RELAY_COOKIE_SIZE];
+        n = a.bind_once(session, 0, expiry, token, cookie, 10, buf, sizeof(buf));
+        expect(n > 0 && relay_cookie_reply(buf, static_cast<size_t>(n), session, 10, other) && daemon.stats().sessions == 0,
+               "cookie issued to another address does not bind");
+
+        // 绑定同一会话两端后双向转发
+        expect(a.bind_to(session, 0, test_secret) == 1, "first end bound");
+        expect(b.bind_to(session, 1, test_secret) == 2, "second end bound");
+        a.send(data, sizeof(data));
+        n = b.recv(buf, sizeof(buf), 500);
+        expect(n == sizeof(data) && memcmp(buf, data, sizeof(data)) == 0, "a -> b forwarded unchanged");
+        b.send(data, sizeof(data));
+        n = a.recv(buf, sizeof(buf), 500);
+        expect(n == sizeof(data), "b -> a forwarded");
+        d.send(data, sizeof(data));
+        expect(a.recv(buf, sizeof(buf), 100) < 0 && b.recv(buf, sizeof(buf), 100) < 0, "unbound source cannot inject into the session");
+
+        // 已绑定：检查原样转发给对方，路径探测测的是到对方的时延
+        len = req.encode(buf);
+        a.send(buf, len);
+        n = b.recv(buf, sizeof(buf), 500);
+        expect(n == static_cast<int>(PUNCH_REQUEST_SIZE) && reply.decode(buf, static_cast<size_t>(n)) && reply.type == PUNCH_REQUEST,
+               "bound check forwarded to the peer");
+        expect(a.recv(buf, sizeof(buf), 100) < 0, "bound check not answered by the relay");
+
+        // a 换了地址（c）用同一端的令牌重新绑定：替换 a，b 的报文转到 c
+        expect(c.bind_to(session, 0, test_secret) == 2, "rebinding the same end from a new address keeps the pair");
+        b.send(data, sizeof(data));
+        expect(c.recv(buf, sizeof(buf), 500) == sizeof(data), "traffic follows the rebound end");
+        expect(a.recv(buf, sizeof(buf), 100) < 0, "replaced end no longer receives");
+        auto stats = daemon.stats();
+        expect(stats.sessions == 1 && stats.endpoints == 2, "one session with two ends");
+
+        // 同一地址绑定到另一会话：离开旧会话
+        expect(b.bind_to(session + 1, 0, test_secret) == 1, "end moved to a new session");
+        c.send(data, sizeof(data));
+        expect(b.recv(buf, sizeof(buf), 200) < 0, "old session no longer reaches the moved end");
+
+        // 过期清理
+        daemon.sweep_now(RELAY_IDLE_S + 1);
+        stats = daemon.stats();
+        expect(stats.sessions == 0 && stats.endpoints == 0, "idle sessions expire");
+
+        // 大量会话触发会话表重建与扩容
+        std::vector<std::unique_ptr<client>> many;
+        bool all_bound = true;
+        for (int i = 0; i < 1200; i++)
+        {
+            many.push_back(std::make_unique<client>(daemon.port()));
+            all_bound = all_bound && many.back()->bind_to(5000 + i / 2, static_cast<uint8_t>(i % 2), test_secret) == 1 + i % 2;
+        }
+        many[0]->send(data, sizeof(data));
+        stats = daemon.stats();
+        expect(all_bound && stats.sessions == 600 && stats.endpoints == 1200 && many[1]->recv(buf, sizeof(buf), 500) == sizeof(data),
+               "1200 ends bound across table growth");
+        many.clear();
+        daemon.stop();
+
+        // 无锁读：多个写线程（按 bind_lock 的方式串行）在限定时间内不停改写对端与删除，
+        // 读端校验从未读到写了一半的槽（对端地址由键与版本推出）
+        {
+            relay_table table(256);
+            std::mutex writer_lock;
+            std::atomic<bool> done{false};
+            std::atomic<uint64_t> torn{0}, reads{0}, writes{0};
+            const auto key_of = [](uint64_t i)
+            { return relay_addr{{AF_INET | (i << 16), i * 7919, 0}}; };
+            const auto peer_of = [](const relay_addr &k, uint64_t v)
+            { return relay_addr{{AF_INET | (v << 16), k.w[1] ^ v, v}}; };
+            for (uint64_t i = 0; i < 64; i++)
+                table.put(key_of(i), peer_of(key_of(i), 0), 1);
+            std::vector<std::thread> threads;
+            const size_t cpus = std::max(2u, std::thread::hardware_concurrency());
+            const size_t readers = std::max<size_t>(2, cpus / 2), writers = 2;
+            for (size_t r = 0; r < readers; r++)
+            {
+                threads.emplace_back([&]
+                                     {
+                    uint64_t local = 0, bad = 0;
+                    while (!done.load(std::memory_order_relaxed))
+                    {
+                        for (uint64_t i = 0; i < 64; i++)
+                        {
+                            relay_addr p{};
+                            if (table.lookup(key_of(i), p, 1))
+                            {
+                                bad += p.w[1] != (key_of(i).w[1] ^ p.w[2]) || (p.w[0] >> 16) != p.w[2];
+                                local++;
+                            }
+                        }
+                    }
+                    reads.fetch_add(local);
+                    torn.fetch_add(bad); });
+            }
+            for (size_t w = 0; w < writers; w++)
+            {
+                threads.emplace_back([&, w]
+                                     {
+                    uint64_t local = 0;
+                    for (uint64_t v = 1 + w; !done.load(std::memory_order_relaxed); v += writers)
+                    {
+                        const auto k = key_of(v % 64);
+                        std::lock_guard<std::mutex> guard(writer_lock);
+                        if (v % 5 == 0)
+                            table.erase(k);
+                        table.put(k, peer_of(k, v & 0xFFFF), 1);
+                        local++;
+                    }
+                    writes.fetch_add(local); });
+            }
+            const double torn_seconds = std::max(0.5, seconds / 2);
+            std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int64_t>(torn_seconds * 1000)));
+            done.store(true);
+            for (auto &t : threads)
+                t.join();
+            char line[160];
+            snprintf(line, sizeof(line), "lock-free reads never torn (%llu reads, %llu writes from %zu writers in %.1fs)",
+                     static_cast<unsigned long long>(reads.load()), static_cast<unsigned long long>(writes.load()), writers, torn_seconds);
+            expect(torn.load() == 0 && reads.load() > 100000 && writes.load() > 100000, line);
+        }
+
+        // 回环压测：1 到 N 个工作线程
+        const size_t cpus = std::max(1u, std::thread::hardware_concurrency());
+        double base = 0;
+        for (size_t workers = 1; workers <= std::max<size_t>(2, cpus); workers *= 2)
+        {
+            const auto r = load(workers, 16, std::max<size_t>(1, workers), seconds, 148);
+            if (workers == 1)
+                base = r.pps;
+            char line[160];
+            snprintf(line, sizeof(line), "load %zu workers: %.0f pps, p50 %.0fus, p99 %.0fus, drop %.2f%%, scaling %.2fx (%zu cpus)",
+                     workers, r.pps, r.p50_us, r.p99_us, r.loss * 100, base > 0 ? r.pps / base : 0, cpus);
+            expect(r.pps > 0, line);
+        }
+        return selftest_result();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    return relay_test::run(argc > 1 ? atof(argv[1]) : 2.0);
+}
+#endif
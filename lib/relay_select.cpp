@@ -0,0 +1,419 @@
+#include "hole_punch.cpp"
+#include "algorithm"
+#include "random"
+#include "vector"
+#include "chrono"
+
+#pragma once
+
+// 每个中继的探测次数与间隔(ms)，所有中继并发探测
+static constexpr uint32_t RELAY_PROBE_COUNT = 10;
+static constexpr uint32_t RELAY_PROBE_INTERVAL_MS = 100;
+// 最后一轮探测发出后等待应答的时长(ms)
+static constexpr uint32_t RELAY_PROBE_WAIT_MS = 1000;
+// 单次测量的候选中继上限
+static constexpr size_t RELAY_CANDIDATE_LIMIT = 16;
+// 丢包折算为时延的代价(ms)：成员对经中继的丢包率 × 该值计入往返时延
+static constexpr double RELAY_LOSS_COST_MS = 250;
+// 重新评估时新中继的代价需低于当前中继的该比例才更换，避免成员加入时来回更换
+static constexpr double RELAY_SWITCH_RATIO = 0.9;
+// 不可达中继的往返时延
+static constexpr uint32_t RELAY_UNREACHABLE = 0xFFFFFFFF;
+
+// 中继选择目标
+enum relay_objective : int
+{
+    RELAY_MINIMAX = 0, // 最差成员对的往返时延最小
+    RELAY_MIN_SUM = 1, // 全部成员对的往返时延之和最小
+};
+
+// 导出给调用方的本端到单个中继的测量结果，调用方按 16 字节步长解析
+#pragma pack(push, 8)
+struct relay_measure
+{
+    uint32_t rtt_us;     // 中位往返时延，不可达为 RELAY_UNREACHABLE
+    uint32_t min_rtt_us; // 最小往返时延
+    uint16_t loss;       // 丢包率（千分比）
+    uint16_t sent;
+    uint16_t received;
+    uint16_t reserved;
+};
+
+// 中继选择结果，调用方按 16 字节解析
+struct relay_choice
+{
+    int32_t relay;     // 选中的中继下标，-1 表示没有全部成员都可达的中继
+    uint32_t worst_us; // 最差成员对经该中继的往返时延（含丢包代价）
+    uint64_t total_us; // 全部成员对经该中继的往返时延之和（含丢包代价）
+};
+#pragma pack(pop)
+static_assert(sizeof(relay_measure) == 16, "relay_measure layout changed");
+static_assert(sizeof(relay_choice) == 16, "relay_choice layout changed");
+
+/**
+ * 本端到各候选中继的往返时延与丢包测量，中继为任意应答打洞检查的节点（反射器、打洞引擎）
+ * 每个中继按 RELAY_PROBE_INTERVAL_MS 发送 RELAY_PROBE_COUNT 个检查，全部中继并发。
+ * 同步执行，耗时约 RELAY_PROBE_COUNT × RELAY_PROBE_INTERVAL_MS + RELAY_PROBE_WAIT_MS，调用方应在工作线程中调用
+ */
+class relay_prober
+{
+    struct outstanding
+    {
+        size_t relay;
+        uint64_t nonce;
+        std::chrono::steady_clock::time_point sent;
+    };
+
+    punch_socket v4 = PUNCH_INVALID_SOCKET;
+    punch_socket v6 = PUNCH_INVALID_SOCKET;
+    std::mt19937_64 rng{std::random_device{}()};
+
+    punch_socket socket_for(int family)
+    {
+        auto &s = family == AF_INET6 ? v6 : v4;
+        if (s == PUNCH_INVALID_SOCKET)
+            s = punch_open(family, 0);
+        return s;
+    }
+
+public:
+    ~relay_prober()
+    {
+        if (v4 != PUNCH_INVALID_SOCKET)
+            punch_close(v4);
+        if (v6 != PUNCH_INVALID_SOCKET)
+            punch_close(v6);
+    }
+
+    // 测量全部候选，结果与 relays 一一对应
+    std::vector<relay_measure> measure(const std::vector<sockaddr_storage> &relays)
+    {
+        std::vector<relay_measure> out(relays.size());
+        std::vector<std::vector<uint32_t>> rtts(relays.size());
+        std::vector<outstanding> pending;
+        const auto start = std::chrono::steady_clock::now();
+        const auto deadline = start + std::chrono::milliseconds(RELAY_PROBE_INTERVAL_MS * (RELAY_PROBE_COUNT - 1) + RELAY_PROBE_WAIT_MS);
+        auto next_round = start;
+        uint32_t rounds = 0;
+        uint8_t buf[512];
+        while (true)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= deadline || (rounds == RELAY_PROBE_COUNT && pending.empty()))
+                break;
+            if (rounds < RELAY_PROBE_COUNT && now >= next_round)
+            {
+                for (size_t i = 0; i < relays.size(); i++)
+                {
+                    const auto s = socket_for(relays[i].ss_family);
+                    if (s == PUNCH_INVALID_SOCKET)
+                        continue;
+                    punch_message req{PUNCH_REQUEST, 0, PUNCH_PROBE_SESSION, rng(), {}};
+                    const size_t len = req.encode(buf);
+                    sendto(s, reinterpret_cast<const char *>(buf), static_cast<int>(len), 0,
+                           reinterpret_cast<const sockaddr *>(&relays[i]), punch_addr_len(relays[i]));
+                    pending.push_back({i, req.nonce, now});
+                    out[i].sent++;
+                }
+                rounds++;
+                next_round = now + std::chrono::milliseconds(RELAY_PROBE_INTERVAL_MS);
+            }
+            pollfd fds[2];
+            size_t n = 0;
+            for (const auto s : {v4, v6})
+            {
+                if (s != PUNCH_INVALID_SOCKET)
+                    fds[n++] = {s, POLLIN, 0};
+            }
+            const auto wake = rounds < RELAY_PROBE_COUNT && next_round < deadline ? next_round : deadline;
+            if (n == 0 || punch_poll(fds, n, punch_wait_ms(wake, now, RELAY_PROBE_INTERVAL_MS)) <= 0)
+                continue;
+            now = std::chrono::steady_clock::now();
+            for (size_t k = 0; k < n; k++)
+            {
+                if ((fds[k].revents & POLLIN) == 0)
+                    continue;
+                sockaddr_storage from{};
+                socklen_t from_len = sizeof(from);
+                const auto len = recvfrom(fds[k].fd, reinterpret_cast<char *>(buf), sizeof(buf), 0,
+                                          reinterpret_cast<sockaddr *>(&from), &from_len);
+                punch_message reply{};
+                if (len <= 0 || !reply.decode(buf, static_cast<size_t>(len)) || reply.type != PUNCH_RESPONSE)
+                    continue;
+                for (size_t p = 0; p < pending.size(); p++)
+                {
+                    if (pending[p].nonce != reply.nonce || !punch_same_addr(relays[pending[p].relay], from))
+                        continue;
+                    const auto us = std::chrono::duration_cast<std::chrono::microseconds>(now - pending[p].sent).count();
+                    rtts[pending[p].relay].push_back(static_cast<uint32_t>(us));
+                    pending.erase(pending.begin() + static_cast<ptrdiff_t>(p));
+                    break;
+                }
+            }
+        }
+        for (size_t i = 0; i < relays.size(); i++)
+        {
+            auto &m = out[i];
+            auto &r = rtts[i];
+            m.received = static_cast<uint16_t>(r.size());
+            m.loss = m.sent == 0 ? 1000 : static_cast<uint16_t>((m.sent - m.received) * 1000 / m.sent);
+            m.rtt_us = m.min_rtt_us = RELAY_UNREACHABLE;
+            if (r.empty())
+                continue;
+            std::sort(r.begin(), r.end());
+            m.rtt_us = r[r.size() / 2];
+            m.min_rtt_us = r.front();
+        }
+        return out;
+    }
+};
+
+/**
+ * 成员 a、b 经中继往返时延：两端到中继的往返时延之和，加上两段合成丢包率的代价
+ * 任一端不可达返回 RELAY_UNREACHABLE
+ */
+inline uint64_t relay_pair_cost(uint32_t rtt_a, uint16_t loss_a, uint32_t rtt_b, uint16_t loss_b)
+{
+    if (rtt_a == RELAY_UNREACHABLE || rtt_b == RELAY_UNREACHABLE)
+        return RELAY_UNREACHABLE;
+    const double delivered = (1 - loss_a / 1000.0) * (1 - loss_b / 1000.0);
+    return static_cast<uint64_t>(rtt_a) + rtt_b + static_cast<uint64_t>((1 - delivered) * RELAY_LOSS_COST_MS * 1000);
+}
+
+/**
+ * 按全部成员到全部中继的测量矩阵选择中继
+ * @param rtt_us 成员 m 到中继 r 的往返时延位于 rtt_us[m * relays + r]，RELAY_UNREACHABLE 表示不可达
+ * @param loss 同布局的丢包率（千分比），可为空
+ * @param current 当前使用的中继下标，-1 表示尚未选择；新中继的代价不低于当前的 RELAY_SWITCH_RATIO 时保留当前中继
+ * 只有一个成员时以其到中继的往返时延作为代价；有成员不可达的中继不参与选择
+ */
+inline relay_choice select_relay(const uint32_t *rtt_us, const uint16_t *loss, size_t members, size_t relays,
+                                 relay_objective objective, int32_t current)
+{
+    std::vector<relay_choice> costs(relays);
+    for (size_t r = 0; r < relays; r++)
+    {
+        auto &c = costs[r];
+        c.relay = static_cast<int32_t>(r);
+        const auto rtt = [&](size_t m)
+        { return rtt_us[m * relays + r]; };
+        const auto lost = [&](size_t m) -> uint16_t
+        { return loss == nullptr ? 0 : loss[m * relays + r]; };
+        for (size_t m = 0; m < members && c.relay >= 0; m++)
+        {
+            if (rtt(m) == RELAY_UNREACHABLE)
+                c.relay = -1;
+        }
+        if (c.relay < 0 || members == 0)
+        {
+            c.relay = -1;
+            continue;
+        }
+        if (members == 1)
+        {
+            c.worst_us = static_cast<uint32_t>(relay_pair_cost(rtt(0), lost(0), 0, 0));
+            c.total_us = c.worst_us;
+            continue;
+        }
+        for (size_t a = 0; a < members; a++)
+        {
+            for (size_t b = a + 1; b < members; b++)
+            {
+                const auto pair = relay_pair_cost(rtt(a), lost(a), rtt(b), lost(b));
+                c.worst_us = std::max(c.worst_us, static_cast<uint32_t>(std::min<uint64_t>(pair, RELAY_UNREACHABLE - 1)));
+                c.total_us += pair;
+            }
+        }
+    }
+    // 按目标比较，相同时比较另一项，再按下标
+    const auto key = [objective](const relay_choice &c)
+    {
+        return objective == RELAY_MIN_SUM ? std::make_pair(c.total_us, static_cast<uint64_t>(c.worst_us))
+                                          : std::make_pair(static_cast<uint64_t>(c.worst_us), c.total_us);
+    };
+    relay_choice best{-1, 0, 0};
+    for (const auto &c : costs)
+    {
+        if (c.relay >= 0 && (best.relay < 0 || key(c) < key(best)))
+            best = c;
+    }
+    if (current >= 0 && static_cast<size_t>(current) < relays && costs[current].relay >= 0 && best.relay != current)
+    {
+        const auto kept = key(costs[current]).first;
+        if (static_cast<double>(key(best).first) >= kept * RELAY_SWITCH_RATIO)
+            best = costs[current];
+    }
+    return best;
+}
+
+#ifdef RELAY_SELECT_SELFTEST
+// 本地自测：bash lib/selftest.sh relay_select
+#include "selftest_compat.h"
+#include "iostream"
+#include "cmath"
+
+namespace relay_test
+{
+    /**
+     * 合成时延矩阵：成员与中继分布在平面上，往返时延 = 距离 × 每单位时延 + 接入时延
+     * 坐标单位约为 100km，每单位约 1ms 往返
+     */
+    struct world
+    {
+        struct point
+        {
+            double x, y;
+        };
+        std::vector<point> members;
+        std::vector<point> relays;
+        std::vector<uint16_t> loss;
+        uint32_t access_us = 5000;
+
+        std::vector<uint32_t> matrix() const
+        {
+            std::vector<uint32_t> out;
+            for (const auto &m : members)
+            {
+                for (const auto &r : relays)
+                    out.push_back(access_us + static_cast<uint32_t>(std::hypot(m.x - r.x, m.y - r.y) * 1000));
+            }
+            return out;
+        }
+
+        relay_choice select(relay_objective objective, int32_t current = -1) const
+        {
+            const auto m = matrix();
+            return select_relay(m.data(), loss.empty() ? nullptr : loss.data(), members.size(), relays.size(), objective, current);
+        }
+    };
+
+    // 不依赖 select_relay 的暴力校验：目标值不大于任何可用中继
+    inline bool optimal(const std::vector<uint32_t> &rtt, size_t members, size_t relays, relay_objective objective, const relay_choice &c)
+    {
+        for (size_t r = 0; r < relays; r++)
+        {
+            uint64_t worst = 0, total = 0;
+            bool ok = true;
+            for (size_t a = 0; a < members; a++)
+            {
+                ok = ok && rtt[a * relays + r] != RELAY_UNREACHABLE;
+                for (size_t b = a + 1; b < members && ok; b++)
+                {
+                    const uint64_t pair = static_cast<uint64_t>(rtt[a * relays + r]) + rtt[b * relays + r];
+                    worst = std::max(worst, pair);
+                    total += pair;
+                }
+            }
+            if (!ok)
+                continue;
+            if (members == 1)
+                worst = total = rtt[r];
+            if (c.relay < 0)
+                return false;
+            if (objective == RELAY_MINIMAX ? worst < c.worst_us : total < c.total_us)
+                return false;
+        }
+        return true;
+    }
+
+    inline int run()
+    {
+        {
+            // 东西两组成员，中继在东、西与中部：最差成员对最小的是中部
+            world w;
+            w.relays = {{0, 0}, {100, 0}, {50, 0}};
+            w.members = {{0, 1}, {2, 0}, {100, 1}, {98, 0}};
+            const auto c = w.select(RELAY_MINIMAX);
+            expect(c.relay == 2, "split room picks middle relay, worst " + std::to_string(c.worst_us / 1000) + "ms");
+        }
+        {
+            // 多数成员在东部、一名在远处：求和偏向东部中继，最差成员对偏向中部
+            world w;
+            w.relays = {{0, 0}, {60, 0}};
+            w.members = {{0, 0}, {1, 0}, {0, 1}, {1, 1}, {120, 0}};
+            const auto sum = w.select(RELAY_MIN_SUM);
+            const auto minimax = w.select(RELAY_MINIMAX);
+            expect(sum.relay == 0 && minimax.relay == 1, "objectives differ: sum " + std::to_string(sum.relay) + " minimax " + std::to_string(minimax.relay));
+        }
+        {
+            // 最近的中继对某个成员不可达：排除
+            world w;
+            w.relays = {{0, 0}, {30, 0}};
+            w.members = {{0, 0}, {5, 0}};
+            auto m = w.matrix();
+            m[1 * 2 + 0] = RELAY_UNREACHABLE;
+            const auto c = select_relay(m.data(), nullptr, 2, 2, RELAY_MINIMAX, -1);
+            m[0 * 2 + 1] = RELAY_UNREACHABLE;
+            const auto none = select_relay(m.data(), nullptr, 2, 2, RELAY_MINIMAX, -1);
+            expect(c.relay == 1 && none.relay == -1, "unreachable relay excluded");
+        }
+        {
+            // 时延低但丢包 30% 的中继不如稍远的无丢包中继
+            world w;
+            w.relays = {{0, 0}, {20, 0}};
+            w.members = {{0, 0}, {2, 0}};
+            w.loss = {300, 0, 300, 0};
+            expect(w.select(RELAY_MINIMAX).relay == 1, "lossy relay avoided");
+        }
+        {
+            // 成员陆续加入西部：差距小时保留当前中继，差距明显时更换
+            world w;
+            w.relays = {{0, 0}, {100, 0}};
+            w.members = {{0, 0}, {10, 0}};
+            int32_t current = w.select(RELAY_MIN_SUM).relay;
+            const bool east = current == 0;
+            w.members.push_back({100, 0});
+            w.members.push_back({95, 0});
+            current = w.select(RELAY_MIN_SUM, current).relay;
+            const bool kept = current == 0;
+            w.members.push_back({100, 2});
+            w.members.push_back({99, 1});
+            current = w.select(RELAY_MIN_SUM, current).relay;
+            expect(east && kept && current == 1, "re-evaluation on join with hysteresis");
+        }
+        {
+            // 随机矩阵：与暴力计算比较
+            std::mt19937 rng(7);
+            bool all = true;
+            for (int round = 0; round < 500; round++)
+            {
+                const size_t members = 1 + rng() % 12, relays = 1 + rng() % 8;
+                std::vector<uint32_t> m(members * relays);
+                for (auto &v : m)
+                    v = rng() % 20 == 0 ? RELAY_UNREACHABLE : 1000 + rng() % 300000;
+                for (const auto objective : {RELAY_MINIMAX, RELAY_MIN_SUM})
+                {
+                    const auto c = select_relay(m.data(), nullptr, members, relays, objective, -1);
+                    all = all && optimal(m, members, relays, objective, c);
+                }
+            }
+            expect(all, "random matrices match brute force");
+        }
+        {
+            // 回环测量：两个应答节点与一个黑洞地址
+            punch_engine a, b;
+            a.start(0, nullptr);
+            b.start(0, nullptr);
+            std::vector<sockaddr_storage> relays;
+            for (const auto &text : {"127.0.0.1:" + std::to_string(a.port()), "127.0.0.1:" + std::to_string(b.port()), std::string("192.0.2.1:9")})
+            {
+                punch_candidate c{};
+                parse_candidate(text, c);
+                relays.push_back(c.addr);
+            }
+            const auto start = std::chrono::steady_clock::now();
+            const auto m = relay_prober().measure(relays);
+            const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            const bool reachable = m[0].received == RELAY_PROBE_COUNT && m[1].loss == 0 && m[0].rtt_us < 50000;
+            const bool dead = m[2].rtt_us == RELAY_UNREACHABLE && m[2].loss == 1000;
+            expect(reachable && dead, "loopback measure in " + std::to_string(ms) + "ms, rtt " + std::to_string(m[0].rtt_us) + "us");
+        }
+        return selftest_result();
+    }
+}
+
+int main()
+{
+    return relay_test::run();
+}
+#endif
@@ -0,0 +1,303 @@
+#ifdef _WIN32
+#include "src/wireguard.h"
+#include "wireguard_tool.cpp"
+#else
+#include "selftest_compat.h"
+#endif
+#include "mutex"
+#include "condition_variable"
+#include "thread"
+#include "functional"
+#include "vector"
+#include "string"
+#include "chrono"
+
+#pragma once
+
+// 分阶段计时，lap 返回距上次 lap 的微秒数
+class stage_clock
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point last = start;
+
+public:
+    uint32_t lap()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        const auto us = std::chrono::duration_cast<std::chrono::microseconds>(now - last).count();
+        last = now;
+        return static_cast<uint32_t>(us);
+    }
+
+    uint32_t total() const
+    {
+        return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                                         std::chrono::steady_clock::now() - start)
+                                         .count());
+    }
+};
+
+// 单个房间流水线的步骤数上限
+static constexpr size_t PIPELINE_STEP_LIMIT = 8;
+// 步骤名长度上限（含结尾 0）
+static constexpr size_t PIPELINE_NAME_LENGTH = 16;
+
+enum step_status
+{
+    STEP_PENDING = 0,
+    STEP_OK = 1,
+    STEP_FAILED = 2,
+    STEP_SKIPPED = 3,     // 依赖失败未执行
+    STEP_ROLLED_BACK = 4, // 已执行成功，因其他步骤失败已回滚
+};
+
+// 单个步骤的时间线，时间为相对流水线开始的微秒数，调用方按 28 字节步长解析
+#pragma pack(push, 4)
+struct step_timeline
+{
+    char name[PIPELINE_NAME_LENGTH];
+    uint32_t start_us;
+    uint32_t end_us;
+    int32_t status;
+};
+#pragma pack(pop)
+static_assert(sizeof(step_timeline) == 28, "step_timeline layout changed");
+
+/**
+ * 按依赖关系执行的步骤图
+ * 依赖全部完成的步骤并发执行，互不依赖的步骤（如 IP 与路由设置、广播捕获句柄重开）同时进行。
+ * 任一步骤失败后不再启动新步骤，等待执行中的步骤结束，再按完成的逆序回滚已成功的步骤
+ */
+class step_graph
+{
+    struct step
+    {
+        std::string name;
+        std::vector<size_t> deps;
+        std::function<bool()> run;
+        std::function<void()> rollback;
+        step_status status = STEP_PENDING;
+        bool started = false;
+        uint32_t start_us = 0;
+        uint32_t end_us = 0;
+    };
+
+    std::vector<step> steps;
+    std::vector<size_t> done_order;
+    std::mutex lock;
+    std::condition_variable cv;
+    stage_clock clock;
+    uint32_t elapsed_us = 0;
+
+    bool ready(const step &s) const
+    {
+        for (const auto d : s.deps)
+        {
+            if (steps[d].status != STEP_OK)
+                return false;
+        }
+        return true;
+    }
+
+public:
+    // 添加步骤，deps 只能引用已添加的步骤，返回步骤编号
+    size_t add(const char *name, std::vector<size_t> deps, std::function<bool()> run, std::function<void()> rollback = nullptr)
+    {
+        step s;
+        s.name = name;
+        s.deps = std::move(deps);
+        s.run = std::move(run);
+        s.rollback = std::move(rollback);
+        steps.push_back(std::move(s));
+        return steps.size() - 1;
+    }
+
+    // 执行全部步骤，全部成功返回 true，失败时已回滚
+    bool execute()
+    {
+        std::vector<std::thread> workers;
+        std::unique_lock<std::mutex> guard(lock);
+        size_t completed = 0;
+        bool failed = false;
+        while (true)
+        {
+            for (size_t i = 0; i < steps.size() && !failed; i++)
+            {
+                auto &s = steps[i];
+                if (s.started || !ready(s))
+                    continue;
+                s.started = true;
+                s.start_us = clock.total();
+                workers.emplace_back([this, i, &completed]
+                                     {
+                    const bool ok = steps[i].run();
+                    std::lock_guard<std::mutex> g(lock);
+                    steps[i].end_us = clock.total();
+                    steps[i].status = ok ? STEP_OK : STEP_FAILED;
+                    if (ok)
+                        done_order.push_back(i);
+                    completed++;
+                    cv.notify_all(); });
+            }
+            if (completed == workers.size())
+                break;
+            const size_t seen = completed;
+            cv.wait(guard, [&]
+                    { return completed > seen; });
+            for (const auto &s : steps)
+            {
+                if (s.status == STEP_FAILED)
+                    failed = true;
+            }
+        }
+        guard.unlock();
+        for (auto &w : workers)
+            w.join();
+        elapsed_us = clock.total();
+
+        for (auto &s : steps)
+        {
+            if (!s.started)
+                s.status = STEP_SKIPPED;
+        }
+        if (!failed)
+            return true;
+        for (auto it = done_order.rbegin(); it != done_order.rend(); ++it)
+        {
+            auto &s = steps[*it];
+            if (s.rollback)
+                s.rollback();
+            s.status = STEP_ROLLED_BACK;
+        }
+        return false;
+    }
+
+    // 输出时间线，返回步骤数
+    size_t timeline(step_timeline *out, size_t max) const
+    {
+        for (size_t i = 0; i < steps.size() && i < max; i++)
+        {
+            memset(&out[i], 0, sizeof(step_timeline));
+            strncpy_s(out[i].name, steps[i].name.c_str(), _TRUNCATE);
+            out[i].start_us = steps[i].start_us;
+            out[i].end_us = steps[i].end_us;
+            out[i].status = steps[i].status;
+        }
+        return steps.size();
+    }
+
+    // 单个步骤耗时(us)
+    uint32_t duration(size_t idx) const
+    {
+        return steps[idx].end_us - steps[idx].start_us;
+    }
+
+    // 流水线总耗时(us)，不含回滚
+    uint32_t total() const
+    {
+        return elapsed_us;
+    }
+
+    // 日志用的单行时间线
+    std::string describe() const
+    {
+        static const char *status_names[] = {"pending", "ok", "failed", "skipped", "rolled back"};
+        std::string out;
+        for (const auto &s : steps)
+        {
+            out += s.name + "[" + std::to_string(s.start_us) + "-" + std::to_string(s.end_us) + "us " +
+                   status_names[s.status] + "] ";
+        }
+        return out;
+    }
+};
+
+#ifdef ROOM_PIPELINE_SELFTEST
+// 本地自测：bash lib/selftest.sh room_pipeline
+#include "selftest_compat.h"
+#include "iostream"
+#include "atomic"
+
+int main()
+{
+    const auto sleep_ms = [](int ms)
+    { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); };
+
+    // 空图直接成功
+    {
+        step_graph graph;
+        expect(graph.execute() && graph.timeline(nullptr, 0) == 0, "empty graph succeeds");
+    }
+
+    // 互不依赖的步骤并发执行，依赖全部完成后才启动后续步骤
+    {
+        step_graph graph;
+        const auto ip = graph.add("ip", {}, [&]
+                                  { sleep_ms(100); return true; });
+        const auto route = graph.add("route", {}, [&]
+                                     { sleep_ms(100); return true; });
+        const auto trans = graph.add("trans", {ip, route}, [&]
+                                     { sleep_ms(20); return true; });
+        expect(graph.execute(), "all steps succeed");
+        step_timeline lines[PIPELINE_STEP_LIMIT] = {};
+        expect(graph.timeline(lines, PIPELINE_STEP_LIMIT) == 3, "timeline has every step");
+        const bool statuses = lines[ip].status == STEP_OK && lines[route].status == STEP_OK && lines[trans].status == STEP_OK;
+        expect(statuses && strcmp(lines[route].name, "route") == 0, "timeline names and statuses");
+        expect(lines[ip].start_us < lines[route].end_us && lines[route].start_us < lines[ip].end_us, "independent steps overlap");
+        expect(lines[trans].start_us >= lines[ip].end_us && lines[trans].start_us >= lines[route].end_us, "dependent step waits for both");
+        expect(graph.total() < 200 * 1000 && graph.duration(ip) >= 100 * 1000,
+               "total " + std::to_string(graph.total() / 1000) + "ms below the serial 220ms");
+    }
+
+    // 失败：不再启动新步骤，执行中的步骤结束后按完成的逆序回滚，依赖失败的步骤跳过
+    {
+        step_graph graph;
+        std::vector<std::string> undo;
+        std::mutex undo_lock;
+        const auto record = [&](const char *name)
+        {
+            return [&, name]
+            {
+                std::lock_guard<std::mutex> guard(undo_lock);
+                undo.push_back(name);
+            };
+        };
+        std::atomic<bool> late_ran{false};
+        const auto adapter = graph.add("adapter", {}, [&]
+                                       { return true; }, record("adapter"));
+        const auto config = graph.add("config", {adapter}, [&]
+                                      { sleep_ms(10); return true; }, record("config"));
+        const auto slow = graph.add("slow", {adapter}, [&]
+                                    { sleep_ms(80); return true; }, record("slow"));
+        const auto bind = graph.add("bind", {adapter}, [&]
+                                    { sleep_ms(30); return false; }, record("bind"));
+        const auto trans = graph.add("trans", {config, bind}, [&]
+                                     { late_ran = true; return true; }, record("trans"));
+        const auto after = graph.add("after_slow", {slow}, [&]
+                                     { late_ran = true; return true; }, record("after_slow"));
+        expect(!graph.execute(), "failure reported");
+        step_timeline lines[PIPELINE_STEP_LIMIT] = {};
+        graph.timeline(lines, PIPELINE_STEP_LIMIT);
+        expect(lines[bind].status == STEP_FAILED, "failed step marked failed");
+        expect(lines[trans].status == STEP_SKIPPED && lines[after].status == STEP_SKIPPED && !late_ran,
+               "no step starts after the failure");
+        expect(lines[adapter].status == STEP_ROLLED_BACK && lines[config].status == STEP_ROLLED_BACK &&
+                   lines[slow].status == STEP_ROLLED_BACK,
+               "completed steps rolled back, including the one in flight");
+        expect(undo == std::vector<std::string>({"slow", "config", "adapter"}), "rollback in reverse completion order");
+    }
+
+    // 名称超长截断，保留结尾 0
+    {
+        step_graph graph;
+        graph.add("a-very-long-step-name", {}, []
+                  { return true; });
+        graph.execute();
+        step_timeline line{};
+        graph.timeline(&line, 1);
+        expect(strlen(line.name) == PIPELINE_NAME_LENGTH - 1 && strncmp(line.name, "a-very-long-ste", 15) == 0, "long name truncated");
+        expect(graph.describe().find("a-very-long-step-name[") == 0, "describe keeps the full name");
+    }
+    return selftest_result();
+}
+#endif
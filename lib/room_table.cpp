@@ -0,0 +1,277 @@
+#include "unordered_map"
+#include "shared_mutex"
+#include "mutex"
+#include "memory"
+#include "functional"
+#include "string"
+#include "vector"
+#include "atomic"
+
+#pragma once
+
+/**
+ * 房间表：名称到房间共享指针的映射，外加按投影函数生成的只读快照
+ * 锁层次中位于 lifecycle_lock 与房间锁之间：表锁只在查找、插入、摘除时短暂持有，从不在持有房间锁时获取，
+ * 查找后释放表锁仍可安全使用房间。快照整体替换，读取不加任何锁，不会阻塞在表锁或任何房间锁上
+ */
+template <typename Room, typename View>
+class room_table
+{
+public:
+    using views = std::unordered_map<std::wstring, View>;
+
+    explicit room_table(std::function<View(const Room &)> project) : project(std::move(project)) {}
+
+    room_table(const room_table &) = delete;
+    room_table &operator=(const room_table &) = delete;
+
+    // 查找房间，不存在返回空
+    std::shared_ptr<Room> find(const wchar_t *name)
+    {
+        std::shared_lock<std::shared_mutex> lock(table_lock);
+        const auto it = rooms.find(name);
+        return it == rooms.end() ? nullptr : it->second;
+    }
+
+    // 当前房间列表副本，遍历期间不持有表锁
+    std::vector<std::shared_ptr<Room>> list()
+    {
+        std::shared_lock<std::shared_mutex> lock(table_lock);
+        std::vector<std::shared_ptr<Room>> out;
+        out.reserve(rooms.size());
+        for (const auto &[name, room] : rooms)
+            out.push_back(room);
+        return out;
+    }
+
+    // 插入或替换房间并刷新快照，投影在表锁内执行，不得获取房间锁
+    void put(const std::wstring &name, std::shared_ptr<Room> room)
+    {
+        std::unique_lock<std::shared_mutex> lock(table_lock);
+        rooms[name] = std::move(room);
+        publish();
+    }
+
+    // 摘除房间并刷新快照，返回被摘除的房间，不存在返回空
+    std::shared_ptr<Room> take(const wchar_t *name)
+    {
+        std::unique_lock<std::shared_mutex> lock(table_lock);
+        const auto it = rooms.find(name);
+        if (it == rooms.end())
+            return nullptr;
+        auto room = std::move(it->second);
+        rooms.erase(it);
+        publish();
+        return room;
+    }
+
+    void clear()
+    {
+        std::unique_lock<std::shared_mutex> lock(table_lock);
+        rooms.clear();
+        publish();
+    }
+
+    // 只读快照，不加锁
+    std::shared_ptr<const views> snapshot() const
+    {
+        return std::atomic_load(&current);
+    }
+
+private:
+    // 按房间表重新生成快照，调用方需持有表锁
+    void publish()
+    {
+        auto next = std::make_shared<views>();
+        for (const auto &[name, room] : rooms)
+            (*next)[name] = project(*room);
+        std::atomic_store(&current, std::shared_ptr<const views>(std::move(next)));
+    }
+
+    std::unordered_map<std::wstring, std::shared_ptr<Room>> rooms;
+    std::shared_mutex table_lock;
+    std::function<View(const Room &)> project;
+    std::shared_ptr<const views> current = std::make_shared<const views>();
+};
+
+#ifdef ROOM_TABLE_SELFTEST
+// 本地自测：bash lib/selftest.sh room_table
+// 两个房间并发压测：一个写线程长时间持有 a 房间锁（模拟阻塞的 set_config），其余写线程在 a 上增删成员、
+// 同时反复创建删除第三个房间；b 房间的读线程与快照读线程的最大耗时必须远小于持锁时长。不需要适配器
+#ifdef _WIN32
+#include "src/wireguard.h"
+#include "wireguard_tool.cpp"
+#endif
+#include "selftest_compat.h"
+#include "iostream"
+#include "thread"
+#include "chrono"
+
+namespace room_table_test
+{
+    // 模拟房间：与 room_config 相同，配置按 wireguard 内存布局保存，修改与下发都在房间锁内；id 创建后只读，供快照投影
+    struct sim_room
+    {
+        int id;
+        std::mutex lock;
+        std::vector<BYTE> conf = std::vector<BYTE>(interface_size);
+        DWORD peers = 0;
+        bool closed = false;
+
+        bool set_config()
+        {
+            return WireGuardSetConfiguration(nullptr, reinterpret_cast<const WIREGUARD_INTERFACE *>(conf.data()), static_cast<DWORD>(conf.size())) != 0;
+        }
+    };
+
+    struct sim_view
+    {
+        int id;
+    };
+
+    // 模拟适配器：每次下发配置耗时约 200us
+    BOOL slow_set(WIREGUARD_ADAPTER_HANDLE, const WIREGUARD_INTERFACE *, DWORD)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        return 1;
+    }
+
+    long long elapsed_us(std::chrono::steady_clock::time_point begin)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    void raise(std::atomic<long long> &max, long long value)
+    {
+        auto prev = max.load();
+        while (value > prev && !max.compare_exchange_weak(prev, value))
+            ;
+    }
+}
+
+int main()
+{
+    using namespace room_table_test;
+    WireGuardSetConfiguration = &slow_set;
+
+    room_table<sim_room, sim_view> table([](const sim_room &room)
+                                         { return sim_view{room.id}; });
+    const auto make_room = [](int id)
+    {
+        auto room = std::make_shared<sim_room>();
+        room->id = id;
+        return room;
+    };
+    table.put(L"a", make_room(1));
+    table.put(L"b", make_room(2));
+    expect(table.find(L"a") != nullptr && table.find(L"c") == nullptr && table.snapshot()->size() == 2, "lookup and snapshot");
+
+    constexpr auto HOLD = std::chrono::milliseconds(300);
+    constexpr long long BOUND_US = 50 * 1000;
+    std::atomic<bool> running{true};
+    std::atomic<long long> max_b_us{0}, max_snapshot_us{0}, max_a_us{0};
+    std::atomic<uint64_t> b_reads{0}, snapshot_reads{0}, a_writes{0}, churns{0};
+    std::vector<std::thread> writers, readers;
+
+    // 持锁线程：反复长时间持有 a 房间锁
+    writers.emplace_back([&]
+                         {
+        for (int i = 0; i < 3; i++)
+        {
+            const auto room = table.find(L"a");
+            std::lock_guard<std::mutex> guard(room->lock);
+            std::this_thread::sleep_for(HOLD);
+        } });
+    // a 房间的成员增删：追加或截断一条 peer 记录后下发
+    for (int w = 0; w < 2; w++)
+    {
+        writers.emplace_back([&, w]
+                             {
+            for (int r = 0; r < 200; r++)
+            {
+                const auto begin = std::chrono::steady_clock::now();
+                const auto room = table.find(L"a");
+                std::lock_guard<std::mutex> guard(room->lock);
+                if (room->closed)
+                    continue;
+                if ((r + w) % 3 == 0 && room->peers > 0)
+                {
+                    room->conf.resize(room->conf.size() - peer_size);
+                    room->peers--;
+                }
+                else
+                {
+                    room->conf.resize(room->conf.size() + peer_size);
+                    room->peers++;
+                }
+                room->set_config();
+                a_writes++;
+                raise(max_a_us, elapsed_us(begin));
+            } });
+    }
+    // 房间创建与删除：表锁上的写竞争
+    writers.emplace_back([&]
+                         {
+        for (int r = 0; r < 500; r++)
+        {
+            table.put(L"c", make_room(3));
+            if (const auto room = table.take(L"c"))
+            {
+                std::lock_guard<std::mutex> guard(room->lock);
+                room->closed = true;
+            }
+            churns++;
+        } });
+    // b 房间读线程：查找后在房间锁内读取配置，与 a 的持锁互不影响
+    for (int i = 0; i < 2; i++)
+    {
+        readers.emplace_back([&]
+                             {
+            while (running)
+            {
+                const auto begin = std::chrono::steady_clock::now();
+                const auto room = table.find(L"b");
+                {
+                    std::lock_guard<std::mutex> guard(room->lock);
+                    volatile auto size = room->conf.size();
+                    (void)size;
+                }
+                raise(max_b_us, elapsed_us(begin));
+                b_reads++;
+            } });
+    }
+    // 快照读线程：读取 a 的视图，不经过任何房间锁
+    readers.emplace_back([&]
+                         {
+        while (running)
+        {
+            const auto begin = std::chrono::steady_clock::now();
+            const auto views = table.snapshot();
+            const auto it = views->find(L"a");
+            volatile int id = it == views->end() ? 0 : it->second.id;
+            (void)id;
+            raise(max_snapshot_us, elapsed_us(begin));
+            snapshot_reads++;
+        } });
+    for (auto &t : writers)
+        t.join();
+    running = false;
+    for (auto &t : readers)
+        t.join();
+
+    std::cout << "room_table: a_writes=" << a_writes << " churns=" << churns << " b_reads=" << b_reads
+              << " snapshot_reads=" << snapshot_reads << " max_a_us=" << max_a_us << " max_b_us=" << max_b_us
+              << " max_snapshot_us=" << max_snapshot_us << std::endl;
+    expect(a_writes == 400 && churns == 500, "all writers finished");
+    expect(max_a_us >= std::chrono::duration_cast<std::chrono::microseconds>(HOLD).count() / 2,
+           "writers on a waited for the holder");
+    expect(b_reads > 1000 && max_b_us < BOUND_US, "room b readers not blocked by a writer holding room a");
+    expect(snapshot_reads > 1000 && max_snapshot_us < BOUND_US, "snapshot readers never block");
+    const auto a = table.find(L"a");
+    const auto views = table.snapshot();
+    expect(a != nullptr && a->conf.size() == interface_size + a->peers * peer_size, "room a table consistent");
+    expect(table.find(L"c") == nullptr && views->size() == 2 && views->at(L"a").id == 1 && views->at(L"b").id == 2,
+           "snapshot matches the table after churn");
+    return selftest_result();
+}
+#endif
@@ -0,0 +1,230 @@
+#include "mutex"
+#include "condition_variable"
+#include "thread"
+#include "functional"
+#include "chrono"
+#include "array"
+#include "cstdint"
+
+#pragma once
+
+// 共享采样线程的消费者数量上限，消费者以位掩码传给每一轮
+static constexpr size_t SAMPLE_CONSUMER_LIMIT = 32;
+
+/**
+ * 共享采样线程：各消费者登记自己的周期，线程在最早的到期时间醒来，把本轮到期的消费者以位掩码交给 pass，
+ * pass 内每个房间只查询一次适配器配置再分发给到期的消费者，不再由每个功能各开线程各自轮询
+ * 关闭消费者时等待进行中的一轮结束，返回后不会再以该消费者调用 pass；set 与 stop 不能在 pass 内调用
+ */
+class sample_scheduler
+{
+public:
+    using clock = std::chrono::steady_clock;
+    using pass_func = std::function<void(uint32_t due, clock::time_point now)>;
+
+    explicit sample_scheduler(pass_func pass) : pass(std::move(pass)) {}
+
+    ~sample_scheduler()
+    {
+        stop();
+    }
+
+    sample_scheduler(const sample_scheduler &) = delete;
+    sample_scheduler &operator=(const sample_scheduler &) = delete;
+
+    /**
+     * 设置消费者周期，period_ms 为 0 时关闭并等待进行中的一轮结束
+     * immediate 为 true 时立即安排一轮，否则一个周期后首次到期；首次开启消费者时启动线程
+     */
+    void set(size_t consumer, uint32_t period_ms, bool immediate)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        periods[consumer] = period_ms;
+        if (period_ms == 0)
+        {
+            idle_cv.wait(guard, [this, consumer]
+                         { return (running & (1u << consumer)) == 0; });
+            return;
+        }
+        due[consumer] = clock::now() + (immediate ? clock::duration::zero() : std::chrono::milliseconds(period_ms));
+        if (!thread.joinable())
+        {
+            stopping = false;
+            thread = std::thread([this]
+                                 { loop(); });
+        }
+        woken = true;
+        cv.notify_one();
+    }
+
+    /**
+     * 由 pass 在处理完全部消费者后调用，提前唤醒等待关闭的调用方
+     * 之后 pass 只能做不触及消费者状态的收尾，例如输出本轮延后的日志：日志回调可能等待的正是关闭方所在的线程
+     */
+    void release()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            running = 0;
+        }
+        idle_cv.notify_all();
+    }
+
+    // 消费者是否开启
+    bool enabled(size_t consumer)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return periods[consumer] != 0;
+    }
+
+    // 停止线程并关闭全部消费者，之后再次 set 会重新启动线程
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            periods.fill(0);
+        }
+        cv.notify_all();
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+
+private:
+    void loop()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while (!stopping)
+        {
+            const auto now = clock::now();
+            uint32_t mask = 0;
+            auto wake = clock::time_point::max();
+            for (size_t c = 0; c < SAMPLE_CONSUMER_LIMIT; c++)
+            {
+                if (periods[c] == 0)
+                    continue;
+                // 距到期不足 1/4 周期的消费者提前并入本轮，周期不同的消费者尽量共用一次查询
+                if (due[c] <= now + std::chrono::milliseconds(periods[c] / 4))
+                {
+                    mask |= 1u << c;
+                    due[c] = now + std::chrono::milliseconds(periods[c]);
+                }
+                if (due[c] < wake)
+                    wake = due[c];
+            }
+            if (mask != 0)
+            {
+                running = mask;
+                guard.unlock();
+                pass(mask, now);
+                guard.lock();
+                running = 0;
+                idle_cv.notify_all();
+                continue;
+            }
+            if (wake == clock::time_point::max())
+                cv.wait(guard, [this]
+                        { return stopping || woken; });
+            else
+                cv.wait_until(guard, wake, [this]
+                              { return stopping || woken; });
+            woken = false;
+        }
+    }
+
+    pass_func pass;
+    std::mutex lock;
+    std::condition_variable cv;
+    // 进行中的一轮结束时通知等待关闭的调用方
+    std::condition_variable idle_cv;
+    std::thread thread;
+    bool stopping = false;
+    bool woken = false;
+    uint32_t running = 0;
+    std::array<uint32_t, SAMPLE_CONSUMER_LIMIT> periods{};
+    std::array<clock::time_point, SAMPLE_CONSUMER_LIMIT> due{};
+};
+
+#ifdef SAMPLER_SELFTEST
+// 本地自测：bash lib/selftest.sh sampler
+#include "selftest_compat.h"
+#include "iostream"
+#include "atomic"
+#include "string"
+
+int main()
+{
+    std::atomic<int> passes{0}, fast{0}, slow{0}, shared{0};
+    std::atomic<bool> in_pass{false}, slow_after_disable{false};
+    std::atomic<bool> slow_disabled{false};
+    sample_scheduler sampler([&](uint32_t due, std::chrono::steady_clock::time_point)
+                             {
+        in_pass = true;
+        passes++;
+        if (due & 1u)
+            fast++;
+        if (due & 2u)
+        {
+            slow++;
+            if (slow_disabled)
+                slow_after_disable = true;
+            // 模拟一轮耗时的查询，关闭方必须等它结束
+            std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        }
+        if ((due & 3u) == 3u)
+            shared++;
+        in_pass = false; });
+
+    sampler.set(0, 10, true);
+    sampler.set(1, 50, false);
+    std::this_thread::sleep_for(std::chrono::milliseconds(520));
+    expect(fast >= 20 && fast <= 60, "10ms consumer ran every 8-10ms between slow passes: " + std::to_string(fast.load()));
+    expect(slow >= 6 && slow <= 14, "50ms consumer ran every 38-50ms: " + std::to_string(slow.load()));
+    expect(shared >= 1 && passes < fast + slow, "consumers due together share one pass");
+
+    // 关闭时等待进行中的一轮，之后不再以该消费者调用
+    sampler.set(1, 0, false);
+    slow_disabled = true;
+    const int slow_at_disable = slow;
+    std::this_thread::sleep_for(std::chrono::milliseconds(150));
+    expect(!slow_after_disable && slow == slow_at_disable, "disabled consumer never runs after set returns");
+    expect(sampler.enabled(0) && !sampler.enabled(1), "enabled reflects periods");
+
+    // 全部关闭后线程空等，不再调用 pass
+    sampler.set(0, 0, false);
+    const int idle_passes = passes;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    expect(passes == idle_passes && !in_pass, "no passes with every consumer disabled");
+
+    // pass 调用 release 之后的收尾不阻塞关闭方
+    std::atomic<bool> started{false}, tail_done{false};
+    sample_scheduler *releasing_ptr = nullptr;
+    sample_scheduler releasing([&](uint32_t, std::chrono::steady_clock::time_point)
+                               {
+        started = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        releasing_ptr->release();
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        tail_done = true; });
+    releasing_ptr = &releasing;
+    releasing.set(0, 1000, true);
+    while (!started)
+        std::this_thread::yield();
+    const auto begin = std::chrono::steady_clock::now();
+    releasing.set(0, 0, false);
+    const auto waited = std::chrono::steady_clock::now() - begin;
+    expect(!tail_done && waited >= std::chrono::milliseconds(10) && waited < std::chrono::milliseconds(150),
+           "disable waits for the consumers but not for the tail after release");
+    releasing.stop();
+
+    // stop 后重新开启
+    sampler.stop();
+    sampler.set(0, 5, true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    expect(passes > idle_passes, "set after stop restarts the thread");
+    sampler.stop();
+    return selftest_result();
+}
+#endif
@@ -0,0 +1,51 @@
+#!/usr/bin/env bash
+# 编译并运行 lib 下各模块的自测（文件末尾 #ifdef XXX_SELFTEST 中的 main）
+# 用法：bash lib/selftest.sh [模块 [参数...]]，不带模块时依次运行全部，任一编译或断言失败返回非 0
+# 模块名为去掉 .cpp 的文件名，参数原样传给自测程序；编译器可用 CXX 指定，默认 g++
+set -u
+
+cd "$(dirname "$0")"
+CXX=${CXX:-g++}
+# 非 Windows 下用 selftest/ 中的空头文件顶替 src/wireguard.h 引用的 Windows 系统头文件
+case "$(uname -s)" in
+MINGW* | MSYS* | CYGWIN*) include=() ;;
+*) include=(-I selftest) ;;
+esac
+
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+# 运行单个模块，返回 0 表示编译与全部断言通过
+run_module() {
+    local module=$1
+    shift
+    local macro
+    macro=$(grep -m1 -o '^#ifdef [A-Z_]*_SELFTEST$' "$module.cpp" | cut -d' ' -f2)
+    if [ -z "$macro" ]; then
+        echo "$module: no self-test" >&2
+        return 1
+    fi
+    echo "== $module"
+    if ! "$CXX" -std=c++17 -O2 "${include[@]}" -D"$macro" -x c++ "$module.cpp" -o "$out/$module" -lpthread >"$out/$module.log" 2>&1; then
+        cat "$out/$module.log"
+        echo "BUILD FAIL $module"
+        return 1
+    fi
+    "$out/$module" "$@"
+}
+
+if [ $# -gt 0 ]; then
+    run_module "$@"
+    exit $?
+fi
+
+failed=()
+for file in $(grep -l '^#ifdef [A-Z_]*_SELFTEST$' *.cpp); do
+    module=${file%.cpp}
+    run_module "$module" || failed+=("$module")
+done
+if [ ${#failed[@]} -gt 0 ]; then
+    echo "failed: ${failed[*]}"
+    exit 1
+fi
+echo "all self-tests passed"
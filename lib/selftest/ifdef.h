@@ -0,0 +1,3 @@
+#pragma once
+
+// Linux 自测占位：src/wireguard.h 与 wireguard_common.cpp 引用的 Windows 头文件，类型由 selftest_compat.h 提供
@@ -0,0 +1,320 @@
+#pragma once
+
+/**
+ * lib 下各模块自测的公共部分：断言输出与 Linux 下的 Windows 替身，不参与 dll 构建
+ * 自测由 lib/selftest.sh 统一编译运行。Linux 下 selftest/ 目录提供空的 Windows 系统头文件，
+ * 本文件补齐 src/wireguard.h 用到的 Windows 类型后直接包含它与 wireguard_common.cpp，
+ * 驱动结构体、日志与地址解析和 dll 使用同一份定义；驱动函数指针默认为空，自测按需换成模拟适配器
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+
+// 自测断言：输出 ok/FAIL 与说明并累计失败数，main 返回 selftest_result()
+inline int selftest_failed = 0;
+
+inline void expect(bool ok, const std::string &what)
+{
+    std::cout << (ok ? "ok   " : "FAIL ") << what << std::endl;
+    selftest_failed += !ok;
+}
+
+inline int selftest_result()
+{
+    return selftest_failed == 0 ? 0 : 1;
+}
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstddef>
+#include <cwchar>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+typedef void VOID;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint64_t DWORD64;
+typedef uint64_t UINT64;
+typedef int BOOL;
+typedef uint16_t ADDRESS_FAMILY;
+typedef void *HANDLE;
+typedef const wchar_t *LPCWSTR;
+typedef struct
+{
+    uint32_t Data1;
+    uint16_t Data2;
+    uint16_t Data3;
+    uint8_t Data4[8];
+} GUID;
+typedef union
+{
+    uint64_t Value;
+} NET_LUID;
+
+struct IN_ADDR
+{
+    union
+    {
+        uint32_t S_addr;
+    } S_un;
+};
+typedef in6_addr IN6_ADDR;
+
+union SOCKADDR_INET
+{
+    sockaddr_in Ipv4;
+    sockaddr_in6 Ipv6;
+    sa_family_t si_family;
+};
+
+#define WINAPI
+#define CALLBACK
+#define _In_
+#define _In_z_
+#define _In_opt_
+#define _Out_
+#define _Inout_
+#define _Must_inspect_result_
+#define _Return_type_success_(expr)
+#define _In_reads_bytes_(size)
+#define _Out_writes_bytes_all_(size)
+// 与 winnt.h 相同，wireguard.h 在 extern "C" 中展开
+#define DEFINE_ENUM_FLAG_OPERATORS(T)                                                                                      \
+    extern "C++"                                                                                                           \
+    {                                                                                                                      \
+        constexpr T operator|(T a, T b) { return static_cast<T>(static_cast<int>(a) | static_cast<int>(b)); }           \
+        constexpr T operator&(T a, T b) { return static_cast<T>(static_cast<int>(a) & static_cast<int>(b)); }           \
+        constexpr T operator~(T a) { return static_cast<T>(~static_cast<int>(a)); }                                      \
+        inline T &operator|=(T &a, T b) { return a = a | b; }                                                            \
+        inline T &operator&=(T &a, T b) { return a = a & b; }                                                            \
+    }
+
+static constexpr DWORD ERROR_MORE_DATA = 234;
+static constexpr DWORD MOVEFILE_REPLACE_EXISTING = 1;
+
+inline DWORD GetLastError()
+{
+    return static_cast<DWORD>(errno);
+}
+
+inline void SetLastError(DWORD code)
+{
+    errno = static_cast<int>(code);
+}
+
+inline DWORD GetCurrentProcessId()
+{
+    return static_cast<DWORD>(getpid());
+}
+
+inline int fopen_s(FILE **f, const char *path, const char *mode)
+{
+    *f = fopen(path, mode);
+    return *f == nullptr ? errno : 0;
+}
+
+inline BOOL MoveFileExA(const char *from, const char *to, DWORD)
+{
+    return rename(from, to) == 0;
+}
+
+// 只支持 _TRUNCATE：超长时截断并保证结尾 0
+#define _TRUNCATE (static_cast<size_t>(-1))
+template <size_t N>
+inline int strncpy_s(char (&dest)[N], const char *src, size_t)
+{
+    const size_t n = strnlen(src, N - 1);
+    memcpy(dest, src, n);
+    dest[n] = '\0';
+    return 0;
+}
+
+template <size_t N>
+inline int wcsncpy_s(wchar_t (&dest)[N], const wchar_t *src, size_t)
+{
+    const size_t n = wcsnlen(src, N - 1);
+    wmemcpy(dest, src, n);
+    dest[n] = L'\0';
+    return 0;
+}
+
+#define FALSE 0
+#define TRUE 1
+static constexpr DWORD INFINITE = 0xFFFFFFFF;
+static constexpr DWORD WAIT_OBJECT_0 = 0;
+static constexpr DWORD WAIT_TIMEOUT = 258;
+
+// 只支持自动复位事件：等待成功后自动清除信号
+struct selftest_event
+{
+    std::mutex lock;
+    std::condition_variable cv;
+    bool signaled = false;
+};
+
+inline HANDLE CreateEventW(void *, BOOL, BOOL initial, const wchar_t *)
+{
+    auto *e = new selftest_event;
+    e->signaled = initial != 0;
+    return e;
+}
+
+inline BOOL SetEvent(HANDLE handle)
+{
+    if (handle == nullptr)
+        return FALSE;
+    auto *e = static_cast<selftest_event *>(handle);
+    {
+        std::lock_guard<std::mutex> guard(e->lock);
+        e->signaled = true;
+    }
+    e->cv.notify_one();
+    return TRUE;
+}
+
+inline DWORD WaitForSingleObject(HANDLE handle, DWORD ms)
+{
+    auto *e = static_cast<selftest_event *>(handle);
+    std::unique_lock<std::mutex> guard(e->lock);
+    const auto ready = [e]
+    { return e->signaled; };
+    if (ms == INFINITE)
+        e->cv.wait(guard, ready);
+    else if (!e->cv.wait_for(guard, std::chrono::milliseconds(ms), ready))
+        return WAIT_TIMEOUT;
+    e->signaled = false;
+    return WAIT_OBJECT_0;
+}
+
+inline BOOL CloseHandle(HANDLE handle)
+{
+    delete static_cast<selftest_event *>(handle);
+    return TRUE;
+}
+
+static constexpr unsigned CP_UTF8 = 65001;
+
+// 只支持 CP_UTF8，Linux 下 wchar_t 为 UTF-32；length 为 -1 时包含结尾 0，out 为空时返回所需长度
+inline int WideCharToMultiByte(unsigned, DWORD, const wchar_t *src, int length, char *out, int size, const char *, BOOL *)
+{
+    const size_t n = length < 0 ? wcslen(src) + 1 : static_cast<size_t>(length);
+    std::string utf8;
+    for (size_t i = 0; i < n; i++)
+    {
+        const auto c = static_cast<uint32_t>(src[i]);
+        if (c < 0x80)
+            utf8 += static_cast<char>(c);
+        else if (c < 0x800)
+        {
+            utf8 += static_cast<char>(0xC0 | c >> 6);
+            utf8 += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            utf8 += static_cast<char>(0xE0 | c >> 12);
+            utf8 += static_cast<char>(0x80 | (c >> 6 & 0x3F));
+            utf8 += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            utf8 += static_cast<char>(0xF0 | c >> 18);
+            utf8 += static_cast<char>(0x80 | (c >> 12 & 0x3F));
+            utf8 += static_cast<char>(0x80 | (c >> 6 & 0x3F));
+            utf8 += static_cast<char>(0x80 | (c & 0x3F));
+        }
+    }
+    if (out == nullptr || size == 0)
+        return static_cast<int>(utf8.size());
+    if (utf8.size() > static_cast<size_t>(size))
+        return 0;
+    memcpy(out, utf8.data(), utf8.size());
+    return static_cast<int>(utf8.size());
+}
+
+// broadcaster.cpp 依赖 WinDivert，自测用只带转发计数的替身
+class transporter
+{
+public:
+    uint64_t forwarded_count() const
+    {
+        return forwarded;
+    }
+
+    uint64_t failed_count() const
+    {
+        return failed;
+    }
+
+    uint64_t forwarded = 0;
+    uint64_t failed = 0;
+};
+
+#include "src/wireguard.h"
+#include "wireguard_common.cpp"
+#endif
+
+// 按 wireguard 内存布局拼装的接口配置，模拟 WireGuardGetConfiguration 的查询结果，缓冲区 8 字节对齐
+class selftest_config
+{
+public:
+    selftest_config() : buffer((interface_size + 7) / 8) {}
+
+    // 追加公钥各字节均为 key 的 peer，后跟 allowed_ips 条全零的 allowed IP；返回的引用在下次追加前有效
+    WIREGUARD_PEER &add_peer(uint8_t key, uint64_t tx = 0, uint64_t rx = 0, DWORD allowed_ips = 0)
+    {
+        const size_t offset = bytes;
+        bytes += peer_size + allowed_ips * allowed_ip_size;
+        buffer.resize((bytes + 7) / 8);
+        auto *peer = reinterpret_cast<WIREGUARD_PEER *>(data() + offset);
+        memset(data() + offset, 0, bytes - offset);
+        peer->Flags = WIREGUARD_PEER_HAS_PUBLIC_KEY;
+        memset(peer->PublicKey, key, WIREGUARD_KEY_LENGTH);
+        peer->TxBytes = tx;
+        peer->RxBytes = rx;
+        peer->AllowedIPsCount = allowed_ips;
+        reinterpret_cast<WIREGUARD_INTERFACE *>(data())->PeersCount++;
+        return *peer;
+    }
+
+    // 第 i 个 peer，用于在两次查询之间修改计数、握手与 endpoint
+    WIREGUARD_PEER &peer(size_t i)
+    {
+        BYTE *cursor = data() + interface_size;
+        for (;; i--)
+        {
+            auto *peer = reinterpret_cast<WIREGUARD_PEER *>(cursor);
+            if (i == 0)
+                return *peer;
+            cursor += peer_size + peer->AllowedIPsCount * allowed_ip_size;
+        }
+    }
+
+    const WIREGUARD_INTERFACE *get() const
+    {
+        return reinterpret_cast<const WIREGUARD_INTERFACE *>(buffer.data());
+    }
+
+    DWORD size() const
+    {
+        return static_cast<DWORD>(bytes);
+    }
+
+private:
+    BYTE *data()
+    {
+        return reinterpret_cast<BYTE *>(buffer.data());
+    }
+
+    std::vector<uint64_t> buffer;
+    size_t bytes = interface_size;
+};
@@ -0,0 +1,821 @@
+#ifdef _WIN32
+#include "src/wireguard.h"
+#include "wireguard_tool.cpp"
+#include "dpapi.h"
+#pragma comment(lib, "crypt32.lib")
+#else
+#include "selftest_compat.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "mutex"
+#include "condition_variable"
+#include "thread"
+#include "functional"
+#include "vector"
+#include "string"
+#include "atomic"
+#include "array"
+#include "algorithm"
+
+#pragma once
+
+// 快照文件标识与格式版本，版本不一致时丢弃旧快照
+static constexpr uint32_t SNAPSHOT_MAGIC = 0x534C4F4D; // "MOLS"
+static constexpr uint32_t SNAPSHOT_VERSION = 2;
+// 快照块标识
+static constexpr uint32_t SNAPSHOT_BLOCK_MAGIC = 0x4B4C424D; // "MBLK"
+// 初始文件大小与块容量粒度
+static constexpr uint32_t SNAPSHOT_INITIAL_SIZE = 64 * 1024;
+static constexpr uint32_t SNAPSHOT_BLOCK_ALIGN = 4096;
+// 房间名长度上限（含结尾 0）
+static constexpr size_t SNAPSHOT_ROOM_NAME = 64;
+// 快照中 peer 名称长度，与房间 peer 表一致
+static constexpr size_t SNAPSHOT_PEER_NAME = 64;
+// 配置变更后合并写入快照的等待时间(ms)
+static constexpr uint32_t SNAPSHOT_FLUSH_MS = 200;
+
+#pragma pack(push, 8)
+struct snapshot_file_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t reserved;
+};
+
+/**
+ * 快照块头，数据紧随其后
+ * 写入顺序：容量 -> 标识（新块），房间名 -> 长度 -> 数据 -> 校验 -> 序号。
+ * 序号最后写入且为 8 字节对齐的单次写，写入中途崩溃时该块校验失败，恢复时使用同一房间序号较小的旧块
+ */
+struct snapshot_block
+{
+    uint32_t capacity; // 数据区容量，不含块头
+    uint32_t magic;
+    uint64_t seq;      // 0 表示空闲或已删除
+    uint32_t length;   // 数据长度
+    uint32_t crc;      // 覆盖房间名、长度与数据
+    wchar_t room[SNAPSHOT_ROOM_NAME];
+};
+
+/**
+ * 房间快照数据头，之后依次为 key_size 字节（按 8 字节对齐）的加密私钥、peer_count 个 snapshot_peer
+ * 与 conf_size 字节的 wireguard 配置，配置中的私钥置零
+ */
+struct snapshot_room
+{
+    char adapter_ip[INET_ADDRSTRLEN];
+    char ip_area[INET_ADDRSTRLEN];
+    uint8_t prefix_length;
+    uint8_t reserved[3];
+    uint32_t peer_count;
+    uint32_t conf_size;
+    uint32_t key_size;
+    // 房间实际使用的适配器名，来自预创建池时为池中的占位名，恢复时按该名称接管
+    wchar_t adapter[SNAPSHOT_ROOM_NAME];
+};
+
+struct snapshot_peer
+{
+    wchar_t name[SNAPSHOT_PEER_NAME];
+    // 激活时的 peer 标志，按需或错峰等待中的 peer 在配置中是休眠记录，恢复时统一按激活写入
+    WIREGUARD_PEER_FLAG flags;
+    uint32_t reserved;
+};
+#pragma pack(pop)
+static_assert(sizeof(snapshot_file_header) == 16, "snapshot_file_header layout changed");
+static_assert(sizeof(snapshot_block) % 8 == 0, "snapshot_block must keep payload aligned");
+static_assert(sizeof(snapshot_room) == 48 + SNAPSHOT_ROOM_NAME * sizeof(wchar_t), "snapshot_room layout changed");
+
+// 房间记录中加密私钥区的长度，按 8 字节对齐
+inline size_t snapshot_key_area(const snapshot_room &head)
+{
+    return (static_cast<size_t>(head.key_size) + 7) / 8 * 8;
+}
+
+#ifdef _WIN32
+// 以当前用户身份用 DPAPI 加密房间私钥，快照文件中只保存密文
+inline bool snapshot_seal_key(const BYTE *key, std::vector<BYTE> &out)
+{
+    DATA_BLOB in{WIREGUARD_KEY_LENGTH, const_cast<BYTE *>(key)};
+    DATA_BLOB sealed{};
+    if (!CryptProtectData(&in, L"mole room key", nullptr, nullptr, nullptr, CRYPTPROTECT_UI_FORBIDDEN, &sealed))
+    {
+        log(WIREGUARD_LOG_ERR, "snapshot key protect failed", GetLastError());
+        return false;
+    }
+    out.assign(sealed.pbData, sealed.pbData + sealed.cbData);
+    LocalFree(sealed.pbData);
+    return true;
+}
+
+// 解密快照中的房间私钥，其他用户或其他机器上的快照无法解密
+inline bool snapshot_open_key(const BYTE *blob, size_t size, BYTE *key)
+{
+    DATA_BLOB in{static_cast<DWORD>(size), const_cast<BYTE *>(blob)};
+    DATA_BLOB plain{};
+    if (!CryptUnprotectData(&in, nullptr, nullptr, nullptr, nullptr, CRYPTPROTECT_UI_FORBIDDEN, &plain))
+    {
+        log(WIREGUARD_LOG_ERR, "snapshot key unprotect failed", GetLastError());
+        return false;
+    }
+    const bool ok = plain.cbData == WIREGUARD_KEY_LENGTH;
+    if (ok)
+        memcpy(key, plain.pbData, WIREGUARD_KEY_LENGTH);
+    SecureZeroMemory(plain.pbData, plain.cbData);
+    LocalFree(plain.pbData);
+    return ok;
+}
+#endif
+
+// CRC-32 (IEEE)，用于识别写入中途崩溃的快照块
+inline uint32_t snapshot_crc(uint32_t crc, const void *data, size_t size)
+{
+    static const auto table = []
+    {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    const auto *p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+/**
+ * 会话快照，内存映射文件，每个房间一条记录
+ * 文件为文件头加一串定长块，每个房间最多占用两个块交替写入：每次变更写入非最新的块，序号最后更新，
+ * 进程在任意位置崩溃都至少保留一个完整的旧版本。只改写发生变化的房间，写入即内存拷贝，不等待落盘。
+ * 房间配置变更只通过 touch 标记，写入线程合并 SNAPSHOT_FLUSH_MS 内的标记后回调调用方逐个房间写入。
+ * 房间私钥以 DPAPI 密文保存，文件仍应放在用户目录下
+ */
+class session_snapshot
+{
+public:
+    static session_snapshot snapshot_instance;
+
+    static session_snapshot &getInstance()
+    {
+        return snapshot_instance;
+    }
+
+    session_snapshot(const session_snapshot &) = delete;
+    session_snapshot &operator=(const session_snapshot &) = delete;
+
+    // 恢复时读取的单个房间记录
+    struct record
+    {
+        std::wstring room;
+        std::vector<BYTE> data;
+    };
+
+    /**
+     * 打开或创建快照文件，校验通过的房间记录写入 out
+     * 文件头不一致时视为新文件，重新初始化
+     */
+    bool open(const char *path, std::vector<record> &out)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        close_locked();
+        if (!open_file(path))
+        {
+            log(WIREGUARD_LOG_ERR, "snapshot open failed", GetLastError());
+            return false;
+        }
+        const size_t size = file_size();
+        if (!map(size < SNAPSHOT_INITIAL_SIZE ? SNAPSHOT_INITIAL_SIZE : size))
+        {
+            close_locked();
+            return false;
+        }
+        auto *header = reinterpret_cast<snapshot_file_header *>(view);
+        if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION)
+        {
+            memset(view, 0, view_size);
+            header->version = SNAPSHOT_VERSION;
+            header->magic = SNAPSHOT_MAGIC;
+            used = sizeof(snapshot_file_header);
+            return true;
+        }
+        scan(out);
+        return true;
+    }
+
+    /**
+     * 写入房间记录，fill 向目标地址写入 length 字节数据
+     * 调用方可持有房间锁，快照锁为叶子锁
+     */
+    template <typename F>
+    bool save(const std::wstring &room, uint32_t length, F &&fill)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (view == nullptr || room.size() >= SNAPSHOT_ROOM_NAME)
+            return false;
+        size_t newest = npos;
+        uint64_t top = 0;
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            if (blocks[i].seq != 0 && blocks[i].room == room && blocks[i].seq > top)
+            {
+                newest = i;
+                top = blocks[i].seq;
+            }
+        }
+        const size_t target = pick(room, length, newest);
+        if (target == npos)
+            return false;
+        auto &meta = blocks[target];
+        auto *block = block_at(meta.offset);
+        // 先作废目标块，写入期间崩溃时该块不会被当作有效版本
+        store_seq(block, 0);
+        memset(block->room, 0, sizeof(block->room));
+        wmemcpy(block->room, room.c_str(), room.size());
+        block->length = length;
+        auto *payload = reinterpret_cast<BYTE *>(block) + sizeof(snapshot_block);
+        fill(payload);
+        block->crc = block_crc(block);
+        std::atomic_thread_fence(std::memory_order_release);
+        store_seq(block, ++sequence);
+        meta.seq = sequence;
+        meta.room = room;
+        // 异步写回，不等待落盘
+        flush_view(block, sizeof(snapshot_block) + length);
+        return true;
+    }
+
+    // 写入一条已编码的房间记录
+    bool save(const std::wstring &room, const std::vector<BYTE> &data)
+    {
+        return save(room, static_cast<uint32_t>(data.size()), [&data](BYTE *dst)
+                    { memcpy(dst, data.data(), data.size()); });
+    }
+
+    // 删除房间记录：先作废旧块再作废最新块，中途崩溃最多恢复出最新版本
+    void erase(const std::wstring &room)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (view == nullptr)
+            return;
+        std::vector<size_t> owned;
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            if (blocks[i].seq != 0 && blocks[i].room == room)
+                owned.push_back(i);
+        }
+        std::sort(owned.begin(), owned.end(), [this](size_t a, size_t b)
+                  { return blocks[a].seq < blocks[b].seq; });
+        for (const auto i : owned)
+        {
+            store_seq(block_at(blocks[i].offset), 0);
+            blocks[i].seq = 0;
+        }
+    }
+
+    /**
+     * 启动写入线程，flush 在线程中执行，由调用方把标记过的房间编码后调用 save
+     * flush 中可获取房间锁，写入锁不在 flush 期间持有
+     */
+    void start(std::function<void()> flush)
+    {
+        std::lock_guard<std::mutex> guard(writer_lock);
+        if (writer.joinable())
+            return;
+        writer_stop = false;
+        writer = std::thread([this, flush = std::move(flush)]
+                             { write_loop(flush); });
+    }
+
+    // 标记有房间待写入，调用方可持有房间锁，写入锁为叶子锁
+    void touch()
+    {
+        {
+            std::lock_guard<std::mutex> guard(writer_lock);
+            writer_pending = true;
+        }
+        writer_cv.notify_one();
+    }
+
+    // 停止写入线程，停止前写完已标记的变更
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(writer_lock);
+            writer_stop = true;
+        }
+        writer_cv.notify_all();
+        if (writer.joinable())
+            writer.join();
+    }
+
+    void close()
+    {
+        stop();
+        std::lock_guard<std::mutex> guard(lock);
+        close_locked();
+    }
+
+private:
+    session_snapshot() = default;
+
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    struct block_meta
+    {
+        size_t offset;
+        uint32_t capacity;
+        uint64_t seq;
+        std::wstring room;
+    };
+
+    std::mutex lock;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int file = -1;
+#endif
+    BYTE *view = nullptr;
+    size_t view_size = 0;
+    // 已分配块的末尾偏移
+    size_t used = 0;
+    uint64_t sequence = 0;
+    std::vector<block_meta> blocks;
+    // 写入线程
+    std::mutex writer_lock;
+    std::condition_variable writer_cv;
+    std::thread writer;
+    bool writer_stop = false;
+    bool writer_pending = false;
+
+    void write_loop(const std::function<void()> &flush)
+    {
+        std::unique_lock<std::mutex> guard(writer_lock);
+        while (true)
+        {
+            writer_cv.wait(guard, [this]
+                           { return writer_stop || writer_pending; });
+            // 合并一段时间内的标记，集中加入时只写一次
+            if (!writer_stop)
+                writer_cv.wait_for(guard, std::chrono::milliseconds(SNAPSHOT_FLUSH_MS), [this]
+                                   { return writer_stop; });
+            const bool stopping = writer_stop;
+            const bool pending = writer_pending;
+            writer_pending = false;
+            guard.unlock();
+            if (pending)
+                flush();
+            guard.lock();
+            if (stopping)
+                break;
+        }
+    }
+
+    snapshot_block *block_at(size_t offset) const
+    {
+        return reinterpret_cast<snapshot_block *>(view + offset);
+    }
+
+    static void store_seq(snapshot_block *block, uint64_t seq)
+    {
+        reinterpret_cast<std::atomic<uint64_t> *>(&block->seq)->store(seq, std::memory_order_release);
+    }
+
+    static uint32_t block_crc(const snapshot_block *block)
+    {
+        uint32_t crc = snapshot_crc(0, block->room, sizeof(block->room));
+        crc = snapshot_crc(crc, &block->length, sizeof(block->length));
+        return snapshot_crc(crc, reinterpret_cast<const BYTE *>(block) + sizeof(snapshot_block), block->length);
+    }
+
+#ifdef _WIN32
+    bool open_file(const char *path)
+    {
+        file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        return file != INVALID_HANDLE_VALUE;
+    }
+
+    size_t file_size() const
+    {
+        LARGE_INTEGER size{};
+        GetFileSizeEx(file, &size);
+        return static_cast<size_t>(size.QuadPart);
+    }
+
+    bool map(size_t size)
+    {
+        const auto high = static_cast<DWORD>(static_cast<uint64_t>(size) >> 32);
+        const auto low = static_cast<DWORD>(size & 0xFFFFFFFF);
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, high, low, nullptr);
+        if (mapping == nullptr)
+        {
+            log(WIREGUARD_LOG_ERR, "snapshot mapping failed", GetLastError());
+            return false;
+        }
+        view = static_cast<BYTE *>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+        if (view == nullptr)
+        {
+            log(WIREGUARD_LOG_ERR, "snapshot map view failed", GetLastError());
+            CloseHandle(mapping);
+            mapping = nullptr;
+            return false;
+        }
+        view_size = size;
+        return true;
+    }
+
+    static void flush_view(void *at, size_t size)
+    {
+        FlushViewOfFile(at, size);
+    }
+
+    void unmap()
+    {
+        if (view != nullptr)
+        {
+            FlushViewOfFile(view, 0);
+            UnmapViewOfFile(view);
+            view = nullptr;
+        }
+        if (mapping != nullptr)
+        {
+            CloseHandle(mapping);
+            mapping = nullptr;
+        }
+        view_size = 0;
+    }
+
+    void close_file()
+    {
+        if (file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(file);
+            file = INVALID_HANDLE_VALUE;
+        }
+    }
+#else
+    // 非 Windows 下使用 mmap，仅供本地自测
+    bool open_file(const char *path)
+    {
+        file = ::open(path, O_RDWR | O_CREAT, 0600);
+        return file >= 0;
+    }
+
+    size_t file_size() const
+    {
+        struct stat st{};
+        return fstat(file, &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+    }
+
+    bool map(size_t size)
+    {
+        if (file_size() < size && ftruncate(file, static_cast<off_t>(size)) != 0)
+        {
+            log(WIREGUARD_LOG_ERR, "snapshot mapping failed", GetLastError());
+            return false;
+        }
+        void *at = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+        if (at == MAP_FAILED)
+        {
+            log(WIREGUARD_LOG_ERR, "snapshot map view failed", GetLastError());
+            return false;
+        }
+        view = static_cast<BYTE *>(at);
+        view_size = size;
+        return true;
+    }
+
+    void flush_view(void *at, size_t size) const
+    {
+        const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        const uintptr_t begin = reinterpret_cast<uintptr_t>(at) / page * page;
+        msync(reinterpret_cast<void *>(begin), reinterpret_cast<uintptr_t>(at) + size - begin, MS_ASYNC);
+    }
+
+    void unmap()
+    {
+        if (view != nullptr)
+        {
+            msync(view, view_size, MS_SYNC);
+            munmap(view, view_size);
+            view = nullptr;
+        }
+        view_size = 0;
+    }
+
+    void close_file()
+    {
+        if (file >= 0)
+        {
+            ::close(file);
+            file = -1;
+        }
+    }
+#endif
+
+    void close_locked()
+    {
+        unmap();
+        close_file();
+        blocks.clear();
+        used = 0;
+        sequence = 0;
+    }
+
+    // 扩大文件并重新映射，块只追加，已有偏移不变
+    bool grow(size_t need)
+    {
+        size_t size = view_size;
+        while (size < need)
+            size *= 2;
+        const size_t current = view_size;
+        unmap();
+        if (map(size))
+            return true;
+        // 扩容失败时按原大小恢复映射
+        map(current);
+        return false;
+    }
+
+    // 选择写入块：本房间非最新的块或空闲块，容量不足时在末尾追加
+    size_t pick(const std::wstring &room, uint32_t length, size_t newest)
+    {
+        size_t free_block = npos;
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            if (i == newest || blocks[i].capacity < length)
+                continue;
+            // 其他房间的有效块不能占用
+            if (blocks[i].seq != 0 && blocks[i].room != room)
+                continue;
+            if (blocks[i].seq != 0)
+                return i;
+            if (free_block == npos)
+                free_block = i;
+        }
+        if (free_block != npos)
+            return free_block;
+        const uint32_t capacity = static_cast<uint32_t>((length + length / 2 + SNAPSHOT_BLOCK_ALIGN - 1) / SNAPSHOT_BLOCK_ALIGN * SNAPSHOT_BLOCK_ALIGN);
+        const size_t end = used + sizeof(snapshot_block) + capacity;
+        if (end > view_size && !grow(end))
+            return npos;
+        auto *block = block_at(used);
+        store_seq(block, 0);
+        block->capacity = capacity;
+        std::atomic_thread_fence(std::memory_order_release);
+        block->magic = SNAPSHOT_BLOCK_MAGIC;
+        blocks.push_back({used, capacity, 0, L""});
+        used = end;
+        return blocks.size() - 1;
+    }
+
+    // 扫描全部块，每个房间取校验通过且序号最大的块
+    void scan(std::vector<record> &out)
+    {
+        size_t offset = sizeof(snapshot_file_header);
+        while (offset + sizeof(snapshot_block) <= view_size)
+        {
+            const auto *block = block_at(offset);
+            if (block->magic != SNAPSHOT_BLOCK_MAGIC || block->capacity == 0 ||
+                block->capacity > view_size - offset - sizeof(snapshot_block))
+                break;
+            block_meta meta{offset, block->capacity, block->seq, L""};
+            const bool valid = meta.seq != 0 && block->length <= block->capacity &&
+                               block->room[SNAPSHOT_ROOM_NAME - 1] == L'\0' && block_crc(block) == block->crc;
+            if (valid)
+                meta.room = block->room;
+            else
+                meta.seq = 0;
+            if (meta.seq > sequence)
+                sequence = meta.seq;
+            blocks.push_back(meta);
+            offset += sizeof(snapshot_block) + block->capacity;
+        }
+        used = offset;
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            if (blocks[i].seq == 0)
+                continue;
+            bool newest = true;
+            for (size_t j = 0; j < blocks.size(); j++)
+            {
+                if (j != i && blocks[j].seq > blocks[i].seq && blocks[j].room == blocks[i].room)
+                    newest = false;
+            }
+            if (!newest)
+                continue;
+            const auto *block = block_at(blocks[i].offset);
+            const auto *payload = reinterpret_cast<const BYTE *>(block) + sizeof(snapshot_block);
+            out.push_back({blocks[i].room, std::vector<BYTE>(payload, payload + block->length)});
+        }
+    }
+};
+
+session_snapshot session_snapshot::snapshot_instance;
+
+#ifdef SESSION_SNAPSHOT_SELFTEST
+// 本地自测：bash lib/selftest.sh session_snapshot
+#include "selftest_compat.h"
+#include "iostream"
+#include "fstream"
+#include "cstddef"
+
+namespace session_snapshot_test
+{
+    const char *const path = "/tmp/session_snapshot_selftest.bin";
+
+    inline std::vector<BYTE> read_file()
+    {
+        std::ifstream in(path, std::ios::binary);
+        return std::vector<BYTE>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    inline void write_file(const std::vector<BYTE> &data)
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+    }
+
+    inline std::vector<BYTE> payload(BYTE fill, size_t size)
+    {
+        std::vector<BYTE> data(size);
+        for (size_t i = 0; i < size; i++)
+            data[i] = static_cast<BYTE>(fill + i);
+        return data;
+    }
+
+    inline std::vector<session_snapshot::record> load()
+    {
+        std::vector<session_snapshot::record> out;
+        auto &snapshot = session_snapshot::getInstance();
+        snapshot.open(path, out);
+        snapshot.close();
+        return out;
+    }
+
+    inline void save(const std::wstring &room, const std::vector<BYTE> &data)
+    {
+        std::vector<session_snapshot::record> ignored;
+        auto &snapshot = session_snapshot::getInstance();
+        snapshot.open(path, ignored);
+        snapshot.save(room, data);
+        snapshot.close();
+    }
+
+    inline const std::vector<BYTE> *find(const std::vector<session_snapshot::record> &records, const std::wstring &room)
+    {
+        for (const auto &r : records)
+        {
+            if (r.room == room)
+                return &r.data;
+        }
+        return nullptr;
+    }
+
+    // 一次写入：zero 为作废序号，否则写入新镜像在该位置的内容
+    struct step
+    {
+        size_t offset;
+        size_t size;
+        bool zero;
+    };
+
+    /**
+     * 按 save 的写入顺序展开块的每次写入：作废序号，新块的容量与标识，房间名、长度、数据、校验逐字节，最后整体写入序号
+     * 序号是 8 字节对齐的单次写，不会被撕裂
+     */
+    inline std::vector<step> save_steps(size_t block, size_t length, bool fresh)
+    {
+        std::vector<step> steps;
+        const auto bytes = [&steps](size_t offset, size_t size)
+        {
+            for (size_t i = 0; i < size; i++)
+                steps.push_back({offset + i, 1, false});
+        };
+        steps.push_back({block + offsetof(snapshot_block, seq), sizeof(uint64_t), true});
+        if (fresh)
+        {
+            bytes(block + offsetof(snapshot_block, capacity), sizeof(uint32_t));
+            bytes(block + offsetof(snapshot_block, magic), sizeof(uint32_t));
+        }
+        bytes(block + offsetof(snapshot_block, room), sizeof(snapshot_block::room));
+        bytes(block + offsetof(snapshot_block, length), sizeof(uint32_t));
+        bytes(block + sizeof(snapshot_block), length);
+        bytes(block + offsetof(snapshot_block, crc), sizeof(uint32_t));
+        steps.push_back({block + offsetof(snapshot_block, seq), sizeof(uint64_t), false});
+        return steps;
+    }
+
+    inline size_t block_after(const std::vector<BYTE> &image, size_t block)
+    {
+        return block + sizeof(snapshot_block) + reinterpret_cast<const snapshot_block *>(image.data() + block)->capacity;
+    }
+
+    /**
+     * 在每个写入位置撕裂：旧镜像加上前 k 次写入后恢复，accept 校验恢复结果，
+     * 之后在撕裂的文件上继续写入新版本，确认恢复后的快照仍可正常使用
+     */
+    template <typename F>
+    int tear(const char *name, const std::vector<BYTE> &before, const std::vector<BYTE> &after, const std::vector<step> &steps, F &&accept)
+    {
+        int bad = 0;
+        for (size_t k = 0; k <= steps.size(); k++)
+        {
+            auto image = before;
+            for (size_t i = 0; i < k; i++)
+            {
+                const auto &s = steps[i];
+                if (s.zero)
+                    memset(image.data() + s.offset, 0, s.size);
+                else
+                    memcpy(image.data() + s.offset, after.data() + s.offset, s.size);
+            }
+            write_file(image);
+            bool ok = accept(load(), k == steps.size());
+            const auto next = payload(0x70, 900);
+            save(L"a", next);
+            const auto records = load();
+            ok = ok && find(records, L"a") != nullptr && *find(records, L"a") == next && find(records, L"b") != nullptr;
+            if (!ok && bad++ == 0)
+                std::cout << "  " << name << " failed at write " << k << "/" << steps.size() << std::endl;
+        }
+        return bad;
+    }
+
+    inline int run()
+    {
+        remove(path);
+        const auto other = payload(0x10, 200);
+        const auto v1 = payload(0x20, 300);
+        const auto v2 = payload(0x30, 500);
+        const auto v3 = payload(0x40, 420);
+        save(L"b", other);
+        save(L"a", v1);
+        const auto s1 = read_file();
+        save(L"a", v2);
+        const auto s2 = read_file();
+        save(L"a", v3);
+        const auto s3 = read_file();
+        const size_t block_b = sizeof(snapshot_file_header);
+        const size_t block_a1 = block_after(s3, block_b);
+        const size_t block_a2 = block_after(s3, block_a1);
+        expect(s1.size() == s3.size(), "snapshot file did not grow");
+
+        const auto matches = [&other](const std::vector<session_snapshot::record> &records, const std::vector<BYTE> &a)
+        {
+            const auto *b = find(records, L"b");
+            const auto *got = find(records, L"a");
+            return b != nullptr && *b == other && got != nullptr && *got == a;
+        };
+        // 追加新块时撕裂：恢复出 v1 或 v2，写完才是 v2
+        const auto fresh = save_steps(block_a2, v2.size(), true);
+        expect(tear("append", s1, s2, fresh, [&](const std::vector<session_snapshot::record> &records, bool complete)
+                    { return complete ? matches(records, v2) : matches(records, v1); }) == 0,
+               "torn append recovers the previous version at each of " + std::to_string(fresh.size() + 1) + " offsets");
+        // 覆盖旧块时撕裂：恢复出 v2 或 v3
+        const auto reuse = save_steps(block_a1, v3.size(), false);
+        expect(tear("overwrite", s2, s3, reuse, [&](const std::vector<session_snapshot::record> &records, bool complete)
+                    { return complete ? matches(records, v3) : matches(records, v2); }) == 0,
+               "torn overwrite recovers the previous version at each of " + std::to_string(reuse.size() + 1) + " offsets");
+        // 删除时撕裂：先作废旧块，再作废最新块，中途只会恢复出最新版本
+        const std::vector<step> erase = {{block_a2 + offsetof(snapshot_block, seq), sizeof(uint64_t), true},
+                                         {block_a1 + offsetof(snapshot_block, seq), sizeof(uint64_t), true}};
+        auto erased = s3;
+        for (const auto &s : erase)
+            memset(erased.data() + s.offset, 0, s.size);
+        expect(tear("erase", s3, erased, erase, [&](const std::vector<session_snapshot::record> &records, bool complete)
+                    { return complete ? find(records, L"a") == nullptr && find(records, L"b") != nullptr : matches(records, v3); }) == 0,
+               "torn erase never resurrects an older version");
+
+        // 写入线程合并标记，停止前写完
+        std::vector<session_snapshot::record> ignored;
+        auto &snapshot = session_snapshot::getInstance();
+        write_file(s3);
+        snapshot.open(path, ignored);
+        int flushes = 0;
+        snapshot.start([&]
+                       { flushes++; snapshot.save(L"a", v1); });
+        for (int i = 0; i < 50; i++)
+            snapshot.touch();
+        snapshot.close();
+        const auto records = load();
+        expect(flushes == 1 && matches(records, v1), "writer coalesces touches and flushes on stop");
+        remove(path);
+        return selftest_result();
+    }
+}
+
+int main()
+{
+    return session_snapshot_test::run();
+}
+#endif
@@ -0,0 +1,503 @@
+#ifdef _WIN32
+#include "src/wireguard.h"
+#include "wireguard_tool.cpp"
+#include "broadcaster.cpp"
+#else
+#include "selftest_compat.h"
+#endif
+#include "peer_stats.cpp"
+#include "mutex"
+#include "vector"
+#include "array"
+#include "memory"
+#include "string"
+#include "cstdio"
+
+#pragma once
+
+// 每个指标的历史容量，默认 5s 采样一次时覆盖 60 分钟
+static constexpr size_t TELEMETRY_HISTORY_SLOTS = 720;
+// 每个房间记录历史的 peer 数上限，超出的 peer 只计入房间汇总
+static constexpr size_t TELEMETRY_PEER_LIMIT = 64;
+// 从未握手时的握手间隔
+static constexpr uint64_t TELEMETRY_NO_HANDSHAKE = UINT64_MAX;
+
+// 房间级采样点，调用方按 48 字节步长解析
+#pragma pack(push, 8)
+struct room_sample
+{
+    uint64_t unix_ms;        // 采样时间
+    uint64_t tx_rate;        // 全部 peer 发送速率之和，字节/秒
+    uint64_t rx_rate;        // 全部 peer 接收速率之和，字节/秒
+    uint64_t forwarded;      // 广播转发累计成功包数
+    uint64_t forward_failed; // 广播转发累计失败包数
+    uint32_t peer_count;
+    uint32_t reserved;
+};
+
+// peer 级采样点，调用方按 64 字节步长解析
+struct peer_sample
+{
+    uint8_t public_key[WIREGUARD_KEY_LENGTH];
+    uint64_t unix_ms;
+    uint64_t tx_rate;
+    uint64_t rx_rate;
+    uint64_t handshake_age_ms; // 距最后握手的毫秒数，从未握手为 UINT64_MAX
+};
+#pragma pack(pop)
+static_assert(sizeof(room_sample) == 48, "room_sample layout changed");
+static_assert(sizeof(peer_sample) == 64, "peer_sample layout changed");
+
+// 定长环形缓冲区，写满后覆盖最旧的采样点
+template <typename T, size_t N>
+class sample_ring
+{
+    std::array<T, N> items{};
+    size_t head = 0;
+    size_t count = 0;
+
+public:
+    void push(const T &item)
+    {
+        items[head] = item;
+        head = (head + 1) % N;
+        if (count < N)
+            count++;
+    }
+
+    void reset()
+    {
+        head = 0;
+        count = 0;
+    }
+
+    // 从旧到新复制 since 之后的采样点，返回符合条件的总数，超出 max 的不写入
+    size_t copy_since(uint64_t since, T *out, size_t max, size_t written) const
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            const auto &item = items[(head + N - count + i) % N];
+            if (item.unix_ms < since)
+                continue;
+            if (written + total < max)
+                out[written + total] = item;
+            total++;
+        }
+        return total;
+    }
+};
+
+// prometheus 导出时的单个房间最新值
+struct room_exposition
+{
+    std::string room;
+    room_sample latest;
+    std::vector<peer_stat> peers;
+};
+
+/**
+ * 单个房间的遥测历史
+ * 房间与每个 peer 各一个定长环形缓冲区，peer 槽位数量有上限，内存不随会话时长增长。
+ * 使用独立的 room_stats 计算速率，不影响 get_peer_stats 调用方的速率基准
+ */
+class room_telemetry
+{
+    struct peer_series
+    {
+        bool used = false;
+        bool seen = false;
+        uint8_t public_key[WIREGUARD_KEY_LENGTH]{};
+        std::unique_ptr<sample_ring<peer_sample, TELEMETRY_HISTORY_SLOTS>> history;
+    };
+
+    std::mutex lock;
+    room_stats stats;
+    std::vector<peer_stat> scratch = std::vector<peer_stat>(TELEMETRY_PEER_LIMIT);
+    sample_ring<room_sample, TELEMETRY_HISTORY_SLOTS> history;
+    std::array<peer_series, TELEMETRY_PEER_LIMIT> peers;
+    room_sample latest{};
+    size_t latest_count = 0;
+
+    // 查找或分配 peer 槽位，槽位已满返回 nullptr，释放的槽位保留缓冲区复用
+    peer_series *series_of(const uint8_t *key)
+    {
+        peer_series *free_slot = nullptr;
+        for (auto &p : peers)
+        {
+            if (p.used && memcmp(p.public_key, key, WIREGUARD_KEY_LENGTH) == 0)
+                return &p;
+            if (!p.used && free_slot == nullptr)
+                free_slot = &p;
+        }
+        if (free_slot == nullptr)
+            return nullptr;
+        free_slot->used = true;
+        memcpy(free_slot->public_key, key, WIREGUARD_KEY_LENGTH);
+        if (free_slot->history == nullptr)
+            free_slot->history = std::make_unique<sample_ring<peer_sample, TELEMETRY_HISTORY_SLOTS>>();
+        else
+            free_slot->history->reset();
+        return free_slot;
+    }
+
+public:
+    // 以共享采样线程查询到的配置采样一次，config 为空时跳过，trans 可为空
+    bool sample(const WIREGUARD_INTERFACE *config, const transporter *trans,
+                std::chrono::steady_clock::time_point now, uint64_t now_ms)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t total = 0;
+        if (!stats.snapshot(config, now, scratch.data(), scratch.size(), total))
+            return false;
+        // 缓冲区不足时扩容，本次超出部分不计入，下次采样起完整
+        const size_t n = total < scratch.size() ? total : scratch.size();
+        if (total > scratch.size())
+            scratch.resize(total);
+
+        room_sample room{};
+        room.unix_ms = now_ms;
+        room.peer_count = static_cast<uint32_t>(total);
+        if (trans != nullptr)
+        {
+            room.forwarded = trans->forwarded_count();
+            room.forward_failed = trans->failed_count();
+        }
+        for (auto &p : peers)
+            p.seen = false;
+        for (size_t i = 0; i < n; i++)
+        {
+            const auto &stat = scratch[i];
+            room.tx_rate += stat.tx_rate;
+            room.rx_rate += stat.rx_rate;
+            auto *series = series_of(stat.public_key);
+            if (series == nullptr)
+                continue;
+            series->seen = true;
+            peer_sample ps{};
+            memcpy(ps.public_key, stat.public_key, WIREGUARD_KEY_LENGTH);
+            ps.unix_ms = now_ms;
+            ps.tx_rate = stat.tx_rate;
+            ps.rx_rate = stat.rx_rate;
+            ps.handshake_age_ms = stat.last_handshake_ms == 0 || stat.last_handshake_ms > now_ms
+                                      ? TELEMETRY_NO_HANDSHAKE
+                                      : now_ms - stat.last_handshake_ms;
+            series->history->push(ps);
+        }
+        // 已删除的 peer 释放槽位
+        for (auto &p : peers)
+        {
+            if (p.used && !p.seen)
+                p.used = false;
+        }
+        history.push(room);
+        latest = room;
+        latest_count = n;
+        return true;
+    }
+
+    size_t query_room(uint64_t since, room_sample *out, size_t max)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return history.copy_since(since, out, max, 0);
+    }
+
+    // 按 peer 分组、组内从旧到新输出
+    size_t query_peers(uint64_t since, peer_sample *out, size_t max)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t total = 0;
+        for (const auto &p : peers)
+        {
+            if (p.used)
+                total += p.history->copy_since(since, out, max, total);
+        }
+        return total;
+    }
+
+    // 复制最新一次采样，用于文本导出
+    void expose(room_exposition &out)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        out.latest = latest;
+        out.peers.assign(scratch.begin(), scratch.begin() + latest_count);
+    }
+};
+
+namespace formmater
+{
+    // 宽字符房间名转 utf8
+    inline std::string to_utf8(const std::wstring &value)
+    {
+        if (value.empty())
+            return {};
+        const int size = WideCharToMultiByte(CP_UTF8, 0, value.c_str(), static_cast<int>(value.size()), nullptr, 0, nullptr, nullptr);
+        std::string out(size, '\0');
+        WideCharToMultiByte(CP_UTF8, 0, value.c_str(), static_cast<int>(value.size()), &out[0], size, nullptr, nullptr);
+        return out;
+    }
+
+    // prometheus 标签值转义
+    inline void append_label(std::string &out, const std::string &value)
+    {
+        for (const char c : value)
+        {
+            if (c == '\\' || c == '"')
+            {
+                out += '\\';
+                out += c;
+            }
+            else if (c == '\n')
+                out += "\\n";
+            else
+                out += c;
+        }
+    }
+
+    /**
+     * 按 prometheus 文本格式输出各房间最新采样，同名指标连续输出
+     */
+    inline std::string prometheus_text(const std::vector<room_exposition> &rooms, uint64_t now_ms)
+    {
+        std::string out;
+        out.reserve(256 + rooms.size() * 1024);
+        const auto room_metric = [&](const char *name, const char *type, const char *help, auto value)
+        {
+            out += "# HELP ";
+            out += name;
+            out += ' ';
+            out += help;
+            out += "\n# TYPE ";
+            out += name;
+            out += ' ';
+            out += type;
+            out += '\n';
+            for (const auto &r : rooms)
+            {
+                out += name;
+                out += "{room=\"";
+                append_label(out, r.room);
+                out += "\"} ";
+                out += std::to_string(value(r));
+                out += '\n';
+            }
+        };
+        const auto peer_metric = [&](const char *name, const char *type, const char *help, auto value)
+        {
+            out += "# HELP ";
+            out += name;
+            out += ' ';
+            out += help;
+            out += "\n# TYPE ";
+            out += name;
+            out += ' ';
+            out += type;
+            out += '\n';
+            for (const auto &r : rooms)
+            {
+                for (const auto &p : r.peers)
+                {
+                    uint64_t v;
+                    if (!value(p, v))
+                        continue;
+                    out += name;
+                    out += "{room=\"";
+                    append_label(out, r.room);
+                    out += "\",peer=\"";
+                    out += base64_encode(p.public_key, WIREGUARD_KEY_LENGTH);
+                    out += "\"} ";
+                    out += std::to_string(v);
+                    out += '\n';
+                }
+            }
+        };
+
+        room_metric("mole_room_peers", "gauge", "Peers configured in the room.",
+                    [](const room_exposition &r)
+                    { return r.latest.peer_count; });
+        room_metric("mole_room_tx_bytes_per_second", "gauge", "Sum of peer transmit rates.",
+                    [](const room_exposition &r)
+                    { return r.latest.tx_rate; });
+        room_metric("mole_room_rx_bytes_per_second", "gauge", "Sum of peer receive rates.",
+                    [](const room_exposition &r)
+                    { return r.latest.rx_rate; });
+        room_metric("mole_transporter_forwarded_packets_total", "counter", "Broadcast packets forwarded to peers.",
+                    [](const room_exposition &r)
+                    { return r.latest.forwarded; });
+        room_metric("mole_transporter_failed_packets_total", "counter", "Broadcast packets that failed to forward.",
+                    [](const room_exposition &r)
+                    { return r.latest.forward_failed; });
+        peer_metric("mole_peer_tx_bytes_total", "counter", "Bytes sent to the peer.",
+                    [](const peer_stat &p, uint64_t &v)
+                    { v = p.tx_bytes; return true; });
+        peer_metric("mole_peer_rx_bytes_total", "counter", "Bytes received from the peer.",
+                    [](const peer_stat &p, uint64_t &v)
+                    { v = p.rx_bytes; return true; });
+        peer_metric("mole_peer_tx_bytes_per_second", "gauge", "Transmit rate to the peer.",
+                    [](const peer_stat &p, uint64_t &v)
+                    { v = p.tx_rate; return true; });
+        peer_metric("mole_peer_rx_bytes_per_second", "gauge", "Receive rate from the peer.",
+                    [](const peer_stat &p, uint64_t &v)
+                    { v = p.rx_rate; return true; });
+        peer_metric("mole_peer_handshake_age_seconds", "gauge", "Seconds since the last handshake, absent if never.",
+                    [now_ms](const peer_stat &p, uint64_t &v)
+                    {
+                        if (p.last_handshake_ms == 0 || p.last_handshake_ms > now_ms)
+                            return false;
+                        v = (now_ms - p.last_handshake_ms) / 1000;
+                        return true; });
+        return out;
+    }
+}
+
+// 先写临时文件再替换，采集端不会读到半个文件
+inline bool write_text_file(const std::string &path, const std::string &text)
+{
+    const std::string tmp = path + ".tmp";
+    FILE *f = nullptr;
+    if (fopen_s(&f, tmp.c_str(), "wb") != 0 || f == nullptr)
+    {
+        log(WIREGUARD_LOG_ERR, "open telemetry dump failed:" + tmp);
+        return false;
+    }
+    const bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    fclose(f);
+    if (!ok || !MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        log(WIREGUARD_LOG_ERR, "write telemetry dump failed:" + path, GetLastError());
+        return false;
+    }
+    return true;
+}
+
+#ifdef TELEMETRY_SELFTEST
+// 本地自测：bash lib/selftest.sh telemetry
+// 环形历史的覆盖与 since 查询、房间与 peer 采样、槽位回收，以及 prometheus 文本与落盘
+#include "selftest_compat.h"
+#include "fstream"
+#include "sstream"
+
+namespace telemetry_test
+{
+    inline std::string read_file(const std::string &path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::stringstream ss;
+        ss << in.rdbuf();
+        return ss.str();
+    }
+
+    inline bool contains(const std::string &text, const std::string &part)
+    {
+        return text.find(part) != std::string::npos;
+    }
+
+    inline int run()
+    {
+        using namespace std::chrono;
+
+        // 写满后覆盖最旧的点，按时间从旧到新输出
+        sample_ring<room_sample, 4> ring;
+        for (uint64_t ms = 1; ms <= 6; ms++)
+        {
+            room_sample s{};
+            s.unix_ms = ms;
+            ring.push(s);
+        }
+        room_sample out[8]{};
+        expect(ring.copy_since(0, out, 8, 0) == 4 && out[0].unix_ms == 3 && out[3].unix_ms == 6, "full ring keeps the newest samples oldest first");
+        expect(ring.copy_since(5, out, 8, 0) == 2 && out[0].unix_ms == 5 && out[1].unix_ms == 6, "since filters older samples");
+        expect(ring.copy_since(7, out, 8, 0) == 0, "since after the newest sample is empty");
+        out[2].unix_ms = 99;
+        expect(ring.copy_since(0, out, 2, 0) == 4 && out[1].unix_ms == 4 && out[2].unix_ms == 99, "total reported beyond max, extra samples not written");
+        expect(ring.copy_since(4, out, 3, 2) == 3 && out[2].unix_ms == 4, "written offset appends after earlier output");
+        ring.reset();
+        expect(ring.copy_since(0, out, 8, 0) == 0, "reset empties the ring");
+
+        // 房间采样：速率按 peer 求和，转发计数来自 transporter
+        const auto t0 = steady_clock::now();
+        const uint64_t ms0 = 1700000000000ull;
+        room_telemetry telemetry;
+        transporter trans;
+        selftest_config conf;
+        conf.add_peer(1, 1000, 1000).LastHandshake = FILETIME_UNIX_EPOCH + (ms0 - 4000) * 10000;
+        conf.add_peer(2, 1000, 1000);
+        expect(telemetry.sample(conf.get(), &trans, t0, ms0), "first sample recorded");
+        conf.peer(0).TxBytes += 5000;
+        conf.peer(1).RxBytes += 10000;
+        trans.forwarded = 7;
+        trans.failed = 2;
+        telemetry.sample(conf.get(), &trans, t0 + seconds(5), ms0 + 5000);
+        room_sample rooms[4]{};
+        expect(telemetry.query_room(0, rooms, 4) == 2 && rooms[1].tx_rate == 1000 && rooms[1].rx_rate == 2000 &&
+                   rooms[1].peer_count == 2 && rooms[1].forwarded == 7 && rooms[1].forward_failed == 2,
+               "room sample sums peer rates and carries transporter counters");
+        expect(telemetry.query_room(ms0 + 1, rooms, 4) == 1 && rooms[0].unix_ms == ms0 + 5000, "room history queried since a time");
+        expect(!telemetry.sample(nullptr, &trans, t0 + seconds(6), ms0 + 6000) && telemetry.query_room(0, rooms, 4) == 2,
+               "failed query adds no sample");
+
+        // peer 历史按 peer 分组、组内从旧到新；从未握手记为 UINT64_MAX
+        peer_sample peers[8]{};
+        const size_t n = telemetry.query_peers(0, peers, 8);
+        expect(n == 4 && peers[0].public_key[0] == 1 && peers[1].public_key[0] == 1 && peers[1].unix_ms == ms0 + 5000 &&
+                   peers[1].tx_rate == 1000 && peers[3].rx_rate == 2000,
+               "peer history grouped by peer, oldest first");
+        expect(peers[1].handshake_age_ms == 9000 && peers[2].handshake_age_ms == TELEMETRY_NO_HANDSHAKE, "handshake age, never handshaken marked");
+        expect(telemetry.query_peers(ms0 + 1, peers, 8) == 2, "peer history queried since a time");
+
+        // 删除的 peer 释放槽位，重新加入时历史从头开始
+        selftest_config only_two;
+        only_two.add_peer(2, 1000, 11000);
+        telemetry.sample(only_two.get(), &trans, t0 + seconds(10), ms0 + 10000);
+        expect(telemetry.query_peers(0, peers, 8) == 3 && peers[0].public_key[0] == 2, "removed peer history dropped");
+        telemetry.sample(conf.get(), &trans, t0 + seconds(15), ms0 + 15000);
+        size_t returned = 0;
+        const size_t all = telemetry.query_peers(0, peers, 8);
+        for (size_t i = 0; i < all; i++)
+            returned += peers[i].public_key[0] == 1;
+        expect(returned == 1, "re-added peer starts a fresh history");
+
+        // 超过 peer 槽位上限：房间汇总计入全部 peer，只有前 TELEMETRY_PEER_LIMIT 个有历史
+        room_telemetry crowded;
+        selftest_config crowd;
+        for (size_t i = 0; i < TELEMETRY_PEER_LIMIT + 6; i++)
+            crowd.add_peer(static_cast<uint8_t>(i + 1), 0, 0);
+        crowded.sample(crowd.get(), nullptr, t0, ms0);
+        crowded.sample(crowd.get(), nullptr, t0 + seconds(1), ms0 + 1000);
+        for (size_t i = 0; i < TELEMETRY_PEER_LIMIT + 6; i++)
+            crowd.peer(i).TxBytes += 100;
+        crowded.sample(crowd.get(), nullptr, t0 + seconds(2), ms0 + 2000);
+        std::vector<peer_sample> crowd_out(4 * TELEMETRY_PEER_LIMIT);
+        expect(crowded.query_room(ms0 + 2000, rooms, 4) == 1 && rooms[0].peer_count == TELEMETRY_PEER_LIMIT + 6 &&
+                   rooms[0].tx_rate == 100 * (TELEMETRY_PEER_LIMIT + 6),
+               "room totals include peers beyond the history limit");
+        expect(crowded.query_peers(ms0 + 2000, crowd_out.data(), crowd_out.size()) == TELEMETRY_PEER_LIMIT, "peer history capped at the slot limit");
+
+        // prometheus 文本：标签转义、握手缺失时不输出该 peer 的握手指标
+        std::vector<room_exposition> expo(1);
+        expo[0].room = formmater::to_utf8(L"房\"间\\");
+        telemetry.expose(expo[0]);
+        const auto text = formmater::prometheus_text(expo, ms0 + 15000);
+        const std::string key1 = formmater::base64_encode(conf.peer(0).PublicKey, WIREGUARD_KEY_LENGTH);
+        expect(expo[0].room == "\xE6\x88\xBF\"\xE9\x97\xB4\\", "room name converted to utf8");
+        expect(contains(text, "mole_room_peers{room=\"\xE6\x88\xBF\\\"\xE9\x97\xB4\\\\\"} 2\n"), "room label escaped");
+        expect(contains(text, "# TYPE mole_transporter_failed_packets_total counter\n") &&
+                   contains(text, "mole_peer_tx_bytes_total{room=\"\xE6\x88\xBF\\\"\xE9\x97\xB4\\\\\",peer=\"" + key1 + "\"} 6000\n"),
+               "metric types and peer labels");
+        expect(contains(text, "mole_peer_handshake_age_seconds{room=\"\xE6\x88\xBF\\\"\xE9\x97\xB4\\\\\",peer=\"" + key1 + "\"} 19\n") &&
+                   text.find("mole_peer_handshake_age_seconds{") == text.rfind("mole_peer_handshake_age_seconds{"),
+               "handshake age only for peers that handshook");
+
+        // 先写临时文件再替换
+        const std::string path = "telemetry_selftest.prom";
+        expect(write_text_file(path, text) && read_file(path) == text && read_file(path + ".tmp").empty(), "dump replaced atomically");
+        std::remove(path.c_str());
+        return selftest_result();
+    }
+}
+
+int main()
+{
+    return telemetry_test::run();
+}
+#endif
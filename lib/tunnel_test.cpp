@@ -0,0 +1,957 @@
+#include "hole_punch.cpp"
+#include "latency_probe.cpp"
+#include "algorithm"
+#include "atomic"
+#include "chrono"
+#include "mutex"
+#include "random"
+#include "thread"
+#include "vector"
+
+#pragma once
+
+/**
+ * 隧道自测，类似 iperf 的 UDP 测试，在两个房间成员的虚拟 IP 之间运行
+ * 发起端先空载发送时延探测，再按限速发送定长数据报文（或请求对端发送），同时继续探测时延；
+ * 结束后由接收方汇报收到的报文数与字节数，得到吞吐、丢包、空载与负载下的时延。
+ * 时长与速率都有上限，对端同一时间只接受一个测试，不能被用作流量放大
+ */
+
+// 报文标识 "MTST" 与版本
+static constexpr uint32_t TUNNEL_TEST_MAGIC = 0x4D545354;
+static constexpr uint8_t TUNNEL_TEST_VERSION = 1;
+// 报文头：0 magic u32 | 4 version u8 | 5 type u8 | 6 flags u16 | 8 test u32 | 12 seq u32 | 16 stamp u64(us)
+static constexpr size_t TUNNEL_HEADER_SIZE = 24;
+// 开始：24 direction u8 | 25 保留 | 26 size u16 | 28 rate_kbps u32 | 32 duration_ms u32
+static constexpr size_t TUNNEL_START_SIZE = 36;
+// 汇报：24 received u32 | 28 sent u32 | 32 bytes u64 | 40 throughput_bps u64 | 48 reordered u32
+static constexpr size_t TUNNEL_REPORT_SIZE = 52;
+// 默认的对端端口
+static constexpr uint16_t TUNNEL_TEST_PORT = 51831;
+// 测试时长与速率上限，请求超出时按上限运行
+static constexpr uint32_t TUNNEL_TEST_MAX_MS = 10000;
+static constexpr uint32_t TUNNEL_TEST_MAX_KBPS = 100000;
+static constexpr uint32_t TUNNEL_TEST_DEFAULT_MS = 3000;
+static constexpr uint32_t TUNNEL_TEST_DEFAULT_KBPS = 20000;
+// 数据报文长度：隧道 MTU(1420) 减去内层 IP/UDP 头
+static constexpr uint16_t TUNNEL_TEST_MAX_SIZE = 1392;
+static constexpr uint16_t TUNNEL_TEST_DEFAULT_SIZE = 1200;
+// 空载时延阶段时长与时延探测间隔(ms)
+static constexpr uint32_t TUNNEL_IDLE_PHASE_MS = 500;
+static constexpr uint32_t TUNNEL_PING_MS = 10;
+// 控制报文的等待时间与重发次数
+static constexpr uint32_t TUNNEL_CONTROL_WAIT_MS = 300;
+static constexpr int TUNNEL_CONTROL_TRIES = 4;
+// 负载阶段结束后等待在途报文的时长(ms)
+static constexpr uint32_t TUNNEL_DRAIN_MS = 300;
+// 对端会话无报文后视为结束的时长(ms)，之后可接受其他成员的测试
+static constexpr uint32_t TUNNEL_SESSION_IDLE_MS = 2000;
+// 按限速发送时一次补发的最大报文数，落后更多时不再追赶
+static constexpr int TUNNEL_MAX_BURST = 32;
+static constexpr int TUNNEL_SOCKET_BUFFER = 4 << 20;
+
+enum tunnel_message_type : uint8_t
+{
+    TUNNEL_START = 1,
+    TUNNEL_START_ACK = 2,
+    TUNNEL_DATA = 3,
+    TUNNEL_PING = 4,
+    TUNNEL_PONG = 5,
+    TUNNEL_FINISH = 6,
+    TUNNEL_REPORT = 7,
+};
+
+// START_ACK 的 flags：对端正在与其他成员测试
+static constexpr uint16_t TUNNEL_FLAG_BUSY = 1;
+// PING 的 flags：负载阶段的探测，应答原样带回
+static constexpr uint16_t TUNNEL_FLAG_LOADED = 1;
+
+enum tunnel_status : int32_t
+{
+    TUNNEL_OK = 0,
+    TUNNEL_NO_RESPONSE = 1, // 对端未开启自测或不可达
+    TUNNEL_BUSY = 2,        // 对端正在与其他成员测试
+    TUNNEL_ERROR = 3,       // 参数错误或本地套接字失败
+    TUNNEL_CANCELLED = 4,
+    TUNNEL_RUNNING = 5,     // 测试进行中，只用于查询
+    TUNNEL_NO_REPORT = 6,   // 负载阶段完成但未收到对端汇报，吞吐与丢包不可用
+};
+
+// 导出给调用方的测试结果，调用方按 72 字节解析
+#pragma pack(push, 8)
+struct tunnel_result
+{
+    int32_t status;
+    uint32_t reverse;         // 1 表示对端发送、本端接收
+    uint32_t duration_ms;     // 实际负载时长
+    uint32_t rate_kbps;       // 实际限速
+    uint64_t throughput_bps;  // 接收方测得的有效吞吐
+    uint32_t sent;            // 数据报文
+    uint32_t received;
+    uint32_t loss;            // 数据报文丢包率（千分比）
+    uint32_t reordered;       // 乱序到达的数据报文
+    uint32_t idle_rtt_us;     // 空载往返时延中位数
+    uint32_t load_p50_us;     // 负载下往返时延
+    uint32_t load_p99_us;
+    uint32_t load_max_us;
+    uint32_t jitter_us;       // 负载下相邻往返时延差的平滑值
+    uint32_t pings_sent;
+    uint32_t pings_lost;
+    uint32_t reserved;
+};
+#pragma pack(pop)
+static_assert(sizeof(tunnel_result) == 72, "tunnel_result layout changed");
+
+struct tunnel_message
+{
+    uint8_t type = 0;
+    uint16_t flags = 0;
+    uint32_t test = 0;
+    uint32_t seq = 0;
+    uint64_t stamp = 0;
+    // START
+    uint8_t reverse = 0;
+    uint16_t size = 0;
+    uint32_t rate_kbps = 0;
+    uint32_t duration_ms = 0;
+    // REPORT
+    uint32_t received = 0;
+    uint32_t sent = 0;
+    uint64_t bytes = 0;
+    uint64_t throughput_bps = 0; // 接收方测得的吞吐
+    uint32_t reordered = 0;
+
+    // 编码到 out，返回报文长度；DATA 由调用方补足到数据长度
+    size_t encode(uint8_t *out) const
+    {
+        put(out, TUNNEL_TEST_MAGIC, 4);
+        out[4] = TUNNEL_TEST_VERSION;
+        out[5] = type;
+        put(out + 6, flags, 2);
+        put(out + 8, test, 4);
+        put(out + 12, seq, 4);
+        put(out + 16, stamp, 8);
+        if (type == TUNNEL_START)
+        {
+            out[24] = reverse;
+            out[25] = 0;
+            put(out + 26, size, 2);
+            put(out + 28, rate_kbps, 4);
+            put(out + 32, duration_ms, 4);
+            return TUNNEL_START_SIZE;
+        }
+        if (type == TUNNEL_REPORT)
+        {
+            put(out + 24, received, 4);
+            put(out + 28, sent, 4);
+            put(out + 32, bytes, 8);
+            put(out + 40, throughput_bps, 8);
+            put(out + 48, reordered, 4);
+            return TUNNEL_REPORT_SIZE;
+        }
+        return TUNNEL_HEADER_SIZE;
+    }
+
+    bool decode(const uint8_t *in, size_t len)
+    {
+        if (len < TUNNEL_HEADER_SIZE || get(in, 4) != TUNNEL_TEST_MAGIC || in[4] != TUNNEL_TEST_VERSION)
+            return false;
+        type = in[5];
+        flags = static_cast<uint16_t>(get(in + 6, 2));
+        test = static_cast<uint32_t>(get(in + 8, 4));
+        seq = static_cast<uint32_t>(get(in + 12, 4));
+        stamp = get(in + 16, 8);
+        if (type == TUNNEL_START)
+        {
+            if (len < TUNNEL_START_SIZE)
+                return false;
+            reverse = in[24];
+            size = static_cast<uint16_t>(get(in + 26, 2));
+            rate_kbps = static_cast<uint32_t>(get(in + 28, 4));
+            duration_ms = static_cast<uint32_t>(get(in + 32, 4));
+        }
+        else if (type == TUNNEL_REPORT)
+        {
+            if (len < TUNNEL_REPORT_SIZE)
+                return false;
+            received = static_cast<uint32_t>(get(in + 24, 4));
+            sent = static_cast<uint32_t>(get(in + 28, 4));
+            bytes = get(in + 32, 8);
+            throughput_bps = get(in + 40, 8);
+            reordered = static_cast<uint32_t>(get(in + 48, 4));
+        }
+        return type >= TUNNEL_START && type <= TUNNEL_REPORT;
+    }
+
+    // 时长、速率与报文长度按上限修正，0 使用默认值
+    void clamp()
+    {
+        duration_ms = duration_ms == 0 ? TUNNEL_TEST_DEFAULT_MS : std::min(duration_ms, TUNNEL_TEST_MAX_MS);
+        rate_kbps = rate_kbps == 0 ? TUNNEL_TEST_DEFAULT_KBPS : std::min(rate_kbps, TUNNEL_TEST_MAX_KBPS);
+        size = size == 0 ? TUNNEL_TEST_DEFAULT_SIZE : std::max<uint16_t>(static_cast<uint16_t>(TUNNEL_REPORT_SIZE), std::min(size, TUNNEL_TEST_MAX_SIZE));
+    }
+
+private:
+    static void put(uint8_t *out, uint64_t value, int bytes)
+    {
+        for (int i = bytes - 1; i >= 0; i--)
+        {
+            out[i] = static_cast<uint8_t>(value);
+            value >>= 8;
+        }
+    }
+
+    static uint64_t get(const uint8_t *in, int bytes)
+    {
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++)
+            value = (value << 8) | in[i];
+        return value;
+    }
+};
+
+inline uint64_t tunnel_now_us()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// 按限速发送的节拍，落后超过 TUNNEL_MAX_BURST 个报文时从当前时间重新开始
+class tunnel_pacer
+{
+    uint64_t next_us = 0;
+    uint64_t interval_us = 0;
+
+public:
+    void reset(uint32_t rate_kbps, uint16_t size, uint64_t now_us)
+    {
+        interval_us = std::max<uint64_t>(1, static_cast<uint64_t>(size) * 8 * 1000 / rate_kbps);
+        next_us = now_us;
+    }
+
+    // 当前可发送的报文数
+    int due(uint64_t now_us)
+    {
+        if (now_us < next_us)
+            return 0;
+        if (now_us - next_us > interval_us * TUNNEL_MAX_BURST)
+            next_us = now_us - interval_us * (TUNNEL_MAX_BURST - 1);
+        return static_cast<int>(std::min<uint64_t>(TUNNEL_MAX_BURST, (now_us - next_us) / interval_us + 1));
+    }
+
+    void sent(int count)
+    {
+        next_us += interval_us * static_cast<uint64_t>(count);
+    }
+
+    // 距下一个报文的等待(us)
+    uint64_t wait_us(uint64_t now_us) const
+    {
+        return next_us > now_us ? next_us - now_us : 0;
+    }
+};
+
+// 数据接收统计，发起端（反向测试）与对端共用
+struct tunnel_counter
+{
+    uint32_t received = 0;
+    uint32_t max_seq = 0;
+    uint32_t reordered = 0;
+    uint64_t bytes = 0;
+    uint64_t first_us = 0;
+    uint64_t last_us = 0;
+
+    void add(uint32_t seq, size_t len, uint64_t now_us)
+    {
+        if (received == 0)
+            first_us = now_us;
+        else if (seq < max_seq)
+            reordered++;
+        max_seq = std::max(max_seq, seq);
+        last_us = now_us;
+        received++;
+        bytes += len;
+    }
+
+    // 吞吐按首末报文之间的时长计算，补上一个报文的间隔
+    uint64_t throughput_bps() const
+    {
+        if (received < 2 || last_us <= first_us)
+            return 0;
+        const uint64_t span = last_us - first_us;
+        return bytes * 8 * 1000000 / (span + span / (received - 1));
+    }
+};
+
+inline punch_socket tunnel_open(const sockaddr_in &local)
+{
+    const punch_socket s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s == PUNCH_INVALID_SOCKET)
+        return s;
+    int size = TUNNEL_SOCKET_BUFFER;
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char *>(&size), sizeof(size));
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char *>(&size), sizeof(size));
+    if (bind(s, reinterpret_cast<const sockaddr *>(&local), sizeof(local)) != 0)
+    {
+        punch_close(s);
+        return PUNCH_INVALID_SOCKET;
+    }
+    return s;
+}
+
+/**
+ * 自测对端，绑定本端虚拟 IP，收到开始报文后接收数据或按请求的限速发送数据，收到结束报文后汇报
+ * 同一时间只服务一个测试，其他成员的请求回复忙；时延探测任何时候都直接应答
+ */
+class tunnel_responder
+{
+    struct session
+    {
+        bool active = false;
+        bool finished = false; // 已汇报，保留会话只为应答重发的结束报文
+        uint32_t test = 0;
+        sockaddr_in peer{};
+        tunnel_message params;
+        tunnel_counter counter;
+        uint64_t last_us = 0;
+        // 反向测试：本端发送
+        bool sending = false;
+        uint32_t sent = 0;
+        uint64_t send_until_us = 0;
+        tunnel_pacer pacer;
+    };
+
+    punch_socket sock = PUNCH_INVALID_SOCKET;
+    std::thread worker;
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> served{0};
+    session current;
+
+    void send(const sockaddr_in &to, const uint8_t *data, size_t len)
+    {
+        sendto(sock, reinterpret_cast<const char *>(data), static_cast<int>(len), 0, reinterpret_cast<const sockaddr *>(&to), sizeof(to));
+    }
+
+    static bool same(const sockaddr_in &a, const sockaddr_in &b)
+    {
+        return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+    }
+
+    void on_message(const tunnel_message &msg, size_t len, const sockaddr_in &from, uint64_t now)
+    {
+        uint8_t out[TUNNEL_REPORT_SIZE];
+        if (msg.type == TUNNEL_PING)
+        {
+            tunnel_message pong = msg;
+            pong.type = TUNNEL_PONG;
+            send(from, out, pong.encode(out));
+            return;
+        }
+        const bool mine = current.active && current.test == msg.test && same(current.peer, from);
+        if (msg.type == TUNNEL_START)
+        {
+            tunnel_message ack{};
+            ack.type = TUNNEL_START_ACK;
+            ack.test = msg.test;
+            if (!mine && current.active && !current.finished && now - current.last_us < TUNNEL_SESSION_IDLE_MS * 1000ull)
+            {
+                ack.flags = TUNNEL_FLAG_BUSY;
+                send(from, out, ack.encode(out));
+                return;
+            }
+            if (!mine)
+            {
+                current = session{};
+                current.active = true;
+                current.test = msg.test;
+                current.peer = from;
+                current.params = msg;
+                current.params.clamp();
+                if (current.params.reverse != 0)
+                {
+                    current.sending = true;
+                    // 发起端先测空载时延，之后开始发送
+                    current.pacer.reset(current.params.rate_kbps, current.params.size, now + TUNNEL_IDLE_PHASE_MS * 1000ull);
+                    current.send_until_us = now + (TUNNEL_IDLE_PHASE_MS + current.params.duration_ms) * 1000ull;
+                }
+                served.fetch_add(1);
+            }
+            current.last_us = now;
+            send(from, out, ack.encode(out));
+            return;
+        }
+        if (!mine)
+            return;
+        current.last_us = now;
+        if (msg.type == TUNNEL_DATA)
+            current.counter.add(msg.seq, len, now);
+        else if (msg.type == TUNNEL_FINISH)
+        {
+            current.sending = false;
+            current.finished = true;
+            tunnel_message report{};
+            report.type = TUNNEL_REPORT;
+            report.test = msg.test;
+            report.received = current.counter.received;
+            report.sent = current.sent;
+            report.bytes = current.counter.bytes;
+            report.throughput_bps = current.counter.throughput_bps();
+            report.reordered = current.counter.reordered;
+            send(from, out, report.encode(out));
+        }
+    }
+
+    // 反向测试按限速发送，返回距下一个报文的等待(ms)
+    int send_due(uint64_t now)
+    {
+        if (!current.sending)
+            return LATENCY_IDLE_WAIT_MS;
+        if (now >= current.send_until_us)
+        {
+            current.sending = false;
+            return LATENCY_IDLE_WAIT_MS;
+        }
+        uint8_t buf[TUNNEL_TEST_MAX_SIZE] = {};
+        const int count = current.pacer.due(now);
+        for (int i = 0; i < count; i++)
+        {
+            tunnel_message data{};
+            data.type = TUNNEL_DATA;
+            data.test = current.test;
+            data.seq = current.sent++;
+            data.stamp = now;
+            data.encode(buf);
+            send(current.peer, buf, current.params.size);
+        }
+        current.pacer.sent(count);
+        // 不足 1ms 的间隔由下一轮的补发追上，避免空转
+        return std::max(1, static_cast<int>(current.pacer.wait_us(tunnel_now_us()) / 1000));
+    }
+
+    void run()
+    {
+        uint8_t buf[2048];
+        pollfd fd{};
+        fd.fd = sock;
+        fd.events = POLLIN;
+        int wait_ms = LATENCY_IDLE_WAIT_MS;
+        while (!stopping.load())
+        {
+            if (punch_poll(&fd, 1, wait_ms) > 0)
+            {
+                // 一次取完已到达的报文，数据报文较多时不逐个等待 poll
+                for (int i = 0; i < 256; i++)
+                {
+                    sockaddr_in from{};
+                    socklen_t from_len = sizeof(from);
+                    const int n = recvfrom(sock, reinterpret_cast<char *>(buf), sizeof(buf), 0, reinterpret_cast<sockaddr *>(&from), &from_len);
+                    if (n <= 0)
+                        break;
+                    tunnel_message msg{};
+                    if (msg.decode(buf, static_cast<size_t>(n)))
+                        on_message(msg, static_cast<size_t>(n), from, tunnel_now_us());
+                    pollfd more = fd;
+                    if (punch_poll(&more, 1, 0) <= 0)
+                        break;
+                }
+            }
+            const uint64_t now = tunnel_now_us();
+            if (current.active && now - current.last_us > TUNNEL_SESSION_IDLE_MS * 1000ull && !current.sending)
+                current.active = false;
+            wait_ms = send_due(now);
+        }
+    }
+
+public:
+    tunnel_responder() = default;
+    tunnel_responder(const tunnel_responder &) = delete;
+    tunnel_responder &operator=(const tunnel_responder &) = delete;
+
+    ~tunnel_responder()
+    {
+        close();
+    }
+
+    // ip 为网络序的本端虚拟 IP
+    bool open(uint32_t ip, uint16_t port)
+    {
+        if (opened())
+            return true;
+        sockaddr_in local{};
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = ip;
+        local.sin_port = htons(port);
+        sock = tunnel_open(local);
+        if (sock == PUNCH_INVALID_SOCKET)
+            return false;
+        stopping.store(false);
+        worker = std::thread(&tunnel_responder::run, this);
+        return true;
+    }
+
+    void close()
+    {
+        stopping.store(true);
+        if (worker.joinable())
+            worker.join();
+        if (sock != PUNCH_INVALID_SOCKET)
+        {
+            punch_close(sock);
+            sock = PUNCH_INVALID_SOCKET;
+        }
+        current = session{};
+    }
+
+    bool opened() const { return sock != PUNCH_INVALID_SOCKET; }
+
+    // 已接受的测试数
+    uint64_t served_count() const { return served.load(); }
+};
+
+// 发起端参数，地址为网络序
+struct tunnel_test_params
+{
+    uint32_t local_ip = 0;
+    uint32_t peer_ip = 0;
+    uint16_t port = TUNNEL_TEST_PORT;
+    uint32_t rate_kbps = 0;
+    uint32_t duration_ms = 0;
+    uint16_t size = 0;
+    bool reverse = false;
+};
+
+/**
+ * 运行一次自测，同步执行，耗时约 空载阶段 + 时长 + 收尾，调用方应在工作线程中调用
+ * cancel 置位时尽快结束并返回 TUNNEL_CANCELLED
+ */
+inline tunnel_result tunnel_test_run(const tunnel_test_params &params, const std::atomic<bool> *cancel = nullptr)
+{
+    tunnel_result result{};
+    result.reverse = params.reverse ? 1 : 0;
+    tunnel_message start{};
+    start.type = TUNNEL_START;
+    start.reverse = result.reverse;
+    start.rate_kbps = params.rate_kbps;
+    start.duration_ms = params.duration_ms;
+    start.size = params.size;
+    start.clamp();
+    result.rate_kbps = start.rate_kbps;
+    if (params.peer_ip == 0)
+    {
+        result.status = TUNNEL_ERROR;
+        return result;
+    }
+    sockaddr_in local{}, peer{};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = params.local_ip;
+    peer.sin_family = AF_INET;
+    peer.sin_addr.s_addr = params.peer_ip;
+    peer.sin_port = htons(params.port);
+    const punch_socket s = tunnel_open(local);
+    if (s == PUNCH_INVALID_SOCKET)
+    {
+        result.status = TUNNEL_ERROR;
+        return result;
+    }
+    std::random_device rd;
+    start.test = rd() | 1;
+    const auto cancelled = [cancel]
+    { return cancel != nullptr && cancel->load(); };
+    const auto send = [&](const uint8_t *data, size_t len)
+    {
+        sendto(s, reinterpret_cast<const char *>(data), static_cast<int>(len), 0, reinterpret_cast<const sockaddr *>(&peer), sizeof(peer));
+    };
+    uint8_t buf[2048] = {};
+    pollfd fd{};
+    fd.fd = s;
+    fd.events = POLLIN;
+
+    // 时延探测与数据接收的状态
+    std::vector<uint8_t> ping_phase; // 0 未应答 1 空载应答 2 负载应答
+    latency_histogram idle, load, none;
+    uint32_t last_rtt = 0;
+    double jitter = 0;
+    tunnel_counter counter;
+    tunnel_message reply{};
+    bool got_reply = false;
+    // 收取到 deadline_us 为止的报文，want 非 0 时收到该类型的控制报文即返回
+    const auto pump = [&](uint64_t deadline_us, uint8_t want)
+    {
+        got_reply = false;
+        for (;;)
+        {
+            const uint64_t now = tunnel_now_us();
+            if (now >= deadline_us || cancelled())
+                return false;
+            const int wait = static_cast<int>((deadline_us - now + 999) / 1000);
+            if (punch_poll(&fd, 1, wait) <= 0)
+                continue;
+            for (int i = 0; i < 256; i++)
+            {
+                const int n = recvfrom(s, reinterpret_cast<char *>(buf), sizeof(buf), 0, nullptr, nullptr);
+                if (n <= 0)
+                    break;
+                tunnel_message msg{};
+                const uint64_t at = tunnel_now_us();
+                if (!msg.decode(buf, static_cast<size_t>(n)) || msg.test != start.test)
+                    continue;
+                if (msg.type == TUNNEL_PONG && msg.seq < ping_phase.size() && ping_phase[msg.seq] == 0 && at >= msg.stamp)
+                {
+                    const uint32_t rtt = static_cast<uint32_t>(at - msg.stamp);
+                    const bool loaded = (msg.flags & TUNNEL_FLAG_LOADED) != 0;
+                    ping_phase[msg.seq] = loaded ? 2 : 1;
+                    if (loaded)
+                    {
+                        load.record(rtt);
+                        if (last_rtt != 0)
+                            jitter += (std::abs(static_cast<double>(rtt) - last_rtt) - jitter) / 16;
+                        last_rtt = rtt;
+                    }
+                    else
+                        idle.record(rtt);
+                }
+                else if (msg.type == TUNNEL_DATA)
+                    counter.add(msg.seq, static_cast<size_t>(n), at);
+                else if (want != 0 && msg.type == want)
+                {
+                    reply = msg;
+                    got_reply = true;
+                }
+                pollfd more = fd;
+                if (punch_poll(&more, 1, 0) <= 0)
+                    break;
+            }
+            if (got_reply)
+                return true;
+        }
+    };
+    // 控制报文重发直到收到应答
+    const auto exchange = [&](const tunnel_message &msg, uint8_t want)
+    {
+        uint8_t out[TUNNEL_START_SIZE];
+        const size_t len = msg.encode(out);
+        for (int i = 0; i < TUNNEL_CONTROL_TRIES && !cancelled(); i++)
+        {
+            send(out, len);
+            if (pump(tunnel_now_us() + TUNNEL_CONTROL_WAIT_MS * 1000ull, want))
+                return true;
+        }
+        return false;
+    };
+    const auto ping = [&](bool loaded)
+    {
+        tunnel_message p{};
+        p.type = TUNNEL_PING;
+        p.test = start.test;
+        p.flags = loaded ? TUNNEL_FLAG_LOADED : 0;
+        p.seq = static_cast<uint32_t>(ping_phase.size());
+        p.stamp = tunnel_now_us();
+        ping_phase.push_back(0);
+        uint8_t out[TUNNEL_HEADER_SIZE];
+        send(out, p.encode(out));
+    };
+
+    if (!exchange(start, TUNNEL_START_ACK))
+    {
+        punch_close(s);
+        result.status = cancelled() ? TUNNEL_CANCELLED : TUNNEL_NO_RESPONSE;
+        return result;
+    }
+    if ((reply.flags & TUNNEL_FLAG_BUSY) != 0)
+    {
+        punch_close(s);
+        result.status = TUNNEL_BUSY;
+        return result;
+    }
+
+    // 空载阶段：只发时延探测
+    uint64_t now = tunnel_now_us();
+    const uint64_t idle_end = now + TUNNEL_IDLE_PHASE_MS * 1000ull;
+    while (now < idle_end && !cancelled())
+    {
+        ping(false);
+        pump(std::min<uint64_t>(idle_end, now + TUNNEL_PING_MS * 1000ull), 0);
+        now = tunnel_now_us();
+    }
+
+    // 负载阶段：按限速发送数据（反向测试由对端发送），同时继续探测
+    const uint64_t load_start = tunnel_now_us();
+    const uint64_t load_end = load_start + start.duration_ms * 1000ull;
+    uint64_t next_ping = load_start;
+    tunnel_pacer pacer;
+    pacer.reset(start.rate_kbps, start.size, load_start);
+    uint32_t sent = 0;
+    std::vector<uint8_t> data(start.size, 0);
+    now = load_start;
+    while (now < load_end && !cancelled())
+    {
+        if (now >= next_ping)
+        {
+            ping(true);
+            next_ping += TUNNEL_PING_MS * 1000ull;
+        }
+        uint64_t wake = std::min(next_ping, load_end);
+        if (!params.reverse)
+        {
+            const int count = pacer.due(now);
+            for (int i = 0; i < count; i++)
+            {
+                tunnel_message d{};
+                d.type = TUNNEL_DATA;
+                d.test = start.test;
+                d.seq = sent++;
+                d.stamp = now;
+                d.encode(data.data());
+                send(data.data(), data.size());
+            }
+            pacer.sent(count);
+            wake = std::min(wake, now + pacer.wait_us(tunnel_now_us()));
+        }
+        pump(std::max(wake, tunnel_now_us() + 200), 0);
+        now = tunnel_now_us();
+    }
+    result.duration_ms = static_cast<uint32_t>((std::min(now, load_end) - load_start) / 1000);
+    if (!cancelled())
+        pump(tunnel_now_us() + TUNNEL_DRAIN_MS * 1000ull, 0);
+
+    tunnel_message finish{};
+    finish.type = TUNNEL_FINISH;
+    finish.test = start.test;
+    const bool reported = !cancelled() && exchange(finish, TUNNEL_REPORT);
+    punch_close(s);
+
+    result.pings_sent = static_cast<uint32_t>(ping_phase.size());
+    result.pings_lost = static_cast<uint32_t>(std::count(ping_phase.begin(), ping_phase.end(), 0));
+    result.idle_rtt_us = latency_histogram::percentile(idle, none, 0.5);
+    result.load_p50_us = latency_histogram::percentile(load, none, 0.5);
+    result.load_p99_us = latency_histogram::percentile(load, none, 0.99);
+    result.load_max_us = load.max();
+    result.jitter_us = static_cast<uint32_t>(jitter);
+    if (cancelled())
+    {
+        result.status = TUNNEL_CANCELLED;
+        return result;
+    }
+    if (!reported)
+    {
+        result.status = TUNNEL_NO_REPORT;
+        return result;
+    }
+    // 正向由对端汇报接收，反向由本端统计接收、对端汇报发送
+    if (params.reverse)
+    {
+        result.sent = reply.sent;
+        result.received = counter.received;
+        result.reordered = counter.reordered;
+        result.throughput_bps = counter.throughput_bps();
+    }
+    else
+    {
+        result.sent = sent;
+        result.received = reply.received;
+        result.reordered = reply.reordered;
+        result.throughput_bps = reply.throughput_bps;
+    }
+    if (result.sent > 0)
+        result.loss = static_cast<uint32_t>(static_cast<uint64_t>(result.sent - std::min(result.sent, result.received)) * 1000 / result.sent);
+    result.status = TUNNEL_OK;
+    return result;
+}
+
+#ifdef TUNNEL_TEST_SELFTEST
+// 本地自测：bash lib/selftest.sh tunnel_test
+// 网络命名空间中分别运行：./a.out serve <虚拟IP> [port] 与 ./a.out run <本端IP> <对端IP> [port] [kbps] [ms] [reverse]
+#include "selftest_compat.h"
+#include "iostream"
+#include "cstdio"
+#include "cstdlib"
+#include "string"
+
+namespace tunnel_test
+{
+    // 回环替身：把发往 front 的报文转发给 target，应答转回最近的发送方，每个方向每 drop_every 个丢 1 个
+    class lossy_forwarder
+    {
+        punch_socket front = PUNCH_INVALID_SOCKET;
+        punch_socket back = PUNCH_INVALID_SOCKET;
+        sockaddr_in target{};
+        sockaddr_in client{};
+        int drop_every;
+        std::atomic<bool> stopping{false};
+        std::thread worker;
+
+    public:
+        uint16_t port = 0;
+
+        lossy_forwarder(uint16_t target_port, int every) : drop_every(every)
+        {
+            sockaddr_in local{};
+            local.sin_family = AF_INET;
+            local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            front = tunnel_open(local);
+            back = tunnel_open(local);
+            socklen_t len = sizeof(local);
+            getsockname(front, reinterpret_cast<sockaddr *>(&local), &len);
+            port = ntohs(local.sin_port);
+            target.sin_family = AF_INET;
+            target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            target.sin_port = htons(target_port);
+            worker = std::thread([this]
+                                 {
+                uint8_t buf[2048];
+                pollfd fds[2] = {{front, POLLIN, 0}, {back, POLLIN, 0}};
+                uint64_t up = 0, down = 0;
+                while (!stopping.load())
+                {
+                    if (punch_poll(fds, 2, 50) <= 0)
+                        continue;
+                    if (fds[0].revents & POLLIN)
+                    {
+                        socklen_t len = sizeof(client);
+                        const int n = recvfrom(front, reinterpret_cast<char *>(buf), sizeof(buf), 0, reinterpret_cast<sockaddr *>(&client), &len);
+                        if (n > 0 && ++up % drop_every != 0)
+                            sendto(back, reinterpret_cast<const char *>(buf), n, 0, reinterpret_cast<const sockaddr *>(&target), sizeof(target));
+                    }
+                    if (fds[1].revents & POLLIN)
+                    {
+                        const int n = recvfrom(back, reinterpret_cast<char *>(buf), sizeof(buf), 0, nullptr, nullptr);
+                        if (n > 0 && ++down % drop_every != 0)
+                            sendto(front, reinterpret_cast<const char *>(buf), n, 0, reinterpret_cast<const sockaddr *>(&client), sizeof(client));
+                    }
+                } });
+        }
+
+        ~lossy_forwarder()
+        {
+            stopping.store(true);
+            worker.join();
+            punch_close(front);
+            punch_close(back);
+        }
+    };
+
+    inline std::string describe(const tunnel_result &r)
+    {
+        char line[320];
+        snprintf(line, sizeof(line),
+                 "status %d %s %ums at %ukbps: %.1f Mbit/s, sent %u received %u loss %u%% reordered %u, "
+                 "idle rtt %uus, load rtt p50 %uus p99 %uus max %uus jitter %uus, pings %u lost %u",
+                 r.status, r.reverse ? "reverse" : "forward", r.duration_ms, r.rate_kbps, r.throughput_bps / 1e6, r.sent, r.received,
+                 r.loss / 10, r.reordered, r.idle_rtt_us, r.load_p50_us, r.load_p99_us, r.load_max_us, r.jitter_us, r.pings_sent, r.pings_lost);
+        return line;
+    }
+
+    inline uint32_t ip_of(const char *text)
+    {
+        in_addr addr{};
+        inet_pton(AF_INET, text, &addr);
+        return addr.s_addr;
+    }
+
+    inline int run()
+    {
+        const uint32_t loopback = htonl(INADDR_LOOPBACK);
+        const uint16_t port = static_cast<uint16_t>(40000 + std::random_device{}() % 20000);
+
+        // 参数修正
+        tunnel_message m{};
+        m.rate_kbps = 10000000;
+        m.duration_ms = 60000;
+        m.size = 9000;
+        m.clamp();
+        expect(m.rate_kbps == TUNNEL_TEST_MAX_KBPS && m.duration_ms == TUNNEL_TEST_MAX_MS && m.size == TUNNEL_TEST_MAX_SIZE,
+               "rate, duration and size are capped");
+
+        tunnel_responder responder;
+        expect(responder.open(loopback, port), "responder on 127.0.0.1:" + std::to_string(port));
+
+        // 正向与反向，20 Mbit/s 1s
+        tunnel_test_params p{};
+        p.local_ip = loopback;
+        p.peer_ip = loopback;
+        p.port = port;
+        p.rate_kbps = 20000;
+        p.duration_ms = 1000;
+        auto r = tunnel_test_run(p);
+        std::cout << "     " << describe(r) << std::endl;
+        expect(r.status == TUNNEL_OK && r.throughput_bps > 17000000 && r.throughput_bps < 22000000 && r.loss < 10,
+               "forward throughput follows the rate cap");
+        expect(r.idle_rtt_us > 0 && r.load_p50_us > 0 && r.load_p99_us >= r.load_p50_us && r.pings_sent >= 140,
+               "idle and loaded latency measured");
+        const auto started = std::chrono::steady_clock::now();
+        p.reverse = true;
+        r = tunnel_test_run(p);
+        std::cout << "     " << describe(r) << std::endl;
+        expect(r.status == TUNNEL_OK && r.reverse == 1 && r.throughput_bps > 17000000 && r.throughput_bps < 22000000 && r.loss < 10,
+               "reverse throughput follows the rate cap (back-to-back test accepted)");
+        const auto took = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+        expect(took < 1000 + TUNNEL_IDLE_PHASE_MS + TUNNEL_DRAIN_MS + 500, "bounded run time " + std::to_string(took) + "ms");
+
+        // 经丢包替身：每个方向丢 1/10
+        {
+            lossy_forwarder lossy(port, 10);
+            tunnel_test_params q = p;
+            q.port = lossy.port;
+            q.reverse = false;
+            q.rate_kbps = 5000;
+            r = tunnel_test_run(q);
+            std::cout << "     " << describe(r) << std::endl;
+            expect(r.status == TUNNEL_OK && r.loss >= 80 && r.loss <= 120, "10% loss measured on the data path");
+            expect(r.pings_lost * 100 >= r.pings_sent * 12 && r.pings_lost * 100 <= r.pings_sent * 28, "ping loss covers both directions");
+        }
+
+        // 忙：反向测试进行中，另一个发起端被拒绝；之后取消
+        {
+            std::atomic<bool> cancel{false};
+            tunnel_test_params long_test = p;
+            long_test.duration_ms = 5000;
+            tunnel_result first{};
+            std::thread t([&]
+                          { first = tunnel_test_run(long_test, &cancel); });
+            std::this_thread::sleep_for(std::chrono::milliseconds(300));
+            p.reverse = false;
+            r = tunnel_test_run(p);
+            expect(r.status == TUNNEL_BUSY, "second tester gets busy");
+            cancel.store(true);
+            t.join();
+            expect(first.status == TUNNEL_CANCELLED, "running test cancelled");
+        }
+
+        // 对端未开启：重发后超时
+        responder.close();
+        const auto before = std::chrono::steady_clock::now();
+        r = tunnel_test_run(p);
+        const auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - before).count();
+        expect(r.status == TUNNEL_NO_RESPONSE && waited < 2000, "no responder fails in " + std::to_string(waited) + "ms");
+        return selftest_result();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const std::string mode = argc > 1 ? argv[1] : "";
+    if (mode == "serve" && argc > 2)
+    {
+        tunnel_responder responder;
+        const uint16_t port = static_cast<uint16_t>(argc > 3 ? atoi(argv[3]) : TUNNEL_TEST_PORT);
+        if (!responder.open(tunnel_test::ip_of(argv[2]), port))
+            return 1;
+        std::cout << "serving on " << argv[2] << ":" << port << std::endl;
+        for (;;)
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    if (mode == "run" && argc > 3)
+    {
+        tunnel_test_params p{};
+        p.local_ip = tunnel_test::ip_of(argv[2]);
+        p.peer_ip = tunnel_test::ip_of(argv[3]);
+        p.port = static_cast<uint16_t>(argc > 4 ? atoi(argv[4]) : TUNNEL_TEST_PORT);
+        p.rate_kbps = argc > 5 ? static_cast<uint32_t>(atoi(argv[5])) : 0;
+        p.duration_ms = argc > 6 ? static_cast<uint32_t>(atoi(argv[6])) : 0;
+        p.reverse = argc > 7 && std::string(argv[7]) == "reverse";
+        const auto r = tunnel_test_run(p);
+        std::cout << tunnel_test::describe(r) << std::endl;
+        return r.status == TUNNEL_OK ? 0 : 1;
+    }
+    return tunnel_test::run();
+}
+#endif
@@ -0,0 +1,325 @@
+#include "string"
+#include "sstream"
+#include "memory"
+#include "vector"
+#include "cstring"
+#include "src/wireguard.h"
+#include "ws2tcpip.h"
+
+#pragma once
+
+/**
+ * wireguard_tool 中不依赖 Windows API 的部分：内存布局常量、日志、驱动函数指针、地址解析与密钥格式化
+ * Linux 自测经 selftest_compat.h 直接包含本文件，与 dll 使用同一份实现
+ */
+
+static constexpr size_t interface_size = sizeof(WIREGUARD_INTERFACE);
+static constexpr size_t peer_size = sizeof(WIREGUARD_PEER);
+static constexpr size_t allowed_ip_size = sizeof(WIREGUARD_ALLOWED_IP);
+// 房间网段未指定前缀长度时的默认值
+static constexpr uint8_t DEFAULT_PREFIX_LENGTH = 16;
+
+// 外部日志函数钩子
+static void (*log_func)(WIREGUARD_LOGGER_LEVEL level, const char *msg, int code) = nullptr;
+
+/**
+ * 延迟日志：存活期间本线程的 log / log_dll 只入队，析构时按顺序输出
+ * 后台线程调用 log_func 会阻塞到 JS 主线程执行回调，持有房间锁时调用而主线程正等待同一把锁即死锁；
+ * 后台线程在 lock_guard 之前声明一个批次，日志在解锁之后才输出。嵌套声明时由最外层输出
+ */
+class log_batch
+{
+public:
+    log_batch()
+    {
+        if (active == nullptr)
+            active = this;
+    }
+
+    ~log_batch()
+    {
+        if (active != this)
+            return;
+        active = nullptr;
+        if (log_func == nullptr)
+            return;
+        for (const auto &e : entries)
+            log_func(e.level, e.msg.c_str(), e.code);
+    }
+
+    log_batch(const log_batch &) = delete;
+    log_batch &operator=(const log_batch &) = delete;
+
+    // 本线程生效的批次，没有返回空
+    static log_batch *current()
+    {
+        return active;
+    }
+
+    void add(const WIREGUARD_LOGGER_LEVEL level, std::string msg, int code)
+    {
+        entries.push_back({level, std::move(msg), code});
+    }
+
+private:
+    struct entry
+    {
+        WIREGUARD_LOGGER_LEVEL level;
+        std::string msg;
+        int code;
+    };
+    std::vector<entry> entries;
+    static inline thread_local log_batch *active = nullptr;
+};
+
+void log(const WIREGUARD_LOGGER_LEVEL level, const char *msg, int code = 0)
+{
+    if (log_func == nullptr)
+    {
+        return;
+    }
+    if (const auto batch = log_batch::current())
+    {
+        batch->add(level, msg, code);
+        return;
+    }
+    log_func(level, msg, code);
+}
+
+void log(const WIREGUARD_LOGGER_LEVEL level, const std::string &msg, int code = 0)
+{
+    if (log_func == nullptr)
+    {
+        return;
+    }
+    log(level, msg.c_str(), code);
+}
+
+// wireguard.dll 导出函数，由 initial 加载，自测直接赋值为模拟实现
+static WIREGUARD_CREATE_ADAPTER_FUNC *WireGuardCreateAdapter;
+static WIREGUARD_OPEN_ADAPTER_FUNC *WireGuardOpenAdapter;
+static WIREGUARD_CLOSE_ADAPTER_FUNC *WireGuardCloseAdapter;
+static WIREGUARD_GET_ADAPTER_LUID_FUNC *WireGuardGetAdapterLUID;
+static WIREGUARD_GET_RUNNING_DRIVER_VERSION_FUNC *WireGuardGetRunningDriverVersion;
+static WIREGUARD_DELETE_DRIVER_FUNC *WireGuardDeleteDriver;
+static WIREGUARD_SET_LOGGER_FUNC *WireGuardSetLogger;
+static WIREGUARD_SET_ADAPTER_LOGGING_FUNC *WireGuardSetAdapterLogging;
+static WIREGUARD_GET_ADAPTER_STATE_FUNC *WireGuardGetAdapterState;
+static WIREGUARD_SET_ADAPTER_STATE_FUNC *WireGuardSetAdapterState;
+static WIREGUARD_GET_CONFIGURATION_FUNC *WireGuardGetConfiguration;
+static WIREGUARD_SET_CONFIGURATION_FUNC *WireGuardSetConfiguration;
+
+// 共享所有权的适配器句柄，最后一个持有者释放时关闭适配器，只读查询期间适配器不会被关闭
+using adapter_ptr = std::shared_ptr<_WIREGUARD_ADAPTER>;
+
+inline adapter_ptr make_adapter_ptr(WIREGUARD_ADAPTER_HANDLE handle)
+{
+    return adapter_ptr(handle, [](WIREGUARD_ADAPTER_HANDLE h)
+                       { if (h != nullptr) WireGuardCloseAdapter(h); });
+}
+
+bool parse_ip(const char *ip_string, int port, SOCKADDR_INET &addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    if (inet_pton(AF_INET, ip_string, &addr.Ipv4.sin_addr) == 1)
+    {
+        addr.Ipv4.sin_port = htons(port);
+        addr.si_family = AF_INET;
+        return true;
+    }
+    if (inet_pton(AF_INET6, ip_string, &addr.Ipv6.sin6_addr) == 1)
+    {
+        addr.Ipv6.sin6_port = htons(port);
+        addr.si_family = AF_INET6;
+        return true;
+    }
+    return false;
+}
+
+// 比较两个 endpoint 的地址族、地址与端口
+inline bool same_endpoint(const SOCKADDR_INET &a, const SOCKADDR_INET &b)
+{
+    if (a.si_family != b.si_family)
+        return false;
+    if (a.si_family == AF_INET)
+        return a.Ipv4.sin_port == b.Ipv4.sin_port && a.Ipv4.sin_addr.s_addr == b.Ipv4.sin_addr.s_addr;
+    if (a.si_family == AF_INET6)
+        return a.Ipv6.sin6_port == b.Ipv6.sin6_port &&
+               memcmp(&a.Ipv6.sin6_addr, &b.Ipv6.sin6_addr, sizeof(a.Ipv6.sin6_addr)) == 0;
+    return true;
+}
+
+bool parse_allowed_ip(std::string &ip_string, WIREGUARD_ALLOWED_IP &rec)
+{
+    size_t slash_pos = ip_string.find('/');
+    std::string cidr_part;
+    if (slash_pos != std::string::npos)
+    {
+        cidr_part = ip_string.substr(slash_pos + 1);
+        ip_string = ip_string.substr(0, slash_pos);
+        try
+        {
+            rec.Cidr = static_cast<BYTE>(std::stoi(cidr_part));
+        }
+        catch (const std::exception &e)
+        {
+            log(WIREGUARD_LOG_ERR, "cidr format error");
+            return false;
+        }
+    }
+    // 解析IP地址
+    if (inet_pton(AF_INET, ip_string.c_str(), &rec.Address.V4) == 1)
+    {
+        rec.AddressFamily = AF_INET;
+        if (cidr_part.empty())
+            rec.Cidr = 32;
+    }
+    // else if (inet_pton(AF_INET6, ip_string.c_str(), &rec.Address.V6) == 1)
+    // {
+    //     rec.AddressFamily = AF_INET6;
+    //     if (cidr_part.empty())
+    //         rec.Cidr = 128;
+    // }
+    else
+    {
+        log(WIREGUARD_LOG_ERR, "ip format error");
+        return false;
+    }
+    return true;
+}
+
+// 解析房间网段，支持 "10.20.0.0/16" 形式，未带前缀长度时使用 DEFAULT_PREFIX_LENGTH
+bool parse_ip_area(const char *ip_area, std::string &network, uint8_t &prefix_length)
+{
+    if (ip_area == nullptr)
+        return false;
+    network = ip_area;
+    prefix_length = DEFAULT_PREFIX_LENGTH;
+    const size_t slash_pos = network.find('/');
+    if (slash_pos != std::string::npos)
+    {
+        try
+        {
+            const int prefix = std::stoi(network.substr(slash_pos + 1));
+            if (prefix <= 0 || prefix > 32)
+                return false;
+            prefix_length = static_cast<uint8_t>(prefix);
+        }
+        catch (const std::exception &e)
+        {
+            log(WIREGUARD_LOG_ERR, "ip area prefix format error");
+            return false;
+        }
+        network = network.substr(0, slash_pos);
+    }
+    IN_ADDR addr;
+    return inet_pton(AF_INET, network.c_str(), &addr) == 1;
+}
+
+namespace formmater
+{
+    // byte密钥转b64字符串
+    std::string base64_encode(const uint8_t *data, size_t len)
+    {
+        static const char *base64_chars =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+            "abcdefghijklmnopqrstuvwxyz"
+            "0123456789+/";
+
+        std::string ret;
+        int i = 0;
+        uint8_t char_array_3[3];
+        uint8_t char_array_4[4];
+
+        while (len--)
+        {
+            char_array_3[i++] = *(data++);
+            if (i == 3)
+            {
+                char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
+                char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
+                char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
+                char_array_4[3] = char_array_3[2] & 0x3f;
+
+                for (i = 0; i < 4; i++)
+                    ret += base64_chars[char_array_4[i]];
+                i = 0;
+            }
+        }
+
+        if (i)
+        {
+            for (int j = i; j < 3; j++)
+                char_array_3[j] = '\0';
+
+            char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
+            char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
+            char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
+
+            for (int j = 0; j < i + 1; j++)
+                ret += base64_chars[char_array_4[j]];
+
+            while (i++ < 3)
+                ret += '=';
+        }
+
+        return ret;
+    }
+
+    // 将 sockaddr 转换为字符串
+    std::string sockaddr_to_string(const SOCKADDR_INET *addr)
+    {
+        if (!addr)
+            return "none";
+
+        char ip_str[INET6_ADDRSTRLEN] = {0};
+        uint16_t port = 0;
+
+        if (addr->si_family == AF_INET)
+        {
+            inet_ntop(AF_INET, &addr->Ipv4.sin_addr, ip_str, sizeof(ip_str));
+            port = ntohs(addr->Ipv4.sin_port);
+            return std::string(ip_str) + ":" + std::to_string(port);
+        }
+        else if (addr->si_family == AF_INET6)
+        {
+            inet_ntop(AF_INET6, &addr->Ipv6.sin6_addr, ip_str, sizeof(ip_str));
+            port = ntohs(addr->Ipv6.sin6_port);
+            return "[" + std::string(ip_str) + "]:" + std::to_string(port);
+        }
+
+        return "unknown";
+    }
+
+    // 格式化允许的 IP 列表
+    std::string format_allowed_ips(const WIREGUARD_ALLOWED_IP *allowed_ips, size_t count)
+    {
+        if (!allowed_ips || count == 0)
+            return "  AllowedIPs = (none)\n";
+
+        std::stringstream ss;
+        ss << "  AllowedIPs = ";
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            char ip_str[INET6_ADDRSTRLEN] = {0};
+
+            if (allowed_ips[i].AddressFamily == AF_INET)
+            {
+                inet_ntop(AF_INET, &allowed_ips[i].Address.V4, ip_str, sizeof(ip_str));
+                ss << ip_str << "/" << (int)allowed_ips[i].Cidr;
+            }
+            else if (allowed_ips[i].AddressFamily == AF_INET6)
+            {
+                inet_ntop(AF_INET6, &allowed_ips[i].Address.V6, ip_str, sizeof(ip_str));
+                ss << ip_str << "/" << (int)allowed_ips[i].Cidr;
+            }
+
+            if (i < count - 1)
+                ss << ", ";
+        }
+        ss << "\n";
+
+        return ss.str();
+    }
+}
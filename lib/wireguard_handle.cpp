@@ -1,13 +1,39 @@
 #include <unordered_map>
 #include <string>
 #include <vector>
-#include <optional>
 #include "src/wireguard.h"
 #include "wireguard_tool.cpp"
 #include "broadcaster.cpp"
+#include "peer_stats.cpp"
+#include "telemetry.cpp"
+#include "peer_events.cpp"
+#include "adapter_pool.cpp"
+#include "room_pipeline.cpp"
+#include "lazy_gate.cpp"
+#include "keepalive.cpp"
+#include "handshake_stagger.cpp"
+#include "session_snapshot.cpp"
+#include "endpoint_cache.cpp"
+#include "hole_punch.cpp"
+#include "nat_probe.cpp"
+#include "divert_probe.cpp"
+#include "latency_probe.cpp"
+#include "path_manager.cpp"
+#include "relay_select.cpp"
+#include "dns_cache.cpp"
+#include "tunnel_test.cpp"
+#include "room_table.cpp"
+#include "peer_index.cpp"
+#include "sampler.cpp"
 #include <memory>
 #include "mutex"
 #include "chrono"
+#include "condition_variable"
+#include "thread"
+#include "deque"
+#include "functional"
+#include "array"
+#include "shared_mutex"
 #include <iostream>
 
 #include "winsock2.h"
@@ -15,107 +41,817 @@
 
 #pragma comment(lib, "ws2_32.lib")
 
+// peer 名称驻留长度上限（含结尾 0），JS 侧使用 uuid 作为成员名
+static constexpr size_t PEER_NAME_LENGTH = 64;
+static_assert(PEER_NAME_LENGTH == SNAPSHOT_PEER_NAME, "snapshot peer name length mismatch");
+static_assert(LATENCY_KEY_LENGTH == WIREGUARD_KEY_LENGTH, "latency key length mismatch");
+static_assert(PATH_KEY_LENGTH == WIREGUARD_KEY_LENGTH, "path key length mismatch");
+// NAT 分类结果按网络指纹缓存的有效期(ms)
+static constexpr uint64_t NAT_PROFILE_TTL_MS = 3600 * 1000;
+// 初始为多少个 peer 预留配置空间（按每个 peer 两条 allowed ip 估算）
+static constexpr size_t PEER_RESERVE_COUNT = 16;
+
+// 成员名 FNV-1a 哈希，查找时先比较哈希再比较字符串
+inline uint64_t peer_name_hash(const wchar_t *name)
+{
+    uint64_t h = 1469598103934665603ull;
+    for (; *name != L'\0'; ++name)
+    {
+        h ^= static_cast<uint64_t>(*name);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// 公钥哈希：curve25519 公钥本身均匀分布，取前 8 字节
+inline uint64_t peer_key_hash(const uint8_t *key)
+{
+    uint64_t h;
+    memcpy(&h, key, sizeof(h));
+    return h;
+}
+
+// wireguard endpoint 与套接字地址互转，路径探测使用套接字地址
+inline sockaddr_storage endpoint_storage(const SOCKADDR_INET &endpoint)
+{
+    sockaddr_storage out{};
+    if (endpoint.si_family == AF_INET)
+        memcpy(&out, &endpoint.Ipv4, sizeof(endpoint.Ipv4));
+    else if (endpoint.si_family == AF_INET6)
+        memcpy(&out, &endpoint.Ipv6, sizeof(endpoint.Ipv6));
+    return out;
+}
+
+inline bool storage_endpoint(const sockaddr_storage &addr, SOCKADDR_INET &out)
+{
+    memset(&out, 0, sizeof(out));
+    if (addr.ss_family == AF_INET)
+        memcpy(&out.Ipv4, &addr, sizeof(out.Ipv4));
+    else if (addr.ss_family == AF_INET6)
+        memcpy(&out.Ipv6, &addr, sizeof(out.Ipv6));
+    else
+        return false;
+    return true;
+}
+
 // 抽象room配置类，对应一个房间和一个wireguard adapter
+// peer 直接以 wireguard 要求的内存布局保存在 conf 中，设置配置时无需重新拼装
 class room_config
 {
-    // 生成配置数据，返回配置数据指针大小，0则代表生成失败
-    size_t generate_config()
+    // 对等体索引项：名称驻留在定长数组中，offset 指向 conf 中该 peer 记录的起始位置
+    struct peer_slot
     {
-        size_t total_size = interface_size + peers.size() * peer_size;
-        // 添加每个peer的allowed_ip大小
-        for (const auto &[k, v] : peer_allowed_ips)
+        uint64_t hash;
+        wchar_t name[PEER_NAME_LENGTH];
+        size_t offset;
+        DWORD ip_count;
+        // 合并窗口内尚未应用到适配器的变更类型
+        uint8_t pending;
+        // 按需激活：虚拟 IP（网络字节序，0 表示不按需管理）、是否已激活、休眠期间保存的激活设置
+        bool active;
+        uint32_t lazy_ip;
+        lazy_saved saved;
+        // 最近一次观察到的收发字节合计与流量变化时间，用于空闲降级
+        uint64_t lazy_bytes;
+        std::chrono::steady_clock::time_point lazy_seen;
+        // 握手错峰：已登记但在错峰队列中等待激活，期间同样以休眠记录写入适配器
+        bool held;
+    };
+
+    // 保证 conf 至少有 size 字节容量，按倍数扩容，稳态下不再分配
+    bool reserve(size_t size)
+    {
+        if (size <= conf_capacity)
+        {
+            return true;
+        }
+        size_t capacity = conf_capacity == 0 ? size : conf_capacity;
+        while (capacity < size)
         {
-            total_size += peer_allowed_ips[k].size() * allowed_ip_size;
+            capacity *= 2;
         }
-        const auto new_ptr = realloc(conf, total_size);
+        const auto new_ptr = realloc(conf, capacity);
         if (new_ptr == nullptr)
         {
-            return 0;
+            log(WIREGUARD_LOG_ERR, "reserve adapter config failed");
+            return false;
         }
-        conf = new_ptr;
-        size_t offset = 0;
-        // 逐步复制数据
-        memcpy(conf, &(this->interface_config), interface_size);
-        offset += interface_size;
-        for (const auto &[key, peer] : peers)
+        conf = static_cast<BYTE *>(new_ptr);
+        conf_capacity = capacity;
+        return true;
+    }
+
+    static size_t record_size(DWORD ip_count)
+    {
+        return peer_size + ip_count * allowed_ip_size;
+    }
+
+    // 调整第 idx 个 peer 记录中 allowed ip 的数量，位于其后的记录整体平移
+    bool resize_record(size_t idx, DWORD ip_count)
+    {
+        auto &slot = slots[idx];
+        const size_t old_len = record_size(slot.ip_count);
+        const size_t new_len = record_size(ip_count);
+        if (new_len == old_len)
         {
-            memcpy(reinterpret_cast<BYTE *>(conf) + offset, &peer, peer_size);
-            offset += peer_size;
-            if (peer.AllowedIPsCount == 0)
-            {
-                continue;
-            }
-            // 转发虚拟IP地址错误
-            if (peer_allowed_ips.find(key) == peer_allowed_ips.end())
-            {
-                log(WIREGUARD_LOG_ERR, "parse peer transport failed");
-                return 0;
-            };
-            for (const auto &ip : peer_allowed_ips[key])
-            {
-                memcpy(reinterpret_cast<BYTE *>(conf) + offset, &ip, allowed_ip_size);
-                offset += allowed_ip_size;
-            }
+            return true;
+        }
+        if (new_len > old_len && !reserve(conf_size + new_len - old_len))
+        {
+            return false;
+        }
+        const size_t tail = slot.offset + old_len;
+        memmove(conf + slot.offset + new_len, conf + tail, conf_size - tail);
+        conf_size = conf_size + new_len - old_len;
+        for (auto &other : slots)
+        {
+            if (other.offset > slot.offset)
+                other.offset = other.offset + new_len - old_len;
         }
-        return total_size;
+        slot.ip_count = ip_count;
+        return true;
     }
 
 public:
     std::wstring name;
-    // 绑定的 IP 和网段（用于删除时清理）
+    // 绑定的 IP、网段与前缀长度（用于删除时清理）
     std::string adapter_ip;
     std::string adapter_ip_area;
-    // wireguard 适配器配置
-    WIREGUARD_INTERFACE interface_config{};
-    // wireguard 适配器对等体配置
-    std::unordered_map<std::wstring, WIREGUARD_PEER> peers;
-    // wireguard 适配器对等体允许的IP配置
-    std::unordered_map<std::wstring, std::vector<WIREGUARD_ALLOWED_IP>> peer_allowed_ips;
-
-    // wireguard 适配器匿名句柄
+    uint8_t prefix_length = DEFAULT_PREFIX_LENGTH;
+    // 适配器 luid 与网卡索引，创建流水线第一步查询后只读
+    NET_LUID luid{};
+    DWORD interface_index = 0;
+    // peer 索引表，记录在 conf 中的位置由 offset 给出，删除时以最后一项填补空位，下标与记录先后无关
+    std::vector<peer_slot> slots;
+    // 成员名哈希、公钥哈希与成员虚拟 IP 到 slots 下标，哈希冲突时按名称或公钥区分，与 slots 同步维护
+    peer_index name_index;
+    peer_index key_index;
+    peer_index ip_index;
+    // 房间配置锁，保护 peer 表、conf 和合并窗口状态
+    std::mutex lock;
+    // 房间已删除，持有旧指针的调用不再修改配置
+    bool closed = false;
+    // 房间注册后写入会话快照，此后每次成功设置配置都标记快照待更新
+    bool persistent = false;
+    // 快照待更新，由快照写入线程清除
+    bool snapshot_dirty = false;
+    // DPAPI 加密后的房间私钥，首次写入快照时生成
+    std::vector<BYTE> sealed_key;
+    // 实际使用的适配器名，来自预创建池时与房间名不同，恢复时按该名称接管
+    std::wstring adapter_name;
+    // 解析 allowed ip 时复用的缓冲区
+    std::vector<WIREGUARD_ALLOWED_IP> allowed_buffer;
+    // 配置失败时用于回滚的配置与索引副本，容量复用
+    std::vector<BYTE> backup;
+    std::vector<peer_slot> backup_slots;
+    peer_index backup_names;
+    peer_index backup_keys;
+    peer_index backup_ips;
+    // 是否存在合并窗口内暂存、尚未应用的变更，以及窗口开始时间
+    bool dirty = false;
+    std::chrono::steady_clock::time_point pending_since;
+
+    // 本房间的广播转发器
+    std::shared_ptr<transporter> trans;
+    // 本房间的统计查询状态，与配置修改使用不同的锁
+    std::shared_ptr<room_stats> stats = std::make_shared<room_stats>();
+    // 本房间的遥测历史，由共享采样线程写入
+    std::shared_ptr<room_telemetry> telemetry = std::make_shared<room_telemetry>();
+    // 本房间的事件比对状态，由共享采样线程访问
+    std::shared_ptr<room_watch> watch = std::make_shared<room_watch>();
+    // 共享采样线程的配置查询缓冲区，每轮查询一次后分发给各消费者，只由采样线程访问
+    std::vector<uint64_t> sample_buffer;
+    // 按需激活闸门，关闭按需激活时为空
+    std::shared_ptr<lazy_gate> gate;
+    // 闸门当前过滤的虚拟 IP，与 inactive_ips 不一致时需要刷新闸门
+    std::vector<uint32_t> gate_ips;
+    // 空闲检查从查询结果中提取的公钥和收发字节，只由采样线程访问
+    std::vector<std::pair<const uint8_t *, uint64_t>> lazy_samples;
+    // 自适应保活状态，受房间锁保护
+    keepalive_controller keepalive;
+    // 正在尝试缓存 endpoint 的 peer，受房间锁保护
+    std::vector<endpoint_race> races;
+    // 隧道时延探测器，受自身锁保护；查询缓冲区只由时延线程访问
+    latency_prober latency;
+    std::vector<uint64_t> latency_buffer;
+    std::vector<latency_target> latency_targets;
+    // 隧道自测对端，自测端口为 0 时未开启
+    tunnel_responder selftest;
+    // 直连/中继路径选择状态，受房间锁保护
+    path_manager paths;
+    // 房间创建各阶段耗时与创建流水线时间线
+    room_timing timing{};
+    std::array<step_timeline, PIPELINE_STEP_LIMIT> setup_timeline{};
+    size_t setup_steps = 0;
+    // wireguard 适配器句柄，adapter 持有所有权
+    adapter_ptr adapter;
     WIREGUARD_ADAPTER_HANDLE handle = nullptr;
-    // 特定内存布局的wireguard配置
+    // 特定内存布局的wireguard配置，原地维护
     // interface + peer1 + allowed_ip1 + allowed_ip2 + peer2 + allowed + ...
-    void *conf = nullptr;
+    BYTE *conf = nullptr;
+    // conf 已使用字节数与容量
+    size_t conf_size = 0;
+    size_t conf_capacity = 0;
 
     static constexpr WIREGUARD_INTERFACE_FLAG BASE_FLAG = WIREGUARD_INTERFACE_HAS_LISTEN_PORT | WIREGUARD_INTERFACE_HAS_PRIVATE_KEY;
     static constexpr WIREGUARD_PEER_FLAG BASE_PEER_FLAG = WIREGUARD_PEER_HAS_PUBLIC_KEY  | WIREGUARD_PEER_HAS_PERSISTENT_KEEPALIVE;
+    static constexpr size_t npos = static_cast<size_t>(-1);
+    static constexpr uint8_t PENDING_NONE = 0;
+    static constexpr uint8_t PENDING_ADD = 1;
+    static constexpr uint8_t PENDING_DEL = 2;
+
+    // wireguard 适配器配置，位于 conf 头部
+    WIREGUARD_INTERFACE &interface_config()
+    {
+        return *reinterpret_cast<WIREGUARD_INTERFACE *>(conf);
+    }
+
+    WIREGUARD_PEER &peer_at(size_t idx)
+    {
+        return *reinterpret_cast<WIREGUARD_PEER *>(conf + slots[idx].offset);
+    }
+
+    WIREGUARD_ALLOWED_IP *allowed_ips_at(size_t idx)
+    {
+        return reinterpret_cast<WIREGUARD_ALLOWED_IP *>(conf + slots[idx].offset + peer_size);
+    }
+
+    // 按成员名查找 peer 下标，不存在返回 npos
+    size_t find_peer(const wchar_t *peer_name) const
+    {
+        const auto idx = name_index.find(peer_name_hash(peer_name), [this, peer_name](uint32_t i)
+                                         { return wcscmp(slots[i].name, peer_name) == 0; });
+        return idx == peer_index::npos ? npos : idx;
+    }
+
+    // 登记第 idx 个 peer 记录的公钥与成员虚拟 IP，记录写入后调用
+    void index_record(size_t idx)
+    {
+        key_index.insert(peer_key_hash(peer_at(idx).PublicKey), static_cast<uint32_t>(idx));
+        if (const auto ip = member_ip(idx); ip != 0)
+            ip_index.insert(ip, static_cast<uint32_t>(idx));
+    }
+
+    // 撤销第 idx 个 peer 记录的公钥与成员虚拟 IP，记录覆盖或删除前调用
+    void unindex_record(size_t idx)
+    {
+        key_index.erase(peer_key_hash(peer_at(idx).PublicKey), static_cast<uint32_t>(idx));
+        if (const auto ip = member_ip(idx); ip != 0)
+            ip_index.erase(ip, static_cast<uint32_t>(idx));
+    }
+
+    // 按 slots 重建全部索引，从快照载入整张表后调用
+    void rebuild_index()
+    {
+        name_index.clear();
+        key_index.clear();
+        ip_index.clear();
+        name_index.reserve(slots.size());
+        key_index.reserve(slots.size());
+        ip_index.reserve(slots.size());
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            name_index.insert(slots[i].hash, static_cast<uint32_t>(i));
+            index_record(i);
+        }
+    }
+
+    // 写入 peer 记录，已存在则原地覆盖，返回 peer 下标，失败返回 npos
+    // 新 peer 的记录先完整写在配置末尾，成功后才登记索引项，失败不留下半条记录
+    size_t put_peer(const wchar_t *peer_name, const WIREGUARD_PEER &peer,
+                    const WIREGUARD_ALLOWED_IP *ips, DWORD ip_count)
+    {
+        auto idx = find_peer(peer_name);
+        if (idx == npos)
+        {
+            if (wcslen(peer_name) >= PEER_NAME_LENGTH)
+            {
+                log(WIREGUARD_LOG_ERR, "peer name too long");
+                return npos;
+            }
+            if (!reserve(conf_size + record_size(ip_count)))
+            {
+                return npos;
+            }
+            peer_slot slot{};
+            slot.hash = peer_name_hash(peer_name);
+            wcscpy_s(slot.name, peer_name);
+            slot.offset = conf_size;
+            slot.ip_count = ip_count;
+            slots.push_back(slot);
+            conf_size += record_size(ip_count);
+            idx = slots.size() - 1;
+            name_index.insert(slot.hash, static_cast<uint32_t>(idx));
+        }
+        else
+        {
+            // 覆盖后公钥与 allowed ip 可能变化，先撤销旧记录的索引
+            unindex_record(idx);
+            if (!resize_record(idx, ip_count))
+            {
+                index_record(idx);
+                return npos;
+            }
+        }
+        memcpy(conf + slots[idx].offset, &peer, peer_size);
+        peer_at(idx).AllowedIPsCount = ip_count;
+        if (ip_count != 0)
+        {
+            memcpy(allowed_ips_at(idx), ips, ip_count * allowed_ip_size);
+        }
+        index_record(idx);
+        interface_config().PeersCount = static_cast<DWORD>(slots.size());
+        return idx;
+    }
+
+    /**
+     * 按需激活模式下登记 peer，调用方需持有房间锁，peer 记录须为 put_peer 刚写入的激活设置
+     * 只有一条 /32 allowed ip 的成员 peer 按需管理，新 peer 以休眠记录写入适配器：不带 endpoint 与保活，
+     * 对端发起的握手仍可完成；已激活的 peer 重复添加时保持激活。中继等网段 peer 始终激活
+     */
+    void apply_lazy(size_t idx, bool lazy)
+    {
+        auto &slot = slots[idx];
+        uint32_t ip = 0;
+        if (lazy && (slot.lazy_ip != 0 || lazy_count() < LAZY_PEER_LIMIT))
+        {
+            ip = member_ip(idx);
+        }
+        slot.lazy_ip = ip;
+        if (ip == 0 || slot.active)
+        {
+            slot.active = true;
+            slot.lazy_seen = std::chrono::steady_clock::now();
+            return;
+        }
+        lazy_sleep(peer_at(idx), slot.saved, true);
+    }
+
+    // 成员 peer 的虚拟 IP：只有一条 IPv4 /32 allowed ip 时返回该 IP（网络字节序），中继等网段 peer 返回 0
+    uint32_t member_ip(size_t idx)
+    {
+        const auto *ips = allowed_ips_at(idx);
+        if (slots[idx].ip_count == 1 && ips[0].AddressFamily == AF_INET && ips[0].Cidr == 32)
+            return ips[0].Address.V4.S_un.S_addr;
+        return 0;
+    }
+
+    /**
+     * 把成员 peer 放入错峰等待，以休眠记录写入适配器：本端暂不握手，对端在等待期间发起的握手仍可完成，
+     * 调用方需持有房间锁，peer 记录须为激活设置（put_peer 刚写入或刚激活）
+     * 按需管理的 peer 本身不会立即握手，中继等网段 peer 始终立即激活，均返回 false
+     */
+    bool hold_peer(size_t idx)
+    {
+        auto &slot = slots[idx];
+        if (slot.lazy_ip != 0 || member_ip(idx) == 0)
+        {
+            slot.held = false;
+            return false;
+        }
+        lazy_sleep(peer_at(idx), slot.saved, true);
+        slot.active = false;
+        slot.held = true;
+        return true;
+    }
+
+    // 激活 peer，恢复激活时的 endpoint 与保活，需要随后 set_config 生效，已激活返回 false
+    bool activate_peer(size_t idx)
+    {
+        auto &slot = slots[idx];
+        if (slot.active)
+            return false;
+        lazy_wake(peer_at(idx), slot.saved);
+        slot.active = true;
+        slot.held = false;
+        slot.lazy_bytes = 0;
+        slot.lazy_seen = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    // 降级空闲 peer 为休眠：留在适配器中并保留会话与 endpoint，只停止保活，需要随后 set_config 生效
+    bool demote_peer(size_t idx)
+    {
+        auto &slot = slots[idx];
+        if (!slot.active || slot.lazy_ip == 0)
+            return false;
+        lazy_sleep(peer_at(idx), slot.saved, true);
+        slot.active = false;
+        return true;
+    }
+
+    // 修改 peer 的保活间隔，休眠 peer 只修改保存的激活设置，返回记录是否变化
+    bool set_keepalive(size_t idx, uint16_t interval)
+    {
+        auto &slot = slots[idx];
+        if (!slot.active)
+        {
+            slot.saved.keepalive = interval;
+            return false;
+        }
+        auto &peer = peer_at(idx);
+        if (peer.PersistentKeepalive == interval)
+            return false;
+        peer.PersistentKeepalive = interval;
+        return true;
+    }
+
+    /**
+     * 只修改 peer 的 endpoint，调用方需持有房间锁
+     * 已激活的 peer 以单 peer、UPDATE_ONLY 的配置写入适配器，不替换其它 peer，会话与计数保持不变；
+     * 未激活的 peer 与合并窗口内的暂存变更只修改 conf，随激活或合并写入
+     */
+    _NODISCARD bool update_endpoint(size_t idx, const SOCKADDR_INET &endpoint)
+    {
+        auto &slot = slots[idx];
+        auto &peer = peer_at(idx);
+        peer.Endpoint = endpoint;
+        if (!slot.active)
+        {
+            slot.saved.flags |= WIREGUARD_PEER_HAS_ENDPOINT;
+            persist();
+            return true;
+        }
+        peer.Flags |= WIREGUARD_PEER_HAS_ENDPOINT;
+        if (dirty)
+            return true;
+        alignas(8) BYTE update[interface_size + peer_size] = {};
+        auto &iface = *reinterpret_cast<WIREGUARD_INTERFACE *>(update);
+        iface.PeersCount = 1;
+        auto &target = *reinterpret_cast<WIREGUARD_PEER *>(update + interface_size);
+        memcpy(target.PublicKey, peer.PublicKey, WIREGUARD_KEY_LENGTH);
+        target.Endpoint = endpoint;
+        target.Flags = WIREGUARD_PEER_HAS_PUBLIC_KEY | WIREGUARD_PEER_HAS_ENDPOINT | WIREGUARD_PEER_UPDATE_ONLY;
+        if (WireGuardSetConfiguration(handle, &iface, static_cast<DWORD>(sizeof(update))) == 0)
+        {
+            log(WIREGUARD_LOG_ERR, "set endpoint failed", GetLastError());
+            return false;
+        }
+        persist();
+        return true;
+    }
+
+    // 按公钥查找 peer 下标，不存在返回 npos
+    size_t find_key(const uint8_t *key)
+    {
+        const auto idx = key_index.find(peer_key_hash(key), [this, key](uint32_t i)
+                                        { return memcmp(peer_at(i).PublicKey, key, WIREGUARD_KEY_LENGTH) == 0; });
+        return idx == peer_index::npos ? npos : idx;
+    }
+
+    // 登记 endpoint 竞速，替换该 peer 已有的竞速，fallback 为空时只清除
+    void track_race(const uint8_t *key, const SOCKADDR_INET *fallback)
+    {
+        races.erase(std::remove_if(races.begin(), races.end(), [key](const endpoint_race &r)
+                                   { return memcmp(r.public_key, key, WIREGUARD_KEY_LENGTH) == 0; }),
+                    races.end());
+        if (fallback == nullptr)
+            return;
+        endpoint_race race{};
+        memcpy(race.public_key, key, WIREGUARD_KEY_LENGTH);
+        race.fallback = *fallback;
+        race.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ENDPOINT_RACE_MS);
+        race.started_ms = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                    std::chrono::system_clock::now().time_since_epoch())
+                                                    .count());
+        races.push_back(std::move(race));
+    }
+
+    // 按虚拟 IP 查找按需管理或错峰等待的 peer，闸门每拦截一个报文调用一次
+    size_t find_lazy(uint32_t ip)
+    {
+        const auto idx = ip_index.find(ip, [this, ip](uint32_t i)
+                                       { return slots[i].pending != PENDING_DEL && (slots[i].lazy_ip == ip || slots[i].held); });
+        return idx == peer_index::npos ? npos : idx;
+    }
+
+    size_t lazy_count() const
+    {
+        size_t n = 0;
+        for (const auto &slot : slots)
+            n += slot.lazy_ip != 0;
+        return n;
+    }
+
+    // 未激活 peer 的虚拟 IP，包括错峰等待的成员
+    std::vector<uint32_t> inactive_ips()
+    {
+        std::vector<uint32_t> ips;
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            const auto &slot = slots[i];
+            if (slot.active || slot.pending == PENDING_DEL)
+                continue;
+            if (slot.lazy_ip != 0)
+                ips.push_back(slot.lazy_ip);
+            else if (slot.held)
+                ips.push_back(member_ip(i));
+        }
+        return ips;
+    }
+
+    // 保存当前配置，用于失败回滚
+    void checkpoint()
+    {
+        backup.assign(conf, conf + conf_size);
+        backup_slots.assign(slots.begin(), slots.end());
+        backup_names = name_index;
+        backup_keys = key_index;
+        backup_ips = ip_index;
+    }
+
+    // 恢复到最近一次 checkpoint 的配置
+    void rollback()
+    {
+        if (!reserve(backup.size()))
+        {
+            return;
+        }
+        memcpy(conf, backup.data(), backup.size());
+        conf_size = backup.size();
+        slots.assign(backup_slots.begin(), backup_slots.end());
+        name_index = backup_names;
+        key_index = backup_keys;
+        ip_index = backup_ips;
+    }
+
+    /**
+     * 从配置中移除 peer 记录，后续记录前移；最后一个索引项移入 idx，每张索引只改动两项
+     * 倒序遍历删除时，移入的项已经遍历过
+     */
+    void remove_peer(size_t idx)
+    {
+        name_index.erase(slots[idx].hash, static_cast<uint32_t>(idx));
+        unindex_record(idx);
+        const size_t offset = slots[idx].offset;
+        const size_t len = record_size(slots[idx].ip_count);
+        memmove(conf + offset, conf + offset + len, conf_size - offset - len);
+        conf_size -= len;
+        for (auto &slot : slots)
+        {
+            if (slot.offset > offset)
+                slot.offset -= len;
+        }
+        const size_t last = slots.size() - 1;
+        if (idx != last)
+        {
+            const auto from = static_cast<uint32_t>(last);
+            const auto to = static_cast<uint32_t>(idx);
+            name_index.move(slots[last].hash, from, to);
+            key_index.move(peer_key_hash(peer_at(last).PublicKey), from, to);
+            if (const auto ip = member_ip(last); ip != 0)
+                ip_index.move(ip, from, to);
+            slots[idx] = slots[last];
+        }
+        slots.pop_back();
+        interface_config().PeersCount = static_cast<DWORD>(slots.size());
+    }
+
+    // 清空全部 peer，下次设置配置时替换适配器中的 peer
+    void clear_peers()
+    {
+        slots.clear();
+        name_index.clear();
+        key_index.clear();
+        ip_index.clear();
+        conf_size = interface_size;
+        interface_config().PeersCount = 0;
+        interface_config().Flags = BASE_FLAG | WIREGUARD_INTERFACE_REPLACE_PEERS;
+    }
+
+    /**
+     * 标记会话快照待更新，调用方需持有房间锁
+     * 只做标记，快照写入线程合并 SNAPSHOT_FLUSH_MS 内的变更后调用 encode_snapshot，锁外写入映射
+     */
+    void persist()
+    {
+        if (!persistent || closed || snapshot_dirty)
+            return;
+        snapshot_dirty = true;
+        session_snapshot::getInstance().touch();
+    }
+
+    /**
+     * 编码房间快照记录，调用方需持有房间锁
+     * 删除中的 peer 不写入，未激活的 peer 按激活时的标志写入，恢复时全部 peer 一次配置写入适配器；
+     * 私钥只以 DPAPI 密文写入，配置中的私钥置零
+     */
+    bool encode_snapshot(std::vector<BYTE> &out)
+    {
+        if (sealed_key.empty() && !snapshot_seal_key(interface_config().PrivateKey, sealed_key))
+            return false;
+        std::vector<size_t> kept;
+        kept.reserve(slots.size());
+        size_t conf_bytes = interface_size;
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            const auto &slot = slots[i];
+            if (slot.pending == PENDING_DEL || (slot.active && (peer_at(i).Flags & WIREGUARD_PEER_REMOVE) != 0))
+                continue;
+            kept.push_back(i);
+            conf_bytes += record_size(slot.ip_count);
+        }
+        snapshot_room head{};
+        strncpy_s(head.adapter_ip, adapter_ip.c_str(), _TRUNCATE);
+        strncpy_s(head.ip_area, adapter_ip_area.c_str(), _TRUNCATE);
+        wcsncpy_s(head.adapter, adapter_name.c_str(), _TRUNCATE);
+        head.prefix_length = prefix_length;
+        head.peer_count = static_cast<uint32_t>(kept.size());
+        head.conf_size = static_cast<uint32_t>(conf_bytes);
+        head.key_size = static_cast<uint32_t>(sealed_key.size());
+        const size_t key_area = snapshot_key_area(head);
+        out.assign(sizeof(snapshot_room) + key_area + kept.size() * sizeof(snapshot_peer) + conf_bytes, 0);
+        memcpy(out.data(), &head, sizeof(head));
+        memcpy(out.data() + sizeof(snapshot_room), sealed_key.data(), sealed_key.size());
+        auto *names = reinterpret_cast<snapshot_peer *>(out.data() + sizeof(snapshot_room) + key_area);
+        BYTE *dst = reinterpret_cast<BYTE *>(names + kept.size());
+        memcpy(dst, conf, interface_size);
+        auto &iface = *reinterpret_cast<WIREGUARD_INTERFACE *>(dst);
+        SecureZeroMemory(iface.PrivateKey, WIREGUARD_KEY_LENGTH);
+        iface.PeersCount = static_cast<DWORD>(kept.size());
+        iface.Flags = BASE_FLAG | WIREGUARD_INTERFACE_REPLACE_PEERS;
+        dst += interface_size;
+        for (size_t k = 0; k < kept.size(); k++)
+        {
+            const auto i = kept[k];
+            wcscpy_s(names[k].name, slots[i].name);
+            names[k].flags = slots[i].active ? peer_at(i).Flags : slots[i].saved.flags;
+            const size_t len = record_size(slots[i].ip_count);
+            memcpy(dst, conf + slots[i].offset, len);
+            auto &record = *reinterpret_cast<WIREGUARD_PEER *>(dst);
+            record.Flags = names[k].flags;
+            if (!slots[i].active)
+                record.PersistentKeepalive = slots[i].saved.keepalive;
+            dst += len;
+        }
+        return true;
+    }
+
+    /**
+     * 从会话快照载入 peer 表与配置，所有 peer 按激活写入，接口带 REPLACE_PEERS 标志，随后一次 set_config 生效
+     * 数据长度或记录边界不一致时返回 false，不修改当前配置
+     */
+    bool load_snapshot(const std::vector<BYTE> &data)
+    {
+        if (data.size() < sizeof(snapshot_room))
+            return false;
+        const auto &head = *reinterpret_cast<const snapshot_room *>(data.data());
+        const size_t names_offset = sizeof(snapshot_room) + snapshot_key_area(head);
+        const size_t names_size = static_cast<size_t>(head.peer_count) * sizeof(snapshot_peer);
+        if (head.conf_size < interface_size || names_offset + names_size + head.conf_size != data.size())
+            return false;
+        const auto *names = reinterpret_cast<const snapshot_peer *>(data.data() + names_offset);
+        const BYTE *src = data.data() + names_offset + names_size;
+        // 先校验记录边界，再写入配置
+        std::vector<peer_slot> loaded;
+        loaded.reserve(head.peer_count);
+        size_t offset = interface_size;
+        for (uint32_t k = 0; k < head.peer_count; k++)
+        {
+            if (offset + peer_size > head.conf_size || names[k].name[SNAPSHOT_PEER_NAME - 1] != L'\0')
+                return false;
+            const auto *peer = reinterpret_cast<const WIREGUARD_PEER *>(src + offset);
+            if (offset + record_size(peer->AllowedIPsCount) > head.conf_size)
+                return false;
+            peer_slot slot{};
+            slot.hash = peer_name_hash(names[k].name);
+            wcscpy_s(slot.name, names[k].name);
+            slot.offset = offset;
+            slot.ip_count = peer->AllowedIPsCount;
+            slot.active = true;
+            slot.saved = {names[k].flags, peer->PersistentKeepalive};
+            slot.lazy_seen = std::chrono::steady_clock::now();
+            loaded.push_back(slot);
+            offset += record_size(peer->AllowedIPsCount);
+        }
+        if (offset != head.conf_size || !reserve(head.conf_size))
+            return false;
+        // 快照中的私钥已置零，保留构造时写入的解密私钥
+        BYTE private_key[WIREGUARD_KEY_LENGTH];
+        memcpy(private_key, interface_config().PrivateKey, WIREGUARD_KEY_LENGTH);
+        memcpy(conf, src, head.conf_size);
+        memcpy(interface_config().PrivateKey, private_key, WIREGUARD_KEY_LENGTH);
+        SecureZeroMemory(private_key, WIREGUARD_KEY_LENGTH);
+        conf_size = head.conf_size;
+        slots = std::move(loaded);
+        rebuild_index();
+        for (size_t i = 0; i < slots.size(); i++)
+            peer_at(i).Flags = slots[i].saved.flags;
+        interface_config().PeersCount = static_cast<DWORD>(slots.size());
+        interface_config().Flags = BASE_FLAG | WIREGUARD_INTERFACE_REPLACE_PEERS;
+        return true;
+    }
 
-    // 设置适配器参数
+    // 设置适配器参数，conf 已是 wireguard 内存布局，直接传递指针
     _NODISCARD bool set_config()
     {
-        auto size_of_config = generate_config();
-        if (size_of_config == 0)
+        if (conf == nullptr)
         {
             return false;
         }
         // 设置配置
-        if (WireGuardSetConfiguration(handle, static_cast<WIREGUARD_INTERFACE *>(conf), size_of_config) != 0)
+        if (WireGuardSetConfiguration(handle, reinterpret_cast<WIREGUARD_INTERFACE *>(conf), static_cast<DWORD>(conf_size)) != 0)
+        {
+            persist();
             return true;
+        }
         log(WIREGUARD_LOG_ERR, "set configuration failed", GetLastError());
         return false;
     }
 
-    room_config(const WIREGUARD_ADAPTER_HANDLE &handle, std::wstring name,
+    // 配置缓冲区预留失败时构造出的房间不可用，调用方需以 valid() 检查
+    room_config(adapter_ptr adapter, std::wstring name,
                 const u_char *public_key, const u_char *private_key,
-                const uint16_t listen_port) noexcept : name(name), handle(handle)
+                const uint16_t listen_port) : name(name), adapter(adapter), handle(adapter.get())
     {
-        memcpy(interface_config.PublicKey, public_key, WIREGUARD_KEY_LENGTH);
-        memcpy(interface_config.PrivateKey, private_key, WIREGUARD_KEY_LENGTH);
-        interface_config.ListenPort = listen_port;
-        interface_config.PeersCount = 0;
+        if (!reserve(interface_size + PEER_RESERVE_COUNT * record_size(2)))
+        {
+            return;
+        }
+        slots.reserve(PEER_RESERVE_COUNT);
+        name_index.reserve(PEER_RESERVE_COUNT);
+        key_index.reserve(PEER_RESERVE_COUNT);
+        ip_index.reserve(PEER_RESERVE_COUNT);
+        memset(conf, 0, interface_size);
+        conf_size = interface_size;
+        auto &iface = interface_config();
+        memcpy(iface.PublicKey, public_key, WIREGUARD_KEY_LENGTH);
+        memcpy(iface.PrivateKey, private_key, WIREGUARD_KEY_LENGTH);
+        iface.ListenPort = listen_port;
+        iface.PeersCount = 0;
 
-        interface_config.Flags = BASE_FLAG | WIREGUARD_INTERFACE_REPLACE_PEERS;
+        iface.Flags = BASE_FLAG | WIREGUARD_INTERFACE_REPLACE_PEERS;
     };
 
+    // 配置缓冲区已就绪
+    bool valid() const
+    {
+        return conf != nullptr;
+    }
+
     ~room_config()
     {
         free(conf);
     };
 };
 
+// 共享采样线程的消费者，每轮按位掩码传入
+enum sample_consumer : size_t
+{
+    SAMPLE_TELEMETRY = 0,
+    SAMPLE_EVENTS = 1,
+    SAMPLE_LAZY = 2,
+    SAMPLE_KEEPALIVE = 3,
+    SAMPLE_ENDPOINT = 4,
+    SAMPLE_PATH = 5,
+};
+
+// 一轮采样中单个房间的配置：第一个需要配置的消费者触发查询，之后的消费者复用同一结果，查询失败为空
+struct config_sample
+{
+    room_config &room;
+    const WIREGUARD_INTERFACE *config = nullptr;
+    bool queried = false;
+
+    const WIREGUARD_INTERFACE *get()
+    {
+        if (!queried)
+        {
+            config = query_configuration(room.handle, room.sample_buffer);
+            queried = true;
+        }
+        return config;
+    }
+};
+
+// 成员变更结果码
+enum peer_result
+{
+    PEER_OK = 0,
+    PEER_FAILED = 1,
+    // 已暂存到合并窗口，结果稍后通过回调返回
+    PEER_PENDING = 2,
+};
+
+// 合并窗口内成员变更结果的外部回调：房间名、成员名、结果码
+static void (*peer_result_func)(const wchar_t *room, const wchar_t *peer, int code) = nullptr;
+
+// 只读查询使用的房间快照项，房间表变化后整体替换，查询无需持有任何锁
+struct room_view
+{
+    adapter_ptr adapter;
+    std::shared_ptr<room_stats> stats;
+    std::shared_ptr<room_telemetry> telemetry;
+    std::shared_ptr<room_watch> watch;
+    std::shared_ptr<transporter> trans;
+    std::string adapter_ip;
+    std::string adapter_ip_area;
+};
+
 /**
  * 管理器单例
+ * 锁层次：lifecycle_lock（房间创建/删除串行） > 房间表锁（room_table，仅保护表结构，短暂持有） > room_config::lock（单房间配置）
+ * 不同房间的成员变更互不阻塞，配置查询读取快照，不会阻塞在任何房间的 set_config 上
  */
 class WireGuardHandle
 {
@@ -131,340 +867,3193 @@ private:
         // 加载dll
         initial();
         WireGuardSetLogger((WIREGUARD_LOGGER_CALLBACK)&log_dll);
-        // 初始化广播转发器
-        auto &trans = transporter::getInstance();
         log(WIREGUARD_LOG_INFO, "handler created");
     }
 
-    WireGuardHandle()
+    WireGuardHandle() = default;
+
+    /**
+     * 成员 endpoint 为域名时解析为 IP 文本，IP 与空串原样返回，调用方不得持有房间锁
+     * 解析缓存命中（含过期后仍可用的条目）时不等待 DNS，只有未缓存的域名同步解析
+     */
+    bool resolve_endpoint(const char *host, uint16_t port, std::string &out)
+    {
+        out = host == nullptr ? "" : host;
+        if (out.empty())
+            return true;
+        sockaddr_storage addr{};
+        if (!dns_cache::getInstance().resolve(out, port, addr))
+        {
+            log(WIREGUARD_LOG_ERR, "peer endpoint resolve failed: " + out);
+            return false;
+        }
+        char text[INET6_ADDRSTRLEN] = {};
+        const void *src = addr.ss_family == AF_INET6 ? static_cast<const void *>(&reinterpret_cast<const sockaddr_in6 &>(addr).sin6_addr)
+                                                     : static_cast<const void *>(&reinterpret_cast<const sockaddr_in &>(addr).sin_addr);
+        if (inet_ntop(addr.ss_family, src, text, sizeof(text)) == nullptr)
+            return false;
+        out = text;
+        return true;
+    }
+
+    // 解析成员参数并写入房间配置，不应用到适配器，返回 peer 下标，失败返回 npos，调用方需持有房间锁
+    size_t stage_peer(room_config &room, const wchar_t *peer_name, const u_char *pub_key,
+                             const char *ip, uint16_t port, const char **allowed_ips, size_t allowed_ip_count)
+    {
+        WIREGUARD_PEER new_peer = {};
+        new_peer.Flags = room_config::BASE_PEER_FLAG;
+        // 重复添加的 peer 沿用已探测的间隔，新 peer 从保守值开始
+        new_peer.PersistentKeepalive = room.keepalive.interval_for(pub_key);
+        // 设置对端真实地址
+        if (ip != nullptr && ip[0] != '\0') {
+            new_peer.Flags |= WIREGUARD_PEER_HAS_ENDPOINT;
+            if(!parse_ip(ip, port, new_peer.Endpoint))
+            {
+                log(WIREGUARD_LOG_ERR, "peer endpoint format error");
+                return room_config::npos;
+            }
+        }
+        memcpy(new_peer.PublicKey, pub_key, WIREGUARD_KEY_LENGTH);
+        const bool fresh = room.find_peer(peer_name) == room_config::npos;
+        // 新成员优先使用同一网络下产生过握手的缓存 endpoint，重复添加的成员沿用服务器下发的 endpoint
+        SOCKADDR_INET fallback{};
+        const bool race = fresh && cached_endpoint(new_peer, fallback);
+
+        // 先解析 allowed_ips 到复用的临时列表，避免解析失败时污染已有配置
+        auto &allowed_buffer = room.allowed_buffer;
+        allowed_buffer.clear();
+        for (size_t i = 0; i < allowed_ip_count; i++)
+        {
+            WIREGUARD_ALLOWED_IP allowed_ip = {};
+            if (!parse_allowed_ip(std::string(allowed_ips[i]), allowed_ip))
+            {
+                log(WIREGUARD_LOG_WARN, std::string("allowed_ip format failed: ") + allowed_ips[i]);
+                continue;
+            }
+            allowed_buffer.push_back(allowed_ip);
+        }
+        const auto idx = room.put_peer(peer_name, new_peer, allowed_buffer.data(), static_cast<DWORD>(allowed_buffer.size()));
+        if (idx != room_config::npos)
+        {
+            auto &slot = room.slots[idx];
+            slot.pending = room_config::PENDING_NONE;
+            room.track_race(pub_key, race ? &fallback : nullptr);
+            room.apply_lazy(idx, lazy_idle_ms.load() > 0);
+            // 新成员与仍在等待的成员进入错峰队列，已激活的成员原地更新
+            if ((fresh || slot.held) && stagger.enabled() && room.hold_peer(idx))
+            {
+                stagger.push(room.name, slot.name, false, std::chrono::steady_clock::now());
+                wake_stagger();
+            }
+            else
+            {
+                slot.held = false;
+            }
+        }
+        return idx;
+    }
+
+    // 记录成员结果，由合并线程在释放锁后回调，避免回调期间阻塞调用线程造成死锁
+    void report(const room_config &room, const wchar_t *peer_name, int code)
+    {
+        if (peer_result_func == nullptr)
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(coalesce_lock);
+            reports.push_back({room.name, peer_name, code});
+            coalesce_wake = true;
+        }
+        coalesce_cv.notify_one();
+    }
+
+    // 开启房间的合并窗口，窗口内第一次变更前保存回滚点，调用方需持有房间锁
+    void begin_window(room_config &room)
+    {
+        if (room.dirty)
+        {
+            return;
+        }
+        room.checkpoint();
+        room.dirty = true;
+        room.pending_since = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(coalesce_lock);
+            coalesce_wake = true;
+        }
+        coalesce_cv.notify_one();
+    }
+
+    // 将合并窗口内暂存的变更一次性应用到适配器，并逐个回调成员结果，调用方需持有房间锁
+    void flush_room(room_config &room)
+    {
+        if (!room.dirty)
+        {
+            return;
+        }
+        room.dirty = false;
+        const bool ok = room.set_config();
+        for (const auto &slot : room.slots)
+        {
+            if (slot.pending != room_config::PENDING_NONE)
+                report(room, slot.name, ok ? PEER_OK : PEER_FAILED);
+        }
+        if (!ok)
+        {
+            room.rollback();
+            return;
+        }
+        for (size_t i = room.slots.size(); i-- > 0;)
+        {
+            if (room.slots[i].pending == room_config::PENDING_DEL)
+                room.remove_peer(i);
+            else
+                room.slots[i].pending = room_config::PENDING_NONE;
+        }
+    }
+
+    // 当前房间列表副本，遍历期间不持有房间表锁
+    std::vector<std::shared_ptr<room_config>> room_list()
+    {
+        return rooms.list();
+    }
+
+    // 合并线程：等待最早的窗口到期后应用对应房间的暂存变更
+    void coalesce_loop()
+    {
+        while (true)
+        {
+            auto deadline = std::chrono::steady_clock::time_point::max();
+            for (const auto &room : room_list())
+            {
+                // set_config 失败的日志延后到解锁后输出
+                log_batch logs;
+                std::lock_guard<std::mutex> guard(room->lock);
+                if (room->closed || !room->dirty)
+                    continue;
+                const auto expire = room->pending_since + std::chrono::milliseconds(coalesce_window_ms.load());
+                if (expire <= std::chrono::steady_clock::now())
+                    flush_room(*room);
+                else if (expire < deadline)
+                    deadline = expire;
+            }
+            std::unique_lock<std::mutex> lock(coalesce_lock);
+            if (!reports.empty())
+            {
+                auto out = std::move(reports);
+                reports.clear();
+                lock.unlock();
+                for (const auto &r : out)
+                {
+                    if (peer_result_func != nullptr)
+                        peer_result_func(r.room.c_str(), r.peer.c_str(), r.code);
+                }
+                continue;
+            }
+            if (coalesce_stop)
+                break;
+            if (deadline == std::chrono::steady_clock::time_point::max())
+                coalesce_cv.wait(lock, [this]
+                                 { return coalesce_wake || coalesce_stop; });
+            else
+                coalesce_cv.wait_until(lock, deadline, [this]
+                                       { return coalesce_wake || coalesce_stop; });
+            coalesce_wake = false;
+        }
+    }
+
+    /**
+     * 共享采样线程的一轮：每个房间最多查询一次适配器配置，分发给本轮到期的遥测、事件、按需激活、保活、endpoint 缓存与路径切换
+     * 各消费者先做不需要配置的检查，确实需要时才触发查询，本轮没有消费者需要的房间不查询
+     */
+    void sample_pass(uint32_t due, std::chrono::steady_clock::time_point now)
+    {
+        // 本轮日志在 release 之后输出：日志回调要等 JS 主线程，而主线程可能正在关闭某个消费者、等待本轮结束
+        log_batch logs;
+        const auto has = [due](sample_consumer c)
+        { return (due & (1u << c)) != 0; };
+        const auto now_ms = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                      std::chrono::system_clock::now().time_since_epoch())
+                                                      .count());
+        // 保活节省量按实际间隔累计，关闭期间的间隔不计入
+        double keepalive_elapsed = 0;
+        if (has(SAMPLE_KEEPALIVE))
+        {
+            const double tick_s = KEEPALIVE_TICK_MS / 1000.0;
+            keepalive_elapsed = keepalive_last == std::chrono::steady_clock::time_point()
+                                    ? tick_s
+                                    : std::min(std::chrono::duration<double>(now - keepalive_last).count(), 2 * tick_s);
+            keepalive_last = now;
+        }
+        bool record = false;
+        uint64_t fingerprint = 0;
+        if (has(SAMPLE_ENDPOINT))
+        {
+            record = now - endpoint_recorded >= std::chrono::milliseconds(ENDPOINT_RECORD_MS);
+            if (record)
+                endpoint_recorded = now;
+            fingerprint = endpoint_cache::getInstance().fingerprint(now_ms);
+        }
+        // 探测经由打洞引擎发出，引擎未启动时只判定不探测
+        const bool divert = has(SAMPLE_PATH) && prober.running();
+        const bool probe = divert || (has(SAMPLE_PATH) && puncher.running());
+        path_batch.clear();
+
+        for (const auto &room : room_list())
+        {
+            config_sample sample{*room};
+            if (has(SAMPLE_TELEMETRY))
+                room->telemetry->sample(sample.get(), room->trans.get(), now, now_ms);
+            if (has(SAMPLE_EVENTS))
+                room->watch->diff(room->name, room->handle, sample.get(), room->trans.get(), now_ms, events);
+            if (has(SAMPLE_LAZY))
+                check_idle(*room, now, sample);
+            if (has(SAMPLE_KEEPALIVE))
+                tune_keepalive(*room, now, keepalive_elapsed, sample);
+            if (has(SAMPLE_ENDPOINT))
+                scan_endpoints(*room, record, fingerprint, now, now_ms, sample);
+            if (has(SAMPLE_PATH))
+                tick_paths(room, now, probe, path_batch, sample);
+        }
+
+        if (has(SAMPLE_TELEMETRY))
+            dump_telemetry(now, now_ms);
+        if (has(SAMPLE_ENDPOINT))
+        {
+            if (endpoint_flushed == std::chrono::steady_clock::time_point())
+                endpoint_flushed = now;
+            else if (now - endpoint_flushed >= std::chrono::milliseconds(ENDPOINT_FLUSH_MS))
+            {
+                endpoint_cache::getInstance().flush();
+                endpoint_flushed = now;
+            }
+        }
+        if (has(SAMPLE_PATH))
+            send_path_probes(now, divert);
+        sampler.release();
+    }
+
+    // 遥测导出到期时写出各房间最新采样的 prometheus 文本
+    void dump_telemetry(std::chrono::steady_clock::time_point now, uint64_t now_ms)
+    {
+        std::string path;
+        std::chrono::milliseconds dump_interval;
+        {
+            std::lock_guard<std::mutex> lock(telemetry_lock);
+            path = telemetry_dump_path;
+            dump_interval = std::chrono::milliseconds(telemetry_dump_ms);
+        }
+        if (path.empty() || now < telemetry_next_dump)
+            return;
+        const auto current = rooms.snapshot();
+        std::vector<room_exposition> rooms_text(current->size());
+        size_t i = 0;
+        for (const auto &[name, view] : *current)
+        {
+            rooms_text[i].room = formmater::to_utf8(name);
+            view.telemetry->expose(rooms_text[i++]);
+        }
+        write_text_file(path, formmater::prometheus_text(rooms_text, now_ms));
+        telemetry_next_dump = std::chrono::steady_clock::now() + dump_interval;
+    }
+
+    // 停止事件比对与派发线程
+    void stop_events()
+    {
+        sampler.set(SAMPLE_EVENTS, 0, false);
+        events.stop();
+    }
+
+    // 为房间启动按需激活闸门，调用方不能持有房间锁
+    void start_gate(const std::shared_ptr<room_config> &room)
+    {
+        std::weak_ptr<room_config> weak = room;
+        auto gate = std::make_shared<lazy_gate>(
+            room->interface_index,
+            [weak]
+            {
+                const auto r = weak.lock();
+                if (r == nullptr)
+                    return std::vector<uint32_t>();
+                std::lock_guard<std::mutex> guard(r->lock);
+                r->gate_ips = r->closed ? std::vector<uint32_t>() : r->inactive_ips();
+                return r->gate_ips;
+            },
+            [this, weak](uint32_t ip)
+            {
+                if (const auto r = weak.lock(); r != nullptr)
+                    activate_lazy(*r, ip);
+            });
+        {
+            std::lock_guard<std::mutex> guard(room->lock);
+            if (room->closed || room->gate != nullptr)
+                return;
+            for (size_t i = 0; i < room->slots.size(); i++)
+                room->apply_lazy(i, true);
+            room->gate = gate;
+        }
+        gate->start();
+    }
+
+    // 摘下并停止房间的闸门，调用方不能持有房间锁
+    static void stop_gate(room_config &room)
+    {
+        std::shared_ptr<lazy_gate> gate;
+        {
+            std::lock_guard<std::mutex> guard(room.lock);
+            gate = std::move(room.gate);
+        }
+        if (gate != nullptr)
+            gate->stop();
+    }
+
+    /**
+     * 闸门拦截到发往未激活 peer 的报文：写入适配器后由闸门注入被拦截的报文
+     * 开启握手错峰时改为以紧急优先级排队，由错峰线程在并发名额内激活，期间的报文经中继转发
+     */
+    void activate_lazy(room_config &room, uint32_t ip)
+    {
+        // 闸门线程上的日志延后到解锁后输出
+        log_batch logs;
+        std::shared_ptr<lazy_gate> gate;
+        {
+            std::lock_guard<std::mutex> guard(room.lock);
+            if (room.closed)
+                return;
+            const auto idx = room.find_lazy(ip);
+            if (idx == room_config::npos || room.slots[idx].active)
+                return;
+            if (stagger.enabled())
+            {
+                stagger.push(room.name, room.slots[idx].name, true, std::chrono::steady_clock::now());
+                wake_stagger();
+                return;
+            }
+            if (room.slots[idx].held || !room.activate_peer(idx))
+                return;
+            if (!room.set_config())
+            {
+                room.demote_peer(idx);
+                log(WIREGUARD_LOG_ERR, "lazy peer activate failed");
+                return;
+            }
+            log_dll(WIREGUARD_LOG_INFO, 0, std::wstring(L"lazy peer activated:").append(room.slots[idx].name).c_str());
+            gate = room.gate;
+        }
+        if (gate != nullptr)
+            gate->refresh();
+    }
+
+    /**
+     * 空闲检查：收发字节在 lazy_idle_ms 内没有变化的按需 peer 降级为休眠，并刷新闸门
+     * 加锁前从本轮采样的配置中提取各 peer 的公钥与收发字节，锁内按公钥索引逐个对应
+     */
+    void check_idle(room_config &room, std::chrono::steady_clock::time_point now, config_sample &sample)
+    {
+        const auto idle = std::chrono::milliseconds(lazy_idle_ms.load());
+        {
+            std::lock_guard<std::mutex> guard(room.lock);
+            if (room.closed || room.gate == nullptr)
+                return;
+        }
+        const auto config = sample.get();
+        auto &samples = room.lazy_samples;
+        samples.clear();
+        const BYTE *cursor = config == nullptr ? nullptr : reinterpret_cast<const BYTE *>(config) + interface_size;
+        for (DWORD p = 0; config != nullptr && p < config->PeersCount; p++)
+        {
+            const auto *peer = reinterpret_cast<const WIREGUARD_PEER *>(cursor);
+            cursor += peer_size + peer->AllowedIPsCount * allowed_ip_size;
+            samples.emplace_back(peer->PublicKey, peer->TxBytes + peer->RxBytes);
+        }
+        log_batch logs;
+        std::shared_ptr<lazy_gate> gate;
+        {
+            std::lock_guard<std::mutex> guard(room.lock);
+            if (room.closed || room.gate == nullptr)
+                return;
+            std::vector<size_t> demoted;
+            for (const auto &[key, bytes] : samples)
+            {
+                const auto i = room.find_key(key);
+                if (i == room_config::npos)
+                    continue;
+                auto &slot = room.slots[i];
+                if (slot.lazy_ip == 0 || !slot.active)
+                    continue;
+                if (bytes != slot.lazy_bytes)
+                {
+                    slot.lazy_bytes = bytes;
+                    slot.lazy_seen = now;
+                }
+                else if (now - slot.lazy_seen >= idle && room.demote_peer(i))
+                {
+                    demoted.push_back(i);
+                    log_dll(WIREGUARD_LOG_INFO, 0, std::wstring(L"lazy peer demoted:").append(slot.name).c_str());
+                }
+            }
+            if (!demoted.empty() && !room.set_config())
+            {
+                log(WIREGUARD_LOG_ERR, "lazy peer demote failed");
+                for (const auto i : demoted)
+                    room.activate_peer(i);
+            }
+            // 新增、删除或降级的 peer 需要更新闸门过滤器
+            if (room.inactive_ips() != room.gate_ips)
+                gate = room.gate;
+        }
+        if (gate != nullptr)
+            gate->refresh();
+    }
+
+    // 按探测结果更新房间内各 peer 的保活间隔，合并窗口内有暂存变更时跳过本轮
+    void tune_keepalive(room_config &room, std::chrono::steady_clock::time_point now, double elapsed_s, config_sample &sample)
+    {
+        const auto config = sample.get();
+        // 写入失败的日志延后到解锁后输出
+        log_batch logs;
+        std::lock_guard<std::mutex> guard(room.lock);
+        if (room.closed || room.dirty)
+            return;
+        if (config == nullptr)
+        {
+            // 查询失败时无法判断映射状态，回退到保守值
+            room.keepalive.clear();
+        }
+        else if (!room.keepalive.update(config, now, elapsed_s))
+        {
+            return;
+        }
+        bool changed = false;
+        for (size_t i = 0; i < room.slots.size(); i++)
+            changed |= room.set_keepalive(i, room.keepalive.interval_for(room.peer_at(i).PublicKey));
+        if (changed && !room.set_config())
+            log(WIREGUARD_LOG_ERR, "keepalive update failed");
+    }
+
+    // 按当前配置同步房间的探测目标：每个 peer 的第一个单主机 allowed ip 视为其虚拟 IP
+    void sync_latency(room_config &room, uint16_t port, std::chrono::steady_clock::time_point now)
+    {
+        {
+            std::lock_guard<std::mutex> guard(room.lock);
+            if (room.closed)
+            {
+                room.latency.close();
+                return;
+            }
+        }
+        if (!room.latency.opened())
+        {
+            sockaddr_storage local{};
+            auto &in = reinterpret_cast<sockaddr_in &>(local);
+            in.sin_family = AF_INET;
+            in.sin_port = htons(port);
+            // 虚拟 IP 在适配器启动后才可绑定，失败时下一轮重试
+            if (inet_pton(AF_INET, room.adapter_ip.c_str(), &in.sin_addr) != 1 || !room.latency.open(local))
+                return;
+            log(WIREGUARD_LOG_INFO, "latency probe bind " + room.adapter_ip + ":" + std::to_string(port));
+        }
+        const auto config = query_configuration(room.handle, room.latency_buffer);
+        if (config == nullptr)
+            return;
+        room.latency_targets.clear();
+        const BYTE *cursor = reinterpret_cast<const BYTE *>(config) + interface_size;
+        for (DWORD i = 0; i < config->PeersCount; i++)
+        {
+            const auto *peer = reinterpret_cast<const WIREGUARD_PEER *>(cursor);
+            const auto *ips = reinterpret_cast<const WIREGUARD_ALLOWED_IP *>(cursor + peer_size);
+            cursor += peer_size + peer->AllowedIPsCount * allowed_ip_size;
+            latency_target t{};
+            memcpy(t.public_key, peer->PublicKey, WIREGUARD_KEY_LENGTH);
+            t.bytes = peer->RxBytes + peer->TxBytes;
+            for (DWORD k = 0; k < peer->AllowedIPsCount; k++)
+            {
+                if (ips[k].AddressFamily == AF_INET && ips[k].Cidr == 32)
+                {
+                    auto &in = reinterpret_cast<sockaddr_in &>(t.vip);
+                    in.sin_family = AF_INET;
+                    in.sin_addr = ips[k].Address.V4;
+                    in.sin_port = htons(port);
+                    break;
+                }
+            }
+            if (t.vip.ss_family != 0)
+                room.latency_targets.push_back(t);
+        }
+        room.latency.sync(room.latency_targets, now);
+    }
+
+    // 时延探测线程：按各房间探测器给出的时间发送探测，每 LATENCY_SYNC_MS 同步一次 peer 列表
+    void latency_loop()
+    {
+        std::unique_lock<std::mutex> lock(latency_lock);
+        auto sync_at = std::chrono::steady_clock::now();
+        std::vector<pollfd> fds;
+        std::vector<std::shared_ptr<room_config>> owners;
+        while (!latency_stop)
+        {
+            const uint16_t port = latency_port;
+            lock.unlock();
+            auto now = std::chrono::steady_clock::now();
+            const auto rooms = room_list();
+            if (now >= sync_at)
+            {
+                for (const auto &room : rooms)
+                    sync_latency(*room, port, now);
+                sync_at = now + std::chrono::milliseconds(LATENCY_SYNC_MS);
+            }
+            auto wake = sync_at;
+            fds.clear();
+            owners.clear();
+            for (const auto &room : rooms)
+            {
+                const auto due = room->latency.send_due(now);
+                if (due < wake)
+                    wake = due;
+                const auto s = room->latency.handle();
+                if (s == PUNCH_INVALID_SOCKET)
+                    continue;
+                fds.push_back({s, POLLIN, 0});
+                owners.push_back(room);
+            }
+            const int wait_ms = punch_wait_ms(wake, now, LATENCY_IDLE_WAIT_MS);
+            if (!fds.empty() && punch_poll(fds.data(), fds.size(), wait_ms) > 0)
+            {
+                now = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < fds.size(); i++)
+                {
+                    if ((fds[i].revents & POLLIN) != 0)
+                        owners[i]->latency.receive(now);
+                }
+            }
+            lock.lock();
+            if (fds.empty())
+                latency_cv.wait_for(lock, std::chrono::milliseconds(wait_ms), [this]
+                                    { return latency_stop; });
+        }
+    }
+
+    // 停止时延探测线程并关闭各房间的探测套接字
+    void stop_latency()
+    {
+        {
+            std::lock_guard<std::mutex> lock(latency_lock);
+            latency_stop = true;
+        }
+        latency_cv.notify_all();
+        if (latency_thread.joinable())
+        {
+            latency_thread.join();
+        }
+        for (const auto &room : room_list())
+            room->latency.close();
+    }
+
+    // 路径探测结果回填对应房间的路径选择器，不是路径探测返回 false
+    bool take_path_result(const punch_result &r)
+    {
+        path_pending pending{};
+        {
+            std::lock_guard<std::mutex> lock(path_probe_lock);
+            const auto it = path_probes.find(r.id);
+            if (it == path_probes.end())
+                return false;
+            pending = it->second;
+            path_probes.erase(it);
+        }
+        const auto room = pending.room.lock();
+        if (room == nullptr)
+            return true;
+        std::lock_guard<std::mutex> guard(room->lock);
+        if (!room->closed)
+            room->paths.sample(pending.public_key, pending.kind, r.success, r.elapsed_ms, r.sent);
+        return true;
+    }
+
+    /**
+     * 以适配器中 peer 实际使用的 endpoint 校正路径选择器，调用方需持有房间锁，并在加锁前声明 log_batch
+     * WireGuard 漫游后同步房间配置中的 endpoint，之后整体写入配置时不会把 peer 拉回旧地址
+     */
+    void reconcile_paths(room_config &room, const WIREGUARD_INTERFACE *config, std::chrono::steady_clock::time_point now)
+    {
+        const BYTE *cursor = reinterpret_cast<const BYTE *>(config) + interface_size;
+        for (DWORD i = 0; i < config->PeersCount; i++)
+        {
+            const auto *peer = reinterpret_cast<const WIREGUARD_PEER *>(cursor);
+            cursor += peer_size + peer->AllowedIPsCount * allowed_ip_size;
+            if (peer->Endpoint.si_family != AF_INET && peer->Endpoint.si_family != AF_INET6)
+                continue;
+            const auto idx = room.find_key(peer->PublicKey);
+            if (idx == room_config::npos || !room.slots[idx].active)
+                continue;
+            const auto actual = endpoint_storage(peer->Endpoint);
+            if (!room.paths.observe(peer->PublicKey, actual, now))
+                continue;
+            auto &conf = room.peer_at(idx);
+            if (same_endpoint(conf.Endpoint, peer->Endpoint))
+                continue;
+            conf.Endpoint = peer->Endpoint;
+            room.persist();
+            const auto text = format_candidate(actual);
+            log_dll(WIREGUARD_LOG_INFO, 0, (std::wstring(room.slots[idx].name) + L" path roamed to " + std::wstring(text.begin(), text.end())).c_str());
+        }
+    }
+
+    /**
+     * 推进房间的路径选择：清理已删除的成员，按实际 endpoint 校正当前路径，以只改 endpoint 的配置执行到期的切换，收集需要发出的探测
+     * 写入失败时回退选择器的当前路径，下一轮重新判定
+     */
+    void tick_paths(const std::shared_ptr<room_config> &room, std::chrono::steady_clock::time_point now, bool probe,
+                    std::vector<std::pair<std::shared_ptr<room_config>, path_probe>> &probes, config_sample &sample)
+    {
+        {
+            std::lock_guard<std::mutex> guard(room->lock);
+            if (room->closed || room->paths.empty())
+                return;
+        }
+        // 对端从另一地址发来报文时 WireGuard 会漫游过去，每轮判定前读回实际 endpoint
+        const auto config = sample.get();
+        // 漫游与切换日志延后到解锁后输出
+        log_batch logs;
+        std::lock_guard<std::mutex> guard(room->lock);
+        if (room->closed || room->paths.empty())
+            return;
+        room->paths.retain([&room](const uint8_t *key)
+                           { return room->find_key(key) != room_config::npos; });
+        // 合并窗口内暂存的 endpoint 尚未写入适配器，读回的配置不代表漫游
+        if (config != nullptr && !room->dirty)
+            reconcile_paths(*room, config, now);
+        std::vector<path_switch> switches;
+        room->paths.evaluate(now, switches);
+        for (const auto &s : switches)
+        {
+            const auto idx = room->find_key(s.public_key);
+            SOCKADDR_INET endpoint{};
+            if (!storage_endpoint(s.endpoint, endpoint) || !room->update_endpoint(idx, endpoint))
+            {
+                room->paths.set_active(s.public_key, s.to == PATH_DIRECT ? PATH_RELAY : PATH_DIRECT);
+                log(WIREGUARD_LOG_ERR, "path switch failed");
+                continue;
+            }
+            const auto text = describe_switch(s);
+            log_dll(WIREGUARD_LOG_INFO, 0, (std::wstring(room->slots[idx].name) + L" " + std::wstring(text.begin(), text.end())).c_str());
+        }
+        if (!probe)
+            return;
+        std::vector<path_probe> due;
+        room->paths.due(now, due);
+        for (const auto &p : due)
+            probes.emplace_back(room, p);
+    }
+
+    // 发出本轮收集的路径探测，清理引擎重启后不再回调的探测
+    void send_path_probes(std::chrono::steady_clock::time_point now, bool divert)
+    {
+        // 持有叶子锁发出探测，应答回调先于登记到达时在锁上等待
+        std::lock_guard<std::mutex> guard(path_probe_lock);
+        for (auto it = path_probes.begin(); it != path_probes.end();)
+        {
+            if (now - it->second.issued > std::chrono::milliseconds(2 * PATH_PROBE_TIMEOUT_MS))
+                it = path_probes.erase(it);
+            else
+                ++it;
+        }
+        for (const auto &[room, p] : path_batch)
+        {
+            const std::vector<punch_candidate> remote = {{p.endpoint, PUNCH_REFLEXIVE}};
+            const auto id = divert ? prober.connect(PUNCH_PROBE_SESSION, remote, PATH_PROBE_TIMEOUT_MS)
+                                   : puncher.connect(PUNCH_PROBE_SESSION, remote, PATH_PROBE_TIMEOUT_MS);
+            if (id == 0)
+                continue;
+            path_pending pending{room, {}, p.kind, now};
+            memcpy(pending.public_key, p.public_key, WIREGUARD_KEY_LENGTH);
+            path_probes.emplace(id, pending);
+        }
+        path_batch.clear();
+    }
+
+    // 停止路径切换并丢弃进行中的探测
+    void stop_paths()
+    {
+        sampler.set(SAMPLE_PATH, 0, false);
+        std::lock_guard<std::mutex> guard(path_probe_lock);
+        path_probes.clear();
+    }
+
+    // 唤醒错峰线程，可在持有房间锁时调用
+    void wake_stagger()
+    {
+        {
+            std::lock_guard<std::mutex> lock(stagger_lock);
+            stagger_wake = true;
+        }
+        stagger_cv.notify_one();
+    }
+
+    // 激活错峰队列中到期的成员，同一房间的成员合并为一次配置
+    void release_staggered(const std::vector<std::pair<std::wstring, std::wstring>> &grants, bool track)
+    {
+        std::vector<std::wstring> rooms_seen;
+        for (const auto &[room_name, peer_name] : grants)
+        {
+            if (std::find(rooms_seen.begin(), rooms_seen.end(), room_name) != rooms_seen.end())
+                continue;
+            rooms_seen.push_back(room_name);
+            const auto room = find_room(room_name.c_str());
+            if (room == nullptr)
+                continue;
+            // 激活日志延后到解锁后输出
+            log_batch logs;
+            std::shared_ptr<lazy_gate> gate;
+            {
+                std::lock_guard<std::mutex> guard(room->lock);
+                if (room->closed)
+                    continue;
+                std::vector<size_t> released;
+                for (const auto &[r, p] : grants)
+                {
+                    if (r != room_name)
+                        continue;
+                    const auto idx = room->find_peer(p.c_str());
+                    if (idx == room_config::npos || room->slots[idx].pending == room_config::PENDING_DEL)
+                        continue;
+                    // 等待期间按需激活的 peer 可能已被闸门激活，未激活的按需 peer 由紧急排队进入
+                    if (!room->slots[idx].held && room->slots[idx].lazy_ip == 0)
+                        continue;
+                    if (room->activate_peer(idx))
+                        released.push_back(idx);
+                }
+                if (released.empty())
+                    continue;
+                // 合并窗口内的暂存变更不提前应用，稍后再激活；配置失败时等待一个握手超时后重试
+                const bool dirty = room->dirty;
+                if (dirty || !room->set_config())
+                {
+                    const auto retry = std::chrono::steady_clock::now() +
+                                       std::chrono::milliseconds(dirty ? STAGGER_TICK_MS : STAGGER_HANDSHAKE_TIMEOUT_MS);
+                    for (const auto i : released)
+                    {
+                        if (!room->hold_peer(i))
+                            room->demote_peer(i);
+                        stagger.push(room_name, room->slots[i].name, false, retry);
+                    }
+                    if (!dirty)
+                        log(WIREGUARD_LOG_ERR, "staggered peer activate failed");
+                    continue;
+                }
+                const auto now = std::chrono::steady_clock::now();
+                const auto now_ms = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                              std::chrono::system_clock::now().time_since_epoch())
+                                                              .count());
+                for (const auto i : released)
+                {
+                    if (track)
+                        stagger.launched(room_name, room->peer_at(i).PublicKey, now, now_ms);
+                }
+                log_dll(WIREGUARD_LOG_INFO, 0, (L"staggered peers activated:" + std::to_wstring(released.size()) + L" room:" + room_name).c_str());
+                gate = room->gate;
+            }
+            if (gate != nullptr)
+                gate->refresh();
+        }
+    }
+
+    // 错峰线程：释放已完成或超时的握手，在并发名额内激活到期的成员
+    void stagger_loop()
+    {
+        std::unique_lock<std::mutex> lock(stagger_lock);
+        while (!stagger_stop)
+        {
+            stagger_wake = false;
+            lock.unlock();
+            for (const auto &name : stagger.inflight_rooms())
+            {
+                const auto room = find_room(name.c_str());
+                stagger.settle(name, room == nullptr ? nullptr : query_configuration(room->handle, stagger_buffer));
+            }
+            auto now = std::chrono::steady_clock::now();
+            stagger.expire(now);
+            release_staggered(stagger.take(now), true);
+            now = std::chrono::steady_clock::now();
+            const auto wake = stagger.next_wake(now);
+            lock.lock();
+            if (stagger_stop || stagger_wake)
+                continue;
+            if (wake == std::chrono::steady_clock::time_point::max())
+                stagger_cv.wait(lock, [this]
+                                { return stagger_stop || stagger_wake; });
+            else
+                stagger_cv.wait_until(lock, wake, [this]
+                                      { return stagger_stop || stagger_wake; });
+        }
+    }
+
+    // 停止错峰线程
+    void stop_stagger()
+    {
+        {
+            std::lock_guard<std::mutex> lock(stagger_lock);
+            stagger_stop = true;
+        }
+        stagger_cv.notify_all();
+        if (stagger_thread.joinable())
+        {
+            stagger_thread.join();
+        }
+    }
+
+    /**
+     * 用缓存中当前网络下最近产生过握手的 endpoint 替换服务器下发的 endpoint
+     * 需要在超时后切回服务器下发的 endpoint 时返回 true，缓存未开启或没有缓存时不修改 peer
+     */
+    bool cached_endpoint(WIREGUARD_PEER &peer, SOCKADDR_INET &fallback)
+    {
+        auto &cache = endpoint_cache::getInstance();
+        if (!cache.enabled())
+            return false;
+        const auto now_ms = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                      std::chrono::system_clock::now().time_since_epoch())
+                                                      .count());
+        return prefer_cached_endpoint(peer, cache.lookup(peer.PublicKey, cache.fingerprint(now_ms), now_ms), fallback);
+    }
+
+    /**
+     * 记录房间内产生握手的 endpoint，并推进 endpoint 竞速：
+     * 缓存 endpoint 握手成功即结束，超过 ENDPOINT_RACE_MS 未握手切回服务器下发的 endpoint，未激活的 peer 推迟判定
+     */
+    void scan_endpoints(room_config &room, bool record, uint64_t fingerprint, std::chrono::steady_clock::time_point now, uint64_t now_ms,
+                        config_sample &sample)
+    {
+        {
+            std::lock_guard<std::mutex> guard(room.lock);
+            if (room.closed || (!record && room.races.empty()))
+                return;
+        }
+        const auto config = sample.get();
+        if (config == nullptr)
+            return;
+        auto &cache = endpoint_cache::getInstance();
+        // 配置快照中 peer 的最近握手时间，不存在返回 0
+        const auto handshake_of = [config](const uint8_t *key) -> uint64_t
+        {
+            const BYTE *cursor = reinterpret_cast<const BYTE *>(config) + interface_size;
+            for (DWORD i = 0; i < config->PeersCount; i++)
+            {
+                const auto *peer = reinterpret_cast<const WIREGUARD_PEER *>(cursor);
+                cursor += peer_size + peer->AllowedIPsCount * allowed_ip_size;
+                if (memcmp(peer->PublicKey, key, WIREGUARD_KEY_LENGTH) == 0)
+                    return handshake_to_unix_ms(peer->LastHandshake);
+            }
+            return 0;
+        };
+        if (record)
+        {
+            const BYTE *cursor = reinterpret_cast<const BYTE *>(config) + interface_size;
+            for (DWORD i = 0; i < config->PeersCount; i++)
+            {
+                const auto *peer = reinterpret_cast<const WIREGUARD_PEER *>(cursor);
+                cursor += peer_size + peer->AllowedIPsCount * allowed_ip_size;
+                const auto handshake = handshake_to_unix_ms(peer->LastHandshake);
+                if (handshake != 0 && now_ms - handshake < ENDPOINT_FRESH_MS)
+                    cache.record(peer->PublicKey, peer->Endpoint, fingerprint, now_ms);
+            }
+        }
+
+        // 切换失败的日志延后到解锁后输出
+        log_batch logs;
+        std::lock_guard<std::mutex> guard(room.lock);
+        if (room.closed)
+            return;
+        for (size_t i = room.races.size(); i-- > 0;)
+        {
+            auto &race = room.races[i];
+            const auto idx = room.find_key(race.public_key);
+            if (idx == room_config::npos || handshake_of(race.public_key) >= race.started_ms)
+            {
+                room.races.erase(room.races.begin() + static_cast<ptrdiff_t>(i));
+                continue;
+            }
+            if (now < race.deadline)
+                continue;
+            if (!room.slots[idx].active || room.dirty)
+            {
+                // 未激活的 peer 不会握手，合并窗口内的暂存变更尚未应用，均推迟判定
+                race.deadline = now + std::chrono::milliseconds(ENDPOINT_RACE_MS);
+                continue;
+            }
+            // 以 UPDATE_ONLY 只改 endpoint，不重建 peer：对端期间发起的握手与已有会话保留，
+            // wireguard 的下一次握手重传即发往服务器下发的 endpoint
+            if (!room.update_endpoint(idx, race.fallback))
+                log(WIREGUARD_LOG_ERR, "endpoint switch failed");
+            room.races.erase(room.races.begin() + static_cast<ptrdiff_t>(i));
+        }
+    }
+
+public:
+    static WireGuardHandle h_instance;
+    static std::once_flag initInstanceFlag;
+    // 房间表，值为共享指针：查找后释放表锁仍可安全使用房间，删除后通过 closed 标记拒绝后续操作
+    // 快照只投影创建后不再改变的字段，供查询接口无锁读取
+    room_table<room_config, room_view> rooms{[](const room_config &room) -> room_view
+                                             { return {room.adapter, room.stats, room.telemetry, room.watch, room.trans, room.adapter_ip, room.adapter_ip_area}; }};
+    // 房间创建与删除串行执行，耗时的适配器创建不持有房间表锁
+    std::mutex lifecycle_lock;
+    // 成员变更合并窗口(ms)，0 表示关闭，每次调用立即应用
+    std::atomic<uint32_t> coalesce_window_ms{0};
+    // 合并线程的唤醒与结果队列锁
+    std::mutex coalesce_lock;
+    std::condition_variable coalesce_cv;
+    std::thread coalesce_thread;
+    bool coalesce_stop = false;
+    bool coalesce_wake = false;
+    // 待回调的合并窗口成员结果
+    struct peer_report
+    {
+        std::wstring room;
+        std::wstring peer;
+        int code;
+    };
+    std::vector<peer_report> reports;
+    // 遥测导出配置，由共享采样线程读取；下次导出时间只由采样线程访问
+    std::mutex telemetry_lock;
+    uint32_t telemetry_dump_ms = 0;
+    std::string telemetry_dump_path;
+    std::chrono::steady_clock::time_point telemetry_next_dump;
+    // 按需激活空闲时间(ms)，0 表示关闭，所有 peer 添加后立即写入适配器
+    std::atomic<uint32_t> lazy_idle_ms{0};
+    // 握手错峰队列与线程，队列未开启时新成员立即写入适配器
+    stagger_queue stagger;
+    std::mutex stagger_lock;
+    std::condition_variable stagger_cv;
+    std::thread stagger_thread;
+    bool stagger_stop = false;
+    bool stagger_wake = false;
+    // 检查握手完成情况的查询缓冲区，只由错峰线程访问
+    std::vector<uint64_t> stagger_buffer;
+    // 快照记录编码缓冲区，只由快照写入线程访问
+    std::vector<BYTE> snapshot_buffer;
+    // 自适应保活上次执行时间，只由共享采样线程访问；未开启时所有 peer 使用 KEEPALIVE_CONSERVATIVE
+    std::chrono::steady_clock::time_point keepalive_last;
+    // endpoint 缓存上次记录与写盘时间，只由共享采样线程访问；未开启时新成员只使用服务器下发的 endpoint
+    std::chrono::steady_clock::time_point endpoint_recorded;
+    std::chrono::steady_clock::time_point endpoint_flushed;
+    // 隧道时延探测线程，探测端口为 0 时未开启
+    std::mutex latency_lock;
+    std::condition_variable latency_cv;
+    std::thread latency_thread;
+    bool latency_stop = false;
+    uint16_t latency_port = 0;
+    // 隧道自测：对端端口为 0 时本端不应答；同一时间只运行一个发起的测试，结果保留到下次开始
+    std::mutex tunnel_lock;
+    std::thread tunnel_thread;
+    std::atomic<bool> tunnel_cancel{false};
+    uint16_t tunnel_port = 0;
+    tunnel_result tunnel_last{};
+    // 本轮收集的路径探测，只由共享采样线程访问；路径切换未开启时 endpoint 只由添加成员与 endpoint 竞速修改
+    std::vector<std::pair<std::shared_ptr<room_config>, path_probe>> path_batch;
+    // 进行中的路径探测，按打洞连接 id 找回房间与 peer，叶子锁
+    struct path_pending
+    {
+        std::weak_ptr<room_config> room;
+        uint8_t public_key[WIREGUARD_KEY_LENGTH];
+        path_kind kind;
+        std::chrono::steady_clock::time_point issued;
+    };
+    std::mutex path_probe_lock;
+    std::unordered_map<uint64_t, path_pending> path_probes;
+    // 直连打洞引擎，未启动时直连确认由 JS 侧 udp 完成
+    punch_engine puncher;
+    // wg 监听端口上的打洞引擎，启动后优先于 puncher
+    divert_prober prober;
+    // NAT 分类结果，按网络指纹缓存，叶子锁
+    std::mutex nat_lock;
+    std::unordered_map<uint64_t, nat_profile> nat_profiles;
+    // 最近一次中继测量结果，与测量时的候选顺序一致，叶子锁
+    std::mutex relay_lock;
+    std::vector<relay_measure> relay_measures;
+    // 事件派发通道，比对由共享采样线程执行
+    event_channel events;
+    // 共享采样线程：遥测、事件、按需激活、保活、endpoint 缓存与路径切换共用，每轮每个房间只查询一次配置
+    // 最后声明，析构时最先停止，采样回调用到的成员仍然有效
+    sample_scheduler sampler{[this](uint32_t due, std::chrono::steady_clock::time_point now)
+                             { sample_pass(due, now); }};
+    WireGuardHandle(const WireGuardHandle &) = delete;
+
+    WireGuardHandle &operator=(const WireGuardHandle &) = delete;
+
+    void clear()
+    {
+        {
+            std::lock_guard<std::mutex> lock(coalesce_lock);
+            coalesce_stop = true;
+        }
+        coalesce_cv.notify_all();
+        if (coalesce_thread.joinable())
+        {
+            coalesce_thread.join();
+        }
+        // 共享采样、错峰、时延与预创建线程会调用 wireguard.dll，必须在卸载前停止
+        sampler.stop();
+        events.stop();
+        stop_stagger();
+        stop_latency();
+        {
+            std::lock_guard<std::mutex> guard(path_probe_lock);
+            path_probes.clear();
+        }
+        stop_tunnel_test();
+        // 快照写入线程停止前写完已标记的房间，须在房间关闭前停止
+        session_snapshot::getInstance().stop();
+        puncher.stop();
+        prober.stop();
+        for (const auto &room : room_list())
+            stop_gate(*room);
+        adapter_pool::getInstance().stop();
+        std::lock_guard<std::mutex> lifecycle(lifecycle_lock);
+        for (const auto &room : room_list())
+        {
+            std::lock_guard<std::mutex> guard(room->lock);
+            room->closed = true;
+        }
+        rooms.clear();
+        session_snapshot::getInstance().close();
+        endpoint_cache::getInstance().close();
+        dns_cache::getInstance().close();
+        // 释放winsock
+        WSACleanup();
+        FreeLibrary(wg);
+        capture_hub::getInstance().stop_trans();
+        log(WIREGUARD_LOG_INFO, "handler closed");
+    }
+
+    static WireGuardHandle &getInstance()
+    {
+        std::call_once(WireGuardHandle::initInstanceFlag, []()
+                       { init(); });
+        return h_instance;
+    };
+
+    // 查找房间，返回的房间在持有期间保持有效，操作前需加房间锁并检查 closed
+    std::shared_ptr<room_config> find_room(const wchar_t *name)
+    {
+        return rooms.find(name);
+    }
+
+    // 从快照中查找房间适配器，不持有任何锁，返回的句柄在持有期间保持有效
+    adapter_ptr find_adapter(const wchar_t *name) const
+    {
+        const auto current = rooms.snapshot();
+        const auto it = current->find(name);
+        if (it == current->end())
+        {
+            return nullptr;
+        }
+        return it->second.adapter;
+    }
+
+    // 查询房间 peer 统计，读取快照，不会阻塞在房间配置修改上
+    bool peer_stats(const wchar_t *name, peer_stat *out, size_t max, size_t &total) const
+    {
+        const auto current = rooms.snapshot();
+        const auto it = current->find(name);
+        if (it == current->end())
+        {
+            total = 0;
+            return false;
+        }
+        return it->second.stats->snapshot(it->second.adapter.get(), out, max, total);
+    }
+
+    // 创建适配器对象，已存在则直接返回
+    _NODISCARD bool create_room(const wchar_t *name, const u_char *public_key,
+                                const u_char *private_key, const char *adapter_ip, const char *ip_area, uint16_t listen_port)
+    {
+        return build_room(name, public_key, private_key, adapter_ip, ip_area, listen_port, nullptr);
+    }
+
+    /**
+     * 创建房间，restore 非空时按会话快照恢复：优先接管同名的现存适配器，
+     * 全部 peer 在配置步骤中随接口一次写入适配器
+     */
+    _NODISCARD bool build_room(const wchar_t *name, const u_char *public_key, const u_char *private_key,
+                               const char *adapter_ip, const char *ip_area, uint16_t listen_port,
+                               const std::vector<BYTE> *restore)
+    {
+        std::lock_guard<std::mutex> lifecycle(lifecycle_lock);
+        if (find_room(name) != nullptr)
+        {
+            return true;
+        }
+        std::string network;
+        uint8_t prefix_length;
+        if (!parse_ip_area(ip_area, network, prefix_length))
+        {
+            log(WIREGUARD_LOG_ERR, std::string("invalid ip area:") + (ip_area == nullptr ? "" : ip_area));
+            return false;
+        }
+        // 创建流水线：适配器就绪后，配置、IP、路由与广播捕获句柄重开互不依赖，并发执行
+        std::shared_ptr<room_config> conf;
+        bool pooled = false;
+        step_graph graph;
+        const auto adapter_step = graph.add("adapter", {}, [&]
+                                            {
+            // 恢复时优先按快照记录的适配器名接管仍然存在的适配器（可能是池中的占位名），其次使用预创建的适配器，池为空时同步创建
+            adapter_ptr adapter;
+            std::wstring adapter_name;
+            if (restore != nullptr)
+            {
+                const auto &head = *reinterpret_cast<const snapshot_room *>(restore->data());
+                if (head.adapter[0] != L'\0' && head.adapter[SNAPSHOT_ROOM_NAME - 1] == L'\0')
+                {
+                    if (const auto existing = WireGuardOpenAdapter(head.adapter); existing != nullptr)
+                    {
+                        adapter = make_adapter_ptr(existing);
+                        adapter_name = head.adapter;
+                        log_dll(WIREGUARD_LOG_INFO, 0, std::wstring(L"adapter reattached of room:").append(name).c_str());
+                    }
+                }
+            }
+            if (adapter == nullptr)
+            {
+                adapter = adapter_pool::getInstance().acquire(adapter_name);
+                pooled = adapter != nullptr;
+            }
+            if (adapter == nullptr)
+            {
+                const auto handle = WireGuardCreateAdapter(name, L"WireGuard Tunnel", nullptr);
+                if (handle == nullptr)
+                {
+                    log(WIREGUARD_LOG_ERR, "adapter create failed", GetLastError());
+                    return false;
+                }
+                adapter = make_adapter_ptr(handle);
+                adapter_name = name;
+            }
+            // 失败返回时 adapter_ptr 随 conf 释放自动关闭适配器
+            conf = std::make_shared<room_config>(std::move(adapter), name, public_key, private_key, listen_port);
+            if (!conf->valid())
+            {
+                return false;
+            }
+            conf->adapter_name = std::move(adapter_name);
+            conf->adapter_ip = adapter_ip;
+            conf->adapter_ip_area = network;
+            conf->prefix_length = prefix_length;
+            if (!adapter_index(conf->handle, conf->luid, conf->interface_index))
+            {
+                log(WIREGUARD_LOG_ERR, "adapter index query failed", GetLastError());
+                return false;
+            }
+            return true; });
+        const auto config_step = graph.add("config", {adapter_step}, [&]
+                                           {
+            if (restore != nullptr && !conf->load_snapshot(*restore))
+            {
+                log(WIREGUARD_LOG_ERR, "snapshot record corrupted");
+                return false;
+            }
+            if (!conf->set_config())
+            {
+                log(WIREGUARD_LOG_ERR, "adapter config failed", GetLastError());
+                return false;
+            }
+            // 去除清空peer的状态码
+            conf->interface_config().Flags = room_config::BASE_FLAG;
+            return true; });
+        const auto ip_step = graph.add("ip", {adapter_step}, [&]
+                                       {
+            if (!set_adapter_ip(conf->interface_index, adapter_ip, prefix_length))
+            {
+                log(WIREGUARD_LOG_ERR, "set adapter ip failed");
+                return false;
+            }
+            return true; }, [&]
+                                       { del_adapter_ip(conf->interface_index, adapter_ip); });
+        const auto route_step = graph.add("route", {adapter_step}, [&]
+                                          {
+            if (!add_adapter_route(conf->luid, conf->interface_index, network.c_str(), prefix_length))
+            {
+                log(WIREGUARD_LOG_ERR, "set adapter route failed");
+                return false;
+            }
+            return true; }, [&]
+                                          { del_adapter_route(conf->luid, conf->interface_index, network.c_str(), prefix_length); });
+        // 启动本房间的广播和组播转发，捕获句柄由所有房间共享
+        const auto trans_step = graph.add("trans", {adapter_step}, [&]
+                                          {
+            conf->trans = std::make_shared<transporter>(conf->interface_index, adapter_ip);
+            capture_hub::getInstance().attach(conf->trans);
+            return true; }, [&]
+                                          { capture_hub::getInstance().detach(conf->trans); });
+        const bool ok = graph.execute();
+        log(ok ? WIREGUARD_LOG_INFO : WIREGUARD_LOG_ERR, "room setup:" + graph.describe());
+        if (!ok)
+        {
+            return false;
+        }
+        room_timing timing{};
+        timing.adapter_us = graph.duration(adapter_step);
+        timing.config_us = graph.duration(config_step);
+        // IP 与路由并发设置，取较长者
+        timing.bind_us = graph.duration(ip_step) > graph.duration(route_step) ? graph.duration(ip_step) : graph.duration(route_step);
+        timing.trans_us = graph.duration(trans_step);
+        timing.total_us = graph.total();
+        timing.pooled = pooled;
+        conf->timing = timing;
+        conf->setup_steps = graph.timeline(conf->setup_timeline.data(), conf->setup_timeline.size());
+        rooms.put(name, conf);
+        {
+            std::lock_guard<std::mutex> guard(conf->lock);
+            conf->persistent = true;
+            conf->persist();
+        }
+        if (lazy_idle_ms.load() > 0)
+            start_gate(conf);
+        open_selftest(*conf);
+        log_dll(WIREGUARD_LOG_INFO, 0, std::wstring(L"adapter created of room:").append(name).c_str());
+        log(WIREGUARD_LOG_INFO, "room timing(us) adapter:" + std::to_string(timing.adapter_us) +
+                                    (timing.pooled ? "(pooled)" : "") +
+                                    " config:" + std::to_string(timing.config_us) +
+                                    " bind:" + std::to_string(timing.bind_us) +
+                                    " trans:" + std::to_string(timing.trans_us) +
+                                    " total:" + std::to_string(timing.total_us));
+        return true;
+    };
+
+    void del_room(const wchar_t *name)
+    {
+        std::lock_guard<std::mutex> lifecycle(lifecycle_lock);
+        // 先从房间表和快照中摘除，后续查找不再返回该房间
+        const auto room = rooms.take(name);
+        if (room == nullptr)
+        {
+            return;
+        }
+        // 闸门线程的激活回调需要房间锁，先在锁外停止
+        stop_gate(*room);
+        std::lock_guard<std::mutex> guard(room->lock);
+        // 先应用窗口内暂存的变更，保证回调结果完整
+        flush_room(*room);
+        room->closed = true;
+        session_snapshot::getInstance().erase(name);
+        // 删除流水线：停止广播转发、清理 IP 与路由、清空 peers 互不依赖，并发执行
+        step_graph graph;
+        graph.add("trans", {}, [&]
+                  {
+            capture_hub::getInstance().detach(room->trans);
+            return true; });
+        graph.add("ip", {}, [&]
+                  {
+            del_adapter_ip(room->interface_index, room->adapter_ip.c_str());
+            return true; });
+        graph.add("route", {}, [&]
+                  {
+            del_adapter_route(room->luid, room->interface_index, room->adapter_ip_area.c_str(), room->prefix_length);
+            return true; });
+        graph.add("peers", {}, [&]
+                  {
+            room->clear_peers();
+            return room->set_config(); });
+        graph.execute();
+        log(WIREGUARD_LOG_INFO, "room teardown:" + graph.describe());
+        // 适配器在最后一个持有者释放后关闭
+        log_dll(WIREGUARD_LOG_INFO, 0, std::wstring(L"adapter deleted of room:").append(name).c_str());
+    }
+
+    /**
+     * 设置按需激活，idle_ms 为 0 时关闭并激活全部 peer
+     * 开启后成员 peer 以休眠记录写入适配器（无 endpoint 与保活，对端可先握手），首次有发往其虚拟 IP 的流量时激活，空闲 idle_ms 后降级
+     */
+    void set_lazy_peers(uint32_t idle_ms)
+    {
+        lazy_idle_ms = idle_ms;
+        if (idle_ms > 0)
+        {
+            for (const auto &room : room_list())
+                start_gate(room);
+            // 检查间隔为空闲时间的 1/4，最长 1s
+            sampler.set(SAMPLE_LAZY, std::clamp<uint32_t>(idle_ms / 4, 1, 1000), true);
+            log(WIREGUARD_LOG_INFO, "lazy peers idle:" + std::to_string(idle_ms) + "ms");
+            return;
+        }
+        sampler.set(SAMPLE_LAZY, 0, false);
+        for (const auto &room : room_list())
+        {
+            stop_gate(*room);
+            std::lock_guard<std::mutex> guard(room->lock);
+            if (room->closed)
+                continue;
+            for (size_t i = 0; i < room->slots.size(); i++)
+            {
+                room->activate_peer(i);
+                room->slots[i].lazy_ip = 0;
+            }
+            if (!room->set_config())
+                log(WIREGUARD_LOG_ERR, "lazy peers activate all failed");
+        }
+        log(WIREGUARD_LOG_INFO, "lazy peers disabled");
+    }
+
+    /**
+     * 打开会话快照并恢复其中的房间，restored 返回恢复成功的房间名
+     * 恢复失败的房间从快照中删除，避免每次启动重复失败
+     */
+    size_t restore_snapshot(const char *path, std::vector<std::wstring> &restored)
+    {
+        stage_clock clock;
+        std::vector<session_snapshot::record> records;
+        auto &snapshot = session_snapshot::getInstance();
+        if (!snapshot.open(path, records))
+            return 0;
+        snapshot.start([this]
+                       { flush_snapshots(); });
+        for (const auto &r : records)
+        {
+            bool ok = r.data.size() >= sizeof(snapshot_room);
+            if (ok)
+            {
+                const auto &head = *reinterpret_cast<const snapshot_room *>(r.data.data());
+                const size_t key_offset = sizeof(snapshot_room);
+                const size_t conf_offset = key_offset + snapshot_key_area(head) + static_cast<size_t>(head.peer_count) * sizeof(snapshot_peer);
+                BYTE private_key[WIREGUARD_KEY_LENGTH];
+                ok = conf_offset + interface_size <= r.data.size() &&
+                     head.adapter_ip[INET_ADDRSTRLEN - 1] == '\0' && head.ip_area[INET_ADDRSTRLEN - 1] == '\0' &&
+                     snapshot_open_key(r.data.data() + key_offset, head.key_size, private_key);
+                if (ok)
+                {
+                    const auto &iface = *reinterpret_cast<const WIREGUARD_INTERFACE *>(r.data.data() + conf_offset);
+                    const std::string area = std::string(head.ip_area) + "/" + std::to_string(head.prefix_length);
+                    ok = build_room(r.room.c_str(), iface.PublicKey, private_key, head.adapter_ip, area.c_str(),
+                                    iface.ListenPort, &r.data) &&
+                         run_adapter(r.room.c_str());
+                }
+                SecureZeroMemory(private_key, WIREGUARD_KEY_LENGTH);
+            }
+            if (ok)
+            {
+                restored.push_back(r.room);
+                continue;
+            }
+            log_dll(WIREGUARD_LOG_ERR, 0, std::wstring(L"snapshot restore failed of room:").append(r.room).c_str());
+            session_snapshot::getInstance().erase(r.room);
+        }
+        log(WIREGUARD_LOG_INFO, "snapshot restored " + std::to_string(restored.size()) + "/" + std::to_string(records.size()) +
+                                    " rooms in " + std::to_string(clock.total() / 1000) + "ms");
+        return restored.size();
+    }
+
+    /**
+     * 把标记待更新的房间写入会话快照，在快照写入线程执行
+     * 房间锁内只编码到复用缓冲区，写入映射在锁外；写入期间房间被删除时撤销刚写入的记录
+     */
+    void flush_snapshots()
+    {
+        auto &snapshot = session_snapshot::getInstance();
+        for (const auto &room : room_list())
+        {
+            {
+                std::lock_guard<std::mutex> guard(room->lock);
+                if (!room->snapshot_dirty || room->closed)
+                    continue;
+                room->snapshot_dirty = false;
+                if (!room->encode_snapshot(snapshot_buffer))
+                    continue;
+            }
+            snapshot.save(room->name, snapshot_buffer);
+            bool closed;
+            {
+                std::lock_guard<std::mutex> guard(room->lock);
+                closed = room->closed;
+            }
+            if (closed && find_room(room->name.c_str()) == nullptr)
+                snapshot.erase(room->name);
+        }
+    }
+
+    // 读取房间密钥，快照恢复后调用方沿用恢复的密钥
+    bool get_room_key(const wchar_t *name, u_char *public_key, u_char *private_key)
+    {
+        const auto room = find_room(name);
+        if (room == nullptr)
+        {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(room->lock);
+        memcpy(public_key, room->interface_config().PublicKey, WIREGUARD_KEY_LENGTH);
+        memcpy(private_key, room->interface_config().PrivateKey, WIREGUARD_KEY_LENGTH);
+        return true;
+    }
+
+    /**
+     * 设置握手错峰，max_inflight 为 0 时关闭并立即激活所有等待中的成员
+     * 开启后新成员在 [0, jitter_ms] 的随机延迟后写入适配器，同时进行的握手不超过 max_inflight，
+     * 有流量等待的成员优先。房间集中加入时避免所有成员同时握手造成 CPU 与中继突发
+     */
+    void set_handshake_stagger(uint32_t max_inflight, uint32_t jitter_ms)
+    {
+        auto released = stagger.configure(max_inflight, jitter_ms);
+        if (max_inflight != 0)
+        {
+            std::lock_guard<std::mutex> lock(stagger_lock);
+            if (!stagger_thread.joinable())
+            {
+                stagger_stop = false;
+                stagger_thread = std::thread([this]
+                                             { stagger_loop(); });
+            }
+            log(WIREGUARD_LOG_INFO, "handshake stagger inflight:" + std::to_string(max_inflight) + " jitter:" + std::to_string(jitter_ms) + "ms");
+            return;
+        }
+        stop_stagger();
+        release_staggered(released, false);
+        log(WIREGUARD_LOG_INFO, "handshake stagger disabled");
+    }
+
+    /**
+     * 设置 endpoint 缓存文件，path 为空时写盘并关闭
+     * 开启后记录产生握手的 endpoint 与当时的网络指纹，新成员优先尝试同一网络下最新的缓存 endpoint，
+     * 等待 ENDPOINT_RACE_MS 未握手时切回服务器下发的 endpoint
+     */
+    void set_endpoint_cache(const char *path)
+    {
+        if (path != nullptr && path[0] != '\0')
+        {
+            endpoint_cache::getInstance().open(path);
+            // 每 ENDPOINT_RECORD_MS 记录握手 endpoint，存在竞速时每 ENDPOINT_RACE_TICK_MS 检查一次
+            if (!sampler.enabled(SAMPLE_ENDPOINT))
+                sampler.set(SAMPLE_ENDPOINT, ENDPOINT_RACE_TICK_MS, false);
+            return;
+        }
+        sampler.set(SAMPLE_ENDPOINT, 0, false);
+        endpoint_cache::getInstance().close();
+        for (const auto &room : room_list())
+        {
+            std::lock_guard<std::mutex> guard(room->lock);
+            room->races.clear();
+        }
+        log(WIREGUARD_LOG_INFO, "endpoint cache disabled");
+    }
+
+    /**
+     * 启动直连打洞引擎，已启动时按新端口重启，进行中的连接不再回调
+     * 回调参数为连接 id、结果码（0 成功，1 超时）、打通的对方地址、耗时
+     */
+    bool start_punch(uint16_t port, void (*cb)(uint64_t id, int code, const char *endpoint, uint32_t elapsed_ms))
+    {
+        const bool ok = puncher.start(port, punch_reporter(cb));
+        if (!ok)
+            log(WIREGUARD_LOG_ERR, "punch engine bind failed of port:" + std::to_string(port), WSAGetLastError());
+        return ok;
+    }
+
+    /**
+     * 在 wg 监听端口上启动打洞引擎，探测报文与隧道共用同一个 NAT 映射
+     * 启动后 punch_connect 与 punch_candidates 改用该引擎，回调参数同 start_punch
+     */
+    bool start_probe(uint16_t port, void (*cb)(uint64_t id, int code, const char *endpoint, uint32_t elapsed_ms))
+    {
+        const bool ok = prober.start(port, punch_reporter(cb));
+        if (!ok)
+            log(WIREGUARD_LOG_ERR, "probe windivert open failed of port:" + std::to_string(port), GetLastError());
+        return ok;
+    }
+
+    // 打洞结果回调：路径探测的结果回填路径选择器，其余记录日志后转为导出回调的参数
+    std::function<void(const punch_result &)> punch_reporter(void (*cb)(uint64_t id, int code, const char *endpoint, uint32_t elapsed_ms))
+    {
+        return [this, cb](const punch_result &r)
+        {
+            if (take_path_result(r))
+                return;
+            const auto endpoint = r.success ? format_candidate(r.remote) : std::string();
+            log(WIREGUARD_LOG_INFO, "punch " + std::to_string(r.id) + (r.success ? " connected " + endpoint : std::string(" timeout")) +
+                                        " in " + std::to_string(r.elapsed_ms) + "ms, " + std::to_string(r.sent) + " checks");
+            if (cb != nullptr)
+                cb(r.id, r.success ? 0 : 1, endpoint.c_str(), r.elapsed_ms);
+        };
+    }
+
+    /**
+     * 向候选地址并发打洞，返回连接 id，失败返回 0
+     * @param uid 双方一致的连接 id，为空时向反射器学习本端映射地址
+     * @param candidates 以 ; 分隔的 ip:port 或 [ipv6]:port，前缀 h: 表示局域网候选
+     * @param port_delta 对方为顺序分配端口的对称型 NAT 时的端口步长，0 不预测
+     */
+    uint64_t punch_connect(const char *uid, const char *candidates, uint32_t timeout_ms, int32_t port_delta)
+    {
+        std::vector<punch_candidate> remote;
+        std::stringstream stream(candidates);
+        std::string item;
+        while (std::getline(stream, item, ';'))
+        {
+            const bool host = item.rfind("h:", 0) == 0;
+            punch_candidate c{};
+            if (!parse_candidate(host ? item.substr(2) : item, c))
+            {
+                log(WIREGUARD_LOG_WARN, "punch candidate format error: " + item);
+                continue;
+            }
+            c.kind = host ? PUNCH_HOST : PUNCH_REFLEXIVE;
+            remote.push_back(c);
+        }
+        const auto session = uid[0] == '\0' ? PUNCH_REFLEXIVE_SESSION : punch_session(uid);
+        if (prober.running())
+            return prober.connect(session, std::move(remote), timeout_ms, port_delta);
+        return puncher.connect(session, std::move(remote), timeout_ms, port_delta);
+    }
+
+    // 当前网络下缓存的 NAT 分类，未测得或已过期返回 false
+    bool current_nat(nat_profile &out)
+    {
+        const auto now_ms = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                      std::chrono::system_clock::now().time_since_epoch())
+                                                      .count());
+        const auto fingerprint = endpoint_cache::getInstance().fingerprint(now_ms);
+        std::lock_guard<std::mutex> lock(nat_lock);
+        const auto it = nat_profiles.find(fingerprint);
+        if (it == nat_profiles.end() || now_ms - it->second.measured_ms >= NAT_PROFILE_TTL_MS)
+            return false;
+        out = it->second;
+        return true;
+    }
+
+    /**
+     * 探测本端 NAT 类型并按网络指纹缓存，当前网络已有未过期结果时直接返回
+     * @param reflectors 以 ; 分隔的主反射器、同 IP 不同端口反射器、不同 IP 反射器，后两者可省略
+     */
+    bool classify_nat(const char *reflectors)
+    {
+        nat_profile cached{};
+        if (current_nat(cached))
+            return true;
+        nat_reflectors r{};
+        sockaddr_storage *slots[] = {&r.primary, &r.alt_port, &r.alt_ip};
+        std::stringstream stream(reflectors);
+        std::string item;
+        for (size_t i = 0; i < 3 && std::getline(stream, item, ';'); i++)
+        {
+            punch_candidate c{};
+            if (!item.empty() && parse_candidate(item, c))
+                *slots[i] = c.addr;
+        }
+        if (r.primary.ss_family == 0)
+        {
+            log(WIREGUARD_LOG_ERR, "nat reflector format error");
+            return false;
+        }
+        auto profile = nat_classifier().classify(r);
+        if (profile.mapping == NAT_UNKNOWN)
+        {
+            log(WIREGUARD_LOG_WARN, "nat classify failed, reflector unreachable");
+            return false;
+        }
+        profile.measured_ms = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                        std::chrono::system_clock::now().time_since_epoch())
+                                                        .count());
+        profile.fingerprint = endpoint_cache::getInstance().fingerprint(profile.measured_ms);
+        log(WIREGUARD_LOG_INFO, "nat mapping:" + std::to_string(profile.mapping) + " filtering:" + std::to_string(profile.filtering) +
+                                    " allocation:" + std::to_string(profile.allocation) + " delta:" + std::to_string(profile.port_delta));
+        std::lock_guard<std::mutex> lock(nat_lock);
+        nat_profiles[profile.fingerprint] = profile;
+        return true;
+    }
+
+    /**
+     * 测量本端到各候选中继的往返时延与丢包，结果按候选顺序保存
+     * @param candidates 以 ; 分隔的中继探测地址 ip:port 或 [ipv6]:port，格式错误的候选结果为不可达
+     */
+    bool measure_relays(const char *candidates)
+    {
+        std::vector<sockaddr_storage> relays;
+        std::stringstream stream(candidates);
+        std::string item;
+        while (std::getline(stream, item, ';') && relays.size() < RELAY_CANDIDATE_LIMIT)
+        {
+            punch_candidate c{};
+            if (!parse_candidate(item, c))
+                log(WIREGUARD_LOG_WARN, "relay candidate format error: " + item);
+            relays.push_back(c.addr);
+        }
+        if (relays.empty())
+            return false;
+        auto measures = relay_prober().measure(relays);
+        bool reachable = false;
+        for (size_t i = 0; i < relays.size(); i++)
+        {
+            const auto &m = measures[i];
+            reachable = reachable || m.received > 0;
+            log(WIREGUARD_LOG_INFO, "relay " + format_candidate(relays[i]) + " rtt:" +
+                                        (m.received > 0 ? std::to_string(m.rtt_us / 1000.0) + "ms" : std::string("unreachable")) +
+                                        " loss:" + std::to_string(m.loss / 10.0) + "%");
+        }
+        std::lock_guard<std::mutex> lock(relay_lock);
+        relay_measures = std::move(measures);
+        return reachable;
+    }
+
+    // 最近一次中继测量结果，返回候选总数
+    size_t relay_results(relay_measure *out, size_t max)
+    {
+        std::lock_guard<std::mutex> lock(relay_lock);
+        for (size_t i = 0; i < relay_measures.size() && i < max; i++)
+            out[i] = relay_measures[i];
+        return relay_measures.size();
+    }
+
+    // 本端候选，格式同 punch_connect 的参数
+    std::string punch_candidates()
+    {
+        std::string out;
+        for (const auto &c : prober.running() ? prober.local_candidates() : puncher.local_candidates())
+        {
+            if (!out.empty())
+                out += ';';
+            out += (c.kind == PUNCH_HOST ? "h:" : "") + format_candidate(c.addr);
+        }
+        return out;
+    }
+
+    /**
+     * 开关自适应保活
+     * 开启后在 peer 路径静默期按对端保活包是否按时到达逐步放大保活间隔，判定失效后回退并二分；
+     * 关闭时清空探测状态，所有 peer 恢复 KEEPALIVE_CONSERVATIVE
+     */
+    void set_adaptive_keepalive(bool enabled)
+    {
+        if (enabled)
+        {
+            // 每 KEEPALIVE_TICK_MS 比对一次收发计数
+            if (!sampler.enabled(SAMPLE_KEEPALIVE))
+                sampler.set(SAMPLE_KEEPALIVE, KEEPALIVE_TICK_MS, false);
+            log(WIREGUARD_LOG_INFO, "adaptive keepalive enabled");
+            return;
+        }
+        sampler.set(SAMPLE_KEEPALIVE, 0, false);
+        for (const auto &room : room_list())
+        {
+            std::lock_guard<std::mutex> guard(room->lock);
+            if (room->closed)
+                continue;
+            room->keepalive.clear();
+            for (size_t i = 0; i < room->slots.size(); i++)
+                room->set_keepalive(i, KEEPALIVE_CONSERVATIVE);
+            if (!room->set_config())
+                log(WIREGUARD_LOG_ERR, "keepalive reset failed");
+        }
+        log(WIREGUARD_LOG_INFO, "adaptive keepalive disabled");
+    }
+
+    // 查询房间各 peer 的保活状态，返回跟踪的 peer 总数
+    bool get_keepalive_stats(const wchar_t *name, keepalive_stat *out, size_t max, size_t &total)
+    {
+        const auto room = find_room(name);
+        if (room == nullptr)
+        {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(room->lock);
+        total = room->keepalive.stats(out, max);
+        return true;
+    }
+
+    /**
+     * 开关隧道时延探测，port 为各成员约定的探测端口，0 关闭
+     * 开启后每个房间在虚拟 IP 的该端口上收发探测报文，修改端口时重新绑定
+     */
+    void set_latency_probe(uint16_t port)
+    {
+        stop_latency();
+        if (port == 0)
+        {
+            log(WIREGUARD_LOG_INFO, "latency probe disabled");
+            return;
+        }
+        std::lock_guard<std::mutex> lock(latency_lock);
+        latency_port = port;
+        latency_stop = false;
+        latency_thread = std::thread([this]
+                                     { latency_loop(); });
+        log(WIREGUARD_LOG_INFO, "latency probe enabled on port " + std::to_string(port));
+    }
+
+    // 查询房间各 peer 的隧道时延统计，返回跟踪的 peer 总数
+    bool get_latency_stats(const wchar_t *name, latency_stat *out, size_t max, size_t &total)
+    {
+        const auto room = find_room(name);
+        if (room == nullptr)
+        {
+            return false;
+        }
+        total = room->latency.stats(out, max);
+        return true;
+    }
+
+    // 在房间虚拟 IP 上开启自测对端，未开启自测或已开启时不做处理
+    void open_selftest(room_config &room)
+    {
+        uint16_t port;
+        {
+            std::lock_guard<std::mutex> lock(tunnel_lock);
+            port = tunnel_port;
+        }
+        if (port == 0 || room.selftest.opened())
+            return;
+        in_addr ip{};
+        if (inet_pton(AF_INET, room.adapter_ip.c_str(), &ip) != 1 || !room.selftest.open(ip.s_addr, port))
+        {
+            log(WIREGUARD_LOG_ERR, "tunnel test bind failed " + room.adapter_ip + ":" + std::to_string(port));
+            return;
+        }
+        log(WIREGUARD_LOG_INFO, "tunnel test bind " + room.adapter_ip + ":" + std::to_string(port));
+    }
+
+    // 取消进行中的测试并关闭各房间的自测对端
+    void stop_tunnel_test()
+    {
+        tunnel_cancel.store(true);
+        if (tunnel_thread.joinable())
+        {
+            tunnel_thread.join();
+        }
+        for (const auto &room : room_list())
+            room->selftest.close();
+    }
+
+    /**
+     * 开关隧道自测对端，port 为各成员约定的自测端口，0 关闭
+     * 开启后每个房间在虚拟 IP 的该端口上应答其他成员发起的测试，修改端口时重新绑定
+     */
+    void set_tunnel_test(uint16_t port)
+    {
+        for (const auto &room : room_list())
+            room->selftest.close();
+        {
+            std::lock_guard<std::mutex> lock(tunnel_lock);
+            tunnel_port = port;
+        }
+        if (port == 0)
+        {
+            log(WIREGUARD_LOG_INFO, "tunnel test disabled");
+            return;
+        }
+        for (const auto &room : room_list())
+            open_selftest(*room);
+        log(WIREGUARD_LOG_INFO, "tunnel test enabled on port " + std::to_string(port));
+    }
+
+    /**
+     * 向房间成员发起自测，在独立线程中运行，不占用命令队列；通过 get_tunnel_test 轮询结果
+     * 已有测试进行中时返回 false，速率与时长为 0 时取默认值，超出上限时按上限运行
+     */
+    bool start_tunnel_test(const wchar_t *name, const char *peer_ip, uint32_t rate_kbps, uint32_t duration_ms, bool reverse)
+    {
+        const auto room = find_room(name);
+        if (room == nullptr || peer_ip == nullptr)
+        {
+            return false;
+        }
+        tunnel_test_params params{};
+        in_addr local{}, peer{};
+        if (inet_pton(AF_INET, room->adapter_ip.c_str(), &local) != 1 || inet_pton(AF_INET, peer_ip, &peer) != 1)
+        {
+            return false;
+        }
+        params.local_ip = local.s_addr;
+        params.peer_ip = peer.s_addr;
+        params.rate_kbps = rate_kbps;
+        params.duration_ms = duration_ms;
+        params.reverse = reverse;
+        std::lock_guard<std::mutex> lock(tunnel_lock);
+        if (tunnel_last.status == TUNNEL_RUNNING)
+        {
+            return false;
+        }
+        params.port = tunnel_port != 0 ? tunnel_port : TUNNEL_TEST_PORT;
+        // 上一次测试已写回结果，线程即将退出
+        if (tunnel_thread.joinable())
+        {
+            tunnel_thread.join();
+        }
+        tunnel_cancel.store(false);
+        tunnel_last = tunnel_result{};
+        tunnel_last.status = TUNNEL_RUNNING;
+        tunnel_last.reverse = reverse ? 1 : 0;
+        tunnel_thread = std::thread([this, params]
+                                    {
+            const auto result = tunnel_test_run(params, &tunnel_cancel);
+            log(WIREGUARD_LOG_INFO, "tunnel test status:" + std::to_string(result.status) +
+                                        " throughput(bps):" + std::to_string(result.throughput_bps) +
+                                        " loss:" + std::to_string(result.loss) +
+                                        " load p99(us):" + std::to_string(result.load_p99_us));
+            std::lock_guard<std::mutex> guard(tunnel_lock);
+            tunnel_last = result; });
+        return true;
+    }
+
+    // 查询最近一次自测结果，进行中时 status 为 TUNNEL_RUNNING
+    tunnel_result get_tunnel_test()
+    {
+        std::lock_guard<std::mutex> lock(tunnel_lock);
+        return tunnel_last;
+    }
+
+    /**
+     * 开关直连/中继路径自动切换
+     * 开启后持续探测登记了两条路径的 peer，按时延与丢包带迟滞地切换 endpoint；关闭时保留当前 endpoint 并清空测量
+     */
+    void set_path_switching(bool enabled)
+    {
+        if (enabled)
+        {
+            // 每 PATH_TICK_MS 判定一次
+            if (!sampler.enabled(SAMPLE_PATH))
+                sampler.set(SAMPLE_PATH, PATH_TICK_MS, false);
+            log(WIREGUARD_LOG_INFO, "path switching enabled");
+            return;
+        }
+        stop_paths();
+        for (const auto &room : room_list())
+        {
+            std::lock_guard<std::mutex> guard(room->lock);
+            room->paths = path_manager();
+        }
+        log(WIREGUARD_LOG_INFO, "path switching disabled");
+    }
+
+    /**
+     * 登记成员的直连与中继 endpoint，ip 为空表示没有该路径，两者都为空时取消登记
+     * 当前 endpoint 与中继 endpoint 相同时视为正在使用中继
+     */
+    bool set_peer_paths(const wchar_t *name, const wchar_t *peer_name, const char *direct_ip, uint16_t direct_port,
+                        const char *relay_ip, uint16_t relay_port)
+    {
+        SOCKADDR_INET direct{}, relay{};
+        if ((direct_ip != nullptr && direct_ip[0] != '\0' && !parse_ip(direct_ip, direct_port, direct)) ||
+            (relay_ip != nullptr && relay_ip[0] != '\0' && !parse_ip(relay_ip, relay_port, relay)))
+        {
+            log(WIREGUARD_LOG_ERR, "peer path format error");
+            return false;
+        }
+        const auto room = find_room(name);
+        if (room == nullptr)
+            return false;
+        std::lock_guard<std::mutex> guard(room->lock);
+        const auto idx = room->find_peer(peer_name);
+        if (room->closed || idx == room_config::npos)
+            return false;
+        const auto &peer = room->peer_at(idx);
+        if (direct.si_family == 0 && relay.si_family == 0)
+        {
+            room->paths.remove(peer.PublicKey);
+            return true;
+        }
+        const bool on_relay = relay.si_family != 0 && same_endpoint(peer.Endpoint, relay);
+        room->paths.set(peer.PublicKey, endpoint_storage(direct), endpoint_storage(relay), on_relay ? PATH_RELAY : PATH_DIRECT,
+                        std::chrono::steady_clock::now());
+        return true;
+    }
+
+    // 查询房间各 peer 的路径测量与当前路径，返回登记的 peer 总数
+    bool get_path_stats(const wchar_t *name, path_stat *out, size_t max, size_t &total)
+    {
+        const auto room = find_room(name);
+        if (room == nullptr)
+        {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(room->lock);
+        total = room->paths.stats(out, max);
+        return true;
+    }
+
+    // 查询房间创建流水线时间线，返回步骤数
+    bool get_room_timeline(const wchar_t *name, step_timeline *out, size_t max, size_t &total)
+    {
+        const auto room = find_room(name);
+        if (room == nullptr)
+        {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(room->lock);
+        total = room->setup_steps;
+        for (size_t i = 0; i < total && i < max; i++)
+            out[i] = room->setup_timeline[i];
+        return true;
+    }
+
+    // 查询房间创建各阶段耗时
+    bool get_room_timing(const wchar_t *name, room_timing &out)
+    {
+        const auto room = find_room(name);
+        if (room == nullptr)
+        {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(room->lock);
+        out = room->timing;
+        return true;
+    }
+
+    // 添加房间内需要转发广播的成员虚拟 IP
+    bool add_trans_ips(const wchar_t *name, const char **ips, size_t count)
+    {
+        const auto room = find_room(name);
+        if (room == nullptr)
+        {
+            return false;
+        }
+        room->trans->add_ips(ips, count);
+        return true;
+    }
+
+    // 删除房间内需要转发广播的成员虚拟 IP
+    bool del_trans_ips(const wchar_t *name, const char **ips, size_t count)
+    {
+        const auto room = find_room(name);
+        if (room == nullptr)
+        {
+            return false;
+        }
+        room->trans->del_ips(ips, count);
+        return true;
+    }
+
+    // 设置房间的广播复制点，房间标记由房间名生成，各成员一致
+    bool set_broadcast_replica(const wchar_t *name, const char *replicator_ip, uint32_t uplink_kbps)
+    {
+        const auto room = find_room(name);
+        if (room == nullptr)
+        {
+            return false;
+        }
+        return room->trans->set_replica(replica_room_tag(name), replicator_ip, static_cast<uint64_t>(uplink_kbps) * 1000);
+    }
+
+    // 查询房间的广播复制状态
+    bool get_replica_stats(const wchar_t *name, replica_stats &out)
+    {
+        const auto room = find_room(name);
+        if (room == nullptr)
+        {
+            return false;
+        }
+        out = room->trans->replica_state();
+        return true;
+    }
+
+    /**
+     * 配置遥测采样，interval_ms 为 0 时停止采样，已有历史保留
+     * dump_path 非空时每 dump_ms 写出一次 prometheus 文本，dump_ms 不小于采样间隔
+     */
+    void set_telemetry(uint32_t interval_ms, const char *dump_path, uint32_t dump_ms)
+    {
+        if (interval_ms == 0)
+        {
+            sampler.set(SAMPLE_TELEMETRY, 0, false);
+            log(WIREGUARD_LOG_INFO, "telemetry stopped");
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(telemetry_lock);
+            telemetry_dump_ms = dump_ms < interval_ms ? interval_ms : dump_ms;
+            telemetry_dump_path = dump_path == nullptr ? "" : dump_path;
+        }
+        // 配置变更立即采样一轮
+        sampler.set(SAMPLE_TELEMETRY, interval_ms, true);
+        log(WIREGUARD_LOG_INFO, "telemetry interval:" + std::to_string(interval_ms) + "ms");
+    }
+
+    /**
+     * 注册事件回调并按 interval_ms 比对配置快照，cb 为空时停止
+     * 重新注册时替换回调，各房间的比对状态保留，不会重复产生已报告的事件
+     */
+    bool set_event_callback(event_callback cb, uint32_t interval_ms)
+    {
+        stop_events();
+        if (cb == nullptr)
+        {
+            log(WIREGUARD_LOG_INFO, "event channel stopped");
+            return true;
+        }
+        if (!events.start(cb))
+            return false;
+        const uint32_t interval = interval_ms == 0 ? 200 : interval_ms;
+        sampler.set(SAMPLE_EVENTS, interval, true);
+        log(WIREGUARD_LOG_INFO, "event interval:" + std::to_string(interval) + "ms");
+        return true;
+    }
+
+    // 查询房间最近 minutes 分钟的采样，返回符合条件的总数，房间不存在返回 false
+    bool room_telemetry_since(const wchar_t *name, uint32_t minutes, room_sample *out, size_t max, size_t &total) const
+    {
+        const auto current = rooms.snapshot();
+        const auto it = current->find(name);
+        if (it == current->end())
+            return false;
+        total = it->second.telemetry->query_room(telemetry_since(minutes), out, max);
+        return true;
+    }
+
+    bool peer_telemetry_since(const wchar_t *name, uint32_t minutes, peer_sample *out, size_t max, size_t &total) const
+    {
+        const auto current = rooms.snapshot();
+        const auto it = current->find(name);
+        if (it == current->end())
+            return false;
+        total = it->second.telemetry->query_peers(telemetry_since(minutes), out, max);
+        return true;
+    }
+
+    static uint64_t telemetry_since(uint32_t minutes)
+    {
+        const auto now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                   std::chrono::system_clock::now().time_since_epoch())
+                                                   .count());
+        const uint64_t span = static_cast<uint64_t>(minutes) * 60000;
+        return span >= now ? 0 : now - span;
+    }
+
+    // 设置成员变更合并窗口，窗口内的单成员调用合并为一次配置应用
+    void set_coalesce_window(uint32_t ms)
+    {
+        coalesce_window_ms = ms;
+        if (ms == 0)
+        {
+            // 关闭窗口时立即应用所有暂存变更
+            for (const auto &room : room_list())
+            {
+                std::lock_guard<std::mutex> guard(room->lock);
+                if (!room->closed)
+                    flush_room(*room);
+            }
+            return;
+        }
+        std::lock_guard<std::mutex> lock(coalesce_lock);
+        if (!coalesce_thread.joinable())
+        {
+            coalesce_stop = false;
+            coalesce_thread = std::thread([this]
+                                          { coalesce_loop(); });
+        }
+        coalesce_wake = true;
+        coalesce_cv.notify_one();
+    }
+
+    // 添加成员并修改wireguard适配器配置
+    // 已存在的 peer 允许重复添加：用于更新 endpoint 等配置，直接重赋值 peer 结构体并重新设置 wg
+    // 开启合并窗口时只暂存变更，返回 PEER_PENDING，结果通过 peer_result_func 回调
+    _NODISCARD peer_result add_peer(const wchar_t *adapter_name, const wchar_t *peer_name, const u_char *pub_key,
+                                    const char *ip, uint16_t port, const char **allowed_ips, size_t allowed_ip_count)
+    {
+        const auto room = find_room(adapter_name);
+        if (room == nullptr)
+        {
+            log(WIREGUARD_LOG_ERR, "add peer failed for not exist room");
+            return PEER_FAILED;
+        };
+        // 域名在加房间锁前解析
+        std::string endpoint;
+        if (!resolve_endpoint(ip, port, endpoint))
+        {
+            return PEER_FAILED;
+        }
+        ip = endpoint.c_str();
+        std::lock_guard<std::mutex> guard(room->lock);
+        if (room->closed)
+        {
+            return PEER_FAILED;
+        }
+        if (coalesce_window_ms.load() > 0)
+        {
+            begin_window(*room);
+            const auto idx = stage_peer(*room, peer_name, pub_key, ip, port, allowed_ips, allowed_ip_count);
+            if (idx == room_config::npos)
+            {
+                return PEER_FAILED;
+            }
+            room->slots[idx].pending = room_config::PENDING_ADD;
+            return PEER_PENDING;
+        }
+
+        // 保存旧配置，用于配置失败时回滚
+        room->checkpoint();
+        if (stage_peer(*room, peer_name, pub_key, ip, port, allowed_ips, allowed_ip_count) == room_config::npos)
+        {
+            room->rollback();
+            return PEER_FAILED;
+        }
+        // 配置失败回退：更新已有 peer 时恢复旧配置，新增 peer 时删除
+        if (!room->set_config())
+        {
+            room->rollback();
+            return PEER_FAILED;
+        };
+        return PEER_OK;
+    }
+
+    // 批量添加成员，整批只保存一次回滚点并合并为一次配置应用，results 返回每个成员的结果码
+    // allowed_ips 为所有成员 allowed ip 顺序拼接，allowed_ip_counts 为每个成员的数量；房间不存在时返回 false
+    bool add_peers(const wchar_t *adapter_name, size_t count, const wchar_t **peer_names, const u_char *pub_keys,
+                   const char **ips, const uint16_t *ports, const char **allowed_ips, const int *allowed_ip_counts,
+                   int *results)
+    {
+        for (size_t i = 0; i < count; i++)
+            results[i] = PEER_FAILED;
+        const auto room = find_room(adapter_name);
+        if (room == nullptr)
+        {
+            log(WIREGUARD_LOG_ERR, "add peers failed for not exist room");
+            return false;
+        }
+        // 域名在加房间锁前解析，解析失败的成员不写入
+        std::vector<std::string> endpoints(count);
+        std::vector<bool> resolved(count);
+        for (size_t i = 0; i < count; i++)
+            resolved[i] = resolve_endpoint(ips[i], ports[i], endpoints[i]);
+        std::lock_guard<std::mutex> guard(room->lock);
+        if (room->closed)
+        {
+            return false;
+        }
+        flush_room(*room);
+        room->checkpoint();
+        size_t staged = 0;
+        size_t ip_offset = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            const auto ip_count = static_cast<size_t>(allowed_ip_counts[i] < 0 ? 0 : allowed_ip_counts[i]);
+            const auto idx = !resolved[i] ? room_config::npos
+                                          : stage_peer(*room, peer_names[i], pub_keys + i * WIREGUARD_KEY_LENGTH,
+                                                       endpoints[i].c_str(), ports[i], allowed_ips + ip_offset, ip_count);
+            ip_offset += ip_count;
+            if (idx == room_config::npos)
+                continue;
+            results[i] = PEER_PENDING;
+            staged++;
+        }
+        if (staged == 0)
+        {
+            return true;
+        }
+        const bool ok = room->set_config();
+        if (!ok)
+        {
+            room->rollback();
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            if (results[i] == PEER_PENDING)
+                results[i] = ok ? PEER_OK : PEER_FAILED;
+        }
+        return true;
+    }
+
+    // 删除适配器中的成员
+    peer_result del_peer(const wchar_t *adapter_name, const wchar_t *peer_name)
+    {
+        const auto room = find_room(adapter_name);
+        if (room == nullptr)
+            return PEER_OK;
+        std::lock_guard<std::mutex> guard(room->lock);
+        if (room->closed)
+            return PEER_OK;
+        const auto idx = room->find_peer(peer_name);
+        if (idx == room_config::npos)
+            return PEER_OK;
+        if (coalesce_window_ms.load() > 0)
+        {
+            begin_window(*room);
+            room->peer_at(idx).Flags = WIREGUARD_PEER_REMOVE | WIREGUARD_PEER_HAS_PUBLIC_KEY;
+            room->slots[idx].pending = room_config::PENDING_DEL;
+            return PEER_PENDING;
+        }
+        // 原地设置删除标记，配置失败时回滚，成员仍保留在房间中
+        room->checkpoint();
+        room->peer_at(idx).Flags = WIREGUARD_PEER_REMOVE | WIREGUARD_PEER_HAS_PUBLIC_KEY;
+        if (!room->set_config())
+        {
+            log(WIREGUARD_LOG_ERR, "remove adapter peer failed");
+            room->rollback();
+            return PEER_FAILED;
+        }
+        room->remove_peer(idx);
+        return PEER_OK;
+    }
+
+    // 批量删除成员，合并为一次配置应用
+    bool del_peers(const wchar_t *adapter_name, size_t count, const wchar_t **peer_names)
+    {
+        const auto room = find_room(adapter_name);
+        if (room == nullptr)
+            return true;
+        std::lock_guard<std::mutex> guard(room->lock);
+        if (room->closed)
+            return true;
+        flush_room(*room);
+        room->checkpoint();
+        size_t marked = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            const auto idx = room->find_peer(peer_names[i]);
+            if (idx == room_config::npos)
+                continue;
+            room->peer_at(idx).Flags = WIREGUARD_PEER_REMOVE | WIREGUARD_PEER_HAS_PUBLIC_KEY;
+            room->slots[idx].pending = room_config::PENDING_DEL;
+            marked++;
+        }
+        if (marked == 0)
+            return true;
+        // 配置失败时回滚删除标记，成员全部保留
+        if (!room->set_config())
+        {
+            log(WIREGUARD_LOG_ERR, "remove adapter peers failed");
+            room->rollback();
+            return false;
+        }
+        for (size_t i = room->slots.size(); i-- > 0;)
+        {
+            if (room->slots[i].pending == room_config::PENDING_DEL)
+                room->remove_peer(i);
+        }
+        return true;
+    }
+
+    bool run_adapter(const wchar_t *name)
+    {
+        const auto adapter = find_adapter(name);
+        if (adapter == nullptr)
+        {
+            return false;
+        }
+        if (!WireGuardSetAdapterState(adapter.get(), WIREGUARD_ADAPTER_STATE_UP))
+        {
+            return false;
+        }
+        // 创建时虚拟 IP 可能尚不可绑定，启动后重试
+        if (const auto room = find_room(name); room != nullptr)
+            open_selftest(*room);
+        return true;
+    }
+
+    bool pause_adapter(const wchar_t *name)
+    {
+        const auto adapter = find_adapter(name);
+        if (adapter == nullptr)
+        {
+            return false;
+        }
+        return WireGuardSetAdapterState(adapter.get(), WIREGUARD_ADAPTER_STATE_DOWN);
+    }
+};
+
+std::once_flag WireGuardHandle::initInstanceFlag;
+WireGuardHandle WireGuardHandle::h_instance;
+
+// 完成队列长度上限，未设置回调且长期不轮询时丢弃最旧的完成项
+static constexpr size_t ASYNC_COMPLETION_LIMIT = 256;
+
+// 异步命令完成项，msg 指向静态字符串
+struct async_completion
+{
+    uint64_t id;
+    int code;
+    const wchar_t *msg;
+};
+
+/**
+ * 异步命令队列单例
+ * 单个工作线程串行执行修改类命令，完成后通过回调通知，未设置回调时进入完成队列等待轮询
+ */
+class command_queue
+{
+private:
+    struct command
+    {
+        uint64_t id;
+        std::function<response()> run;
+    };
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<command> commands;
+    std::deque<async_completion> completions;
+    std::thread worker;
+    bool stopped = false;
+    uint64_t next_id = 1;
+    void (*callback)(uint64_t id, int code, const wchar_t *msg) = nullptr;
+
+    command_queue() = default;
+
+    void work()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true)
+        {
+            cv.wait(guard, [this]
+                    { return stopped || !commands.empty(); });
+            if (commands.empty())
+            {
+                break;
+            }
+            auto cmd = std::move(commands.front());
+            commands.pop_front();
+            guard.unlock();
+            const auto resp = cmd.run();
+            guard.lock();
+            if (callback != nullptr)
+            {
+                const auto cb = callback;
+                guard.unlock();
+                cb(cmd.id, resp.code, resp.msg);
+                guard.lock();
+                continue;
+            }
+            if (completions.size() >= ASYNC_COMPLETION_LIMIT)
+            {
+                log(WIREGUARD_LOG_WARN, "async completion queue full, drop oldest");
+                completions.pop_front();
+            }
+            completions.push_back({cmd.id, resp.code, resp.msg});
+        }
+    }
+
+public:
+    static command_queue q_instance;
+
+    command_queue(const command_queue &) = delete;
+    command_queue &operator=(const command_queue &) = delete;
+
+    static command_queue &getInstance()
+    {
+        return q_instance;
+    }
+
+    void set_callback(void (*cb)(uint64_t id, int code, const wchar_t *msg))
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        callback = cb;
+    }
+
+    // 提交命令，返回命令 id，队列已停止返回 0
+    uint64_t submit(std::function<response()> run)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (stopped)
+        {
+            return 0;
+        }
+        if (!worker.joinable())
+        {
+            worker = std::thread([this]
+                                 { work(); });
+        }
+        const auto id = next_id++;
+        commands.push_back({id, std::move(run)});
+        cv.notify_one();
+        return id;
+    }
+
+    // 取出最多 max 个完成项，返回实际数量
+    size_t poll(async_completion *out, size_t max)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t n = 0;
+        while (n < max && !completions.empty())
+        {
+            out[n++] = completions.front();
+            completions.pop_front();
+        }
+        return n;
+    }
+
+    // 执行完已提交的命令后停止工作线程
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopped = true;
+        }
+        cv.notify_all();
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+    }
+};
+
+command_queue command_queue::q_instance;
+
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+// |-------------------------- 导出函数定义 --------------------------- |
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+extern "C"
+{
+    /**
+     * 设置全局日志回调
+     * @param cb: 回调函数指针
+     */
+    EXPORT void set_logger(void (*cb)(WIREGUARD_LOGGER_LEVEL level, const char *msg, int code))
+    {
+        log_func = cb;
+    }
+
+    /**
+     * 创建vlan房间
+     * @param name: 房间名 @param public_key: 32位uint8类型的curve25519公钥 @param private_key: 32位uint8类型的curve25519私钥 @param port: 本机转发端口
+     * @param ip_area: 房间网段，可带前缀长度如 "10.20.0.0/16"，不带时为 /16
+     */
+    EXPORT response create_adapter(const wchar_t *name, const u_char *public_key, const u_char *private_key, const char *adapter_ip,
+                                   const char *ip_area, uint16_t port)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (wg == nullptr)
+            return {1, L"wireguard.dll unload"};
+        if (!handle.create_room(name, public_key, private_key, adapter_ip, ip_area, port))
+            return {1, L"create adapter failed"};
+        return {0, L"success"};
+    }
+
+    /**
+     * 删除房间
+     * @param name: 房间名
+     */
+    EXPORT response del_adapter(const wchar_t *name)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (wg == nullptr)
+            return {1, L"wireguard.dll unload"};
+        handle.del_room(name);
+        return {0, L"success"};
+    }
+
+    /**
+     * 添加房间成员
+     * @param room_name: 房间适配器名 @param peer_name: 成员名 @param ip: 成员通信IP或域名（未缓存的域名同步解析） @param port: 成员通信端口 @param public_key: 成员ed25519公钥
+     * @param allowed_ips: 成员虚拟局域网网转发IP @param allowed_ips_count: 转发IP数量
+     */
+    EXPORT response add_peer(const wchar_t *room_name, const wchar_t *peer_name, const char *ip, const uint16_t port, const u_char *public_key,
+                             const char **allowed_ips, int allowed_ips_count)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (wg == nullptr)
+            return {1, L"wireguard.dll unload"};
+        const auto result = handle.add_peer(room_name, peer_name, public_key, ip, port, allowed_ips, allowed_ips_count);
+        if (result == PEER_PENDING)
+            return {PEER_PENDING, L"pending"};
+        if (result != PEER_OK)
+            return {1, L"add peer failed"};
+        return {0, L"success"};
+    }
+
+    /**
+     * 批量添加房间成员，合并为一次适配器配置
+     * @param room_name: 房间适配器名 @param peer_names: 成员名数组 @param ips: 成员通信IP或域名数组 @param ports: 成员通信端口数组
+     * @param public_keys: 成员公钥顺序拼接，每个32字节 @param allowed_ips: 所有成员转发IP顺序拼接
+     * @param allowed_ips_counts: 每个成员的转发IP数量 @param count: 成员数量 @param results: 输出每个成员的结果码
+     * 部分成员失败时仍返回 0，以 results 为准；只有房间不存在时返回 1
+     */
+    EXPORT response add_peers(const wchar_t *room_name, const wchar_t **peer_names, const char **ips, const uint16_t *ports,
+                              const u_char *public_keys, const char **allowed_ips, const int *allowed_ips_counts, int count,
+                              int *results)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (wg == nullptr)
+            return {1, L"wireguard.dll unload"};
+        if (count <= 0)
+            return {0, L"success"};
+        if (!handle.add_peers(room_name, count, peer_names, public_keys, ips, ports, allowed_ips, allowed_ips_counts, results))
+            return {1, L"room not exist"};
+        return {0, L"success"};
+    }
+
+    /**
+     * 批量删除房间成员，合并为一次适配器配置，配置失败时成员全部保留
+     * @param room_name: 房间适配器名 @param peer_names: 成员名数组 @param count: 成员数量
+     */
+    EXPORT response del_peers(const wchar_t *room_name, const wchar_t **peer_names, int count)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (wg == nullptr)
+            return {1, L"wireguard.dll unload"};
+        if (count > 0 && !handle.del_peers(room_name, count, peer_names))
+            return {1, L"del peers failed"};
+        return {0, L"success"};
+    }
+
+    /**
+     * 设置单成员调用的合并窗口，窗口内的 add_peer/del_peer 合并为一次配置应用
+     * @param ms: 窗口毫秒数，0 关闭合并 @param cb: 暂存变更的结果回调
+     */
+    EXPORT void set_coalesce_window(uint32_t ms, void (*cb)(const wchar_t *room, const wchar_t *peer, int code))
+    {
+        peer_result_func = cb;
+        WireGuardHandle::getInstance().set_coalesce_window(ms);
+    }
+
+    /**
+     * 添加房间广播转发成员
+     * @param room_name: 房间适配器名 @param ips: 成员虚拟局域网IP @param count: IP数量
+     */
+    EXPORT response add_trans_ips(const wchar_t *room_name, const char **ips, size_t count)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (!handle.add_trans_ips(room_name, ips, count))
+            return {1, L"adapter not exist"};
+        return {0, L"success"};
+    }
+
+    /**
+     * 删除房间广播转发成员
+     * @param room_name: 房间适配器名 @param ips: 成员虚拟局域网IP @param count: IP数量
+     */
+    EXPORT response del_trans_ips(const wchar_t *room_name, const char **ips, size_t count)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (!handle.del_trans_ips(room_name, ips, count))
+            return {1, L"adapter not exist"};
+        return {0, L"success"};
+    }
+
+    /**
+     * 设置房间广播复制点，成员较多或上行紧张时广播只上传一份给复制点，由复制点扇出给其余成员
+     * 各成员需设置同一个复制点，复制点可用 get_relay_choice 按成员间时延选出
+     * @param room_name: 房间适配器名 @param replicator_ip: 复制点虚拟局域网IP，为空关闭复制，为本端IP时本端负责扇出
+     * @param uplink_kbps: 配置的本端上行带宽(kbit/s)，不做测量，0 表示未配置，只按成员数决定
+     */
+    EXPORT response set_broadcast_replica(const wchar_t *room_name, const char *replicator_ip, uint32_t uplink_kbps)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (!handle.set_broadcast_replica(room_name, replicator_ip, uplink_kbps))
+            return {1, L"set broadcast replica failed"};
+        return {0, L"success"};
+    }
+
+    // 查询房间广播复制状态：是否经复制点发送、广播速率、上传/扇出/投递计数
+    EXPORT response get_replica_stats(const wchar_t *room_name, replica_stats *out)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (out == nullptr || !handle.get_replica_stats(room_name, *out))
+            return {1, L"room not exist"};
+        return {0, L"success"};
+    }
+
+    EXPORT response del_peer(const wchar_t *room_name, const wchar_t *peer_name)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (wg == nullptr)
+            return {1, L"wireguard.dll unload"};
+        const auto result = handle.del_peer(room_name, peer_name);
+        if (result == PEER_PENDING)
+            return {PEER_PENDING, L"pending"};
+        if (result != PEER_OK)
+            return {1, L"del peer failed"};
+        return {0, L"success"};
+    }
+
+    EXPORT response run_adapter(const wchar_t *name)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (wg == nullptr)
+            return {1, L"wireguard.dll unload"};
+        if (!handle.run_adapter(name))
+            return {1, L"adapter run failed"};
+        return {0, L"success"};
+    }
+
+    EXPORT response pause_adapter(const wchar_t *name)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (wg == nullptr)
+            return {1, L"wireguard.dll unload"};
+        handle.pause_adapter(name);
+        return {0, L"success"};
+    }
+
+    EXPORT response get_adapter_config(const wchar_t *name, char *buffer, int l)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (wg == nullptr)
+            return {1, L"wireguard.dll unload"};
+        // 从快照读取，不会阻塞在其他线程的房间修改上
+        const auto adapter = handle.find_adapter(name);
+        if (adapter == nullptr)
+            return {1, L"adapter not exist"};
+        auto conf = get_wg_conf(adapter.get());
+        if (conf.length() > l)
+            return {1, L"buffer too small"};
+        strcpy(buffer, conf.c_str());
+        return {0, L"success"};
+    }
+
+    // ---------------- 异步接口：在工作线程串行执行，立即返回命令 id，0 表示提交失败 ----------------
+
+    /**
+     * 设置异步命令完成回调，回调在工作线程中执行；未设置时完成项需通过 poll_async 获取
+     * @param cb: 回调函数指针，参数为命令 id、结果码、结果信息
+     */
+    EXPORT void set_async_callback(void (*cb)(uint64_t id, int code, const wchar_t *msg))
+    {
+        command_queue::getInstance().set_callback(cb);
+    }
+
+    /**
+     * 轮询异步命令完成项
+     * @param out: 输出数组 @param max: 数组长度 @return 实际取出数量
+     */
+    EXPORT int poll_async(async_completion *out, int max)
+    {
+        if (out == nullptr || max <= 0)
+            return 0;
+        return static_cast<int>(command_queue::getInstance().poll(out, max));
+    }
+
+    // 参数同 create_adapter
+    EXPORT uint64_t create_adapter_async(const wchar_t *name, const u_char *public_key, const u_char *private_key, const char *adapter_ip,
+                                         const char *ip_area, uint16_t port)
+    {
+        std::array<u_char, WIREGUARD_KEY_LENGTH> pub{}, pri{};
+        memcpy(pub.data(), public_key, WIREGUARD_KEY_LENGTH);
+        memcpy(pri.data(), private_key, WIREGUARD_KEY_LENGTH);
+        return command_queue::getInstance().submit(
+            [n = std::wstring(name), pub, pri, ip = std::string(adapter_ip), area = std::string(ip_area), port]
+            { return create_adapter(n.c_str(), pub.data(), pri.data(), ip.c_str(), area.c_str(), port); });
+    }
+
+    // 参数同 del_adapter
+    EXPORT uint64_t del_adapter_async(const wchar_t *name)
+    {
+        return command_queue::getInstance().submit([n = std::wstring(name)]
+                                                   { return del_adapter(n.c_str()); });
+    }
+
+    // 参数同 add_peer
+    EXPORT uint64_t add_peer_async(const wchar_t *room_name, const wchar_t *peer_name, const char *ip, const uint16_t port, const u_char *public_key,
+                                   const char **allowed_ips, int allowed_ips_count)
+    {
+        std::array<u_char, WIREGUARD_KEY_LENGTH> pub{};
+        memcpy(pub.data(), public_key, WIREGUARD_KEY_LENGTH);
+        std::vector<std::string> allowed;
+        for (int i = 0; i < allowed_ips_count; i++)
+            allowed.emplace_back(allowed_ips[i]);
+        return command_queue::getInstance().submit(
+            [r = std::wstring(room_name), p = std::wstring(peer_name), e = std::string(ip == nullptr ? "" : ip), port, pub, allowed]
+            {
+                std::vector<const char *> ips;
+                for (const auto &a : allowed)
+                    ips.push_back(a.c_str());
+                return add_peer(r.c_str(), p.c_str(), e.c_str(), port, pub.data(), ips.data(), static_cast<int>(ips.size()));
+            });
+    }
+
+    // 参数同 del_peer
+    EXPORT uint64_t del_peer_async(const wchar_t *room_name, const wchar_t *peer_name)
+    {
+        return command_queue::getInstance().submit([r = std::wstring(room_name), p = std::wstring(peer_name)]
+                                                   { return del_peer(r.c_str(), p.c_str()); });
+    }
+
+    // 参数同 run_adapter
+    EXPORT uint64_t run_adapter_async(const wchar_t *name)
+    {
+        return command_queue::getInstance().submit([n = std::wstring(name)]
+                                                   { return run_adapter(n.c_str()); });
+    }
+
+    // 参数同 pause_adapter
+    EXPORT uint64_t pause_adapter_async(const wchar_t *name)
+    {
+        return command_queue::getInstance().submit([n = std::wstring(name)]
+                                                   { return pause_adapter(n.c_str()); });
+    }
+
+    /**
+     * 查询房间 peer 统计，写入调用方提供的定长结构体数组，无格式化，适合高频轮询
+     * @param name: 房间名 @param out: peer_stat 数组 @param max: 数组长度 @param count: 输出 peer 总数，大于 max 时只写入前 max 个
+     */
+    EXPORT response get_peer_stats(const wchar_t *name, peer_stat *out, int max, int *count)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (wg == nullptr)
+            return {1, L"wireguard.dll unload"};
+        size_t total = 0;
+        const bool ok = handle.peer_stats(name, out, max < 0 ? 0 : max, total);
+        if (count != nullptr)
+            *count = static_cast<int>(total);
+        if (!ok)
+            return {1, L"get peer stats failed"};
+        return {0, L"success"};
+    }
+
+    /**
+     * 配置后台遥测采样
+     * @param interval_ms: 采样间隔，0 停止采样 @param dump_path: prometheus 文本输出路径，空则不输出 @param dump_ms: 输出间隔
+     */
+    EXPORT response set_telemetry(uint32_t interval_ms, const char *dump_path, uint32_t dump_ms)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (wg == nullptr)
+            return {1, L"wireguard.dll unload"};
+        handle.set_telemetry(interval_ms, dump_path, dump_ms);
+        return {0, L"success"};
+    }
+
+    /**
+     * 查询房间最近 minutes 分钟的房间级采样，从旧到新
+     * @param out: room_sample 数组 @param max: 数组长度 @param count: 输出符合条件的总数
+     */
+    EXPORT response get_room_telemetry(const wchar_t *name, uint32_t minutes, room_sample *out, int max, int *count)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        size_t total = 0;
+        const bool ok = handle.room_telemetry_since(name, minutes, out, max < 0 ? 0 : max, total);
+        if (count != nullptr)
+            *count = static_cast<int>(total);
+        if (!ok)
+            return {1, L"room not exist"};
+        return {0, L"success"};
+    }
+
+    /**
+     * 查询房间最近 minutes 分钟的 peer 级采样，按 peer 分组，组内从旧到新
+     * @param out: peer_sample 数组 @param max: 数组长度 @param count: 输出符合条件的总数
+     */
+    EXPORT response get_peer_telemetry(const wchar_t *name, uint32_t minutes, peer_sample *out, int max, int *count)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        size_t total = 0;
+        const bool ok = handle.peer_telemetry_since(name, minutes, out, max < 0 ? 0 : max, total);
+        if (count != nullptr)
+            *count = static_cast<int>(total);
+        if (!ok)
+            return {1, L"room not exist"};
+        return {0, L"success"};
+    }
+
+    /**
+     * 设置预创建适配器池大小，后台创建，创建房间时优先使用，0 关闭并释放池中适配器
+     * @param size: 池大小，上限 ADAPTER_POOL_LIMIT
+     */
+    EXPORT response set_adapter_pool(int size)
+    {
+        WireGuardHandle::getInstance();
+        if (wg == nullptr)
+            return {1, L"wireguard.dll unload"};
+        adapter_pool::getInstance().resize(size < 0 ? 0 : size);
+        return {0, L"success"};
+    }
+
+    // 查询房间创建各阶段耗时，用于确认预创建池的效果
+    EXPORT response get_room_timing(const wchar_t *name, room_timing *out)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (out == nullptr || !handle.get_room_timing(name, *out))
+            return {1, L"room not exist"};
+        return {0, L"success"};
+    }
+
+    /**
+     * 设置按需激活 peer，适用于成员较多的房间
+     * @param idle_ms: 空闲多久后把 peer 降级为休眠（停止保活，仍可接受对端握手），0 关闭按需激活
+     */
+    EXPORT response set_lazy_peers(uint32_t idle_ms)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (wg == nullptr)
+            return {1, L"wireguard.dll unload"};
+        handle.set_lazy_peers(idle_ms);
+        return {0, L"success"};
+    }
+
+    /**
+     * 打开会话快照并恢复上次运行中的房间，之后房间与成员的变更增量写入快照
+     * @param path: 快照文件路径 @param names: 输出恢复的房间名，以换行分隔 @param size: names 长度(字符)
+     * @param count: 输出恢复的房间数
+     */
+    EXPORT response open_snapshot(const char *path, wchar_t *names, int size, int *count)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (wg == nullptr)
+            return {1, L"wireguard.dll unload"};
+        std::vector<std::wstring> restored;
+        handle.restore_snapshot(path, restored);
+        std::wstring joined;
+        for (const auto &r : restored)
+            joined += (joined.empty() ? L"" : L"\n") + r;
+        if (names != nullptr && size > 0)
+            wcsncpy_s(names, size, joined.c_str(), _TRUNCATE);
+        if (count != nullptr)
+            *count = static_cast<int>(restored.size());
+        return {0, L"success"};
+    }
+
+    /**
+     * 启动直连打洞引擎，替代 JS 侧的 udp 直连确认，双方需使用同一连接 uid
+     * @param port: 监听端口，0 由系统分配 @param cb: 连接结果回调，在引擎线程中执行
+     */
+    EXPORT response punch_start(uint16_t port, void (*cb)(uint64_t id, int code, const char *endpoint, uint32_t elapsed_ms))
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (!handle.start_punch(port, cb))
+            return {1, L"punch port bind failed"};
+        return {0, L"success"};
+    }
+
+    /**
+     * 在 wireguard 监听端口上启动打洞引擎，探测报文通过 WinDivert 注入与捕获，打通的就是隧道使用的 NAT 映射
+     * 启动后 punch_connect 与 punch_candidates 改用该引擎，失败时可退回 punch_start
+     * @param port: wireguard 监听端口 @param cb: 连接结果回调，参数同 punch_start
+     */
+    EXPORT response probe_start(uint16_t port, void (*cb)(uint64_t id, int code, const char *endpoint, uint32_t elapsed_ms))
     {
-        rooms = std::unordered_map<std::wstring, std::unique_ptr<room_config>>();
-    };
-
-public:
-    static WireGuardHandle h_instance;
-    static std::once_flag initInstanceFlag;
-    std::unordered_map<std::wstring, std::unique_ptr<room_config>> rooms;
-    WireGuardHandle(const WireGuardHandle &) = delete;
-
-    WireGuardHandle &operator=(const WireGuardHandle &) = delete;
+        if (!WireGuardHandle::getInstance().start_probe(port, cb))
+            return {1, L"probe windivert open failed"};
+        return {0, L"success"};
+    }
 
-    void clear()
+    /**
+     * 并发检查所有候选地址，第一个收到应答的候选即为结果
+     * 对方只应答本端已发起连接的会话，双方需使用同一连接 id
+     * @param uid: 双方一致的连接 id，为空时向反射器学习本端映射地址 @param candidates: 以 ; 分隔的候选地址 @param timeout_ms: 超时时间
+     * @param port_delta: 对方 NAT 的端口分配步长，非 0 时追加预测端口 @return 连接 id，0 表示失败
+     */
+    EXPORT uint64_t punch_connect(const char *uid, const char *candidates, uint32_t timeout_ms, int32_t port_delta)
     {
-        for (auto &room : rooms)
-        {
-            WireGuardCloseAdapter(room.second->handle);
-        }
-        rooms.clear();
-        // 释放winsock
-        WSACleanup();
-        FreeLibrary(wg);
-        auto &trans = transporter::getInstance();
-        trans.stop_trans();
-        log(WIREGUARD_LOG_INFO, "handler closed");
+        if (uid == nullptr || candidates == nullptr)
+            return 0;
+        return WireGuardHandle::getInstance().punch_connect(uid, candidates, timeout_ms, port_delta);
     }
 
-    static WireGuardHandle &getInstance()
+    /**
+     * 在工作线程中探测本端 NAT 类型，结果按网络指纹缓存，完成后通过异步回调通知
+     * @param reflectors: 以 ; 分隔的主反射器、同 IP 不同端口反射器、不同 IP 反射器 @return 命令 id，0 表示提交失败
+     */
+    EXPORT uint64_t classify_nat_async(const char *reflectors)
     {
-        std::call_once(WireGuardHandle::initInstanceFlag, []()
-                       { init(); });
-        return h_instance;
-    };
+        if (reflectors == nullptr)
+            return 0;
+        return command_queue::getInstance().submit(
+            [r = std::string(reflectors)]() -> response
+            {
+                if (!WireGuardHandle::getInstance().classify_nat(r.c_str()))
+                    return {1, L"nat classify failed"};
+                return {0, L"success"};
+            });
+    }
 
-    // 创建适配器对象，已存在则直接返回
-    _NODISCARD bool create_room(const wchar_t *name, const u_char *public_key,
-                                const u_char *private_key, const char *adapter_ip, const char *ip_area, uint16_t listen_port)
+    // 读取当前网络下缓存的 NAT 分类
+    EXPORT response get_nat_profile(nat_profile *out)
     {
-        if (rooms.find(name) != rooms.end())
-        {
-            return true;
-        }
-        // TODO: 由于中转服务器存在，目前只支持一个房间，后续可扩展为多个房间
-        if (rooms.size() != 0)
-        {
-            log(WIREGUARD_LOG_ERR, "only support one room");
-            return false;
-        }
-        auto handle = WireGuardCreateAdapter(name, L"WireGuard Tunnel", nullptr);
-        if (handle == nullptr)
-        {   
-            log(WIREGUARD_LOG_ERR, "adapter create failed", GetLastError());
-            return false;
-        }
-        // 创建配置并设置适配器
-        auto conf = std::make_unique<room_config>(handle, name, public_key, private_key, listen_port);
-        conf->adapter_ip = adapter_ip;
-        conf->adapter_ip_area = ip_area;
-        if (!conf->set_config())
-        {
-            WireGuardCloseAdapter(handle);
-            log(WIREGUARD_LOG_ERR, "adapter create failed", GetLastError());
-            return false;
-        }
-        auto interface_index = bind_adapter(handle, adapter_ip, ip_area);
-        if (interface_index == 0)
-        {
-            WireGuardCloseAdapter(handle);
-            log(WIREGUARD_LOG_ERR, "adapter bind failed", GetLastError());
-            return false;
-        }
-        // 启动广播和组播转发
-        // TODO: 多房间时修改转发器逻辑
-        auto& trans = transporter::getInstance();
-        trans.run(interface_index, adapter_ip);
-        // 去除清空peer的状态码
-        conf->interface_config.Flags = room_config::BASE_FLAG;
-        rooms[name] = std::move(conf);
-        log_dll(WIREGUARD_LOG_INFO, 0, std::wstring(L"adapter created of room:").append(name).c_str());
-        return true;
-    };
+        if (out == nullptr || !WireGuardHandle::getInstance().current_nat(*out))
+            return {1, L"nat profile not measured"};
+        return {0, L"success"};
+    }
 
-    void del_room(const wchar_t *name)
+    /**
+     * 按本端与对方的 NAT 分类选择穿透策略，本端未测得时视为未知
+     * @return 0 尝试直连，1 按对方端口步长预测，2 直连不可能成功、直接使用中继
+     */
+    EXPORT int get_traversal_strategy(const nat_profile *remote)
     {
-        if (rooms.find(name) == rooms.end())
-        {
-            return;
-        }
-        auto &room = rooms[name];
-        // 清理虚拟网卡 IP 和路由
-        unbind_adapter(room->handle, room->adapter_ip.c_str(), room->adapter_ip_area.c_str());
-        // 清空 peers 配置
-        room->peers.clear();
-        room->peer_allowed_ips.clear();
-        room->interface_config.PeersCount = 0;
-        room->interface_config.Flags = room_config::BASE_FLAG | WIREGUARD_INTERFACE_REPLACE_PEERS;
-        room->set_config();
-        WireGuardCloseAdapter(room->handle);
-        log_dll(WIREGUARD_LOG_INFO, 0, std::wstring(L"adapter deleted of room:").append(name).c_str());
-        rooms.erase(name);
-        // TODO: 多房间时添加额外识别逻辑
-        auto& trans = transporter::getInstance();
-        trans.stop_trans();
+        nat_profile local{};
+        WireGuardHandle::getInstance().current_nat(local);
+        return traversal_strategy(local, remote == nullptr ? nat_profile{} : *remote);
     }
 
-    // 添加成员并修改wireguard适配器配置
-    // 已存在的 peer 允许重复添加：用于更新 endpoint 等配置，直接重赋值 peer 结构体并重新设置 wg
-    _NODISCARD bool add_peer(const wchar_t *adapter_name, const wchar_t *peer_name, const u_char *pub_key,
-                             const char *ip, uint16_t port, const char **allowed_ips, size_t allowed_ip_count)
+    /**
+     * 在工作线程中解析成员 endpoint 域名并写入解析缓存，之后以域名调用 add_peer 不再等待 DNS
+     * @param host: 域名或 IP @param port: 成员通信端口，用于 happy eyeballs 选择地址族 @return 命令 id，0 表示提交失败
+     */
+    EXPORT uint64_t resolve_host_async(const char *host, uint16_t port)
     {
-        if (rooms.find(adapter_name) == rooms.end())
-        {
-            log(WIREGUARD_LOG_ERR, "add peer failed for not exist room");
-            return false;
-        };
-        auto &room = rooms[adapter_name];
-        // 是否更新已有 peer
-        const bool existed = room->peers.find(peer_name) != room->peers.end();
-
-        WIREGUARD_PEER new_peer = {};
-        new_peer.Flags = room_config::BASE_PEER_FLAG;
-        new_peer.PersistentKeepalive = 15;
-        // 设置对端真实地址
-        if (ip != nullptr && ip[0] != '\0') {
-            new_peer.Flags |= WIREGUARD_PEER_HAS_ENDPOINT;
-            if(!parse_ip(ip, port, new_peer.Endpoint))
-            {
-                log(WIREGUARD_LOG_ERR, "peer endpoint format error");
-                return false;
-            }
-        }
-        memcpy(new_peer.PublicKey, pub_key, WIREGUARD_KEY_LENGTH);
-        new_peer.AllowedIPsCount = allowed_ip_count;
-
-        // 先解析 allowed_ips 到临时列表，避免解析失败时污染已有配置
-        std::vector<WIREGUARD_ALLOWED_IP> new_allowed;
-        for (size_t i = 0; i < allowed_ip_count; i++)
-        {
-            WIREGUARD_ALLOWED_IP allowed_ip = {};
-            if (!parse_allowed_ip(std::string(allowed_ips[i]), allowed_ip))
+        if (host == nullptr)
+            return 0;
+        return command_queue::getInstance().submit(
+            [h = std::string(host), port]() -> response
             {
-                log(WIREGUARD_LOG_WARN, std::string("allowed_ip format failed: ") + allowed_ips[i]);
-                continue;
-            }
-            new_allowed.push_back(allowed_ip);
-        }
-
-        // 更新已有 peer 时保存旧配置，用于配置失败时回滚
-        std::optional<WIREGUARD_PEER> old_peer;
-        std::optional<std::vector<WIREGUARD_ALLOWED_IP>> old_allowed;
-        if (existed)
-        {
-            old_peer = room->peers[peer_name];
-            old_allowed = room->peer_allowed_ips[peer_name];
-        }
+                sockaddr_storage addr{};
+                if (!dns_cache::getInstance().resolve(h, port, addr))
+                    return {1, L"resolve failed"};
+                return {0, L"success"};
+            });
+    }
 
-        room->peers[peer_name] = new_peer;
-        room->interface_config.PeersCount = room->peers.size();
-        room->peer_allowed_ips[peer_name] = new_allowed;
+    // 域名是否已在解析缓存中，已缓存时 add_peer 不等待 DNS（过期条目在后台刷新）
+    EXPORT bool dns_cached(const char *host)
+    {
+        return host != nullptr && dns_cache::getInstance().cached(host);
+    }
 
-        // 配置失败回退：更新已有 peer 时恢复旧配置，新增 peer 时删除
-        if (!room->set_config())
-        {
-            if (existed && old_peer.has_value() && old_allowed.has_value())
-            {
-                room->peers[peer_name] = *old_peer;
-                room->peer_allowed_ips[peer_name] = *old_allowed;
-            }
-            else
+    /**
+     * 在工作线程中测量本端到各候选中继的往返时延与丢包，完成后通过异步回调通知，全部不可达时结果码为 1
+     * @param candidates: 以 ; 分隔的中继探测地址，最多 16 个 @return 命令 id，0 表示提交失败
+     */
+    EXPORT uint64_t measure_relays_async(const char *candidates)
+    {
+        if (candidates == nullptr)
+            return 0;
+        return command_queue::getInstance().submit(
+            [c = std::string(candidates)]() -> response
             {
-                room->peers.erase(peer_name);
-                room->peer_allowed_ips.erase(peer_name);
-            }
-            room->interface_config.PeersCount = room->peers.size();
-            return false;
-        };
-        return true;
+                if (!WireGuardHandle::getInstance().measure_relays(c.c_str()))
+                    return {1, L"all relays unreachable"};
+                return {0, L"success"};
+            });
     }
 
-    // 删除适配器中的成员
-    void del_peer(const wchar_t *adapter_name, const wchar_t *peer_name)
+    /**
+     * 读取最近一次中继测量结果，顺序与 measure_relays_async 的候选一致
+     * @param out: relay_measure 数组 @param max: 数组长度 @param count: 输出候选总数
+     */
+    EXPORT response get_relay_measures(relay_measure *out, int max, int *count)
     {
-        if (rooms.find(adapter_name) == rooms.end())
-            return;
-        auto &room = rooms[adapter_name];
-        if (room->peers.find(peer_name) == room->peers.end())
-            return;
-        // 设置删除
-        auto &peer = room->peers[peer_name];
-        peer.Flags = WIREGUARD_PEER_REMOVE | WIREGUARD_PEER_HAS_PUBLIC_KEY;
-        if (!room->set_config())
-        {
-            log(WIREGUARD_LOG_ERR, "remove adapter peer failed");
-        }
-        room->peer_allowed_ips.erase(peer_name);
-        room->peers.erase(peer_name);
-        room->interface_config.PeersCount = room->peers.size();
+        const auto total = WireGuardHandle::getInstance().relay_results(out, max < 0 || out == nullptr ? 0 : max);
+        if (count != nullptr)
+            *count = static_cast<int>(total);
+        if (total == 0)
+            return {1, L"relays not measured"};
+        return {0, L"success"};
     }
 
-    bool run_adapter(const wchar_t *name)
+    /**
+     * 按房间全部成员的中继测量选择中继，各成员的测量行需经服务器汇总
+     * @param rtt_us: 成员 m 到中继 r 的往返时延位于 [m * relays + r]，0xFFFFFFFF 表示不可达 @param loss: 同布局丢包率（千分比），可为空
+     * @param objective: 0 最差成员对时延最小，1 成员对时延之和最小 @param current: 当前中继下标，-1 未选择，代价接近时保留当前中继
+     * @param out: 选择结果，relay 为 -1 表示没有全部成员可达的中继
+     */
+    EXPORT response get_relay_choice(const uint32_t *rtt_us, const uint16_t *loss, int members, int relays, int objective,
+                                     int current, relay_choice *out)
     {
-        if (rooms.find(name) == rooms.end())
-        {
-            return false;
-        }
-        return WireGuardSetAdapterState(rooms[name]->handle, WIREGUARD_ADAPTER_STATE_UP);
+        if (rtt_us == nullptr || out == nullptr || members <= 0 || relays <= 0)
+            return {1, L"param error"};
+        *out = select_relay(rtt_us, loss, members, relays, objective == RELAY_MIN_SUM ? RELAY_MIN_SUM : RELAY_MINIMAX, current);
+        if (out->relay < 0)
+            return {1, L"no relay reachable by all members"};
+        return {0, L"success"};
     }
 
-    bool pause_adapter(const wchar_t *name)
+    // 输出本端候选地址，以 ; 分隔
+    EXPORT response punch_candidates(char *buffer, int size)
     {
-        if (rooms.find(name) == rooms.end())
-        {
-            return false;
-        }
-        return WireGuardSetAdapterState(rooms[name]->handle, WIREGUARD_ADAPTER_STATE_DOWN);
+        const auto text = WireGuardHandle::getInstance().punch_candidates();
+        if (buffer == nullptr || size <= 0 || text.size() >= static_cast<size_t>(size))
+            return {1, L"buffer too small"};
+        memcpy(buffer, text.c_str(), text.size() + 1);
+        return {0, L"success"};
     }
-};
-
-std::once_flag WireGuardHandle::initInstanceFlag;
-WireGuardHandle WireGuardHandle::h_instance;
 
-// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-// |-------------------------- 导出函数定义 --------------------------- |
-// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+    // 读取房间密钥，用于快照恢复后沿用原密钥
+    EXPORT response get_room_key(const wchar_t *name, u_char *public_key, u_char *private_key)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (public_key == nullptr || private_key == nullptr || !handle.get_room_key(name, public_key, private_key))
+            return {1, L"room not exist"};
+        return {0, L"success"};
+    }
 
-extern "C"
-{
     /**
-     * 设置全局日志回调
-     * @param cb: 回调函数指针
+     * 设置握手错峰，适用于房间集中加入大量成员
+     * @param max_inflight: 同时进行的握手数上限，0 关闭 @param jitter_ms: 新成员激活前的最大随机延迟
      */
-    EXPORT void set_logger(void (*cb)(WIREGUARD_LOGGER_LEVEL level, const char *msg, int code))
+    EXPORT response set_handshake_stagger(uint32_t max_inflight, uint32_t jitter_ms)
     {
-        log_func = cb;
+        auto &handle = WireGuardHandle::getInstance();
+        if (wg == nullptr)
+            return {1, L"wireguard.dll unload"};
+        handle.set_handshake_stagger(max_inflight, jitter_ms);
+        return {0, L"success"};
     }
 
     /**
-     * 创建vlan房间
-     * @param name: 房间名 @param public_key: 32位uint8类型的curve25519公钥 @param private_key: 32位uint8类型的curve25519私钥 @param port: 本机转发端口
+     * 设置 endpoint 缓存文件，新成员优先尝试同一网络下产生过握手的 endpoint
+     * @param path: 缓存文件路径，为空时关闭
      */
-    EXPORT response create_adapter(const wchar_t *name, const u_char *public_key, const u_char *private_key, const char *adapter_ip,
-                                   const char *ip_area, uint16_t port)
+    EXPORT response set_endpoint_cache(const char *path)
     {
         auto &handle = WireGuardHandle::getInstance();
         if (wg == nullptr)
             return {1, L"wireguard.dll unload"};
-        if (!handle.create_room(name, public_key, private_key, adapter_ip, ip_area, port))
-            return {1, L"create adapter failed"};
+        handle.set_endpoint_cache(path);
         return {0, L"success"};
     }
 
     /**
-     * 删除房间
-     * @param name: 房间名
+     * 开关自适应保活，关闭时所有 peer 恢复 15s 保活
+     * @param enabled: 是否开启
      */
-    EXPORT response del_adapter(const wchar_t *name)
+    EXPORT response set_adaptive_keepalive(bool enabled)
     {
         auto &handle = WireGuardHandle::getInstance();
         if (wg == nullptr)
             return {1, L"wireguard.dll unload"};
-        handle.del_room(name);
+        handle.set_adaptive_keepalive(enabled);
         return {0, L"success"};
     }
 
     /**
-     * 添加房间成员
-     * @param room_name: 房间适配器名 @param peer_name: 成员名 @param ip: 成员通信IP @param port: 成员通信端口 @param public_key: 成员ed25519公钥
-     * @param allowed_ips: 成员虚拟局域网网转发IP @param allowed_ips_count: 转发IP数量
+     * 查询房间各 peer 当前保活间隔、测得的映射寿命与节省的保活包数
+     * @param out: keepalive_stat 数组 @param max: 数组长度 @param count: 输出 peer 总数
      */
-    EXPORT response add_peer(const wchar_t *room_name, const wchar_t *peer_name, const char *ip, const uint16_t port, const u_char *public_key,
-                             const char **allowed_ips, int allowed_ips_count)
+    EXPORT response get_keepalive_stats(const wchar_t *name, keepalive_stat *out, int max, int *count)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        size_t total = 0;
+        const bool ok = handle.get_keepalive_stats(name, out, max < 0 ? 0 : max, total);
+        if (count != nullptr)
+            *count = static_cast<int>(total);
+        if (!ok)
+            return {1, L"room not exist"};
+        return {0, L"success"};
+    }
+
+    /**
+     * 开关隧道时延探测，各成员需使用同一端口
+     * @param port: 虚拟 IP 上的探测端口，0 关闭
+     */
+    EXPORT response set_latency_probe(uint16_t port)
     {
         auto &handle = WireGuardHandle::getInstance();
         if (wg == nullptr)
             return {1, L"wireguard.dll unload"};
-        if (!handle.add_peer(room_name, peer_name, public_key, ip, port, allowed_ips, allowed_ips_count))
-            return {1, L"add peer failed"};
+        handle.set_latency_probe(port);
         return {0, L"success"};
     }
 
-    EXPORT void add_trans(const char ** ips, size_t count) {
-        auto & trans = transporter::getInstance();
+    /**
+     * 查询房间各 peer 的往返时延分位数、抖动与丢包
+     * @param out: latency_stat 数组 @param max: 数组长度 @param count: 输出 peer 总数
+     */
+    EXPORT response get_latency_stats(const wchar_t *name, latency_stat *out, int max, int *count)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        size_t total = 0;
+        const bool ok = handle.get_latency_stats(name, out, max < 0 ? 0 : max, total);
+        if (count != nullptr)
+            *count = static_cast<int>(total);
+        if (!ok)
+            return {1, L"room not exist"};
+        return {0, L"success"};
     }
 
-    EXPORT response del_peer(const wchar_t *room_name, const wchar_t *peer_name)
+    /**
+     * 开关隧道自测对端，各成员需使用同一端口
+     * @param port: 虚拟 IP 上的自测端口，0 关闭
+     */
+    EXPORT response set_tunnel_test(uint16_t port)
     {
         auto &handle = WireGuardHandle::getInstance();
         if (wg == nullptr)
             return {1, L"wireguard.dll unload"};
-        handle.del_peer(room_name, peer_name);
+        handle.set_tunnel_test(port);
         return {0, L"success"};
     }
 
-    EXPORT response run_adapter(const wchar_t *name)
+    /**
+     * 向房间成员发起隧道自测，立即返回，结果通过 get_tunnel_test 轮询
+     * @param peer_ip: 对端虚拟 IP @param rate_kbps: 限速，0 默认 20000，上限 100000
+     * @param duration_ms: 负载时长，0 默认 3000，上限 10000 @param reverse: 为 true 时由对端发送
+     */
+    EXPORT response start_tunnel_test(const wchar_t *room_name, const char *peer_ip, uint32_t rate_kbps, uint32_t duration_ms, bool reverse)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (!handle.start_tunnel_test(room_name, peer_ip, rate_kbps, duration_ms, reverse))
+            return {1, L"start tunnel test failed"};
+        return {0, L"success"};
+    }
+
+    /**
+     * 查询最近一次隧道自测结果
+     * @param out: tunnel_result 输出，status 为 5 时测试仍在进行
+     */
+    EXPORT response get_tunnel_test(tunnel_result *out)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        if (out == nullptr)
+            return {1, L"invalid argument"};
+        *out = handle.get_tunnel_test();
+        return {0, L"success"};
+    }
+
+    /**
+     * 开关直连/中继路径自动切换，探测经由 probe_start 或 punch_start 启动的打洞引擎发出
+     * @param enabled: 是否开启
+     */
+    EXPORT response set_path_switching(bool enabled)
     {
         auto &handle = WireGuardHandle::getInstance();
         if (wg == nullptr)
             return {1, L"wireguard.dll unload"};
-        if (!handle.run_adapter(name))
-            return {1, L"adapter run failed"};
+        handle.set_path_switching(enabled);
         return {0, L"success"};
     }
 
-    EXPORT response pause_adapter(const wchar_t *name)
+    /**
+     * 登记成员的直连与中继 endpoint，中继需原样转发报文到成员的 wg 端口
+     * @param room_name: 房间适配器名 @param peer_name: 成员名 @param direct_ip: 直连IP @param direct_port: 直连端口
+     * @param relay_ip: 中继IP，为空表示没有中继路径 @param relay_port: 中继端口
+     */
+    EXPORT response set_peer_paths(const wchar_t *room_name, const wchar_t *peer_name, const char *direct_ip, uint16_t direct_port,
+                                   const char *relay_ip, uint16_t relay_port)
     {
         auto &handle = WireGuardHandle::getInstance();
         if (wg == nullptr)
             return {1, L"wireguard.dll unload"};
-        handle.pause_adapter(name);
+        if (!handle.set_peer_paths(room_name, peer_name, direct_ip, direct_port, relay_ip, relay_port))
+            return {1, L"set peer paths failed"};
         return {0, L"success"};
     }
 
-    EXPORT response get_adapter_config(const wchar_t *name, char *buffer, int l)
+    /**
+     * 查询房间各 peer 两条路径的平滑时延、丢包、当前路径与切换次数
+     * @param out: path_stat 数组 @param max: 数组长度 @param count: 输出 peer 总数
+     */
+    EXPORT response get_path_stats(const wchar_t *name, path_stat *out, int max, int *count)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        size_t total = 0;
+        const bool ok = handle.get_path_stats(name, out, max < 0 ? 0 : max, total);
+        if (count != nullptr)
+            *count = static_cast<int>(total);
+        if (!ok)
+            return {1, L"room not exist"};
+        return {0, L"success"};
+    }
+
+    /**
+     * 查询房间创建流水线各步骤时间线
+     * @param out: step_timeline 数组 @param max: 数组长度 @param count: 输出步骤数
+     */
+    EXPORT response get_room_timeline(const wchar_t *name, step_timeline *out, int max, int *count)
+    {
+        auto &handle = WireGuardHandle::getInstance();
+        size_t total = 0;
+        const bool ok = handle.get_room_timeline(name, out, max < 0 ? 0 : max, total);
+        if (count != nullptr)
+            *count = static_cast<int>(total);
+        if (!ok)
+            return {1, L"room not exist"};
+        return {0, L"success"};
+    }
+
+    /**
+     * 注册事件回调，回调在 dll 派发线程执行，同一 peer 同类事件在负载高时合并为最后一个
+     * @param cb: 回调(类型, 房间名, peer 公钥 base64, 详情)，为空时停止 @param interval_ms: 比对间隔，0 使用默认 200ms
+     */
+    EXPORT response set_event_callback(event_callback cb, uint32_t interval_ms)
     {
         auto &handle = WireGuardHandle::getInstance();
         if (wg == nullptr)
             return {1, L"wireguard.dll unload"};
-        if (handle.rooms.find(name) == handle.rooms.end())
-            return {1, L"adapter not exist"};
-        auto conf = get_wg_conf(handle.rooms[name]->handle);
-        if (conf.length() > l)
-            return {1, L"buffer too small"};
-        strcpy(buffer, conf.c_str());
+        if (!handle.set_event_callback(cb, interval_ms))
+            return {1, L"start event channel failed"};
         return {0, L"success"};
     }
 
     EXPORT void clear_all()
     {
+        // 先执行完已提交的异步命令
+        command_queue::getInstance().stop();
         auto &handle = WireGuardHandle::getInstance();
         handle.clear();
     }
@@ -486,6 +4075,109 @@ namespace test
     {
         log_func = &test_log;
     }
+
+    // 校验房间配置表：按 offset 排序后 peer 记录首尾相接，数量与 PeersCount 一致，每个成员都能按名称查到
+    bool check_table(room_config &room)
+    {
+        std::lock_guard<std::mutex> guard(room.lock);
+        std::vector<size_t> order(room.slots.size());
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            order[i] = i;
+            if (room.find_peer(room.slots[i].name) != i)
+                return false;
+        }
+        std::sort(order.begin(), order.end(), [&room](size_t a, size_t b)
+                  { return room.slots[a].offset < room.slots[b].offset; });
+        size_t offset = interface_size;
+        for (const auto i : order)
+        {
+            if (room.slots[i].offset != offset || room.peer_at(i).AllowedIPsCount != room.slots[i].ip_count)
+                return false;
+            offset += peer_size + room.slots[i].ip_count * allowed_ip_size;
+        }
+        return offset == room.conf_size && room.interface_config().PeersCount == room.slots.size();
+    }
+
+    /**
+     * 并发压力测试：两个房间，一个线程长时间持有 busy 房间锁，多个线程在 busy 房间增删成员，
+     * 同时多个线程读取 idle 房间的配置，idle 房间读取的最大耗时必须远小于持锁时长，并校验结束后的配置表
+     * 不需要适配器的同一场景见 room_table.cpp 的 ROOM_TABLE_SELFTEST
+     */
+    bool stress(WireGuardHandle &handle, const wchar_t *busy, const wchar_t *idle, int writers, int readers, int rounds)
+    {
+        constexpr auto hold = std::chrono::milliseconds(300);
+        constexpr long long bound_us = 50 * 1000;
+        std::atomic<bool> running{true};
+        std::atomic<long long> max_read_us{0};
+        std::atomic<uint64_t> reads{0};
+        std::atomic<int> failed{0};
+        std::vector<std::thread> threads;
+        threads.emplace_back([&]
+                             {
+            for (int i = 0; i < 3; i++)
+            {
+                const auto room = handle.find_room(busy);
+                if (room == nullptr)
+                    return;
+                std::lock_guard<std::mutex> guard(room->lock);
+                std::this_thread::sleep_for(hold);
+            } });
+        for (int w = 0; w < writers; w++)
+        {
+            threads.emplace_back([&, w]
+                                 {
+                for (int r = 0; r < rounds; r++)
+                {
+                    const auto name = L"stress-" + std::to_wstring(w) + L"-" + std::to_wstring(r % 8);
+                    const auto ip = "10.30." + std::to_string(w) + "." + std::to_string(r % 8 + 1) + "/32";
+                    const char *allowed[] = {ip.c_str()};
+                    u_char key[WIREGUARD_KEY_LENGTH] = {};
+                    key[0] = static_cast<u_char>(w);
+                    key[1] = static_cast<u_char>(r % 8);
+                    key[2] = 0x5a;
+                    if (handle.add_peer(busy, name.c_str(), key, "127.0.0.1", static_cast<uint16_t>(9000 + r % 8), allowed, 1) == PEER_FAILED)
+                        failed++;
+                    if (r % 3 == 0)
+                        handle.del_peer(busy, name.c_str());
+                } });
+        }
+        const size_t reader_begin = threads.size();
+        for (int i = 0; i < readers; i++)
+        {
+            threads.emplace_back([&]
+                                 {
+                while (running)
+                {
+                    const auto begin = std::chrono::steady_clock::now();
+                    if (const auto adapter = handle.find_adapter(idle); adapter != nullptr)
+                        get_wg_conf(adapter.get());
+                    if (const auto room = handle.find_room(idle); room != nullptr)
+                    {
+                        std::lock_guard<std::mutex> guard(room->lock);
+                        volatile auto size = room->conf_size;
+                        (void)size;
+                    }
+                    const auto cost = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count();
+                    auto prev = max_read_us.load();
+                    while (cost > prev && !max_read_us.compare_exchange_weak(prev, cost))
+                        ;
+                    reads++;
+                } });
+        }
+        for (size_t i = 0; i < reader_begin; i++)
+            threads[i].join();
+        running = false;
+        for (size_t i = reader_begin; i < threads.size(); i++)
+            threads[i].join();
+        const auto room = handle.find_room(busy);
+        const bool consistent = room != nullptr && check_table(*room);
+        const bool responsive = reads > 0 && max_read_us < bound_us;
+        std::cout << "stress: writers=" << writers << " readers=" << readers << " rounds=" << rounds
+                  << " add_failed=" << failed << " reads=" << reads << " max_read_us=" << max_read_us
+                  << " responsive=" << responsive << " table_ok=" << consistent << '\n';
+        return consistent && responsive && failed == 0;
+    }
 }
 
 int main()
@@ -513,12 +4205,12 @@ int main()
     {
         return 0;
     }
-    std::cout << "First conf:" << get_wg_conf(handle.rooms[L"test"]->handle) << '\n';
+    std::cout << "First conf:" << get_wg_conf(handle.find_adapter(L"test").get()) << '\n';
     const u_char peer_key[] = {
         113, 54, 183, 51, 253, 208, 0, 141, 85, 73, 153, 40, 209, 110, 24, 169, 158, 172, 204, 231, 13, 52, 53, 46, 53,
         186, 9, 64, 182, 167, 28, 130};
     const char *allowed_ips[] = {"10.0.0.1/32"};
-    if (const auto ok = handle.add_peer(L"test", L"peer1", peer_key, "192.168.0.100", 8767, allowed_ips, 1); !ok)
+    if (const auto ok = handle.add_peer(L"test", L"peer1", peer_key, "192.168.0.100", 8767, allowed_ips, 1); ok != PEER_OK)
     {
         return 0;
     }
@@ -526,14 +4218,24 @@ int main()
         113, 54, 183, 51, 253, 208, 0, 88, 85, 73, 47, 40, 209, 110, 24, 169, 158, 172, 204, 231, 13, 52, 53, 46, 53,
         186, 9, 64, 182, 167, 28, 130};
     const char *allowed_ips2[] = {"10.0.0.2/32"};
-    if (const auto ok = handle.add_peer(L"test", L"peer2", peer2_key, "192.168.0.101", 8769, allowed_ips2, 1); !ok)
+    if (const auto ok = handle.add_peer(L"test", L"peer2", peer2_key, "192.168.0.101", 8769, allowed_ips2, 1); ok != PEER_OK)
     {
         return 0;
     }
 
-    std::cout << "Second Conf:" << get_wg_conf(handle.rooms[L"test"]->handle) << '\n';
+    std::cout << "Second Conf:" << get_wg_conf(handle.find_adapter(L"test").get()) << '\n';
     // handle.del_peer(L"test", L"peer1");
-    std::cout << "Third Conf:" << get_wg_conf(handle.rooms[L"test"]->handle) << '\n';
+    std::cout << "Third Conf:" << get_wg_conf(handle.find_adapter(L"test").get()) << '\n';
+    const u_char pub_key2[] = {
+        85, 28, 11, 0, 37, 145, 159, 133,
+        154, 18, 242, 47, 200, 53, 112, 25,
+        116, 81, 254, 120, 17, 66, 232, 6,
+        69, 61, 152, 77, 228, 135, 155, 111};
+    if (handle.create_room(L"test2", pub_key2, pri_key, "10.21.0.2", "10.21.0.0", 8081))
+    {
+        std::cout << "stress " << (test::stress(handle, L"test", L"test2", 4, 2, 200) ? "passed" : "failed") << '\n';
+        handle.del_room(L"test2");
+    }
     handle.del_room(L"test");
     return 0;
 }
@@ -1,7 +1,10 @@
 #include "string"
 #include "sstream"
 #include "src/wireguard.h"
+#include "wireguard_common.cpp"
 #include "filesystem"
+#include "memory"
+#include "vector"
 
 #include "winsock2.h"
 #include "ws2tcpip.h"
@@ -14,14 +17,6 @@
 
 namespace fs = std::filesystem;
 
-static constexpr size_t interface_size = sizeof(WIREGUARD_INTERFACE);
-static constexpr size_t peer_size = sizeof(WIREGUARD_PEER);
-static constexpr size_t allowed_ip_size = sizeof(WIREGUARD_ALLOWED_IP);
-static const uint8_t MASK = 16;
-
-// 外部日志函数钩子
-static void (*log_func)(WIREGUARD_LOGGER_LEVEL level, const char *msg, int code) = nullptr;
-
 // 用于wireguard日志回调转换
 void log_dll(const WIREGUARD_LOGGER_LEVEL level, int64_t dt, const wchar_t *msg)
 {
@@ -29,28 +24,16 @@ void log_dll(const WIREGUARD_LOGGER_LEVEL level, int64_t dt, const wchar_t *msg)
     {
         return;
     }
+    const int code = level == WIREGUARD_LOG_ERR ? GetLastError() : 0;
     int size_needed = WideCharToMultiByte(CP_UTF8, 0, msg, -1, NULL, 0, NULL, NULL);
     std::string str(size_needed, 0);
     WideCharToMultiByte(CP_UTF8, 0, msg, -1, &str[0], size_needed, NULL, NULL);
-    log_func(level, str.c_str(), level == WIREGUARD_LOG_ERR ? GetLastError() : 0);
-}
-
-void log(const WIREGUARD_LOGGER_LEVEL level, const char *msg, int code = 0)
-{
-    if (log_func == nullptr)
-    {
-        return;
-    }
-    log_func(level, msg, code);
-}
-
-void log(const WIREGUARD_LOGGER_LEVEL level, const std::string &msg, int code = 0)
-{
-    if (log_func == nullptr)
+    if (const auto batch = log_batch::current())
     {
+        batch->add(level, std::move(str), code);
         return;
     }
-    log(level, msg.c_str(), code);
+    log_func(level, str.c_str(), code);
 }
 
 struct response
@@ -59,19 +42,6 @@ struct response
     const wchar_t *msg;
 };
 
-static WIREGUARD_CREATE_ADAPTER_FUNC *WireGuardCreateAdapter;
-static WIREGUARD_OPEN_ADAPTER_FUNC *WireGuardOpenAdapter;
-static WIREGUARD_CLOSE_ADAPTER_FUNC *WireGuardCloseAdapter;
-static WIREGUARD_GET_ADAPTER_LUID_FUNC *WireGuardGetAdapterLUID;
-static WIREGUARD_GET_RUNNING_DRIVER_VERSION_FUNC *WireGuardGetRunningDriverVersion;
-static WIREGUARD_DELETE_DRIVER_FUNC *WireGuardDeleteDriver;
-static WIREGUARD_SET_LOGGER_FUNC *WireGuardSetLogger;
-static WIREGUARD_SET_ADAPTER_LOGGING_FUNC *WireGuardSetAdapterLogging;
-static WIREGUARD_GET_ADAPTER_STATE_FUNC *WireGuardGetAdapterState;
-static WIREGUARD_SET_ADAPTER_STATE_FUNC *WireGuardSetAdapterState;
-static WIREGUARD_GET_CONFIGURATION_FUNC *WireGuardGetConfiguration;
-static WIREGUARD_SET_CONFIGURATION_FUNC *WireGuardSetConfiguration;
-
 static HMODULE wg = nullptr;
 
 void LoadWireguardDll()
@@ -122,65 +92,15 @@ void initial()
     }
 }
 
-bool parse_ip(const char *ip_string, int port, SOCKADDR_INET &addr)
+// 查询适配器 luid 和网卡索引
+bool adapter_index(WIREGUARD_ADAPTER_HANDLE handle, NET_LUID &luid, DWORD &interface_index)
 {
-    memset(&addr, 0, sizeof(addr));
-    if (inet_pton(AF_INET, ip_string, &addr.Ipv4.sin_addr) == 1)
-    {
-        addr.Ipv4.sin_port = htons(port);
-        addr.si_family = AF_INET;
-        return true;
-    }
-    if (inet_pton(AF_INET6, ip_string, &addr.Ipv6.sin6_addr) == 1)
-    {
-        addr.Ipv6.sin6_port = htons(port);
-        addr.si_family = AF_INET6;
-        return true;
-    }
-    return false;
-}
-
-bool parse_allowed_ip(std::string &ip_string, WIREGUARD_ALLOWED_IP &rec)
-{
-    size_t slash_pos = ip_string.find('/');
-    std::string cidr_part;
-    if (slash_pos != std::string::npos)
-    {
-        cidr_part = ip_string.substr(slash_pos + 1);
-        ip_string = ip_string.substr(0, slash_pos);
-        try
-        {
-            rec.Cidr = static_cast<BYTE>(std::stoi(cidr_part));
-        }
-        catch (const std::exception &e)
-        {
-            log(WIREGUARD_LOG_ERR, "cidr format error");
-            return false;
-        }
-    }
-    // 解析IP地址
-    if (inet_pton(AF_INET, ip_string.c_str(), &rec.Address.V4) == 1)
-    {
-        rec.AddressFamily = AF_INET;
-        if (cidr_part.empty())
-            rec.Cidr = 32;
-    }
-    // else if (inet_pton(AF_INET6, ip_string.c_str(), &rec.Address.V6) == 1)
-    // {
-    //     rec.AddressFamily = AF_INET6;
-    //     if (cidr_part.empty())
-    //         rec.Cidr = 128;
-    // }
-    else
-    {
-        log(WIREGUARD_LOG_ERR, "ip format error");
-        return false;
-    }
-    return true;
+    WireGuardGetAdapterLUID(handle, &luid);
+    return ConvertInterfaceLuidToIndex(&luid, &interface_index) == NO_ERROR;
 }
 
 // 配置虚拟网卡ip
-bool set_adapter_ip(DWORD interfaceIndex, const char *ipAddress, const char *netmask)
+bool set_adapter_ip(DWORD interfaceIndex, const char *ipAddress, uint8_t prefix_length)
 {
     MIB_UNICASTIPADDRESS_ROW ipRow;
     InitializeUnicastIpAddressEntry(&ipRow);
@@ -188,7 +108,7 @@ bool set_adapter_ip(DWORD interfaceIndex, const char *ipAddress, const char *net
     ipRow.InterfaceIndex = interfaceIndex;
     ipRow.Address.si_family = AF_INET;
     inet_pton(AF_INET, ipAddress, &ipRow.Address.Ipv4.sin_addr);
-    ipRow.OnLinkPrefixLength = MASK;
+    ipRow.OnLinkPrefixLength = prefix_length;
 
     // 设置为手动配置（不是 DHCP）
     ipRow.DadState = IpDadStatePreferred;
@@ -198,7 +118,19 @@ bool set_adapter_ip(DWORD interfaceIndex, const char *ipAddress, const char *net
     ipRow.SuffixOrigin = IpSuffixOriginManual;
 
     DWORD result = CreateUnicastIpAddressEntry(&ipRow);
-    return result == NO_ERROR;
+    // 按快照重新接管的适配器上 IP 可能仍然存在
+    return result == NO_ERROR || result == ERROR_OBJECT_ALREADY_EXISTS;
+}
+
+// 删除虚拟网卡 IP
+void del_adapter_ip(DWORD interface_index, const char *ip)
+{
+    MIB_UNICASTIPADDRESS_ROW ipRow;
+    InitializeUnicastIpAddressEntry(&ipRow);
+    ipRow.InterfaceIndex = interface_index;
+    ipRow.Address.si_family = AF_INET;
+    inet_pton(AF_INET, ip, &ipRow.Address.Ipv4.sin_addr);
+    DeleteUnicastIpAddressEntry(&ipRow);
 }
 
 // 添加虚拟网卡路由
@@ -226,159 +158,21 @@ bool add_adapter_route(const NET_LUID &luid, DWORD interface_index, const char *
     return result == NO_ERROR || result == ERROR_OBJECT_ALREADY_EXISTS;
 }
 
-DWORD bind_adapter(WIREGUARD_ADAPTER_HANDLE handle, const char *ip, const char *ip_area)
+// 删除虚拟网卡路由
+void del_adapter_route(const NET_LUID &luid, DWORD interface_index, const char *destNetwork, BYTE prefixLength)
 {
-    NET_LUID luid;
-    WireGuardGetAdapterLUID(handle, &luid);
-    DWORD interface_index;
-    ConvertInterfaceLuidToIndex(&luid, &interface_index);
-    if (!set_adapter_ip(interface_index, ip, "255.255.0.0"))
-    {
-        log(WIREGUARD_LOG_ERR, "set adapter ip failed");
-        return 0;
-    }
-    if (!add_adapter_route(luid, interface_index, ip_area, MASK))
-    {
-        log(WIREGUARD_LOG_ERR, "set adapter route failed");
-        return 0;
-    }
-    return interface_index;
-}
-
-// 清理虚拟网卡 IP 和路由
-void unbind_adapter(WIREGUARD_ADAPTER_HANDLE handle, const char *ip, const char *ip_area)
-{
-    NET_LUID luid;
-    WireGuardGetAdapterLUID(handle, &luid);
-    DWORD interface_index;
-    ConvertInterfaceLuidToIndex(&luid, &interface_index);
-
-    // 删除 IP 地址
-    MIB_UNICASTIPADDRESS_ROW ipRow;
-    InitializeUnicastIpAddressEntry(&ipRow);
-    ipRow.InterfaceIndex = interface_index;
-    ipRow.Address.si_family = AF_INET;
-    inet_pton(AF_INET, ip, &ipRow.Address.Ipv4.sin_addr);
-    DeleteUnicastIpAddressEntry(&ipRow);
-
-    // 删除路由
     MIB_IPFORWARD_ROW2 route;
     InitializeIpForwardEntry(&route);
     route.InterfaceLuid = luid;
     route.InterfaceIndex = interface_index;
     route.DestinationPrefix.Prefix.si_family = AF_INET;
-    inet_pton(AF_INET, ip_area, &route.DestinationPrefix.Prefix.Ipv4.sin_addr);
-    route.DestinationPrefix.PrefixLength = MASK;
+    inet_pton(AF_INET, destNetwork, &route.DestinationPrefix.Prefix.Ipv4.sin_addr);
+    route.DestinationPrefix.PrefixLength = prefixLength;
     DeleteIpForwardEntry2(&route);
 }
 
 namespace formmater
 {
-    // byte密钥转b64字符串
-    std::string base64_encode(const uint8_t *data, size_t len)
-    {
-        static const char *base64_chars =
-            "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-            "abcdefghijklmnopqrstuvwxyz"
-            "0123456789+/";
-
-        std::string ret;
-        int i = 0;
-        uint8_t char_array_3[3];
-        uint8_t char_array_4[4];
-
-        while (len--)
-        {
-            char_array_3[i++] = *(data++);
-            if (i == 3)
-            {
-                char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-                char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-                char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-                char_array_4[3] = char_array_3[2] & 0x3f;
-
-                for (i = 0; i < 4; i++)
-                    ret += base64_chars[char_array_4[i]];
-                i = 0;
-            }
-        }
-
-        if (i)
-        {
-            for (int j = i; j < 3; j++)
-                char_array_3[j] = '\0';
-
-            char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-            char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-            char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-
-            for (int j = 0; j < i + 1; j++)
-                ret += base64_chars[char_array_4[j]];
-
-            while (i++ < 3)
-                ret += '=';
-        }
-
-        return ret;
-    }
-
-    // 将 sockaddr 转换为字符串
-    std::string sockaddr_to_string(const SOCKADDR_INET *addr)
-    {
-        if (!addr)
-            return "none";
-
-        char ip_str[INET6_ADDRSTRLEN] = {0};
-        uint16_t port = 0;
-
-        if (addr->si_family == AF_INET)
-        {
-            inet_ntop(AF_INET, &addr->Ipv4.sin_addr, ip_str, sizeof(ip_str));
-            port = ntohs(addr->Ipv4.sin_port);
-            return std::string(ip_str) + ":" + std::to_string(port);
-        }
-        else if (addr->si_family == AF_INET6)
-        {
-            inet_ntop(AF_INET6, &addr->Ipv6.sin6_addr, ip_str, sizeof(ip_str));
-            port = ntohs(addr->Ipv6.sin6_port);
-            return "[" + std::string(ip_str) + "]:" + std::to_string(port);
-        }
-
-        return "unknown";
-    }
-
-    // 格式化允许的 IP 列表
-    std::string format_allowed_ips(const WIREGUARD_ALLOWED_IP *allowed_ips, size_t count)
-    {
-        if (!allowed_ips || count == 0)
-            return "  AllowedIPs = (none)\n";
-
-        std::stringstream ss;
-        ss << "  AllowedIPs = ";
-
-        for (size_t i = 0; i < count; ++i)
-        {
-            char ip_str[INET6_ADDRSTRLEN] = {0};
-
-            if (allowed_ips[i].AddressFamily == AF_INET)
-            {
-                inet_ntop(AF_INET, &allowed_ips[i].Address.V4, ip_str, sizeof(ip_str));
-                ss << ip_str << "/" << (int)allowed_ips[i].Cidr;
-            }
-            else if (allowed_ips[i].AddressFamily == AF_INET6)
-            {
-                inet_ntop(AF_INET6, &allowed_ips[i].Address.V6, ip_str, sizeof(ip_str));
-                ss << ip_str << "/" << (int)allowed_ips[i].Cidr;
-            }
-
-            if (i < count - 1)
-                ss << ", ";
-        }
-        ss << "\n";
-
-        return ss.str();
-    }
-
     // 将 WIREGUARD_INTERFACE 转换为字符串
     std::string wireguard_config_to_string(const WIREGUARD_INTERFACE *config)
     {
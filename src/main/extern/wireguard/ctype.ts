@@ -18,6 +18,23 @@ type Response = { code: number, msg: string };
 export const WireGuardLoggerCallback = koffi.proto('WireGuardLoggerCallback', koffi.types.void,
     [koffi.types.uint, c_type.LPCSTR, koffi.types.int]);
 
+// 合并窗口内成员变更结果回调：房间名、成员名、结果码（0成功，1失败）
+export const PeerResultCallback = koffi.proto('PeerResultCallback', koffi.types.void,
+    [c_type.LPCWSTR, c_type.LPCWSTR, koffi.types.int]);
+
+// 异步命令完成回调：命令id、结果码、结果信息
+export const AsyncCallback = koffi.proto('AsyncCallback', koffi.types.void,
+    [koffi.types.uint64, koffi.types.int, c_type.LPCWSTR]);
+
+// 事件回调：事件类型、房间名、peer公钥base64（房间级事件为空）、详情
+// 1握手成功，2握手失效，3endpoint变化，4适配器状态，5广播转发失败
+export const EventCallback = koffi.proto('EventCallback', koffi.types.void,
+    [koffi.types.int, c_type.LPCWSTR, c_type.LPCSTR, c_type.LPCSTR]);
+
+// 打洞结果回调：连接id、结果码（0成功，1超时）、打通的对方地址、耗时ms
+export const PunchCallback = koffi.proto('PunchCallback', koffi.types.void,
+    [koffi.types.uint64, koffi.types.int, c_type.LPCSTR, koffi.types.uint32]);
+
 export interface wgApi {
     // 设置dll日志回调函数
     set_logger: (cb: koffi.IKoffiRegisteredCallback) => void,
@@ -27,14 +44,78 @@ export interface wgApi {
     add_peer: (adapter_name: string, peer_name: string, ip: string, port: number, public_key: Buffer,
         transport_ip: string[], count: number
     ) => Response,
+    // 批量添加成员，public_keys为所有公钥顺序拼接，results输出每个成员的结果码
+    add_peers: (adapter_name: string, peer_names: string[], ips: string[], ports: number[], public_keys: Buffer,
+        allowed_ips: string[], allowed_ips_counts: number[], count: number, results: Int32Array
+    ) => Response,
     del_peer: (adapter_name: string, peer_name: string) => Response,
-    add_trans_ips: (ips: string[], count: number) => void,
-    del_trans_ips: (ips: string[], count: number) => void,
+    del_peers: (adapter_name: string, peer_names: string[], count: number) => Response,
+    // 设置单成员调用的合并窗口(ms)，0关闭，开启时add_peer/del_peer返回code 2，结果通过回调返回
+    set_coalesce_window: (ms: number, cb: koffi.IKoffiRegisteredCallback | null) => void,
+    // 房间广播转发成员，每个房间独立
+    add_trans_ips: (adapter_name: string, ips: string[], count: number) => Response,
+    del_trans_ips: (adapter_name: string, ips: string[], count: number) => Response,
+    // 房间广播复制点，replicator为空关闭，uplink_kbps为0表示上行未知
+    set_broadcast_replica: (adapter_name: string, replicator: string, uplink_kbps: number) => Response,
+    get_replica_stats: (adapter_name: string, buffer: Buffer) => Response,
     // 启动适配器
     run_adapter: (name: string) => Response,
     // 停止适配器
     pause_adapter: (name: string) => Response,
     get_adapter_config: (name: string, buffer: Buffer, size: number) => Response,
+    get_peer_stats: (name: string, buffer: Buffer, max: number, count: Int32Array) => Response,
+    set_adapter_pool: (size: number) => Response,
+    set_lazy_peers: (idle_ms: number) => Response,
+    get_room_timing: (name: string, buffer: Buffer) => Response,
+    set_adaptive_keepalive: (enabled: boolean) => Response,
+    // 打开会话快照并恢复上次的房间，names输出以换行分隔的房间名(utf16)
+    open_snapshot: (path: string, names: Buffer, size: number, count: Int32Array) => Response,
+    get_room_key: (name: string, public_key: Buffer, private_key: Buffer) => Response,
+    // 握手错峰：同时进行的握手数上限(0关闭)与新成员激活前的最大随机延迟
+    set_handshake_stagger: (max_inflight: number, jitter_ms: number) => Response,
+    // endpoint缓存文件，新成员优先尝试同一网络下握手成功过的endpoint，空串关闭
+    set_endpoint_cache: (path: string) => Response,
+    // 直连打洞引擎：启动监听、并发检查以;分隔的候选地址（返回连接id，0失败）、查询本端候选
+    punch_start: (port: number, cb: koffi.IKoffiRegisteredCallback) => Response,
+    probe_start: (port: number, cb: koffi.IKoffiRegisteredCallback) => Response,
+    punch_connect: (uid: string, candidates: string, timeout_ms: number, port_delta: number) => number | bigint,
+    punch_candidates: (buffer: Buffer, size: number) => Response,
+    // NAT类型探测（异步，返回命令id）、读取当前网络下的分类、按对方分类选择穿透策略（0直连，1端口预测，2只用中继）
+    classify_nat_async: (reflectors: string) => number | bigint,
+    get_nat_profile: (buffer: Buffer) => Response,
+    get_traversal_strategy: (remote: Buffer) => number,
+    // 成员endpoint域名解析（异步，返回命令id），之后add_peer可直接传域名；查询域名是否已缓存
+    resolve_host_async: (host: string, port: number) => number | bigint,
+    dns_cached: (host: string) => boolean,
+    // 中继测量（异步，返回命令id）、读取本端到各候选中继的测量、按全部成员的测量矩阵选择中继
+    measure_relays_async: (candidates: string) => number | bigint,
+    get_relay_measures: (buffer: Buffer, max: number, count: Int32Array) => Response,
+    get_relay_choice: (rtt_us: Uint32Array, loss: Uint16Array | null, members: number, relays: number, objective: number, current: number, out: Buffer) => Response,
+    get_keepalive_stats: (name: string, buffer: Buffer, max: number, count: Int32Array) => Response,
+    set_latency_probe: (port: number) => Response,
+    get_latency_stats: (name: string, buffer: Buffer, max: number, count: Int32Array) => Response,
+    // 隧道自测：开关本端应答（端口0关闭）、向成员发起测试（立即返回）、轮询最近一次结果
+    set_tunnel_test: (port: number) => Response,
+    start_tunnel_test: (name: string, peer_ip: string, rate_kbps: number, duration_ms: number, reverse: boolean) => Response,
+    get_tunnel_test: (buffer: Buffer) => Response,
+    // 直连/中继路径自动切换：开关、登记成员两条路径的endpoint（中继ip为空表示没有中继）、查询路径测量
+    set_path_switching: (enabled: boolean) => Response,
+    set_peer_paths: (room: string, peer: string, direct_ip: string, direct_port: number, relay_ip: string, relay_port: number) => Response,
+    get_path_stats: (name: string, buffer: Buffer, max: number, count: Int32Array) => Response,
+    set_event_callback: (cb: koffi.IKoffiRegisteredCallback | null, interval_ms: number) => Response,
+    set_telemetry: (interval_ms: number, dump_path: string | null, dump_ms: number) => Response,
+    get_room_telemetry: (name: string, minutes: number, buffer: Buffer, max: number, count: Int32Array) => Response,
+    get_peer_telemetry: (name: string, minutes: number, buffer: Buffer, max: number, count: Int32Array) => Response,
+    // 异步接口：立即返回命令id(0为提交失败)，结果通过set_async_callback注册的回调返回
+    set_async_callback: (cb: koffi.IKoffiRegisteredCallback) => void,
+    create_adapter_async: (name: string, public_key: Buffer, private_key: Buffer, adaper_ip: string, ip_area: string, listen_port: number) => number | bigint,
+    del_adapter_async: (name: string) => number | bigint,
+    add_peer_async: (adapter_name: string, peer_name: string, ip: string, port: number, public_key: Buffer,
+        transport_ip: string[], count: number
+    ) => number | bigint,
+    del_peer_async: (adapter_name: string, peer_name: string) => number | bigint,
+    run_adapter_async: (name: string) => number | bigint,
+    pause_adapter_async: (name: string) => number | bigint,
     clear_all: () => void,
     unload: () => void,
 }
\ No newline at end of file
@@ -71,12 +71,66 @@ export const WireGuardAPI: CType.wgApi = {
     add_peer: wg.func("add_peer", CType.c_type.response, [CType.c_type.LPCWSTR, CType.c_type.LPCWSTR, CType.c_type.LPCSTR, koffi.types.uint16,
     koffi.pointer(koffi.types.uchar), koffi.pointer(CType.c_type.LPCSTR), koffi.types.int
     ]),
+    add_peers: wg.func("add_peers", CType.c_type.response, [CType.c_type.LPCWSTR, koffi.pointer(CType.c_type.LPCWSTR),
+    koffi.pointer(CType.c_type.LPCSTR), koffi.pointer(koffi.types.uint16), koffi.pointer(koffi.types.uchar),
+    koffi.pointer(CType.c_type.LPCSTR), koffi.pointer(koffi.types.int), koffi.types.int, koffi.pointer(koffi.types.int)
+    ]),
     del_peer: wg.func("del_peer", CType.c_type.response, [CType.c_type.LPCWSTR, CType.c_type.LPCWSTR]),
-    add_trans_ips: wg.func("add_trans_ips", koffi.types.void, [koffi.pointer(CType.c_type.LPCSTR), koffi.types.size_t]),
-    del_trans_ips: wg.func("del_trans_ips", koffi.types.void, [koffi.pointer(CType.c_type.LPCSTR), koffi.types.size_t]),
+    del_peers: wg.func("del_peers", CType.c_type.response, [CType.c_type.LPCWSTR, koffi.pointer(CType.c_type.LPCWSTR), koffi.types.int]),
+    set_coalesce_window: wg.func("set_coalesce_window", koffi.types.void, [koffi.types.uint32, koffi.pointer(CType.PeerResultCallback)]),
+    add_trans_ips: wg.func("add_trans_ips", CType.c_type.response, [CType.c_type.LPCWSTR, koffi.pointer(CType.c_type.LPCSTR), koffi.types.size_t]),
+    del_trans_ips: wg.func("del_trans_ips", CType.c_type.response, [CType.c_type.LPCWSTR, koffi.pointer(CType.c_type.LPCSTR), koffi.types.size_t]),
+    set_broadcast_replica: wg.func("set_broadcast_replica", CType.c_type.response, [CType.c_type.LPCWSTR, CType.c_type.LPCSTR, koffi.types.uint32]),
+    get_replica_stats: wg.func("get_replica_stats", CType.c_type.response, [CType.c_type.LPCWSTR, koffi.pointer(koffi.types.uchar)]),
     run_adapter: wg.func("run_adapter", CType.c_type.response, [CType.c_type.LPCWSTR]),
     pause_adapter: wg.func("pause_adapter", CType.c_type.response, [CType.c_type.LPCWSTR]),
     get_adapter_config: wg.func("get_adapter_config", CType.c_type.response, [CType.c_type.LPCWSTR, koffi.pointer(koffi.types.char), koffi.types.int]),
+    get_peer_stats: wg.func("get_peer_stats", CType.c_type.response, [CType.c_type.LPCWSTR, koffi.pointer(koffi.types.uchar), koffi.types.int, koffi.pointer(koffi.types.int)]),
+    set_adapter_pool: wg.func("set_adapter_pool", CType.c_type.response, [koffi.types.int]),
+    set_lazy_peers: wg.func("set_lazy_peers", CType.c_type.response, [koffi.types.uint32]),
+    get_room_timing: wg.func("get_room_timing", CType.c_type.response, [CType.c_type.LPCWSTR, koffi.pointer(koffi.types.uchar)]),
+    set_adaptive_keepalive: wg.func("set_adaptive_keepalive", CType.c_type.response, [koffi.types.bool]),
+    open_snapshot: wg.func("open_snapshot", CType.c_type.response, [CType.c_type.LPCSTR, koffi.pointer(koffi.types.uchar), koffi.types.int, koffi.pointer(koffi.types.int)]),
+    get_room_key: wg.func("get_room_key", CType.c_type.response, [CType.c_type.LPCWSTR, koffi.pointer(koffi.types.uchar), koffi.pointer(koffi.types.uchar)]),
+    set_handshake_stagger: wg.func("set_handshake_stagger", CType.c_type.response, [koffi.types.uint32, koffi.types.uint32]),
+    set_endpoint_cache: wg.func("set_endpoint_cache", CType.c_type.response, [CType.c_type.LPCSTR]),
+    punch_start: wg.func("punch_start", CType.c_type.response, [koffi.types.uint16, koffi.pointer(CType.PunchCallback)]),
+    probe_start: wg.func("probe_start", CType.c_type.response, [koffi.types.uint16, koffi.pointer(CType.PunchCallback)]),
+    punch_connect: wg.func("punch_connect", koffi.types.uint64, [CType.c_type.LPCSTR, CType.c_type.LPCSTR, koffi.types.uint32, koffi.types.int32]),
+    punch_candidates: wg.func("punch_candidates", CType.c_type.response, [koffi.pointer(koffi.types.char), koffi.types.int]),
+    classify_nat_async: wg.func("classify_nat_async", koffi.types.uint64, [CType.c_type.LPCSTR]),
+    get_nat_profile: wg.func("get_nat_profile", CType.c_type.response, [koffi.pointer(koffi.types.uchar)]),
+    get_traversal_strategy: wg.func("get_traversal_strategy", koffi.types.int, [koffi.pointer(koffi.types.uchar)]),
+    resolve_host_async: wg.func("resolve_host_async", koffi.types.uint64, [CType.c_type.LPCSTR, koffi.types.uint16]),
+    dns_cached: wg.func("dns_cached", koffi.types.bool, [CType.c_type.LPCSTR]),
+    measure_relays_async: wg.func("measure_relays_async", koffi.types.uint64, [CType.c_type.LPCSTR]),
+    get_relay_measures: wg.func("get_relay_measures", CType.c_type.response, [koffi.pointer(koffi.types.uchar), koffi.types.int, koffi.pointer(koffi.types.int)]),
+    get_relay_choice: wg.func("get_relay_choice", CType.c_type.response, [koffi.pointer(koffi.types.uint32), koffi.pointer(koffi.types.uint16), koffi.types.int, koffi.types.int, koffi.types.int, koffi.types.int, koffi.pointer(koffi.types.uchar)]),
+    get_keepalive_stats: wg.func("get_keepalive_stats", CType.c_type.response, [CType.c_type.LPCWSTR, koffi.pointer(koffi.types.uchar), koffi.types.int, koffi.pointer(koffi.types.int)]),
+    set_latency_probe: wg.func("set_latency_probe", CType.c_type.response, [koffi.types.uint16]),
+    get_latency_stats: wg.func("get_latency_stats", CType.c_type.response, [CType.c_type.LPCWSTR, koffi.pointer(koffi.types.uchar), koffi.types.int, koffi.pointer(koffi.types.int)]),
+    set_tunnel_test: wg.func("set_tunnel_test", CType.c_type.response, [koffi.types.uint16]),
+    start_tunnel_test: wg.func("start_tunnel_test", CType.c_type.response, [CType.c_type.LPCWSTR, CType.c_type.LPCSTR, koffi.types.uint32, koffi.types.uint32, koffi.types.bool]),
+    get_tunnel_test: wg.func("get_tunnel_test", CType.c_type.response, [koffi.pointer(koffi.types.uchar)]),
+    set_path_switching: wg.func("set_path_switching", CType.c_type.response, [koffi.types.bool]),
+    set_peer_paths: wg.func("set_peer_paths", CType.c_type.response, [CType.c_type.LPCWSTR, CType.c_type.LPCWSTR, CType.c_type.LPCSTR, koffi.types.uint16, CType.c_type.LPCSTR, koffi.types.uint16]),
+    get_path_stats: wg.func("get_path_stats", CType.c_type.response, [CType.c_type.LPCWSTR, koffi.pointer(koffi.types.uchar), koffi.types.int, koffi.pointer(koffi.types.int)]),
+    set_event_callback: wg.func("set_event_callback", CType.c_type.response, [koffi.pointer(CType.EventCallback), koffi.types.uint32]),
+    set_telemetry: wg.func("set_telemetry", CType.c_type.response, [koffi.types.uint32, CType.c_type.LPCSTR, koffi.types.uint32]),
+    get_room_telemetry: wg.func("get_room_telemetry", CType.c_type.response, [CType.c_type.LPCWSTR, koffi.types.uint32, koffi.pointer(koffi.types.uchar), koffi.types.int, koffi.pointer(koffi.types.int)]),
+    get_peer_telemetry: wg.func("get_peer_telemetry", CType.c_type.response, [CType.c_type.LPCWSTR, koffi.types.uint32, koffi.pointer(koffi.types.uchar), koffi.types.int, koffi.pointer(koffi.types.int)]),
+    set_async_callback: wg.func("set_async_callback", koffi.types.void, [koffi.pointer(CType.AsyncCallback)]),
+    create_adapter_async: wg.func("create_adapter_async", koffi.types.uint64, [CType.c_type.LPCWSTR,
+    koffi.pointer(koffi.types.uchar), koffi.pointer(koffi.types.uchar),
+    CType.c_type.LPCSTR, CType.c_type.LPCSTR, koffi.types.uint16
+    ]),
+    del_adapter_async: wg.func("del_adapter_async", koffi.types.uint64, [CType.c_type.LPCWSTR]),
+    add_peer_async: wg.func("add_peer_async", koffi.types.uint64, [CType.c_type.LPCWSTR, CType.c_type.LPCWSTR, CType.c_type.LPCSTR, koffi.types.uint16,
+    koffi.pointer(koffi.types.uchar), koffi.pointer(CType.c_type.LPCSTR), koffi.types.int
+    ]),
+    del_peer_async: wg.func("del_peer_async", koffi.types.uint64, [CType.c_type.LPCWSTR, CType.c_type.LPCWSTR]),
+    run_adapter_async: wg.func("run_adapter_async", koffi.types.uint64, [CType.c_type.LPCWSTR]),
+    pause_adapter_async: wg.func("pause_adapter_async", koffi.types.uint64, [CType.c_type.LPCWSTR]),
     clear_all: wg.func("clear_all", koffi.types.void, []),
     unload: wg.unload,
 };
@@ -1,12 +1,13 @@
 import { platform } from "process";
 import { app } from 'electron';
 import { Configs, Logger } from "../../public";
-import { wgApi } from "./ctype"
+import { wgApi, PeerResultCallback, AsyncCallback, EventCallback, PunchCallback } from "./ctype"
 import path = require("path");
 import { WireGuardAPI as winApi, win_logger } from "./wgWindows";
 import nacl from 'tweetnacl';
-import dns from 'dns/promises';
 import * as net from 'net';
+import * as koffi from 'koffi';
+import { appWindow } from "../../app/window";
 
 function generateCurve25519Key() {
     const keyPair = nacl.box.keyPair();
@@ -21,6 +22,148 @@ function generateCurve25519Key() {
     return { publicKey: nacl.scalarMult.base(pri), privateKey: pri }
 }
 
+// dll中peer_stat结构体大小
+const PEER_STAT_SIZE = 96;
+// dll中room_sample、peer_sample结构体大小
+const ROOM_SAMPLE_SIZE = 48;
+const PEER_SAMPLE_SIZE = 64;
+// dll中keepalive_stat结构体大小
+const KEEPALIVE_STAT_SIZE = 48;
+// dll中nat_profile结构体大小
+const NAT_PROFILE_SIZE = 24;
+// dll中latency_stat结构体大小
+const LATENCY_STAT_SIZE = 72;
+// dll中path_stat结构体大小
+const PATH_STAT_SIZE = 56;
+const REPLICA_STATS_SIZE = 48;
+// dll中tunnel_result结构体大小，status为5时测试仍在进行
+const TUNNEL_RESULT_SIZE = 72;
+const TUNNEL_RUNNING = 5;
+// dll中relay_measure、relay_choice结构体大小
+const RELAY_MEASURE_SIZE = 16;
+const RELAY_CHOICE_SIZE = 16;
+// 中继不可达时的往返时延
+const RELAY_UNREACHABLE = 0xFFFFFFFF;
+
+export type PeerStat = {
+    publicKey: string,
+    txBytes: number,
+    rxBytes: number,
+    // 相对上次查询的速率，字节/秒
+    txRate: number,
+    rxRate: number,
+    // 最后握手unix毫秒时间戳，0表示从未握手
+    lastHandshake: number,
+    endpoint: string,
+}
+
+export type Telemetry = {
+    room: { time: number, txRate: number, rxRate: number, forwarded: number, forwardFailed: number, peers: number }[],
+    // 从未握手时handshakeAge为-1
+    peers: { publicKey: string, time: number, txRate: number, rxRate: number, handshakeAge: number }[],
+}
+
+// NAT分类：mapping/filtering 0未知，1与目的无关，2与地址相关，3与地址端口相关；allocation 0未知，1保持，2顺序，3随机
+export type NatProfile = {
+    mapping: number,
+    filtering: number,
+    allocation: number,
+    // 顺序分配时相邻映射端口差
+    portDelta: number,
+}
+
+export type KeepaliveStat = {
+    publicKey: string,
+    // 当前保活间隔(s)
+    interval: number,
+    // 静默期探测到的失效间隔(s)，0表示尚未测得
+    lifetime: number,
+    // 静默期内已验证可用的最大间隔(s)，0表示尚未验证
+    verified: number,
+    // 处于静默期，只在此期间探测
+    idle: boolean,
+    // 相比固定15s保活少发的包数
+    saved: number,
+}
+
+export type LatencyStat = {
+    publicKey: string,
+    // 最近一到两分钟的往返时延分位数与最大值(us)
+    p50: number,
+    p99: number,
+    max: number,
+    jitter: number,
+    // 最近一次往返时延(us)，0表示尚无应答
+    last: number,
+    // 当前探测间隔(ms)
+    interval: number,
+    // peer空闲，探测已暂停
+    paused: boolean,
+    sent: number,
+    lost: number,
+}
+
+// 本端到单个中继的测量，rtt为-1表示不可达
+export type RelayMeasure = {
+    // 中位与最小往返时延(us)
+    rtt: number,
+    minRtt: number,
+    // 丢包率(‰)
+    loss: number,
+}
+
+export type ReplicaStats = {
+    // 当前是否经复制点发送广播
+    active: boolean,
+    peers: number,
+    // 单份广播速率与配置的上行带宽(bit/s)
+    broadcastBps: number,
+    uplinkBps: number,
+    // 上传给复制点、作为复制点扇出、收到并投递的广播数
+    uploaded: number,
+    fanned: number,
+    delivered: number,
+}
+
+export type TunnelResult = {
+    // 0成功 1对端无应答 2对端忙 3本地套接字或参数错误 4已取消 6未收到对端汇报
+    status: number,
+    // 对端发送、本端接收
+    reverse: boolean,
+    durationMs: number,
+    rateKbps: number,
+    // 接收方测得的吞吐(bit/s)
+    throughputBps: number,
+    sent: number,
+    received: number,
+    // 丢包率(‰)
+    loss: number,
+    reordered: number,
+    // 空载与负载下的往返时延(us)
+    idleRtt: number,
+    loadP50: number,
+    loadP99: number,
+    loadMax: number,
+    jitter: number,
+    pingsSent: number,
+    pingsLost: number,
+}
+
+export type PathStat = {
+    publicKey: string,
+    // 两条路径的平滑往返时延(us)，0表示尚不可测
+    directRtt: number,
+    relayRtt: number,
+    // 平滑丢包率(‰)
+    directLoss: number,
+    relayLoss: number,
+    // 当前是否经由中继
+    relay: boolean,
+    directMeasured: boolean,
+    relayMeasured: boolean,
+    switches: number,
+}
+
 /**
  * 访问dll，通过dll实现对wireguard的管理
  * 无需考虑并发问题，koffi实现一定是串行
@@ -29,6 +172,22 @@ class Wg {
     private lib: wgApi;
     public public_key: Uint8Array;
     private private_key: Uint8Array;
+    // 合并窗口内等待dll回调结果的成员变更，key为 房间名/成员名
+    private pending: Map<string, ((ok: boolean) => void)[]> = new Map();
+    private peer_callback: koffi.IKoffiRegisteredCallback | null = null;
+    // 等待dll工作线程完成的异步命令，key为命令id
+    private async_waiters: Map<number, (resp: { code: number, msg: string }) => void> = new Map();
+    private async_callback: koffi.IKoffiRegisteredCallback;
+    private event_callback: koffi.IKoffiRegisteredCallback;
+    // 打洞引擎结果回调与进行中的连接，key为连接id
+    private punch_callback: koffi.IKoffiRegisteredCallback | null = null;
+    private punch_waiters: Map<number, (ok: boolean, endpoint: string) => void> = new Map();
+    // 按会话快照恢复的房间名，渲染进程重新加入时无需等待适配器创建
+    public restored_rooms: string[] = [];
+    // 恢复房间各自的公钥，重新加入这些房间时沿用，新建的房间使用本次生成的密钥
+    private room_keys: Map<string, Uint8Array> = new Map();
+    // peer统计查询缓冲区，成员超出时扩容
+    private stats_buffer: Buffer = Buffer.alloc(PEER_STAT_SIZE * 16);
     constructor() {
         if (platform == 'win32') {
             this.lib = winApi;
@@ -40,22 +199,137 @@ class Wg {
         this.private_key = Uint8Array.from(data.privateKey);
         this.public_key = Uint8Array.from(data.publicKey);
         Logger.debug(`local wireguard public key: ${Buffer.from(data.publicKey).toString('base64')}`);
+        // 耗时的适配器操作在dll工作线程执行，完成后回调
+        this.async_callback = koffi.register((id: number | bigint, code: number, msg: string) => {
+            const waiter = this.async_waiters.get(Number(id));
+            this.async_waiters.delete(Number(id));
+            waiter?.({ code: code, msg: msg });
+        }, koffi.pointer(AsyncCallback));
+        this.lib.set_async_callback(this.async_callback);
+        // 可选的会话快照，应用或原生模块重启后直接恢复房间与全部成员，恢复的房间沿用各自的密钥
+        if (Configs.get('wgSnapshot')) this.restore_snapshot(path.join(app.getPath('userData'), 'wg.snapshot'));
+        // 可选的成员变更合并窗口，房间成员集中加入时合并为一次适配器配置
+        const window: number | undefined = Configs.get('wgCoalesceMs');
+        if (window && window > 0) {
+            this.peer_callback = koffi.register((room: string, peer: string, code: number) => {
+                const key = `${room}/${peer}`;
+                const waiters = this.pending.get(key);
+                this.pending.delete(key);
+                waiters?.forEach(w => w(code == 0));
+            }, koffi.pointer(PeerResultCallback));
+            this.lib.set_coalesce_window(window, this.peer_callback);
+            Logger.info(`wireguard peer coalesce window: ${window}ms`);
+        }
+        // 握手、endpoint变化等事件由dll推送，转发给渲染进程
+        this.event_callback = koffi.register((type: number, room: string, peer: string, detail: string) => {
+            appWindow?.webContents.send('wg-event', type, room, peer, detail);
+        }, koffi.pointer(EventCallback));
+        this.lib.set_event_callback(this.event_callback, Configs.get('wgEventMs') ?? 0);
+        // 可选的预创建适配器池，启动时后台创建，加入房间时不再等待适配器创建
+        const pool: number | undefined = Configs.get('wgAdapterPool');
+        if (pool && pool > 0) this.lib.set_adapter_pool(pool);
+        // 可选的按需激活，大房间中成员peer在有流量时才写入适配器，空闲后移除
+        const lazy: number | undefined = Configs.get('wgLazyIdleMs');
+        if (lazy && lazy > 0) this.lib.set_lazy_peers(lazy);
+        // 可选的自适应保活，按探测到的NAT映射寿命调整各peer的保活间隔
+        if (Configs.get('wgAdaptiveKeepalive')) this.lib.set_adaptive_keepalive(true);
+        // 可选的隧道时延探测，各成员在虚拟IP的同一端口上互相探测
+        const latency: number | undefined = Configs.get('wgLatencyPort');
+        if (latency && latency > 0) this.lib.set_latency_probe(latency);
+        // 可选的隧道自测应答，各成员在虚拟IP的同一端口上应答其他成员发起的测试
+        const selftest: number | undefined = Configs.get('wgSelfTestPort');
+        if (selftest && selftest > 0) this.lib.set_tunnel_test(selftest);
+        // 可选的直连/中继路径自动切换，登记了中继endpoint的成员按测得的时延与丢包切换路径
+        if (Configs.get('wgPathSwitch')) this.lib.set_path_switching(true);
+        // 可选的握手错峰，房间集中加入时限制同时握手的成员数，避免CPU与中继突发
+        const inflight: number | undefined = Configs.get('wgStaggerInflight');
+        if (inflight && inflight > 0) this.lib.set_handshake_stagger(inflight, Configs.get('wgStaggerJitterMs') ?? 500);
+        // 可选的endpoint缓存，重新遇到同一成员时先尝试上次握手成功的endpoint
+        if (Configs.get('wgEndpointCache')) this.lib.set_endpoint_cache(path.join(app.getPath('userData'), 'wg.endpoints'));
+        // 可选的后台遥测采样，配置输出路径时定期写出prometheus文本供采集端读取
+        const telemetry: number | undefined = Configs.get('wgTelemetryMs');
+        if (telemetry && telemetry > 0) {
+            const dump: string | undefined = Configs.get('wgTelemetryDump');
+            this.lib.set_telemetry(telemetry, dump ?? null, Configs.get('wgTelemetryDumpMs') ?? telemetry);
+        }
+    }
+
+    // 打开会话快照，恢复的房间使用快照中各自的密钥，不影响新建房间的密钥
+    private restore_snapshot(file: string) {
+        const names = Buffer.alloc(4096 * 2);
+        const count = new Int32Array(1);
+        const resp = this.lib.open_snapshot(file, names, 4096, count);
+        if (resp.code != 0) {
+            Logger.info(`打开会话快照失败: ${resp.msg}`);
+            return;
+        }
+        const text = names.toString('utf16le');
+        const end = text.indexOf('\0');
+        this.restored_rooms = count[0] > 0 ? text.substring(0, end < 0 ? text.length : end).split('\n') : [];
+        if (this.restored_rooms.length == 0) return;
+        for (const room of this.restored_rooms) {
+            const pub = Buffer.alloc(32), pri = Buffer.alloc(32);
+            if (this.lib.get_room_key(room, pub, pri).code == 0) this.room_keys.set(room, Uint8Array.from(pub));
+            pri.fill(0);
+        }
+        Logger.info(`按会话快照恢复房间：${this.restored_rooms}`);
+    }
+
+    // 房间使用的公钥，快照恢复的房间为恢复时的公钥，其余为本次生成的公钥
+    public public_key_of(room?: string): string {
+        const key = room === undefined ? undefined : this.room_keys.get(room);
+        return Buffer.from(key ?? this.public_key).toString('base64');
+    }
+
+    // 等待合并窗口内暂存变更的结果
+    private wait_pending(room: string, name: string): Promise<boolean> {
+        return new Promise((resolve) => {
+            const key = `${room}/${name}`;
+            const waiters = this.pending.get(key);
+            if (waiters) waiters.push(resolve);
+            else this.pending.set(key, [resolve]);
+        });
+    }
+
+    // 等待异步命令完成
+    private wait_async(id: number | bigint): Promise<{ code: number, msg: string }> {
+        if (Number(id) == 0) return Promise.resolve({ code: 1, msg: "async submit failed" });
+        return new Promise((resolve) => this.async_waiters.set(Number(id), resolve));
+    }
+
+    /**
+     * 域名endpoint预先在dll工作线程解析进dll的解析缓存，之后add_peer直接传域名
+     * 已缓存的域名不等待，过期条目由dll在后台刷新；ip与空串无需解析
+     */
+    private async warm_host(host: string, port: number): Promise<boolean> {
+        if (host === '' || net.isIP(host) || this.lib.dns_cached(host)) return true;
+        const resp = await this.wait_async(this.lib.resolve_host_async(host, port));
+        return resp.code === 0;
     }
 
     // 创建vlan局域网适配器
     public async create_room(name: string, ip: string, ip_area: string): Promise<boolean> {
-        const resp = this.lib.create_adapter(name, Buffer.from(this.public_key), Buffer.from(this.private_key), ip, ip_area, Configs.wgPort);
+        // 适配器创建与网卡配置耗时较长，在dll工作线程执行，不阻塞主进程
+        const resp = await this.wait_async(this.lib.create_adapter_async(name, Buffer.from(this.public_key),
+            Buffer.from(this.private_key), ip, ip_area, Configs.wgPort));
         if (resp.code != 0) {
             Logger.info(`创建wireguard房间失败: ${resp.code}, ${resp.msg}`);
             return false;
         };
         Logger.info(`创建适配器：${name}`)
+        // 各阶段耗时(us)：适配器、配置、IP与路由、广播转发、总计、是否来自预创建池
+        const timing = Buffer.alloc(24);
+        if (this.lib.get_room_timing(name, timing).code == 0) {
+            Logger.debug(`房间创建耗时(us)：adapter ${timing.readUInt32LE(0)}${timing.readUInt32LE(20) ? "(pooled)" : ""}, ` +
+                `config ${timing.readUInt32LE(4)}, bind ${timing.readUInt32LE(8)}, trans ${timing.readUInt32LE(12)}, total ${timing.readUInt32LE(16)}`);
+        }
         return true;
     }
 
     // 删除vlan局域网适配器
     public async del_room(name: string): Promise<boolean> {
-        const f = this.lib.del_adapter(name).code == 0;
+        const f = (await this.wait_async(this.lib.del_adapter_async(name))).code == 0;
+        if (f) this.room_keys.delete(name);
         Logger.info(`关闭适配器： ${name} ${f ? "成功" : "失败"}`);
         return f;
     }
@@ -63,7 +337,7 @@ class Wg {
      * 
      * @param room 房间名，直接用房间uuid
      * @param name 成员名，直接用成员uuid
-     * @param host 成员地址
+     * @param host 成员地址，ip或域名，域名由dll解析
      * @param port 成员端口
      * @param pub_key 成员wg公钥
      * @param vlan_ip 成员vlan地址
@@ -72,34 +346,133 @@ class Wg {
      */
     public async add_peer(room: string, name: string, host: string, port: number, pub_key: string, vlan_ip: string[],
         vlan_ip_count: number): Promise<boolean> {
-        let target: string;
-        if (net.isIP(host)) {
-            target = host;
-        } else {
-            const ips = await dns.resolve(host);
-            if (ips.length == 0) return false;
-            target = ips[0];
+        if (!await this.warm_host(host, port)) {
+            Logger.info(`成员${name}的endpoint解析失败：${host}`);
+            return false;
+        }
+        const resp = this.lib.add_peer(room, name, host, port, Buffer.from(pub_key, "base64"), vlan_ip, vlan_ip_count);
+        if (resp.code == 2) {
+            const ok = await this.wait_pending(room, name);
+            Logger.debug(`房间${room}合并添加成员：${name} ${ok ? "成功" : "失败"}`);
+            return ok;
         }
-        const resp = this.lib.add_peer(room, name, target, port, Buffer.from(pub_key, "base64"), vlan_ip, vlan_ip_count);
         if (resp.code != 0) {
             Logger.info(resp.msg);
             return false;
         };
-        Logger.debug(`房间${room}添加成员：${name}，vlan：${vlan_ip}，pub：${pub_key}，endpoint: ${target}:${port}`);
+        Logger.debug(`房间${room}添加成员：${name}，vlan：${vlan_ip}，pub：${pub_key}，endpoint: ${host}:${port}`);
         return true;
     }
 
+    /**
+     * 批量添加成员，一次适配器配置
+     * @param room 房间名
+     * @param peers 成员列表，字段含义同add_peer
+     * @returns 每个成员是否添加成功
+     */
+    public async add_peers(room: string, peers: { name: string, host: string, port: number, pub_key: string, vlan_ip: string[] }[]): Promise<boolean[]> {
+        const warmed = await Promise.all(peers.map(p => this.warm_host(p.host, p.port)));
+        const valid = peers.map((p, i) => ({ p, target: p.host })).filter((_, i) => warmed[i]);
+        const results = new Int32Array(valid.length).fill(1);
+        if (valid.length > 0) {
+            const keys = Buffer.concat(valid.map(v => Buffer.from(v.p.pub_key, "base64")));
+            const resp = this.lib.add_peers(room, valid.map(v => v.p.name), valid.map(v => v.target as string),
+                valid.map(v => v.p.port), keys, valid.flatMap(v => v.p.vlan_ip), valid.map(v => v.p.vlan_ip.length),
+                valid.length, results);
+            if (resp.code != 0) Logger.info(`房间${room}批量添加成员失败：${resp.msg}`);
+        }
+        const ok = new Map(valid.map((v, i) => [v.p.name, results[i] == 0]));
+        Logger.debug(`房间${room}批量添加成员：${valid.length}/${peers.length}`);
+        return peers.map(p => ok.get(p.name) ?? false);
+    }
+
     public async del_peer(room: string, name: string): Promise<boolean> {
         Logger.info(`删除房间${room}成员：${name}`);
-        return this.lib.del_peer(room, name).code == 0;
+        const code = this.lib.del_peer(room, name).code;
+        if (code == 2) return await this.wait_pending(room, name);
+        return code == 0;
+    }
+
+    // 批量删除成员，一次适配器配置
+    public async del_peers(room: string, names: string[]): Promise<boolean> {
+        Logger.info(`删除房间${room}成员：${names}`);
+        return this.lib.del_peers(room, names, names.length).code == 0;
+    }
+
+    public async add_trans_ips(room: string, ips: string[]): Promise<boolean> {
+        return this.lib.add_trans_ips(room, ips, ips.length).code == 0;
+    }
+
+    public async del_trans_ips(room: string, ips: string[]): Promise<boolean> {
+        return this.lib.del_trans_ips(room, ips, ips.length).code == 0;
     }
 
-    public async add_trans_ips(ips: string[]): Promise<void> {
-        this.lib.add_trans_ips(ips, ips.length);
+    /**
+     * 设置房间广播复制点，成员较多或上行紧张时广播只上传一份，由复制点扇出
+     * 是否经复制点发送按成员数与配置项wgUplinkKbps判断，上行带宽不做测量
+     * @param room 房间名
+     * @param replicator 复制点虚拟ip，各成员一致，可用select_relay按成员间时延选出；为空关闭
+     */
+    public async set_broadcast_replica(room: string, replicator: string): Promise<boolean> {
+        // 上行带宽(kbit/s)未配置时只按成员数决定
+        const uplink: number | undefined = Configs.get('wgUplinkKbps');
+        const resp = this.lib.set_broadcast_replica(room, replicator, uplink && uplink > 0 ? uplink : 0);
+        if (resp.code != 0) Logger.info(`设置广播复制点失败: ${resp.msg}`);
+        return resp.code == 0;
     }
 
-    public async del_trans_ips(ips: string[]): Promise<void> {
-        this.lib.del_trans_ips(ips, ips.length);
+    public async get_replica_stats(room: string): Promise<ReplicaStats | null> {
+        const b = Buffer.alloc(REPLICA_STATS_SIZE);
+        if (this.lib.get_replica_stats(room, b).code != 0) return null;
+        return {
+            active: b.readUInt32LE(0) != 0,
+            peers: b.readUInt32LE(4),
+            broadcastBps: Number(b.readBigUInt64LE(8)),
+            uplinkBps: Number(b.readBigUInt64LE(16)),
+            uploaded: Number(b.readBigUInt64LE(24)),
+            fanned: Number(b.readBigUInt64LE(32)),
+            delivered: Number(b.readBigUInt64LE(40)),
+        };
+    }
+
+    /**
+     * 向房间成员发起隧道自测，测量吞吐、丢包与空载/负载下的时延，对端需开启wgSelfTestPort
+     * @param room 房间名
+     * @param peer 对端虚拟ip
+     * @param rateKbps 限速(kbit/s)，0为默认20000，上限100000
+     * @param durationMs 负载时长，0为默认3000，上限10000
+     * @param reverse 为true时由对端发送，测量下行
+     */
+    public async run_tunnel_test(room: string, peer: string, rateKbps: number = 0, durationMs: number = 0, reverse: boolean = false): Promise<TunnelResult | null> {
+        const resp = this.lib.start_tunnel_test(room, peer, rateKbps, durationMs, reverse);
+        if (resp.code != 0) {
+            Logger.info(`发起隧道自测失败: ${resp.msg}`);
+            return null;
+        }
+        const b = Buffer.alloc(TUNNEL_RESULT_SIZE);
+        for (;;) {
+            await new Promise(resolve => setTimeout(resolve, 500));
+            if (this.lib.get_tunnel_test(b).code != 0) return null;
+            if (b.readInt32LE(0) != TUNNEL_RUNNING) break;
+        }
+        return {
+            status: b.readInt32LE(0),
+            reverse: b.readUInt32LE(4) != 0,
+            durationMs: b.readUInt32LE(8),
+            rateKbps: b.readUInt32LE(12),
+            throughputBps: Number(b.readBigUInt64LE(16)),
+            sent: b.readUInt32LE(24),
+            received: b.readUInt32LE(28),
+            loss: b.readUInt32LE(32),
+            reordered: b.readUInt32LE(36),
+            idleRtt: b.readUInt32LE(40),
+            loadP50: b.readUInt32LE(44),
+            loadP99: b.readUInt32LE(48),
+            loadMax: b.readUInt32LE(52),
+            jitter: b.readUInt32LE(56),
+            pingsSent: b.readUInt32LE(60),
+            pingsLost: b.readUInt32LE(64),
+        };
     }
 
     public async run_adapter(name: string): Promise<boolean> {
@@ -130,6 +503,253 @@ class Wg {
         return "";
     }
 
+    // 查询房间peer统计，复用缓冲区，按dll中peer_stat的96字节布局解析
+    public async get_peer_stats(name: string): Promise<PeerStat[]> {
+        const count = new Int32Array(1);
+        let resp = this.lib.get_peer_stats(name, this.stats_buffer, this.stats_buffer.length / PEER_STAT_SIZE, count);
+        if (resp.code === 0 && count[0] * PEER_STAT_SIZE > this.stats_buffer.length) {
+            this.stats_buffer = Buffer.alloc(count[0] * PEER_STAT_SIZE);
+            resp = this.lib.get_peer_stats(name, this.stats_buffer, count[0], count);
+        }
+        if (resp.code !== 0) return [];
+        const result: PeerStat[] = [];
+        const n = Math.min(count[0], this.stats_buffer.length / PEER_STAT_SIZE);
+        for (let i = 0; i < n; i++) {
+            const b = this.stats_buffer.subarray(i * PEER_STAT_SIZE, (i + 1) * PEER_STAT_SIZE);
+            const family = b.readUInt16LE(88);
+            const port = b.readUInt16LE(90);
+            let endpoint = "";
+            if (family === 2) {
+                endpoint = `${b[72]}.${b[73]}.${b[74]}.${b[75]}:${port}`;
+            } else if (family === 23) {
+                const parts: string[] = [];
+                for (let j = 0; j < 8; j++) parts.push(b.readUInt16BE(72 + j * 2).toString(16));
+                endpoint = `[${parts.join(':')}]:${port}`;
+            }
+            result.push({
+                publicKey: b.subarray(0, 32).toString('base64'),
+                txBytes: Number(b.readBigUInt64LE(32)),
+                rxBytes: Number(b.readBigUInt64LE(40)),
+                txRate: Number(b.readBigUInt64LE(48)),
+                rxRate: Number(b.readBigUInt64LE(56)),
+                lastHandshake: Number(b.readBigUInt64LE(64)),
+                endpoint: endpoint,
+            });
+        }
+        return result;
+    }
+
+    // 按定长结构体查询dll数组，缓冲区不足时按总数重新查询
+    private query_samples(query: (buffer: Buffer, max: number, count: Int32Array) => { code: number }, size: number): Buffer[] {
+        const count = new Int32Array(1);
+        let buffer = Buffer.alloc(size * 720);
+        let resp = query(buffer, buffer.length / size, count);
+        if (resp.code === 0 && count[0] * size > buffer.length) {
+            buffer = Buffer.alloc(count[0] * size);
+            resp = query(buffer, count[0], count);
+        }
+        if (resp.code !== 0) return [];
+        const n = Math.min(count[0], buffer.length / size);
+        const result: Buffer[] = [];
+        for (let i = 0; i < n; i++) result.push(buffer.subarray(i * size, (i + 1) * size));
+        return result;
+    }
+
+    // 查询房间最近minutes分钟的遥测历史
+    public async get_telemetry(name: string, minutes: number): Promise<Telemetry> {
+        const room = this.query_samples((b, max, count) => this.lib.get_room_telemetry(name, minutes, b, max, count), ROOM_SAMPLE_SIZE)
+            .map(b => ({
+                time: Number(b.readBigUInt64LE(0)),
+                txRate: Number(b.readBigUInt64LE(8)),
+                rxRate: Number(b.readBigUInt64LE(16)),
+                forwarded: Number(b.readBigUInt64LE(24)),
+                forwardFailed: Number(b.readBigUInt64LE(32)),
+                peers: b.readUInt32LE(40),
+            }));
+        const peers = this.query_samples((b, max, count) => this.lib.get_peer_telemetry(name, minutes, b, max, count), PEER_SAMPLE_SIZE)
+            .map(b => {
+                const age = b.readBigUInt64LE(56);
+                return {
+                    publicKey: b.subarray(0, 32).toString('base64'),
+                    time: Number(b.readBigUInt64LE(32)),
+                    txRate: Number(b.readBigUInt64LE(40)),
+                    rxRate: Number(b.readBigUInt64LE(48)),
+                    handshakeAge: age === 0xFFFFFFFFFFFFFFFFn ? -1 : Number(age),
+                };
+            });
+        return { room: room, peers: peers };
+    }
+
+    // 查询房间各peer的保活间隔与节省的保活包数
+    public async get_keepalive_stats(name: string): Promise<KeepaliveStat[]> {
+        return this.query_samples((b, max, count) => this.lib.get_keepalive_stats(name, b, max, count), KEEPALIVE_STAT_SIZE)
+            .map(b => ({
+                publicKey: b.subarray(0, 32).toString('base64'),
+                interval: b.readUInt16LE(32),
+                lifetime: b.readUInt16LE(34),
+                verified: b.readUInt16LE(36),
+                idle: b.readUInt16LE(38) != 0,
+                saved: Number(b.readBigUInt64LE(40)),
+            }));
+    }
+
+    // 查询房间各peer的隧道往返时延分位数、抖动与丢包
+    public async get_latency_stats(name: string): Promise<LatencyStat[]> {
+        return this.query_samples((b, max, count) => this.lib.get_latency_stats(name, b, max, count), LATENCY_STAT_SIZE)
+            .map(b => ({
+                publicKey: b.subarray(0, 32).toString('base64'),
+                p50: b.readUInt32LE(32),
+                p99: b.readUInt32LE(36),
+                max: b.readUInt32LE(40),
+                jitter: b.readUInt32LE(44),
+                last: b.readUInt32LE(48),
+                interval: b.readUInt16LE(52),
+                paused: b.readUInt16LE(54) != 0,
+                sent: Number(b.readBigUInt64LE(56)),
+                lost: Number(b.readBigUInt64LE(64)),
+            }));
+    }
+
+    /**
+     * 登记成员的直连与中继endpoint，开启wgPathSwitch时按测量结果自动切换
+     * @param relay 原样转发报文到成员wg端口的中继地址，空串表示没有中继路径
+     */
+    public async set_peer_paths(room: string, name: string, direct: string, direct_port: number, relay: string, relay_port: number): Promise<boolean> {
+        const resp = this.lib.set_peer_paths(room, name, direct, direct_port, relay, relay_port);
+        if (resp.code != 0) {
+            Logger.info(resp.msg);
+            return false;
+        }
+        return true;
+    }
+
+    // 查询房间各peer直连与中继路径的测量结果与当前路径
+    public async get_path_stats(name: string): Promise<PathStat[]> {
+        return this.query_samples((b, max, count) => this.lib.get_path_stats(name, b, max, count), PATH_STAT_SIZE)
+            .map(b => ({
+                publicKey: b.subarray(0, 32).toString('base64'),
+                directRtt: b.readUInt32LE(32),
+                relayRtt: b.readUInt32LE(36),
+                directLoss: b.readUInt16LE(40),
+                relayLoss: b.readUInt16LE(42),
+                relay: b.readUInt8(44) != 0,
+                directMeasured: (b.readUInt8(45) & 1) != 0,
+                relayMeasured: (b.readUInt8(45) & 2) != 0,
+                switches: b.readUInt32LE(48),
+            }));
+    }
+
+    private punch_register(): koffi.IKoffiRegisteredCallback {
+        if (this.punch_callback === null) {
+            this.punch_callback = koffi.register((id: number | bigint, code: number, endpoint: string, elapsed: number) => {
+                const waiter = this.punch_waiters.get(Number(id));
+                this.punch_waiters.delete(Number(id));
+                waiter?.(code === 0, endpoint);
+            }, koffi.pointer(PunchCallback));
+        }
+        return this.punch_callback;
+    }
+
+    // 启动dll打洞引擎，替代js侧udp直连确认
+    public punch_start(port: number): boolean {
+        const resp = this.lib.punch_start(port, this.punch_register());
+        if (resp.code !== 0) Logger.error(`punch engine start failed: ${resp.msg}`);
+        return resp.code === 0;
+    }
+
+    // 在wireguard监听端口上启动打洞引擎，打通的映射即隧道使用的映射，启动后punch_connect改用该引擎
+    public probe_start(port: number): boolean {
+        const resp = this.lib.probe_start(port, this.punch_register());
+        if (resp.code !== 0) Logger.warn(`probe engine start failed: ${resp.msg}`);
+        return resp.code === 0;
+    }
+
+    // 并发检查所有候选地址，返回打通的对方地址，超时返回null
+    // uid为双方一致的连接id，对方只应答同一会话的检查；空串表示向反射器学习本端nat映射地址
+    public punch_connect(uid: string, candidates: string[], timeout_ms: number, port_delta: number = 0): Promise<string | null> {
+        return new Promise(resolve => {
+            const id = Number(this.lib.punch_connect(uid, candidates.join(';'), timeout_ms, port_delta));
+            if (id === 0) return resolve(null);
+            this.punch_waiters.set(id, (ok, endpoint) => resolve(ok ? endpoint : null));
+        });
+    }
+
+    // 探测本端NAT类型，reflectors为;分隔的主反射器、同IP不同端口反射器、不同IP反射器，结果按网络缓存
+    public async classify_nat(reflectors: string): Promise<NatProfile | null> {
+        const resp = await this.wait_async(this.lib.classify_nat_async(reflectors));
+        if (resp.code !== 0) return null;
+        return this.nat_profile();
+    }
+
+    // 当前网络下缓存的NAT分类，未测得返回null
+    public nat_profile(): NatProfile | null {
+        const b = Buffer.alloc(NAT_PROFILE_SIZE);
+        if (this.lib.get_nat_profile(b).code !== 0) return null;
+        return { mapping: b.readUInt8(16), filtering: b.readUInt8(17), allocation: b.readUInt8(18), portDelta: b.readInt32LE(20) };
+    }
+
+    // 按对方NAT分类选择穿透策略：0直连，1端口预测，2只用中继
+    public traversal_strategy(remote: NatProfile): number {
+        const b = Buffer.alloc(NAT_PROFILE_SIZE);
+        b.writeUInt8(remote.mapping, 16);
+        b.writeUInt8(remote.filtering, 17);
+        b.writeUInt8(remote.allocation, 18);
+        b.writeInt32LE(remote.portDelta, 20);
+        return this.lib.get_traversal_strategy(b);
+    }
+
+    /**
+     * 测量本端到各候选中继的往返时延与丢包，结果顺序与candidates一致，全部不可达返回null
+     * @param candidates 中继探测地址ip:port，需应答打洞检查
+     */
+    public async measure_relays(candidates: string[]): Promise<RelayMeasure[] | null> {
+        const resp = await this.wait_async(this.lib.measure_relays_async(candidates.join(';')));
+        if (resp.code !== 0) return null;
+        return this.query_samples((b, max, count) => this.lib.get_relay_measures(b, max, count), RELAY_MEASURE_SIZE)
+            .map(b => {
+                const rtt = b.readUInt32LE(0);
+                return {
+                    rtt: rtt === RELAY_UNREACHABLE ? -1 : rtt,
+                    minRtt: rtt === RELAY_UNREACHABLE ? -1 : b.readUInt32LE(4),
+                    loss: b.readUInt16LE(8),
+                };
+            });
+    }
+
+    /**
+     * 按房间全部成员的中继测量选择中继，成员加入后用新矩阵与当前选择重新评估
+     * @param matrix 每个成员一行，每行为该成员measure_relays的结果，候选顺序需一致
+     * @param minimax true使最差成员对时延最小，false使成员对时延之和最小
+     * @param current 当前中继下标，-1未选择
+     * @returns 选中的中继下标，-1表示没有全部成员可达的中继
+     */
+    public select_relay(matrix: RelayMeasure[][], minimax: boolean, current: number = -1): number {
+        const relays = matrix.length > 0 ? matrix[0].length : 0;
+        if (relays === 0 || matrix.some(row => row.length !== relays)) return -1;
+        const rtt = new Uint32Array(matrix.length * relays);
+        const loss = new Uint16Array(matrix.length * relays);
+        matrix.forEach((row, m) => row.forEach((r, i) => {
+            rtt[m * relays + i] = r.rtt < 0 ? RELAY_UNREACHABLE : r.rtt;
+            loss[m * relays + i] = r.loss;
+        }));
+        const out = Buffer.alloc(RELAY_CHOICE_SIZE);
+        const resp = this.lib.get_relay_choice(rtt, loss, matrix.length, relays, minimax ? 0 : 1, current, out);
+        if (resp.code !== 0) {
+            Logger.info(resp.msg);
+            return -1;
+        }
+        return out.readInt32LE(0);
+    }
+
+    // 本端候选地址，局域网候选带h:前缀
+    public punch_candidates(): string[] {
+        const buffer = Buffer.alloc(4096);
+        if (this.lib.punch_candidates(buffer, buffer.length).code !== 0) return [];
+        const end = buffer.indexOf(0);
+        const text = buffer.subarray(0, end < 0 ? buffer.length : end).toString('utf-8');
+        return text.length > 0 ? text.split(';') : [];
+    }
+
     // 释放dll
     public dispose() {
         this.lib.clear_all();
@@ -151,16 +771,44 @@ export async function handleIPC(type_: string, ...args: any[]): Promise<any> {
             return WgHandler.pause_adapter(args[0]);
         case "addPeer":
             return WgHandler.add_peer(args[0], args[1], args[2], args[3], args[4], args[5], args[6]);
+        case "addPeers":
+            return WgHandler.add_peers(args[0], args[1]);
         case "delPeer":
             return WgHandler.del_peer(args[0], args[1]);
+        case "delPeers":
+            return WgHandler.del_peers(args[0], args[1]);
         case "publicKey":
-            return Buffer.from(WgHandler.public_key).toString('base64');
+            return WgHandler.public_key_of(args[0]);
         case "addTransIps":
-            return WgHandler.add_trans_ips(args[0]);
+            return WgHandler.add_trans_ips(args[0], args[1]);
         case "delTransIps":
-            return WgHandler.del_trans_ips(args[0]);
+            return WgHandler.del_trans_ips(args[0], args[1]);
         case "getAdapterConfig":
             return WgHandler.get_adapter_config(args[0]);
+        case "getPeerStats":
+            return WgHandler.get_peer_stats(args[0]);
+        case "getTelemetry":
+            return WgHandler.get_telemetry(args[0], args[1]);
+        case "restoredRooms":
+            return WgHandler.restored_rooms;
+        case "getKeepaliveStats":
+            return WgHandler.get_keepalive_stats(args[0]);
+        case "getLatencyStats":
+            return WgHandler.get_latency_stats(args[0]);
+        case "setPeerPaths":
+            return WgHandler.set_peer_paths(args[0], args[1], args[2], args[3], args[4], args[5]);
+        case "getPathStats":
+            return WgHandler.get_path_stats(args[0]);
+        case "measureRelays":
+            return WgHandler.measure_relays(args[0]);
+        case "selectRelay":
+            return WgHandler.select_relay(args[0], args[1], args[2]);
+        case "setBroadcastReplica":
+            return WgHandler.set_broadcast_replica(args[0], args[1]);
+        case "getReplicaStats":
+            return WgHandler.get_replica_stats(args[0]);
+        case "runTunnelTest":
+            return WgHandler.run_tunnel_test(args[0], args[1], args[2], args[3], args[4]);
         default:
             throw new Error(`Unknown IPC type: ${type_}`);
     }
@@ -2,6 +2,7 @@ import { Logger, Configs } from "./public";
 import dgram = require('dgram')
 import { AsyncMap } from "../shared/asynchronous";
 import {appWindow} from "./app/window";
+import { WgHandler, NatProfile } from "./extern/wireguard/wireguard";
 
 enum UdpMsgType {
     turn = "turn",
@@ -22,22 +23,42 @@ class UdpHandler {
     private soc: dgram.Socket;
     private slaveSoc: dgram.Socket;
     private readonly port: number;
+    // 使用dll打洞引擎时并发检查全部候选地址，优先在wireguard监听端口上探测，失败时由引擎监听udp端口
+    private readonly native: boolean;
     // 存储连接任务和连接超时控制
     private connecting: AsyncMap<string, { task: NodeJS.Timeout, timeout: NodeJS.Timeout }> = new AsyncMap();
 
     constructor() {
         this.port = Configs.udpPort;
+        this.native = Configs.get('nativePunch') === true &&
+            (WgHandler.probe_start(Configs.wgPort) || WgHandler.punch_start(this.port));
         this.soc = dgram.createSocket('udp4');
         this.slaveSoc = dgram.createSocket('udp4');
         this.soc.on('message', (msg, info) => {return this.listener(msg, info)});
         this.slaveSoc.on("message", (msg: Buffer, info: dgram.RemoteInfo) => {
             const message = msg.toString('utf-8').split('\r\n');
-            // TODO: nat类型确认逻辑
+            // nat类型确认由dll分类器完成（nativePunch + natReflectors），此处只保留旧协议
             if (message.length !== 3 || message[0] !== UdpMsgType.turn.toString()) return;
 
         });
-        this.soc.bind(this.port);
+        if (!this.native) this.soc.bind(this.port);
         this.slaveSoc.bind(this.port + 1);
+        // 启动时按当前网络探测nat类型，同一网络下的结果由dll缓存
+        const reflectors: string | undefined = Configs.get('natReflectors');
+        if (this.native && reflectors) {
+            this.classify(reflectors).then();
+            // 向主反射器发一次检查，学到探测端口的nat映射地址作为本端候选
+            WgHandler.punch_connect('', [reflectors.split(';')[0]], 2000).then();
+        }
+    }
+
+    // 探测本端nat类型，需经服务器转发给对方作为connect的remote参数
+    public async classify(reflectors?: string): Promise<NatProfile | null> {
+        if (!this.native) return null;
+        const r = reflectors ?? Configs.get('natReflectors');
+        const profile = r ? await WgHandler.classify_nat(r) : WgHandler.nat_profile();
+        if (profile) Logger.info(`nat mapping:${profile.mapping} filtering:${profile.filtering} allocation:${profile.allocation}`);
+        return profile;
     }
 
     // udp监听处理函数
@@ -68,8 +89,30 @@ class UdpHandler {
         }
     }
 
-    // 10秒内持续向目标地址发送udp信息
-    public async connect(host: string, port: number, uid: string, timeout_s: number): Promise<void> {
+    // 本端候选地址（局域网、IPv6与已学到的NAT映射），需经服务器转发给对方作为connect的extra参数
+    public candidates(): string[] {
+        return this.native ? WgHandler.punch_candidates() : [];
+    }
+
+    // 10秒内持续向目标地址发送udp信息，使用打洞引擎时同时检查extra中的候选地址
+    // remote为对方的nat分类：直连不可能成功时立即返回失败，对方为顺序分配的对称型nat时预测端口
+    // uid为本次连接结果的回调标识，session为双方一致的打洞会话id，缺省时沿用uid
+    public async connect(host: string, port: number, uid: string, timeout_s: number, extra: string[] = [], remote?: NatProfile, session?: string): Promise<void> {
+        if (this.native) {
+            const strategy = remote ? WgHandler.traversal_strategy(remote) : 0;
+            if (strategy === 2) {
+                Logger.info(`skip direct connect of ${host}:${port}, nat traversal impossible`);
+                appWindow.webContents.send(`udp-connect-${uid}`, false);
+                return;
+            }
+            const target = host.includes(':') ? `[${host}]:${port}` : `${host}:${port}`;
+            const delta = strategy === 1 ? remote!.portDelta : 0;
+            WgHandler.punch_connect(session || uid, [target, ...extra], timeout_s * 1000, delta).then(endpoint => {
+                Logger.info(endpoint ? `UDP connect success of ${endpoint}` : `udp connect timeout of ${host}:${port}`);
+                appWindow.webContents.send(`udp-connect-${uid}`, endpoint !== null, endpoint);
+            });
+            return;
+        }
         // 持续发起连接请求，直到收到回复
         const task = setInterval(() => {
             this.soc.send(udpPayload(UdpMsgType.connectPeer, uid, ""), port, host, async (error, bytes) => {
@@ -92,12 +135,16 @@ class UdpHandler {
 
 export const udpHandle = new UdpHandler();
 
-export type NatMethod = "connect";
+export type NatMethod = "connect" | "candidates" | "natProfile";
 
 
 export async function handleIPC(method: NatMethod, ...args: any[]): Promise<any> {
     switch (method) {
         case "connect":
-            return await udpHandle.connect(args[0], args[1], args[2], args[3]);
+            return await udpHandle.connect(args[0], args[1], args[2], args[3], args[4], args[5], args[6]);
+        case "candidates":
+            return udpHandle.candidates();
+        case "natProfile":
+            return await udpHandle.classify();
     }
 }
\ No newline at end of file
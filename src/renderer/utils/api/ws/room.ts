@@ -2,7 +2,7 @@ import {wsRequest, wsHandleFunc} from '../../conn';
 import {getConfig, wireguardFunc} from '../../publicType';
 
 export async function roomIn(server: string, roomId: string, password?: string, handle?: wsHandleFunc) {
-	let param = [roomId, await wireguardFunc.getPublicKey(), await getConfig("udpPort")];
+	let param = [roomId, await wireguardFunc.getPublicKey(roomId), await getConfig("udpPort")];
 	if (password !== undefined && password !== "") param.push(password);
     await wsRequest(server, 'room.in', param, handle);
 }
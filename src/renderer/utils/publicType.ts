@@ -84,14 +84,25 @@ export async function setConfig(name: string, value: any): Promise<void> {
 // udp相关接口
 export const udpFunc = {
     // 尝试udp通信，等待回调结果
-    connect: async (ip: string, port: number, timeout_s: number, cb?: (flag: boolean) => void): Promise<void> => {
+    // session为双方一致的连接id（由信令中的房间与成员id得出），开启nativePunch时对方只应答同一会话的检查
+    // extra为对方的其他候选地址，开启nativePunch时与ip:port并发检查，endpoint为打通的地址
+    // remoteNat为对方的nat分类，直连不可能成功时立即回调失败
+    connect: async (ip: string, port: number, session: string, timeout_s: number, cb?: (flag: boolean, endpoint?: string) => void, extra: string[] = [], remoteNat?: any): Promise<void> => {
         const uid = uuid();
         if (cb) {
-            ipcOnce(`udp-connect-${uid}`, (flag: boolean) => {
-                cb(flag);
+            ipcOnce(`udp-connect-${uid}`, (flag: boolean, endpoint?: string) => {
+                cb(flag, endpoint);
             });
         }
-        await ipcInvoke('udp', 'connect', ip, port, uid, timeout_s);
+        await ipcInvoke('udp', 'connect', ip, port, uid, timeout_s, extra, remoteNat, session);
+    },
+    // 本端nat分类，同一网络下复用缓存结果，需开启nativePunch并配置natReflectors
+    natProfile: async (): Promise<any> => {
+        return await ipcInvoke('udp', 'natProfile');
+    },
+    // 本端候选地址，需开启nativePunch
+    candidates: async (): Promise<string[]> => {
+        return await ipcInvoke('udp', 'candidates');
     },
     // TODO: udp直连心跳失败后，添加回调函数
 }
@@ -109,7 +120,7 @@ export async function request(url: string, method: string, headers: Record<strin
 }
 
 export const wireguardFunc = {
-    // 创建wireguard房间，ip是本机vlan地址，ip_area是vlan网段
+    // 创建wireguard房间，ip是本机vlan地址，ip_area是vlan网段，可带前缀长度如 10.20.0.0/16
     createRoom: async (roomName: string, ip: string, ip_area: string): Promise<boolean> => { return await ipcInvoke("wireguard", "createRoom", roomName, ip, ip_area); },
     // 删除wireguard房间
     delRoom: async (roomName: string): Promise<boolean> => { return await ipcInvoke("wireguard", "delRoom", roomName); },
@@ -121,13 +132,43 @@ export const wireguardFunc = {
     addPeer: async (roomName: string, peerName: string, ip: string, port: number,
         pub_key: string, vlan_ip: string[], vlan_ip_count: number
     ): Promise<boolean> => { return await ipcInvoke("wireguard", "addPeer", roomName, peerName, ip, port, pub_key, vlan_ip, vlan_ip_count); },
+    // 批量添加peer，一次适配器配置，返回每个成员是否成功
+    addPeers: async (roomName: string, peers: { name: string, host: string, port: number, pub_key: string, vlan_ip: string[] }[]
+    ): Promise<boolean[]> => { return await ipcInvoke("wireguard", "addPeers", roomName, peers); },
+    // 批量删除peer
+    delPeers: async (roomName: string, peerNames: string[]): Promise<boolean> => { return await ipcInvoke("wireguard", "delPeers", roomName, peerNames); },
     // 删除peer
     delPeer: async (roomName: string, peerName: string): Promise<boolean> => { return await ipcInvoke("wireguard", "delPeer", roomName, peerName); },
-    // 获取base64编码格式公钥
-    getPublicKey: async (): Promise<string> => { return await ipcInvoke("wireguard", "publicKey"); },
-    addTransIps: async(ips: string[]): Promise<void> => {await ipcInvoke("wireguard", "addTransIps", ips);},
-    delTransIps: async(ips: string[]): Promise<void> => {await ipcInvoke("wireguard", "delTransIps", ips);},
-    getAdapterConfig: async(roomName: string): Promise<string> =>{ return await ipcInvoke("wireguard","getAdapterConfig", roomName);}
+    // 获取base64编码格式公钥，传入房间名时返回该房间使用的公钥（快照恢复的房间沿用恢复时的公钥）
+    getPublicKey: async (roomId?: string): Promise<string> => { return await ipcInvoke("wireguard", "publicKey", roomId); },
+    // 房间广播转发成员
+    addTransIps: async(roomName: string, ips: string[]): Promise<void> => {await ipcInvoke("wireguard", "addTransIps", roomName, ips);},
+    delTransIps: async(roomName: string, ips: string[]): Promise<void> => {await ipcInvoke("wireguard", "delTransIps", roomName, ips);},
+    // 房间广播复制点（成员虚拟ip，各成员一致），为空关闭；上行带宽在配置wgUplinkKbps中设置
+    setBroadcastReplica: async(roomName: string, replicator: string): Promise<boolean> => { return await ipcInvoke("wireguard", "setBroadcastReplica", roomName, replicator);},
+    // 房间广播复制状态，bps为bit/s
+    getReplicaStats: async(roomName: string): Promise<{ active: boolean, peers: number, broadcastBps: number, uplinkBps: number, uploaded: number, fanned: number, delivered: number } | null> =>{ return await ipcInvoke("wireguard","getReplicaStats", roomName);},
+    // 向房间成员(虚拟ip)发起隧道自测，速率kbit/s与时长ms为0取默认值，reverse测量下行；对端需在配置中设置wgSelfTestPort
+    runTunnelTest: async(roomName: string, peer: string, rateKbps: number, durationMs: number, reverse: boolean): Promise<{ status: number, reverse: boolean, durationMs: number, rateKbps: number, throughputBps: number, sent: number, received: number, loss: number, reordered: number, idleRtt: number, loadP50: number, loadP99: number, loadMax: number, jitter: number, pingsSent: number, pingsLost: number } | null> =>{ return await ipcInvoke("wireguard","runTunnelTest", roomName, peer, rateKbps, durationMs, reverse);},
+    getAdapterConfig: async(roomName: string): Promise<string> =>{ return await ipcInvoke("wireguard","getAdapterConfig", roomName);},
+    // 房间最近minutes分钟的遥测历史，需在配置中开启wgTelemetryMs
+    getTelemetry: async(roomName: string, minutes: number): Promise<any> =>{ return await ipcInvoke("wireguard","getTelemetry", roomName, minutes);},
+    // 房间peer统计，速率为相对上次查询的字节/秒，lastHandshake为unix毫秒
+    getPeerStats: async(roomName: string): Promise<{ publicKey: string, txBytes: number, rxBytes: number, txRate: number, rxRate: number, lastHandshake: number, endpoint: string }[]> =>{ return await ipcInvoke("wireguard","getPeerStats", roomName);},
+    // 按会话快照恢复的房间名，需在配置中开启wgSnapshot
+    restoredRooms: async(): Promise<string[]> =>{ return await ipcInvoke("wireguard","restoredRooms");},
+    // 房间各peer的自适应保活状态，需在配置中开启wgAdaptiveKeepalive
+    getKeepaliveStats: async(roomName: string): Promise<{ publicKey: string, interval: number, lifetime: number, verified: number, idle: boolean, saved: number }[]> =>{ return await ipcInvoke("wireguard","getKeepaliveStats", roomName);},
+    // 房间各peer的隧道时延(us)与丢包，需在配置中设置wgLatencyPort
+    getLatencyStats: async(roomName: string): Promise<{ publicKey: string, p50: number, p99: number, max: number, jitter: number, last: number, interval: number, paused: boolean, sent: number, lost: number }[]> =>{ return await ipcInvoke("wireguard","getLatencyStats", roomName);},
+    // 登记成员的直连与中继endpoint，relay为空表示没有中继路径，需在配置中开启wgPathSwitch
+    setPeerPaths: async(roomName: string, peerName: string, direct: string, directPort: number, relay: string, relayPort: number): Promise<boolean> =>{ return await ipcInvoke("wireguard","setPeerPaths", roomName, peerName, direct, directPort, relay, relayPort);},
+    // 房间各peer直连与中继路径的时延(us)、丢包(‰)与当前路径
+    getPathStats: async(roomName: string): Promise<{ publicKey: string, directRtt: number, relayRtt: number, directLoss: number, relayLoss: number, relay: boolean, directMeasured: boolean, relayMeasured: boolean, switches: number }[]> =>{ return await ipcInvoke("wireguard","getPathStats", roomName);},
+    // 本端到各候选中继的往返时延(us，-1不可达)与丢包(‰)，候选为应答打洞检查的ip:port，全部不可达返回null
+    measureRelays: async(candidates: string[]): Promise<{ rtt: number, minRtt: number, loss: number }[] | null> =>{ return await ipcInvoke("wireguard","measureRelays", candidates);},
+    // 按全部成员的测量（每个成员一行measureRelays结果）选择中继，返回下标，-1表示没有全部成员可达的中继
+    selectRelay: async(matrix: { rtt: number, minRtt: number, loss: number }[][], minimax: boolean, current: number): Promise<number> =>{ return await ipcInvoke("wireguard","selectRelay", matrix, minimax, current);}
 }
 
 // =========== Error Code ===========
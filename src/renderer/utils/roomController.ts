@@ -1,19 +1,35 @@
 import { RWLock } from '../../shared/asynchronous';
 import { Connection } from './conn';
-import { wsResp, wireguardFunc, server, udpFunc, log } from './publicType';
+import { wsResp, wireguardFunc, server, udpFunc, log, ipcOn } from './publicType';
 import { ref, Ref, shallowRef, triggerRef } from 'vue';
 import { Services } from './stores';
 
+// dll推送的wireguard事件类型
+export const WgEvent = {
+    handshake: 1,
+    handshakeLost: 2,
+    endpointRoamed: 3,
+    adapterState: 4,
+    transporterError: 5,
+} as const;
+
 class RoomController {
     private AllRoom: Map<string, Room> = new Map();
 
+    public constructor() {
+        // wireguard事件按房间分发，代替轮询适配器配置
+        ipcOn('wg-event', (type: number, room: string, peer: string, detail: string) => {
+            this.AllRoom.get(room)?.onWgEvent(type, peer, detail);
+        });
+    }
+
     // 创建房间时，必须已获取vlanIP，创建房间自动添加中继服务器
     public async createRoom(conn: Connection, id: string, svr: string, vlan: number, link: string): Promise<Room | null> {
         const s = Services().get(svr);
         if (!s || !s.wgInfo) return null;
         if (!await wireguardFunc.createRoom(id,
             `${s.wgInfo.vlanIp[0]}.${s.wgInfo.vlanIp[1]}.${vlan >> 8}.${vlan & 0xff}`,
-            `${s.wgInfo.vlanIp[0]}.${s.wgInfo.vlanIp[1]}.0.0`) ||
+            `${s.wgInfo.vlanIp[0]}.${s.wgInfo.vlanIp[1]}.0.0/16`) ||
             // 添加中继服务器peer
             !await wireguardFunc.addPeer(id, s.wgInfo.publicKey, s.host, s.wgInfo.listenPort, s.wgInfo.publicKey,
                 [`${s.wgInfo.vlanIp[0]}.${s.wgInfo.vlanIp[1]}.0.1/16`], 1) ||
@@ -85,6 +101,9 @@ export class Room {
     private readonly port: number = 0;
     private msgCallback: ((msg: message) => void) | null = null;
     public readonly vlanPrefix: string = "";
+    // 等待合并下发的peer与本批的下发结果
+    private peerBatch: Map<string, { name: string, host: string, port: number, pub_key: string, vlan_ip: string[] }> | null = null;
+    private peerFlush: Promise<Map<string, boolean>> = Promise.resolve(new Map());
 
     public constructor(conn: Connection, id: string, svr: server, link: string) {
         if (!svr.wgInfo || !svr.token) throw new Error("error svr");
@@ -125,6 +144,26 @@ export class Room {
         triggerRef(this.members);
     }
 
+    // 处理dll推送的peer事件，直连中的成员握手成功即显示已直连，已直连的成员握手失效显示直连失败
+    public onWgEvent(type: number, peer: string, detail: string) {
+        if (type !== WgEvent.handshake && type !== WgEvent.handshakeLost) return;
+        for (const [uid, m] of this.members.value) {
+            if (m.publicKey !== peer || uid === this.selfUuid) continue;
+            if (type === WgEvent.handshake && m.directFlag === 0) {
+                this.modifyConnFlagLocked(uid, 1);
+            } else if (type === WgEvent.handshakeLost && m.directFlag === 1) {
+                this.modifyConnFlagLocked(uid, 2);
+                log("warning", `wireguard handshake lost: ${m.name} ${detail}`);
+            }
+            return;
+        }
+    }
+
+    // 与成员的打洞会话id：由服务器下发的房间id与双方成员id得出，双方计算结果一致
+    private punchSession(peerUuid: string): string {
+        return [this.roomId, ...[this.selfUuid, peerUuid].sort()].join('/');
+    }
+
     // 检查wg直连，失败后回退
     private async checkDirectConn(uuid: string, name: string, ip: string, port: number, timeout_s: number) {
         // endpoint 校验：peer 已回退为中继（wgIp 为空 或 endpoint 指向中继服务器）时，
@@ -135,7 +174,7 @@ export class Room {
             return;
         }
         // wg直连后立刻进行udp连接尝试
-        await udpFunc.connect(ip, port, timeout_s, async (f: boolean) => {
+        await udpFunc.connect(ip, port, this.punchSession(uuid), timeout_s, async (f: boolean) => {
 
             if (!this.members.value.has(uuid)) return;
             await this.modifyConnFlagLocked(uuid, f ? 1 : 2);
@@ -153,34 +192,49 @@ export class Room {
         });
     }
 
-    private async addMember(m: member) {
-        // 禁止重复添加，防止ws和wg管理混乱
-        if (this.members.value.has(m.uuid)) return;
-        this.members.value.set(m.uuid, m);
-        triggerRef(this.members);
-        if (m.uuid === this.selfUuid) return;
-        // 具有真实公网地址进行直连尝试，失败退回转发模式
-        const vlan = this.vlanPrefix + `.${m.vlan >> 8}.${m.vlan & 0xff}`;
-        await wireguardFunc.addTransIps([vlan]);
-        if (m.wgIp !== "" && m.wgPort !== 0) {
-            await this.modifyConnFlagLocked(m.uuid, 0);
-            const ok = await wireguardFunc.addPeer(this.roomId, m.uuid, m.wgIp, m.wgPort, m.publicKey,
-                [vlan], 1);
-            // endpoint 校验：addPeer 成功（endpoint 已生效）才进行直连验证；
-            // 直连测试后台并行进行，不阻塞"加入房间"消息
-            if (ok) {
-                this.checkDirectConn(m.uuid, m.name, vlan, m.udpPort, 10)
-                    .catch(e => log("error", String(e)));
-            }
-        };
-        this.checkInMsg([{ fromUuid: "", text: `${m.name}加入房间`, timestamp: Date.now(), fromUsername: "" }]);
+    // 写入成员peer：同一轮事件循环内的调用合并为一次addPeers，一次适配器配置；同名成员以最后一次为准
+    private async putPeer(peer: { name: string, host: string, port: number, pub_key: string, vlan_ip: string[] }): Promise<boolean> {
+        if (!this.peerBatch) {
+            const batch = new Map<string, typeof peer>();
+            this.peerBatch = batch;
+            this.peerFlush = new Promise(resolve => setTimeout(resolve, 0)).then(async () => {
+                this.peerBatch = null;
+                const peers = [...batch.values()];
+                const results = await wireguardFunc.addPeers(this.roomId, peers);
+                return new Map(peers.map((p, i) => [p.name, results[i] ?? false]));
+            });
+        }
+        this.peerBatch.set(peer.name, peer);
+        return (await this.peerFlush).get(peer.name) ?? false;
     }
 
     public async addMembers(m: member[]) {
-        if (m.length === 0) return;
-        // 并行加入成员：前一个成员的直连测试(最长10s)不再阻塞后续成员
-        // 单个成员失败不影响其他成员加入
-        await Promise.all(m.map(mem => this.addMember(mem).catch(e => log("error", String(e)))));
+        // 禁止重复添加，防止ws和wg管理混乱
+        const fresh = m.filter((mem, i) => !this.members.value.has(mem.uuid) && m.findIndex(o => o.uuid === mem.uuid) === i);
+        if (fresh.length === 0) return;
+        for (const mem of fresh) this.members.value.set(mem.uuid, mem);
+        triggerRef(this.members);
+        const peers = fresh.filter(mem => mem.uuid !== this.selfUuid);
+        if (peers.length === 0) return;
+        const vlanOf = (mem: member) => this.vlanPrefix + `.${mem.vlan >> 8}.${mem.vlan & 0xff}`;
+        try {
+            await wireguardFunc.addTransIps(this.roomId, peers.map(vlanOf));
+            // 具有真实公网地址进行直连尝试，失败退回转发模式；所有成员合并为一次addPeers，单个成员失败不影响其他成员
+            const direct = peers.filter(mem => mem.wgIp !== "" && mem.wgPort !== 0);
+            for (const mem of direct) await this.modifyConnFlagLocked(mem.uuid, 0);
+            await Promise.all(direct.map(async mem => {
+                const ok = await this.putPeer({ name: mem.uuid, host: mem.wgIp, port: mem.wgPort, pub_key: mem.publicKey, vlan_ip: [vlanOf(mem)] });
+                // endpoint 校验：addPeer 成功（endpoint 已生效）才进行直连验证；
+                // 直连测试后台并行进行，不阻塞"加入房间"消息
+                if (ok) {
+                    this.checkDirectConn(mem.uuid, mem.name, vlanOf(mem), mem.udpPort, 10)
+                        .catch(e => log("error", String(e)));
+                }
+            }));
+        } catch (e) {
+            log("error", String(e));
+        }
+        this.checkInMsg(peers.map(mem => ({ fromUuid: "", text: `${mem.name}加入房间`, timestamp: Date.now(), fromUsername: "" })));
     }
 
     public async delMember(userUUid: string, force: boolean = false) {
@@ -191,7 +245,7 @@ export class Room {
         triggerRef(this.members);
         // if (!await wireguardFunc.pauseAdapter(this.roomId)) return;
         await wireguardFunc.delPeer(this.roomId, userUUid);
-        await wireguardFunc.delTransIps([`${this.vlanPrefix}.${mem.vlan >> 8}.${mem.vlan & 0xff}`]);
+        await wireguardFunc.delTransIps(this.roomId, [`${this.vlanPrefix}.${mem.vlan >> 8}.${mem.vlan & 0xff}`]);
         // await wireguardFunc.runAdapter(this.roomId);
     }
 
@@ -224,7 +278,8 @@ export class Room {
         if (!peer) return;
         peer.wgIp = ip;
         peer.wgPort = port;
-        const ok = await wireguardFunc.addPeer(this.roomId, peer.uuid, ip, port, peer.publicKey, [`${this.vlanPrefix}.${peer.vlan >> 8}.${peer.vlan & 0xff}/32`], 1);
+        // 同时到达的多个endpoint更新合并为一次addPeers
+        const ok = await this.putPeer({ name: peer.uuid, host: ip, port, pub_key: peer.publicKey, vlan_ip: [`${this.vlanPrefix}.${peer.vlan >> 8}.${peer.vlan & 0xff}/32`] });
         // endpoint 校验：addPeer 成功（endpoint 已更新为直连地址）才进行直连验证
         if (ok) {
             await this.checkDirectConn(peer_uuid, peer.name, this.vlanPrefix + `.${peer.vlan >> 8}.${peer.vlan & 0xff}`, peer.udpPort, 10);